@@ -0,0 +1,470 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "analysis/analyzer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <thread>
+
+#include "mcts/search.h"
+#include "neural/cache.h"
+#include "neural/factory.h"
+#include "neural/loader.h"
+#include "neural/shared_batch.h"
+#include "utils/exception.h"
+#include "utils/mutex.h"
+#include "utils/optionsparser.h"
+#include "utils/string.h"
+
+namespace lczero {
+
+namespace {
+const char* kWeightsStr = "Network weights file path";
+const char* kNnBackendStr = "NN backend to use";
+const char* kNnBackendOptionsStr = "NN backend parameters";
+const char* kInputStr = "File with a FEN or EPD position per line, - for stdin";
+const char* kOutputStr = "File to write results to, - for stdout";
+const char* kFormatStr = "Format of results";
+const char* kThreadsStr = "Number of worker threads";
+const char* kPositionsPerThreadStr = "Number of positions searched by every "
+                                     "thread at once";
+const char* kVisitsStr = "Number of visits per position";
+const char* kNnCacheSizeStr = "NNCache size";
+
+const char* kAutoDiscover = "<autodiscover>";
+
+// Position to analyze, and its place in the input.
+struct PositionLine {
+  int64_t index = 0;
+  std::string fen;
+  // The "id" operation of EPD, if any.
+  std::string id;
+};
+
+// Returns whether @str is a non-empty string of digits.
+bool IsNumber(const std::string& str) {
+  return !str.empty() &&
+         std::all_of(str.begin(), str.end(), [](unsigned char c) {
+           return std::isdigit(c);
+         });
+}
+
+// Fills fen and id of @position from @line. EPD lines have the four fields
+// of the board, followed by operations such as 'id "name";'. Move counters
+// come from the hmvc and fmvn operations then.
+void ParsePositionLine(const std::string& line, PositionLine* position) {
+  const auto fields = StrSplitAtWhitespace(line);
+  if (fields.size() < 4 ||
+      (fields.size() >= 6 && IsNumber(fields[4]) && IsNumber(fields[5]))) {
+    position->fen = line;
+    return;
+  }
+  std::string halfmoves = "0";
+  std::string fullmoves = "1";
+  // Operations start after the fourth field.
+  std::string::size_type pos = 0;
+  for (int i = 0; i < 4; ++i) {
+    pos = line.find_first_not_of(" \t", pos);
+    pos = line.find_first_of(" \t", pos);
+  }
+  const std::string operations =
+      pos == std::string::npos ? "" : line.substr(pos);
+  for (const auto& operation : StrSplit(operations, ";")) {
+    const std::string op = Trim(operation);
+    const auto space = op.find(' ');
+    if (space == std::string::npos) continue;
+    const std::string opcode = op.substr(0, space);
+    std::string operand = Trim(op.substr(space + 1));
+    if (operand.size() >= 2 && operand.front() == '"' &&
+        operand.back() == '"') {
+      operand = operand.substr(1, operand.size() - 2);
+    }
+    if (opcode == "id") position->id = operand;
+    if (opcode == "hmvc" && IsNumber(operand)) halfmoves = operand;
+    if (opcode == "fmvn" && IsNumber(operand)) fullmoves = operand;
+  }
+  position->fen = fields[0] + " " + fields[1] + " " + fields[2] + " " +
+                  fields[3] + " " + halfmoves + " " + fullmoves;
+}
+
+std::string JsonQuote(const std::string& str) {
+  std::ostringstream oss;
+  oss << '"';
+  for (const char c : str) {
+    if (c == '"' || c == '\\') {
+      oss << '\\' << c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      oss << "\\u" << std::hex << std::setw(4) << std::setfill('0')
+          << static_cast<int>(c) << std::dec;
+    } else {
+      oss << c;
+    }
+  }
+  oss << '"';
+  return oss.str();
+}
+
+std::string CsvQuote(const std::string& str) {
+  if (str.find_first_of(",\"\n") == std::string::npos) return str;
+  std::string result = "\"";
+  for (const char c : str) {
+    if (c == '"') result += '"';
+    result += c;
+  }
+  return result + '"';
+}
+
+// Outcome of the search of a position.
+struct Result {
+  PositionLine position;
+  std::string error;
+  Move best_move;
+  Move ponder;
+  optional<int> score;
+  float q = 0.0f;
+  int64_t visits = 0;
+  int depth = 0;
+  int seldepth = 0;
+  std::vector<Move> pv;
+
+  std::string AsJson() const {
+    std::ostringstream oss;
+    oss << "{\"index\":" << position.index
+        << ",\"fen\":" << JsonQuote(position.fen);
+    if (!position.id.empty()) oss << ",\"id\":" << JsonQuote(position.id);
+    if (!error.empty()) {
+      oss << ",\"error\":" << JsonQuote(error) << "}";
+      return oss.str();
+    }
+    oss << ",\"bestmove\":"
+        << (best_move ? JsonQuote(best_move.as_string()) : "null");
+    if (ponder) oss << ",\"ponder\":" << JsonQuote(ponder.as_string());
+    if (score) oss << ",\"score_cp\":" << *score;
+    oss << ",\"q\":" << q << ",\"visits\":" << visits << ",\"depth\":" << depth
+        << ",\"seldepth\":" << seldepth << ",\"pv\":[";
+    for (size_t i = 0; i < pv.size(); ++i) {
+      oss << (i ? "," : "") << JsonQuote(pv[i].as_string());
+    }
+    oss << "]}";
+    return oss.str();
+  }
+
+  static std::string CsvHeader() {
+    return "index,fen,id,bestmove,ponder,score_cp,q,visits,depth,seldepth,pv,"
+           "error";
+  }
+
+  std::string AsCsv() const {
+    std::ostringstream oss;
+    oss << position.index << "," << CsvQuote(position.fen) << ","
+        << CsvQuote(position.id) << ",";
+    if (error.empty()) {
+      std::vector<std::string> moves;
+      for (const Move move : pv) moves.push_back(move.as_string());
+      oss << (best_move ? best_move.as_string() : "") << ","
+          << (ponder ? ponder.as_string() : "") << ","
+          << (score ? std::to_string(*score) : "") << "," << q << ","
+          << visits << "," << depth << "," << seldepth << ","
+          << StrJoin(moves) << ",";
+    } else {
+      oss << ",,,,,,,," << CsvQuote(error);
+    }
+    return oss.str();
+  }
+};
+
+// Reads positions for all threads.
+class PositionReader {
+ public:
+  explicit PositionReader(std::istream* in) : in_(in) {}
+
+  // Returns false at the end of the input.
+  bool Next(PositionLine* position) {
+    Mutex::Lock lock(mutex_);
+    std::string line;
+    while (std::getline(*in_, line)) {
+      line = Trim(line);
+      if (line.empty() || line[0] == '#') continue;
+      position->index = count_++;
+      position->id.clear();
+      ParsePositionLine(line, position);
+      return true;
+    }
+    return false;
+  }
+
+ private:
+  Mutex mutex_{"analyzer input"};
+  std::istream* const in_ GUARDED_BY(mutex_);
+  int64_t count_ GUARDED_BY(mutex_) = 0;
+};
+
+// Writes results in the order of the input as they come from all threads.
+class ResultWriter {
+ public:
+  ResultWriter(std::ostream* out, bool csv) : out_(out), csv_(csv) {
+    if (csv_) *out_ << Result::CsvHeader() << std::endl;
+  }
+
+  void Write(const Result& result) {
+    const std::string line = csv_ ? result.AsCsv() : result.AsJson();
+    Mutex::Lock lock(mutex_);
+    pending_.emplace(result.position.index, line);
+    bool written = false;
+    for (auto iter = pending_.begin();
+         iter != pending_.end() && iter->first == next_index_;
+         iter = pending_.erase(iter)) {
+      *out_ << iter->second << '\n';
+      ++next_index_;
+      written = true;
+    }
+    if (written) out_->flush();
+  }
+
+  int64_t GetWritten() {
+    Mutex::Lock lock(mutex_);
+    return next_index_;
+  }
+
+ private:
+  Mutex mutex_{"analyzer output"};
+  std::ostream* const out_ GUARDED_BY(mutex_);
+  const bool csv_;
+  // Results waiting for those of earlier positions, by index.
+  std::map<int64_t, std::string> pending_ GUARDED_BY(mutex_);
+  int64_t next_index_ GUARDED_BY(mutex_) = 0;
+};
+
+// Search of one position, of the many which a thread runs at once.
+struct Slot {
+  Result result;
+  NodeTree tree;
+  std::unique_ptr<Search> search;
+  std::unique_ptr<SearchWorker> worker;
+};
+
+class AnalyzerWorker {
+ public:
+  AnalyzerWorker(const OptionsDict& options, std::shared_ptr<Network> network,
+                 NNCache* cache, PositionReader* reader, ResultWriter* writer)
+      : options_(options),
+        network_(std::move(network)),
+        cache_(cache),
+        reader_(reader),
+        writer_(writer) {
+    limits_.visits = options.Get<int>(kVisitsStr);
+  }
+
+  void Run(int positions) {
+    SharedBatchNetworks networks;
+    Network* const network = networks.Get(network_);
+    std::vector<Slot> slots(positions);
+    bool more_positions = true;
+
+    while (true) {
+      // Starts searches of next positions in place of finished ones.
+      bool active = false;
+      for (auto& slot : slots) {
+        while (!slot.worker && more_positions) {
+          if (!reader_->Next(&slot.result.position)) {
+            more_positions = false;
+          } else {
+            StartSearch(&slot, network);
+          }
+        }
+        if (slot.worker) active = true;
+      }
+      if (!active) break;
+
+      // Gathers minibatches of all searches, computes them at once, and
+      // backs them up.
+      for (auto& slot : slots) {
+        if (!slot.worker) continue;
+        slot.worker->InitializeIteration(slot.worker->NewComputation());
+        slot.worker->GatherMinibatch();
+        slot.worker->MaybePrefetchIntoCache();
+      }
+      networks.ComputeBatches();
+      for (auto& slot : slots) {
+        if (!slot.worker) continue;
+        SearchWorker* const worker = slot.worker.get();
+        worker->RunNNComputation();
+        worker->FetchMinibatchResults();
+        worker->DoBackupUpdate();
+        worker->UpdateCounters();
+        if (worker->IsSearchActive()) continue;
+        // The worker holds locks of the search's NNCache, so it's destroyed
+        // before the search is.
+        slot.worker.reset();
+        slot.result.q = slot.search->GetBestEval();
+        slot.result.visits = slot.tree.GetCurrentHead()->GetN();
+        slot.search.reset();
+        writer_->Write(slot.result);
+      }
+    }
+  }
+
+ private:
+  // Starts the search of the position of @slot, or writes its result right
+  // away if there's nothing to search.
+  void StartSearch(Slot* slot, Network* network) {
+    Result& result = slot->result;
+    const PositionLine position = result.position;
+    result = Result();
+    result.position = position;
+    try {
+      slot->tree.ResetToPosition(position.fen, {});
+    } catch (const Exception& ex) {
+      result.error = ex.what();
+      writer_->Write(result);
+      return;
+    }
+    const ChessBoard& board = slot->tree.HeadPosition().GetBoard();
+    if (board.GenerateLegalMoves().empty()) {
+      // Checkmate or stalemate.
+      result.q = board.IsUnderCheck() ? -1.0f : 0.0f;
+      writer_->Write(result);
+      return;
+    }
+    slot->search = std::make_unique<Search>(
+        slot->tree, network,
+        [&result](const BestMoveInfo& info) {
+          result.best_move = info.bestmove;
+          result.ponder = info.ponder;
+        },
+        [&result](const ThinkingInfo& info) {
+          // Skip comments, like stage times.
+          if (info.pv.empty()) return;
+          result.score = info.score;
+          result.depth = info.depth;
+          result.seldepth = info.seldepth;
+          result.pv = info.pv;
+        },
+        limits_, options_, cache_, nullptr);
+    slot->worker = slot->search->NewWorker();
+  }
+
+  const OptionsDict& options_;
+  const std::shared_ptr<Network> network_;
+  NNCache* const cache_;
+  PositionReader* const reader_;
+  ResultWriter* const writer_;
+  SearchLimits limits_;
+};
+
+}  // namespace
+
+void Analyzer::Run() {
+  OptionsParser options;
+  options.Add<StringOption>(kWeightsStr, "weights", 'w') = kAutoDiscover;
+  const auto backends = NetworkFactory::Get()->GetBackendsList();
+  options.Add<ChoiceOption>(kNnBackendStr, backends, "backend") =
+      backends.empty() ? "<none>" : backends[0];
+  options.Add<StringOption>(kNnBackendOptionsStr, "backend-opts");
+  options.Add<StringOption>(kInputStr, "input") = "-";
+  options.Add<StringOption>(kOutputStr, "output") = "-";
+  options.Add<ChoiceOption>(kFormatStr, std::vector<std::string>{"json", "csv"},
+                            "format") = "json";
+  options.Add<IntOption>(kThreadsStr, 1, 128, "threads", 't') = 1;
+  options.Add<IntOption>(kPositionsPerThreadStr, 1, 65536,
+                         "positions-per-thread") = 64;
+  options.Add<IntOption>(kVisitsStr, 1, 999999999, "visits", 'v') = 800;
+  options.Add<IntOption>(kNnCacheSizeStr, 0, 999999999, "nncache") = 2000000;
+  Search::PopulateUciParams(&options);
+  // Same defaults as the engine has, with smaller minibatches as many
+  // searches fill the batches together.
+  auto defaults = options.GetMutableDefaultsOptions();
+  defaults->Set<int>(Search::kMiniBatchSizeStr, 32);
+  defaults->Set<float>(Search::kFpuReductionStr, 0.9f);
+  defaults->Set<float>(Search::kCpuctStr, 3.4f);
+  defaults->Set<float>(Search::kPolicySoftmaxTempStr, 2.2f);
+  defaults->Set<int>(Search::kAllowedNodeCollisionsStr, 32);
+  defaults->Set<float>(Search::kAggressiveTimePruningStr, 0.0f);
+  if (!options.ProcessAllFlags()) return;
+  const OptionsDict& dict = options.GetOptionsDict();
+
+  std::ifstream input_file;
+  std::istream* input = &std::cin;
+  const std::string input_name = dict.Get<std::string>(kInputStr);
+  if (input_name != "-") {
+    input_file.open(input_name);
+    if (!input_file) throw Exception("Unable to open " + input_name);
+    input = &input_file;
+  }
+  std::ofstream output_file;
+  std::ostream* output = &std::cout;
+  const std::string output_name = dict.Get<std::string>(kOutputStr);
+  if (output_name != "-") {
+    output_file.open(output_name);
+    if (!output_file) throw Exception("Unable to write " + output_name);
+    output = &output_file;
+  }
+
+  std::string path = dict.Get<std::string>(kWeightsStr);
+  if (path == kAutoDiscover) path = DiscoverWeightsFile();
+  const auto weights =
+      std::make_shared<const Weights>(LoadWeightsFromFile(path));
+  const OptionsDict network_options = OptionsDict::FromString(
+      dict.Get<std::string>(kNnBackendOptionsStr), &dict);
+  std::shared_ptr<Network> network = NetworkFactory::Get()->Create(
+      dict.Get<std::string>(kNnBackendStr), weights, network_options);
+  const int threads = dict.Get<int>(kThreadsStr);
+  const int positions = dict.Get<int>(kPositionsPerThreadStr);
+  network->Warmup(dict.Get<int>(Search::kMiniBatchSizeStr));
+
+  NNCache cache(dict.Get<int>(kNnCacheSizeStr));
+  PositionReader reader(input);
+  ResultWriter writer(output, dict.Get<std::string>(kFormatStr) == "csv");
+
+  const auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> workers;
+  for (int i = 0; i < threads; ++i) {
+    workers.emplace_back([&, positions]() {
+      AnalyzerWorker(dict, network, &cache, &reader, &writer).Run(positions);
+    });
+  }
+  for (auto& worker : workers) worker.join();
+  const double seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+
+  const NNCacheStats stats = cache.GetStats();
+  const int64_t analyzed = writer.GetWritten();
+  std::cerr << "Analyzed " << analyzed << " positions in " << std::fixed
+            << std::setprecision(1) << seconds << "s, "
+            << analyzed / std::max(seconds, 1e-3) << " positions/s, cache hits "
+            << 100.0 * stats.hits / std::max<uint64_t>(stats.lookups, 1) << "%."
+            << std::endl;
+}
+
+}  // namespace lczero
@@ -0,0 +1,224 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "benchmark/backendbench.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include "chess/board.h"
+#include "chess/position.h"
+#include "neural/encoder.h"
+#include "neural/factory.h"
+#include "neural/loader.h"
+#include "utils/exception.h"
+#include "utils/optionsparser.h"
+#include "utils/random.h"
+#include "utils/string.h"
+
+namespace lczero {
+
+namespace {
+const char* kWeightsStr = "Network weights file path";
+const char* kBackendsStr = "Comma separated list of backends to measure";
+const char* kNnBackendOptionsStr = "NN backend parameters";
+const char* kBatchSizesStr = "Comma separated list of batch sizes";
+const char* kBatchesPerSizeStr = "Number of batches computed per batch size";
+
+const char* kAutoDiscover = "<autodiscover>";
+const char* kAllBackends = "<all>";
+
+// Backends which compute with other backends, or elsewhere, and measure
+// nothing new on their own.
+const char* kWrappingBackends[] = {"check", "demux", "multiplexing",
+                                   "remote"};
+
+// Number of different positions fed to backends.
+const int kNumPositions = 1024;
+
+// Encodes positions of random games from the starting position. Backends may
+// take shortcuts on empty or repeated planes, so inputs are as in searches.
+std::vector<InputPlanes> GeneratePositions() {
+  std::vector<InputPlanes> result;
+  PositionHistory history;
+  while (static_cast<int>(result.size()) < kNumPositions) {
+    ChessBoard board;
+    board.SetFromFen(ChessBoard::kStartingFen);
+    history.Reset(board, 0, 1);
+    while (static_cast<int>(result.size()) < kNumPositions &&
+           history.ComputeGameResult() == GameResult::UNDECIDED) {
+      result.push_back(EncodePositionForNN(history, kMoveHistory));
+      const MoveList moves = history.Last().GetBoard().GenerateLegalMoves();
+      history.Append(
+          moves[Random::Get().GetInt(0, static_cast<int>(moves.size()) - 1)]);
+    }
+  }
+  return result;
+}
+
+// Returns the largest resident memory of the process so far, in megabytes.
+// Memory of devices (GPU) is not included.
+double GetPeakMemoryMb() {
+#ifdef _WIN32
+  PROCESS_MEMORY_COUNTERS counters;
+  if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters,
+                            sizeof(counters))) {
+    return 0;
+  }
+  return counters.PeakWorkingSetSize / 1048576.0;
+#else
+  rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+  // Bytes on macOS, kilobytes elsewhere.
+  return usage.ru_maxrss / 1048576.0;
+#else
+  return usage.ru_maxrss / 1024.0;
+#endif
+#endif
+}
+
+// Returns the value at @fraction of sorted @values.
+double Percentile(const std::vector<double>& values, double fraction) {
+  const int idx = static_cast<int>(fraction * (values.size() - 1) + 0.5);
+  return values[idx];
+}
+
+// Computes @batches batches of @batch_size samples and prints throughput and
+// latency of ComputeBlocking().
+void MeasureBatchSize(const std::string& backend, Network* network,
+                      const std::vector<InputPlanes>& positions,
+                      int batch_size, int batches) {
+  std::vector<double> latencies_ms;
+  int next_position = 0;
+  // The first batch is not measured.
+  for (int i = -1; i < batches; ++i) {
+    auto computation = network->NewComputation();
+    for (int j = 0; j < batch_size; ++j) {
+      computation->AddInput(positions[next_position]);
+      next_position = (next_position + 1) % positions.size();
+    }
+    const auto start = std::chrono::steady_clock::now();
+    computation->ComputeBlocking();
+    const auto time = std::chrono::steady_clock::now() - start;
+    if (i < 0) continue;
+    latencies_ms.push_back(
+        std::chrono::duration<double, std::milli>(time).count());
+  }
+
+  double total_ms = 0;
+  for (const double latency : latencies_ms) total_ms += latency;
+  std::sort(latencies_ms.begin(), latencies_ms.end());
+  std::cout << std::fixed << std::setprecision(3) << "backendbench backend "
+            << backend << " batch_size " << batch_size << " batches "
+            << batches << " pos_per_sec " << std::setprecision(1)
+            << batch_size * batches * 1000.0 / std::max(total_ms, 1e-6)
+            << std::setprecision(3) << " p50_ms "
+            << Percentile(latencies_ms, 0.5) << " p99_ms "
+            << Percentile(latencies_ms, 0.99) << " max_ms "
+            << latencies_ms.back() << std::setprecision(1) << " peak_rss_mb "
+            << GetPeakMemoryMb() << std::endl;
+}
+}  // namespace
+
+void BackendBenchmark::Run() {
+  OptionsParser options;
+  options.Add<StringOption>(kWeightsStr, "weights", 'w') = kAutoDiscover;
+  options.Add<StringOption>(kBackendsStr, "backends") = kAllBackends;
+  options.Add<StringOption>(kNnBackendOptionsStr, "backend-opts");
+  options.Add<StringOption>(kBatchSizesStr, "batch-sizes") =
+      "1,8,16,32,64,128,256";
+  options.Add<IntOption>(kBatchesPerSizeStr, 1, 100000, "batches") = 50;
+  if (!options.ProcessAllFlags()) return;
+  const OptionsDict& dict = options.GetOptionsDict();
+
+  std::vector<std::string> backends;
+  const std::string backends_str = dict.Get<std::string>(kBackendsStr);
+  if (backends_str == kAllBackends) {
+    for (const auto& name : NetworkFactory::Get()->GetBackendsList()) {
+      if (std::find(std::begin(kWrappingBackends), std::end(kWrappingBackends),
+                    name) == std::end(kWrappingBackends)) {
+        backends.push_back(name);
+      }
+    }
+  } else {
+    backends = StrSplit(backends_str, ",");
+  }
+
+  std::vector<int> batch_sizes;
+  for (const auto& size : StrSplit(dict.Get<std::string>(kBatchSizesStr),
+                                   ",")) {
+    int value = 0;
+    try {
+      value = std::stoi(size);
+    } catch (std::exception&) {
+    }
+    if (value <= 0) throw Exception("Invalid batch size: " + size);
+    batch_sizes.push_back(value);
+  }
+  const int batches = dict.Get<int>(kBatchesPerSizeStr);
+
+  // Weights are loaded once for all backends.
+  std::string path = dict.Get<std::string>(kWeightsStr);
+  if (path == kAutoDiscover) path = DiscoverWeightsFile();
+  const auto weights =
+      std::make_shared<const Weights>(LoadWeightsFromFile(path));
+  const OptionsDict network_options = OptionsDict::FromString(
+      dict.Get<std::string>(kNnBackendOptionsStr), &dict);
+  const std::vector<InputPlanes> positions = GeneratePositions();
+
+  for (const auto& backend : backends) {
+    std::unique_ptr<Network> network;
+    try {
+      network = NetworkFactory::Get()->Create(backend, weights,
+                                              network_options);
+      network->Warmup(*std::max_element(batch_sizes.begin(),
+                                        batch_sizes.end()));
+    } catch (Exception& ex) {
+      // Backends may be built in and still not work on this machine.
+      std::cout << "backendbench backend " << backend << " skipped "
+                << ex.what() << std::endl;
+      continue;
+    }
+    for (const int batch_size : batch_sizes) {
+      MeasureBatchSize(backend, network.get(), positions, batch_size,
+                       batches);
+    }
+  }
+}
+
+}  // namespace lczero
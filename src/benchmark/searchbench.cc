@@ -0,0 +1,261 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+
+#include "benchmark/searchbench.h"
+
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+#include "mcts/search.h"
+#include "neural/cache.h"
+#include "neural/factory.h"
+#include "neural/loader.h"
+#include "utils/exception.h"
+#include "utils/optionsparser.h"
+
+namespace lczero {
+
+namespace {
+const char* kWeightsStr = "Network weights file path";
+const char* kNnBackendStr = "NN backend to use";
+const char* kNnBackendOptionsStr = "NN backend parameters";
+const char* kThreadsStr = "Number of worker threads";
+const char* kVisitsStr = "Number of visits per position";
+const char* kNnCacheSizeStr = "NNCache size";
+
+const char* kAutoDiscover = "<autodiscover>";
+
+// Middlegame and endgame positions of varied complexity. The suite must stay
+// the same for results to be comparable between versions.
+const char* kPositions[] = {
+    "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+    "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 10",
+    "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 11",
+    "4rrk1/pp1n3p/3q2pQ/2p1pb2/2PP4/2P3N1/P2B2PP/4RRK1 b - - 7 19",
+    "rq3rk1/ppp2ppp/1bnpb3/3N2B1/3NP3/7P/PPPQ1PP1/2KR3R w - - 7 14",
+    "r1bq1r1k/1pp1n1pp/1p1p4/4p2Q/4Pp2/1BNP4/PPP2PPP/3R1RK1 w - - 2 14",
+    "r3r1k1/2p2ppp/p1p1bn2/8/1q2P3/2NPQN2/PPP3PP/R4RK1 b - - 2 15",
+    "r1bbk1nr/pp3p1p/2n5/1N4p1/2Np1B2/8/PPP2PPP/2KR1B1R w kq - 0 13",
+    "r1bq1rk1/ppp1nppp/4n3/3p3Q/3P4/1BP1B3/PP1N2PP/R4RK1 w - - 1 16",
+    "4r1k1/r1q2ppp/ppp2n2/4P3/5Rb1/1N1BQ3/PPP3PP/R5K1 w - - 1 17",
+    "2rqkb1r/ppp2p2/2npb1p1/1N1Nn2p/2P1PP2/8/PP2B1PP/R1BQK2R b KQ - 0 11",
+    "6k1/6p1/6Pp/ppp5/3pn2P/1P3K2/1PP2P2/3N4 b - - 0 1",
+    "3b4/5kp1/1p1p1p1p/pP1PpP1P/P1P1P3/3KN3/8/8 w - - 0 1",
+    "8/8/8/8/5kp1/P7/8/1K1N4 w - - 0 1",
+};
+
+// Counts batches which searches compute and the samples in them.
+struct BatchCounters {
+  std::atomic<int64_t> batches{0};
+  std::atomic<int64_t> samples{0};
+};
+
+class CountingComputation : public NetworkComputation {
+ public:
+  CountingComputation(std::unique_ptr<NetworkComputation> computation,
+                      BatchCounters* counters)
+      : computation_(std::move(computation)), counters_(counters) {}
+
+  InputPlanesRef AddInputInPlace() override {
+    return computation_->AddInputInPlace();
+  }
+  InputPlanesRef AddInputForMoves(const std::uint16_t* move_ids,
+                                  int count) override {
+    return computation_->AddInputForMoves(move_ids, count);
+  }
+  void SetPriority(int priority) override {
+    computation_->SetPriority(priority);
+  }
+  void SetPolicySoftmaxTemp(float temp) override {
+    computation_->SetPolicySoftmaxTemp(temp);
+  }
+  void ComputeBlocking() override {
+    ++counters_->batches;
+    counters_->samples += computation_->GetBatchSize();
+    computation_->ComputeBlocking();
+  }
+  int GetBatchSize() const override { return computation_->GetBatchSize(); }
+  float GetQVal(int sample) const override {
+    return computation_->GetQVal(sample);
+  }
+  float GetPVal(int sample, int move_id) const override {
+    return computation_->GetPVal(sample, move_id);
+  }
+  void GetPVals(int sample, const std::uint16_t* move_ids, int count,
+                float* out) const override {
+    computation_->GetPVals(sample, move_ids, count, out);
+  }
+
+ private:
+  const std::unique_ptr<NetworkComputation> computation_;
+  BatchCounters* const counters_;
+};
+
+class CountingNetwork : public Network {
+ public:
+  explicit CountingNetwork(std::unique_ptr<Network> network)
+      : network_(std::move(network)) {}
+
+  std::unique_ptr<NetworkComputation> NewComputation() override {
+    return std::make_unique<CountingComputation>(network_->NewComputation(),
+                                                 &counters_);
+  }
+  int GetPreferredBatchStep() const override {
+    return network_->GetPreferredBatchStep();
+  }
+  bool SupportsPolicySoftmaxTemp() const override {
+    return network_->SupportsPolicySoftmaxTemp();
+  }
+  void Warmup(int max_batch) override { network_->Warmup(max_batch); }
+
+  int64_t GetBatches() const { return counters_.batches; }
+  int64_t GetSamples() const { return counters_.samples; }
+
+ private:
+  const std::unique_ptr<Network> network_;
+  BatchCounters counters_;
+};
+
+// Totals of searches, printed as one line.
+struct Results {
+  int64_t visits = 0;
+  int64_t time_us = 0;
+  uint64_t cache_lookups = 0;
+  uint64_t cache_hits = 0;
+  int64_t batches = 0;
+  int64_t samples = 0;
+
+  void Add(const Results& other) {
+    visits += other.visits;
+    time_us += other.time_us;
+    cache_lookups += other.cache_lookups;
+    cache_hits += other.cache_hits;
+    batches += other.batches;
+    samples += other.samples;
+  }
+
+  std::string AsString() const {
+    std::ostringstream oss;
+    oss << std::fixed << std::setprecision(1) << "visits " << visits
+        << " time_ms " << time_us / 1000 << " nps "
+        << visits * 1000000 / std::max<int64_t>(time_us, 1) << " cache_hits "
+        << cache_hits << " cache_lookups " << cache_lookups
+        << " cache_hit_pct "
+        << 100.0 * cache_hits / std::max<uint64_t>(cache_lookups, 1)
+        << " batches " << batches << " samples " << samples
+        << " avg_batch_size "
+        << static_cast<double>(samples) / std::max<int64_t>(batches, 1);
+    return oss.str();
+  }
+};
+}  // namespace
+
+void Benchmark::Run() {
+  OptionsParser options;
+  options.Add<StringOption>(kWeightsStr, "weights", 'w') = kAutoDiscover;
+  const auto backends = NetworkFactory::Get()->GetBackendsList();
+  options.Add<ChoiceOption>(kNnBackendStr, backends, "backend") =
+      backends.empty() ? "<none>" : backends[0];
+  options.Add<StringOption>(kNnBackendOptionsStr, "backend-opts");
+  options.Add<IntOption>(kThreadsStr, 1, 128, "threads", 't') = 2;
+  options.Add<IntOption>(kVisitsStr, 1, 999999999, "visits", 'v') = 10000;
+  options.Add<IntOption>(kNnCacheSizeStr, 0, 999999999, "nncache") = 200000;
+  Search::PopulateUciParams(&options);
+  // Same defaults as the engine has, except that searches run until the
+  // visits limit.
+  auto defaults = options.GetMutableDefaultsOptions();
+  defaults->Set<int>(Search::kMiniBatchSizeStr, 256);
+  defaults->Set<float>(Search::kFpuReductionStr, 0.9f);
+  defaults->Set<float>(Search::kCpuctStr, 3.4f);
+  defaults->Set<float>(Search::kPolicySoftmaxTempStr, 2.2f);
+  defaults->Set<int>(Search::kAllowedNodeCollisionsStr, 32);
+  defaults->Set<float>(Search::kAggressiveTimePruningStr, 0.0f);
+  if (!options.ProcessAllFlags()) return;
+  const OptionsDict& dict = options.GetOptionsDict();
+
+  std::string path = dict.Get<std::string>(kWeightsStr);
+  if (path == kAutoDiscover) path = DiscoverWeightsFile();
+  const auto weights =
+      std::make_shared<const Weights>(LoadWeightsFromFile(path));
+  const OptionsDict network_options = OptionsDict::FromString(
+      dict.Get<std::string>(kNnBackendOptionsStr), &dict);
+  CountingNetwork network(NetworkFactory::Get()->Create(
+      dict.Get<std::string>(kNnBackendStr), weights, network_options));
+  network.Warmup(dict.Get<int>(Search::kMiniBatchSizeStr));
+
+  const int threads = dict.Get<int>(kThreadsStr);
+  SearchLimits limits;
+  limits.visits = dict.Get<int>(kVisitsStr);
+  NNCache cache(dict.Get<int>(kNnCacheSizeStr));
+
+  Results total;
+  int position_idx = 0;
+  for (const char* fen : kPositions) {
+    ++position_idx;
+    // Every search starts from scratch.
+    cache.Clear();
+    NodeTree tree;
+    tree.ResetToPosition(fen, {});
+    const NNCacheStats cache_before = cache.GetStats();
+    const int64_t batches_before = network.GetBatches();
+    const int64_t samples_before = network.GetSamples();
+    Move best_move;
+    const auto start = std::chrono::steady_clock::now();
+    {
+      Search search(tree, &network,
+                    [&best_move](const BestMoveInfo& info) {
+                      best_move = info.bestmove;
+                    },
+                    [](const ThinkingInfo&) {}, limits, dict, &cache,
+                    nullptr);
+      search.RunBlocking(threads);
+    }
+    const auto time = std::chrono::steady_clock::now() - start;
+    const NNCacheStats cache_after = cache.GetStats();
+
+    Results results;
+    results.visits = tree.GetCurrentHead()->GetN();
+    results.time_us =
+        std::chrono::duration_cast<std::chrono::microseconds>(time).count();
+    results.cache_lookups = cache_after.lookups - cache_before.lookups;
+    results.cache_hits = cache_after.hits - cache_before.hits;
+    results.batches = network.GetBatches() - batches_before;
+    results.samples = network.GetSamples() - samples_before;
+    total.Add(results);
+    std::cout << "benchmark position " << position_idx << " bestmove "
+              << best_move.as_string() << " " << results.AsString()
+              << std::endl;
+  }
+  std::cout << "benchmark total positions " << position_idx << " "
+            << total.AsString() << std::endl;
+}
+
+}  // namespace lczero
@@ -59,6 +59,9 @@ class BoardSquare {
   // Row := 7 - row.  Col remains the same.
   void Mirror() { square_ = square_ ^ 0b111000; }
 
+  // Col := 7 - col.  Row remains the same.
+  void FlipFile() { square_ = square_ ^ 0b000111; }
+
   // Checks whether coordinate is within 0..7.
   static bool IsValidCoord(int x) { return x >= 0 && x < 8; }
 
@@ -125,6 +128,8 @@ class BitBoard {
 
   // Returns whether all bits of a board are set to 0.
   bool empty() const { return board_ == 0; }
+  // Returns the number of bits set.
+  int count() const { return __builtin_popcountll(board_); }
 
   // Checks whether two bitboards have common bits set.
   bool intersects(const BitBoard& other) const { return board_ & other.board_; }
@@ -139,6 +144,16 @@ class BitBoard {
         (board_ & 0x00FF00FF00FF00FF) << 8 | (board_ & 0xFF00FF00FF00FF00) >> 8;
   }
 
+  // Flips a and h files of a board (reverses bits of every byte).
+  void FlipFiles() {
+    board_ =
+        (board_ & 0x5555555555555555) << 1 | (board_ & 0xAAAAAAAAAAAAAAAA) >> 1;
+    board_ =
+        (board_ & 0x3333333333333333) << 2 | (board_ & 0xCCCCCCCCCCCCCCCC) >> 2;
+    board_ =
+        (board_ & 0x0F0F0F0F0F0F0F0F) << 4 | (board_ & 0xF0F0F0F0F0F0F0F0) >> 4;
+  }
+
   bool operator==(const BitBoard& other) const {
     return board_ == other.board_;
   }
@@ -237,6 +252,8 @@ class Move {
   operator bool() const { return data_ != 0; }
 
   void Mirror() { data_ ^= 0b111000111000; }
+  // Flips a and h files of both squares of the move.
+  void FlipFiles() { data_ ^= 0b000111000111; }
 
   std::string as_string() const {
     std::string res = from().as_string() + to().as_string();
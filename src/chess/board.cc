@@ -27,12 +27,17 @@
 
 #include "chess/board.h"
 
+#include <cassert>
 #include <cctype>
 #include <cstdlib>
 #include <cstring>
 #include <sstream>
 #include "utils/exception.h"
 
+#ifdef USE_PEXT
+#include <immintrin.h>
+#endif
+
 namespace lczero {
 
 using std::string;
@@ -40,6 +45,54 @@ using std::string;
 const string ChessBoard::kStartingFen =
     "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
 
+namespace {
+// Zobrist keys of pieces on absolute squares (from white's point of view).
+enum ZobristKeys {
+  kWhitePiecesKeys,
+  kBlackPiecesKeys,
+  kRooksKeys,
+  kBishopsKeys,
+  kPawnsKeys,
+  kWhiteKingKeys,
+  kBlackKingKeys,
+  kZobristKeysCount
+};
+uint64_t zobrist_keys[kZobristKeysCount][64];
+// Keys of white 0-0, white 0-0-0, black 0-0 and black 0-0-0 rights.
+uint64_t zobrist_castling_keys[4];
+uint64_t zobrist_black_to_move_key;
+
+struct ZobristInitializer {
+  ZobristInitializer() {
+    // SplitMix64, so that the keys are the same on every run.
+    uint64_t state = 0x4c63305a6f627269ULL;
+    auto next = [&state]() {
+      uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+      return z ^ (z >> 31);
+    };
+    for (auto& keys : zobrist_keys) {
+      for (auto& key : keys) key = next();
+    }
+    for (auto& key : zobrist_castling_keys) key = next();
+    zobrist_black_to_move_key = next();
+  }
+} zobrist_initializer;
+
+// Returns XOR of @keys of @squares, which are relative squares converted to
+// absolute ones by XOR with @square_xor.
+uint64_t HashSquares(const uint64_t* keys, BitBoard squares, int square_xor) {
+  uint64_t hash = 0;
+  for (auto square : squares) hash ^= keys[square.as_int() ^ square_xor];
+  return hash;
+}
+
+BitBoard Difference(BitBoard a, BitBoard b) {
+  return a.as_int() ^ b.as_int();
+}
+}  // namespace
+
 void ChessBoard::Clear() {
   std::memset(reinterpret_cast<void*>(this), 0, sizeof(ChessBoard));
 }
@@ -56,6 +109,80 @@ void ChessBoard::Mirror() {
   std::swap(our_king_, their_king_);
   castlings_.Mirror();
   flipped_ = !flipped_;
+  hash_ ^= zobrist_black_to_move_key;
+  file_flipped_hash_ ^= zobrist_black_to_move_key;
+}
+
+void ChessBoard::FlipFiles() {
+  our_pieces_.FlipFiles();
+  their_pieces_.FlipFiles();
+  rooks_.FlipFiles();
+  bishops_.FlipFiles();
+  // En passant markers on first and last rows are flipped together with pawns.
+  pawns_.FlipFiles();
+  our_king_.FlipFile();
+  their_king_.FlipFile();
+  std::swap(hash_, file_flipped_hash_);
+}
+
+uint64_t ChessBoard::HashDifference(const ChessBoard& other,
+                                    bool flip_files) const {
+  // Relative squares are mirrored for black to move.
+  const int square_xor = (flipped_ ? 56 : 0) ^ (flip_files ? 7 : 0);
+  const auto& our_keys = zobrist_keys[flipped_ ? kBlackPiecesKeys
+                                               : kWhitePiecesKeys];
+  const auto& their_keys = zobrist_keys[flipped_ ? kWhitePiecesKeys
+                                                 : kBlackPiecesKeys];
+  const auto& our_king_keys = zobrist_keys[flipped_ ? kBlackKingKeys
+                                                    : kWhiteKingKeys];
+  const auto& their_king_keys = zobrist_keys[flipped_ ? kWhiteKingKeys
+                                                      : kBlackKingKeys];
+  uint64_t hash =
+      HashSquares(our_keys, Difference(our_pieces_, other.our_pieces_),
+                  square_xor) ^
+      HashSquares(their_keys, Difference(their_pieces_, other.their_pieces_),
+                  square_xor) ^
+      HashSquares(zobrist_keys[kRooksKeys], Difference(rooks_, other.rooks_),
+                  square_xor) ^
+      HashSquares(zobrist_keys[kBishopsKeys],
+                  Difference(bishops_, other.bishops_), square_xor) ^
+      HashSquares(zobrist_keys[kPawnsKeys], Difference(pawns_, other.pawns_),
+                  square_xor);
+  if (our_king_ != other.our_king_) {
+    hash ^= our_king_keys[our_king_.as_int() ^ square_xor] ^
+            our_king_keys[other.our_king_.as_int() ^ square_xor];
+  }
+  if (their_king_ != other.their_king_) {
+    hash ^= their_king_keys[their_king_.as_int() ^ square_xor] ^
+            their_king_keys[other.their_king_.as_int() ^ square_xor];
+  }
+  const int castlings = castlings_.as_int() ^ other.castlings_.as_int();
+  for (int i = 0; i < 4; ++i) {
+    // Our rights are the lower two bits, white ones when white is to move.
+    if (castlings & (1 << i)) {
+      hash ^= zobrist_castling_keys[flipped_ ? i ^ 2 : i];
+    }
+  }
+  return hash;
+}
+
+void ChessBoard::ComputeHashes() {
+  // Differences with an empty board with kings on the same squares.
+  ChessBoard empty;
+  empty.Clear();
+  empty.our_king_ = our_king_;
+  empty.their_king_ = their_king_;
+  empty.flipped_ = flipped_;
+  for (const bool flip_files : {false, true}) {
+    const int square_xor = (flipped_ ? 56 : 0) ^ (flip_files ? 7 : 0);
+    uint64_t hash = HashDifference(empty, flip_files) ^
+                    zobrist_keys[flipped_ ? kBlackKingKeys : kWhiteKingKeys]
+                                [our_king_.as_int() ^ square_xor] ^
+                    zobrist_keys[flipped_ ? kWhiteKingKeys : kBlackKingKeys]
+                                [their_king_.as_int() ^ square_xor];
+    if (flipped_) hash ^= zobrist_black_to_move_key;
+    (flip_files ? file_flipped_hash_ : hash_) = hash;
+  }
 }
 
 namespace {
@@ -74,54 +201,6 @@ static const std::pair<int, int> kBishopDirections[] = {
 static const int k00Attackers[] = {4, 5, 6};
 static const int k000Attackers[] = {2, 3, 4};
 
-// Which squares can rook attack from every of squares.
-static const BitBoard kRookAttacks[] = {
-    0x01010101010101FEULL, 0x02020202020202FDULL, 0x04040404040404FBULL,
-    0x08080808080808F7ULL, 0x10101010101010EFULL, 0x20202020202020DFULL,
-    0x40404040404040BFULL, 0x808080808080807FULL, 0x010101010101FE01ULL,
-    0x020202020202FD02ULL, 0x040404040404FB04ULL, 0x080808080808F708ULL,
-    0x101010101010EF10ULL, 0x202020202020DF20ULL, 0x404040404040BF40ULL,
-    0x8080808080807F80ULL, 0x0101010101FE0101ULL, 0x0202020202FD0202ULL,
-    0x0404040404FB0404ULL, 0x0808080808F70808ULL, 0x1010101010EF1010ULL,
-    0x2020202020DF2020ULL, 0x4040404040BF4040ULL, 0x80808080807F8080ULL,
-    0x01010101FE010101ULL, 0x02020202FD020202ULL, 0x04040404FB040404ULL,
-    0x08080808F7080808ULL, 0x10101010EF101010ULL, 0x20202020DF202020ULL,
-    0x40404040BF404040ULL, 0x808080807F808080ULL, 0x010101FE01010101ULL,
-    0x020202FD02020202ULL, 0x040404FB04040404ULL, 0x080808F708080808ULL,
-    0x101010EF10101010ULL, 0x202020DF20202020ULL, 0x404040BF40404040ULL,
-    0x8080807F80808080ULL, 0x0101FE0101010101ULL, 0x0202FD0202020202ULL,
-    0x0404FB0404040404ULL, 0x0808F70808080808ULL, 0x1010EF1010101010ULL,
-    0x2020DF2020202020ULL, 0x4040BF4040404040ULL, 0x80807F8080808080ULL,
-    0x01FE010101010101ULL, 0x02FD020202020202ULL, 0x04FB040404040404ULL,
-    0x08F7080808080808ULL, 0x10EF101010101010ULL, 0x20DF202020202020ULL,
-    0x40BF404040404040ULL, 0x807F808080808080ULL, 0xFE01010101010101ULL,
-    0xFD02020202020202ULL, 0xFB04040404040404ULL, 0xF708080808080808ULL,
-    0xEF10101010101010ULL, 0xDF20202020202020ULL, 0xBF40404040404040ULL,
-    0x7F80808080808080ULL};
-// Which squares can bishop attack.
-static const BitBoard kBishopAttacks[] = {
-    0x8040201008040200ULL, 0x0080402010080500ULL, 0x0000804020110A00ULL,
-    0x0000008041221400ULL, 0x0000000182442800ULL, 0x0000010204885000ULL,
-    0x000102040810A000ULL, 0x0102040810204000ULL, 0x4020100804020002ULL,
-    0x8040201008050005ULL, 0x00804020110A000AULL, 0x0000804122140014ULL,
-    0x0000018244280028ULL, 0x0001020488500050ULL, 0x0102040810A000A0ULL,
-    0x0204081020400040ULL, 0x2010080402000204ULL, 0x4020100805000508ULL,
-    0x804020110A000A11ULL, 0x0080412214001422ULL, 0x0001824428002844ULL,
-    0x0102048850005088ULL, 0x02040810A000A010ULL, 0x0408102040004020ULL,
-    0x1008040200020408ULL, 0x2010080500050810ULL, 0x4020110A000A1120ULL,
-    0x8041221400142241ULL, 0x0182442800284482ULL, 0x0204885000508804ULL,
-    0x040810A000A01008ULL, 0x0810204000402010ULL, 0x0804020002040810ULL,
-    0x1008050005081020ULL, 0x20110A000A112040ULL, 0x4122140014224180ULL,
-    0x8244280028448201ULL, 0x0488500050880402ULL, 0x0810A000A0100804ULL,
-    0x1020400040201008ULL, 0x0402000204081020ULL, 0x0805000508102040ULL,
-    0x110A000A11204080ULL, 0x2214001422418000ULL, 0x4428002844820100ULL,
-    0x8850005088040201ULL, 0x10A000A010080402ULL, 0x2040004020100804ULL,
-    0x0200020408102040ULL, 0x0500050810204080ULL, 0x0A000A1120408000ULL,
-    0x1400142241800000ULL, 0x2800284482010000ULL, 0x5000508804020100ULL,
-    0xA000A01008040201ULL, 0x4000402010080402ULL, 0x0002040810204080ULL,
-    0x0005081020408000ULL, 0x000A112040800000ULL, 0x0014224180000000ULL,
-    0x0028448201000000ULL, 0x0050880402010000ULL, 0x00A0100804020100ULL,
-    0x0040201008040201ULL};
 // Which squares can knight attack.
 static const BitBoard kKnightAttacks[] = {
     0x0000000000020400ULL, 0x0000000000050800ULL, 0x00000000000A1100ULL,
@@ -178,22 +257,268 @@ static const Move::Promotion kPromotions[] = {
     Move::Promotion::Knight,
 };
 
+// Attacks of sliding pieces are looked up by magic bitboards: the occupancy
+// of the squares which can block a ray from the square (not counting the last
+// square of the ray, which is attacked anyway) is mapped to an index into a
+// table of attacked squares, either by a multiplication by a "magic" number
+// which maps all occupancies to different indices, or by PEXT, which packs
+// the occupancy bits together. PEXT is only fast on processors which have it
+// in hardware (Intel since Haswell, AMD since Zen 3), so it's a build option.
+struct MagicParams {
+  // Squares which can block the rays from the square.
+  uint64_t mask;
+#ifndef USE_PEXT
+  uint64_t magic;
+  // 64 minus the number of bits of mask.
+  int shift;
+#endif
+  // Attacks of all occupancies of mask.
+  uint64_t* attacks;
+
+  uint64_t* GetEntry(uint64_t occupancy) const {
+#ifdef USE_PEXT
+    return attacks + _pext_u64(occupancy, mask);
+#else
+    return attacks + (((occupancy & mask) * magic) >> shift);
+#endif
+  }
+};
+
+// Sums of 2^(bits of mask) over all squares.
+const int kRookTableSize = 102400;
+const int kBishopTableSize = 5248;
+
+// Squares between two squares on a line (not including them), empty if they
+// are not on a line.
+uint64_t between_table[64][64];
+
+MagicParams rook_magic_params[64];
+MagicParams bishop_magic_params[64];
+uint64_t rook_attacks_table[kRookTableSize];
+uint64_t bishop_attacks_table[kBishopTableSize];
+
+// Attacks of a piece on @square moving in @directions with pieces on
+// @occupancy, stepping square by square. Only used to fill the tables.
+template <size_t N>
+uint64_t GetSlidingAttacks(BoardSquare square, uint64_t occupancy,
+                           const std::pair<int, int> (&directions)[N]) {
+  uint64_t result = 0;
+  for (const auto& direction : directions) {
+    auto row = square.row();
+    auto col = square.col();
+    while (true) {
+      row += direction.first;
+      col += direction.second;
+      if (!BoardSquare::IsValid(row, col)) break;
+      const uint64_t bit = 1ULL << BoardSquare(row, col).as_int();
+      result |= bit;
+      if (occupancy & bit) break;
+    }
+  }
+  return result;
+}
+
+// Multipliers which map all occupancies of the mask of a square to different
+// entries, found by a search of random sparse numbers.
+const uint64_t kRookMagics[] = {
+    0x0A80004000801220ULL, 0x8040004010002008ULL, 0x2080200010008008ULL,
+    0x1100100008210004ULL, 0xC200209084020008ULL, 0x2100010004000208ULL,
+    0x0400081000822421ULL, 0x0200010422048844ULL, 0x0800800080400024ULL,
+    0x0001402000401000ULL, 0x3000801000802001ULL, 0x4400800800100083ULL,
+    0x0904802402480080ULL, 0x4040800400020080ULL, 0x0018808042000100ULL,
+    0x4040800080004100ULL, 0x0040048001458024ULL, 0x00A0004000205000ULL,
+    0x3100808010002000ULL, 0x4825010010000820ULL, 0x5004808008000401ULL,
+    0x2024818004000A00ULL, 0x0005808002000100ULL, 0x2100060004806104ULL,
+    0x0080400880008421ULL, 0x4062220600410280ULL, 0x010A004A00108022ULL,
+    0x0000100080080080ULL, 0x0021000500080010ULL, 0x0044000202001008ULL,
+    0x0000100400080102ULL, 0xC020128200040545ULL, 0x0080002000400040ULL,
+    0x0000804000802004ULL, 0x0000120022004080ULL, 0x010A386103001001ULL,
+    0x9010080080800400ULL, 0x8440020080800400ULL, 0x0004228824001001ULL,
+    0x000000490A000084ULL, 0x0080002000504000ULL, 0x200020005000C000ULL,
+    0x0012088020420010ULL, 0x0010010080080800ULL, 0x0085001008010004ULL,
+    0x0002000204008080ULL, 0x0040413002040008ULL, 0x0000304081020004ULL,
+    0x0080204000800080ULL, 0x3008804000290100ULL, 0x1010100080200080ULL,
+    0x2008100208028080ULL, 0x5000850800910100ULL, 0x8402019004680200ULL,
+    0x0120911028020400ULL, 0x0000008044010200ULL, 0x0020850200244012ULL,
+    0x0020850200244012ULL, 0x0000102001040841ULL, 0x140900040A100021ULL,
+    0x000200282410A102ULL, 0x000200282410A102ULL, 0x000200282410A102ULL,
+    0x4048240043802106ULL,
+};
+
+const uint64_t kBishopMagics[] = {
+    0x40106000A1160020ULL, 0x0020010250810120ULL, 0x2010010220280081ULL,
+    0x002806004050C040ULL, 0x0002021018000000ULL, 0x2001112010000400ULL,
+    0x0881010120218080ULL, 0x1030820110010500ULL, 0x0000120222042400ULL,
+    0x2000020404040044ULL, 0x8000480094208000ULL, 0x0003422A02000001ULL,
+    0x000A220210100040ULL, 0x8004820202226000ULL, 0x0018234854100800ULL,
+    0x0100004042101040ULL, 0x0004001004082820ULL, 0x0010000810010048ULL,
+    0x1014004208081300ULL, 0x2080818802044202ULL, 0x0040880C00A00100ULL,
+    0x0080400200522010ULL, 0x0001000188180B04ULL, 0x0080249202020204ULL,
+    0x1004400004100410ULL, 0x00013100A0022206ULL, 0x2148500001040080ULL,
+    0x4241080011004300ULL, 0x4020848004002000ULL, 0x10101380D1004100ULL,
+    0x0008004422020284ULL, 0x01010A1041008080ULL, 0x0808080400082121ULL,
+    0x0808080400082121ULL, 0x0091128200100C00ULL, 0x0202200802010104ULL,
+    0x8C0A020200440085ULL, 0x01A0008080B10040ULL, 0x0889520080122800ULL,
+    0x100902022202010AULL, 0x04081A0816002000ULL, 0x0000681208005000ULL,
+    0x8170840041008802ULL, 0x0A00004200810805ULL, 0x0830404408210100ULL,
+    0x2602208106006102ULL, 0x1048300680802628ULL, 0x2602208106006102ULL,
+    0x0602010120110040ULL, 0x0941010801043000ULL, 0x000040440A210428ULL,
+    0x0008240020880021ULL, 0x0400002012048200ULL, 0x00AC102001210220ULL,
+    0x0220021002009900ULL, 0x84440C080A013080ULL, 0x0001008044200440ULL,
+    0x0004C04410841000ULL, 0x2000500104011130ULL, 0x1A0C010011C20229ULL,
+    0x0044800112202200ULL, 0x0434804908100424ULL, 0x0300404822C08200ULL,
+    0x48081010008A2A80ULL,
+};
+
+template <size_t N>
+void InitializeMagics(const std::pair<int, int> (&directions)[N],
+                      const uint64_t* magics, MagicParams* params,
+                      uint64_t* table) {
+  uint64_t* attacks_begin = table;
+  for (int square = 0; square < 64; ++square) {
+    const BoardSquare sq(square);
+    // Last squares of rays are not in the mask: rank 1 and 8 and files a and
+    // h, unless the square is on them itself.
+    const uint64_t edges =
+        ((0x00000000000000FFULL | 0xFF00000000000000ULL) &
+         ~(0xFFULL << (8 * sq.row()))) |
+        ((0x0101010101010101ULL | 0x8080808080808080ULL) &
+         ~(0x0101010101010101ULL << sq.col()));
+    MagicParams& magic = params[square];
+    magic.mask = GetSlidingAttacks(sq, 0, directions) & ~edges;
+    magic.attacks = attacks_begin;
+    const int bits = __builtin_popcountll(magic.mask);
+    attacks_begin += 1 << bits;
+#ifndef USE_PEXT
+    magic.magic = magics[square];
+    magic.shift = 64 - bits;
+#else
+    (void)magics;
+#endif
+
+    // All subsets of the mask (carry-rippler).
+    uint64_t occupancy = 0;
+    do {
+      uint64_t* entry = magic.GetEntry(occupancy);
+      const uint64_t attacks = GetSlidingAttacks(sq, occupancy, directions);
+      // Either empty or the same attacks, if the magic is right.
+      assert(*entry == 0 || *entry == attacks);
+      *entry = attacks;
+      occupancy = (occupancy - magic.mask) & magic.mask;
+    } while (occupancy);
+  }
+}
+
+template <size_t N>
+void InitializeBetween(const std::pair<int, int> (&directions)[N]) {
+  for (int square = 0; square < 64; ++square) {
+    const BoardSquare sq(square);
+    for (const auto& direction : directions) {
+      uint64_t between = 0;
+      auto row = sq.row();
+      auto col = sq.col();
+      while (true) {
+        row += direction.first;
+        col += direction.second;
+        if (!BoardSquare::IsValid(row, col)) break;
+        const BoardSquare destination(row, col);
+        between_table[square][destination.as_int()] = between;
+        between |= 1ULL << destination.as_int();
+      }
+    }
+  }
+}
+
+// Fills the tables when the program starts.
+struct MagicsInitializer {
+  MagicsInitializer() {
+    InitializeBetween(kRookDirections);
+    InitializeBetween(kBishopDirections);
+    InitializeMagics(kRookDirections, kRookMagics, rook_magic_params,
+                     rook_attacks_table);
+    InitializeMagics(kBishopDirections, kBishopMagics, bishop_magic_params,
+                     bishop_attacks_table);
+  }
+} magics_initializer;
+
+BitBoard GetRookAttacks(BoardSquare square, BitBoard occupancy) {
+  return *rook_magic_params[square.as_int()].GetEntry(occupancy.as_int());
+}
+
+BitBoard GetBishopAttacks(BoardSquare square, BitBoard occupancy) {
+  return *bishop_magic_params[square.as_int()].GetEntry(occupancy.as_int());
+}
+
+bool HasSeveralBits(BitBoard board) {
+  return board.as_int() & (board.as_int() - 1);
+}
+
+BitBoard GetBetween(BoardSquare from, BoardSquare to) {
+  return between_table[from.as_int()][to.as_int()];
+}
+
 }  // namespace
 
 BitBoard ChessBoard::pawns() const { return pawns_ * kPawnMask; }
 
 MoveList ChessBoard::GeneratePseudolegalMoves() const {
+  return GenerateMoves(false);
+}
+
+MoveList ChessBoard::GenerateMoves(bool legal) const {
+  const BitBoard occupancy = our_pieces_ + their_pieces_;
+  // Where pieces other than the king may move to: anywhere, or under check,
+  // only so that the checking piece is captured or blocked.
+  BitBoard targets = ~0ULL;
+  // Our pieces pinned to the king, and the squares between the king and the
+  // pinning piece (including it) each may move to.
+  BitBoard pinned;
+  BitBoard pin_rays[64];
+  if (legal) {
+    const BitBoard checkers =
+        their_pieces_ *
+        (GetRookAttacks(our_king_, occupancy) * rooks_ +
+         GetBishopAttacks(our_king_, occupancy) * bishops_ +
+         kKnightAttacks[our_king_.as_int()] * their_knights() +
+         kPawnAttacks[our_king_.as_int()] * pawns_);
+    if (!checkers.empty()) {
+      // Only the king can escape a double check.
+      targets = HasSeveralBits(checkers)
+                    ? 0
+                    : GetBetween(our_king_, *checkers.begin()) + checkers;
+    }
+    // Their sliding pieces which would attack the king if not for our pieces.
+    const BitBoard snipers =
+        their_pieces_ * (GetRookAttacks(our_king_, their_pieces_) * rooks_ +
+                         GetBishopAttacks(our_king_, their_pieces_) * bishops_);
+    for (auto sniper : snipers) {
+      const BitBoard between = GetBetween(our_king_, sniper);
+      const BitBoard blockers = between * occupancy;
+      // Pinned is a single piece of ours in between.
+      if (blockers.empty() || HasSeveralBits(blockers) ||
+          blockers.intersects(their_pieces_)) {
+        continue;
+      }
+      const BoardSquare blocker = *blockers.begin();
+      pinned.set(blocker);
+      pin_rays[blocker.as_int()] = between;
+      pin_rays[blocker.as_int()].set(sniper);
+    }
+  }
+
   MoveList result;
   for (auto source : our_pieces_) {
     // King
     if (source == our_king_) {
+      // The king doesn't block lines which attack it.
+      const BitBoard occupancy_without_king = occupancy - our_king_;
       for (const auto& delta : kKingMoves) {
         const auto dst_row = source.row() + delta.first;
         const auto dst_col = source.col() + delta.second;
         if (!BoardSquare::IsValid(dst_row, dst_col)) continue;
         const BoardSquare destination(dst_row, dst_col);
         if (our_pieces_.get(destination)) continue;
-        if (IsUnderAttack(destination)) continue;
+        if (IsUnderAttack(destination, occupancy_without_king)) continue;
         result.emplace_back(source, destination);
       }
       // Castlings.
@@ -241,39 +566,25 @@ MoveList ChessBoard::GeneratePseudolegalMoves() const {
       }
       continue;
     }
+    const BitBoard allowed =
+        pinned.get(source) ? targets * pin_rays[source.as_int()] : targets;
     bool processed_piece = false;
     // Rook (and queen)
     if (rooks_.get(source)) {
       processed_piece = true;
-      for (const auto& direction : kRookDirections) {
-        auto dst_row = source.row();
-        auto dst_col = source.col();
-        while (true) {
-          dst_row += direction.first;
-          dst_col += direction.second;
-          if (!BoardSquare::IsValid(dst_row, dst_col)) break;
-          const BoardSquare destination(dst_row, dst_col);
-          if (our_pieces_.get(destination)) break;
-          result.emplace_back(source, destination);
-          if (their_pieces_.get(destination)) break;
-        }
+      const BitBoard attacked =
+          (GetRookAttacks(source, occupancy) - our_pieces_) * allowed;
+      for (const auto destination : attacked) {
+        result.emplace_back(source, destination);
       }
     }
     // Bishop (and queen)
     if (bishops_.get(source)) {
       processed_piece = true;
-      for (const auto& direction : kBishopDirections) {
-        auto dst_row = source.row();
-        auto dst_col = source.col();
-        while (true) {
-          dst_row += direction.first;
-          dst_col += direction.second;
-          if (!BoardSquare::IsValid(dst_row, dst_col)) break;
-          const BoardSquare destination(dst_row, dst_col);
-          if (our_pieces_.get(destination)) break;
-          result.emplace_back(source, destination);
-          if (their_pieces_.get(destination)) break;
-        }
+      const BitBoard attacked =
+          (GetBishopAttacks(source, occupancy) - our_pieces_) * allowed;
+      for (const auto destination : attacked) {
+        result.emplace_back(source, destination);
       }
     }
     if (processed_piece) continue;
@@ -285,17 +596,18 @@ MoveList ChessBoard::GeneratePseudolegalMoves() const {
         const auto dst_col = source.col();
         const BoardSquare destination(dst_row, dst_col);
 
-        if (!our_pieces_.get(destination) && !their_pieces_.get(destination)) {
+        if (!occupancy.get(destination)) {
           if (dst_row != 7) {
-            result.emplace_back(source, destination);
+            if (allowed.get(destination)) {
+              result.emplace_back(source, destination);
+            }
             if (dst_row == 2) {
               // Maybe it'll be possible to move two squares.
-              if (!our_pieces_.get(3, dst_col) &&
-                  !their_pieces_.get(3, dst_col)) {
+              if (!occupancy.get(3, dst_col) && allowed.get(3, dst_col)) {
                 result.emplace_back(source, BoardSquare(3, dst_col));
               }
             }
-          } else {
+          } else if (allowed.get(destination)) {
             // Promotions
             for (auto promotion : kPromotions) {
               result.emplace_back(source, destination, promotion);
@@ -311,6 +623,7 @@ MoveList ChessBoard::GeneratePseudolegalMoves() const {
           if (dst_col < 0 || dst_col >= 8) continue;
           const BoardSquare destination(dst_row, dst_col);
           if (their_pieces_.get(destination)) {
+            if (!allowed.get(destination)) continue;
             if (dst_row == 7) {
               // Promotion.
               for (auto promotion : kPromotions) {
@@ -324,7 +637,15 @@ MoveList ChessBoard::GeneratePseudolegalMoves() const {
             // En passant.
             // "Pawn" on opponent's file 8 means that en passant is possible.
             // Those fake pawns are reset in ApplyMove.
-            result.emplace_back(source, destination);
+            const Move move(source, destination);
+            if (legal) {
+              // Removes two pawns from a line at once, too rare to bother
+              // with masks.
+              ChessBoard board(*this);
+              board.ApplyMove(move);
+              if (board.IsUnderCheck()) continue;
+            }
+            result.push_back(move);
           }
         }
       }
@@ -332,8 +653,8 @@ MoveList ChessBoard::GeneratePseudolegalMoves() const {
     }
     // Knight.
     {
-      for (const auto destination : kKnightAttacks[source.as_int()]) {
-        if (our_pieces_.get(destination)) continue;
+      for (const auto destination :
+           (kKnightAttacks[source.as_int()] - our_pieces_) * allowed) {
         result.emplace_back(source, destination);
       }
     }
@@ -342,6 +663,14 @@ MoveList ChessBoard::GeneratePseudolegalMoves() const {
 }
 
 bool ChessBoard::ApplyMove(Move move) {
+  const ChessBoard before(*this);
+  const bool reset_50_moves = MovePieces(move);
+  hash_ ^= HashDifference(before, false);
+  file_flipped_hash_ ^= HashDifference(before, true);
+  return reset_50_moves;
+}
+
+bool ChessBoard::MovePieces(Move move) {
   const auto& from = move.from();
   const auto& to = move.to();
   const auto from_row = from.row();
@@ -450,6 +779,10 @@ bool ChessBoard::ApplyMove(Move move) {
 }
 
 bool ChessBoard::IsUnderAttack(BoardSquare square) const {
+  return IsUnderAttack(square, our_pieces_ + their_pieces_);
+}
+
+bool ChessBoard::IsUnderAttack(BoardSquare square, BitBoard occupancy) const {
   const int row = square.row();
   const int col = square.col();
   // Check king
@@ -459,40 +792,13 @@ bool ChessBoard::IsUnderAttack(BoardSquare square) const {
     if (std::abs(krow - row) <= 1 && std::abs(kcol - col) <= 1) return true;
   }
   // Check Rooks (and queen)
-  if (kRookAttacks[square.as_int()].intersects(their_pieces_ * rooks_)) {
-    for (const auto& direction : kRookDirections) {
-      auto dst_row = row;
-      auto dst_col = col;
-      while (true) {
-        dst_row += direction.first;
-        dst_col += direction.second;
-        if (!BoardSquare::IsValid(dst_row, dst_col)) break;
-        const BoardSquare destination(dst_row, dst_col);
-        if (our_pieces_.get(destination)) break;
-        if (their_pieces_.get(destination)) {
-          if (rooks_.get(destination)) return true;
-          break;
-        }
-      }
-    }
+  if (GetRookAttacks(square, occupancy).intersects(their_pieces_ * rooks_)) {
+    return true;
   }
   // Check Bishops
-  if (kBishopAttacks[square.as_int()].intersects(their_pieces_ * bishops_)) {
-    for (const auto& direction : kBishopDirections) {
-      auto dst_row = row;
-      auto dst_col = col;
-      while (true) {
-        dst_row += direction.first;
-        dst_col += direction.second;
-        if (!BoardSquare::IsValid(dst_row, dst_col)) break;
-        const BoardSquare destination(dst_row, dst_col);
-        if (our_pieces_.get(destination)) break;
-        if (their_pieces_.get(destination)) {
-          if (bishops_.get(destination)) return true;
-          break;
-        }
-      }
-    }
+  if (GetBishopAttacks(square, occupancy)
+          .intersects(their_pieces_ * bishops_)) {
+    return true;
   }
   // Check pawns
   if (kPawnAttacks[square.as_int()].intersects(their_pieces_ * pawns_)) {
@@ -541,68 +847,34 @@ bool ChessBoard::IsLegalMove(Move move, bool was_under_check) const {
 
   // Not check that piece was pinned. And it was, check that after the move
   // it is still on like of attack.
-  int dx = from.col() - our_king_.col();
-  int dy = from.row() - our_king_.row();
+  const int dx = from.col() - our_king_.col();
+  const int dy = from.row() - our_king_.row();
 
   // If it's not on the same file/rank/diagonal as our king, cannot be pinned.
   if (dx != 0 && dy != 0 && std::abs(dx) != std::abs(dy)) return true;
-  dx = (dx > 0) - (dx < 0);  // Sign.
-  dy = (dy > 0) - (dy < 0);
-  auto col = our_king_.col();
-  auto row = our_king_.row();
-  while (true) {
-    col += dx;
-    row += dy;
-    // Attacking line left board, good.
-    if (!BoardSquare::IsValid(row, col)) return true;
-    const BoardSquare square(row, col);
-    // The source square of the move is now free.
-    if (square == from) continue;
-    // The destination square if the move is our piece. King is not under
-    // attack.
-    if (square == to) return true;
-    // Our piece on the line. Not under attack.
-    if (our_pieces_.get(square)) return true;
-    if (their_pieces_.get(square)) {
-      if (dx == 0 || dy == 0) {
-        // Have to be afraid of rook-like piece.
-        return !rooks_.get(square);
-      } else {
-        // Have to be afraid of bishop-like piece.
-        return !bishops_.get(square);
-      }
-      return true;
-    }
+  // As the king is not under check, only the line through the source square
+  // can open. A piece captured on the destination square doesn't attack.
+  BitBoard occupancy = our_pieces_ + their_pieces_ - from;
+  occupancy.set(to);
+  const BitBoard attackers = their_pieces_ - to;
+  if (dx == 0 || dy == 0) {
+    // Have to be afraid of rook-like piece.
+    return !GetRookAttacks(our_king_, occupancy).intersects(attackers * rooks_);
   }
+  // Have to be afraid of bishop-like piece.
+  return !GetBishopAttacks(our_king_, occupancy)
+              .intersects(attackers * bishops_);
 }
 
-MoveList ChessBoard::GenerateLegalMoves() const {
-  const bool was_under_check = IsUnderCheck();
-  MoveList move_list = GeneratePseudolegalMoves();
-  MoveList result;
-  result.reserve(move_list.size());
-
-  for (Move m : move_list) {
-    if (IsLegalMove(m, was_under_check)) result.emplace_back(m);
-  }
-
-  return result;
-}
+MoveList ChessBoard::GenerateLegalMoves() const { return GenerateMoves(true); }
 
 std::vector<MoveExecution> ChessBoard::GenerateLegalMovesAndPositions() const {
-  MoveList move_list = GeneratePseudolegalMoves();
-  std::vector<MoveExecution> result;
-
-  for (const auto& move : move_list) {
-    result.emplace_back();
-    auto& newboard = result.back().board;
-    newboard = *this;
-    result.back().reset_50_moves = newboard.ApplyMove(move);
-    if (newboard.IsUnderCheck()) {
-      result.pop_back();
-      continue;
-    }
-    result.back().move = move;
+  MoveList move_list = GenerateLegalMoves();
+  std::vector<MoveExecution> result(move_list.size());
+  for (size_t i = 0; i < move_list.size(); ++i) {
+    result[i].move = move_list[i];
+    result[i].board = *this;
+    result[i].reset_50_moves = result[i].board.ApplyMove(move_list[i]);
   }
   return result;
 }
@@ -693,6 +965,7 @@ void ChessBoard::SetFromFen(const std::string& fen, int* no_capture_ply,
     pawns_.set((square.row() == 2) ? 0 : 7, square.col());
   }
 
+  ComputeHashes();
   if (who_to_move == "b" || who_to_move == "B") {
     Mirror();
   }
@@ -53,6 +53,10 @@ class ChessBoard {
   // middle of the board. (what was on file 1 appears on file 8, what was
   // on rank b remains on b).
   void Mirror();
+  // Mirrors pieces relative to the middle of the board between d and e files.
+  // (what was on file a appears on file h). Castling rights are kept as is, so
+  // the result only makes sense for positions without them.
+  void FlipFiles();
 
   // Generates list of possible moves for "ours" (white), but may leave king
   // under check.
@@ -67,19 +71,18 @@ class ChessBoard {
   // Checks whether at least one of the sides has mating material.
 
   bool HasMatingMaterial() const;
-  // Generates legal moves.
+  // Generates legal moves, in the same order as GeneratePseudolegalMoves().
   MoveList GenerateLegalMoves() const;
   // Check whether pseudolegal move is legal.
   bool IsLegalMove(Move move, bool was_under_check) const;
   // Returns a list of legal moves and board positions after the move is made.
   std::vector<MoveExecution> GenerateLegalMovesAndPositions() const;
 
-  uint64_t Hash() const {
-    return HashCat({our_pieces_.as_int(), their_pieces_.as_int(),
-                    rooks_.as_int(), bishops_.as_int(), pawns_.as_int(),
-                    our_king_.as_int(), their_king_.as_int(),
-                    castlings_.as_int(), flipped_});
-  }
+  // Zobrist hash of the position, kept up to date by ApplyMove() and the same
+  // for both sides' points of view except for the side to move.
+  uint64_t Hash() const { return hash_; }
+  // Hash of the position with a and h files flipped.
+  uint64_t FileFlippedHash() const { return file_flipped_hash_; }
 
   class Castlings {
    public:
@@ -151,6 +154,19 @@ class ChessBoard {
   bool operator!=(const ChessBoard& other) const { return !operator==(other); }
 
  private:
+  // Generates moves of "ours" (white). If @legal, only legal ones, otherwise
+  // moves other than of the king may leave it under check.
+  MoveList GenerateMoves(bool legal) const;
+  // Same as IsUnderAttack(), with lines blocked by pieces on @occupancy.
+  bool IsUnderAttack(BoardSquare square, BitBoard occupancy) const;
+  // ApplyMove() without the update of hashes.
+  bool MovePieces(Move move);
+  // Returns XOR of the hashes of this board and @other, which must have the
+  // same side to move, or of their @flip_files versions.
+  uint64_t HashDifference(const ChessBoard& other, bool flip_files) const;
+  // Computes hashes from scratch.
+  void ComputeHashes();
+
   // All white pieces.
   BitBoard our_pieces_;
   // All black pieces.
@@ -169,6 +185,8 @@ class ChessBoard {
   BoardSquare their_king_;
   Castlings castlings_;
   bool flipped_ = false;  // aka "Black to move".
+  uint64_t hash_ = 0;
+  uint64_t file_flipped_hash_ = 0;
 };
 
 // Stores the move and state of the board after the move is done.
@@ -0,0 +1,90 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include <benchmark/benchmark.h>
+
+#include "chess/board.h"
+
+namespace lczero {
+namespace {
+
+std::uint64_t Perft(const ChessBoard& board, int depth) {
+  if (depth == 0) return 1;
+  const auto moves = board.GenerateLegalMoves();
+  if (depth == 1) return moves.size();
+  std::uint64_t total_count = 0;
+  for (const auto& move : moves) {
+    auto new_board = board;
+    new_board.ApplyMove(move);
+    new_board.Mirror();
+    total_count += Perft(new_board, depth - 1);
+  }
+  return total_count;
+}
+
+// Perft positions from https://www.chessprogramming.org/Perft_Results
+const char* kFens[] = {
+    "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+    "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+    "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+    "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1",
+};
+
+// Counts leaves of the move tree of a position, to the given depth. Items are
+// leaves, so the rate is in moves generated per second.
+void BM_Perft(benchmark::State& state) {
+  ChessBoard board;
+  board.SetFromFen(kFens[state.range(0)]);
+  const int depth = state.range(1);
+  std::uint64_t leaves = 0;
+  for (auto _ : state) {
+    leaves += Perft(board, depth);
+  }
+  state.SetItemsProcessed(leaves);
+}
+BENCHMARK(BM_Perft)
+    ->Args({0, 4})
+    ->Args({1, 3})
+    ->Args({2, 5})
+    ->Args({3, 3})
+    ->Unit(benchmark::kMillisecond);
+
+// Move generation of a single position.
+void BM_GenerateLegalMoves(benchmark::State& state) {
+  ChessBoard board;
+  board.SetFromFen(kFens[state.range(0)]);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(board.GenerateLegalMoves());
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_GenerateLegalMoves)->DenseRange(0, 3);
+
+}  // namespace
+}  // namespace lczero
+
+BENCHMARK_MAIN();
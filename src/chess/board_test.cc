@@ -18,6 +18,8 @@
 
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <chrono>
 #include <iostream>
 #include "src/chess/bitboard.h"
 #include "src/chess/board.h"
@@ -92,6 +94,34 @@ int Perft(const ChessBoard& board, int max_depth, bool dump = false,
   EXPECT_EQ(iter, legal_moves.end());
   return total_count;
 }
+
+// Same as Perft(), using only legal move generation, to measure its speed.
+std::uint64_t LegalPerft(const ChessBoard& board, int depth) {
+  if (depth == 0) return 1;
+  const auto moves = board.GenerateLegalMoves();
+  if (depth == 1) return moves.size();
+  std::uint64_t total_count = 0;
+  for (const auto& move : moves) {
+    auto new_board = board;
+    new_board.ApplyMove(move);
+    new_board.Mirror();
+    total_count += LegalPerft(new_board, depth - 1);
+  }
+  return total_count;
+}
+
+// Runs LegalPerft() and reports its speed.
+std::uint64_t TimedLegalPerft(const std::string& fen, int depth) {
+  ChessBoard board;
+  board.SetFromFen(fen);
+  const auto start = std::chrono::steady_clock::now();
+  const auto count = LegalPerft(board, depth);
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  std::cerr << fen << " depth " << depth << ": " << count << " nodes, "
+            << static_cast<int>(count / elapsed.count()) << " nps\n";
+  return count;
+}
 }  // namespace
 
 /* TEST(ChessBoard, MoveGenStartingPos) {
@@ -166,6 +196,104 @@ TEST(ChessBoard, MoveGenPosition6) {
   EXPECT_EQ(Perft(board, 4), 3894594);
 }
 
+// Positions with discovered checks, pins, en passant captures exposing the
+// king and castling through attacked squares.
+TEST(ChessBoard, MoveGenTrickyPositions) {
+  ChessBoard board;
+  board.SetFromFen("3k4/3p4/8/K1P4r/8/8/8/8 b - - 0 1");
+  EXPECT_EQ(Perft(board, 6), 1134888);
+  board.SetFromFen("8/8/1k6/2b5/2pP4/8/5K2/8 b - d3 0 1");
+  EXPECT_EQ(Perft(board, 6), 1440467);
+  board.SetFromFen("5k2/8/8/8/8/8/8/4K2R w K - 0 1");
+  EXPECT_EQ(Perft(board, 6), 661072);
+  board.SetFromFen("r3k2r/1b4bq/8/8/8/8/7B/R3K2R w KQkq - 0 1");
+  EXPECT_EQ(Perft(board, 4), 1274206);
+  board.SetFromFen("2K2r2/4P3/8/8/8/8/8/3k4 w - - 0 1");
+  EXPECT_EQ(Perft(board, 6), 3821001);
+  board.SetFromFen("8/8/2k5/5q2/5n2/8/5K2/8 b - - 0 1");
+  EXPECT_EQ(Perft(board, 4), 23527);
+}
+
+TEST(ChessBoard, LegalPerft) {
+  EXPECT_EQ(TimedLegalPerft(ChessBoard::kStartingFen, 5), 4865609);
+  EXPECT_EQ(TimedLegalPerft("r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/"
+                            "PPPBBPPP/R3K2R w KQkq - 0 1",
+                            4),
+            4085603);
+  EXPECT_EQ(TimedLegalPerft("8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1", 5),
+            674624);
+  EXPECT_EQ(TimedLegalPerft("3k4/3p4/8/K1P4r/8/8/8/8 b - - 0 1", 6), 1134888);
+  EXPECT_EQ(TimedLegalPerft("8/8/1k6/2b5/2pP4/8/5K2/8 b - d3 0 1", 6),
+            1440467);
+  EXPECT_EQ(TimedLegalPerft("5k2/8/8/8/8/8/8/4K2R w K - 0 1", 6), 661072);
+  EXPECT_EQ(TimedLegalPerft("r3k2r/1b4bq/8/8/8/8/7B/R3K2R w KQkq - 0 1", 4),
+            1274206);
+  EXPECT_EQ(TimedLegalPerft("2K2r2/4P3/8/8/8/8/8/3k4 w - - 0 1", 6), 3821001);
+}
+
+namespace {
+// Checks that hashes of the board after @moves from @fen, which are updated
+// by ApplyMove(), are the same as of the board set from @expected_fen.
+void ExpectHashesAfterMoves(const std::string& fen,
+                            const std::vector<std::string>& moves,
+                            const std::string& expected_fen) {
+  ChessBoard board;
+  board.SetFromFen(fen);
+  for (const auto& move : moves) {
+    board.ApplyMove(Move(move, board.flipped()));
+    board.Mirror();
+  }
+  ChessBoard expected;
+  expected.SetFromFen(expected_fen);
+  EXPECT_EQ(board, expected) << expected_fen;
+  EXPECT_EQ(board.Hash(), expected.Hash()) << expected_fen;
+  EXPECT_EQ(board.FileFlippedHash(), expected.FileFlippedHash())
+      << expected_fen;
+}
+}  // namespace
+
+TEST(ChessBoard, HashAfterMoves) {
+  ExpectHashesAfterMoves(ChessBoard::kStartingFen, {"e2e4"},
+                         "rnbqkbnr/pppppppp/8/8/4P3/8/PPPP1PPP/RNBQKBNR b KQkq "
+                         "- 0 1");
+  ExpectHashesAfterMoves(ChessBoard::kStartingFen,
+                         {"g1f3", "g8f6", "f3g1", "f6g8"},
+                         ChessBoard::kStartingFen);
+  // Castling.
+  ExpectHashesAfterMoves(
+      "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+      {"e1g1", "e8c8"},
+      "2kr3r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R4RK1 w - - 2 2");
+  // En passant flag and capture.
+  ExpectHashesAfterMoves("8/8/8/8/3p4/8/4P3/4K2k w - - 0 1", {"e2e4"},
+                         "8/8/8/8/3pP3/8/8/4K2k b - e3 0 1");
+  ExpectHashesAfterMoves("8/8/1k6/2b5/2pP4/8/5K2/8 b - d3 0 1", {"c4d3"},
+                         "8/8/1k6/2b5/8/3p4/5K2/8 w - - 0 2");
+  // Promotion with capture.
+  ExpectHashesAfterMoves("2K2r2/4P3/8/8/8/8/8/3k4 w - - 0 1", {"e7f8q"},
+                         "2K2Q2/8/8/8/8/8/8/3k4 b - - 0 1");
+}
+
+TEST(ChessBoard, HashDependsOnSideToMove) {
+  ChessBoard white;
+  white.SetFromFen("8/8/1k6/2b5/8/8/5K2/8 w - - 0 1");
+  ChessBoard black;
+  black.SetFromFen("8/8/1k6/2b5/8/8/5K2/8 b - - 0 1");
+  EXPECT_NE(white.Hash(), black.Hash());
+}
+
+TEST(ChessBoard, FileFlippedHash) {
+  ChessBoard board;
+  board.SetFromFen("8/8/1k6/2b5/2pP4/8/5K2/8 b - d3 0 1");
+  ChessBoard flipped;
+  flipped.SetFromFen("8/8/6k1/5b2/4Pp2/8/2K5/8 b - e3 0 1");
+  EXPECT_EQ(board.FileFlippedHash(), flipped.Hash());
+  EXPECT_EQ(board.Hash(), flipped.FileFlippedHash());
+  board.FlipFiles();
+  EXPECT_EQ(board, flipped);
+  EXPECT_EQ(board.Hash(), flipped.Hash());
+}
+
 TEST(ChessBoard, HasMatingMaterialStartPosition) {
   ChessBoard board;
   board.SetFromFen(ChessBoard::kStartingFen);
@@ -236,6 +364,33 @@ TEST(ChessBoard, HasMatingMaterialMultipleBishopsNotSameColor) {
   EXPECT_TRUE(board.HasMatingMaterial());
 }
 
+TEST(ChessBoard, FlipFiles) {
+  ChessBoard board;
+  board.SetFromFen("8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 1 1");
+  ChessBoard flipped;
+  flipped.SetFromFen("8/5p2/4p3/r5PK/k1p3R1/8/1P1P4/8 w - - 1 1");
+  ChessBoard board_flipped = board;
+  board_flipped.FlipFiles();
+  EXPECT_EQ(board_flipped, flipped);
+  EXPECT_EQ(Perft(board_flipped, 3), 2812);
+
+  // Moves on a flipped board are flipped moves.
+  auto moves = board.GenerateLegalMoves();
+  auto flipped_moves = flipped.GenerateLegalMoves();
+  ASSERT_EQ(moves.size(), flipped_moves.size());
+  for (auto move : moves) {
+    move.FlipFiles();
+    EXPECT_NE(std::find(flipped_moves.begin(), flipped_moves.end(), move),
+              flipped_moves.end());
+  }
+
+  // En passant is flipped too.
+  board.SetFromFen("4k3/8/8/3Pp3/8/8/8/4K3 w - e6 0 1");
+  flipped.SetFromFen("3k4/8/8/3pP3/8/8/8/3K4 w - d6 0 1");
+  board.FlipFiles();
+  EXPECT_EQ(board, flipped);
+}
+
 }  // namespace lczero
 
 int main(int argc, char** argv) {
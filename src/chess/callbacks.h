@@ -67,6 +67,10 @@ struct ThinkingInfo {
   int nps = -1;
   // Hash fullness * 1000
   int hashfull = -1;
+  // Positions found in endgame tablebases.
+  int64_t tbhits = -1;
+  // Memory used by search tree, in bytes. Not a UCI field.
+  int64_t tree_bytes = -1;
   // Win in centipawns.
   optional<int> score;
   // Best line found. Moves are from perspective of white player.
@@ -113,6 +117,20 @@ struct TournamentInfo {
   // Player1's [win/draw/lose] as [white/black].
   // e.g. results[2][1] is how many times player 1 lost as black.
   int results[3][2] = {{0, 0}, {0, 0}, {0, 0}};
+
+  // NNCache counters of player1 and player2 (same for both if the cache is
+  // shared), only filled in when the tournament is finished.
+  struct CacheStats {
+    uint64_t lookups = 0;
+    uint64_t hits = 0;
+    uint64_t evictions = 0;
+    int size = 0;
+    int capacity = 0;
+  };
+  CacheStats cache_stats[2];
+  // Number of games (or with lock-step search, threads of games) played in
+  // parallel. Changes if it's adjusted to the load of the backend.
+  int parallelism = 0;
   using Callback = std::function<void(const TournamentInfo&)>;
 };
 
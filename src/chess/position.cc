@@ -26,31 +26,56 @@
 */
 
 #include "chess/position.h"
+#include <algorithm>
 #include <cassert>
 
 namespace lczero {
 
 Position::Position(const Position& parent, Move m)
-    : no_capture_ply_(parent.no_capture_ply_ + 1),
+    : us_board_(parent.us_board_),
+      no_capture_ply_(parent.no_capture_ply_ + 1),
       ply_count_(parent.ply_count_ + 1) {
-  them_board_ = parent.us_board_;
-  bool capture = them_board_.ApplyMove(m);
-  us_board_ = them_board_;
+  bool capture = us_board_.ApplyMove(m);
   us_board_.Mirror();
   if (capture) no_capture_ply_ = 0;
 }
 
 Position::Position(const ChessBoard& board, int no_capture_ply, int game_ply)
-    : no_capture_ply_(no_capture_ply), repetitions_(0), ply_count_(game_ply) {
-  us_board_ = board;
-  them_board_ = board;
-  them_board_.Mirror();
+    : us_board_(board),
+      no_capture_ply_(no_capture_ply),
+      repetitions_(0),
+      ply_count_(game_ply) {}
+
+ChessBoard Position::GetThemBoard() const {
+  ChessBoard board = us_board_;
+  board.Mirror();
+  return board;
 }
 
 uint64_t Position::Hash() const {
   return HashCat({us_board_.Hash(), static_cast<unsigned long>(repetitions_)});
 }
 
+uint64_t Position::FileFlippedHash() const {
+  return HashCat({us_board_.FileFlippedHash(),
+                  static_cast<unsigned long>(repetitions_)});
+}
+
+namespace {
+// History hashes are polynomials of position hashes in this base, so that the
+// hash of last positions is a difference of two history hashes.
+const uint64_t kHistoryHashBase = 0x9e3779b97f4a7c15ULL;
+}  // namespace
+
+void Position::SetHistoryHashes(const Position* previous) {
+  const uint64_t hashes[2] = {Hash(), FileFlippedHash()};
+  for (int i = 0; i < 2; ++i) {
+    history_hashes_[i] =
+        (previous ? previous->history_hashes_[i] * kHistoryHashBase : 0) +
+        hashes[i];
+  }
+}
+
 bool Position::CanCastle(Castling castling) const {
   auto cast = us_board_.castlings();
   switch (castling) {
@@ -91,8 +116,22 @@ GameResult PositionHistory::ComputeGameResult() const {
 
 void PositionHistory::Reset(const ChessBoard& board, int no_capture_ply,
                             int game_ply) {
+  prefix_ = nullptr;
+  prefix_length_ = 0;
   positions_.clear();
+  previous_in_slot_.clear();
+  last_in_slot_.fill(-1);
   positions_.emplace_back(board, no_capture_ply, game_ply);
+  positions_.back().SetHistoryHashes(nullptr);
+  IndexLastPosition();
+}
+
+void PositionHistory::ResetToPrefix(const PositionHistory& prefix) {
+  prefix_ = &prefix;
+  prefix_length_ = prefix.GetLength();
+  positions_.clear();
+  previous_in_slot_.clear();
+  last_in_slot_ = prefix.last_in_slot_;
 }
 
 void PositionHistory::Append(Move m) {
@@ -101,31 +140,68 @@ void PositionHistory::Append(Move m) {
   //                reallocation happens. (it also reallocates Last())
   positions_.push_back(Position(Last(), m));
   positions_.back().SetRepetitions(ComputeLastMoveRepetitions());
+  positions_.back().SetHistoryHashes(&GetPositionAt(GetLength() - 2));
+  IndexLastPosition();
+}
+
+void PositionHistory::Pop() {
+  assert(!positions_.empty());
+  const uint64_t hash = Last().GetBoard().Hash();
+  last_in_slot_[hash % kHashSlots] = previous_in_slot_.back();
+  previous_in_slot_.pop_back();
+  positions_.pop_back();
+}
+
+void PositionHistory::IndexLastPosition() {
+  int& last = last_in_slot_[Last().GetBoard().Hash() % kHashSlots];
+  previous_in_slot_.push_back(last);
+  last = GetLength() - 1;
 }
 
 int PositionHistory::ComputeLastMoveRepetitions() const {
-  const auto& last = positions_.back();
-  // TODO(crem) implement hash/cache based solution.
+  const auto& last = Last();
   if (last.GetNoCapturePly() < 4) return 0;
 
-  for (int idx = positions_.size() - 3; idx >= 0; idx -= 2) {
-    const auto& pos = positions_[idx];
-    if (pos.GetBoard() == last.GetBoard()) {
+  // Only positions since the last capture or pawn move can repeat. The last
+  // position is not indexed yet.
+  const int first = std::max(0, GetLength() - 1 - last.GetNoCapturePly());
+  const uint64_t hash = last.GetBoard().Hash();
+  for (int idx = last_in_slot_[hash % kHashSlots]; idx >= first;
+       idx = GetPreviousInSlot(idx)) {
+    const auto& pos = GetPositionAt(idx);
+    if (pos.GetBoard().Hash() == hash && pos.GetBoard() == last.GetBoard()) {
       return 1 + pos.GetRepetitions();
     }
-    if (pos.GetNoCapturePly() < 2) return 0;
   }
   return 0;
 }
 
-uint64_t PositionHistory::HashLast(int positions) const {
-  uint64_t hash = positions;
-  for (auto iter = positions_.rbegin(), end = positions_.rend(); iter != end;
-       ++iter) {
-    if (!positions--) break;
-    hash = HashCat(hash, iter->Hash());
+uint64_t PositionHistory::HashLast(int positions, bool flip_files) const {
+  uint64_t hash = Last().GetHistoryHash(flip_files);
+  const int first = GetLength() - positions - 1;
+  if (first >= 0) {
+    // Removes positions before the last ones from the polynomial.
+    uint64_t power = 1;
+    for (int i = 0; i < positions; ++i) power *= kHistoryHashBase;
+    hash -= GetPositionAt(first).GetHistoryHash(flip_files) * power;
+  }
+  return HashCat({static_cast<uint64_t>(positions), hash,
+                  static_cast<uint64_t>(Last().GetNoCapturePly())});
+}
+
+bool PositionHistory::HasCastlingRights(int positions) const {
+  for (int idx = GetLength() - 1; idx >= 0 && positions--; --idx) {
+    if (GetPositionAt(idx).GetBoard().castlings().as_int() != 0) return true;
   }
-  return HashCat(hash, Last().GetNoCapturePly());
+  return false;
+}
+
+bool PositionHistory::DidRepeatSinceLastZeroingMove() const {
+  const int first = std::max(0, GetLength() - 1 - Last().GetNoCapturePly());
+  for (int idx = GetLength() - 1; idx >= first; --idx) {
+    if (GetPositionAt(idx).GetRepetitions() > 0) return true;
+  }
+  return false;
 }
 
 }  // namespace lczero
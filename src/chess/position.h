@@ -27,6 +27,7 @@
 
 #pragma once
 
+#include <array>
 #include <string>
 #include "chess/board.h"
 
@@ -42,6 +43,8 @@ class Position {
   enum Castling { WE_CAN_OOO, WE_CAN_OO, THEY_CAN_OOO, THEY_CAN_OO };
 
   uint64_t Hash() const;
+  // Hash of the position with a and h files flipped.
+  uint64_t FileFlippedHash() const;
   bool IsBlackToMove() const { return us_board_.flipped(); }
 
   // Number of half-moves since beginning of the game.
@@ -54,6 +57,15 @@ class Position {
   // set it.
   void SetRepetitions(int repetitions) { repetitions_ = repetitions; }
 
+  // Running hash of this position and all positions before it in the game, or
+  // of their @flip_files versions.
+  uint64_t GetHistoryHash(bool flip_files) const {
+    return history_hashes_[flip_files];
+  }
+  // Computes history hashes from those of the @previous position (nullptr for
+  // the first one). Has to be called after repetitions are set.
+  void SetHistoryHashes(const Position* previous);
+
   // Number of ply with no captures and pawn moves.
   int GetNoCapturePly() const { return no_capture_ply_; }
 
@@ -62,16 +74,15 @@ class Position {
 
   // Gets board from the point of view of player to move.
   const ChessBoard& GetBoard() const { return us_board_; }
-  // Gets board from the point of view of opponent.
-  const ChessBoard& GetThemBoard() const { return them_board_; }
+  // Gets board from the point of view of opponent. It's not stored, but
+  // mirrored on every call.
+  ChessBoard GetThemBoard() const;
 
   std::string DebugString() const;
 
  private:
   // The board from the point of view of the player to move.
   ChessBoard us_board_;
-  // The board from the point of view of opponent.
-  ChessBoard them_board_;
 
   // How many half-moves without capture or pawn move was there.
   int no_capture_ply_ = 0;
@@ -79,6 +90,8 @@ class Position {
   int repetitions_;
   // number of half-moves since beginning of the game.
   int ply_count_ = 0;
+  // Plain and file flipped history hashes.
+  uint64_t history_hashes_[2] = {};
 };
 
 enum class GameResult { UNDECIDED, WHITE_WON, DRAW, BLACK_WON };
@@ -89,30 +102,42 @@ class PositionHistory {
   PositionHistory(const PositionHistory& other) = default;
 
   // Returns first position of the game (or fen from which it was initialized).
-  const Position& Starting() const { return positions_.front(); }
+  const Position& Starting() const { return GetPositionAt(0); }
 
   // Returns the latest position of the game.
-  const Position& Last() const { return positions_.back(); }
+  const Position& Last() const {
+    return positions_.empty() ? prefix_->Last() : positions_.back();
+  }
 
   // N-th position of the game, 0-based.
-  const Position& GetPositionAt(int idx) const { return positions_[idx]; }
+  const Position& GetPositionAt(int idx) const {
+    return idx < prefix_length_ ? prefix_->GetPositionAt(idx)
+                                : positions_[idx - prefix_length_];
+  }
 
-  // Trims position to a given size.
+  // Trims position to a given size, which can't be less than the length of
+  // the prefix.
   void Trim(int size) {
-    positions_.erase(positions_.begin() + size, positions_.end());
+    while (GetLength() > size) Pop();
   }
 
   // Number of positions in history.
-  int GetLength() const { return positions_.size(); }
+  int GetLength() const { return prefix_length_ + positions_.size(); }
 
   // Resets the position to a given state.
   void Reset(const ChessBoard& board, int no_capture_ply, int game_ply);
 
+  // Resets the history to continue @prefix, which is not copied, so it must
+  // not change while this history is used. Positions after it are stored in
+  // buffers which keep their capacity, so that a search descending from the
+  // end of the game over and over doesn't copy or allocate anything.
+  void ResetToPrefix(const PositionHistory& prefix);
+
   // Appends a position to history.
   void Append(Move m);
 
   // Pops last move from history.
-  void Pop() { positions_.pop_back(); }
+  void Pop();
 
   // Finds the endgame state (win/lose/draw/nothing) for the last position.
   GameResult ComputeGameResult() const;
@@ -120,13 +145,40 @@ class PositionHistory {
   // Returns whether next move is history should be black's.
   bool IsBlackToMove() const { return Last().IsBlackToMove(); }
 
-  // Builds a hash from last X positions.
-  uint64_t HashLast(int positions) const;
+  // Builds a hash from last X positions. If @flip_files, hashes them with a
+  // and h files flipped. Takes constant time, from history hashes of
+  // positions.
+  uint64_t HashLast(int positions, bool flip_files = false) const;
+
+  // Returns whether any of last X positions has castling rights for either
+  // side.
+  bool HasCastlingRights(int positions) const;
+
+  // Returns whether some position since the last capture or pawn move was a
+  // repetition.
+  bool DidRepeatSinceLastZeroingMove() const;
 
  private:
   int ComputeLastMoveRepetitions() const;
+  // Adds the last position to the index of positions by hash.
+  void IndexLastPosition();
+  // Returns the index of the position before @idx in its slot, or -1.
+  int GetPreviousInSlot(int idx) const {
+    return idx < prefix_length_ ? prefix_->GetPreviousInSlot(idx)
+                                : previous_in_slot_[idx - prefix_length_];
+  }
 
+  // Positions before prefix_length_ are those of prefix_, positions_ are the
+  // ones after.
+  const PositionHistory* prefix_ = nullptr;
+  int prefix_length_ = 0;
   std::vector<Position> positions_;
+  // Positions are indexed by the lower bits of their board hashes, which
+  // select a slot. For every slot, the index of the last position in it, or
+  // -1, and for every position, the index of the previous one in its slot.
+  static const int kHashSlots = 64;
+  std::array<int, kHashSlots> last_in_slot_;
+  std::vector<int> previous_in_slot_;
 };
 
 }  // namespace lczero
@@ -56,6 +56,102 @@ TEST(PositionHistory, ComputeLastMoveRepetitionsWithLegalEnPassant) {
   EXPECT_EQ(repeated_position.GetRepetitions(), 0);
 }
 
+TEST(PositionHistory, ComputeLastMoveRepetitionsAfterPop) {
+  ChessBoard board;
+  PositionHistory history;
+  board.SetFromFen(ChessBoard::kStartingFen);
+  history.Reset(board, 0, 0);
+  for (int i = 0; i < 2; ++i) {
+    history.Append(Move("g1f3", false));
+    history.Append(Move("g8f6", true));
+    history.Append(Move("f3g1", false));
+    history.Append(Move("f6g8", true));
+  }
+  EXPECT_EQ(history.Last().GetRepetitions(), 2);
+  history.Trim(4);
+  history.Append(Move("f6g8", true));
+  EXPECT_EQ(history.Last().GetRepetitions(), 1);
+  history.Pop();
+  history.Pop();
+  history.Append(Move("b1c3", false));
+  history.Append(Move("f6g8", true));
+  EXPECT_EQ(history.Last().GetRepetitions(), 0);
+}
+
+TEST(PositionHistory, DidRepeatSinceLastZeroingMove) {
+  ChessBoard board;
+  PositionHistory history;
+  board.SetFromFen(ChessBoard::kStartingFen);
+  history.Reset(board, 0, 0);
+  history.Append(Move("g1f3", false));
+  history.Append(Move("g8f6", true));
+  history.Append(Move("f3g1", false));
+  EXPECT_FALSE(history.DidRepeatSinceLastZeroingMove());
+  history.Append(Move("f6g8", true));
+  EXPECT_TRUE(history.DidRepeatSinceLastZeroingMove());
+  history.Append(Move("g1f3", false));
+  EXPECT_TRUE(history.DidRepeatSinceLastZeroingMove());
+  history.Append(Move("e7e5", true));
+  EXPECT_FALSE(history.DidRepeatSinceLastZeroingMove());
+}
+
+TEST(PositionHistory, ResetToPrefix) {
+  ChessBoard board;
+  PositionHistory game;
+  board.SetFromFen(ChessBoard::kStartingFen);
+  game.Reset(board, 0, 0);
+  game.Append(Move("g1f3", false));
+  game.Append(Move("g8f6", true));
+
+  PositionHistory copy = game;
+  PositionHistory continuation;
+  continuation.ResetToPrefix(game);
+  for (auto* history : {&copy, &continuation}) {
+    history->Append(Move("f3g1", false));
+    history->Append(Move("f6g8", true));
+  }
+  EXPECT_EQ(continuation.GetLength(), 5);
+  EXPECT_EQ(continuation.Last().GetRepetitions(), 1);
+  EXPECT_EQ(continuation.HashLast(5), copy.HashLast(5));
+  EXPECT_EQ(continuation.HashLast(3, true), copy.HashLast(3, true));
+  EXPECT_EQ(continuation.GetPositionAt(1).Hash(), game.GetPositionAt(1).Hash());
+
+  continuation.Trim(game.GetLength());
+  EXPECT_EQ(continuation.Last().Hash(), game.Last().Hash());
+  continuation.Append(Move("f3g1", false));
+  continuation.Append(Move("f6g8", true));
+  EXPECT_EQ(continuation.Last().GetRepetitions(), 1);
+  EXPECT_EQ(game.GetLength(), 3);
+}
+
+TEST(PositionHistory, HashLastDependsOnLastPositionsOnly) {
+  ChessBoard board;
+  PositionHistory history;
+  board.SetFromFen(ChessBoard::kStartingFen);
+  history.Reset(board, 0, 0);
+  history.Append(Move("g1f3", false));
+  history.Append(Move("g8f6", true));
+  history.Append(Move("b1c3", false));
+
+  PositionHistory shorter;
+  board.SetFromFen(
+      "rnbqkbnr/pppppppp/8/8/8/5N2/PPPPPPPP/RNBQKB1R b KQkq - 1 1");
+  shorter.Reset(board, 1, 1);
+  shorter.Append(Move("g8f6", true));
+  shorter.Append(Move("b1c3", false));
+
+  for (const bool flip_files : {false, true}) {
+    EXPECT_EQ(history.HashLast(1, flip_files),
+              shorter.HashLast(1, flip_files));
+    EXPECT_EQ(history.HashLast(3, flip_files),
+              shorter.HashLast(3, flip_files));
+    EXPECT_NE(history.HashLast(4, flip_files),
+              shorter.HashLast(4, flip_files));
+    EXPECT_NE(history.HashLast(2, flip_files),
+              history.HashLast(3, flip_files));
+  }
+}
+
 }  // namespace lczero
 
 int main(int argc, char** argv) {
@@ -36,6 +36,7 @@
 #include <unordered_set>
 #include <utility>
 #include "utils/exception.h"
+#include "utils/mutex.h"
 #include "utils/string.h"
 #include "version.h"
 
@@ -51,8 +52,12 @@ const std::unordered_map<std::string, std::unordered_set<std::string>>
         {{"position"}, {"fen", "startpos", "moves"}},
         {{"go"},
          {"infinite", "wtime", "btime", "winc", "binc", "movestogo", "depth",
-          "nodes", "movetime", "searchmoves"}},
+          "nodes", "movetime", "searchmoves", "ponder"}},
+        {{"ponderhit"}, {}},
         {{"start"}, {}},
+        {{"savetree"}, {"file"}},
+        {{"loadtree"}, {"file"}},
+        {{"lockstats"}, {}},
         {{"stop"}, {}},
         {{"quit"}, {}},
 };
@@ -165,6 +170,12 @@ bool UciLoop::DispatchCommand(
       }
       go_params.infinite = true;
     }
+    if (ContainsKey(params, "ponder")) {
+      if (!GetOrEmpty(params, "ponder").empty()) {
+        throw Exception("Unexpected token " + GetOrEmpty(params, "ponder"));
+      }
+      go_params.ponder = true;
+    }
     if (ContainsKey(params, "searchmoves")) {
       go_params.searchmoves =
           StrSplitAtWhitespace(GetOrEmpty(params, "searchmoves"));
@@ -185,8 +196,16 @@ bool UciLoop::DispatchCommand(
     CmdGo(go_params);
   } else if (command == "stop") {
     CmdStop();
+  } else if (command == "ponderhit") {
+    CmdPonderHit();
   } else if (command == "start") {
     CmdStart();
+  } else if (command == "savetree") {
+    CmdSaveTree(GetOrEmpty(params, "file"));
+  } else if (command == "loadtree") {
+    CmdLoadTree(GetOrEmpty(params, "file"));
+  } else if (command == "lockstats") {
+    DumpLockStats();
   } else if (command == "quit") {
     return false;
   } else {
@@ -244,6 +263,10 @@ void UciLoop::SendInfo(const ThinkingInfo& info) {
   if (info.score) res += " score cp " + std::to_string(*info.score);
   if (info.hashfull >= 0) res += " hashfull " + std::to_string(info.hashfull);
   if (info.nps >= 0) res += " nps " + std::to_string(info.nps);
+  if (info.tbhits >= 0) res += " tbhits " + std::to_string(info.tbhits);
+  if (info.tree_bytes >= 0) {
+    res += " treebytes " + std::to_string(info.tree_bytes);
+  }
 
   if (!info.pv.empty()) {
     res += " pv";
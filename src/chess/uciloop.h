@@ -46,6 +46,7 @@ struct GoParams {
   int nodes = -1;
   std::int64_t movetime = -1;
   bool infinite = false;
+  bool ponder = false;
   std::vector<std::string> searchmoves;
 };
 
@@ -79,7 +80,16 @@ class UciLoop {
     throw Exception("Not supported");
   }
   virtual void CmdStop() { throw Exception("Not supported"); }
+  virtual void CmdPonderHit() { throw Exception("Not supported"); }
   virtual void CmdStart() { throw Exception("Not supported"); }
+  // Non-standard commands to save and load the search tree of the current
+  // position.
+  virtual void CmdSaveTree(const std::string& /*filename*/) {
+    throw Exception("Not supported");
+  }
+  virtual void CmdLoadTree(const std::string& /*filename*/) {
+    throw Exception("Not supported");
+  }
 
   void SetLogFilename(const std::string& filename);
 
@@ -26,14 +26,18 @@
 */
 
 #include <algorithm>
+#include <chrono>
 #include <cmath>
 #include <functional>
+#include <iostream>
 
 #include "engine.h"
 #include "mcts/search.h"
 #include "neural/factory.h"
 #include "neural/loader.h"
 #include "utils/configfile.h"
+#include "utils/numa.h"
+#include "utils/trace.h"
 
 namespace lczero {
 namespace {
@@ -52,9 +56,39 @@ const char* kMoveOverheadStr = "Move time overhead in milliseconds";
 const char* kTimeCurvePeak = "Time weight curve peak ply";
 const char* kTimeCurveRightWidth = "Time weight curve width right of peak";
 const char* kTimeCurveLeftWidth = "Time weight curve width left of peak";
+const char* kPonderStr = "Ponder";
+const char* kColdSearchReserveStr = "Extra time for cold backend search, ms";
+const char* kNnCacheSizeMbStr = "NNCache size, MB";
+const char* kNnCacheSharedStr = "NNCache shared memory name";
+const char* kNnCacheFileStr = "Persistent NNCache file";
+const char* kNnCacheFileReadOnlyStr = "Don't write to persistent NNCache file";
+const char* kSyzygyTablebaseStr = "List of Syzygy tablebase directories";
+const char* kTraceFileStr = "File to write a timeline trace of threads to";
+const char* kNumaStr = "Binding of threads to NUMA nodes";
 
 const char* kAutoDiscover = "<autodiscover>";
 
+std::unique_ptr<Network> LoadNetwork(const std::string& network_path,
+                                     const std::string& backend,
+                                     const std::string& backend_options,
+                                     const OptionsDict& options) {
+  OptionsDict network_options =
+      OptionsDict::FromString(backend_options, &options);
+
+  return NetworkFactory::Get()->LoadAndCreate(
+      backend,
+      [&network_path]() {
+        std::string net_path = network_path;
+        if (net_path == kAutoDiscover) {
+          net_path = DiscoverWeightsFile();
+        } else {
+          std::cerr << "Loading weights file from: " << net_path << std::endl;
+        }
+        return std::make_shared<const Weights>(LoadWeightsFromFile(net_path));
+      },
+      network_options);
+}
+
 float ComputeMoveWeight(int ply, float peak, float left_width,
                         float right_width) {
   // Inflection points of the function are at ply = peak +/- width.
@@ -82,6 +116,17 @@ void EngineController::PopulateOptions(OptionsParser* options) {
   options->Add<IntOption>(
       "NNCache size", 0, 999999999, "nncache", '\0',
       std::bind(&EngineController::SetCacheSize, this, _1)) = 200000;
+  // When non-zero, the cache is preallocated and "NNCache size" is ignored.
+  options->Add<IntOption>(kNnCacheSizeMbStr, 0, 1048576, "nncache-mb") = 0;
+  // Processes using the same name share the cache (of "NNCache size, MB").
+  options->Add<StringOption>(kNnCacheSharedStr, "nncache-shared");
+  options->Add<StringOption>(kNnCacheFileStr, "nncache-file");
+  options->Add<BoolOption>(kNnCacheFileReadOnlyStr, "nncache-file-readonly") =
+      false;
+  options->Add<StringOption>(kSyzygyTablebaseStr, "syzygy-paths", 's');
+  options->Add<StringOption>(kTraceFileStr, "trace-file");
+  options->Add<ChoiceOption>(kNumaStr, Numa::GetBindingChoices(), "numa") =
+      "none";
 
   const auto backends = NetworkFactory::Get()->GetBackendsList();
   options->Add<ChoiceOption>(kNnBackendStr, backends, "backend") =
@@ -95,6 +140,9 @@ void EngineController::PopulateOptions(OptionsParser* options) {
                             "time-curve-left-width") = 82.0f;
   options->Add<FloatOption>(kTimeCurveRightWidth, 0.0f, 1000.0f,
                             "time-curve-right-width") = 74.0f;
+  options->Add<BoolOption>(kPonderStr, "ponder") = false;
+  options->Add<IntOption>(kColdSearchReserveStr, 0, 100000,
+                          "cold-search-reserve") = 0;
 
   Search::PopulateUciParams(options);
   ConfigFile::PopulateOptions(options);
@@ -111,8 +159,16 @@ void EngineController::PopulateOptions(OptionsParser* options) {
 SearchLimits EngineController::PopulateSearchLimits(int ply, bool is_black,
                                                     const GoParams& params) {
   SearchLimits limits;
+  if (params.ponder) {
+    // Limits only apply after ponderhit, search until then.
+    limits.infinite = true;
+    return limits;
+  }
   limits.visits = params.nodes;
   limits.time_ms = params.movetime;
+  const auto nps_iter = nps_estimates_.find(GetNpsKey());
+  const bool cold = nps_iter == nps_estimates_.end();
+  if (!cold) limits.expected_nps = nps_iter->second;
   int64_t time = (is_black ? params.btime : params.wtime);
   limits.infinite = params.infinite;
   if (!params.searchmoves.empty()) {
@@ -159,6 +215,10 @@ SearchLimits EngineController::PopulateSearchLimits(int ply, bool is_black,
     this_move_time *= slowmover;
   }
 
+  // The first search with the backend (and batch size) also pays for its
+  // warm-up, so give it some extra time.
+  if (cold) this_move_time += options_.Get<int>(kColdSearchReserveStr);
+
   // Make sure we don't exceed current time limit with what we calculated.
   limits.time_ms = std::max(
       int64_t{0},
@@ -172,72 +232,220 @@ void EngineController::UpdateNetwork() {
   std::string backend = options_.Get<std::string>(kNnBackendStr);
   std::string backend_options = options_.Get<std::string>(kNnBackendOptionsStr);
 
-  if (network_path == network_path_ && backend == backend_ &&
-      backend_options == backend_options_)
+  if (network_ && network_path == network_path_ && backend == backend_ &&
+      backend_options == backend_options_) {
+    // Back to the current network, a load of another one is dropped.
+    pending_network_ = {};
+    return;
+  }
+  if (pending_network_.valid() && network_path == pending_network_path_ &&
+      backend == pending_backend_ &&
+      backend_options == pending_backend_options_) {
     return;
+  }
 
-  network_path_ = network_path;
-  backend_ = backend;
-  backend_options_ = backend_options;
+  if (!network_) {
+    // With no search yet, the cache and tablebases are set up meanwhile.
+    auto updated = std::async(std::launch::async, [this]() {
+      const auto start = std::chrono::steady_clock::now();
+      UpdateCacheAndTablebases();
+      const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                          std::chrono::steady_clock::now() - start)
+                          .count();
+      std::cerr << "NNCache and tablebases setup took " << ms
+                << "ms, in parallel." << std::endl;
+    });
+    network_ = LoadNetwork(network_path, backend, backend_options, options_);
+    network_path_ = network_path;
+    backend_ = backend;
+    backend_options_ = backend_options;
+    warm_batch_size_ = 0;
+    updated.get();
+    return;
+  }
 
-  std::string net_path = network_path;
-  if (net_path == kAutoDiscover) {
-    net_path = DiscoverWeightsFile();
-  } else {
-    std::cerr << "Loading weights file from: " << net_path << std::endl;
+  // Searches go on with the current network meanwhile. A load which is still
+  // in progress is waited for (by the destructor of its future) and dropped.
+  // Options are copied, as they may be changed while loading.
+  auto options = std::make_shared<OptionsDict>(options_);
+  const int batch_size = options_.Get<int>(Search::kMiniBatchSizeStr);
+  pending_warm_batch_size_ = batch_size;
+  pending_network_path_ = network_path;
+  pending_backend_ = backend;
+  pending_backend_options_ = backend_options;
+  pending_network_ = std::async(std::launch::async, [=]() {
+    auto network =
+        LoadNetwork(network_path, backend, backend_options, *options);
+    const auto start = std::chrono::steady_clock::now();
+    network->Warmup(batch_size);
+    const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+    std::cerr << "Backend warm-up took " << ms << "ms." << std::endl;
+    return network;
+  });
+}
+
+void EngineController::SwapNetwork() {
+  if (!pending_network_.valid() ||
+      pending_network_.wait_for(std::chrono::seconds(0)) !=
+          std::future_status::ready) {
+    return;
   }
-  Weights weights = LoadWeightsFromFile(net_path);
+  network_ = pending_network_.get();
+  network_path_ = pending_network_path_;
+  backend_ = pending_backend_;
+  backend_options_ = pending_backend_options_;
+  warm_batch_size_ = pending_warm_batch_size_;
+  // Instead of clearing the cache, entries of the old network are left to be
+  // evicted.
+  ++cache_generation_;
+}
 
-  OptionsDict network_options =
-      OptionsDict::FromString(backend_options, &options_);
+std::string EngineController::GetNpsKey() const {
+  return network_path_ + "|" + backend_ + "|" + backend_options_ + "|" +
+         std::to_string(options_.Get<int>(Search::kMiniBatchSizeStr));
+}
 
-  network_ = NetworkFactory::Get()->Create(backend, weights, network_options);
+void EngineController::ResetSearch() {
+  if (!search_) return;
+  search_->Abort();
+  search_->Wait();
+  const float nps = search_->GetPlayoutsPerSecond();
+  search_.reset();
+  if (nps <= 0.0f) return;
+  // Average with the previous estimate, as speed of a single search is noisy
+  // (and that of the first one also includes backend warm-up).
+  const auto key = GetNpsKey();
+  auto iter = nps_estimates_.find(key);
+  if (iter == nps_estimates_.end()) {
+    nps_estimates_.emplace(key, static_cast<int64_t>(nps));
+  } else {
+    iter->second = static_cast<int64_t>((iter->second + nps) / 2);
+  }
 }
 
 void EngineController::SetCacheSize(int size) { cache_.SetCapacity(size); }
 
+void EngineController::UpdateCacheAndTablebases() {
+  // Reallocating the cache is only safe with no search running.
+  cache_.SetSizeMb(options_.Get<int>(kNnCacheSizeMbStr),
+                   options_.Get<std::string>(kNnCacheSharedStr));
+  cache_.SetDiskCache(options_.Get<std::string>(kNnCacheFileStr),
+                      options_.Get<bool>(kNnCacheFileReadOnlyStr));
+  const auto syzygy_paths = options_.Get<std::string>(kSyzygyTablebaseStr);
+  if (!syzygy_tb_ || syzygy_tb_->GetPaths() != syzygy_paths) {
+    syzygy_tb_ = std::make_unique<SyzygyTablebase>();
+    if (!syzygy_paths.empty()) syzygy_tb_->Init(syzygy_paths);
+  }
+}
+
 void EngineController::EnsureReady() {
   UpdateNetwork();
   std::unique_lock<RpSharedMutex> lock(busy_mutex_);
+  // A network being loaded is waited for, so that the next search uses it.
+  // It can't replace the network of an existing search, then Go() swaps it.
+  if (pending_network_.valid()) {
+    pending_network_.wait();
+    if (!search_) SwapNetwork();
+  }
+  // Warm up before reporting ready, so that the first search doesn't pay
+  // for it. The one still pending is warmed up already.
+  if (pending_network_.valid()) return;
+  const int batch_size = options_.Get<int>(Search::kMiniBatchSizeStr);
+  if (network_ && warm_batch_size_ != batch_size) {
+    const auto start = std::chrono::steady_clock::now();
+    network_->Warmup(batch_size);
+    const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+    std::cerr << "Backend warm-up took " << ms << "ms." << std::endl;
+    warm_batch_size_ = batch_size;
+  }
 }
 
 void EngineController::NewGame() {
   SharedLock lock(busy_mutex_);
   cache_.Clear();
-  search_.reset();
+  ResetSearch();
   tree_.reset();
+  position_fen_ = ChessBoard::kStartingFen;
+  position_moves_.clear();
+  pondering_ = false;
   UpdateNetwork();
 }
 
 void EngineController::SetPosition(const std::string& fen,
                                    const std::vector<std::string>& moves_str) {
   SharedLock lock(busy_mutex_);
-  search_.reset();
+  ResetSearch();
+  pondering_ = false;
+
+  // The tree is moved to the position only in Go(), as "go ponder" keeps
+  // the alternatives to the last (predicted) move in the tree.
+  position_fen_ = fen;
+  position_moves_.clear();
+  for (const auto& move : moves_str) position_moves_.emplace_back(move);
+  UpdateNetwork();
+}
 
+void EngineController::PrepareTree() {
   if (!tree_) tree_ = std::make_unique<NodeTree>();
+  tree_->ResetToPosition(position_fen_, position_moves_);
+}
 
-  std::vector<Move> moves;
-  for (const auto& move : moves_str) moves.emplace_back(move);
-  tree_->ResetToPosition(fen, moves);
-  UpdateNetwork();
+uint64_t EngineController::SaveTree(const std::string& filename) {
+  SharedLock lock(busy_mutex_);
+  ResetSearch();
+  PrepareTree();
+  return tree_->SaveHeadSubtree(filename);
+}
+
+uint64_t EngineController::LoadTree(const std::string& filename) {
+  SharedLock lock(busy_mutex_);
+  ResetSearch();
+  PrepareTree();
+  return tree_->LoadHeadSubtree(filename);
 }
 
 void EngineController::Go(const GoParams& params) {
-  if (!tree_) {
-    SetPosition(ChessBoard::kStartingFen, {});
-  }
+  ResetSearch();
+  // Applies to threads started from now on, backend ones included.
+  Numa::SetBinding(options_.Get<std::string>(kNumaStr));
+  SwapNetwork();
+  UpdateCacheAndTablebases();
+  // The trace is written when the file changes, and at exit.
+  Tracer::Get().SetFile(options_.Get<std::string>(kTraceFileStr));
+  if (!tree_) tree_ = std::make_unique<NodeTree>();
+  tree_->ResetToPosition(position_fen_, position_moves_, params.ponder);
+  go_params_ = params;
+  pondering_ = params.ponder;
 
   auto limits = PopulateSearchLimits(tree_->GetPlyCount(),
                                      tree_->IsBlackToMove(), params);
 
   search_ =
       std::make_unique<Search>(*tree_, network_.get(), best_move_callback_,
-                               info_callback_, limits, options_, &cache_);
+                               info_callback_, limits, options_, &cache_,
+                               syzygy_tb_->GetMaxCardinality() > 0
+                                   ? syzygy_tb_.get()
+                                   : nullptr,
+                               cache_generation_);
 
   search_->StartThreads(options_.Get<int>(kThreadsOption));
 }
 
+void EngineController::PonderHit() {
+  if (!pondering_) return;
+  // The predicted move was played, so the tree is kept as is and the search
+  // restarts with the time limits of the original "go ponder".
+  GoParams params = go_params_;
+  params.ponder = false;
+  Go(params);
+}
+
 void EngineController::Stop() {
+  pondering_ = false;
   if (search_) {
     search_->Stop();
     search_->Wait();
@@ -305,6 +513,21 @@ void EngineLoop::CmdGo(const GoParams& params) {
   engine_.Go(params);
 }
 
+void EngineLoop::CmdSaveTree(const std::string& filename) {
+  const auto nodes = engine_.SaveTree(filename);
+  SendResponse("info string Saved " + std::to_string(nodes) + " nodes to " +
+               filename);
+}
+
+void EngineLoop::CmdLoadTree(const std::string& filename) {
+  EnsureOptionsSent();
+  const auto nodes = engine_.LoadTree(filename);
+  SendResponse("info string Loaded " + std::to_string(nodes) + " nodes from " +
+               filename);
+}
+
+void EngineLoop::CmdPonderHit() { engine_.PonderHit(); }
+
 void EngineLoop::CmdStop() { engine_.Stop(); }
 
 }  // namespace lczero
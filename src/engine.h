@@ -27,6 +27,10 @@
 
 #pragma once
 
+#include <future>
+#include <string>
+#include <unordered_map>
+
 #include "chess/uciloop.h"
 #include "mcts/search.h"
 #include "neural/cache.h"
@@ -67,6 +71,12 @@ class EngineController {
   // Must not block.
   void Go(const GoParams& params);
   // Must not block.
+  void PonderHit();
+  // Blocks. Save or load the tree of the last set position, return the
+  // number of nodes.
+  uint64_t SaveTree(const std::string& filename);
+  uint64_t LoadTree(const std::string& filename);
+  // Must not block.
   void Stop();
   void SetCacheSize(int size);
 
@@ -74,7 +84,23 @@ class EngineController {
                                     const GoParams& params);
 
  private:
+  // Loads the network of the current settings if they have changed. If there
+  // is a network already, the new one is loaded and warmed up in the
+  // background, and replaces the old one in SwapNetwork().
   void UpdateNetwork();
+  // Replaces the network by the one loaded in the background, if it's ready,
+  // without waiting for it. Must not be called while searching.
+  void SwapNetwork();
+  // Applies the cache and tablebase settings. Must not be called while
+  // searching.
+  void UpdateCacheAndTablebases();
+  // Stops and destroys the current search, if any, updating the speed
+  // estimate from it.
+  void ResetSearch();
+  // Moves the tree to the last set position.
+  void PrepareTree();
+  // Speed estimates are kept separately per network, backend and batch size.
+  std::string GetNpsKey() const;
 
   const OptionsDict& options_;
 
@@ -83,19 +109,42 @@ class EngineController {
 
   NNCache cache_;
   std::unique_ptr<Network> network_;
+  // Tags cache entries of network_ (see Search::Search()).
+  uint32_t cache_generation_ = 0;
+  // Network being loaded in the background, and the batch size it's warmed up
+  // with.
+  std::future<std::unique_ptr<Network>> pending_network_;
+  int pending_warm_batch_size_ = 0;
+  // Settings of the pending network, which become the current ones when it
+  // is swapped in.
+  std::string pending_network_path_;
+  std::string pending_backend_;
+  std::string pending_backend_options_;
+  // Tablebases of the current settings, reloaded when their paths change.
+  std::unique_ptr<SyzygyTablebase> syzygy_tb_;
 
   // Locked means that there is some work to wait before responding readyok.
-  RpSharedMutex busy_mutex_;
+  RpSharedMutex busy_mutex_{"engine busy"};
   using SharedLock = std::shared_lock<RpSharedMutex>;
 
   std::unique_ptr<Search> search_;
   std::unique_ptr<NodeTree> tree_;
 
-  // Store current network settings to track when they change so that they
-  // are reloaded.
+  // Position of the last "position" command, applied to the tree on Go().
+  std::string position_fen_ = ChessBoard::kStartingFen;
+  std::vector<Move> position_moves_;
+  // Parameters of the last Go(), reused on ponderhit.
+  GoParams go_params_;
+  bool pondering_ = false;
+  // Playouts per second of earlier searches, by GetNpsKey().
+  std::unordered_map<std::string, int64_t> nps_estimates_;
+
+  // Settings of network_, to track when they change so that it's reloaded.
   std::string network_path_;
   std::string backend_;
   std::string backend_options_;
+  // Batch size the current network was warmed up with, 0 if it wasn't.
+  int warm_batch_size_ = 0;
 };
 
 class EngineLoop : public UciLoop {
@@ -111,6 +160,9 @@ class EngineLoop : public UciLoop {
   void CmdPosition(const std::string& position,
                    const std::vector<std::string>& moves) override;
   void CmdGo(const GoParams& params) override;
+  void CmdPonderHit() override;
+  void CmdSaveTree(const std::string& filename) override;
+  void CmdLoadTree(const std::string& filename) override;
   void CmdStop() override;
 
  private:
@@ -26,9 +26,19 @@
 */
 
 #include <iostream>
+#include "analysis/analyzer.h"
+#include "benchmark/backendbench.h"
+#include "benchmark/searchbench.h"
 #include "engine.h"
+#include "neural/diskcache.h"
+#include "neural/loader.h"
+#include "neural/remote/server.h"
+#include "neural/writer.h"
 #include "selfplay/loop.h"
 #include "utils/commandline.h"
+#include "utils/exception.h"
+#include "utils/optionsparser.h"
+#include "utils/string.h"
 #include "version.h"
 
 int main(int argc, const char** argv) {
@@ -39,11 +49,112 @@ int main(int argc, const char** argv) {
   CommandLine::Init(argc, argv);
   CommandLine::RegisterMode("uci", "(default) Act as UCI engine");
   CommandLine::RegisterMode("selfplay", "Play games with itself");
+  CommandLine::RegisterMode("mergecache",
+                            "Merge or compact persistent NNCache files");
+  CommandLine::RegisterMode(
+      "convertweights",
+      "Convert weights to binary format, which loads without parsing");
+  CommandLine::RegisterMode("nnserver",
+                            "Compute NN batches for remote backends");
+  CommandLine::RegisterMode("converttraining",
+                            "Convert sparse training data to V3 format");
+  CommandLine::RegisterMode("benchmark",
+                            "Measure search speed on a fixed set of positions");
+  CommandLine::RegisterMode(
+      "backendbench",
+      "Measure throughput and latency of backends per batch size");
+  CommandLine::RegisterMode("analyze",
+                            "Search positions of a FEN or EPD file in bulk");
 
   if (CommandLine::ConsumeCommand("selfplay")) {
     // Selfplay mode.
     SelfPlayLoop loop;
     loop.RunLoop();
+  } else if (CommandLine::ConsumeCommand("mergecache")) {
+    // Merging persistent cache files.
+    const char* kInputsStr = "Comma separated input files";
+    const char* kOutputStr = "Output file";
+    OptionsParser options;
+    options.Add<StringOption>(kInputsStr, "input");
+    options.Add<StringOption>(kOutputStr, "output");
+    if (!options.ProcessAllFlags()) return 0;
+    const auto& dict = options.GetOptionsDict();
+    try {
+      NNDiskCache::Merge(StrSplit(dict.Get<std::string>(kInputsStr), ","),
+                         dict.Get<std::string>(kOutputStr));
+    } catch (Exception& ex) {
+      std::cerr << ex.what() << std::endl;
+      return 1;
+    }
+  } else if (CommandLine::ConsumeCommand("convertweights")) {
+    // Converting weights to the binary format.
+    const char* kInputStr = "Input weights file";
+    const char* kOutputStr = "Output file";
+    OptionsParser options;
+    options.Add<StringOption>(kInputStr, "input");
+    options.Add<StringOption>(kOutputStr, "output");
+    if (!options.ProcessAllFlags()) return 0;
+    const auto& dict = options.GetOptionsDict();
+    try {
+      SaveWeightsToBinaryFile(
+          LoadWeightsFromFile(dict.Get<std::string>(kInputStr)),
+          dict.Get<std::string>(kOutputStr));
+    } catch (Exception& ex) {
+      std::cerr << ex.what() << std::endl;
+      return 1;
+    }
+  } else if (CommandLine::ConsumeCommand("converttraining")) {
+    // Converting training data for pipelines which read V3 only.
+    const char* kInputStr = "Input training data file";
+    const char* kOutputStr = "Output file";
+    OptionsParser options;
+    options.Add<StringOption>(kInputStr, "input");
+    options.Add<StringOption>(kOutputStr, "output");
+    if (!options.ProcessAllFlags()) return 0;
+    const auto& dict = options.GetOptionsDict();
+    try {
+      ConvertTrainingDataToV3(dict.Get<std::string>(kInputStr),
+                              dict.Get<std::string>(kOutputStr));
+    } catch (Exception& ex) {
+      std::cerr << ex.what() << std::endl;
+      return 1;
+    }
+  } else if (CommandLine::ConsumeCommand("benchmark")) {
+    // Measuring search speed.
+    try {
+      Benchmark benchmark;
+      benchmark.Run();
+    } catch (Exception& ex) {
+      std::cerr << ex.what() << std::endl;
+      return 1;
+    }
+  } else if (CommandLine::ConsumeCommand("backendbench")) {
+    // Measuring backends.
+    try {
+      BackendBenchmark benchmark;
+      benchmark.Run();
+    } catch (Exception& ex) {
+      std::cerr << ex.what() << std::endl;
+      return 1;
+    }
+  } else if (CommandLine::ConsumeCommand("analyze")) {
+    // Searching positions in bulk.
+    try {
+      Analyzer analyzer;
+      analyzer.Run();
+    } catch (Exception& ex) {
+      std::cerr << ex.what() << std::endl;
+      return 1;
+    }
+  } else if (CommandLine::ConsumeCommand("nnserver")) {
+    // Serving NN computations to "remote" backends.
+    try {
+      NNServer server;
+      server.Run();
+    } catch (Exception& ex) {
+      std::cerr << ex.what() << std::endl;
+      return 1;
+    }
   } else {
     // Consuming optional "uci" mode.
     CommandLine::ConsumeCommand("uci");
@@ -29,18 +29,76 @@
 
 #include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <cmath>
+#include <condition_variable>
+#include <cstddef>
 #include <cstring>
+#include <fstream>
 #include <iostream>
+#include <new>
 #include <sstream>
 #include <thread>
+#include <type_traits>
+#include "neural/cache.h"
 #include "neural/encoder.h"
 #include "neural/network.h"
 #include "utils/exception.h"
 #include "utils/hashcat.h"
+#include "utils/numa.h"
+#include "utils/slaballocator.h"
+#include "utils/trace.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 namespace lczero {
 
+/////////////////////////////////////////////////////////////////////////
+// Allocators
+/////////////////////////////////////////////////////////////////////////
+
+namespace {
+// Edge arrays are allocated in size classes, one per number of chunks. Number
+// of size classes. Enough for 256 edges, while maximum number of legal moves
+// in a chess position is 218.
+const int kEdgesSizeClasses = 32;
+
+// Allocators have to be declared before the GC, as it frees nodes when
+// destroyed.
+SlabAllocator gNodeAllocator(sizeof(Node));
+SlabAllocator gChunkAllocator(sizeof(ChildStatsChunk));
+
+// Bytes taken by an edge list of @chunks chunks: the header, edges, and chunk
+// pointers.
+size_t GetEdgesBlockSize(size_t chunks) {
+  return EdgeList::kHeaderSize +
+         chunks * (ChildStatsChunk::kSize * sizeof(Edge) +
+                   sizeof(std::atomic<ChildStatsChunk*>));
+}
+
+std::vector<std::unique_ptr<SlabAllocator>> MakeEdgesAllocators() {
+  std::vector<std::unique_ptr<SlabAllocator>> result;
+  for (int i = 1; i <= kEdgesSizeClasses; ++i) {
+    result.emplace_back(std::make_unique<SlabAllocator>(GetEdgesBlockSize(i)));
+  }
+  return result;
+}
+const std::vector<std::unique_ptr<SlabAllocator>> gEdgesAllocators =
+    MakeEdgesAllocators();
+
+SlabAllocator* GetEdgesAllocator(size_t chunks) {
+  return gEdgesAllocators[chunks - 1].get();
+}
+
+void CountMemory(TreeMemory* memory, int64_t bytes) {
+  if (memory) memory->Add(bytes);
+}
+}  // namespace
+
 /////////////////////////////////////////////////////////////////////////
 // Node garbage collector
 /////////////////////////////////////////////////////////////////////////
@@ -48,60 +106,197 @@ namespace lczero {
 namespace {
 // Periodicity of garbage collection, milliseconds.
 const int kGCIntervalMs = 100;
+// Nodes freed by a GC thread at once, before it lets others (including search
+// threads) run.
+const int kGCChunkNodes = 10000;
 
-// Every kGCIntervalMs milliseconds release nodes in a separate GC thread.
+// Every kGCIntervalMs milliseconds release nodes in separate GC threads.
+// Subtrees are freed iteratively in chunks of kGCChunkNodes. Whatever remains
+// of a subtree after a chunk goes back to the queue, so several threads can
+// share one large subtree. Freed memory returns to the slab allocators and is
+// reused for new nodes.
 class NodeGarbageCollector {
  public:
-  NodeGarbageCollector() : gc_thread_([this]() { Worker(); }) {}
+  NodeGarbageCollector() { SetThreads(1); }
 
-  // Takes ownership of a subtree, to dispose it in a separate thread when
-  // it has time.
-  void AddToGcQueue(std::unique_ptr<Node> node) {
-    if (!node) return;
+  // Takes ownership of subtrees, estimated to have @nodes nodes in total, to
+  // dispose them in a separate thread when it has time. They are counted in
+  // @memory until then.
+  void AddToGcQueue(std::vector<std::unique_ptr<Node>>* subtrees,
+                    int64_t nodes, TreeMemory* memory) {
+    if (subtrees->empty()) return;
+    nodes_pending_ += nodes;
+    std::shared_ptr<TreeMemory> memory_ref;
+    if (memory) {
+      memory_ref = memory->shared_from_this();
+      memory->AddPendingSubtrees(subtrees->size());
+    }
     Mutex::Lock lock(gc_mutex_);
-    subtrees_to_gc_.emplace_back(std::move(node));
+    for (auto& node : *subtrees) {
+      subtrees_to_gc_.push_back({std::move(node), memory_ref});
+    }
+    subtrees->clear();
+  }
+
+  // Makes GC threads free the queue now rather than at their next interval.
+  void Wake() {
+    {
+      // Under the lock, so that the wakeup isn't lost.
+      Mutex::Lock lock(gc_mutex_);
+      wake_ = true;
+    }
+    cv_.notify_all();
+  }
+
+  void SetThreads(int threads) {
+    Mutex::Lock lock(threads_mutex_);
+    {
+      Mutex::Lock gc_lock(gc_mutex_);
+      num_threads_ = threads;
+    }
+    cv_.notify_all();
+    while (static_cast<int>(gc_threads_.size()) > threads) {
+      gc_threads_.back().join();
+      gc_threads_.pop_back();
+    }
+    while (static_cast<int>(gc_threads_.size()) < threads) {
+      const int idx = gc_threads_.size();
+      gc_threads_.emplace_back([this, idx]() {
+        Numa::BindThread();
+        Worker(idx);
+      });
+    }
+  }
+
+  NodeGcStats GetStats() {
+    NodeGcStats stats;
+    {
+      Mutex::Lock lock(gc_mutex_);
+      stats.subtrees = subtrees_to_gc_.size();
+    }
+    stats.nodes_pending = std::max<int64_t>(nodes_pending_.load(), 0);
+    stats.bytes_pending = stats.nodes_pending * sizeof(Node);
+    return stats;
   }
 
   ~NodeGarbageCollector() {
-    // Flips stop flag and waits for a worker thread to stop.
-    stop_ = true;
-    gc_thread_.join();
+    // Stops worker threads, and frees what's left.
+    SetThreads(0);
+    while (FreeChunk()) {
+    }
   }
 
  private:
-  void GarbageCollect() {
-    while (!stop_) {
-      // Node will be released in destructor when mutex is not locked.
-      std::unique_ptr<Node> node_to_gc;
-      {
-        // Lock the mutex and move last subtree from subtrees_to_gc_ into
-        // node_to_gc.
-        Mutex::Lock lock(gc_mutex_);
-        if (subtrees_to_gc_.empty()) return;
-        node_to_gc = std::move(subtrees_to_gc_.back());
-        subtrees_to_gc_.pop_back();
+  void GarbageCollect(int idx) {
+    // Small subtrees, e.g. many of them pruned from a tree, are freed together
+    // before yielding.
+    int freed = 0;
+    while (idx < num_threads_) {
+      const int chunk = FreeChunk();
+      if (chunk == 0) break;
+      freed += chunk;
+      if (freed < kGCChunkNodes) continue;
+      freed = 0;
+      std::this_thread::yield();
+    }
+  }
+
+  // Frees up to kGCChunkNodes nodes of one subtree. Returns the number of nodes
+  // freed, 0 if there was nothing to free.
+  int FreeChunk() {
+    std::vector<std::unique_ptr<Node>> nodes;
+    std::shared_ptr<TreeMemory> memory;
+    {
+      // Lock the mutex and move last subtree from subtrees_to_gc_ into
+      // nodes.
+      Mutex::Lock lock(gc_mutex_);
+      if (subtrees_to_gc_.empty()) return 0;
+      nodes.emplace_back(std::move(subtrees_to_gc_.back().node));
+      memory = std::move(subtrees_to_gc_.back().memory);
+      subtrees_to_gc_.pop_back();
+    }
+    TraceScope trace("free nodes", "gc");
+    int freed = 0;
+    while (!nodes.empty() && freed < kGCChunkNodes) {
+      std::unique_ptr<Node> node = std::move(nodes.back());
+      nodes.pop_back();
+      // Detach the rest of the tree, so that the destructor doesn't recurse.
+      node->DetachChildren(&nodes);
+      node.reset();
+      ++freed;
+    }
+    nodes_pending_ -= freed;
+    // Detached nodes were counted until now, edges and chunks are counted by
+    // their destructors.
+    CountMemory(memory.get(),
+                -static_cast<int64_t>(freed * gNodeAllocator.GetBlockSize()));
+    // What's left of the subtree is counted as pending before the subtree
+    // itself is not, so that the tree has no pending subtrees only when all
+    // of its memory is freed.
+    if (memory) memory->AddPendingSubtrees(nodes.size());
+    if (!nodes.empty()) {
+      Mutex::Lock lock(gc_mutex_);
+      for (auto& node : nodes) {
+        subtrees_to_gc_.push_back({std::move(node), memory});
       }
     }
+    if (memory) memory->AddPendingSubtrees(-1);
+    return freed;
   }
 
-  void Worker() {
-    while (!stop_) {
-      std::this_thread::sleep_for(std::chrono::milliseconds(kGCIntervalMs));
-      GarbageCollect();
-    };
+  // Waits on condition variable with a lock, which thread safety analysis
+  // doesn't understand.
+  void Worker(int idx) NO_THREAD_SAFETY_ANALYSIS {
+    Tracer::Get().SetThreadName("node gc");
+    while (idx < num_threads_) {
+      {
+        std::unique_lock<std::mutex> lock(gc_mutex_.get_raw());
+        cv_.wait_for(lock, std::chrono::milliseconds(kGCIntervalMs),
+                     [this, idx]() { return idx >= num_threads_ || wake_; });
+        wake_ = false;
+      }
+      GarbageCollect(idx);
+    }
   }
 
-  mutable Mutex gc_mutex_;
-  std::vector<std::unique_ptr<Node>> subtrees_to_gc_ GUARDED_BY(gc_mutex_);
+  mutable Mutex gc_mutex_{"node gc"};
+  // Subtree and memory of the tree it was released from.
+  struct Subtree {
+    std::unique_ptr<Node> node;
+    std::shared_ptr<TreeMemory> memory;
+  };
+  std::vector<Subtree> subtrees_to_gc_ GUARDED_BY(gc_mutex_);
+  // Set by Wake() until a GC thread wakes up.
+  std::atomic<bool> wake_{false};
+  // Estimated number of nodes in subtrees_to_gc_.
+  std::atomic<int64_t> nodes_pending_{0};
 
-  // When true, Worker() should stop and exit.
-  volatile bool stop_ = false;
-  std::thread gc_thread_;
-};  // namespace
+  Mutex threads_mutex_{"node gc threads"};
+  std::vector<std::thread> gc_threads_ GUARDED_BY(threads_mutex_);
+  // Worker threads with index of at least that should exit.
+  std::atomic<int> num_threads_{0};
+  std::condition_variable cv_;
+};
 
 NodeGarbageCollector gNodeGc;
+
+// Atomically replaces @val with @op(val), retrying if it was modified by
+// another thread in the meantime.
+template <typename Op>
+void AtomicUpdate(std::atomic<float>* val, Op op) {
+  float old_val = val->load(std::memory_order_relaxed);
+  while (!val->compare_exchange_weak(old_val, op(old_val),
+                                     std::memory_order_relaxed)) {
+  }
+}
 }  // namespace
 
+void SetNodeGcThreads(int threads) { gNodeGc.SetThreads(threads); }
+
+void WakeNodeGc() { gNodeGc.Wake(); }
+
+NodeGcStats GetNodeGcStats() { return gNodeGc.GetStats(); }
+
 /////////////////////////////////////////////////////////////////////////
 // Edge
 /////////////////////////////////////////////////////////////////////////
@@ -115,7 +310,7 @@ Move Edge::GetMove(bool as_opponent) const {
 
 std::string Edge::DebugString() const {
   std::ostringstream oss;
-  oss << "Move: " << move_.as_string() << " P:" << p_;
+  oss << "Move: " << move_.as_string() << " P:" << GetP();
   return oss.str();
 }
 
@@ -123,35 +318,299 @@ std::string Edge::DebugString() const {
 // EdgeList
 /////////////////////////////////////////////////////////////////////////
 
-EdgeList::EdgeList(MoveList moves)
-    : edges_(std::make_unique<Edge[]>(moves.size())), size_(moves.size()) {
-  auto* edge = edges_.get();
-  for (auto move : moves) edge++->SetMove(move);
+EdgeList::EdgeList(MoveList moves, TreeMemory* memory) {
+  if (moves.empty()) return;
+  Allocate(moves.size(), memory);
+  auto* edge = edges_;
+  for (auto move : moves) (new (edge++) Edge())->SetMove(move);
+}
+
+EdgeList::EdgeList(const Edge* edges, uint16_t size, TreeMemory* memory) {
+  if (size == 0) return;
+  Allocate(size, memory);
+  std::memcpy(edges_, edges, size * sizeof(Edge));
 }
 
+void EdgeList::Allocate(size_t size, TreeMemory* memory) {
+  const size_t chunks =
+      (size + ChildStatsChunk::kSize - 1) / ChildStatsChunk::kSize;
+  if (chunks > kEdgesSizeClasses) {
+    throw Exception("Too many moves in a position.");
+  }
+  // Memory counter is at the start of the block, and the size right before
+  // the edges.
+  SlabAllocator* allocator = GetEdgesAllocator(chunks);
+  auto* block = static_cast<char*>(allocator->Allocate());
+  new (block) TreeMemory*(memory);
+  auto* header = new (block + kHeaderSize - sizeof(uint32_t)) uint32_t(size);
+  edges_ = reinterpret_cast<Edge*>(header + 1);
+  CountMemory(memory, allocator->GetBlockSize());
+  // Padding edges have P = 0, so that they are never picked.
+  for (size_t i = size; i < chunks * ChildStatsChunk::kSize; ++i) {
+    new (edges_ + i) Edge();
+  }
+  auto* chunk_ptrs = this->chunks();
+  for (size_t i = 0; i < chunks; ++i) {
+    new (chunk_ptrs + i) std::atomic<ChildStatsChunk*>(nullptr);
+  }
+}
+
+EdgeList::~EdgeList() {
+  // Edge is trivially destructible, so just return the memory.
+  static_assert(std::is_trivially_destructible<Edge>::value,
+                "Edge must be trivially destructible");
+  if (!edges_) return;
+  // Nodes which were not detached are destroyed together with the list.
+  auto* chunk_ptrs = chunks();
+  const size_t chunks = num_chunks();
+  SlabAllocator* allocator = GetEdgesAllocator(chunks);
+  int64_t freed_bytes = allocator->GetBlockSize();
+  for (size_t i = 0; i < chunks; ++i) {
+    ChildStatsChunk* chunk = chunk_ptrs[i].load(std::memory_order_acquire);
+    if (!chunk) continue;
+    for (auto& node_ptr : chunk->node) {
+      Node* node = node_ptr.load(std::memory_order_relaxed);
+      if (!node) continue;
+      delete node;
+      freed_bytes += gNodeAllocator.GetBlockSize();
+    }
+    delete chunk;
+    freed_bytes += gChunkAllocator.GetBlockSize();
+  }
+  CountMemory(memory(), -freed_bytes);
+  allocator->Free(GetBlock(edges_));
+}
+
+/////////////////////////////////////////////////////////////////////////
+// ChildStatsChunk
+/////////////////////////////////////////////////////////////////////////
+
+// Stats are read from the chunk with vector loads.
+static_assert(sizeof(std::atomic<uint64_t>) == sizeof(uint64_t) &&
+                  sizeof(std::atomic<uint16_t>) == sizeof(uint16_t),
+              "Atomic stats are expected to be stored as plain integers");
+
+ChildStatsChunk::ChildStatsChunk() {
+  for (int i = 0; i < kSize; ++i) {
+    q_and_n[i].store(0, std::memory_order_relaxed);
+    n_in_flight[i].store(0, std::memory_order_relaxed);
+    node[i].store(nullptr, std::memory_order_relaxed);
+  }
+}
+
+void* ChildStatsChunk::operator new(size_t /* size */) {
+  return gChunkAllocator.Allocate();
+}
+
+void ChildStatsChunk::operator delete(void* ptr) { gChunkAllocator.Free(ptr); }
+
 /////////////////////////////////////////////////////////////////////////
 // Node
 /////////////////////////////////////////////////////////////////////////
 
-Node* Node::CreateSingleChildNode(Move move) {
+void* Node::operator new(size_t /* size */) {
+  return gNodeAllocator.Allocate();
+}
+
+void Node::operator delete(void* ptr) { gNodeAllocator.Free(ptr); }
+
+Node::Node(Node* parent, uint16_t index)
+    : parent_(parent),
+      stats_(parent ? parent->edges_.chunks()[index / ChildStatsChunk::kSize]
+                          .load(std::memory_order_relaxed)
+                    : nullptr),
+      index_(index) {
+  assert(!parent || stats_);
+}
+
+Node* Node::CreateSingleChildNode(Move move, TreeMemory* memory) {
   assert(!edges_);
-  assert(!child_);
-  edges_ = EdgeList({move});
-  child_ = std::make_unique<Node>(this, 0);
-  return child_.get();
+  edges_ = EdgeList({move}, memory);
+  return GetOrSpawnChild(0);
+}
+
+Node* Node::GetOrSpawnChild(uint16_t idx) {
+  assert(idx < edges_.size());
+  std::atomic<ChildStatsChunk*>& chunk_ptr =
+      edges_.chunks()[idx / ChildStatsChunk::kSize];
+  ChildStatsChunk* chunk = chunk_ptr.load(std::memory_order_acquire);
+  if (!chunk) {
+    // Other thread may allocate the chunk at the same time, the one which
+    // publishes it first wins.
+    auto new_chunk = std::make_unique<ChildStatsChunk>();
+    if (chunk_ptr.compare_exchange_strong(chunk, new_chunk.get(),
+                                          std::memory_order_acq_rel,
+                                          std::memory_order_acquire)) {
+      chunk = new_chunk.release();
+      CountMemory(edges_.memory(), gChunkAllocator.GetBlockSize());
+    }
+  }
+  std::atomic<Node*>& node_ptr = chunk->node[idx % ChildStatsChunk::kSize];
+  Node* node = node_ptr.load(std::memory_order_acquire);
+  if (node) return node;
+  // Same for the node.
+  auto new_node = std::make_unique<Node>(this, idx);
+  if (node_ptr.compare_exchange_strong(node, new_node.get(),
+                                       std::memory_order_acq_rel,
+                                       std::memory_order_acquire)) {
+    node = new_node.release();
+    CountMemory(edges_.memory(), gNodeAllocator.GetBlockSize());
+  }
+  return node;
 }
 
 void Node::CreateEdges(const MoveList& moves) {
   assert(!edges_);
-  assert(!child_);
-  edges_ = EdgeList(moves);
+  edges_ = EdgeList(moves, GetTreeMemory());
 }
 
-Node::ConstIterator Node::Edges() const { return {edges_, &child_}; }
-Node::Iterator Node::Edges() { return {edges_, &child_}; }
+bool Node::CopyPolicyFrom(const Node& source) {
+  assert(*Node_Iterator(edges_) == nullptr);
+  const size_t size = edges_.size();
+  if (source.edges_.size() != size) return false;
+  // Source edges are sorted by P, so the same moves may be in other order.
+  Edge* const begin = edges_.get();
+  for (size_t i = 0; i < size; ++i) {
+    const Move move = source.edges_[i].GetMove();
+    if (std::none_of(begin, begin + size, [move](const Edge& edge) {
+          return edge.GetMove() == move;
+        })) {
+      return false;
+    }
+  }
+  std::memcpy(begin, source.edges_.get(), size * sizeof(Edge));
+  return true;
+}
+
+void Node::SortEdges() {
+  assert(*Node_Iterator(edges_) == nullptr);
+  Edge* const begin = edges_.get();
+  std::stable_sort(begin, begin + edges_.size(),
+                   [](const Edge& a, const Edge& b) {
+                     return a.GetP() > b.GetP();
+                   });
+}
+
+Node::ConstIterator Node::Edges() const { return {edges_}; }
+Node::Iterator Node::Edges() { return {edges_}; }
 
-float Node::GetVisitedPolicy() const { return visited_policy_;  }
+float Node::GetVisitedPolicy() const {
+  return visited_policy_.load(std::memory_order_relaxed);
+}
+
+void Node::ComputeChildScores(float fpu_q, float puct_mult,
+                              float* scores) const {
+  constexpr int kSize = ChildStatsChunk::kSize;
+  // SIMD versions decode P from edges loaded as 32-bit words, and read stats
+  // of a chunk with plain vector loads. Other threads may update the stats
+  // meanwhile, same as with relaxed loads every 64-bit Q and N is read whole.
+  static_assert(offsetof(Edge, p_) == sizeof(uint16_t),
+                "P is expected in the upper half of an edge");
+  const auto* chunk_ptrs = edges_.chunks();
+  for (int c = 0; c < edges_.num_chunks(); ++c, scores += kSize) {
+    const ChildStatsChunk* chunk =
+        chunk_ptrs[c].load(std::memory_order_acquire);
+    const Edge* edges = edges_.get() + c * kSize;
+#if defined(__AVX2__)
+    const __m256i words =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(edges));
+    const __m256i p16 = _mm256_srli_epi32(words, 16);
+    const __m256i p_bits = _mm256_andnot_si256(
+        _mm256_cmpeq_epi32(p16, _mm256_setzero_si256()),
+        _mm256_or_si256(_mm256_slli_epi32(p16, 12),
+                        _mm256_set1_epi32(3 << 28)));
+    const __m256 p = _mm256_castsi256_ps(p_bits);
+    __m256 q = _mm256_set1_ps(fpu_q);
+    __m256 n_started = _mm256_setzero_ps();
+    if (chunk) {
+      const float* q_and_n = reinterpret_cast<const float*>(chunk->q_and_n);
+      const __m256 lo = _mm256_loadu_ps(q_and_n);
+      const __m256 hi = _mm256_loadu_ps(q_and_n + kSize);
+      // Within 128-bit lanes, takes Q (or N) of 0, 1, 4, 5 and 2, 3, 6, 7,
+      // then puts pairs in order.
+      const __m256 child_q = _mm256_castpd_ps(_mm256_permute4x64_pd(
+          _mm256_castps_pd(_mm256_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0))),
+          _MM_SHUFFLE(3, 1, 2, 0)));
+      const __m256i n = _mm256_castpd_si256(_mm256_permute4x64_pd(
+          _mm256_castps_pd(_mm256_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1))),
+          _MM_SHUFFLE(3, 1, 2, 0)));
+      const __m256i n_in_flight = _mm256_cvtepu16_epi32(_mm_loadu_si128(
+          reinterpret_cast<const __m128i*>(chunk->n_in_flight)));
+      q = _mm256_blendv_ps(
+          q, child_q,
+          _mm256_castsi256_ps(_mm256_cmpgt_epi32(n, _mm256_setzero_si256())));
+      n_started = _mm256_cvtepi32_ps(_mm256_add_epi32(n, n_in_flight));
+    }
+    const __m256 u =
+        _mm256_div_ps(_mm256_mul_ps(_mm256_set1_ps(puct_mult), p),
+                      _mm256_add_ps(_mm256_set1_ps(1.0f), n_started));
+    _mm256_storeu_ps(scores, _mm256_add_ps(q, u));
+#elif defined(__aarch64__)
+    const uint16x8_t n_in_flight =
+        chunk ? vld1q_u16(reinterpret_cast<const uint16_t*>(chunk->n_in_flight))
+              : vdupq_n_u16(0);
+    for (int half = 0; half < 2; ++half) {
+      const int offset = half * 4;
+      const uint32x4_t p16 = vshrq_n_u32(
+          vld1q_u32(reinterpret_cast<const uint32_t*>(edges + offset)), 16);
+      const uint32x4_t p_bits =
+          vbicq_u32(vorrq_u32(vshlq_n_u32(p16, 12), vdupq_n_u32(3u << 28)),
+                    vceqq_u32(p16, vdupq_n_u32(0)));
+      const float32x4_t p = vreinterpretq_f32_u32(p_bits);
+      float32x4_t q = vdupq_n_f32(fpu_q);
+      float32x4_t n_started = vdupq_n_f32(0.0f);
+      if (chunk) {
+        // Deinterleaves Q and N.
+        const uint32x4x2_t q_and_n = vld2q_u32(
+            reinterpret_cast<const uint32_t*>(chunk->q_and_n + offset));
+        const uint32x4_t n = q_and_n.val[1];
+        q = vbslq_f32(vcgtq_u32(n, vdupq_n_u32(0)),
+                      vreinterpretq_f32_u32(q_and_n.val[0]), q);
+        const uint32x4_t child_n_in_flight =
+            vmovl_u16(half ? vget_high_u16(n_in_flight)
+                           : vget_low_u16(n_in_flight));
+        n_started = vcvtq_f32_u32(vaddq_u32(n, child_n_in_flight));
+      }
+      const float32x4_t u =
+          vdivq_f32(vmulq_f32(vdupq_n_f32(puct_mult), p),
+                    vaddq_f32(vdupq_n_f32(1.0f), n_started));
+      vst1q_f32(scores + offset, vaddq_f32(q, u));
+    }
+#else
+    for (int i = 0; i < kSize; ++i) {
+      float q = fpu_q;
+      uint32_t n_started = 0;
+      if (chunk) {
+        const uint64_t q_and_n =
+            chunk->q_and_n[i].load(std::memory_order_relaxed);
+        const uint32_t n = UnpackN(q_and_n);
+        if (n > 0) q = UnpackQ(q_and_n);
+        n_started =
+            n + chunk->n_in_flight[i].load(std::memory_order_relaxed);
+      }
+      scores[i] = q + puct_mult * edges[i].GetP() / (1.0f + n_started);
+    }
+#endif
+  }
+}
 
+float Node::ComputeChildScore(int idx, float fpu_q, float puct_mult,
+                              int extra_visits) const {
+  constexpr int kSize = ChildStatsChunk::kSize;
+  const ChildStatsChunk* chunk =
+      edges_.chunks()[idx / kSize].load(std::memory_order_acquire);
+  float q = fpu_q;
+  uint32_t n_started = extra_visits;
+  if (chunk) {
+    const uint64_t q_and_n =
+        chunk->q_and_n[idx % kSize].load(std::memory_order_relaxed);
+    const uint32_t n = UnpackN(q_and_n);
+    if (n > 0) q = UnpackQ(q_and_n);
+    n_started +=
+        n + chunk->n_in_flight[idx % kSize].load(std::memory_order_relaxed);
+  }
+  return q + puct_mult * edges_[idx].GetP() / (1.0f + n_started);
+}
 
 Edge* Node::GetEdgeToNode(const Node* node) const {
   assert(node->parent_ == this);
@@ -162,61 +621,123 @@ Edge* Node::GetEdgeToNode(const Node* node) const {
 std::string Node::DebugString() const {
   std::ostringstream oss;
   oss << " Term:" << is_terminal_ << " This:" << this << " Parent:" << parent_
-      << " Index:" << index_ << " Child:" << child_.get()
-      << " Sibling:" << sibling_.get() << " Q:" << q_ << " N:" << n_
-      << " N_:" << n_in_flight_ << " Edges:" << edges_.size();
+      << " Index:" << static_cast<int>(index_) << " Q:" << GetQ()
+      << " N:" << GetN() << " N_:" << GetNInFlight()
+      << " Edges:" << edges_.size();
   return oss.str();
 }
 
 void Node::MakeTerminal(GameResult result) {
   is_terminal_ = true;
-  q_ = (result == GameResult::DRAW) ? 0.0f : 1.0f;
+  const float q = result == GameResult::DRAW        ? 0.0f
+                  : result == GameResult::WHITE_WON ? 1.0f
+                                                    : -1.0f;
+  uint64_t old_q_and_n = q_and_n().load(std::memory_order_relaxed);
+  while (!q_and_n().compare_exchange_weak(old_q_and_n,
+                                          PackQAndN(q, UnpackN(old_q_and_n)),
+                                          std::memory_order_relaxed)) {
+  }
 }
 
 bool Node::TryStartScoreUpdate() {
-  if (n_ == 0 && n_in_flight_ > 0) return false;
-  ++n_in_flight_;
+  uint16_t n_in_flight = this->n_in_flight().load(std::memory_order_relaxed);
+  do {
+    if (n_in_flight > 0 && GetN() == 0) return false;
+    // If another thread has changed n-in-flight meanwhile, recheck.
+  } while (!this->n_in_flight().compare_exchange_weak(
+      n_in_flight, n_in_flight + 1, std::memory_order_acq_rel,
+      std::memory_order_relaxed));
   return true;
 }
 
-void Node::CancelScoreUpdate() { --n_in_flight_; }
+void Node::CancelScoreUpdate() {
+  n_in_flight().fetch_sub(1, std::memory_order_relaxed);
+}
 
-void Node::FinalizeScoreUpdate(float v) {
-  // Recompute Q.
-  q_ += (v - q_) / (n_ + 1);
+void Node::IncrementNInFlight(int multivisit) {
+  n_in_flight().fetch_add(multivisit, std::memory_order_relaxed);
+}
+
+void Node::FinalizeScoreUpdate(float v, int multivisit) {
+  // Recompute Q and increment N together, so that a concurrent backup never
+  // averages with a stale N.
+  uint64_t old_q_and_n = q_and_n().load(std::memory_order_relaxed);
+  uint32_t n;
+  uint64_t new_q_and_n;
+  do {
+    n = UnpackN(old_q_and_n);
+    const float q = UnpackQ(old_q_and_n);
+    new_q_and_n =
+        PackQAndN(q + multivisit * (v - q) / (n + multivisit), n + multivisit);
+  } while (!q_and_n().compare_exchange_weak(old_q_and_n, new_q_and_n,
+                                            std::memory_order_release,
+                                            std::memory_order_relaxed));
   // If first visit, update parent's sum of policies visited at least once.
-  if (n_ == 0 && parent_ != nullptr) {
-    parent_->visited_policy_ += parent_->edges_[index_].GetP();
+  if (n == 0) {
+    const float p = parent_->edges_[index_].GetP();
+    AtomicUpdate(&parent_->visited_policy_, [p](float sum) { return sum + p; });
   }
-  // Increment N.
-  ++n_;
   // Decrement virtual loss.
-  --n_in_flight_;
+  n_in_flight().fetch_sub(multivisit, std::memory_order_release);
 }
 
+void Node::Reset() {
+  ReleaseChildren();
+  edges_ = EdgeList();
+  if (stats_) {
+    q_and_n().store(0, std::memory_order_relaxed);
+    n_in_flight().store(0, std::memory_order_relaxed);
+  }
+  visited_policy_ = 0.0f;
+  is_terminal_ = false;
+}
 
-Node::NodeRange Node::ChildNodes() const { return child_.get(); }
+Node::NodeRange Node::ChildNodes() const { return edges_; }
 
-void Node::ReleaseChildren() { gNodeGc.AddToGcQueue(std::move(child_)); }
+void Node::ReleaseChildren() { ReleaseChildrenExceptOne(nullptr); }
 
-void Node::ReleaseChildrenExceptOne(Node* node_to_save) {
-  // Stores node which will have to survive (or nullptr if it's not found).
-  std::unique_ptr<Node> saved_node;
-  // Pointer to unique_ptr, so that we could move from it.
-  for (std::unique_ptr<Node>* node = &child_; *node;
-       node = &(*node)->sibling_) {
-    // If current node is the one that we have to save.
-    if (node->get() == node_to_save) {
-      // Kill all remaining siblings.
-      gNodeGc.AddToGcQueue(std::move((*node)->sibling_));
-      // Save the node, and take the ownership from the unique_ptr.
-      saved_node = std::move(*node);
-      break;
+int64_t Node::DetachChildren(std::vector<std::unique_ptr<Node>>* nodes,
+                             const Node* node_to_keep) {
+  if (!edges_) return 0;
+  int64_t estimate = 0;
+  auto* chunk_ptrs = edges_.chunks();
+  for (int i = 0; i < edges_.num_chunks(); ++i) {
+    ChildStatsChunk* chunk = chunk_ptrs[i].load(std::memory_order_acquire);
+    if (!chunk) continue;
+    bool keep_chunk = false;
+    for (int j = 0; j < ChildStatsChunk::kSize; ++j) {
+      Node* node = chunk->node[j].load(std::memory_order_relaxed);
+      if (node && node == node_to_keep) {
+        keep_chunk = true;
+        continue;
+      }
+      // Every visit adds at most one node, so N of the subtree root estimates
+      // the size of the subtree.
+      if (node) {
+        estimate += node->GetN() + 1;
+        // The chunk goes away, the detached node doesn't need its stats.
+        node->parent_ = nullptr;
+        node->stats_ = nullptr;
+        nodes->emplace_back(node);
+      }
+      chunk->node[j].store(nullptr, std::memory_order_relaxed);
+      chunk->q_and_n[j].store(0, std::memory_order_relaxed);
+      chunk->n_in_flight[j].store(0, std::memory_order_relaxed);
+    }
+    if (!keep_chunk) {
+      chunk_ptrs[i].store(nullptr, std::memory_order_relaxed);
+      delete chunk;
+      CountMemory(edges_.memory(),
+                  -static_cast<int64_t>(gChunkAllocator.GetBlockSize()));
     }
   }
-  // Make saved node the only child. (kills previous siblings).
-  gNodeGc.AddToGcQueue(std::move(child_));
-  child_ = std::move(saved_node);
+  return estimate;
+}
+
+void Node::ReleaseChildrenExceptOne(Node* node_to_save) {
+  std::vector<std::unique_ptr<Node>> nodes;
+  const int64_t estimate = DetachChildren(&nodes, node_to_save);
+  gNodeGc.AddToGcQueue(&nodes, estimate, edges_.memory());
 }
 
 namespace {
@@ -229,29 +750,32 @@ uint64_t ReverseBitsInBytes(uint64_t v) {
 }
 }  // namespace
 
-V3TrainingData Node::GetV3TrainingData(GameResult game_result,
-                                       const PositionHistory& history) const {
-  V3TrainingData result;
+SparseTrainingData Node::GetTrainingData(
+    GameResult game_result, const PositionHistory& history) const {
+  SparseTrainingData data;
+  auto& result = data.header;
 
   // Set version.
-  result.version = 3;
+  result.version = kSparseTrainingDataVersion;
 
   // Populate probabilities.
   float total_n = static_cast<float>(
       GetN() - 1);  // First visit was expansion of "this" itself.
   // Prevent garbage/invalid training data from being uploaded to server.
   if (total_n <= 0) throw Exception("Search generated invalid data!");
-  std::memset(result.probabilities, 0, sizeof(result.probabilities));
   for (const auto& child : Edges()) {
-    result.probabilities[child.edge()->GetMove().as_nn_index()] =
-        child.GetN() / total_n;
+    if (child.GetN() == 0) continue;
+    data.probabilities.push_back(
+        {static_cast<uint16_t>(child.edge()->GetMove().as_nn_index()),
+         NNCache::QuantizeP(child.GetN() / total_n)});
   }
+  result.num_probabilities = data.probabilities.size();
 
   // Populate planes.
-  InputPlanes planes = EncodePositionForNN(history, 8);
+  const InputPlanes planes = EncodePositionForNN(history, 8);
   int plane_idx = 0;
   for (auto& plane : result.planes) {
-    plane = ReverseBitsInBytes(planes[plane_idx++].mask);
+    plane = ReverseBitsInBytes(planes.masks[plane_idx++]);
   }
 
   const auto& position = history.Last();
@@ -275,7 +799,7 @@ V3TrainingData Node::GetV3TrainingData(GameResult game_result,
     result.result = 0;
   }
 
-  return result;
+  return data;
 }
 
 /////////////////////////////////////////////////////////////////////////
@@ -292,7 +816,7 @@ std::string EdgeAndNode::DebugString() const {
 // NodeTree
 /////////////////////////////////////////////////////////////////////////
 
-void NodeTree::MakeMove(Move move) {
+void NodeTree::MakeMove(Move move, bool keep_siblings) {
   if (HeadPosition().IsBlackToMove()) move.Mirror();
 
   Node* new_head = nullptr;
@@ -302,22 +826,21 @@ void NodeTree::MakeMove(Move move) {
       break;
     }
   }
-  current_head_->ReleaseChildrenExceptOne(new_head);
+  if (!keep_siblings) current_head_->ReleaseChildrenExceptOne(new_head);
   current_head_ =
-      new_head ? new_head : current_head_->CreateSingleChildNode(move);
+      new_head ? new_head
+               : current_head_->CreateSingleChildNode(move, memory_.get());
   history_.Append(move);
 }
 
 void NodeTree::TrimTreeAtHead() {
-  auto tmp = std::move(current_head_->sibling_);
-  // Send dependent nodes for GC instead of destroying them immediately.
-  gNodeGc.AddToGcQueue(std::move(current_head_->child_));
-  *current_head_ = Node(current_head_->GetParent(), current_head_->index_);
-  current_head_->sibling_ = std::move(tmp);
+  // Dependent nodes are sent for GC instead of destroying them immediately.
+  current_head_->Reset();
 }
 
 void NodeTree::ResetToPosition(const std::string& starting_fen,
-                               const std::vector<Move>& moves) {
+                               const std::vector<Move>& moves,
+                               bool keep_last_siblings) {
   ChessBoard starting_board;
   int no_capture_ply;
   int full_moves;
@@ -328,32 +851,231 @@ void NodeTree::ResetToPosition(const std::string& starting_fen,
   }
 
   if (!gamebegin_node_) {
-    gamebegin_node_ = std::make_unique<Node>(nullptr, 0);
+    gamebegin_parent_ = std::make_unique<Node>(nullptr, 0);
+    gamebegin_node_ =
+        gamebegin_parent_->CreateSingleChildNode(Move(), memory_.get());
   }
 
   history_.Reset(starting_board, no_capture_ply,
                  full_moves * 2 - (starting_board.flipped() ? 1 : 2));
 
   Node* old_head = current_head_;
-  current_head_ = gamebegin_node_.get();
-  bool seen_old_head = (gamebegin_node_.get() == old_head);
-  for (const auto& move : moves) {
-    MakeMove(move);
+  // Nodes from the game begin to the old head.
+  std::vector<const Node*> old_path;
+  for (const Node* node = old_head; node; node = node->GetParent()) {
+    old_path.push_back(node);
+  }
+  current_head_ = gamebegin_node_;
+  bool seen_old_head = (gamebegin_node_ == old_head);
+  for (size_t i = 0; i < moves.size(); ++i) {
+    MakeMove(moves[i], keep_last_siblings && i + 1 == moves.size());
     if (old_head == current_head_) seen_old_head = true;
   }
 
-  // If we didn't see old head, it means that new position is shorter.
-  // As we killed the search tree already, trim it to redo the search.
-  if (!seen_old_head) {
-    assert(!current_head_->sibling_);
+  // If we didn't see old head, but the new head was on the way to it, it
+  // means that new position is shorter. As we killed the search tree already,
+  // trim it to redo the search. (Otherwise the new head is either a fresh
+  // node, or an alternative kept by keep_last_siblings, with its subtree
+  // intact.)
+  if (!seen_old_head && std::find(old_path.begin(), old_path.end(),
+                                  current_head_) != old_path.end()) {
     TrimTreeAtHead();
   }
 }
 
+/////////////////////////////////////////////////////////////////////////
+// Saved tree
+/////////////////////////////////////////////////////////////////////////
+
+namespace {
+// Saved tree consists of fixed size records in native byte order, so that it
+// could also be used memory-mapped:
+//   TreeFileHeader
+//   For every node, in depth-first preorder: FileNode, then its edges
+//   (Edge[num_edges]), then records of its num_children children.
+const char kTreeFileMagic[4] = {'L', 'c', '0', 'T'};
+// 2: position hashes are Zobrist keys.
+// 3: edges are sorted by descending P.
+const uint32_t kTreeFileVersion = 3;
+// Loading is recursive, deeper trees are rejected as corrupt rather than
+// overflowing the stack.
+const int kMaxTreeFileDepth = 1000;
+
+struct TreeFileHeader {
+  char magic[4];
+  uint32_t version;
+  // Hash of the head position, to check that the tree is loaded for it.
+  uint64_t head_hash;
+};
+
+}  // namespace
+
+struct NodeTree::FileNode {
+  float q;
+  uint32_t n;
+  float visited_policy;
+  uint16_t num_edges;
+  uint16_t num_children;
+  // Index of the node in parent's edge list.
+  uint8_t index;
+  uint8_t is_terminal;
+  uint8_t padding[2];
+};
+namespace {
+static_assert(std::is_trivially_copyable<Edge>::value,
+              "Edges are written to tree file as is");
+
+template <typename T>
+void WriteRecord(std::ostream* out, const T* data, size_t count = 1) {
+  out->write(reinterpret_cast<const char*>(data), sizeof(T) * count);
+}
+
+template <typename T>
+void ReadRecord(std::istream* in, T* data, size_t count = 1) {
+  in->read(reinterpret_cast<char*>(data), sizeof(T) * count);
+  if (!*in) throw Exception("Unexpected end of tree file.");
+}
+
+// Orders moves so that legal moves of a position are all different, which
+// operator== alone doesn't do as it ignores castling.
+bool MoveLess(Move a, Move b) {
+  if (a.as_packed_int() != b.as_packed_int()) {
+    return a.as_packed_int() < b.as_packed_int();
+  }
+  return a.castling() < b.castling();
+}
+
+// Checks that @edges are exactly the legal moves of @board, sorted by
+// descending P, as search relies on both.
+bool AreLegalEdges(const std::vector<Edge>& edges, const ChessBoard& board) {
+  MoveList legal_moves = board.GenerateLegalMoves();
+  if (legal_moves.size() != edges.size()) return false;
+  MoveList moves;
+  moves.reserve(edges.size());
+  for (size_t i = 0; i < edges.size(); ++i) {
+    if (i > 0 && edges[i].GetP() > edges[i - 1].GetP()) return false;
+    moves.push_back(edges[i].GetMove());
+  }
+  std::sort(moves.begin(), moves.end(), MoveLess);
+  std::sort(legal_moves.begin(), legal_moves.end(), MoveLess);
+  for (size_t i = 0; i < moves.size(); ++i) {
+    if (moves[i] != legal_moves[i] ||
+        moves[i].castling() != legal_moves[i].castling()) {
+      return false;
+    }
+  }
+  return true;
+}
+}  // namespace
+
+uint64_t NodeTree::SaveSubtree(const Node* node, std::ostream* out) {
+  static_assert(sizeof(FileNode) == 20, "Wrong FileNode size");
+  FileNode record{};
+  record.q = node->GetQ();
+  record.n = node->GetN();
+  record.visited_policy = node->GetVisitedPolicy();
+  record.num_edges = node->GetNumEdges();
+  record.index = node->index_;
+  record.is_terminal = node->IsTerminal();
+  // Unvisited nodes are not saved, they are the same as no node.
+  for (const Node* child : node->ChildNodes()) {
+    if (child->GetN() > 0) ++record.num_children;
+  }
+  WriteRecord(out, &record);
+  WriteRecord(out, node->edges_.get(), record.num_edges);
+
+  uint64_t nodes = 1;
+  for (const Node* child : node->ChildNodes()) {
+    if (child->GetN() > 0) nodes += SaveSubtree(child, out);
+  }
+  return nodes;
+}
+
+uint64_t NodeTree::LoadSubtree(Node* node, const FileNode& record,
+                               const ChessBoard& board, std::istream* in,
+                               int depth) {
+  if (depth > kMaxTreeFileDepth || record.num_children > record.num_edges ||
+      (record.is_terminal && record.num_edges > 0)) {
+    throw Exception("Corrupt tree file.");
+  }
+  std::vector<Edge> edges(record.num_edges);
+  ReadRecord(in, edges.data(), edges.size());
+  // Not expanded nodes have no edges.
+  if (!edges.empty() && !AreLegalEdges(edges, board)) {
+    throw Exception("Corrupt tree file.");
+  }
+  if (node->stats_) {
+    node->q_and_n().store(Node::PackQAndN(record.q, record.n),
+                          std::memory_order_relaxed);
+  }
+  node->visited_policy_.store(record.visited_policy, std::memory_order_relaxed);
+  node->is_terminal_ = record.is_terminal;
+  node->edges_ =
+      EdgeList(edges.data(), record.num_edges, node->GetTreeMemory());
+
+  uint64_t nodes = 1;
+  // Children are saved in the order of edges, each at most once.
+  int min_index = 0;
+  for (int i = 0; i < record.num_children; ++i) {
+    FileNode child_record;
+    ReadRecord(in, &child_record);
+    if (child_record.index < min_index ||
+        child_record.index >= record.num_edges) {
+      throw Exception("Corrupt tree file.");
+    }
+    min_index = child_record.index + 1;
+    ChessBoard child_board = board;
+    child_board.ApplyMove(edges[child_record.index].GetMove());
+    child_board.Mirror();
+    nodes += LoadSubtree(node->GetOrSpawnChild(child_record.index),
+                         child_record, child_board, in, depth + 1);
+  }
+  return nodes;
+}
+
+uint64_t NodeTree::SaveHeadSubtree(const std::string& filename) const {
+  std::ofstream out(filename, std::ios::binary);
+  if (!out) throw Exception("Unable to open " + filename + " for writing.");
+  TreeFileHeader header{};
+  std::memcpy(header.magic, kTreeFileMagic, sizeof(header.magic));
+  header.version = kTreeFileVersion;
+  header.head_hash = HeadPosition().Hash();
+  WriteRecord(&out, &header);
+  const uint64_t nodes = SaveSubtree(current_head_, &out);
+  out.close();
+  if (!out) throw Exception("Error writing to " + filename + ".");
+  return nodes;
+}
+
+uint64_t NodeTree::LoadHeadSubtree(const std::string& filename) {
+  std::ifstream in(filename, std::ios::binary);
+  if (!in) throw Exception("Unable to open " + filename + ".");
+  TreeFileHeader header;
+  ReadRecord(&in, &header);
+  if (std::memcmp(header.magic, kTreeFileMagic, sizeof(header.magic)) != 0 ||
+      header.version != kTreeFileVersion) {
+    throw Exception(filename + " is not a tree file.");
+  }
+  if (header.head_hash != HeadPosition().Hash()) {
+    throw Exception("Tree in " + filename + " is for a different position.");
+  }
+  current_head_->Reset();
+  try {
+    FileNode record;
+    ReadRecord(&in, &record);
+    return LoadSubtree(current_head_, record, HeadPosition().GetBoard(), &in,
+                       0);
+  } catch (...) {
+    current_head_->Reset();
+    throw;
+  }
+}
+
 void NodeTree::DeallocateTree() {
-  // Same as gamebegin_node_.reset(), but actual deallocation will happen in
+  // Same as gamebegin_parent_.reset(), but actual deallocation will happen in
   // GC thread.
-  gNodeGc.AddToGcQueue(std::move(gamebegin_node_));
+  if (gamebegin_parent_) gamebegin_parent_->ReleaseChildren();
+  gamebegin_parent_ = nullptr;
   gamebegin_node_ = nullptr;
   current_head_ = nullptr;
 }
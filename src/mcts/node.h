@@ -27,9 +27,13 @@
 
 #pragma once
 
+#include <atomic>
+#include <cassert>
+#include <cstring>
 #include <iostream>
 #include <memory>
 #include <mutex>
+#include <vector>
 #include "chess/board.h"
 #include "chess/callbacks.h"
 #include "chess/position.h"
@@ -41,9 +45,15 @@ namespace lczero {
 // Children of a node are stored the following way:
 // * Edges and Nodes edges point to are stored separately.
 // * There may be dangling edges (which don't yet point to any Node object yet)
-// * Edges are stored are a simple array on heap.
-// * Nodes are stored as a linked list, and contain index_ field which shows
-//   which edge of a parent that node points to.
+// * Edges are stored in one block from a slab allocator (see EdgeList): a
+//   header with the memory counter of the tree and the number of edges, then
+//   the edges, padded to a whole number of chunks, then chunk pointers.
+// * Nodes are stored in chunks of ChildStatsChunk::kSize consecutive edges,
+//   which are allocated when the first node of a chunk is spawned. Pointers to
+//   chunks are stored in the same block, after the edges.
+// * N, Q and N-in-flight of a node are stored in the chunk of its parent
+//   rather than in the node, so that stats of all children are in a few
+//   plain arrays when the parent picks one of them.
 //
 // Example:
 //                                Parent Node
@@ -54,22 +64,26 @@ namespace lczero {
 //    (dangling)         |           (dangling)        |           (dangling)
 //                   Node, Q=0.5                    Node, Q=-0.2
 //
-//  Is represented as:
-// +--------------+
-// | Parent Node  |
-// +--------------+                                        +--------+
-// | edges_       | -------------------------------------> | Edge[] |
-// |              |    +------------+                      +--------+
-// | child_       | -> | Node       |                      | Nf3    |
-// +--------------+    +------------+                      | Bc5    |
-//                     | index_ = 1 |                      | a4     |
-//                     | q_ = 0.5   |    +------------+    | Qxf7   |
-//                     | sibling_   | -> | Node       |    | a3     |
-//                     +------------+    +------------+    +--------+
-//                                       | index_ = 3 |
-//                                       | q_ = -0.2  |
-//                                       | sibling_   | -> nullptr
-//                                       +------------+
+//  Is represented as (with chunks of 4 edges for brevity):
+// +--------------+     +--------+
+// | Parent Node  |     | memory |
+// +--------------+     | size=5 |
+// | edges_       | -+  +--------+
+// +--------------+  +> | Nf3    |
+//                      | Bc5    |
+//                      | a4     |
+//                      | Qxf7   |
+//                      | a3     |
+//                      | (pad)  |
+//                      | (pad)  |
+//                      | (pad)  |
+//                      +--------+     +----------------------+
+//                      | chunk0 | --> | ChildStatsChunk      |
+//                      | chunk1 |     +----------------------+
+//                      +--------+     | Q = -, 0.5, -, -0.2  |
+//                          |          | N = 0, 1,   0, 1     |
+//                          v          | node = -, *,  -, *   |
+//                       nullptr       +----------------------+
 
 class Node;
 class Edge {
@@ -80,10 +94,10 @@ class Edge {
 
   // Returns value of Move probability returned from the neural net
   // (but can be changed by adding Dirichlet noise).
-  float GetP() const { return p_; }
+  float GetP() const;
 
-  // Sets move probability.
-  void SetP(float val) { p_ = val; }
+  // Sets move probability. Has to be in [0, 1] range.
+  void SetP(float val);
 
   // Debug information about the edge.
   std::string DebugString() const;
@@ -97,25 +111,134 @@ class Edge {
   Move move_;
 
   // Probability that this move will be made. From policy head of the neural
-  // network.
-  float p_ = 0.0;
+  // network. Stored as a 16-bit float with 5 bits of exponent and 11 bits of
+  // mantissa (no sign), which is enough for values in [0, 1] range.
+  uint16_t p_ = 0;
 
   friend class EdgeList;
+  friend class Node;
+};
+static_assert(sizeof(Edge) == 4, "Edge is expected to be 4 bytes");
+
+inline float Edge::GetP() const {
+  // Zero is stored as 0, so that it's still exact zero after decoding.
+  if (p_ == 0) return 0.0f;
+  // Exponent is biased so that the largest stored value is slightly above 1.
+  const uint32_t tmp = (static_cast<uint32_t>(p_) << 12) | (3 << 28);
+  float result;
+  std::memcpy(&result, &tmp, sizeof(result));
+  return result;
+}
+
+inline void Edge::SetP(float val) {
+  assert(0.0f <= val && val <= 1.0f);
+  // Adding half of the dropped bits does the rounding, and subtracting the
+  // exponent bias makes values below the smallest storable one negative.
+  constexpr int32_t kRounding = (1 << 11) - (3 << 28);
+  int32_t tmp;
+  std::memcpy(&tmp, &val, sizeof(tmp));
+  tmp += kRounding;
+  p_ = (tmp < 0) ? 0 : static_cast<uint16_t>(tmp >> 12);
+}
+
+// Child nodes of kSize consecutive edges, and their statistics. Allocated when
+// the first node of a chunk is spawned, and owns the nodes. Every field is an
+// array over the edges of the chunk, so that selection computes the scores of
+// all of them with a few vector instructions.
+struct ChildStatsChunk {
+  static constexpr int kSize = 8;
+
+  ChildStatsChunk();
+  // Chunks are allocated from a slab allocator rather than from the heap.
+  static void* operator new(size_t size);
+  static void operator delete(void* ptr);
+
+  // Q and N of a child in one word, see Node::PackQAndN().
+  std::atomic<uint64_t> q_and_n[kSize];
+  // N-in-flight of a child.
+  std::atomic<uint16_t> n_in_flight[kSize];
+  // Child node, nullptr if it's not spawned.
+  std::atomic<Node*> node[kSize];
 };
 
-// Array of Edges.
+// Bytes taken by edges, chunks and nodes of one tree. Updated without locks as
+// they are allocated and freed, so it's cheap to read on every iteration.
+// Subtrees released to the garbage collector are counted until they are freed,
+// and the collector keeps the counter alive until then.
+class TreeMemory : public std::enable_shared_from_this<TreeMemory> {
+ public:
+  void Add(int64_t bytes) {
+    bytes_.fetch_add(bytes, std::memory_order_relaxed);
+  }
+  int64_t GetBytes() const { return bytes_.load(std::memory_order_relaxed); }
+
+  // Subtrees of the tree in the queue of the garbage collector. Only when
+  // there are none, GetBytes() is the size of the live tree.
+  void AddPendingSubtrees(int subtrees) {
+    pending_subtrees_.fetch_add(subtrees, std::memory_order_release);
+  }
+  bool HasPendingSubtrees() const {
+    return pending_subtrees_.load(std::memory_order_acquire) > 0;
+  }
+
+ private:
+  std::atomic<int64_t> bytes_{0};
+  std::atomic<int> pending_subtrees_{0};
+};
+
+// Array of Edges. Memory is taken from slab allocators (one per size class),
+// so that creating and destroying millions of them doesn't go to malloc.
+// The tree's memory counter and the number of edges are stored in the same
+// block right before the edges, so that the list itself is just one pointer.
+// The edges are padded with zero edges to a whole number of chunks, followed
+// by pointers to ChildStatsChunk of every chunk, which the list owns. The list
+// counts the memory of its block, chunks and child nodes in @memory, unless
+// it's nullptr.
 class EdgeList {
  public:
+  // Bytes of the block before the edges.
+  static constexpr size_t kHeaderSize = 2 * sizeof(uint64_t);
+
   EdgeList() {}
-  EdgeList(MoveList moves);
-  Edge* get() const { return edges_.get(); }
+  EdgeList(MoveList moves, TreeMemory* memory);
+  // Creates a list with a copy of @size edges starting at @edges.
+  EdgeList(const Edge* edges, uint16_t size, TreeMemory* memory);
+  EdgeList(const EdgeList&) = delete;
+  EdgeList(EdgeList&& other) : edges_(other.edges_) { other.edges_ = nullptr; }
+  EdgeList& operator=(EdgeList&& other) {
+    std::swap(edges_, other.edges_);
+    return *this;
+  }
+  ~EdgeList();
+  Edge* get() const { return edges_; }
   Edge& operator[](size_t idx) const { return edges_[idx]; }
-  operator bool() const { return static_cast<bool>(edges_); }
-  uint16_t size() const { return size_; }
+  operator bool() const { return edges_ != nullptr; }
+  uint16_t size() const { return edges_ ? GetHeader(edges_)[0] : 0; }
+  uint16_t num_chunks() const {
+    return (size() + ChildStatsChunk::kSize - 1) / ChildStatsChunk::kSize;
+  }
+  // Pointers to chunks, num_chunks() of them. nullptr for a chunk without
+  // spawned nodes.
+  std::atomic<ChildStatsChunk*>* chunks() const {
+    return reinterpret_cast<std::atomic<ChildStatsChunk*>*>(
+        edges_ + num_chunks() * ChildStatsChunk::kSize);
+  }
+  TreeMemory* memory() const {
+    return edges_ ? *static_cast<TreeMemory**>(GetBlock(edges_)) : nullptr;
+  }
 
  private:
-  std::unique_ptr<Edge[]> edges_;
-  uint16_t size_ = 0;
+  // Allocates memory for @size edges (and the header, padding and chunk
+  // pointers), and constructs padding edges and chunk pointers.
+  void Allocate(size_t size, TreeMemory* memory);
+  static uint32_t* GetHeader(Edge* edges) {
+    return reinterpret_cast<uint32_t*>(edges) - 1;
+  }
+  static void* GetBlock(Edge* edges) {
+    return reinterpret_cast<char*>(edges) - kHeaderSize;
+  }
+
+  Edge* edges_ = nullptr;
 };
 
 class EdgeAndNode;
@@ -127,53 +250,98 @@ class Node {
   using Iterator = Edge_Iterator<false>;
   using ConstIterator = Edge_Iterator<true>;
 
-  // Takes pointer to a parent node and own index in a parent.
-  Node(Node* parent, uint16_t index) : index_(index), parent_(parent) {}
+  // Takes pointer to a parent node and own index in a parent. Chunk of the
+  // index has to be allocated in the parent. A node without a parent has no
+  // stats, it only keeps stats of its children. Roots of trees are children
+  // of such a node.
+  Node(Node* parent, uint16_t index);
+
+  // Nodes are allocated from a slab allocator rather than from the heap.
+  static void* operator new(size_t size);
+  static void operator delete(void* ptr);
 
   // Allocates a new edge and a new node. The node has to be no edges before
-  // that.
-  Node* CreateSingleChildNode(Move m);
+  // that. Memory is counted in @memory, as the node may have no parent to take
+  // the counter from.
+  Node* CreateSingleChildNode(Move m, TreeMemory* memory);
+
+  // Returns the child at edge @idx, spawning it if there is none yet. Safe to
+  // call concurrently, all threads get the same node.
+  Node* GetOrSpawnChild(uint16_t idx);
 
   // Creates edges from a movelist. There has to be no edges before that.
   void CreateEdges(const MoveList& moves);
 
+  // Copies edges (in their order, with P) from @source, which is expected to
+  // be the same position. Returns false (and copies nothing) if the moves of
+  // the nodes differ. There has to be no child nodes yet.
+  bool CopyPolicyFrom(const Node& source);
+
+  // Sorts edges by descending P, keeping the order of equal ones. Has to be
+  // done once P is set and before any child node is spawned, as children
+  // refer to edges by index.
+  void SortEdges();
+
   // Gets parent node.
   Node* GetParent() const { return parent_; }
 
+  // Returns the memory counter of the tree which the node is in, nullptr if
+  // memory of the tree is not counted.
+  TreeMemory* GetTreeMemory() const {
+    return parent_ ? parent_->edges_.memory() : edges_.memory();
+  }
+
   // Returns whether a node has children.
   bool HasChildren() const { return edges_; }
 
   // Returns sum of policy priors which have had at least one playout.
   float GetVisitedPolicy() const;
-  uint32_t GetN() const { return n_; }
-  uint32_t GetNInFlight() const { return n_in_flight_; }
-  uint32_t GetChildrenVisits() const { return n_ > 0 ? n_ - 1 : 0; }
+  uint32_t GetN() const {
+    return stats_ ? UnpackN(q_and_n().load(std::memory_order_acquire)) : 0;
+  }
+  uint32_t GetNInFlight() const {
+    return stats_ ? n_in_flight().load(std::memory_order_relaxed) : 0;
+  }
+  uint32_t GetChildrenVisits() const {
+    const uint32_t n = GetN();
+    return n > 0 ? n - 1 : 0;
+  }
   // Returns n = n_if_flight.
-  int GetNStarted() const { return n_ + n_in_flight_; }
+  int GetNStarted() const { return GetN() + GetNInFlight(); }
   // Returns node eval, i.e. average subtree V for non-terminal node and -1/0/1
   // for terminal nodes.
-  float GetQ() const { return q_; }
+  float GetQ() const {
+    return stats_ ? UnpackQ(q_and_n().load(std::memory_order_relaxed)) : 0.0f;
+  }
 
   // Returns whether the node is known to be draw/lose/win.
   bool IsTerminal() const { return is_terminal_; }
   uint16_t GetNumEdges() const { return edges_.size(); }
 
-  // Makes the node terminal and sets it's score.
+  // Makes the node terminal and sets it's score. The result is from the point
+  // of view of the player who moved into the node, as if it was white:
+  // WHITE_WON when the side to move is mated, BLACK_WON when it wins (known
+  // from tablebases).
   void MakeTerminal(GameResult result);
 
   // If this node is not in the process of being expanded by another thread
   // (which can happen only if n==0 and n-in-flight==1), mark the node as
   // "being updated" by incrementing n-in-flight, and return true.
   // Otherwise return false.
+  // This and two functions below are safe to call concurrently without
+  // external synchronization.
   bool TryStartScoreUpdate();
   // Decrements n-in-flight back.
   void CancelScoreUpdate();
-  // Updates the node with newly computed value v.
+  // Increments n-in-flight for additional playouts going through the node,
+  // for which the update has already been started by TryStartScoreUpdate().
+  void IncrementNInFlight(int multivisit);
+  // Updates the node with newly computed value v, counted @multivisit times.
   // Updates:
   // * Q (weighted average of all V in a subtree)
-  // * N (+=1)
-  // * N-in-flight (-=1)
-  void FinalizeScoreUpdate(float v);
+  // * N (+=multivisit)
+  // * N-in-flight (-=multivisit)
+  void FinalizeScoreUpdate(float v, int multivisit = 1);
 
   // Updates max depth, if new depth is larger.
   void UpdateMaxDepth(int depth);
@@ -182,8 +350,19 @@ class Node {
   // in depth parameter, and returns true if it was indeed updated.
   bool UpdateFullDepth(uint16_t* depth);
 
-  V3TrainingData GetV3TrainingData(GameResult result,
-                                   const PositionHistory& history) const;
+  // Returns training data of the position, with probabilities of visited
+  // moves only.
+  SparseTrainingData GetTrainingData(GameResult result,
+                                     const PositionHistory& history) const;
+
+  // Writes Q + U of every edge to @scores, which has to have room for
+  // GetNumEdges() rounded up to ChildStatsChunk::kSize. Q of an edge without
+  // visits is @fpu_q, U is @puct_mult * P / (1 + N + N-in-flight). Computed
+  // with AVX2 or NEON when the build targets them.
+  void ComputeChildScores(float fpu_q, float puct_mult, float* scores) const;
+  // Same for one edge, as if it had @extra_visits more visits in flight.
+  float ComputeChildScore(int idx, float fpu_q, float puct_mult,
+                          int extra_visits) const;
 
   // Returns range for iterating over edges.
   ConstIterator Edges() const;
@@ -200,6 +379,13 @@ class Node {
   // Deletes all children except one.
   void ReleaseChildrenExceptOne(Node* node);
 
+  // Moves ownership of all children except @node_to_keep into @nodes, and
+  // resets their stats, so that the node can be destroyed without destroying
+  // them. Returns an estimate of number of nodes in detached subtrees. Used by
+  // the garbage collector to free subtrees iteratively.
+  int64_t DetachChildren(std::vector<std::unique_ptr<Node>>* nodes,
+                         const Node* node_to_keep = nullptr);
+
   // For a child node, returns corresponding edge.
   Edge* GetEdgeToNode(const Node* node) const;
 
@@ -207,32 +393,59 @@ class Node {
   std::string DebugString() const;
 
  private:
+  static uint64_t PackQAndN(float q, uint32_t n) {
+    uint32_t q_bits;
+    std::memcpy(&q_bits, &q, sizeof(q_bits));
+    return static_cast<uint64_t>(n) << 32 | q_bits;
+  }
+  static float UnpackQ(uint64_t q_and_n) {
+    const uint32_t q_bits = static_cast<uint32_t>(q_and_n);
+    float q;
+    std::memcpy(&q, &q_bits, sizeof(q));
+    return q;
+  }
+  static uint32_t UnpackN(uint64_t q_and_n) { return q_and_n >> 32; }
+
+  // Own stats in the chunk of the parent. Only valid if stats_ is set.
+  std::atomic<uint64_t>& q_and_n() const {
+    return stats_->q_and_n[index_ % ChildStatsChunk::kSize];
+  }
+  std::atomic<uint16_t>& n_in_flight() const {
+    return stats_->n_in_flight[index_ % ChildStatsChunk::kSize];
+  }
+
+  // Brings the node back to the state right after construction, except that
+  // it keeps its parent and index. Children are sent to GC.
+  void Reset();
+
+  // Fields are ordered by size, so that there is no padding between them.
+
   // List of edges.
   EdgeList edges_;
-  // Index of this node is parent's edge list.
-  uint16_t index_;
-  // Average value (from value head of neural network) of all visited nodes in
-  // subtree. For terminal nodes, eval is stored.
-  float q_ = 0.0f;
-  // How many completed visits this node had.
-  uint32_t n_ = 0;
-  // (aka virtual loss). How many threads currently process this node (started
-  // but not finished). This value is added to n during selection which node
-  // to pick in MCTS, and also when selecting the best move.
-  uint16_t n_in_flight_ = 0;
+  // Pointer to a parent node. nullptr for the parent of the root.
+  Node* parent_ = nullptr;
+  // Chunk of the parent with stats of this node, nullptr if there is no
+  // parent. Stats are:
+  // * Q and N in one word, so that concurrent backups update both at once:
+  //   the bits of the float Q in the low half, N in the high half.
+  //   Q is the average value (from value head of neural network) of all
+  //   visited nodes in subtree. For terminal nodes, eval is stored.
+  //   N is how many completed visits this node had.
+  // * N-in-flight (aka virtual loss). How many threads currently process this
+  //   node (started but not finished). This value is added to n during
+  //   selection which node to pick in MCTS, and also when selecting the best
+  //   move.
+  ChildStatsChunk* stats_ = nullptr;
   // Sum of policy priors which have had at least one playout.
-  float visited_policy_ = 0.0f;
+  std::atomic<float> visited_policy_{0.0f};
+
+  // Index of this node is parent's edge list. One byte is enough, as there
+  // are at most 218 legal moves in a chess position.
+  uint8_t index_;
 
   // Does this node end game (with a winning of either sides or draw).
   bool is_terminal_ = false;
 
-  // Pointer to a parent node. nullptr for the root.
-  Node* parent_ = nullptr;
-  // Pointer to a first child. nullptr for a leaf node.
-  std::unique_ptr<Node> child_;
-  // Pointer to a next sibling. nullptr if there are no further siblings.
-  std::unique_ptr<Node> sibling_;
-
   // TODO(mooskagh) Unfriend NodeTree.
   friend class NodeTree;
   friend class Edge_Iterator<true>;
@@ -241,6 +454,10 @@ class Node {
   friend class Edge;
 };
 
+// Keeps number of nodes per cache line (and per gigabyte) in check.
+static_assert(sizeof(void*) != 8 || sizeof(Node) == 32,
+              "Node is expected to be 32 bytes on 64-bit platforms");
+
 // Contains Edge and Node pair and set of proxy functions to simplify access
 // to them.
 class EdgeAndNode {
@@ -301,22 +518,20 @@ class EdgeAndNode {
 // creating zoo of classes and copying them around while iterating seems
 // excessive.
 //
-// All functions are not thread safe (must be externally synchronized), but
-// it's fine if Node/Edges state change between calls to functions of the
-// iterator (e.g. advancing the iterator).
+// Iteration and GetOrSpawnNode() are safe to run concurrently from several
+// threads (new nodes are published atomically), and it's fine if Node/Edges
+// state change between calls to functions of the iterator (e.g. advancing the
+// iterator).
 template <bool is_const>
 class Edge_Iterator : public EdgeAndNode {
  public:
-  using Ptr = std::conditional_t<is_const, const std::unique_ptr<Node>*,
-                                 std::unique_ptr<Node>*>;
-
   // Creates "end()" iterator.
   Edge_Iterator() {}
 
   // Creates "begin()" iterator. Also happens to be a range constructor.
-  Edge_Iterator(const EdgeList& edges, Ptr node_ptr)
+  Edge_Iterator(const EdgeList& edges)
       : EdgeAndNode(edges.size() ? edges.get() : nullptr, nullptr),
-        node_ptr_(node_ptr),
+        chunks_(edges.size() ? edges.chunks() : nullptr),
         total_count_(edges.size()) {
     if (edge_) Actualize();
   }
@@ -338,111 +553,162 @@ class Edge_Iterator : public EdgeAndNode {
   }
   Edge_Iterator& operator*() { return *this; }
 
+  // Returns whether any edge after the current one has a node.
+  bool HasNodesAfter() const {
+    constexpr int kSize = ChildStatsChunk::kSize;
+    for (int idx = current_idx_ + 1; idx < total_count_;) {
+      const ChildStatsChunk* chunk =
+          chunks_[idx / kSize].load(std::memory_order_acquire);
+      if (!chunk) {
+        idx += kSize - idx % kSize;
+        continue;
+      }
+      if (chunk->node[idx % kSize].load(std::memory_order_relaxed)) {
+        return true;
+      }
+      ++idx;
+    }
+    return false;
+  }
+
   // If there is node, return it. Otherwise spawn a new one and return it.
   Node* GetOrSpawnNode(Node* parent) {
-    if (node_) return node_;  // If there is already a node, return it.
-    Actualize();              // But maybe other thread already did that.
-    if (node_) return node_;  // If it did, return.
-    // Now we are sure we have to create a new node.
-    // Suppose there are nodes with idx 3 and 7, and we want to insert one with
-    // idx 5. Here is how it looks like:
-    //    node_ptr_ -> &Node(idx_.3).sibling_  ->  Node(idx_.7)
-    // Here is how we do that:
-    // 1. Store pointer to a node idx_.7:
-    //    node_ptr_ -> &Node(idx_.3).sibling_  ->  nullptr
-    //    tmp -> Node(idx_.7)
-    std::unique_ptr<Node> tmp = std::move(*node_ptr_);
-    // 2. Create fresh Node(idx_.5):
-    //    node_ptr_ -> &Node(idx_.3).sibling_  ->  Node(idx_.5)
-    //    tmp -> Node(idx_.7)
-    *node_ptr_ = std::make_unique<Node>(parent, current_idx_);
-    // 3. Attach stored pointer back to a list:
-    //    node_ptr_ ->
-    //         &Node(idx_.3).sibling_ -> Node(idx_.5).sibling_ -> Node(idx_.7)
-    (*node_ptr_)->sibling_ = std::move(tmp);
-    // 4. Actualize:
-    //    node_ -> &Node(idx_.5)
-    //    node_ptr_ -> &Node(idx_.5).sibling_ -> Node(idx_.7)
-    Actualize();
+    if (!node_) node_ = parent->GetOrSpawnChild(current_idx_);
     return node_;
   }
 
  private:
   void Actualize() {
-    // If node_ptr_ is behind, advance it.
-    // This is needed (and has to be 'while' rather than 'if') as other threads
-    // could spawn new nodes between &node_ptr_ and *node_ptr_ while we didn't
-    // see.
-    while (*node_ptr_ && (*node_ptr_)->index_ < current_idx_) {
-      node_ptr_ = &(*node_ptr_)->sibling_;
-    }
-    // If in the end node_ptr_ points to the node that we need, populate node_
-    // and advance node_ptr_.
-    if (*node_ptr_ && (*node_ptr_)->index_ == current_idx_) {
-      node_ = (*node_ptr_).get();
-      node_ptr_ = &node_->sibling_;
-    } else {
-      node_ = nullptr;
-    }
+    const ChildStatsChunk* chunk =
+        chunks_[current_idx_ / ChildStatsChunk::kSize].load(
+            std::memory_order_acquire);
+    node_ = chunk ? chunk->node[current_idx_ % ChildStatsChunk::kSize].load(
+                        std::memory_order_acquire)
+                  : nullptr;
   }
 
-  // Pointer to a pointer to the next node. Has to be a pointer to pointer
-  // as we'd like to update it when spawning a new node.
-  Ptr node_ptr_;
+  // Chunks of the node. Nodes are spawned by other threads concurrently, so
+  // they are loaded from there rather than kept.
+  const std::atomic<ChildStatsChunk*>* chunks_ = nullptr;
   uint16_t current_idx_ = 0;
   uint16_t total_count_ = 0;
 };
 
+// Iterates over spawned children in the order of edges.
 class Node_Iterator {
  public:
-  Node_Iterator(Node* node) : node_(node) {}
+  // Creates "end()" iterator.
+  Node_Iterator() {}
+  Node_Iterator(const EdgeList& edges)
+      : chunks_(edges.size() ? edges.chunks() : nullptr),
+        total_count_(edges.size()) {
+    Advance();
+  }
   Node* operator*() { return node_; }
   Node* operator->() { return node_; }
   bool operator==(Node_Iterator& other) { return node_ == other.node_; }
   bool operator!=(Node_Iterator& other) { return node_ != other.node_; }
-  void operator++() { node_ = node_->sibling_.get(); }
+  void operator++() {
+    ++current_idx_;
+    Advance();
+  }
 
  private:
-  Node* node_;
+  // Moves to the first spawned node starting from current_idx_.
+  void Advance() {
+    constexpr int kSize = ChildStatsChunk::kSize;
+    node_ = nullptr;
+    for (; current_idx_ < total_count_; ++current_idx_) {
+      const ChildStatsChunk* chunk =
+          chunks_[current_idx_ / kSize].load(std::memory_order_acquire);
+      if (chunk) node_ = chunk->node[current_idx_ % kSize].load();
+      if (node_) return;
+    }
+  }
+
+  const std::atomic<ChildStatsChunk*>* chunks_ = nullptr;
+  uint16_t current_idx_ = 0;
+  uint16_t total_count_ = 0;
+  Node* node_ = nullptr;
 };
 
 class Node::NodeRange {
  public:
-  Node_Iterator begin() { return Node_Iterator(node_); }
-  Node_Iterator end() { return Node_Iterator(nullptr); }
+  Node_Iterator begin() { return Node_Iterator(edges_); }
+  Node_Iterator end() { return Node_Iterator(); }
 
  private:
-  NodeRange(Node* node) : node_(node) {}
-  Node* node_;
+  NodeRange(const EdgeList& edges) : edges_(edges) {}
+  const EdgeList& edges_;
   friend class Node;
 };
 
+// Sets number of threads which free released subtrees, 1 by default.
+void SetNodeGcThreads(int threads);
+
+// Makes the GC free released subtrees now, e.g. when a tree is out of its
+// memory budget, rather than within the next 100 ms.
+void WakeNodeGc();
+
+struct NodeGcStats {
+  // Released subtrees (or their parts) waiting in the queue.
+  int subtrees = 0;
+  // Estimated number of nodes in them, and bytes taken by those nodes (not
+  // counting edges).
+  int64_t nodes_pending = 0;
+  int64_t bytes_pending = 0;
+};
+NodeGcStats GetNodeGcStats();
+
 class NodeTree {
  public:
   ~NodeTree() { DeallocateTree(); }
-  // Adds a move to current_head_.
-  void MakeMove(Move move);
+  // Adds a move to current_head_. Other children of the old head are released,
+  // unless @keep_siblings.
+  void MakeMove(Move move, bool keep_siblings = false);
   // Resets the current head to ensure it doesn't carry over details from a
   // previous search.
   void TrimTreeAtHead();
   // Sets the position in a tree, trying to reuse the tree.
   // If @auto_garbage_collect, old tree is garbage collected immediately. (may
   // take some milliseconds)
+  // If @keep_last_siblings, alternatives to the last move are kept in the tree,
+  // so that the next ResetToPosition() could reuse them (e.g. after pondering
+  // on a move which opponent then doesn't play).
   void ResetToPosition(const std::string& starting_fen,
-                       const std::vector<Move>& moves);
+                       const std::vector<Move>& moves,
+                       bool keep_last_siblings = false);
   const Position& HeadPosition() const { return history_.Last(); }
   int GetPlyCount() const { return HeadPosition().GetGamePly(); }
   bool IsBlackToMove() const { return HeadPosition().IsBlackToMove(); }
   Node* GetCurrentHead() const { return current_head_; }
-  Node* GetGameBeginNode() const { return gamebegin_node_.get(); }
+  Node* GetGameBeginNode() const { return gamebegin_node_; }
   const PositionHistory& GetPositionHistory() const { return history_; }
 
+  // Writes the subtree of current head (visited nodes only) to a file.
+  // Returns the number of nodes written.
+  uint64_t SaveHeadSubtree(const std::string& filename) const;
+  // Replaces the subtree of current head with the one from a file written by
+  // SaveHeadSubtree() for the same position. Returns the number of nodes read.
+  uint64_t LoadHeadSubtree(const std::string& filename);
+
  private:
+  struct FileNode;
   void DeallocateTree();
+  static uint64_t SaveSubtree(const Node* node, std::ostream* out);
+  // Loads @node, whose record has already been read, with its subtree.
+  // @board is the position of @node, and @depth its distance from the head.
+  static uint64_t LoadSubtree(Node* node, const FileNode& record,
+                              const ChessBoard& board, std::istream* in,
+                              int depth);
+  // Memory of the tree. Declared first, as the nodes count into it when they
+  // are destroyed.
+  std::shared_ptr<TreeMemory> memory_ = std::make_shared<TreeMemory>();
   // A node which to start search from.
   Node* current_head_ = nullptr;
-  // Root node of a game tree.
-  std::unique_ptr<Node> gamebegin_node_;
+  // Root node of a game tree, and its parent which keeps its stats.
+  Node* gamebegin_node_ = nullptr;
+  std::unique_ptr<Node> gamebegin_parent_;
   PositionHistory history_;
 };
 
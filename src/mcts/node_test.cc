@@ -0,0 +1,264 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "mcts/node.h"
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "utils/exception.h"
+
+namespace lczero {
+namespace {
+
+// Backs up value @v through @node, as a search would for a new visit.
+void Visit(Node* node, float v) {
+  ASSERT_TRUE(node->TryStartScoreUpdate());
+  node->FinalizeScoreUpdate(v);
+}
+
+// Expands @node with @moves, with priors decreasing in the order of moves.
+void Expand(Node* node, const MoveList& moves) {
+  node->CreateEdges(moves);
+  float p = 0.5f;
+  for (auto& edge : node->Edges()) {
+    edge.edge()->SetP(p);
+    p /= 2;
+  }
+}
+
+void ExpectSameSubtree(const Node* expected, const Node* actual) {
+  EXPECT_EQ(expected->GetN(), actual->GetN());
+  EXPECT_FLOAT_EQ(expected->GetQ(), actual->GetQ());
+  EXPECT_FLOAT_EQ(expected->GetVisitedPolicy(), actual->GetVisitedPolicy());
+  EXPECT_EQ(expected->IsTerminal(), actual->IsTerminal());
+  ASSERT_EQ(expected->GetNumEdges(), actual->GetNumEdges());
+  auto expected_edges = expected->Edges();
+  auto actual_edges = actual->Edges();
+  auto actual_edge = actual_edges.begin();
+  for (const auto& expected_edge : expected_edges) {
+    EXPECT_EQ(expected_edge.GetMove(), (*actual_edge).GetMove());
+    EXPECT_EQ(expected_edge.GetP(), (*actual_edge).GetP());
+    const Node* expected_child = expected_edge.node();
+    const Node* actual_child = (*actual_edge).node();
+    if (expected_child && expected_child->GetN() > 0) {
+      ASSERT_NE(actual_child, nullptr);
+      ExpectSameSubtree(expected_child, actual_child);
+    } else {
+      EXPECT_TRUE(actual_child == nullptr || actual_child->GetN() == 0);
+    }
+    ++actual_edge;
+  }
+}
+
+std::string TempFile(const std::string& name) {
+  return ::testing::TempDir() + "/" + name;
+}
+
+std::string ReadFile(const std::string& filename) {
+  std::ifstream in(filename, std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(in),
+                     std::istreambuf_iterator<char>());
+}
+
+void WriteFile(const std::string& filename, const std::string& data) {
+  std::ofstream out(filename, std::ios::binary);
+  out.write(data.data(), data.size());
+}
+
+// Index of the edge of @node with @move.
+int EdgeIndex(const Node* node, Move move) {
+  int index = 0;
+  for (const auto& edge : node->Edges()) {
+    if (edge.GetMove() == move) return index;
+    ++index;
+  }
+  return -1;
+}
+
+// Sizes and offsets of the tree file format.
+constexpr size_t kHeaderSize = 16;
+constexpr size_t kFileNodeSize = 20;
+constexpr size_t kFileNodeNumEdgesOffset = 12;
+constexpr size_t kFileNodeIndexOffset = 16;
+constexpr size_t kFileNodeIsTerminalOffset = 17;
+
+}  // namespace
+
+TEST(NodeTree, SaveLoadRoundTrip) {
+  NodeTree tree;
+  tree.ResetToPosition(ChessBoard::kStartingFen, {});
+  Node* head = tree.GetCurrentHead();
+  ChessBoard board = tree.HeadPosition().GetBoard();
+  Expand(head, board.GenerateLegalMoves());
+  Visit(head, 0.1f);
+
+  Node* first = head->GetOrSpawnChild(0);
+  Visit(first, -0.2f);
+  Node* second = head->GetOrSpawnChild(3);
+  Visit(second, 0.4f);
+  // Spawned but never visited, not saved.
+  head->GetOrSpawnChild(5);
+
+  ChessBoard child_board = board;
+  child_board.ApplyMove(head->GetEdgeToNode(second)->GetMove());
+  child_board.Mirror();
+  Expand(second, child_board.GenerateLegalMoves());
+  Node* grandchild = second->GetOrSpawnChild(1);
+  Visit(grandchild, 0.7f);
+  Visit(grandchild, -0.3f);
+  grandchild->MakeTerminal(GameResult::DRAW);
+
+  const std::string filename = TempFile("node_test_round_trip.tree");
+  EXPECT_EQ(tree.SaveHeadSubtree(filename), 4u);
+
+  NodeTree loaded;
+  loaded.ResetToPosition(ChessBoard::kStartingFen, {});
+  EXPECT_EQ(loaded.LoadHeadSubtree(filename), 4u);
+  ExpectSameSubtree(head, loaded.GetCurrentHead());
+  std::remove(filename.c_str());
+}
+
+TEST(NodeTree, LoadRejectsBadChildIndices) {
+  NodeTree tree;
+  tree.ResetToPosition(ChessBoard::kStartingFen, {});
+  Node* head = tree.GetCurrentHead();
+  Expand(head, tree.HeadPosition().GetBoard().GenerateLegalMoves());
+  Visit(head, 0.0f);
+  Visit(head->GetOrSpawnChild(2), 0.0f);
+  Visit(head->GetOrSpawnChild(4), 0.0f);
+
+  const std::string filename = TempFile("node_test_bad_index.tree");
+  tree.SaveHeadSubtree(filename);
+  const std::string data = ReadFile(filename);
+  // The head record and its edges are followed by the two leaf children.
+  const size_t second_child = kHeaderSize + kFileNodeSize +
+                              head->GetNumEdges() * sizeof(Edge) +
+                              kFileNodeSize;
+  ASSERT_EQ(data.size(), second_child + kFileNodeSize);
+  ASSERT_EQ(data[second_child + kFileNodeIndexOffset], 4);
+
+  NodeTree loaded;
+  loaded.ResetToPosition(ChessBoard::kStartingFen, {});
+  for (const int index : {2, 1, int(head->GetNumEdges()), 255}) {
+    std::string corrupt = data;
+    corrupt[second_child + kFileNodeIndexOffset] = char(index);
+    WriteFile(filename, corrupt);
+    EXPECT_THROW(loaded.LoadHeadSubtree(filename), Exception);
+    EXPECT_FALSE(loaded.GetCurrentHead()->HasChildren());
+  }
+  std::remove(filename.c_str());
+}
+
+TEST(NodeTree, LoadRejectsBadEdges) {
+  NodeTree tree;
+  tree.ResetToPosition(ChessBoard::kStartingFen, {});
+  Node* head = tree.GetCurrentHead();
+  Expand(head, tree.HeadPosition().GetBoard().GenerateLegalMoves());
+  Visit(head, 0.0f);
+
+  const std::string filename = TempFile("node_test_bad_edges.tree");
+  tree.SaveHeadSubtree(filename);
+  const std::string data = ReadFile(filename);
+  const size_t head_record = kHeaderSize;
+  const size_t edges = head_record + kFileNodeSize;
+  const size_t num_edges = head->GetNumEdges();
+  ASSERT_EQ(data.size(), edges + num_edges * sizeof(Edge));
+
+  NodeTree loaded;
+  loaded.ResetToPosition(ChessBoard::kStartingFen, {});
+  EXPECT_EQ(loaded.LoadHeadSubtree(filename), 1u);
+
+  std::vector<std::string> corrupt_files;
+  // Edges not sorted by P.
+  std::string corrupt = data;
+  std::swap_ranges(corrupt.begin() + edges,
+                   corrupt.begin() + edges + sizeof(Edge),
+                   corrupt.begin() + edges + sizeof(Edge));
+  corrupt_files.push_back(corrupt);
+  // A legal move missing, another one twice.
+  corrupt = data;
+  std::copy_n(data.begin() + edges + sizeof(Edge), sizeof(Edge),
+              corrupt.begin() + edges);
+  corrupt_files.push_back(corrupt);
+  // A legal move missing.
+  corrupt = data;
+  corrupt[head_record + kFileNodeNumEdgesOffset] = char(num_edges - 1);
+  corrupt.resize(corrupt.size() - sizeof(Edge));
+  corrupt_files.push_back(corrupt);
+  // A terminal node with edges.
+  corrupt = data;
+  corrupt[head_record + kFileNodeIsTerminalOffset] = 1;
+  corrupt_files.push_back(corrupt);
+
+  for (const auto& corrupt : corrupt_files) {
+    WriteFile(filename, corrupt);
+    EXPECT_THROW(loaded.LoadHeadSubtree(filename), Exception);
+    EXPECT_FALSE(loaded.GetCurrentHead()->HasChildren());
+  }
+  std::remove(filename.c_str());
+}
+
+TEST(NodeTree, LoadRejectsTooDeepTree) {
+  NodeTree tree;
+  tree.ResetToPosition(ChessBoard::kStartingFen, {});
+  // Knights going back and forth. Positions are mirrored for black, so both
+  // sides play the same moves.
+  ChessBoard board = tree.HeadPosition().GetBoard();
+  Node* node = tree.GetCurrentHead();
+  std::vector<Node*> line;
+  for (int i = 0; i < 1500; ++i) {
+    Expand(node, board.GenerateLegalMoves());
+    line.push_back(node);
+    const Move move(i % 4 < 2 ? "g1f3" : "f3g1");
+    const int index = EdgeIndex(node, move);
+    ASSERT_GE(index, 0);
+    node = node->GetOrSpawnChild(index);
+    board.ApplyMove(move);
+    board.Mirror();
+  }
+  line.push_back(node);
+  for (auto it = line.rbegin(); it != line.rend(); ++it) Visit(*it, 0.0f);
+
+  const std::string filename = TempFile("node_test_deep.tree");
+  EXPECT_EQ(tree.SaveHeadSubtree(filename), 1501u);
+  NodeTree loaded;
+  loaded.ResetToPosition(ChessBoard::kStartingFen, {});
+  EXPECT_THROW(loaded.LoadHeadSubtree(filename), Exception);
+  std::remove(filename.c_str());
+}
+
+}  // namespace lczero
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
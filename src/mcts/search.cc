@@ -30,6 +30,9 @@
 #include <algorithm>
 #include <chrono>
 #include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <future>
 #include <iomanip>
 #include <iostream>
 #include <sstream>
@@ -38,7 +41,9 @@
 #include "mcts/node.h"
 #include "neural/cache.h"
 #include "neural/encoder.h"
+#include "utils/metrics.h"
 #include "utils/random.h"
+#include "utils/threadpool.h"
 
 namespace lczero {
 
@@ -54,16 +59,78 @@ const char* Search::kAggressiveTimePruningStr =
 const char* Search::kFpuReductionStr = "First Play Urgency Reduction";
 const char* Search::kCacheHistoryLengthStr =
     "Length of history to include in cache";
+const char* Search::kCacheMirrorStr =
+    "Share cache between positions mirrored between a and h files";
 const char* Search::kPolicySoftmaxTempStr = "Policy softmax temperature";
 const char* Search::kAllowedNodeCollisionsStr =
     "Allowed node collisions, per batch";
 const char* Search::kStickyCheckmateStr = "Ignore alternatives to checkmate";
+const char* Search::kLockFreeSearchStr = "Lock-free tree descent and backup";
+const char* Search::kMultiLeafGatherStr = "Gather multiple leaves per descent";
+const char* Search::kPipelinedSearchStr =
+    "Gather next minibatch while NN computes";
+const char* Search::kTranspositionsStr = "Reuse evaluations of transpositions";
+const char* Search::kTreeMemoryMbStr = "Search tree memory budget, MB";
+const char* Search::kGcThreadsStr = "Garbage collector threads";
+const char* Search::kRootParallelTreesStr = "Root-parallel search trees";
+const char* Search::kMinimumKLDGainPerNodeStr = "Minimum KLD gain per node";
+const char* Search::kKLDGainAverageIntervalStr = "KLD gain average interval";
+const char* Search::kMultivisitCollisionsStr =
+    "Count collisions as extra visits";
+const char* Search::kDeferredExtensionStr = "Extend leaves while NN computes";
+const char* Search::kNnPriorityStr = "NN computation priority";
+const char* Search::kStageTimesStr = "Show time spent in stages of search";
 
 namespace {
 const int kSmartPruningToleranceNodes = 100;
 const int kSmartPruningToleranceMs = 200;
 // Maximum delay between outputting "uci info" when nothing interesting happens.
 const int kUciInfoMinimumFrequencyMs = 5000;
+// Prefetching looks at no more than this many leaves per batch slot it fills,
+// the rest of them being in cache already.
+const int kPrefetchLookupsPerSlot = 4;
+
+// Metrics of all searches of the process.
+struct SearchMetrics {
+  MetricsCounter* const playouts = Metrics::Get().GetCounter(
+      "lc0_search_playouts_total", "Playouts of all searches");
+  MetricsCounter* const tb_hits = Metrics::Get().GetCounter(
+      "lc0_search_tb_hits_total", "Positions scored from tablebases");
+  ConcurrentHistogram* const move_time = Metrics::Get().GetHistogram(
+      "lc0_search_move_seconds", "Time of searches until bestmove");
+};
+SearchMetrics& GetSearchMetrics() {
+  static SearchMetrics metrics;
+  return metrics;
+}
+
+// Returns @limits with searchmoves restricted to the moves which keep the
+// tablebase result of the last position of @history, if it's in @syzygy_tb.
+SearchLimits LimitMovesByTablebase(const SearchLimits& limits,
+                                   const PositionHistory& history,
+                                   SyzygyTablebase* syzygy_tb) {
+  const ChessBoard& board = history.Last().GetBoard();
+  if (!syzygy_tb || !syzygy_tb->CanProbe(board)) return limits;
+  MoveList moves;
+  if (!syzygy_tb->RootProbe(history, &moves) &&
+      !syzygy_tb->RootProbeWdl(board, &moves)) {
+    return limits;
+  }
+  SearchLimits result = limits;
+  if (limits.searchmoves.empty()) {
+    result.searchmoves = moves;
+    return result;
+  }
+  // Of the moves asked for, only the best ones are searched, if there are any.
+  MoveList best_moves;
+  for (const auto& move : limits.searchmoves) {
+    if (std::find(moves.begin(), moves.end(), move) != moves.end()) {
+      best_moves.push_back(move);
+    }
+  }
+  if (!best_moves.empty()) result.searchmoves = best_moves;
+  return result;
+}
 }  // namespace
 
 void Search::PopulateUciParams(OptionsParser* options) {
@@ -85,22 +152,44 @@ void Search::PopulateUciParams(OptionsParser* options) {
                             "fpu-reduction") = 0.0f;
   options->Add<IntOption>(kCacheHistoryLengthStr, 0, 7,
                           "cache-history-length") = 7;
+  options->Add<BoolOption>(kCacheMirrorStr, "cache-mirror") = false;
   options->Add<FloatOption>(kPolicySoftmaxTempStr, 0.1f, 10.0f,
                             "policy-softmax-temp") = 1.0f;
   options->Add<IntOption>(kAllowedNodeCollisionsStr, 0, 1024,
                           "allowed-node-collisions") = 0;
   options->Add<BoolOption>(kStickyCheckmateStr, "sticky-checkmate") = false;
+  options->Add<BoolOption>(kLockFreeSearchStr, "lock-free-search") = false;
+  options->Add<BoolOption>(kMultiLeafGatherStr, "multi-leaf-gather") = false;
+  options->Add<BoolOption>(kPipelinedSearchStr, "pipelined-search") = false;
+  options->Add<BoolOption>(kTranspositionsStr, "transpositions") = false;
+  options->Add<IntOption>(kTreeMemoryMbStr, 0, 1024 * 1024, "tree-memory-mb") =
+      0;
+  options->Add<IntOption>(kGcThreadsStr, 1, 64, "gc-threads") = 1;
+  options->Add<IntOption>(kRootParallelTreesStr, 1, 64,
+                          "root-parallel-trees") = 1;
+  options->Add<FloatOption>(kMinimumKLDGainPerNodeStr, 0.0f, 1.0f,
+                            "minimum-kldgain-per-node") = 0.0f;
+  options->Add<IntOption>(kKLDGainAverageIntervalStr, 1, 10000000,
+                          "kldgain-average-interval") = 100;
+  options->Add<BoolOption>(kMultivisitCollisionsStr, "multivisit-collisions") =
+      false;
+  options->Add<BoolOption>(kDeferredExtensionStr, "deferred-extension") = false;
+  options->Add<IntOption>(kNnPriorityStr, 0, 1, "nn-priority") = 1;
+  options->Add<BoolOption>(kStageTimesStr, "stage-times") = false;
 }
 
 Search::Search(const NodeTree& tree, Network* network,
                BestMoveInfo::Callback best_move_callback,
                ThinkingInfo::Callback info_callback, const SearchLimits& limits,
-               const OptionsDict& options, NNCache* cache)
+               const OptionsDict& options, NNCache* cache,
+               SyzygyTablebase* syzygy_tb, uint32_t cache_generation)
     : root_node_(tree.GetCurrentHead()),
       cache_(cache),
+      cache_generation_(cache_generation),
+      syzygy_tb_(syzygy_tb),
       played_history_(tree.GetPositionHistory()),
       network_(network),
-      limits_(limits),
+      limits_(LimitMovesByTablebase(limits, played_history_, syzygy_tb)),
       start_time_(std::chrono::steady_clock::now()),
       initial_visits_(root_node_->GetN()),
       best_move_callback_(best_move_callback),
@@ -115,9 +204,35 @@ Search::Search(const NodeTree& tree, Network* network,
       kAggressiveTimePruning(options.Get<float>(kAggressiveTimePruningStr)),
       kFpuReduction(options.Get<float>(kFpuReductionStr)),
       kCacheHistoryLength(options.Get<int>(kCacheHistoryLengthStr)),
+      kCacheMirror(options.Get<bool>(kCacheMirrorStr)),
       kPolicySoftmaxTemp(options.Get<float>(kPolicySoftmaxTempStr)),
+      kBackendPolicySoftmaxTemp(kPolicySoftmaxTemp != 1.0f &&
+                                network->SupportsPolicySoftmaxTemp()),
       kAllowedNodeCollisions(options.Get<int>(kAllowedNodeCollisionsStr)),
-      kStickyCheckmate(options.Get<bool>(kStickyCheckmateStr)) {}
+      kStickyCheckmate(options.Get<bool>(kStickyCheckmateStr)),
+      kLockFreeSearch(options.Get<bool>(kLockFreeSearchStr)),
+      kMultiLeafGather(options.Get<bool>(kMultiLeafGatherStr)),
+      kPipelinedSearch(options.Get<bool>(kPipelinedSearchStr)),
+      kTranspositions(options.Get<bool>(kTranspositionsStr)),
+      kTreeMemoryMb(options.Get<int>(kTreeMemoryMbStr)),
+      kRootParallelTrees(options.Get<int>(kRootParallelTreesStr)),
+      kMinimumKLDGainPerNode(options.Get<float>(kMinimumKLDGainPerNodeStr)),
+      kKLDGainAverageInterval(options.Get<int>(kKLDGainAverageIntervalStr)),
+      kMultivisitCollisions(options.Get<bool>(kMultivisitCollisionsStr)),
+      kDeferredExtension(options.Get<bool>(kDeferredExtensionStr)),
+      kNnPriority(options.Get<int>(kNnPriorityStr)),
+      kStageTimes(options.Get<bool>(kStageTimesStr)) {
+  // Garbage collector is process-wide, the latest setting applies.
+  SetNodeGcThreads(options.Get<int>(kGcThreadsStr));
+  // Other trees of root-parallel search are only kept for this search.
+  for (int i = 1; i < kRootParallelTrees; ++i) {
+    extra_trees_.emplace_back(std::make_unique<ExtraTree>());
+    ExtraTree* tree = extra_trees_.back().get();
+    tree->root_parent = std::make_unique<Node>(nullptr, 0);
+    tree->root = tree->root_parent->CreateSingleChildNode(
+        Move(), root_node_->GetTreeMemory());
+  }
+}
 
 namespace {
 void ApplyDirichletNoise(Node* node, float eps, double alpha) {
@@ -140,6 +255,70 @@ void ApplyDirichletNoise(Node* node, float eps, double alpha) {
 }
 }  // namespace
 
+//////////////////////////////////////////////////////////////////////////////
+// SearchWorker::EdgeStats
+//////////////////////////////////////////////////////////////////////////////
+
+void SearchWorker::EdgeStats::Compute(const Node* node, float fpu_q,
+                                      float puct_mult) {
+  node_ = node;
+  fpu_q_ = fpu_q;
+  puct_mult_ = puct_mult;
+  num_edges_ = node->GetNumEdges();
+  // Scores are computed for whole chunks, including padding edges.
+  scores.resize(num_edges_ + ChildStatsChunk::kSize - 1);
+  node->ComputeChildScores(fpu_q, puct_mult, scores.data());
+}
+
+void SearchWorker::EdgeStats::Exclude(int idx) {
+  scores[idx] = -std::numeric_limits<float>::infinity();
+}
+
+void SearchWorker::EdgeStats::PickOnly(int idx) {
+  const float score = scores[idx];
+  std::fill(scores.begin(), scores.begin() + num_edges_,
+            -std::numeric_limits<float>::infinity());
+  scores[idx] = score;
+}
+
+int SearchWorker::EdgeStats::PickBest() const {
+  int best_idx = -1;
+  float best = -std::numeric_limits<float>::infinity();
+  for (int i = 0; i < num_edges_; ++i) {
+    if (scores[i] > best) {
+      best = scores[i];
+      best_idx = i;
+    }
+  }
+  return best_idx;
+}
+
+void SearchWorker::EdgeStats::SplitBudget(int budget) {
+  visits.assign(num_edges_, 0);
+  if (budget == 1) {
+    const int best_idx = PickBest();
+    if (best_idx >= 0) visits[best_idx] = 1;
+    return;
+  }
+  // Max-heap by score, and by lowest index among equal scores, same as
+  // PickBest(). Only the score of the picked edge changes after a visit.
+  heap_.clear();
+  for (int i = 0; i < num_edges_; ++i) {
+    if (scores[i] == -std::numeric_limits<float>::infinity()) continue;
+    heap_.emplace_back(scores[i], -i);
+  }
+  std::make_heap(heap_.begin(), heap_.end());
+  for (int i = 0; i < budget && !heap_.empty(); ++i) {
+    std::pop_heap(heap_.begin(), heap_.end());
+    const int best_idx = -heap_.back().second;
+    ++visits[best_idx];
+    // Virtual loss for the next visits.
+    heap_.back().first = node_->ComputeChildScore(best_idx, fpu_q_, puct_mult_,
+                                                  visits[best_idx]);
+    std::push_heap(heap_.begin(), heap_.end());
+  }
+}
+
 void Search::SendUciInfo() REQUIRES(nodes_mutex_) {
   if (!best_move_edge_) return;
   last_outputted_best_move_edge_ = best_move_edge_.edge();
@@ -151,6 +330,10 @@ void Search::SendUciInfo() REQUIRES(nodes_mutex_) {
       cache_->GetSize() * 1000LL / std::max(cache_->GetCapacity(), 1);
   uci_info_.nps =
       uci_info_.time ? (total_playouts_ * 1000 / uci_info_.time) : 0;
+  if (syzygy_tb_) uci_info_.tbhits = tb_hits_.load(std::memory_order_relaxed);
+  if (const TreeMemory* memory = root_node_->GetTreeMemory()) {
+    uci_info_.tree_bytes = memory->GetBytes();
+  }
   uci_info_.score = 290.680623072 * tan(1.548090806 * best_move_edge_.GetQ(0));
   uci_info_.pv.clear();
 
@@ -177,6 +360,50 @@ void Search::MaybeOutputInfo() {
        uci_info_.time + kUciInfoMinimumFrequencyMs < GetTimeSinceStart())) {
     SendUciInfo();
   }
+  if (kStageTimes && !responded_bestmove_ &&
+      last_stage_times_ms_ + kUciInfoMinimumFrequencyMs < GetTimeSinceStart()) {
+    SendStageTimes();
+  }
+}
+
+SearchStageTimes Search::GetStageTimes() const {
+  SearchStageTimes times;
+  for (int i = 0; i < kSearchStageCount; ++i) {
+    times.ns[i] = stage_ns_[i].load(std::memory_order_relaxed);
+  }
+  times.iterations = stage_iterations_.load(std::memory_order_relaxed);
+  return times;
+}
+
+void Search::SendStageTimes() {
+  last_stage_times_ms_ = GetTimeSinceStart();
+#ifndef NO_SEARCH_TIMING
+  const SearchStageTimes times = GetStageTimes();
+  int64_t total_ns = 0;
+  for (const int64_t ns : times.ns) total_ns += ns;
+  std::ostringstream oss;
+  oss << "Search stages:" << std::fixed << std::setprecision(1);
+  for (int i = 0; i < kSearchStageCount; ++i) {
+    oss << " " << GetSearchStageName(static_cast<SearchStage>(i)) << " "
+        << 100.0 * times.ns[i] / std::max<int64_t>(total_ns, 1) << "%";
+  }
+  oss << " of " << total_ns / 1000000 << "ms in " << times.iterations
+      << " iterations";
+  ThinkingInfo info;
+  info.comment = oss.str();
+  info_callback_(info);
+#endif
+}
+
+float Search::GetPlayoutsPerSecond() const {
+  int64_t time_ms;
+  {
+    Mutex::Lock lock(counters_mutex_);
+    time_ms = stop_time_ms_ >= 0 ? stop_time_ms_ : GetTimeSinceStart();
+  }
+  SharedMutex::SharedLock lock(nodes_mutex_);
+  if (time_ms < kSmartPruningToleranceMs || total_playouts_ == 0) return -1.0f;
+  return 1000.0f * total_playouts_ / time_ms;
 }
 
 int64_t Search::GetTimeSinceStart() const {
@@ -185,7 +412,8 @@ int64_t Search::GetTimeSinceStart() const {
       .count();
 }
 
-void Search::SendMovesStats() const {
+void Search::SendMovesStats() const
+    REQUIRES(nodes_mutex_) REQUIRES(counters_mutex_) {
   const float parent_q =
       -root_node_->GetQ() -
       kFpuReduction * std::sqrt(root_node_->GetVisitedPolicy());
@@ -235,7 +463,7 @@ void Search::SendMovesStats() const {
       v = edge.node()->GetQ();
     } else {
       NNCacheLock nneval = GetCachedFirstPlyResult(edge);
-      if (nneval) v = -nneval->q;
+      if (nneval) v = -nneval.GetQ();
     }
     if (v) {
       oss << std::setw(7) << std::setprecision(4) << *v;
@@ -249,6 +477,74 @@ void Search::SendMovesStats() const {
     info.comment = oss.str();
     info_callback_(info);
   }
+
+  {
+    std::ostringstream oss;
+    oss << "Idle worker waits: " << idle_waits_ << ", total "
+        << idle_time_us_ / 1000 << "ms";
+    info.comment = oss.str();
+    info_callback_(info);
+  }
+
+  {
+    const NodeGcStats gc_stats = GetNodeGcStats();
+    std::ostringstream oss;
+    oss << "GC queue: " << gc_stats.subtrees << " subtrees, about "
+        << gc_stats.nodes_pending << " nodes ("
+        << gc_stats.bytes_pending / 1048576 << "MB) pending";
+    info.comment = oss.str();
+    info_callback_(info);
+  }
+
+  {
+    const NNCacheStats stats = cache_->GetStats();
+    std::ostringstream oss;
+    oss << "NNCache: " << stats.hits << " of " << stats.lookups << " hits ("
+        << std::fixed << std::setprecision(1)
+        << 100.0 * stats.hits / std::max<uint64_t>(stats.lookups, 1)
+        << "%), " << stats.disk_hits << " from file, " << stats.inserts
+        << " inserts (" << prefetched_.load() << " prefetched this search, "
+        << prefetch_hits_.load() << " of them used), "
+        << stats.evictions << " evictions, " << stats.size << " of "
+        << stats.capacity << " entries (" << stats.bytes / 1048576 << "MB), "
+        << stats.pinned << " pinned, " << stats.retired << " retired";
+    info.comment = oss.str();
+    info_callback_(info);
+  }
+
+  if (kTranspositions) {
+    const int64_t hits = transposition_hits_.load();
+    const int64_t lookups = transposition_lookups_.load();
+    std::ostringstream oss;
+    oss << "Transpositions: " << hits << " of " << lookups
+        << " expansions evaluated without NN or cache (" << std::fixed
+        << std::setprecision(1) << 100.0 * hits / std::max<int64_t>(lookups, 1)
+        << "%)";
+    info.comment = oss.str();
+    info_callback_(info);
+  }
+
+  if (kMultivisitCollisions) {
+    std::ostringstream oss;
+    oss << "Collisions: " << total_collisions_ << " of "
+        << total_playouts_ + total_collisions_ - total_multivisits_
+        << " playouts, " << total_multivisits_ << " recovered as visits ("
+        << std::fixed << std::setprecision(1)
+        << 100.0 * total_multivisits_ /
+               std::max<int64_t>(total_collisions_, 1)
+        << "%)";
+    info.comment = oss.str();
+    info_callback_(info);
+  }
+
+  if (kMultiLeafGather) {
+    std::ostringstream oss;
+    oss << "Leaves per descent: " << std::fixed << std::setprecision(2)
+        << static_cast<double>(total_playouts_) /
+               std::max<int64_t>(total_descents_, 1);
+    info.comment = oss.str();
+    info_callback_(info);
+  }
 }
 
 NNCacheLock Search::GetCachedFirstPlyResult(EdgeAndNode edge) const {
@@ -257,19 +553,212 @@ NNCacheLock Search::GetCachedFirstPlyResult(EdgeAndNode edge) const {
   // It would be relatively straightforward to generalize this to fetch NN
   // results for an abitrary move.
   optional<float> retval;
-  PositionHistory history(played_history_);  // Is it worth it to move this
-  // initialization to SendMoveStats, reducing n memcpys to 1? Probably not.
+  PositionHistory history;
+  history.ResetToPrefix(played_history_);
   history.Append(edge.GetMove());
-  auto hash = history.HashLast(kCacheHistoryLength + 1);
+  auto hash = GetCacheHash(history, nullptr);
   NNCacheLock nneval(cache_, hash);
   return nneval;
 }
 
+uint64_t Search::GetCacheHash(const PositionHistory& history,
+                              CacheOrder* order) const {
+  const int positions = kCacheHistoryLength + 1;
+  const uint64_t hash = history.HashLast(positions);
+  uint64_t key = hash;
+  // Without castling, a position and its mirror are the same up to flipping
+  // of moves. Both are stored under the key of the one with smaller hash, and
+  // to make moves of both match, probabilities are sorted by the NN index of
+  // moves of that one.
+  if (kCacheMirror && !history.HasCastlingRights(positions)) {
+    const uint64_t flipped_hash = history.HashLast(positions, true);
+    if (order) {
+      *order = flipped_hash < hash ? CacheOrder::kFlippedNnIndex
+                                   : CacheOrder::kNnIndex;
+    }
+    // Differs from unmirrored keys, as the order of probabilities differs.
+    key = HashCat(std::min(hash, flipped_hash), 0x4d6972726f72ull);
+  } else if (order) {
+    *order = CacheOrder::kLegalMoves;
+  }
+  // Entries computed by the backend with a temperature differ from plain
+  // ones, of which search applies the temperature itself.
+  if (kBackendPolicySoftmaxTemp) {
+    uint32_t temp_bits;
+    std::memcpy(&temp_bits, &kPolicySoftmaxTemp, sizeof(temp_bits));
+    key = HashCat({key, 0x54656d70ull, temp_bits});
+  }
+  // Keys of the first generation are plain, so that they match those which
+  // other processes store in a shared table or cache file.
+  return cache_generation_ ? HashCat(key, cache_generation_) : key;
+}
+
+std::vector<int> Search::GetCacheMoveOrder(const MoveList& moves,
+                                           CacheOrder order) {
+  std::vector<std::pair<uint16_t, int>> keys;
+  keys.reserve(moves.size());
+  for (size_t i = 0; i < moves.size(); ++i) {
+    Move move = moves[i];
+    if (order == CacheOrder::kFlippedNnIndex) move.FlipFiles();
+    keys.emplace_back(move.as_nn_index(), i);
+  }
+  std::sort(keys.begin(), keys.end());
+  std::vector<int> result;
+  result.reserve(keys.size());
+  for (const auto& key : keys) result.push_back(key.second);
+  return result;
+}
+
+std::vector<uint16_t> Search::GetCachedMoves(const MoveList& legal_moves,
+                                             CacheOrder order) {
+  std::vector<uint16_t> moves;
+  moves.reserve(legal_moves.size());
+  if (order == CacheOrder::kLegalMoves) {
+    for (const auto& move : legal_moves) {
+      moves.emplace_back(move.as_nn_index());
+    }
+  } else {
+    for (int idx : GetCacheMoveOrder(legal_moves, order)) {
+      moves.emplace_back(legal_moves[idx].as_nn_index());
+    }
+  }
+  return moves;
+}
+
+std::unique_ptr<NetworkComputation> Search::NewComputation() const {
+  auto computation = network_->NewComputation();
+  // Has to be set first, as it may move the computation to another batch.
+  if (kBackendPolicySoftmaxTemp) {
+    computation->SetPolicySoftmaxTemp(kPolicySoftmaxTemp);
+  }
+  computation->SetPriority(kNnPriority);
+  return computation;
+}
+
+std::vector<NNCacheLock> Search::PopulateCache(int plies) {
+  PositionHistory history = played_history_;
+  CachingPositionEncoder encoder;
+  std::unique_ptr<CachingComputation> computation;
+  std::vector<uint64_t> hashes;
+  // Most plies left to explore below every position visited so far, as the
+  // same key is reached by transpositions, and at different depths.
+  std::unordered_map<uint64_t, int> plies_left;
+  const auto compute = [&]() {
+    if (computation) computation->ComputeBlocking();
+    computation.reset();
+  };
+  std::function<void(int)> visit = [&](int plies_below) {
+    const MoveList legal_moves = history.Last().GetBoard().GenerateLegalMoves();
+    if (legal_moves.empty()) return;
+    CacheOrder order;
+    const uint64_t hash = GetCacheHash(history, &order);
+    const auto it = plies_left.find(hash);
+    if (it != plies_left.end() && it->second >= plies_below) return;
+    if (it == plies_left.end()) {
+      hashes.push_back(hash);
+      if (!cache_->ContainsKey(hash)) {
+        if (!computation) {
+          computation =
+              std::make_unique<CachingComputation>(NewComputation(), cache_);
+        }
+        encoder.Encode(history, 8,
+                       computation->AddInput(
+                           hash, GetCachedMoves(legal_moves, order)));
+        if (computation->GetBatchSize() >= kMiniBatchSize) compute();
+      }
+    }
+    plies_left[hash] = plies_below;
+    if (plies_below == 0) return;
+    for (const auto& move : legal_moves) {
+      history.Append(move);
+      visit(plies_below - 1);
+      history.Pop();
+    }
+  };
+  visit(plies);
+  compute();
+
+  std::vector<NNCacheLock> locks;
+  locks.reserve(hashes.size());
+  for (const uint64_t hash : hashes) locks.emplace_back(cache_, hash);
+  return locks;
+}
+
+void Search::MaybePruneTrees() {
+  const TreeMemory* memory = root_node_->GetTreeMemory();
+  if (kTreeMemoryMb == 0 || !memory) return;
+  // Other workers wait, and then find the released subtrees pending.
+  Mutex::Lock prune_lock(prune_mutex_);
+  // Bytes of released subtrees are counted until the garbage collector frees
+  // them, so the budget is only checked when there are none.
+  const int64_t budget = kTreeMemoryMb * 1048576LL;
+  const int64_t bytes = memory->GetBytes();
+  if (memory->HasPendingSubtrees() || bytes < budget) return;
+  {
+    Mutex::Lock lock(counters_mutex_);
+    // Don't prune when the root node is not yet expanded.
+    if (tree_full_ || total_playouts_ == 0) return;
+  }
+  // Root-parallel trees count into the same budget, and every tree is pruned
+  // by the same fraction. Root N estimates the number of nodes in a tree.
+  const double fraction = static_cast<double>(bytes - budget / 4 * 3) / bytes;
+  int64_t released;
+  {
+    SharedMutex::Lock lock(nodes_mutex_);
+    released = PruneSubtrees(root_node_, fraction * root_node_->GetN());
+  }
+  for (const auto& tree : extra_trees_) {
+    SharedMutex::Lock lock(tree->nodes_mutex);
+    released += PruneSubtrees(tree->root, fraction * tree->root->GetN());
+  }
+  if (released > 0) {
+    WakeNodeGc();
+    return;
+  }
+  Mutex::Lock lock(counters_mutex_);
+  tree_full_ = true;
+}
+
+int64_t Search::PruneSubtrees(Node* node, int64_t nodes) {
+  // Estimated number of nodes below each child, as in Node::DetachChildren().
+  std::vector<std::pair<int64_t, Node*>> children;
+  for (Node* child : node->ChildNodes()) {
+    // Unvisited nodes may be being extended outside of the lock.
+    if (child->GetN() == 0) continue;
+    int64_t below = 0;
+    for (Node* grandchild : child->ChildNodes()) {
+      below += grandchild->GetN() + 1;
+    }
+    if (below > 0) children.emplace_back(below, child);
+  }
+  if (children.empty()) return 0;
+  std::sort(children.begin(), children.end());
+  int64_t released = 0;
+  for (size_t i = 0; i < children.size() && released < nodes; ++i) {
+    Node* child = children[i].second;
+    if (i + 1 < children.size() && child->GetNInFlight() == 0) {
+      child->ReleaseChildren();
+      released += children[i].first;
+    } else {
+      released += PruneSubtrees(child, nodes - released);
+    }
+  }
+  return released;
+}
+
 void Search::MaybeTriggerStop() {
   SharedMutex::Lock nodes_lock(nodes_mutex_);
   Mutex::Lock lock(counters_mutex_);
   // Don't stop when the root node is not yet expanded.
   if (total_playouts_ == 0) return;
+  // Stop if the tree is out of memory budget and can't be pruned. In infinite
+  // mode, bestmove can only be sent after "stop", so workers just stop
+  // extending the tree.
+  if (tree_full_ && !limits_.infinite) stop_ = true;
+  // Stop if the root visit distribution hardly changes anymore.
+  if (!limits_.infinite && IsKLDGainTooSmall()) {
+    stop_ = true;
+  }
   // If smart pruning tells to stop (best move found), stop.
   if (found_best_move_) {
     stop_ = true;
@@ -287,17 +776,57 @@ void Search::MaybeTriggerStop() {
   if (limits_.time_ms >= 0 && GetTimeSinceStart() >= limits_.time_ms) {
     stop_ = true;
   }
+  if (stop_ && stop_time_ms_ < 0) stop_time_ms_ = GetTimeSinceStart();
+  // Wake up idle workers so that they could exit.
+  if (stop_) idle_cv_.notify_all();
   // If we are the first to see that stop is needed.
   if (stop_ && !responded_bestmove_) {
     SendUciInfo();
     if (kVerboseStats) SendMovesStats();
+    if (kStageTimes) SendStageTimes();
     best_move_ = GetBestMoveInternal();
     best_move_callback_({best_move_.first, best_move_.second});
     responded_bestmove_ = true;
+    GetSearchMetrics().move_time->Add(GetTimeSinceStart() / 1000.0);
     best_move_edge_ = EdgeAndNode();
   }
 }
 
+bool Search::IsKLDGainTooSmall() {
+  if (kMinimumKLDGainPerNode <= 0.0f) return false;
+  const int64_t visits = total_playouts_ + initial_visits_;
+  if (visits < prev_dist_visits_ + kKLDGainAverageInterval) return false;
+
+  std::vector<uint32_t> new_dist = GetExtraRootVisits(root_node_);
+  new_dist.resize(root_node_->GetNumEdges());
+  int idx = 0;
+  for (auto edge : root_node_->Edges()) new_dist[idx++] += edge.GetN();
+
+  bool too_small = false;
+  if (!prev_dist_.empty() && prev_dist_.size() == new_dist.size()) {
+    double old_sum = 0.0;
+    double new_sum = 0.0;
+    for (size_t i = 0; i < new_dist.size(); ++i) {
+      old_sum += prev_dist_[i];
+      new_sum += new_dist[i];
+    }
+    // KL(old || new), child visits never decrease, so it's always finite.
+    double kld = 0.0;
+    for (size_t i = 0; i < new_dist.size(); ++i) {
+      if (prev_dist_[i] == 0) continue;
+      const double old_p = prev_dist_[i] / old_sum;
+      const double new_p = new_dist[i] / new_sum;
+      kld += old_p * std::log(old_p / new_p);
+    }
+    if (old_sum > 0 && new_sum > old_sum) {
+      too_small = kld / (new_sum - old_sum) < kMinimumKLDGainPerNode;
+    }
+  }
+  prev_dist_.swap(new_dist);
+  prev_dist_visits_ = visits;
+  return too_small;
+}
+
 void Search::UpdateRemainingMoves() {
   if (kAggressiveTimePruning <= 0.0f) return;
   SharedMutex::Lock lock(nodes_mutex_);
@@ -305,10 +834,15 @@ void Search::UpdateRemainingMoves() {
   // Check for how many playouts there is time remaining.
   if (limits_.time_ms >= 0) {
     auto time_since_start = GetTimeSinceStart();
+    // Until this search's own speed can be measured, rely on the estimate
+    // from earlier searches, if there is one.
+    int64_t nps = limits_.expected_nps;
     if (time_since_start > kSmartPruningToleranceMs) {
-      auto nps = (1000LL * total_playouts_ + kSmartPruningToleranceNodes) /
-                     (time_since_start - kSmartPruningToleranceMs) +
-                 1;
+      nps = (1000LL * total_playouts_ + kSmartPruningToleranceNodes) /
+                (time_since_start - kSmartPruningToleranceMs) +
+            1;
+    }
+    if (nps > 0) {
       int64_t remaining_time = limits_.time_ms - time_since_start;
       // Put early_exit scaler here so calculation doesn't have to be done on
       // every node.
@@ -382,9 +916,37 @@ std::pair<Move, Move> Search::GetBestMoveInternal() const
 
   Move ponder_move;  // Default is "null move" which means "don't display
                      // anything".
+  // The expected reply is the best child of the chosen move, if any.
+  if (best_node.HasNode() && best_node.node()->HasChildren()) {
+    ponder_move = GetBestChildNoTemperature(best_node.node())
+                      .GetMove(!played_history_.IsBlackToMove());
+  }
   return {best_node.GetMove(played_history_.IsBlackToMove()), ponder_move};
 }
 
+std::vector<uint32_t> Search::GetExtraRootVisits(Node* parent) const {
+  std::vector<uint32_t> result;
+  if (parent != root_node_ || extra_trees_.empty()) return result;
+  result.resize(parent->GetNumEdges());
+  std::vector<Move> moves;
+  for (auto edge : parent->Edges()) moves.push_back(edge.GetMove());
+  for (const auto& tree : extra_trees_) {
+    SharedMutex::SharedLock lock(tree->nodes_mutex);
+    const Node* root = tree->root;
+    // Edges are only safe to read after the first visit is backed up. All
+    // roots have the same position, so the same moves, but edges of each are
+    // sorted by its own (noised) priors.
+    if (root->GetN() == 0) continue;
+    if (root->GetNumEdges() != parent->GetNumEdges()) continue;
+    for (auto edge : root->Edges()) {
+      if (edge.GetN() == 0) continue;
+      const auto iter = std::find(moves.begin(), moves.end(), edge.GetMove());
+      if (iter != moves.end()) result[iter - moves.begin()] += edge.GetN();
+    }
+  }
+  return result;
+}
+
 // Returns a child with most visits.
 EdgeAndNode Search::GetBestChildNoTemperature(Node* parent) const {
   EdgeAndNode best_edge;
@@ -394,14 +956,17 @@ EdgeAndNode Search::GetBestChildNoTemperature(Node* parent) const {
   //   * If that number is 0, the one with larger prior wins.
   //   * If that number is larger than 0, the one with larger eval wins.
   std::tuple<int, float, float> best(-1, 0.0, 0.0);
+  const auto extra_visits = GetExtraRootVisits(parent);
+  int idx = 0;
   for (auto edge : parent->Edges()) {
+    const int n = edge.GetN() + (extra_visits.empty() ? 0 : extra_visits[idx]);
+    ++idx;
     if (parent == root_node_ && !limits_.searchmoves.empty() &&
         std::find(limits_.searchmoves.begin(), limits_.searchmoves.end(),
                   edge.GetMove()) == limits_.searchmoves.end()) {
       continue;
     }
-    std::tuple<int, float, float> val(edge.GetN(), edge.GetQ(-10.0),
-                                      edge.GetP());
+    std::tuple<int, float, float> val(n, edge.GetQ(-10.0), edge.GetP());
     if (val > best) {
       best = val;
       best_edge = edge;
@@ -416,15 +981,21 @@ EdgeAndNode Search::GetBestChildWithTemperature(Node* parent,
   assert(parent->GetChildrenVisits() > 0);
   std::vector<float> cumulative_sums;
   float sum = 0.0;
-  const float n_parent = parent->GetN();
+  const auto extra_visits = GetExtraRootVisits(parent);
+  float n_parent = parent->GetN();
+  for (const auto n : extra_visits) n_parent += n;
 
+  int edge_idx = 0;
   for (auto edge : parent->Edges()) {
+    const float n =
+        edge.GetN() + (extra_visits.empty() ? 0 : extra_visits[edge_idx]);
+    ++edge_idx;
     if (parent == root_node_ && !limits_.searchmoves.empty() &&
         std::find(limits_.searchmoves.begin(), limits_.searchmoves.end(),
                   edge.GetMove()) == limits_.searchmoves.end()) {
       continue;
     }
-    sum += std::pow(edge.GetN() / n_parent, 1 / temperature);
+    sum += std::pow(n / n_parent, 1 / temperature);
     cumulative_sums.push_back(sum);
   }
 
@@ -445,19 +1016,50 @@ EdgeAndNode Search::GetBestChildWithTemperature(Node* parent,
   return {};
 }
 
+namespace {
+// Returns SearchWorker of the current thread, reset to search @root_node of
+// @search. Threads of the pool (and the thread which runs single-threaded
+// searches) keep their worker between searches, so its buffers are already
+// allocated.
+SearchWorker* GetThreadWorker(Search* search, Node* root_node) {
+  static thread_local std::unique_ptr<SearchWorker> worker;
+  if (worker) {
+    worker->Reset(search, root_node);
+  } else {
+    worker = std::make_unique<SearchWorker>(search, root_node);
+  }
+  return worker.get();
+}
+}  // namespace
+
+void Search::LimitTrees(size_t threads) {
+  if (extra_trees_.size() >= threads) {
+    extra_trees_.resize(std::max<size_t>(threads, 1) - 1);
+  }
+}
+
 void Search::StartThreads(size_t how_many) {
   Mutex::Lock lock(threads_mutex_);
+  if (threads_.empty()) LimitTrees(how_many);
   while (threads_.size() < how_many) {
-    threads_.emplace_back([this]() {
-      SearchWorker worker(this);
-      worker.RunBlocking();
-    });
+    // In root-parallel mode, threads are spread evenly between the trees.
+    const size_t tree_idx = threads_.size() % (extra_trees_.size() + 1);
+    Node* root = tree_idx == 0 ? root_node_ : extra_trees_[tree_idx - 1]->root;
+    threads_.emplace_back(ThreadPool::Get()->Run([this, root]() {
+      Tracer::Get().SetThreadName("search worker");
+      GetThreadWorker(this, root)->RunBlocking();
+    }));
   }
 }
 
 void Search::RunSingleThreaded() {
-  SearchWorker worker(this);
-  worker.RunBlocking();
+  LimitTrees(1);
+  GetThreadWorker(this, root_node_)->RunBlocking();
+}
+
+std::unique_ptr<SearchWorker> Search::NewWorker() {
+  LimitTrees(1);
+  return std::make_unique<SearchWorker>(this, root_node_);
 }
 
 void Search::RunBlocking(size_t threads) {
@@ -472,18 +1074,78 @@ void Search::RunBlocking(size_t threads) {
 void Search::Stop() {
   Mutex::Lock lock(counters_mutex_);
   stop_ = true;
+  if (stop_time_ms_ < 0) stop_time_ms_ = GetTimeSinceStart();
+  idle_cv_.notify_all();
 }
 
 void Search::Abort() {
   Mutex::Lock lock(counters_mutex_);
   responded_bestmove_ = true;
   stop_ = true;
+  if (stop_time_ms_ < 0) stop_time_ms_ = GetTimeSinceStart();
+  idle_cv_.notify_all();
+}
+
+void Search::AddPrefetchedHash(uint64_t hash) {
+  prefetched_hashes_[hash % kPrefetchedHashesSize].store(
+      hash, std::memory_order_relaxed);
+}
+
+void Search::CountPrefetchHit(uint64_t hash) {
+  if (prefetched_.load(std::memory_order_relaxed) == 0 || hash == 0) return;
+  auto& slot = prefetched_hashes_[hash % kPrefetchedHashesSize];
+  uint64_t expected = hash;
+  if (slot.load(std::memory_order_relaxed) == hash &&
+      slot.compare_exchange_strong(expected, 0, std::memory_order_relaxed)) {
+    prefetch_hits_.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+void Search::NotifyBackup() {
+  {
+    Mutex::Lock lock(counters_mutex_);
+    ++backup_epoch_;
+    if (idle_workers_ == 0) return;
+  }
+  idle_cv_.notify_all();
+}
+
+// Uses condition variable with the lock, which thread safety analysis doesn't
+// understand.
+void Search::WaitForBackup(int64_t epoch) NO_THREAD_SAFETY_ANALYSIS {
+  const auto start = std::chrono::steady_clock::now();
+  std::unique_lock<std::mutex> lock(counters_mutex_.get_raw());
+  const auto work_is_possible = [&]() {
+    return stop_ || backup_epoch_ != epoch;
+  };
+  if (work_is_possible()) return;
+  ++idle_workers_;
+  if (limits_.time_ms >= 0) {
+    // Have to wake up when the time is out, to send bestmove.
+    idle_cv_.wait_until(lock,
+                        start_time_ + std::chrono::milliseconds(limits_.time_ms),
+                        work_is_possible);
+  } else {
+    idle_cv_.wait(lock, work_is_possible);
+  }
+  --idle_workers_;
+  ++idle_waits_;
+  idle_time_us_ += std::chrono::duration_cast<std::chrono::microseconds>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+}
+
+bool Search::MaybeWaitForStop() NO_THREAD_SAFETY_ANALYSIS {
+  std::unique_lock<std::mutex> lock(counters_mutex_.get_raw());
+  if (!tree_full_ || stop_) return false;
+  idle_cv_.wait(lock, [this]() { return stop_; });
+  return true;
 }
 
 void Search::Wait() {
   Mutex::Lock lock(threads_mutex_);
   while (!threads_.empty()) {
-    threads_.back().join();
+    threads_.back().get();
     threads_.pop_back();
   }
 }
@@ -491,15 +1153,40 @@ void Search::Wait() {
 Search::~Search() {
   Abort();
   Wait();
+  // Subtrees of other root-parallel trees go to GC, so that the destructor
+  // doesn't free them right here.
+  for (auto& tree : extra_trees_) tree->root_parent->ReleaseChildren();
 }
 
 //////////////////////////////////////////////////////////////////////////////
 // SearchWorker
 //////////////////////////////////////////////////////////////////////////////
 
+void SearchWorker::Reset(Search* search, Node* root_node) {
+  search_ = search;
+  root_node_ = root_node;
+  extra_tree_mutex_ = nullptr;
+  for (auto& tree : search_->extra_trees_) {
+    if (tree->root == root_node) extra_tree_mutex_ = &tree->nodes_mutex;
+  }
+  history_.ResetToPrefix(search_->played_history_);
+  nodes_to_process_.clear();
+  nodes_found_ = 0;
+  collisions_found_ = 0;
+  descents_ = 0;
+  backup_epoch_ = 0;
+  has_pending_batch_ = false;
+  computation_.reset();
+  stage_times_ = SearchStageTimes();
+}
+
+std::unique_ptr<NetworkComputation> SearchWorker::NewComputation() {
+  return search_->NewComputation();
+}
+
 void SearchWorker::ExecuteOneIteration() {
   // 1. Initialize internal structures.
-  InitializeIteration(search_->network_->NewComputation());
+  InitializeIteration(NewComputation());
 
   // 2. Gather minibatch.
   GatherMinibatch();
@@ -520,6 +1207,62 @@ void SearchWorker::ExecuteOneIteration() {
   UpdateCounters();
 }
 
+void SearchWorker::RunPipelined() {
+  // Minibatch which is being computed while the next one is gathered.
+  std::vector<NodeToProcess> pending_nodes;
+  std::unique_ptr<CachingComputation> pending_computation;
+  std::future<void> pending_result;
+
+  bool active = IsSearchActive();
+  while (active || pending_result.valid()) {
+    std::future<void> result;
+    if (active) {
+      // 1-3. Gather next minibatch and prefetch into cache.
+      InitializeIteration(NewComputation());
+      GatherMinibatch();
+      MaybePrefetchIntoCache();
+      // 4. Start NN computation in background.
+      CachingComputation* computation = computation_.get();
+      result = ThreadPool::Get()->Run([computation]() {
+        if (computation->GetBatchSize() != 0) computation->ComputeBlocking();
+      });
+      ExtendDeferredNodes();
+    }
+
+    // Make the just started batch pending, and the previous one current.
+    std::swap(nodes_to_process_, pending_nodes);
+    std::swap(computation_, pending_computation);
+    std::swap(result, pending_result);
+
+    if (result.valid()) {
+      // Wait for the previous batch to finish computing (rethrowing
+      // exception, if any).
+      {
+        StageTimer timer(&stage_times_, SearchStage::kNnCompute);
+        result.get();
+      }
+      // 5-7. Retrieve results, back them up and update counters.
+      has_pending_batch_ = pending_result.valid();
+      FetchMinibatchResults();
+      DoBackupUpdate();
+      UpdateCounters();
+    }
+    active = IsSearchActive();
+  }
+}
+
+void SearchWorker::FlushStageTimes() {
+  for (int i = 0; i < kSearchStageCount; ++i) {
+    if (stage_times_.ns[i] == 0) continue;
+    search_->stage_ns_[i].fetch_add(stage_times_.ns[i],
+                                    std::memory_order_relaxed);
+    stage_times_.ns[i] = 0;
+  }
+  search_->stage_iterations_.fetch_add(stage_times_.iterations,
+                                       std::memory_order_relaxed);
+  stage_times_.iterations = 0;
+}
+
 bool SearchWorker::IsSearchActive() const {
   Mutex::Lock lock(search_->counters_mutex_);
   return !search_->stop_;
@@ -529,7 +1272,11 @@ bool SearchWorker::IsSearchActive() const {
 // ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 void SearchWorker::InitializeIteration(
     std::unique_ptr<NetworkComputation> computation) {
+  StageTimer timer(&stage_times_, SearchStage::kInitialize);
+  ++stage_times_.iterations;
   nodes_to_process_.clear();
+  descents_ = 0;
+  backup_epoch_ = search_->backup_epoch_.load(std::memory_order_relaxed);
   computation_ = std::make_unique<CachingComputation>(std::move(computation),
                                                       search_->cache_);
 }
@@ -537,55 +1284,163 @@ void SearchWorker::InitializeIteration(
 // 2. Gather minibatch.
 // ~~~~~~~~~~~~~~~~~~~~
 void SearchWorker::GatherMinibatch() {
-  int nodes_found = 0;
-  int collisions_found = 0;
+  StageTimer timer(&stage_times_, SearchStage::kGather);
+  nodes_found_ = 0;
+  collisions_found_ = 0;
 
   // Gather nodes to process in the current batch.
-  while (nodes_found < search_->kMiniBatchSize) {
+  while (nodes_found_ < search_->kMiniBatchSize) {
     // If there's something to process without touching slow neural net, do it.
-    if (nodes_found > 0 && computation_->GetCacheMisses() == 0) return;
-    // Pick next node to extend.
-    nodes_to_process_.emplace_back(PickNodeToExtend());
-    auto& picked_node = nodes_to_process_.back();
-    auto* node = picked_node.node;
-
-    // There was a collision. If limit has been reached, return, otherwise
-    // just start search of another node.
-    if (picked_node.is_collision) {
-      if (++collisions_found > search_->kAllowedNodeCollisions) return;
-      continue;
+    if (nodes_found_ > 0 && computation_->GetCacheMisses() == 0) return;
+    ++descents_;
+    if (search_->kMultiLeafGather) {
+      // Pick as many nodes as are still needed in one descent.
+      PickNodesToExtend(search_->kMiniBatchSize - nodes_found_);
+    } else {
+      // Pick next node to extend.
+      nodes_to_process_.emplace_back(PickNodeToExtend());
+      ProcessPickedNode();
     }
-    ++nodes_found;
-    // If node is already known as terminal (win/loss/draw according to rules
-    // of the game), it means that we already visited this node before.
-    if (node->IsTerminal()) continue;
+    // There were too many collisions, return.
+    if (collisions_found_ > search_->kAllowedNodeCollisions) return;
+  }
+}
 
-    // Node was never visited, extend it.
-    ExtendNode(node);
+void SearchWorker::ProcessPickedNode() {
+  if (nodes_to_process_.back().is_collision) {
+    ProcessCollision();
+  } else {
+    ProcessLeaf(&nodes_to_process_.back());
+  }
+}
 
-    // Only send non-terminal nodes to neural network
-    if (!node->IsTerminal()) {
-      nodes_to_process_.back().nn_queried = true;
-      AddNodeToComputation(node);
-    }
+void SearchWorker::ProcessCollision() {
+  // There was a collision. If limit has been reached, GatherMinibatch()
+  // returns, otherwise just start search of another node.
+  if (search_->kMultivisitCollisions &&
+      MergeCollision(nodes_to_process_.back().node)) {
+    ++nodes_found_;
+    return;
   }
+  ++collisions_found_;
+}
+
+void SearchWorker::ProcessLeaf(NodeToProcess* picked_node_ptr) {
+  auto& picked_node = *picked_node_ptr;
+  auto* node = picked_node.node;
+  ++nodes_found_;
+  // If node is already known as terminal (win/loss/draw according to rules
+  // of the game), it means that we already visited this node before.
+  if (node->IsTerminal()) return;
+
+  // The node is sent to NN right away, and gets its edges while NN computes.
+  // If the position isn't cached, legal moves are generated for the NN input
+  // already and only edges are left. Transpositions need edges to compare.
+  if (search_->kDeferredExtension && !search_->kTranspositions &&
+      CanDeferExtension(node)) {
+    picked_node.extension_deferred = true;
+    picked_node.board = history_.Last().GetBoard();
+    picked_node.nn_queried = true;
+    picked_node.legal_moves_known = !AddNodeToComputation(
+        node, true, &picked_node.cache_order, &picked_node.legal_moves);
+    return;
+  }
+
+  // Node was never visited, extend it.
+  ExtendNode(node);
+
+  // Only send non-terminal nodes to neural network
+  if (!node->IsTerminal()) {
+    if (search_->kTranspositions && TryUseTransposition(&picked_node)) return;
+    picked_node.nn_queried = true;
+    AddNodeToComputation(node, true, &picked_node.cache_order);
+  }
+}
+
+bool SearchWorker::MergeCollision(Node* node) {
+  // The last element is the collision itself.
+  for (size_t i = 0; i + 1 < nodes_to_process_.size(); ++i) {
+    NodeToProcess& other = nodes_to_process_[i];
+    if (other.is_collision || other.node != node) continue;
+    // Parents already have the visit in flight, and now the node has too.
+    node->IncrementNInFlight(1);
+    ++other.multivisit;
+    nodes_to_process_.pop_back();
+    return true;
+  }
+  return false;
+}
+
+bool SearchWorker::TryUseTransposition(NodeToProcess* node_to_process) {
+  Node* node = node_to_process->node;
+  // Root is not registered as it may have noise applied, so its policy is
+  // never reused either.
+  if (node == root_node_) return false;
+  node_to_process->position_hash = history_.Last().Hash();
+  ++search_->transposition_lookups_;
+  Node* transposition;
+  {
+    Mutex::Lock lock(search_->transpositions_mutex_);
+    auto iter = search_->transpositions_.find(node_to_process->position_hash);
+    if (iter == search_->transpositions_.end()) return false;
+    transposition = iter->second;
+  }
+  // Policy of the node is only guaranteed to be visible after its first
+  // visit is backed up.
+  if (transposition->GetN() == 0) return false;
+  // Different moves mean hash collision.
+  if (!node->CopyPolicyFrom(*transposition)) return false;
+  // Both nodes are from the point of view of the same side.
+  node_to_process->v = transposition->GetQ();
+  node_to_process->is_transposition = true;
+  ++search_->transposition_hits_;
+  return true;
+}
+
+SearchWorker::SmartPruningInfo SearchWorker::GetSmartPruningInfo() const
+    REQUIRES_SHARED(search_->nodes_mutex_) {
+  SmartPruningInfo info;
+  // Smart pruning only works on the main tree.
+  if (extra_tree_mutex_) return info;
+  info.best_move_edge = search_->best_move_edge_;
+  info.best_node_n = info.best_move_edge.GetN();
+  info.remaining_playouts = search_->remaining_playouts_;
+  return info;
 }
 
 // Returns node and whether there's been a search collision on the node.
 SearchWorker::NodeToProcess SearchWorker::PickNodeToExtend() {
-  // Starting from search_->root_node_, generate a playout, choosing a
+  // Starting from root_node_, generate a playout, choosing a
   // node at each level according to the MCTS formula. n_in_flight_ is
   // incremented for each node in the playout (via TryStartScoreUpdate()).
 
-  Node* node = search_->root_node_;
-  Node::Iterator best_edge;
   // Initialize position sequence with pre-move position.
   history_.Trim(search_->played_history_.GetLength());
 
+  if (search_->kLockFreeSearch) {
+    // Node counters are atomic and new nodes are published with CAS, so the
+    // tree is descended without the lock. Only smart pruning state is read
+    // under it.
+    SmartPruningInfo pruning;
+    {
+      SharedMutex::SharedLock lock(search_->nodes_mutex_);
+      pruning = GetSmartPruningInfo();
+    }
+    return PickNodeToExtend(pruning);
+  }
+
+  if (extra_tree_mutex_) {
+    // Other root-parallel trees have their own lock, and no smart pruning.
+    SharedMutex::Lock lock(*extra_tree_mutex_);
+    return PickNodeToExtend(SmartPruningInfo());
+  }
   SharedMutex::Lock lock(search_->nodes_mutex_);
+  return PickNodeToExtend(GetSmartPruningInfo());
+}
 
-  // Fetch the current best root node visits for possible smart pruning.
-  int best_node_n = search_->best_move_edge_.GetN();
+SearchWorker::NodeToProcess SearchWorker::PickNodeToExtend(
+    const SmartPruningInfo& pruning) {
+  Node* node = root_node_;
 
   // True on first iteration, false as we dive deeper.
   bool is_root_node = true;
@@ -593,13 +1448,6 @@ SearchWorker::NodeToProcess SearchWorker::PickNodeToExtend() {
 
   while (true) {
     // First, terminate if we find collisions or leaf nodes.
-    // Set 'node' to point to the node that was picked on previous iteration,
-    // possibly spawning it.
-    // TODO(crem) This statement has to be in the end of the loop rather than
-    //            in the beginning (and there would be no need for "if
-    //            (!is_root_node)"), but that would mean extra mutex lock.
-    //            Will revisit that after rethinking locking strategy.
-    if (!is_root_node) node = best_edge.GetOrSpawnNode(/* parent */ node);
     depth++;
     // n_in_flight_ is incremented. If the method returns false, then there is
     // a search collision, and this node is already being expanded.
@@ -610,55 +1458,192 @@ SearchWorker::NodeToProcess SearchWorker::PickNodeToExtend() {
     // playout remains incomplete; we must go deeper.
     float puct_mult =
         search_->kCpuct * std::sqrt(std::max(node->GetChildrenVisits(), 1u));
-    float best = -100.0f;
+    CollectEdgeStats(node, is_root_node, pruning, puct_mult);
+    const int best_idx = edge_stats_.PickBest();
+    if (best_idx < 0) {
+      // There was no child to pick, report it as a collision.
+      node->CancelScoreUpdate();
+      return {node, true, depth};
+    }
+
+    // Set 'node' to the picked child, possibly spawning it.
+    Node* child = node->GetOrSpawnChild(best_idx);
+    history_.Append(node->GetEdgeToNode(child)->GetMove());
+    node = child;
+    is_root_node = false;
+  }
+}
+
+void SearchWorker::PickNodesToExtend(int budget) {
+  descent_path_.clear();
+  picked_leaves_.clear();
+  picked_path_moves_.clear();
+
+  if (search_->kLockFreeSearch) {
+    SmartPruningInfo pruning;
+    {
+      SharedMutex::SharedLock lock(search_->nodes_mutex_);
+      pruning = GetSmartPruningInfo();
+    }
+    PickNodesToExtend(root_node_, budget, 1, pruning);
+  } else if (extra_tree_mutex_) {
+    SharedMutex::Lock lock(*extra_tree_mutex_);
+    PickNodesToExtend(root_node_, budget, 1, SmartPruningInfo());
+  } else {
+    SharedMutex::Lock lock(search_->nodes_mutex_);
+    PickNodesToExtend(root_node_, budget, 1, GetSmartPruningInfo());
+  }
+  // Move generation and cache lookups of the leaves don't need the tree, so
+  // they are done after the lock is released.
+  ProcessPickedLeaves();
+}
+
+void SearchWorker::ProcessPickedLeaves() {
+  // Leaves are in the order of the descent, so the path to a leaf shares a
+  // prefix with the path to the previous one, and only the rest of it has to
+  // be replayed.
+  history_.Trim(search_->played_history_.GetLength());
+  history_path_.clear();
+  for (const PickedLeaf& leaf : picked_leaves_) {
+    SetHistoryToPath(picked_path_moves_.data() + leaf.path_begin,
+                     leaf.path_end - leaf.path_begin);
+    ProcessLeaf(&nodes_to_process_[leaf.node_idx]);
+  }
+  history_.Trim(search_->played_history_.GetLength());
+}
+
+void SearchWorker::SetHistoryToPath(const Move* path, size_t length) {
+  size_t common = 0;
+  while (common < length && common < history_path_.size() &&
+         path[common] == history_path_[common]) {
+    ++common;
+  }
+  history_.Trim(search_->played_history_.GetLength() + common);
+  history_path_.resize(common);
+  for (size_t i = common; i < length; ++i) {
+    history_.Append(path[i]);
+    history_path_.push_back(path[i]);
+  }
+}
+
+int SearchWorker::PickNodesToExtend(Node* node, int budget, uint16_t depth,
+                                    const SmartPruningInfo& pruning) {
+  // Collision also happens if too many collisions were found in other
+  // branches already, to stop the whole descent.
+  if (collisions_found_ > search_->kAllowedNodeCollisions ||
+      !node->TryStartScoreUpdate()) {
+    nodes_to_process_.emplace_back(node, true, depth);
+    ProcessCollision();
+    return 1;
+  }
+  // Either terminal or unexamined leaf node -- the end of this playout.
+  // Leaf takes only one visit, the rest of the budget is left unused. It's
+  // processed after the descent, with the path to it.
+  if (!node->HasChildren()) {
+    const size_t path_begin = picked_path_moves_.size();
+    picked_leaves_.push_back({nodes_to_process_.size(), path_begin,
+                              path_begin + descent_path_.size()});
+    picked_path_moves_.insert(picked_path_moves_.end(), descent_path_.begin(),
+                              descent_path_.end());
+    nodes_to_process_.emplace_back(node, false, depth);
+    return 1;
+  }
+
+  // Split the budget between children, one visit at a time, as if every visit
+  // was a separate descent with virtual loss applied.
+  const float puct_mult =
+      search_->kCpuct * std::sqrt(std::max(node->GetChildrenVisits(), 1u));
+  CollectEdgeStats(node, node == root_node_, pruning, puct_mult);
+  edge_stats_.SplitBudget(budget);
+  // edge_stats_ is reused by the nested calls, so take a copy.
+  std::vector<std::pair<int, int>> children;
+  for (size_t i = 0; i < edge_stats_.visits.size(); ++i) {
+    if (edge_stats_.visits[i] > 0) {
+      children.emplace_back(i, edge_stats_.visits[i]);
+    }
+  }
+
+  int picked = 0;
+  for (auto& child : children) {
+    Node* child_node = node->GetOrSpawnChild(child.first);
+    descent_path_.push_back(node->GetEdgeToNode(child_node)->GetMove());
+    picked += PickNodesToExtend(child_node, child.second, depth + 1, pruning);
+    descent_path_.pop_back();
+  }
+  if (picked == 0) {
+    // There was no child to pick. Report it as a collision, so that the
+    // caller doesn't loop forever.
+    node->CancelScoreUpdate();
+    nodes_to_process_.emplace_back(node, true, depth);
+    ProcessCollision();
+    return 1;
+  }
+  // One update was started by TryStartScoreUpdate(), the rest are for all
+  // other playouts which went through this node. Every returned node
+  // updates (or cancels) all its parents once.
+  if (picked > 1) node->IncrementNInFlight(picked - 1);
+  return picked;
+}
+
+void SearchWorker::CollectEdgeStats(Node* node, bool is_root_node,
+                                    const SmartPruningInfo& pruning,
+                                    float puct_mult) {
+  float fpu_q =
+      ((is_root_node && search_->kNoise) || !search_->kFpuReduction)
+          ? -node->GetQ()
+          : -node->GetQ() -
+                search_->kFpuReduction * std::sqrt(node->GetVisitedPolicy());
+  edge_stats_.Compute(node, fpu_q, puct_mult);
+
+  if (is_root_node) {
     int possible_moves = 0;
-    float parent_q =
-        ((is_root_node && search_->kNoise) || !search_->kFpuReduction)
-            ? -node->GetQ()
-            : -node->GetQ() -
-                  search_->kFpuReduction * std::sqrt(node->GetVisitedPolicy());
+    int idx = 0;
     for (auto child : node->Edges()) {
-      if (is_root_node) {
-        // If there's no chance to catch up to the current best node with
-        // remaining playouts, don't consider it.
-        // best_move_node_ could have changed since best_node_n was retrieved.
-        // To ensure we have at least one node to expand, always include
-        // current best node.
-        if (child != search_->best_move_edge_ &&
-            search_->remaining_playouts_ <
-                best_node_n - static_cast<int>(child.GetN())) {
-          continue;
-        }
-        // If searchmoves was sent, restrict the search only in that moves
-        if (!search_->limits_.searchmoves.empty() &&
-            std::find(search_->limits_.searchmoves.begin(),
-                      search_->limits_.searchmoves.end(),
-                      child.GetMove()) == search_->limits_.searchmoves.end()) {
-          continue;
-        }
-        ++possible_moves;
+      const int child_idx = idx++;
+      // If there's no chance to catch up to the current best node with
+      // remaining playouts, don't consider it.
+      // best_move_node_ could have changed since best_node_n was retrieved.
+      // To ensure we have at least one node to expand, always include
+      // current best node.
+      if (child != pruning.best_move_edge &&
+          pruning.remaining_playouts <
+              pruning.best_node_n - static_cast<int>(child.GetN())) {
+        edge_stats_.Exclude(child_idx);
+        continue;
       }
-      float Q = child.GetQ(parent_q);
-      if (search_->kStickyCheckmate && Q == 1.0f && child.IsTerminal()) {
-        // If we find a checkmate, then the confidence is infinite, so ignore U.
-        best_edge = child;
-        break;
-      }
-      const float score = child.GetU(puct_mult) + Q;
-      if (score > best) {
-        best = score;
-        best_edge = child;
+      // If searchmoves was sent, restrict the search only in that moves
+      if (!search_->limits_.searchmoves.empty() &&
+          std::find(search_->limits_.searchmoves.begin(),
+                    search_->limits_.searchmoves.end(),
+                    child.GetMove()) == search_->limits_.searchmoves.end()) {
+        edge_stats_.Exclude(child_idx);
+        continue;
       }
+      ++possible_moves;
     }
-
-    history_.Append(best_edge.GetMove());
-    if (is_root_node && possible_moves <= 1 && !search_->limits_.infinite) {
-      // If there is only one move theoretically possible within remaining time,
-      // output it.
+    if (possible_moves <= 1 && !search_->limits_.infinite) {
+      // If there is only one move theoretically possible within remaining
+      // time, output it.
       Mutex::Lock counters_lock(search_->counters_mutex_);
       search_->found_best_move_ = true;
     }
-    is_root_node = false;
+  }
+
+  if (search_->kStickyCheckmate) {
+    int idx = 0;
+    for (auto child : node->Edges()) {
+      const int child_idx = idx++;
+      if (edge_stats_.scores[child_idx] ==
+          -std::numeric_limits<float>::infinity()) {
+        continue;
+      }
+      if (child.GetQ(fpu_q) == 1.0f && child.IsTerminal()) {
+        // If we find a checkmate, then the confidence is infinite, so ignore
+        // U. Make it the only edge to pick.
+        edge_stats_.PickOnly(child_idx);
+        break;
+      }
+    }
   }
 }
 
@@ -682,7 +1667,7 @@ void SearchWorker::ExtendNode(Node* node) {
 
   // We can shortcircuit these draws-by-rule only if they aren't root;
   // if they are root, then thinking about them is the point.
-  if (node != search_->root_node_) {
+  if (node != root_node_) {
     if (!board.HasMatingMaterial()) {
       node->MakeTerminal(GameResult::DRAW);
       return;
@@ -697,152 +1682,215 @@ void SearchWorker::ExtendNode(Node* node) {
       node->MakeTerminal(GameResult::DRAW);
       return;
     }
+
+    // Tables don't know the 50-move counter, so their result is only exact
+    // right after a zeroing move. Cursed wins and blessed losses are draws.
+    if (CanProbeTablebase()) {
+      ProbeState state;
+      const WdlScore wdl = search_->syzygy_tb_->ProbeWdl(board, &state);
+      if (state != ProbeState::kFail) {
+        search_->tb_hits_.fetch_add(1, std::memory_order_relaxed);
+        GetSearchMetrics().tb_hits->Add();
+        node->MakeTerminal(wdl == WdlScore::kWin    ? GameResult::BLACK_WON
+                           : wdl == WdlScore::kLoss ? GameResult::WHITE_WON
+                                                    : GameResult::DRAW);
+        return;
+      }
+    }
   }
 
   // Add legal moves as edges of this node.
   node->CreateEdges(legal_moves);
 }
 
+bool SearchWorker::CanDeferExtension(Node* node) const {
+  if (node == root_node_) return false;
+  const auto& position = history_.Last();
+  return position.GetBoard().HasMatingMaterial() &&
+         position.GetNoCapturePly() < 100 && position.GetRepetitions() < 2 &&
+         !CanProbeTablebase();
+}
+
+bool SearchWorker::CanProbeTablebase() const {
+  const auto& position = history_.Last();
+  return search_->syzygy_tb_ && position.GetNoCapturePly() == 0 &&
+         search_->syzygy_tb_->CanProbe(position.GetBoard());
+}
+
+void SearchWorker::ExtendDeferredNodes() {
+  for (NodeToProcess& node_to_process : nodes_to_process_) {
+    if (!node_to_process.extension_deferred) continue;
+    Node* node = node_to_process.node;
+    const ChessBoard& board = node_to_process.board;
+    MoveList& legal_moves = node_to_process.legal_moves;
+    if (!node_to_process.legal_moves_known) {
+      legal_moves = board.GenerateLegalMoves();
+    }
+    if (legal_moves.empty()) {
+      // NN result of the node is ignored then.
+      node->MakeTerminal(board.IsUnderCheck() ? GameResult::WHITE_WON
+                                              : GameResult::DRAW);
+    } else {
+      node->CreateEdges(legal_moves);
+    }
+  }
+}
+
 // Returns whether node was already in cache.
-bool SearchWorker::AddNodeToComputation(Node* node, bool add_if_cached) {
-  auto hash = history_.HashLast(search_->kCacheHistoryLength + 1);
+bool SearchWorker::AddNodeToComputation(Node* node, bool add_if_cached,
+                                        Search::CacheOrder* order,
+                                        MoveList* legal_moves_out) {
+  Search::CacheOrder cache_order;
+  auto hash = search_->GetCacheHash(history_, &cache_order);
+  if (order) *order = cache_order;
   // If already in cache, no need to do anything.
   if (add_if_cached) {
-    if (computation_->AddInputByHash(hash)) return true;
+    if (computation_->AddInputByHash(hash)) {
+      search_->CountPrefetchHit(hash);
+      return true;
+    }
   } else {
     if (search_->cache_->ContainsKey(hash)) return true;
   }
-  auto planes = EncodePositionForNN(history_, 8);
-
-  std::vector<uint16_t> moves;
-
-  if (node && node->HasChildren()) {
+  MoveList legal_moves;
+  const bool legal_moves_known = node && node->HasChildren();
+  if (legal_moves_known) {
     // Legal moves are known, use them.
-    for (auto edge : node->Edges()) {
-      moves.emplace_back(edge.GetMove().as_nn_index());
-    }
+    for (auto edge : node->Edges()) legal_moves.push_back(edge.GetMove());
   } else {
-    // Cache pseudolegal moves. A bit of a waste, but faster.
-    const auto& pseudolegal_moves =
-        history_.Last().GetBoard().GeneratePseudolegalMoves();
-    moves.reserve(pseudolegal_moves.size());
-    for (auto iter = pseudolegal_moves.begin(), end = pseudolegal_moves.end();
-         iter != end; ++iter) {
-      moves.emplace_back(iter->as_nn_index());
-    }
+    // The cache stores probabilities of legal moves only, so they have to be
+    // generated.
+    legal_moves = history_.Last().GetBoard().GenerateLegalMoves();
   }
 
-  computation_->AddInput(hash, std::move(planes), std::move(moves));
+  encoder_.Encode(
+      history_, 8,
+      computation_->AddInput(
+          hash, Search::GetCachedMoves(legal_moves, cache_order)));
+  if (!legal_moves_known && legal_moves_out) {
+    *legal_moves_out = std::move(legal_moves);
+  }
+  if (!add_if_cached) search_->AddPrefetchedHash(hash);
   return false;
 }
 
 // 3. Prefetch into cache.
 // ~~~~~~~~~~~~~~~~~~~~~~~
 void SearchWorker::MaybePrefetchIntoCache() {
+  StageTimer timer(&stage_times_, SearchStage::kPrefetch);
   // TODO(mooskagh) Remove prefetch into cache if node collisions work well.
   // If there are requests to NN, but the batch is not full, try to prefetch
-  // nodes which are likely useful in future.
-  if (computation_->GetCacheMisses() > 0 &&
-      computation_->GetCacheMisses() < search_->kMaxPrefetchBatch) {
-    history_.Trim(search_->played_history_.GetLength());
+  // nodes which are likely useful in future. The batch is also padded up to
+  // a size which the backend computes efficiently.
+  const int misses = computation_->GetCacheMisses();
+  if (misses == 0) return;
+  const int step = search_->network_->GetPreferredBatchStep();
+  int target = std::max(misses, search_->kMaxPrefetchBatch);
+  if (step > 1) target = (target + step - 1) / step * step;
+  if (misses >= target) return;
+  if (extra_tree_mutex_) {
+    SharedMutex::SharedLock lock(*extra_tree_mutex_);
+    PrefetchIntoCache(target - misses);
+  } else {
     SharedMutex::SharedLock lock(search_->nodes_mutex_);
-    PrefetchIntoCache(search_->root_node_, search_->kMaxPrefetchBatch -
-                                               computation_->GetCacheMisses());
+    PrefetchIntoCache(target - misses);
   }
 }
 
-// Prefetches up to @budget nodes into cache. Returns number of nodes
+// Prefetches up to @budget positions into cache, best-first: the frontier
+// holds edges of all visited nodes expanded so far, by estimated probability
+// that a future playout goes through them, and the likeliest leaves are
 // prefetched.
-int SearchWorker::PrefetchIntoCache(Node* node, int budget) {
-  if (budget <= 0) return 0;
-
-  // We are in a leaf, which is not yet being processed.
-  if (!node || node->GetNStarted() == 0) {
-    if (AddNodeToComputation(node, false)) {
-      // Make it return 0 to make it not use the slot, so that the function
-      // tries hard to find something to cache even among unpopular moves.
-      // In practice that slows things down a lot though, as it's not always
-      // easy to find what to cache.
-      return 1;
+void SearchWorker::PrefetchIntoCache(int budget) {
+  // Positions which are already cached are skipped, but don't take longer
+  // than a few lookups per slot to find the rest.
+  int lookups_left = budget * kPrefetchLookupsPerSlot;
+  prefetch_frontier_.clear();
+  prefetch_paths_.clear();
+  history_.Trim(search_->played_history_.GetLength());
+  history_path_.clear();
+  ExpandPrefetchFrontier(root_node_, 1.0f, 0, 0, lookups_left);
+  while (budget > 0 && lookups_left > 0 && !prefetch_frontier_.empty()) {
+    std::pop_heap(prefetch_frontier_.begin(), prefetch_frontier_.end());
+    const PrefetchCandidate candidate = prefetch_frontier_.back();
+    prefetch_frontier_.pop_back();
+    Node* node = candidate.edge.node();
+    if (node && node->GetNStarted() > 0) {
+      // n = 0 and n_in_flight_ > 0, that means the node is being extended.
+      if (node->GetN() > 0) {
+        // Path to the node is the path to its parent and the edge's move.
+        const uint32_t path_begin = prefetch_paths_.size();
+        for (int i = 0; i < candidate.path_length; ++i) {
+          prefetch_paths_.push_back(prefetch_paths_[candidate.path_begin + i]);
+        }
+        prefetch_paths_.push_back(candidate.edge.GetMove());
+        ExpandPrefetchFrontier(node, candidate.probability, path_begin,
+                               candidate.path_length + 1, lookups_left);
+      }
+      continue;
     }
-    return 1;
+    // We are in a leaf, which is not yet being processed.
+    --lookups_left;
+    SetHistoryToPath(prefetch_paths_.data() + candidate.path_begin,
+                     candidate.path_length);
+    history_.Append(candidate.edge.GetMove());
+    if (!AddNodeToComputation(node, false)) {
+      search_->prefetched_.fetch_add(1, std::memory_order_relaxed);
+      --budget;
+    }
+    history_.Pop();
   }
+  history_.Trim(search_->played_history_.GetLength());
+}
 
-  assert(node);
-  // n = 0 and n_in_flight_ > 0, that means the node is being extended.
-  if (node->GetN() == 0) return 0;
+void SearchWorker::ExpandPrefetchFrontier(Node* node, float probability,
+                                          uint32_t path_begin,
+                                          uint16_t path_length,
+                                          int max_unvisited) {
   // The node is terminal; don't prefetch it.
-  if (node->IsTerminal()) return 0;
-
-  // Populate all subnodes and their scores.
-  typedef std::pair<float, EdgeAndNode> ScoredEdge;
-  std::vector<ScoredEdge> scores;
-  float puct_mult =
-      search_->kCpuct * std::sqrt(std::max(node->GetChildrenVisits(), 1u));
-  // FPU reduction is not taken into account.
-  const float parent_q = -node->GetQ();
+  if (node->IsTerminal()) return;
+  // Share of future visits of a child is estimated as (N + P) / (N + 1) of
+  // the parent's: priors for the first visits, visit counts later on.
+  const float scale = probability / (node->GetChildrenVisits() + 1);
   for (auto edge : node->Edges()) {
-    if (edge.GetP() == 0.0f) continue;
-    // Flip the sign of a score to be able to easily sort.
-    scores.emplace_back(-edge.GetU(puct_mult) - edge.GetQ(parent_q), edge);
-  }
-
-  size_t first_unsorted_index = 0;
-  int total_budget_spent = 0;
-  int budget_to_spend = budget;  // Initialize for the case where there's only
-                                 // one child.
-  for (size_t i = 0; i < scores.size(); ++i) {
-    if (budget <= 0) break;
-
-    // Sort next chunk of a vector. 3 at a time. Most of the time it's fine.
-    if (first_unsorted_index != scores.size() &&
-        i + 2 >= first_unsorted_index) {
-      const int new_unsorted_index =
-          std::min(scores.size(), budget < 2 ? first_unsorted_index + 2
-                                             : first_unsorted_index + 3);
-      std::partial_sort(scores.begin() + first_unsorted_index,
-                        scores.begin() + new_unsorted_index, scores.end(),
-                        [](const ScoredEdge& a, const ScoredEdge& b) {
-                          return a.first < b.first;
-                        });
-      first_unsorted_index = new_unsorted_index;
-    }
-
-    auto edge = scores[i].second;
-    // Last node gets the same budget as prev-to-last node.
-    if (i != scores.size() - 1) {
-      // Sign of the score was flipped for sorting, so flip it back.
-      const float next_score = -scores[i + 1].first;
-      const float q = edge.GetQ(-parent_q);
-      if (next_score > q) {
-        budget_to_spend =
-            std::min(budget, int(edge.GetP() * puct_mult / (next_score - q) -
-                                 edge.GetNStarted()) +
-                                 1);
-      } else {
-        budget_to_spend = budget;
+    // Edges without a node are sorted by P, so there is no need to look
+    // further than the lookups will get.
+    if (!edge.HasNode()) {
+      if (max_unvisited == 0) {
+        if (!edge.HasNodesAfter()) break;
+        continue;
       }
+      --max_unvisited;
     }
-    history_.Append(edge.GetMove());
-    const int budget_spent = PrefetchIntoCache(edge.node(), budget_to_spend);
-    history_.Pop();
-    budget -= budget_spent;
-    total_budget_spent += budget_spent;
+    const float share = edge.GetN() + edge.GetP();
+    if (share == 0.0f) continue;
+    prefetch_frontier_.push_back(
+        {scale * share, path_begin, path_length, edge});
+    std::push_heap(prefetch_frontier_.begin(), prefetch_frontier_.end());
   }
-  return total_budget_spent;
 }
 
 // 4. Run NN computation.
 // ~~~~~~~~~~~~~~~~~~~~~~
 void SearchWorker::RunNNComputation() {
-  // This function is so small as to be silly, but its parent function is
-  // conceptually cleaner for it.
-  if (computation_->GetBatchSize() != 0) computation_->ComputeBlocking();
+  StageTimer timer(&stage_times_, SearchStage::kNnCompute);
+  if (!search_->kDeferredExtension) {
+    if (computation_->GetBatchSize() != 0) computation_->ComputeBlocking();
+    return;
+  }
+  // Extend deferred nodes while NN computes in another thread.
+  CachingComputation* computation = computation_.get();
+  auto result = ThreadPool::Get()->Run([computation]() {
+    if (computation->GetBatchSize() != 0) computation->ComputeBlocking();
+  });
+  ExtendDeferredNodes();
+  result.get();
 }
 
 // 5. Retrieve NN computations (and terminal values) into nodes.
 // ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 void SearchWorker::FetchMinibatchResults() {
+  StageTimer timer(&stage_times_, SearchStage::kFetch);
   // Populate NN/cached results, or terminal results, into nodes.
   int idx_in_computation = 0;
   for (auto& node_to_process : nodes_to_process_) {
@@ -850,32 +1898,61 @@ void SearchWorker::FetchMinibatchResults() {
     if (!node_to_process.nn_queried) {
       // Terminal nodes don't involve the neural NetworkComputation, nor do
       // they require any further processing after value retrieval.
+      // Value of transpositions is already known.
+      if (!node_to_process.is_transposition) node_to_process.v = node->GetQ();
+      continue;
+    }
+    // Deferred node may turn out to be a checkmate or stalemate.
+    if (node->IsTerminal()) {
       node_to_process.v = node->GetQ();
+      ++idx_in_computation;
       continue;
     }
     // For NN results, we need to populate policy as well as value.
     // First the value...
     node_to_process.v = -computation_->GetQVal(idx_in_computation);
     // ...and secondly, the policy data.
+    // Edges store P with reduced precision, so it's normalized before being
+    // stored.
     float total = 0.0;
-    for (auto edge : node->Edges()) {
-      float p = computation_->GetPVal(idx_in_computation,
-                                      edge.GetMove().as_nn_index());
-      if (search_->kPolicySoftmaxTemp != 1.0f) {
-        p = pow(p, 1 / search_->kPolicySoftmaxTemp);
+    policy_.resize(node->GetNumEdges());
+    computation_->GetPVals(idx_in_computation, policy_.size(), policy_.data());
+    // Position in the computation of probability of every edge.
+    policy_idx_.resize(node->GetNumEdges());
+    if (node_to_process.cache_order == Search::CacheOrder::kLegalMoves) {
+      for (int i = 0; i < node->GetNumEdges(); ++i) policy_idx_[i] = i;
+    } else {
+      MoveList moves;
+      for (auto edge : node->Edges()) moves.push_back(edge.GetMove());
+      const auto move_order =
+          Search::GetCacheMoveOrder(moves, node_to_process.cache_order);
+      for (size_t i = 0; i < move_order.size(); ++i) {
+        policy_idx_[move_order[i]] = i;
       }
-      total += p;
-      edge.edge()->SetP(p);
     }
+    if (search_->kPolicySoftmaxTemp != 1.0f &&
+        !search_->kBackendPolicySoftmaxTemp) {
+      for (auto& p : policy_) p = pow(p, 1 / search_->kPolicySoftmaxTemp);
+    }
+    for (const float p : policy_) total += p;
     // Normalize P values to add up to 1.0.
-    if (total > 0.0f) {
-      float scale = 1.0f / total;
-      for (auto edge : node->Edges()) edge.edge()->SetP(edge.GetP() * scale);
+    const float scale = total > 0.0f ? 1.0f / total : 1.0f;
+    int idx = 0;
+    for (auto edge : node->Edges()) {
+      edge.edge()->SetP(std::min(policy_[policy_idx_[idx++]] * scale, 1.0f));
     }
     // Add Dirichlet noise if enabled and at root.
-    if (search_->kNoise && node == search_->root_node_) {
+    if (search_->kNoise && node == root_node_) {
       ApplyDirichletNoise(node, 0.25, 0.3);
     }
+    // Unvisited edges only differ in P, so with edges sorted by it selection
+    // needs to look at only the first of them.
+    node->SortEdges();
+    // Make the evaluation available to transpositions of the node.
+    if (node_to_process.position_hash != 0) {
+      Mutex::Lock lock(search_->transpositions_mutex_);
+      search_->transpositions_.emplace(node_to_process.position_hash, node);
+    }
     ++idx_in_computation;
   }
 }
@@ -883,18 +1960,56 @@ void SearchWorker::FetchMinibatchResults() {
 // 6. Propagate the new nodes' information to all their parents in the tree.
 // ~~~~~~~~~~~~~~
 void SearchWorker::DoBackupUpdate() {
-  // Initialize playout and depth counters.
-  uint16_t max_depth_batch = 0;
-  uint32_t cum_depth_batch = 0;
-  uint16_t playouts_batch = 0;
- 
-  // Nodes mutex for doing node updates.
-  SharedMutex::Lock lock(search_->nodes_mutex_);
+  StageTimer timer(&stage_times_, SearchStage::kBackup);
+  if (search_->kLockFreeSearch) {
+    // Node updates are atomic, the mutex is only needed for search-wide stats.
+    const bool root_child_updated = DoBackupUpdateNodes();
+    {
+      SharedMutex::Lock lock(search_->nodes_mutex_);
+      DoBackupUpdateStats(root_child_updated);
+    }
+    MaybeNotifyBackup();
+    return;
+  }
+  if (extra_tree_mutex_) {
+    // Nodes of other root-parallel trees are updated under their own lock.
+    bool root_child_updated;
+    {
+      SharedMutex::Lock lock(*extra_tree_mutex_);
+      root_child_updated = DoBackupUpdateNodes();
+    }
+    {
+      SharedMutex::Lock lock(search_->nodes_mutex_);
+      DoBackupUpdateStats(root_child_updated);
+    }
+    MaybeNotifyBackup();
+    return;
+  }
+  {
+    // Nodes mutex for doing node updates.
+    SharedMutex::Lock lock(search_->nodes_mutex_);
+    DoBackupUpdateStats(DoBackupUpdateNodes());
+  }
+  MaybeNotifyBackup();
+}
+
+void SearchWorker::MaybeNotifyBackup() {
+  // Only finalized visits can unblock workers waiting on collisions.
+  for (const NodeToProcess& node_to_process : nodes_to_process_) {
+    if (!node_to_process.is_collision) {
+      search_->NotifyBackup();
+      return;
+    }
+  }
+}
+
+bool SearchWorker::DoBackupUpdateNodes() {
+  bool root_child_updated = false;
   for (NodeToProcess& node_to_process : nodes_to_process_) {
     Node* node = node_to_process.node;
     if (node_to_process.is_collision) {
       // If it was a collision, just undo counters.
-      for (node = node->GetParent(); node != search_->root_node_->GetParent();
+      for (node = node->GetParent(); node != root_node_->GetParent();
            node = node->GetParent()) {
         node->CancelScoreUpdate();
       }
@@ -904,45 +2019,79 @@ void SearchWorker::DoBackupUpdate() {
     // Backup V value up to a root. After 1 visit, V = Q.
     float v = node_to_process.v;
 
-    for (Node* n = node; n != search_->root_node_->GetParent();
+    for (Node* n = node; n != root_node_->GetParent();
          n = n->GetParent()) {
-      n->FinalizeScoreUpdate(v);
+      n->FinalizeScoreUpdate(v, node_to_process.multivisit);
       // Q will be flipped for opponent.
       v = -v;
+      if (n->GetParent() == root_node_) root_child_updated = true;
+    }
+  }
+  return root_child_updated;
+}
 
-      // Best move.
-      if (n->GetParent() == search_->root_node_ &&
-          search_->best_move_edge_.GetN() <= n->GetN()) {
-        search_->best_move_edge_ =
-            search_->GetBestChildNoTemperature(search_->root_node_);
-      }
+void SearchWorker::DoBackupUpdateStats(bool root_child_updated)
+    REQUIRES(search_->nodes_mutex_) {
+  // Initialize playout and depth counters.
+  uint16_t max_depth_batch = 0;
+  uint32_t cum_depth_batch = 0;
+  uint16_t playouts_batch = 0;
+
+  uint16_t collisions_batch = 0;
+  uint16_t multivisits_batch = 0;
+
+  for (const NodeToProcess& node_to_process : nodes_to_process_) {
+    if (node_to_process.is_collision) {
+      ++collisions_batch;
+      continue;
     }
-    ++playouts_batch;
-    cum_depth_batch += node_to_process.depth;
+    playouts_batch += node_to_process.multivisit;
+    multivisits_batch += node_to_process.multivisit - 1;
+    cum_depth_batch += node_to_process.depth * node_to_process.multivisit;
     if (node_to_process.depth > max_depth_batch) {
       max_depth_batch = node_to_process.depth;
-	}
+    }
+  }
+
+  // Best move.
+  if (root_child_updated) {
+    search_->best_move_edge_ =
+        search_->GetBestChildNoTemperature(search_->root_node_);
   }
   // Update global depth and playouts from batch stats.
-  // The two stage update, batch ->search, is in
-  // preparation of a mutex reorganization.
   if (max_depth_batch > search_->max_depth_) {
     search_->max_depth_ = max_depth_batch;
   }
   search_->cum_depth_ += cum_depth_batch;
   search_->total_playouts_ += playouts_batch;
+  GetSearchMetrics().playouts->Add(playouts_batch);
+  search_->total_descents_ += descents_;
+  search_->total_collisions_ += collisions_batch + multivisits_batch;
+  search_->total_multivisits_ += multivisits_batch;
 }
 
 // 7. Update the Search's status and progress information.
 //~~~~~~~~~~~~~~~~~~~~
 void SearchWorker::UpdateCounters() {
+  StageTimer timer(&stage_times_, SearchStage::kCounters);
+  FlushStageTimes();
   search_->UpdateRemainingMoves();  // Updates smart pruning counters.
   search_->MaybeOutputInfo();
+  search_->MaybePruneTrees();
   search_->MaybeTriggerStop();
+  // Someone has to send bestmove after the wait.
+  if (search_->MaybeWaitForStop()) {
+    search_->MaybeTriggerStop();
+    return;
+  }
 
-  // If this thread had no work, sleep for some milliseconds.
+  // If this thread had no work, wait until other threads back up what they
+  // have in flight, as until then there will be only collisions again.
   // Collisions don't count as work, so have to enumerate to find out if there
   // was anything done.
+  // In pipelined mode the collisions may be with the own batch in flight, so
+  // don't wait then.
+  if (has_pending_batch_) return;
   bool work_done = false;
   for (NodeToProcess& node_to_process : nodes_to_process_) {
     if (!node_to_process.is_collision) {
@@ -950,9 +2099,7 @@ void SearchWorker::UpdateCounters() {
       break;
     }
   }
-  if (!work_done) {
-    std::this_thread::sleep_for(std::chrono::milliseconds(10));
-  }
+  if (!work_done) search_->WaitForBackup(backup_epoch_);
 }
 
 }  // namespace lczero
@@ -27,14 +27,22 @@
 
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
 #include <functional>
+#include <future>
+#include <limits>
 #include <shared_mutex>
 #include <thread>
+#include <unordered_map>
 #include "chess/callbacks.h"
 #include "chess/uciloop.h"
 #include "mcts/node.h"
+#include "mcts/stagetimes.h"
 #include "neural/cache.h"
+#include "neural/encoder.h"
 #include "neural/network.h"
+#include "syzygy/syzygy.h"
 #include "utils/mutex.h"
 #include "utils/optional.h"
 #include "utils/optionsdict.h"
@@ -47,15 +55,26 @@ struct SearchLimits {
   std::int64_t playouts = -1;
   std::int64_t time_ms = -1;
   bool infinite = false;
+  // Playouts per second measured in earlier searches, -1 if unknown. Used for
+  // smart pruning until the speed of this search is known.
+  std::int64_t expected_nps = -1;
   MoveList searchmoves;
 };
 
+class SearchWorker;
+
 class Search {
  public:
+  // @cache_generation tags entries of @cache computed by @network, so that
+  // the cache doesn't have to be cleared when the network is replaced:
+  // entries of another generation are not found, and are evicted over time.
+  // Positions of @syzygy_tb (if not null) are scored from the tablebases,
+  // and moves at root are restricted to those keeping the tablebase result.
   Search(const NodeTree& tree, Network* network,
          BestMoveInfo::Callback best_move_callback,
          ThinkingInfo::Callback info_callback, const SearchLimits& limits,
-         const OptionsDict& options, NNCache* cache);
+         const OptionsDict& options, NNCache* cache,
+         SyzygyTablebase* syzygy_tb, uint32_t cache_generation = 0);
 
   ~Search();
 
@@ -71,6 +90,10 @@ class Search {
   // Runs search single-threaded, blocking.
   void RunSingleThreaded();
 
+  // Returns a worker of the main tree, for callers which run iterations of
+  // the search (of many searches at once) themselves instead of threads.
+  std::unique_ptr<SearchWorker> NewWorker();
+
   // Stops search. At the end bestmove will be returned. The function is not
   // blocking, so it returns before search is actually done.
   void Stop();
@@ -86,6 +109,17 @@ class Search {
   // from the above function; with temperature enabled, these two functions may
   // return results from different possible moves.
   float GetBestEval() const;
+  // Returns playouts per second from start until stop (or until now, if the
+  // search is still running). Returns -1 if the search was too short to tell.
+  float GetPlayoutsPerSecond() const;
+  // Returns time spent in stages of iterations by all workers so far. Zero
+  // if built with NO_SEARCH_TIMING.
+  SearchStageTimes GetStageTimes() const;
+
+  // Evaluates all positions up to @plies plies from the root which are not in
+  // the cache yet, and stores them there. Returns locks of all the positions,
+  // which keep entries of the LRU engine from being evicted while held.
+  std::vector<NNCacheLock> PopulateCache(int plies);
 
   // Strings for UCI params. So that others can override defaults.
   // TODO(mooskagh) There are too many options for now. Factor out that into a
@@ -100,11 +134,47 @@ class Search {
   static const char* kAggressiveTimePruningStr;
   static const char* kFpuReductionStr;
   static const char* kCacheHistoryLengthStr;
+  static const char* kCacheMirrorStr;
   static const char* kPolicySoftmaxTempStr;
   static const char* kAllowedNodeCollisionsStr;
   static const char* kStickyCheckmateStr;
+  static const char* kLockFreeSearchStr;
+  static const char* kMultiLeafGatherStr;
+  static const char* kPipelinedSearchStr;
+  static const char* kTranspositionsStr;
+  static const char* kTreeMemoryMbStr;
+  static const char* kGcThreadsStr;
+  static const char* kRootParallelTreesStr;
+  static const char* kMinimumKLDGainPerNodeStr;
+  static const char* kKLDGainAverageIntervalStr;
+  static const char* kMultivisitCollisionsStr;
+  static const char* kDeferredExtensionStr;
+  static const char* kNnPriorityStr;
+  static const char* kStageTimesStr;
 
  private:
+  // Order in which probabilities of a position are stored in NNCache.
+  enum class CacheOrder : uint8_t {
+    // Legal moves in order of generation.
+    kLegalMoves,
+    // Sorted by NN index of the move, or of the move with files flipped.
+    kNnIndex,
+    kFlippedNnIndex,
+  };
+  // Returns key of the last position of @history in NNCache. If @order is not
+  // nullptr, sets it to the order of probabilities of the position there.
+  uint64_t GetCacheHash(const PositionHistory& history,
+                        CacheOrder* order) const;
+  // Returns indices of @moves in @order (which is not kLegalMoves).
+  static std::vector<int> GetCacheMoveOrder(const MoveList& moves,
+                                            CacheOrder order);
+  // Returns NN indices of @legal_moves in @order, which is how probabilities
+  // of the position are requested from CachingComputation.
+  static std::vector<uint16_t> GetCachedMoves(const MoveList& legal_moves,
+                                              CacheOrder order);
+  // Returns a new computation of the network, set up for this search.
+  std::unique_ptr<NetworkComputation> NewComputation() const;
+
   // Returns the best move, maybe with temperature (according to the settings).
   std::pair<Move, Move> GetBestMoveInternal() const;
 
@@ -114,19 +184,58 @@ class Search {
   EdgeAndNode GetBestChildNoTemperature(Node* parent) const;
   EdgeAndNode GetBestChildWithTemperature(Node* parent,
                                           float temperature) const;
+  // For root node, returns visits of every edge in other root-parallel trees
+  // combined. For other nodes (or without other trees), returns empty vector.
+  std::vector<uint32_t> GetExtraRootVisits(Node* parent) const;
 
   int64_t GetTimeSinceStart() const;
   void UpdateRemainingMoves();
   void MaybeTriggerStop();
+  // Keeps at most @threads - 1 extra trees, as a tree without a worker of its
+  // own would never be searched. Called before workers start.
+  void LimitTrees(size_t threads);
+  // When the trees are out of their memory budget, prunes them down to 3/4
+  // of it. If nothing can be pruned, the tree is full.
+  void MaybePruneTrees();
+  // Releases subtrees below children of @node to the garbage collector, those
+  // with fewer visits first, until about @nodes nodes are released. The most
+  // visited child, and children with visits in flight (as workers may be in
+  // their subtrees), are pruned the same way instead. The lock of the tree has
+  // to be held exclusively. Returns the estimated number of nodes released.
+  int64_t PruneSubtrees(Node* node, int64_t nodes);
   void MaybeOutputInfo();
   void SendUciInfo();  // Requires nodes_mutex_ to be held.
 
+  // Requires nodes_mutex_ and counters_mutex_ to be held.
   void SendMovesStats() const;
+  // Sends time spent in stages of search as "info string".
+  void SendStageTimes() REQUIRES(counters_mutex_);
+
+  // Remembers that position @hash was prefetched, and counts a cache hit of a
+  // playout at position @hash if it was.
+  void AddPrefetchedHash(uint64_t hash);
+  void CountPrefetchHit(uint64_t hash);
+  // Called after visits are backed up, wakes idle workers.
+  void NotifyBackup();
+  // Blocks until visits are backed up by some worker after @epoch (value of
+  // backup_epoch_) was seen, or the search is stopped or out of time.
+  void WaitForBackup(int64_t epoch);
+  // In infinite mode, when the tree is out of its memory budget, workers can
+  // neither extend it nor send bestmove, so they wait for "stop" instead.
+  // Returns whether it waited.
+  bool MaybeWaitForStop();
+
+  // Every kKLDGainAverageInterval visits, compares root visit distribution
+  // with the previous one. Returns true when KL divergence between them per
+  // new visit is below kMinimumKLDGainPerNode.
+  bool IsKLDGainTooSmall() REQUIRES_SHARED(nodes_mutex_)
+      REQUIRES(counters_mutex_);
 
   // We only need first ply for debug output, but could be easily generalized.
   NNCacheLock GetCachedFirstPlyResult(EdgeAndNode) const;
 
-  mutable Mutex counters_mutex_ ACQUIRED_AFTER(nodes_mutex_);
+  mutable Mutex counters_mutex_ ACQUIRED_AFTER(nodes_mutex_){
+      "search counters"};
   // Tells all threads to stop.
   bool stop_ GUARDED_BY(counters_mutex_) = false;
   // There is already one thread that responded bestmove, other threads
@@ -134,15 +243,78 @@ class Search {
   bool responded_bestmove_ GUARDED_BY(counters_mutex_) = false;
   // Becomes true when smart pruning decides
   bool found_best_move_ GUARDED_BY(counters_mutex_) = false;
+  // Becomes true when the tree reaches its memory budget.
+  bool tree_full_ GUARDED_BY(counters_mutex_) = false;
+  // Time from start of the search until it was told to stop, -1 until then.
+  int64_t stop_time_ms_ GUARDED_BY(counters_mutex_) = -1;
+  // Root visit distribution at the last KLD gain check, and the number of
+  // visits at that time.
+  std::vector<uint32_t> prev_dist_ GUARDED_BY(counters_mutex_);
+  int64_t prev_dist_visits_ GUARDED_BY(counters_mutex_) = 0;
   // Stored so that in the case of non-zero temperature GetBestMove() returns
   // consistent results.
   std::pair<Move, Move> best_move_ GUARDED_BY(counters_mutex_);
-
-  Mutex threads_mutex_;
-  std::vector<std::thread> threads_ GUARDED_BY(threads_mutex_);
+  // Incremented every time some visits are backed up. Only modified under
+  // counters_mutex_, but can be read without it.
+  std::atomic<int64_t> backup_epoch_{0};
+  // Workers which only had collisions wait on this until more visits are
+  // backed up.
+  std::condition_variable idle_cv_;
+  int idle_workers_ GUARDED_BY(counters_mutex_) = 0;
+  // How many times, and for how long in total, workers were idle.
+  int64_t idle_waits_ GUARDED_BY(counters_mutex_) = 0;
+  int64_t idle_time_us_ GUARDED_BY(counters_mutex_) = 0;
+
+  // Nodes evaluated during this search, by position hash. Nodes which reach
+  // the same position take policy and value from there instead of querying
+  // NN (and NNCache).
+  Mutex transpositions_mutex_ ACQUIRED_AFTER(counters_mutex_){
+      "search transpositions"};
+  std::unordered_map<uint64_t, Node*> transpositions_
+      GUARDED_BY(transpositions_mutex_);
+  // Number of expanded nodes which were evaluated from a transposition, and
+  // the total number of expanded non-terminal nodes.
+  std::atomic<int64_t> transposition_hits_{0};
+  std::atomic<int64_t> transposition_lookups_{0};
+  // Number of nodes scored from tablebases.
+  std::atomic<int64_t> tb_hits_{0};
+  // Time spent in stages of iterations, flushed from workers.
+  std::atomic<int64_t> stage_ns_[kSearchStageCount] = {};
+  std::atomic<int64_t> stage_iterations_{0};
+  int64_t last_stage_times_ms_ GUARDED_BY(counters_mutex_) = 0;
+  // Number of positions sent to NN by prefetching into cache, and how many
+  // of them playouts found in cache later.
+  std::atomic<int64_t> prefetched_{0};
+  std::atomic<int64_t> prefetch_hits_{0};
+  // Prefetched positions which no playout has used yet, in slots by the low
+  // bits of the hash, 0 for none. A prefetch overwrites an earlier one in the
+  // same slot, so hits are undercounted a little, but the table is bounded
+  // and checked without a lock.
+  static constexpr int kPrefetchedHashesSize = 1 << 14;
+  std::unique_ptr<std::atomic<uint64_t>[]> prefetched_hashes_{
+      new std::atomic<uint64_t>[kPrefetchedHashesSize]()};
+
+  Mutex threads_mutex_{"search threads"};
+  // Taken by the worker which prunes the trees.
+  Mutex prune_mutex_{"search prune"};
+  std::vector<std::future<void>> threads_ GUARDED_BY(threads_mutex_);
 
   Node* root_node_;
+  // Other trees in root-parallel mode. They are searched from the same
+  // position by their own workers, and their root visits are added to the
+  // main tree's when the best move is picked.
+  struct ExtraTree {
+    // Parent of the root, which keeps its stats.
+    std::unique_ptr<Node> root_parent;
+    Node* root;
+    // Guards nodes of the tree, as nodes_mutex_ does for the main tree, so
+    // that workers of different trees don't wait for each other.
+    SharedMutex nodes_mutex{"search extra tree"};
+  };
+  std::vector<std::unique_ptr<ExtraTree>> extra_trees_;
   NNCache* cache_;
+  const uint32_t cache_generation_;
+  SyzygyTablebase* const syzygy_tb_;
   // Fixed positions which happened before the search.
   const PositionHistory& played_history_;
 
@@ -151,7 +323,7 @@ class Search {
   const std::chrono::steady_clock::time_point start_time_;
   const int64_t initial_visits_;
 
-  mutable SharedMutex nodes_mutex_;
+  mutable SharedMutex nodes_mutex_{"search nodes"};
   EdgeAndNode best_move_edge_ GUARDED_BY(nodes_mutex_);
   Edge* last_outputted_best_move_edge_ GUARDED_BY(nodes_mutex_) = nullptr;
   ThinkingInfo uci_info_ GUARDED_BY(nodes_mutex_);
@@ -162,6 +334,13 @@ class Search {
   uint16_t max_depth_ GUARDED_BY(nodes_mutex_) = 0;
   // Cummulative depth of all paths taken in PickNodetoExtend.
   uint64_t cum_depth_ GUARDED_BY(nodes_mutex_) = 0;
+  // Number of descents from root done to gather minibatches. With multi-leaf
+  // gathering, one descent may bring many playouts.
+  int64_t total_descents_ GUARDED_BY(nodes_mutex_) = 0;
+  // Playouts which collided with a node being evaluated, and how many of them
+  // were added as extra visits of a node in the same batch.
+  int64_t total_collisions_ GUARDED_BY(nodes_mutex_) = 0;
+  int64_t total_multivisits_ GUARDED_BY(nodes_mutex_) = 0;
   BestMoveInfo::Callback best_move_callback_;
   ThinkingInfo::Callback info_callback_;
   // External parameters.
@@ -175,9 +354,25 @@ class Search {
   const float kAggressiveTimePruning;
   const float kFpuReduction;
   const bool kCacheHistoryLength;
+  const bool kCacheMirror;
   const float kPolicySoftmaxTemp;
+  // Whether the backend divides logits by kPolicySoftmaxTemp. Otherwise P
+  // values are raised to the power of 1 / kPolicySoftmaxTemp in search.
+  const bool kBackendPolicySoftmaxTemp;
   const int kAllowedNodeCollisions;
   const bool kStickyCheckmate;
+  const bool kLockFreeSearch;
+  const bool kMultiLeafGather;
+  const bool kPipelinedSearch;
+  const bool kTranspositions;
+  const int kTreeMemoryMb;
+  const int kRootParallelTrees;
+  const float kMinimumKLDGainPerNode;
+  const int kKLDGainAverageInterval;
+  const bool kMultivisitCollisions;
+  const bool kDeferredExtension;
+  const int kNnPriority;
+  const bool kStageTimes;
 
   friend class SearchWorker;
 };
@@ -187,16 +382,35 @@ class Search {
 // within one thread, have to split into stages.
 class SearchWorker {
  public:
-  SearchWorker(Search* search)
-      : search_(search), history_(search_->played_history_) {}
+  // Searches the tree starting at @root_node, which is either the main root or
+  // root of another root-parallel tree.
+  SearchWorker(Search* search, Node* root_node) { Reset(search, root_node); }
+
+  // Prepares the worker to run another search. Buffers keep their capacity, so
+  // a worker which is reused between moves doesn't have to grow them again.
+  void Reset(Search* search, Node* root_node);
 
   // Runs iterations while needed.
   void RunBlocking() {
-    while (IsSearchActive()) {
-      ExecuteOneIteration();
+    if (search_->kPipelinedSearch) {
+      RunPipelined();
+    } else {
+      while (IsSearchActive()) {
+        ExecuteOneIteration();
+      }
     }
+    // The worker outlives the search, but the computation holds locks of the
+    // search's NNCache, so it should not.
+    computation_.reset();
+    FlushStageTimes();
   }
 
+  // Same as RunBlocking(), but keeps two minibatches in flight: while the NN
+  // computes one, the next one is gathered. Results are backed up as soon as
+  // they arrive. Virtual loss of the batch in flight keeps the next batch from
+  // picking the same nodes.
+  void RunPipelined();
+
   // Does one full iteration of MCTS search:
   // 1. Initialize internal structures.
   // 2. Gather minibatch.
@@ -210,6 +424,9 @@ class SearchWorker {
   // Returns whether another search iteration is needed (false means exit).
   bool IsSearchActive() const;
 
+  // Returns a new computation of the network, with the search's priority.
+  std::unique_ptr<NetworkComputation> NewComputation();
+
   // The same operations one by one:
   // 1. Initialize internal structures.
   // @computation is the computation to use on this iteration.
@@ -234,27 +451,195 @@ class SearchWorker {
   void UpdateCounters();
 
  private:
+  // Adds stage_times_ to the search's and clears them.
+  void FlushStageTimes();
+
   struct NodeToProcess {
     NodeToProcess(Node* node, bool is_collision, uint16_t depth)
         : node(node), is_collision(is_collision), depth(depth) {}
     Node* node;
     bool is_collision = false;
     bool nn_queried = false;
+    // Evaluation is taken from a transposition, v is already set.
+    bool is_transposition = false;
+    // Position hash, only computed if transpositions are enabled.
+    uint64_t position_hash = 0;
+    // Move generation and creation of edges is left until the NN computes.
+    bool extension_deferred = false;
+    // Position of the deferred node.
+    ChessBoard board;
+    // Legal moves of the deferred node, if they were already generated for
+    // the NN input. Otherwise they are generated from the board later.
+    bool legal_moves_known = false;
+    MoveList legal_moves;
+    // Number of visits the evaluation counts for. Playouts which collided
+    // with this node in the same batch add to it.
+    int multivisit = 1;
+    // Order of probabilities in the NN computation.
+    Search::CacheOrder cache_order = Search::CacheOrder::kLegalMoves;
 	uint16_t depth;
     // Value from NN's value head, or -1/0/1 for terminal nodes.
     float v;
   };
   
+  // Snapshot of search state used for smart pruning at root.
+  struct SmartPruningInfo {
+    EdgeAndNode best_move_edge;
+    int best_node_n = 0;
+    int remaining_playouts = std::numeric_limits<int>::max();
+  };
+  SmartPruningInfo GetSmartPruningInfo() const;
+
   NodeToProcess PickNodeToExtend();
+  // Does the tree descent for PickNodeToExtend().
+  NodeToProcess PickNodeToExtend(const SmartPruningInfo& pruning);
+  // Multi-leaf version of PickNodeToExtend(). In one descent, splits @budget
+  // visits between children at every level, and adds resulting leaves and
+  // collisions to nodes_to_process_.
+  void PickNodesToExtend(int budget);
+  // Recursive part of the above. Returns number of nodes added.
+  int PickNodesToExtend(Node* node, int budget, uint16_t depth,
+                        const SmartPruningInfo& pruning);
+  // Looks up evaluated node with the same position as the picked leaf, and if
+  // it's found, copies its policy and value. Returns whether that happened.
+  bool TryUseTransposition(NodeToProcess* node_to_process);
+  // If @node, at which the last picked playout collided, is evaluated in the
+  // current batch, adds the playout to that node's visits instead, and drops
+  // the collision. Returns whether that happened.
+  bool MergeCollision(Node* node);
+  // Fills edge_stats_ with scores of children of @node, excluding ones which
+  // can't be picked.
+  void CollectEdgeStats(Node* node, bool is_root_node,
+                        const SmartPruningInfo& pruning, float puct_mult);
+  // Extends the last node of nodes_to_process_ and adds it to computation if
+  // needed. Updates nodes_found_ and collisions_found_.
+  void ProcessPickedNode();
+  // Parts of the above for a collision, which is merged into an earlier visit
+  // or counted, and for a leaf at the position of history_.
+  void ProcessCollision();
+  void ProcessLeaf(NodeToProcess* picked_node);
+  // Processes leaves picked by the multi-leaf descent, which are left until
+  // the tree is unlocked.
+  void ProcessPickedLeaves();
   void ExtendNode(Node* node);
-  bool AddNodeToComputation(Node* node, bool add_if_cached = true);
-  int PrefetchIntoCache(Node* node, int budget);
+  // Returns whether the expansion of @node can be left until the NN computes
+  // the batch. That is not possible for the root and for nodes which may be a
+  // draw by rule, as checkmate takes precedence there.
+  bool CanDeferExtension(Node* node) const;
+  // Whether the last position of history_ is scored from tablebases when
+  // extended.
+  bool CanProbeTablebase() const;
+  // Creates edges of nodes of the current batch whose extension was deferred,
+  // or makes them terminal if there are no legal moves. Moves generated for
+  // the NN input are reused.
+  void ExtendDeferredNodes();
+  // If @order is not nullptr, sets it to the order of probabilities of
+  // the node in the computation. If legal moves had to be generated and
+  // @legal_moves is not nullptr, they are moved there.
+  bool AddNodeToComputation(Node* node, bool add_if_cached = true,
+                            Search::CacheOrder* order = nullptr,
+                            MoveList* legal_moves = nullptr);
+  void PrefetchIntoCache(int budget);
+  // Adds edges of @node to prefetch_frontier_, @probability being that of the
+  // node, and at most @max_unvisited of edges without a node. Moves from root
+  // to @node are @path_length moves in prefetch_paths_ from @path_begin.
+  void ExpandPrefetchFrontier(Node* node, float probability,
+                              uint32_t path_begin, uint16_t path_length,
+                              int max_unvisited);
+  // Sets history_ to the position after @length moves of @path from root.
+  // Only moves after the common prefix with history_path_ are replayed.
+  void SetHistoryToPath(const Move* path, size_t length);
+  // Parts of DoBackupUpdate(). The first one propagates values to the nodes,
+  // and returns whether any of root's children was updated. The second one
+  // updates search-wide stats and requires nodes_mutex_ to be held.
+  bool DoBackupUpdateNodes();
+  void DoBackupUpdateStats(bool root_child_updated);
+  // Wakes idle workers if any visits were backed up.
+  void MaybeNotifyBackup();
+
+  // PUCT scores of edges of a node being descended in PickNodeToExtend(),
+  // by edge index. Computed from the stats chunks of the node in one
+  // vectorized pass.
+  struct EdgeStats {
+    // Computes Q + U of all edges of @node, Q of unvisited ones being @fpu_q.
+    void Compute(const Node* node, float fpu_q, float puct_mult);
+    // Makes edge @idx impossible to pick.
+    void Exclude(int idx);
+    // Makes edge @idx the only one to pick.
+    void PickOnly(int idx);
+    // Returns index of the edge with highest score, or -1 if there is no edge
+    // to pick.
+    int PickBest() const;
+    // Distributes @budget visits between edges into visits array, picking the
+    // best edge one visit at a time and applying virtual loss to it.
+    void SplitBudget(int budget);
+
+    std::vector<float> scores;
+    std::vector<int> visits;
+
+   private:
+    const Node* node_ = nullptr;
+    float fpu_q_ = 0.0f;
+    float puct_mult_ = 0.0f;
+    int num_edges_ = 0;
+    // Scores and negated indices of edges, for SplitBudget().
+    std::vector<std::pair<float, int>> heap_;
+  };
 
-  Search* const search_;
+  Search* search_;
+  Node* root_node_;
+  // Lock of the tree if it's not the main one, nullptr otherwise.
+  SharedMutex* extra_tree_mutex_ = nullptr;
   std::vector<NodeToProcess> nodes_to_process_;
+  EdgeStats edge_stats_;
+  // Leaves picked by the multi-leaf descent: index in nodes_to_process_, and
+  // the moves from root to the leaf in picked_path_moves_[path_begin,
+  // path_end).
+  struct PickedLeaf {
+    size_t node_idx;
+    size_t path_begin;
+    size_t path_end;
+  };
+  std::vector<PickedLeaf> picked_leaves_;
+  std::vector<Move> picked_path_moves_;
+  // Moves from root to the node the multi-leaf descent is at.
+  std::vector<Move> descent_path_;
+  // Edges which prefetching may go through, with estimated probability of
+  // a future playout going through them. Kept as a max-heap.
+  struct PrefetchCandidate {
+    float probability;
+    // Moves from root to the parent of the edge, in prefetch_paths_.
+    uint32_t path_begin;
+    uint16_t path_length;
+    EdgeAndNode edge;
+    bool operator<(const PrefetchCandidate& other) const {
+      return probability < other.probability;
+    }
+  };
+  std::vector<PrefetchCandidate> prefetch_frontier_;
+  // Moves from root to the nodes expanded by prefetching.
+  std::vector<Move> prefetch_paths_;
+  // Moves from root which history_ is at after SetHistoryToPath().
+  std::vector<Move> history_path_;
+  // Stats of the current iteration's GatherMinibatch().
+  int nodes_found_ = 0;
+  int collisions_found_ = 0;
+  int descents_ = 0;
+  // Search::backup_epoch_ as seen when the current iteration started.
+  int64_t backup_epoch_ = 0;
+  // Whether in pipelined mode there is another batch in flight.
+  bool has_pending_batch_ = false;
   std::unique_ptr<CachingComputation> computation_;
-  // History is reset and extended by PickNodeToExtend().
+  // Policy of the node being fetched, in the order of the computation, before
+  // normalization.
+  std::vector<float> policy_;
+  std::vector<int> policy_idx_;
+  // Continues the played history, and is trimmed back to it and extended by
+  // PickNodeToExtend().
   PositionHistory history_;
+  CachingPositionEncoder encoder_;
+  // Time spent in stages since the last FlushStageTimes().
+  SearchStageTimes stage_times_;
 };
 
 }  // namespace lczero
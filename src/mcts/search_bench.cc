@@ -0,0 +1,101 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include <benchmark/benchmark.h>
+
+#include "mcts/search.h"
+#include "neural/cache.h"
+#include "neural/factory.h"
+#include "utils/optionsparser.h"
+
+namespace lczero {
+namespace {
+
+// Gathers minibatches in a tree grown by a search with the "random" backend,
+// which has priors as uneven as a real network's. Only the gathering is
+// timed. The other stages still run, so that virtual loss is released, but
+// then the tree grows by a minibatch per iteration, so the number of
+// iterations is fixed to keep results comparable.
+void BM_GatherMinibatch(benchmark::State& state) {
+  OptionsParser options;
+  Search::PopulateUciParams(&options);
+  // Engine defaults.
+  auto defaults = options.GetMutableDefaultsOptions();
+  defaults->Set<int>(Search::kMiniBatchSizeStr, state.range(1));
+  defaults->Set<float>(Search::kFpuReductionStr, 0.9f);
+  defaults->Set<float>(Search::kCpuctStr, 3.4f);
+  defaults->Set<float>(Search::kPolicySoftmaxTempStr, 2.2f);
+  defaults->Set<int>(Search::kAllowedNodeCollisionsStr, 32);
+  const OptionsDict& dict = options.GetOptionsDict();
+  auto network =
+      NetworkFactory::Get()->Create("random", nullptr, OptionsDict());
+  NNCache cache(200000);
+  NodeTree tree;
+  tree.ResetToPosition(ChessBoard::kStartingFen, {});
+
+  SearchLimits limits;
+  limits.visits = state.range(0);
+  {
+    Search search(tree, network.get(), [](const BestMoveInfo&) {},
+                  [](const ThinkingInfo&) {}, limits, dict, &cache, nullptr);
+    search.RunBlocking(1);
+  }
+
+  Search search(tree, network.get(), [](const BestMoveInfo&) {},
+                [](const ThinkingInfo&) {}, SearchLimits(), dict, &cache,
+                nullptr);
+  auto worker = search.NewWorker();
+  const int visits_before = tree.GetCurrentHead()->GetN();
+  for (auto _ : state) {
+    state.PauseTiming();
+    worker->InitializeIteration(worker->NewComputation());
+    state.ResumeTiming();
+    worker->GatherMinibatch();
+    state.PauseTiming();
+    worker->MaybePrefetchIntoCache();
+    worker->RunNNComputation();
+    worker->FetchMinibatchResults();
+    worker->DoBackupUpdate();
+    state.ResumeTiming();
+  }
+  // Items are visits added to the tree.
+  state.SetItemsProcessed(tree.GetCurrentHead()->GetN() - visits_before);
+  worker.reset();
+  search.Abort();
+}
+// Arguments are the visits of the tree and the minibatch size.
+BENCHMARK(BM_GatherMinibatch)
+    ->Args({10000, 256})
+    ->Args({100000, 256})
+    ->Args({100000, 32})
+    ->Iterations(500)
+    ->Unit(benchmark::kMicrosecond);
+
+}  // namespace
+}  // namespace lczero
+
+BENCHMARK_MAIN();
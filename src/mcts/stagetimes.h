@@ -0,0 +1,88 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+#include "utils/trace.h"
+
+namespace lczero {
+
+// Stages of a search iteration, see SearchWorker::ExecuteOneIteration().
+enum class SearchStage {
+  kInitialize,
+  kGather,
+  kPrefetch,
+  kNnCompute,
+  kFetch,
+  kBackup,
+  kCounters,
+};
+constexpr int kSearchStageCount = 7;
+
+inline const char* GetSearchStageName(SearchStage stage) {
+  static const char* kNames[kSearchStageCount] = {
+      "initialize", "gather", "prefetch", "nn", "fetch", "backup", "counters"};
+  return kNames[static_cast<int>(stage)];
+}
+
+// Time spent in stages of search iterations.
+struct SearchStageTimes {
+  std::int64_t ns[kSearchStageCount] = {};
+  std::int64_t iterations = 0;
+};
+
+// Adds the time until it's destroyed to @stage of @times, and records it as
+// an event of the Tracer if tracing is on. Building with NO_SEARCH_TIMING
+// defined compiles the timers out.
+class StageTimer {
+ public:
+#ifdef NO_SEARCH_TIMING
+  StageTimer(SearchStageTimes*, SearchStage) {}
+#else
+  StageTimer(SearchStageTimes* times, SearchStage stage)
+      : ns_(&times->ns[static_cast<int>(stage)]),
+        stage_(stage),
+        start_ns_(Tracer::Now()) {}
+  ~StageTimer() {
+    *ns_ += Tracer::Now() - start_ns_;
+    if (Tracer::IsEnabled()) {
+      Tracer::Get().AddEvent(GetSearchStageName(stage_), "search", start_ns_);
+    }
+  }
+
+ private:
+  std::int64_t* const ns_;
+  const SearchStage stage_;
+  const std::int64_t start_ns_;
+#endif
+};
+
+}  // namespace lczero
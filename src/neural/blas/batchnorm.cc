@@ -17,6 +17,7 @@
  */
 
 #include "neural/blas/batchnorm.h"
+#include "neural/blas/simd.h"
 
 #include <cmath>
 
@@ -25,6 +26,11 @@ namespace lczero {
 void Batchnorm::Apply(const size_t batch_size, const size_t channels,
                       float* data, const float* means, const float* stddivs,
                       const float* eltwise) {
+  if (const auto simd = GetSimdKernels(channels)) {
+    simd->batchnorm(batch_size, channels, data, means, stddivs, eltwise);
+    return;
+  }
+
   for (size_t i = 0; i < batch_size; i++) {
     for (size_t c = 0; c < channels; ++c) {
       auto mean = means[c];
@@ -76,6 +82,21 @@ std::vector<float> Batchnorm::OffsetMeans(const Weights::ConvBlock& conv) {
   return means;
 }
 
+void Batchnorm::FoldIntoWeights(Weights::ConvBlock* conv) {
+  const size_t outputs = conv->biases.size();
+  const size_t weights_per_output = conv->weights.size() / outputs;
+  for (size_t o = 0; o < outputs; o++) {
+    const float scale = 1.0f / std::sqrt(conv->bn_stddivs[o] + kEpsilon);
+    for (size_t i = 0; i < weights_per_output; i++) {
+      conv->weights[o * weights_per_output + i] *= scale;
+    }
+    conv->biases[o] = (conv->biases[o] - conv->bn_means[o]) * scale;
+  }
+  // Nothing is left to normalize.
+  conv->bn_means.clear();
+  conv->bn_stddivs.clear();
+}
+
 void Batchnorm::InvertStddev(const size_t size, float* array) {
   for (size_t i = 0; i < size; i++)
     array[i] = 1.0f / std::sqrt(array[i] + kEpsilon);
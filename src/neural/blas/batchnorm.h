@@ -48,6 +48,11 @@ class Batchnorm {
   // Return a vector of bn_means offset by biases of a ConvBlock.
   static std::vector<float> OffsetMeans(const Weights::ConvBlock& conv);
 
+  // Folds batch normalization of a ConvBlock into its weights and biases (in
+  // place), so that the convolution only needs the biases added. Weights have
+  // to be in [output][input] order, not yet transformed.
+  static void FoldIntoWeights(Weights::ConvBlock* conv);
+
  private:
   static constexpr float kEpsilon = 1e-5f;
 
@@ -0,0 +1,45 @@
+/*
+ This file is part of Leela Chess Zero.
+ Copyright (C) 2018 The LCZero Authors
+
+ Leela Chess is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ Leela Chess is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "neural/blas/bf16.h"
+
+#include <cstring>
+
+namespace lczero {
+
+std::vector<uint16_t> Bf16::FromFloat(const std::vector<float>& input) {
+  std::vector<uint16_t> output(input.size());
+  for (size_t i = 0; i < input.size(); i++) {
+    uint32_t bits;
+    std::memcpy(&bits, &input[i], sizeof(bits));
+    // Weights are finite, so the rounding can't turn a NaN into infinity.
+    bits += 0x7fff + ((bits >> 16) & 1);
+    output[i] = static_cast<uint16_t>(bits >> 16);
+  }
+  return output;
+}
+
+void Bf16::ToFloat(const size_t size, const uint16_t* input, float* output) {
+  // Simple enough for the compiler to vectorize.
+  for (size_t i = 0; i < size; i++) {
+    const uint32_t bits = static_cast<uint32_t>(input[i]) << 16;
+    std::memcpy(&output[i], &bits, sizeof(bits));
+  }
+}
+
+}  // namespace lczero
@@ -0,0 +1,40 @@
+/*
+ This file is part of Leela Chess Zero.
+ Copyright (C) 2018 The LCZero Authors
+
+ Leela Chess is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ Leela Chess is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace lczero {
+
+// bfloat16: the upper 16 bits of a float. Same range as fp32 with 8 bits of
+// mantissa, and converts back to fp32 with a shift.
+class Bf16 {
+ public:
+  Bf16() = delete;
+
+  // Converts @input to bf16, rounding to nearest even.
+  static std::vector<uint16_t> FromFloat(const std::vector<float>& input);
+
+  // Converts @size values of @input back to fp32.
+  static void ToFloat(const size_t size, const uint16_t* input, float* output);
+};
+
+}  // namespace lczero
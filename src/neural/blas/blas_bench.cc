@@ -0,0 +1,103 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include <benchmark/benchmark.h>
+
+#include <vector>
+
+#include "neural/blas/fully_connected_layer.h"
+#include "neural/blas/winograd_convolution3.h"
+#include "utils/random.h"
+
+namespace lczero {
+namespace {
+
+const int kSquares = 64;
+
+std::vector<float> RandomVector(size_t size) {
+  std::vector<float> result(size);
+  for (auto& x : result) x = Random::Get().GetFloat(2.0f) - 1.0f;
+  return result;
+}
+
+// One convolution of the residual tower. Arguments are the batch size and
+// the number of filters.
+void BM_WinogradConvolution3(benchmark::State& state) {
+  const size_t batch_size = state.range(0);
+  const size_t channels = state.range(1);
+  WinogradConvolution3 convolution(batch_size, channels, channels);
+  const auto weights = WinogradConvolution3::TransformF(
+      RandomVector(channels * channels * 9), channels, channels);
+  const auto biases = RandomVector(channels);
+  const auto input = RandomVector(batch_size * channels * kSquares);
+  std::vector<float> output(batch_size * channels * kSquares);
+  for (auto _ : state) {
+    convolution.Forward(batch_size, channels, channels, input.data(),
+                        weights.data(), biases.data(), nullptr,
+                        output.data());
+    benchmark::DoNotOptimize(output.data());
+  }
+  state.SetItemsProcessed(state.iterations() * batch_size);
+}
+BENCHMARK(BM_WinogradConvolution3)
+    ->Args({1, 128})
+    ->Args({64, 128})
+    ->Args({256, 128})
+    ->Args({64, 256})
+    ->Unit(benchmark::kMicrosecond);
+
+// Dense layers of the heads. Arguments are the batch size, and sizes of the
+// input and the output.
+void BM_FullyConnectedLayer(benchmark::State& state) {
+  const size_t batch_size = state.range(0);
+  const size_t input_size = state.range(1);
+  const size_t output_size = state.range(2);
+  const auto weights = RandomVector(input_size * output_size);
+  const auto biases = RandomVector(output_size);
+  const auto input = RandomVector(batch_size * input_size);
+  std::vector<float> output(batch_size * output_size);
+  for (auto _ : state) {
+    FullyConnectedLayer::Forward1D(batch_size, input_size, output_size,
+                                   input.data(), weights.data(),
+                                   biases.data(), false, output.data());
+    benchmark::DoNotOptimize(output.data());
+  }
+  state.SetItemsProcessed(state.iterations() * batch_size);
+}
+// Policy head (32 planes to 1858 moves) and the first layer of the value head
+// (32 planes to 128).
+BENCHMARK(BM_FullyConnectedLayer)
+    ->Args({1, 32 * kSquares, 1858})
+    ->Args({256, 32 * kSquares, 1858})
+    ->Args({1, 32 * kSquares, 128})
+    ->Args({256, 32 * kSquares, 128})
+    ->Unit(benchmark::kMicrosecond);
+
+}  // namespace
+}  // namespace lczero
+
+BENCHMARK_MAIN();
@@ -18,6 +18,7 @@
 
 #include "neural/blas/fully_connected_layer.h"
 #include "neural/blas/blas.h"
+#include "neural/blas/simd.h"
 
 #include <algorithm>
 #include <cassert>
@@ -109,6 +110,11 @@ float FullyConnectedLayer::Forward0D(const size_t size, const float* x,
 
 void FullyConnectedLayer::Softmax(const size_t size, const float* input,
                                   float* output) {
+  if (const auto simd = GetSimdKernels()) {
+    simd->softmax(size, input, output);
+    return;
+  }
+
   auto alpha = *std::max_element(input, input + size);
 
   auto denom = 0.0f;
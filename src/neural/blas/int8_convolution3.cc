@@ -0,0 +1,164 @@
+/*
+ This file is part of Leela Chess Zero.
+ Copyright (C) 2018 The LCZero Authors
+
+ Leela Chess is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ Leela Chess is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "neural/blas/int8_convolution3.h"
+#include "neural/blas/simd.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace lczero {
+
+namespace {
+
+// Reference for SimdKernels::int8_gemm, with the same results.
+void Int8Gemm(const size_t rows, const size_t outputs, const size_t depth,
+              const uint8_t* a, const int8_t* b, int32_t* c) {
+  constexpr size_t kLanes = 16;
+  for (size_t n = 0; n < rows; n++) {
+    const uint8_t* a_row = a + n * depth;
+    for (size_t o = 0; o < outputs; o++) {
+      const int8_t* b_block = b + (o / kLanes) * kLanes * depth;
+      const size_t lane = o % kLanes;
+      int32_t acc = 0;
+      for (size_t k = 0; k < depth; k += 4) {
+        const int8_t* w = b_block + k * kLanes + lane * 4;
+        for (size_t i = 0; i < 4; i++) acc += a_row[k + i] * w[i];
+      }
+      c[n * outputs + o] = acc;
+    }
+  }
+}
+
+}  // namespace
+
+Int8Convolution3::Int8Convolution3(const std::vector<float>& weights,
+                                   const std::vector<float>& biases,
+                                   const size_t channels)
+    : channels_(channels),
+      outputs_(biases.size()),
+      depth_((channels * 9 + 3) / 4 * 4),
+      outputs_padded_((outputs_ + kOutputBlock - 1) / kOutputBlock *
+                      kOutputBlock),
+      weights_(outputs_padded_ * depth_),
+      weight_scales_(outputs_),
+      biases_(biases),
+      output_scales_(outputs_) {
+  const size_t weights_per_output = channels * 9;
+  for (size_t o = 0; o < outputs_; o++) {
+    const float* w = &weights[o * weights_per_output];
+    float max = 0.0f;
+    for (size_t k = 0; k < weights_per_output; k++) {
+      max = std::max(max, std::abs(w[k]));
+    }
+    const float scale = max > 0.0f ? max / kMaxWeight : 1.0f;
+    weight_scales_[o] = scale;
+
+    int8_t* block = &weights_[o / kOutputBlock * kOutputBlock * depth_];
+    const size_t lane = o % kOutputBlock;
+    for (size_t k = 0; k < weights_per_output; k++) {
+      const auto q = static_cast<int>(std::round(w[k] / scale));
+      block[(k / 4) * 4 * kOutputBlock + lane * 4 + k % 4] =
+          static_cast<int8_t>(std::min(kMaxWeight, std::max(-kMaxWeight, q)));
+    }
+  }
+  SetInputRange(kMaxInput);
+}
+
+void Int8Convolution3::SetInputRange(const float max_input) {
+  input_scale_ = max_input > 0.0f ? max_input / kMaxInput : 1.0f;
+  for (size_t o = 0; o < outputs_; o++) {
+    output_scales_[o] = weight_scales_[o] * input_scale_;
+  }
+}
+
+void Int8Convolution3::Forward(const size_t batch_size, const float* input,
+                               const float* eltwise, float* output,
+                               Int8Scratch* scratch) const {
+  constexpr auto kPadded = kWidth + 2;
+  const size_t rows = batch_size * kSquares;
+  // The borders of the padded planes are never written, so stay zero.
+  if (scratch->planes.size() < channels_ * kPadded * kPadded) {
+    scratch->planes.resize(channels_ * kPadded * kPadded);
+  }
+  if (scratch->columns.size() < rows * depth_) {
+    scratch->columns.resize(rows * depth_);
+  }
+  if (scratch->products.size() < rows * outputs_padded_) {
+    scratch->products.resize(rows * outputs_padded_);
+  }
+
+  // Quantizes the inputs and lays out the 3x3 neighbourhood of every square
+  // as one row. Padding (both the border and past channels_ * 9) is zero.
+  uint8_t* padded = scratch->planes.data();
+  const float inverse_scale = 1.0f / input_scale_;
+  for (size_t batch_index = 0; batch_index < batch_size; batch_index++) {
+    const float* input_batch = input + batch_index * channels_ * kSquares;
+    for (size_t c = 0; c < channels_; c++) {
+      uint8_t* plane = &padded[c * kPadded * kPadded];
+      for (int y = 0; y < kHeight; y++) {
+        for (int x = 0; x < kWidth; x++) {
+          const float val =
+              input_batch[c * kSquares + y * kWidth + x] * inverse_scale;
+          plane[(y + 1) * kPadded + x + 1] = static_cast<uint8_t>(
+              std::min<float>(kMaxInput, std::max(0.0f, val + 0.5f)));
+        }
+      }
+    }
+    for (int y = 0; y < kHeight; y++) {
+      for (int x = 0; x < kWidth; x++) {
+        uint8_t* row =
+            &scratch->columns[(batch_index * kSquares + y * kWidth + x) *
+                              depth_];
+        for (size_t c = 0; c < channels_; c++) {
+          const uint8_t* plane = &padded[c * kPadded * kPadded];
+          for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) {
+              *row++ = plane[(y + i) * kPadded + x + j];
+            }
+          }
+        }
+        for (size_t k = channels_ * 9; k < depth_; k++) *row++ = 0;
+      }
+    }
+  }
+
+  const auto simd = GetSimdKernels();
+  const auto gemm = simd && simd->int8_gemm ? simd->int8_gemm : Int8Gemm;
+  gemm(rows, outputs_padded_, depth_, scratch->columns.data(),
+       weights_.data(), scratch->products.data());
+
+  for (size_t batch_index = 0; batch_index < batch_size; batch_index++) {
+    const int32_t* products =
+        &scratch->products[batch_index * kSquares * outputs_padded_];
+    float* output_batch = output + batch_index * outputs_ * kSquares;
+    const float* eltwise_batch =
+        eltwise ? eltwise + batch_index * outputs_ * kSquares : nullptr;
+    for (size_t o = 0; o < outputs_; o++) {
+      const float scale = output_scales_[o];
+      const float bias = biases_[o];
+      for (int square = 0; square < kSquares; square++) {
+        auto val = products[square * outputs_padded_ + o] * scale + bias;
+        if (eltwise_batch) val += eltwise_batch[o * kSquares + square];
+        output_batch[o * kSquares + square] = val > 0 ? val : 0;
+      }
+    }
+  }
+}
+
+}  // namespace lczero
@@ -0,0 +1,85 @@
+/*
+ This file is part of Leela Chess Zero.
+ Copyright (C) 2018 The LCZero Authors
+
+ Leela Chess is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ Leela Chess is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace lczero {
+
+// Scratch buffers of Int8Convolution3::Forward(). They only grow.
+struct Int8Scratch {
+  std::vector<uint8_t> planes;
+  std::vector<uint8_t> columns;
+  std::vector<int32_t> products;
+};
+
+// Convolution 3x3 on a 8x8 board in int8.
+//
+// Weights are quantized per output channel to [-127, 127]. Inputs, which are
+// never negative, are quantized to [0, 127] with one scale per convolution
+// that comes from calibration. The convolution is one integer GEMM of the
+// weights with the 3x3 neighbourhoods of all squares, which CPUs with VNNI
+// compute four times as fast as fp32.
+class Int8Convolution3 {
+ public:
+  // @weights are in [output][channel][3][3] order, with batchnorm folded in.
+  Int8Convolution3(const std::vector<float>& weights,
+                   const std::vector<float>& biases, const size_t channels);
+
+  // Sets the largest input value expected. Larger inputs saturate.
+  void SetInputRange(const float max_input);
+
+  // Forward inference, batched. Adds the biases to the result, and @eltwise
+  // (of the same size as @output) unless it's nullptr, and then applies ReLU.
+  void Forward(const size_t batch_size, const float* input,
+               const float* eltwise, float* output,
+               Int8Scratch* scratch) const;
+
+ private:
+  static constexpr auto kWidth = 8;
+  static constexpr auto kHeight = 8;
+  static constexpr auto kSquares = kWidth * kHeight;
+
+  // Largest quantized activation. 7 bits keep the 16-bit pair sums of the
+  // AVX2 kernel from saturating.
+  static constexpr int kMaxInput = 127;
+  static constexpr int kMaxWeight = 127;
+  // Outputs are packed in blocks of that many, see Pack().
+  static constexpr size_t kOutputBlock = 16;
+
+  const size_t channels_;
+  const size_t outputs_;
+  // Values per output, channels_ * 9 padded to a multiple of 4.
+  const size_t depth_;
+  // outputs_ padded to a multiple of kOutputBlock.
+  const size_t outputs_padded_;
+
+  // Blocks of kOutputBlock outputs, in each of them groups of 4 consecutive
+  // weights of each output.
+  std::vector<int8_t> weights_;
+  std::vector<float> weight_scales_;
+  std::vector<float> biases_;
+  float input_scale_ = 1.0f;
+  // weight_scales_ multiplied by input_scale_.
+  std::vector<float> output_scales_;
+};
+
+}  // namespace lczero
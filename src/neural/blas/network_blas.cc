@@ -17,81 +17,279 @@
  */
 
 #include "neural/network.h"
+#include "chess/position.h"
 #include "neural/blas/batchnorm.h"
+#include "neural/blas/bf16.h"
 #include "neural/blas/blas.h"
 #include "neural/blas/convolution1.h"
 #include "neural/blas/fully_connected_layer.h"
+#include "neural/blas/int8_convolution3.h"
+#include "neural/blas/simd.h"
 #include "neural/blas/winograd_convolution3.h"
+#include "neural/blas/winograd_convolution3_f4.h"
+#include "neural/encoder.h"
 #include "neural/factory.h"
+#include "neural/shared_weights.h"
+#include "utils/exception.h"
+#include "utils/threadpool.h"
 
 #include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <future>
+#include <list>
+#include <mutex>
+#include <random>
 
 namespace lczero {
 
+// Scratch buffers of a computation. The network keeps them for reuse, as
+// allocating them for every batch takes a lot of time for small batches.
+struct BlasWorkspace {
+  // Largest batch size the buffers are allocated for.
+  size_t batch_size = 0;
+  std::vector<float> output_val;
+  std::vector<float> output_pol;
+  std::vector<float> res_buffer1;
+  std::vector<float> res_buffer2;
+  std::vector<float> res_buffer3;
+  std::vector<float> policy_buffer;
+  std::vector<float> value_buffer;
+  // Only the one of the Winograd variant the network uses is allocated.
+  std::unique_ptr<WinogradConvolution3> convolve3;
+  std::unique_ptr<WinogradConvolution3F4> convolve3_f4;
+  Int8Scratch int8_scratch;
+};
+
+class BlasNetwork;
+
 class BlasComputation : public NetworkComputation {
  public:
-  BlasComputation(const Weights& weights, const size_t max_batch_size);
+  BlasComputation(BlasNetwork* network, const Weights& weights,
+                  const size_t max_batch_size, const bool winograd_f4x4);
 
   virtual ~BlasComputation() {}
 
   // Adds a sample to the batch.
-  void AddInput(InputPlanes&& input) override { planes_.emplace_back(input); }
+  InputPlanesRef AddInputInPlace() override {
+    samples_.push_back({moves_.size(), kAllMoves, policies_size_});
+    policies_size_ += weights_.ip_pol_b.size();
+    return planes_.Add();
+  }
+
+  // Adds a sample to the batch, keeping the policy of @move_ids only.
+  InputPlanesRef AddInputForMoves(const uint16_t* move_ids,
+                                  int count) override {
+    samples_.push_back({moves_.size(), count, policies_size_});
+    moves_.insert(moves_.end(), move_ids, move_ids + count);
+    policies_size_ += count;
+    return planes_.Add();
+  }
+
+  void SetPolicySoftmaxTemp(float temp) override { policy_temp_ = temp; }
 
   // Do the computation.
   void ComputeBlocking() override;
 
-  // Returns how many times AddInput() was called.
-  int GetBatchSize() const override { return static_cast<int>(planes_.size()); }
+  // Returns how many samples were added.
+  int GetBatchSize() const override { return planes_.GetSize(); }
 
   // Returns Q value of @sample.
   float GetQVal(int sample) const override { return q_values_[sample]; }
 
   // Returns P value @move_id of @sample.
   float GetPVal(int sample, int move_id) const override {
-    return policies_[sample][move_id];
+    const auto& info = samples_[sample];
+    if (info.moves_count == kAllMoves) {
+      return policies_[info.policy_begin + move_id];
+    }
+    const auto moves = &moves_[info.moves_begin];
+    const auto move = std::find(moves, moves + info.moves_count, move_id);
+    if (move == moves + info.moves_count) return 0.0f;
+    return policies_[info.policy_begin + (move - moves)];
+  }
+  void GetPVals(int sample, const uint16_t* move_ids, int count,
+                float* out) const override {
+    const auto& info = samples_[sample];
+    const float* policy = &policies_[info.policy_begin];
+    if (info.moves_count == kAllMoves) {
+      for (int i = 0; i < count; ++i) out[i] = policy[move_ids[i]];
+      return;
+    }
+    // Usually the moves the sample was added with, in the same order.
+    const auto moves = &moves_[info.moves_begin];
+    for (int i = 0; i < count; ++i) {
+      out[i] = i < info.moves_count && moves[i] == move_ids[i]
+                   ? policy[i]
+                   : GetPVal(sample, move_ids[i]);
+    }
+  }
+
+  // Makes the computation record the largest input of each convolution of
+  // the residual tower into @max_inputs.
+  void SetCalibration(std::vector<float>* max_inputs) {
+    max_inputs_ = max_inputs;
   }
 
  private:
-  void EncodePlanes(const InputPlanes& sample, float* buffer);
+  void EncodePlanes(int sample, float* buffer);
+  // Computes samples [@begin, @end) of the batch.
+  void ComputeSlice(const size_t begin, const size_t end);
+  void ComputeBlocking(BlasWorkspace* workspace, const size_t begin,
+                       const size_t end);
 
   static constexpr auto kWidth = 8;
   static constexpr auto kHeight = 8;
   static constexpr auto kSquares = kWidth * kHeight;
 
+  // moves_count of samples which keep the whole policy.
+  static constexpr int kAllMoves = -1;
+  struct SampleInfo {
+    // Where the moves of the sample start in moves_.
+    size_t moves_begin;
+    // Number of moves the policy is kept for, or kAllMoves.
+    int moves_count;
+    // Where the policy of the sample starts in policies_.
+    size_t policy_begin;
+  };
+
+  BlasNetwork* const network_;
   const Weights& weights_;
   size_t max_batch_size_;
-  std::vector<InputPlanes> planes_;
-  std::vector<std::vector<float>> policies_;
+  const bool winograd_f4x4_;
+  float policy_temp_ = 1.0f;
+  InputBatch planes_;
+  std::vector<SampleInfo> samples_;
+  // Moves of the samples added with AddInputForMoves(), one after another.
+  std::vector<uint16_t> moves_;
+  // Policies of all samples, one after another: all of it, or only of the
+  // moves of the sample, in the order of its moves.
+  std::vector<float> policies_;
+  size_t policies_size_ = 0;
   std::vector<float> q_values_;
+  std::vector<float>* max_inputs_ = nullptr;
+};
+
+// Weights in the form the backend computes with.
+struct BlasWeights {
+  // With batch norm folded into the convolutions, and the 3x3 ones Winograd
+  // transformed (except the tower ones which are in bf16).
+  Weights weights;
+  // See GetBf16Weights().
+  std::vector<std::vector<uint16_t>> bf16;
 };
 
 class BlasNetwork : public Network {
  public:
-  BlasNetwork(const Weights& weights, const OptionsDict& options);
+  BlasNetwork(const WeightsPtr& weights, const OptionsDict& options);
   virtual ~BlasNetwork(){};
 
   std::unique_ptr<NetworkComputation> NewComputation() override {
-    return std::make_unique<BlasComputation>(weights_, max_batch_size_);
+    return std::make_unique<BlasComputation>(this, weights_->weights,
+                                             max_batch_size_, winograd_f4x4_);
+  }
+
+  bool SupportsPolicySoftmaxTemp() const override { return true; }
+
+  std::unique_ptr<BlasWorkspace> GetWorkspace() {
+    std::lock_guard<std::mutex> lock(workspaces_lock_);
+    if (free_workspaces_.empty()) return std::make_unique<BlasWorkspace>();
+    std::unique_ptr<BlasWorkspace> workspace =
+        std::move(free_workspaces_.front());
+    free_workspaces_.pop_front();
+    return workspace;
+  }
+
+  void ReleaseWorkspace(std::unique_ptr<BlasWorkspace> workspace) {
+    std::lock_guard<std::mutex> lock(workspaces_lock_);
+    free_workspaces_.push_back(std::move(workspace));
+  }
+
+  // Transformed weights of the convolutions of the residual tower in bf16,
+  // in the same order as GetInt8Convolutions(), or empty when they are fp32.
+  const std::vector<std::vector<uint16_t>>& GetBf16Weights() const {
+    return weights_->bf16;
+  }
+
+  // Number of threads a batch is split across.
+  size_t GetThreadCount() const { return threads_; }
+  ThreadPool* GetThreadPool() { return &thread_pool_; }
+
+  // Quantized convolutions of the residual tower (conv1 and conv2 of every
+  // block), or empty when the tower is computed in fp32.
+  const std::vector<Int8Convolution3>& GetInt8Convolutions() const {
+    return int8_convolutions_;
   }
 
  private:
+  // Transforms @weights into the form to compute with, appending the
+  // quantized tower convolutions to @int8_convolutions if it's not null.
+  static BlasWeights TransformWeights(
+      const Weights& weights, bool winograd_f4x4, bool bf16,
+      std::vector<Int8Convolution3>* int8_convolutions);
+
+  // Sets the input ranges of @convolutions from the fp32 network evaluating
+  // a fixed sample of positions.
+  void CalibrateInt8(std::vector<Int8Convolution3>* convolutions);
+
   // A cap on the max batch size since it consumes a lot of memory
   static constexpr auto kHardMaxBatchSize = 2048;
 
-  Weights weights_;
+  // Shared by all BLAS networks with the same weights and transform options,
+  // except for int8 ones, which calibrate and then trim their own.
+  std::shared_ptr<const BlasWeights> weights_;
   size_t max_batch_size_;
+  // Whether 3x3 convolutions use Winograd F(4x4, 3x3) instead of F(2x2, 3x3).
+  bool winograd_f4x4_;
+  std::vector<Int8Convolution3> int8_convolutions_;
+  size_t threads_;
+  std::mutex workspaces_lock_;
+  std::list<std::unique_ptr<BlasWorkspace>> free_workspaces_;
+  // Runs the slices of a batch but the first one, which the thread calling
+  // ComputeBlocking() does itself. Declared last so that its threads are
+  // stopped before anything they use is destroyed.
+  ThreadPool thread_pool_;
 };
 
-BlasComputation::BlasComputation(const Weights& weights,
-                                 const size_t max_batch_size)
-    : weights_(weights),
+BlasComputation::BlasComputation(BlasNetwork* network, const Weights& weights,
+                                 const size_t max_batch_size,
+                                 const bool winograd_f4x4)
+    : network_(network),
+      weights_(weights),
       max_batch_size_(max_batch_size),
+      winograd_f4x4_(winograd_f4x4),
       policies_(0),
       q_values_(0) {}
 
 void BlasComputation::ComputeBlocking() {
+  const auto plane_count = static_cast<size_t>(planes_.GetSize());
+  policies_.resize(policies_size_);
+  q_values_.resize(plane_count);
+
+  // The batch is split into one slice of consecutive samples per thread,
+  // and every slice goes through the whole network with its own workspace.
+  // Calibration records into a single vector, so doesn't split.
+  size_t slices = std::min(network_->GetThreadCount(), plane_count);
+  if (max_inputs_ || slices == 0) slices = 1;
+  std::vector<std::future<void>> futures;
+  for (size_t slice = 1; slice < slices; slice++) {
+    const auto begin = plane_count * slice / slices;
+    const auto end = plane_count * (slice + 1) / slices;
+    futures.push_back(network_->GetThreadPool()->Run(
+        [this, begin, end]() { ComputeSlice(begin, end); }));
+  }
+  ComputeSlice(0, plane_count / slices);
+  for (auto& future : futures) future.get();
+}
+
+void BlasComputation::ComputeSlice(const size_t begin, const size_t end) {
+  std::unique_ptr<BlasWorkspace> workspace = network_->GetWorkspace();
+  ComputeBlocking(workspace.get(), begin, end);
+  network_->ReleaseWorkspace(std::move(workspace));
+}
+
+void BlasComputation::ComputeBlocking(BlasWorkspace* workspace,
+                                      const size_t begin, const size_t end) {
   // Retrieve network key dimensions from the weights structure.
   const auto num_value_channels = weights_.ip1_val_b.size();
   const auto num_value_input_planes = weights_.value.bn_means.size();
@@ -107,8 +305,7 @@ void BlasComputation::ComputeBlocking() {
   const auto max_channels = std::max(output_channels, input_channels);
 
   // Determine the largest batch for allocations.
-  const auto plane_count = planes_.size();
-  const auto largest_batch_size = std::min(max_batch_size_, plane_count);
+  const auto largest_batch_size = std::min(max_batch_size_, end - begin);
 
   /* Typically
    input_channels = 112
@@ -120,66 +317,115 @@ void BlasComputation::ComputeBlocking() {
    num_output_policy = 1858
    */
 
-  // Allocate data for the whole batch.
-  std::vector<float> output_val(largest_batch_size * num_value_channels);
-  std::vector<float> output_pol(largest_batch_size * num_output_policy);
-
-  std::vector<float> res_buffer1(largest_batch_size * max_channels * kSquares);
-  std::vector<float> res_buffer2(largest_batch_size * output_channels *
-                                 kSquares);
-  std::vector<float> res_buffer3(largest_batch_size * output_channels *
-                                 kSquares);
-
-  WinogradConvolution3 convolve3(largest_batch_size, max_channels,
-                                 output_channels);
-
-  std::vector<float> policy_buffer(largest_batch_size *
-                                   num_policy_input_planes * kSquares);
-  std::vector<float> value_buffer(largest_batch_size * num_value_input_planes *
+  // Allocate data for the whole batch, unless the workspace already has
+  // enough.
+  if (workspace->batch_size < largest_batch_size) {
+    workspace->batch_size = largest_batch_size;
+    workspace->output_val.resize(largest_batch_size * num_value_channels);
+    workspace->output_pol.resize(largest_batch_size * num_output_policy);
+    workspace->res_buffer1.resize(largest_batch_size * max_channels *
+                                  kSquares);
+    workspace->res_buffer2.resize(largest_batch_size * output_channels *
+                                  kSquares);
+    workspace->res_buffer3.resize(largest_batch_size * output_channels *
                                   kSquares);
+    if (winograd_f4x4_) {
+      workspace->convolve3_f4 = std::make_unique<WinogradConvolution3F4>(
+          largest_batch_size, max_channels, output_channels);
+    } else {
+      workspace->convolve3 = std::make_unique<WinogradConvolution3>(
+          largest_batch_size, max_channels, output_channels);
+    }
+    workspace->policy_buffer.resize(largest_batch_size *
+                                    num_policy_input_planes * kSquares);
+    workspace->value_buffer.resize(largest_batch_size *
+                                   num_value_input_planes * kSquares);
+  }
+  auto& output_val = workspace->output_val;
+  auto& output_pol = workspace->output_pol;
+  // Runs a 3x3 convolution with the Winograd variant of the network.
+  // @weights are either fp32 or bf16.
+  const auto convolve3 = [workspace](const size_t batch_size,
+                                     const size_t input_channels,
+                                     const size_t output_channels,
+                                     const float* input, const auto* weights,
+                                     const float* biases, const float* eltwise,
+                                     float* output) {
+    if (workspace->convolve3_f4) {
+      workspace->convolve3_f4->Forward(batch_size, input_channels,
+                                       output_channels, input, weights,
+                                       biases, eltwise, output);
+    } else {
+      workspace->convolve3->Forward(batch_size, input_channels,
+                                    output_channels, input, weights, biases,
+                                    eltwise, output);
+    }
+  };
+  // Runs convolution @index of the residual tower, in int8 or with bf16
+  // weights if the network stores them so.
+  const auto& int8_convolutions = network_->GetInt8Convolutions();
+  const auto& bf16_weights = network_->GetBf16Weights();
+  const auto residual_convolve3 = [&](const size_t index,
+                                      const size_t batch_size,
+                                      const float* input,
+                                      const Weights::ConvBlock& conv,
+                                      const float* eltwise, float* output) {
+    if (max_inputs_) {
+      auto& max_input = (*max_inputs_)[index];
+      max_input = std::max(
+          max_input, *std::max_element(input, input + batch_size *
+                                                          output_channels *
+                                                          kSquares));
+    }
+    if (!int8_convolutions.empty()) {
+      int8_convolutions[index].Forward(batch_size, input, eltwise, output,
+                                       &workspace->int8_scratch);
+    } else if (!bf16_weights.empty()) {
+      convolve3(batch_size, output_channels, output_channels, input,
+                bf16_weights[index].data(), conv.biases.data(), eltwise,
+                output);
+    } else {
+      convolve3(batch_size, output_channels, output_channels, input,
+                &conv.weights[0], conv.biases.data(), eltwise, output);
+    }
+  };
+  auto& policy_buffer = workspace->policy_buffer;
+  auto& value_buffer = workspace->value_buffer;
 
   // These ones will rotate during the computation.
-  float* conv_in = res_buffer1.data();
-  float* conv_out = res_buffer2.data();
-  float* res = res_buffer3.data();
+  float* conv_in = workspace->res_buffer1.data();
+  float* conv_out = workspace->res_buffer2.data();
+  float* res = workspace->res_buffer3.data();
 
-  for (size_t i = 0; i < plane_count; i += largest_batch_size) {
-    const auto batch_size = std::min(plane_count - i, largest_batch_size);
+  for (size_t i = begin; i < end; i += largest_batch_size) {
+    const auto batch_size = std::min(end - i, largest_batch_size);
     for (size_t j = 0; j < batch_size; j++) {
-      EncodePlanes(planes_[i + j], &conv_in[j * kSquares * kInputPlanes]);
+      EncodePlanes(i + j, &conv_in[j * kSquares * kInputPlanes]);
     }
 
-    // Input convolution
-
-    convolve3.Forward(batch_size, kInputPlanes, output_channels, conv_in,
-                      &weights_.input.weights[0], conv_out);
+    // Input convolution. Batchnorm is folded into the weights and biases, and
+    // the bias and ReLU are applied in the Winograd output transform.
 
-    Batchnorm::Apply(batch_size, output_channels, conv_out,
-                     weights_.input.bn_means.data(),
-                     weights_.input.bn_stddivs.data());
+    convolve3(batch_size, kInputPlanes, output_channels, conv_in,
+              &weights_.input.weights[0], weights_.input.biases.data(),
+              nullptr, conv_out);
 
     // Residual tower
 
-    for (auto& residual : weights_.residual) {
-      auto& conv1 = residual.conv1;
-      auto& conv2 = residual.conv2;
+    for (size_t block = 0; block < weights_.residual.size(); block++) {
+      auto& conv1 = weights_.residual[block].conv1;
+      auto& conv2 = weights_.residual[block].conv2;
 
       std::swap(conv_out, conv_in);
 
-      convolve3.Forward(batch_size, output_channels, output_channels, conv_in,
-                        &conv1.weights[0], conv_out);
-
-      Batchnorm::Apply(batch_size, output_channels, &conv_out[0],
-                       conv1.bn_means.data(), conv1.bn_stddivs.data());
+      residual_convolve3(2 * block, batch_size, conv_in, conv1, nullptr,
+                         conv_out);
 
       std::swap(conv_in, res);
       std::swap(conv_out, conv_in);
 
-      convolve3.Forward(batch_size, output_channels, output_channels, conv_in,
-                        &conv2.weights[0], conv_out);
-
-      Batchnorm::Apply(batch_size, output_channels, conv_out,
-                       conv2.bn_means.data(), conv2.bn_stddivs.data(), res);
+      residual_convolve3(2 * block + 1, batch_size, conv_in, conv2, res,
+                         conv_out);
     }
 
     Convolution1::Forward(batch_size, output_channels, num_policy_input_planes,
@@ -212,14 +458,25 @@ void BlasComputation::ComputeBlocking() {
         true,  // Relu On
         output_val.data());
 
+    const float inv_temp = 1.0f / policy_temp_;
     for (size_t j = 0; j < batch_size; j++) {
-      std::vector<float> policy(num_output_policy);
-
       // Get the moves
-      FullyConnectedLayer::Softmax(
-          num_output_policy, &output_pol[j * num_output_policy], policy.data());
-
-      policies_.emplace_back(std::move(policy));
+      const auto& info = samples_[i + j];
+      float* logits = &output_pol[j * num_output_policy];
+      float* policy = &policies_[info.policy_begin];
+      if (info.moves_count == kAllMoves) {
+        if (policy_temp_ != 1.0f) {
+          for (size_t k = 0; k < num_output_policy; k++) logits[k] *= inv_temp;
+        }
+        FullyConnectedLayer::Softmax(num_output_policy, logits, policy);
+      } else {
+        // Softmax over the moves only. Search normalizes over them anyway.
+        const auto moves = &moves_[info.moves_begin];
+        for (int k = 0; k < info.moves_count; k++) {
+          policy[k] = logits[moves[k]] * inv_temp;
+        }
+        FullyConnectedLayer::Softmax(info.moves_count, policy, policy);
+      }
 
       // Now get the score
       double winrate = FullyConnectedLayer::Forward0D(
@@ -227,21 +484,24 @@ void BlasComputation::ComputeBlocking() {
                            &output_val[j * num_value_channels]) +
                        weights_.ip2_val_b[0];
 
-      q_values_.emplace_back(std::tanh(winrate));
+      q_values_[i + j] = std::tanh(winrate);
     }
   }
 }
 
-void BlasComputation::EncodePlanes(const InputPlanes& sample, float* buffer) {
-  for (const InputPlane& plane : sample) {
-    const float value = plane.value;
+void BlasComputation::EncodePlanes(int sample, float* buffer) {
+  const uint64_t* masks = planes_.GetMasks(sample);
+  const float* values = planes_.GetValues(sample);
+  for (int plane = 0; plane < kInputPlanes; plane++) {
+    const uint64_t mask = masks[plane];
+    const float value = values[plane];
     for (auto i = 0; i < kSquares; i++)
-      *(buffer++) = (plane.mask & (((uint64_t)1) << i)) != 0 ? value : 0;
+      *(buffer++) = (mask & (((uint64_t)1) << i)) != 0 ? value : 0;
   }
 }
 
-BlasNetwork::BlasNetwork(const Weights& weights, const OptionsDict& options)
-    : weights_(weights) {
+BlasNetwork::BlasNetwork(const WeightsPtr& weights,
+                         const OptionsDict& options) {
   bool verbose = options.GetOrDefault<bool>("verbose", true);
   int blas_cores = options.GetOrDefault<int>("blas_cores", 1);
   max_batch_size_ =
@@ -251,40 +511,39 @@ BlasNetwork::BlasNetwork(const Weights& weights, const OptionsDict& options)
     max_batch_size_ = kHardMaxBatchSize;
   }
   fprintf(stderr, "BLAS, maximum batch size set to %ld.\n", max_batch_size_);
+  fprintf(stderr, "BLAS, using %s kernels.\n", SimdIsaName(GetSimdIsa()));
 
-  const auto inputChannels = kInputPlanes;
-  const auto channels = static_cast<int>(weights.input.biases.size());
-  const auto residual_blocks = weights.residual.size();
-
-  weights_.input.weights = WinogradConvolution3::TransformF(
-      weights_.input.weights, channels, inputChannels);
-
-  Batchnorm::OffsetMeans(&weights_.input);
-  Batchnorm::InvertStddev(&weights_.input);
-
-  // residual blocks
-  for (size_t i = 0; i < residual_blocks; i++) {
-    auto& residual = weights_.residual[i];
-    auto& conv1 = residual.conv1;
-    auto& conv2 = residual.conv2;
-
-    conv1.weights =
-        WinogradConvolution3::TransformF(conv1.weights, channels, channels);
-    conv2.weights =
-        WinogradConvolution3::TransformF(conv2.weights, channels, channels);
-
-    Batchnorm::OffsetMeans(&conv1);
-    Batchnorm::OffsetMeans(&conv2);
-
-    Batchnorm::InvertStddev(&conv1);
-    Batchnorm::InvertStddev(&conv2);
+  const int threads = options.GetOrDefault<int>("threads", 1);
+  if (threads < 1) {
+    throw Exception("threads of the BLAS backend has to be at least 1.");
   }
+  threads_ = threads;
+  fprintf(stderr, "BLAS, splitting batches across %d thread(s).\n", threads);
 
-  Batchnorm::OffsetMeans(&weights_.policy);
-  Batchnorm::InvertStddev(&weights_.policy);
-
-  Batchnorm::OffsetMeans(&weights_.value);
-  Batchnorm::InvertStddev(&weights_.value);
+  const int winograd_tile = options.GetOrDefault<int>("winograd_tile", 2);
+  if (winograd_tile != 2 && winograd_tile != 4) {
+    throw Exception("winograd_tile of the BLAS backend has to be 2 or 4.");
+  }
+  winograd_f4x4_ = winograd_tile == 4;
+  fprintf(stderr, "BLAS, using Winograd F(%dx%d, 3x3).\n", winograd_tile,
+          winograd_tile);
+  const bool int8 = options.GetOrDefault<bool>("int8", false);
+  const bool bf16 = !int8 && options.GetOrDefault<bool>("bf16", false);
+  if (bf16) fprintf(stderr, "BLAS, residual tower weights in bf16.\n");
+  std::vector<Int8Convolution3> int8_convolutions;
+  std::shared_ptr<BlasWeights> own_weights;
+  if (int8) {
+    own_weights = std::make_shared<BlasWeights>(TransformWeights(
+        *weights, winograd_f4x4_, false, &int8_convolutions));
+    weights_ = own_weights;
+  } else {
+    const std::string key = "blas/f" + std::to_string(winograd_tile) +
+                            (bf16 ? "/bf16" : "/fp32");
+    weights_ = GetTransformedWeights<BlasWeights>(
+        weights, key, [&](const Weights& w) {
+          return TransformWeights(w, winograd_f4x4_, bf16, nullptr);
+        });
+  }
 
 #ifdef USE_OPENBLAS
   int num_procs = openblas_get_num_procs();
@@ -329,6 +588,97 @@ BlasNetwork::BlasNetwork(const Weights& weights, const OptionsDict& options)
 #endif
 
   fprintf(stderr, "BLAS max batch size is %ld.\n", max_batch_size_);
+
+  if (int8) {
+    CalibrateInt8(&int8_convolutions);
+    int8_convolutions_ = std::move(int8_convolutions);
+    // The fp32 weights of the tower are not needed anymore.
+    for (auto& residual : own_weights->weights.residual) {
+      residual.conv1.weights = {};
+      residual.conv2.weights = {};
+    }
+  }
+}
+
+BlasWeights BlasNetwork::TransformWeights(
+    const Weights& weights, const bool winograd_f4x4, const bool bf16,
+    std::vector<Int8Convolution3>* int8_convolutions) {
+  const auto transform_f = winograd_f4x4 ? WinogradConvolution3F4::TransformF
+                                         : WinogradConvolution3::TransformF;
+
+  const auto inputChannels = kInputPlanes;
+  const auto channels = static_cast<int>(weights.input.biases.size());
+
+  BlasWeights result;
+  result.weights = weights;
+  Weights& w = result.weights;
+
+  Batchnorm::FoldIntoWeights(&w.input);
+  w.input.weights = transform_f(w.input.weights, channels, inputChannels);
+
+  // residual blocks
+  for (auto& residual : w.residual) {
+    auto& conv1 = residual.conv1;
+    auto& conv2 = residual.conv2;
+
+    Batchnorm::FoldIntoWeights(&conv1);
+    Batchnorm::FoldIntoWeights(&conv2);
+
+    if (int8_convolutions) {
+      int8_convolutions->emplace_back(conv1.weights, conv1.biases, channels);
+      int8_convolutions->emplace_back(conv2.weights, conv2.biases, channels);
+    }
+
+    conv1.weights = transform_f(conv1.weights, channels, channels);
+    conv2.weights = transform_f(conv2.weights, channels, channels);
+
+    if (bf16) {
+      result.bf16.push_back(Bf16::FromFloat(conv1.weights));
+      result.bf16.push_back(Bf16::FromFloat(conv2.weights));
+      conv1.weights = {};
+      conv2.weights = {};
+    }
+  }
+
+  Batchnorm::OffsetMeans(&w.policy);
+  Batchnorm::InvertStddev(&w.policy);
+
+  Batchnorm::OffsetMeans(&w.value);
+  Batchnorm::InvertStddev(&w.value);
+  return result;
+}
+
+void BlasNetwork::CalibrateInt8(std::vector<Int8Convolution3>* convolutions) {
+  // Always the same games, so that the quantization is reproducible.
+  constexpr int kGames = 4;
+  constexpr int kPliesPerGame = 32;
+  std::mt19937 random(kGames * kPliesPerGame);
+
+  BlasComputation computation(this, weights_->weights, max_batch_size_,
+                              winograd_f4x4_);
+  for (int game = 0; game < kGames; game++) {
+    ChessBoard board;
+    board.SetFromFen(ChessBoard::kStartingFen);
+    PositionHistory history;
+    history.Reset(board, 0, 1);
+    for (int ply = 0; ply < kPliesPerGame; ply++) {
+      const auto moves = history.Last().GetBoard().GenerateLegalMoves();
+      if (moves.empty()) break;
+      history.Append(moves[random() % moves.size()]);
+      EncodePositionForNN(history, kMoveHistory,
+                          computation.AddInputInPlace());
+    }
+  }
+
+  std::vector<float> max_inputs(convolutions->size());
+  computation.SetCalibration(&max_inputs);
+  computation.ComputeBlocking();
+  for (size_t i = 0; i < convolutions->size(); i++) {
+    (*convolutions)[i].SetInputRange(max_inputs[i]);
+  }
+  fprintf(stderr,
+          "BLAS, residual tower in int8, calibrated on %d positions.\n",
+          computation.GetBatchSize());
 }
 
 REGISTER_NETWORK("blas", BlasNetwork, 50)
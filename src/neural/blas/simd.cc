@@ -0,0 +1,137 @@
+/*
+ This file is part of Leela Chess Zero.
+ Copyright (C) 2018 The LCZero Authors
+
+ Leela Chess is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ Leela Chess is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "neural/blas/simd.h"
+
+#include <algorithm>
+#include <iterator>
+
+#if defined(LC0_SIMD_X86) && defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace lczero {
+
+namespace {
+
+SimdIsa DetectSimdIsa() {
+#if defined(LC0_SIMD_X86) && defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 0);
+  if (info[0] < 7) return SimdIsa::kScalar;
+  __cpuid(info, 1);
+  // The OS has to save the AVX registers on context switches.
+  const bool osxsave = (info[2] & (1 << 27)) != 0;
+  const bool avx = (info[2] & (1 << 28)) != 0;
+  if (!osxsave || !avx) return SimdIsa::kScalar;
+  const unsigned long long xcr0 = _xgetbv(0);
+  if ((xcr0 & 0x6) != 0x6) return SimdIsa::kScalar;
+  __cpuidex(info, 7, 0);
+  const bool avx2 = (info[1] & (1 << 5)) != 0;
+  const bool avx512f = (info[1] & (1 << 16)) != 0;
+  const bool avx512vnni = (info[2] & (1 << 11)) != 0;
+  if (avx512f && (xcr0 & 0xe6) == 0xe6) {
+    return avx512vnni ? SimdIsa::kAvx512Vnni : SimdIsa::kAvx512;
+  }
+  if (avx2) return SimdIsa::kAvx2;
+  return SimdIsa::kScalar;
+#elif defined(LC0_SIMD_X86)
+  // Also checks that the OS has enabled the registers.
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    return __builtin_cpu_supports("avx512vnni") ? SimdIsa::kAvx512Vnni
+                                                : SimdIsa::kAvx512;
+  }
+  if (__builtin_cpu_supports("avx2")) return SimdIsa::kAvx2;
+  return SimdIsa::kScalar;
+#elif defined(LC0_SIMD_NEON)
+  // Part of every AArch64 CPU, and on 32-bit ARM only enabled when the
+  // compiler targets it anyway.
+  return SimdIsa::kNeon;
+#else
+  return SimdIsa::kScalar;
+#endif
+}
+
+}  // namespace
+
+SimdIsa GetSimdIsa() {
+  static const SimdIsa isa = DetectSimdIsa();
+  return isa;
+}
+
+const char* SimdIsaName(SimdIsa isa) {
+  switch (isa) {
+    case SimdIsa::kScalar:
+      return "scalar";
+    case SimdIsa::kAvx2:
+      return "AVX2";
+    case SimdIsa::kAvx512:
+      return "AVX-512";
+    case SimdIsa::kAvx512Vnni:
+      return "AVX-512 VNNI";
+    case SimdIsa::kNeon:
+      return "NEON";
+  }
+  return "unknown";
+}
+
+const SimdKernels* GetSimdKernels() {
+  switch (GetSimdIsa()) {
+#ifdef LC0_SIMD_X86
+    case SimdIsa::kAvx2:
+      return &kAvx2Kernels;
+    case SimdIsa::kAvx512:
+      return &kAvx512Kernels;
+    case SimdIsa::kAvx512Vnni:
+      return &kAvx512VnniKernels;
+#endif
+#ifdef LC0_SIMD_NEON
+    case SimdIsa::kNeon:
+      return &kNeonKernels;
+#endif
+    default:
+      return nullptr;
+  }
+}
+
+const SimdKernels* GetSimdKernels(size_t channels) {
+  const auto specialized =
+      std::find(std::begin(kSpecializedChannels),
+                std::end(kSpecializedChannels), channels);
+  if (specialized == std::end(kSpecializedChannels)) return GetSimdKernels();
+  const auto index = specialized - std::begin(kSpecializedChannels);
+  switch (GetSimdIsa()) {
+#ifdef LC0_SIMD_X86
+    case SimdIsa::kAvx2:
+      return &kAvx2ChannelKernels[index];
+    case SimdIsa::kAvx512:
+      return &kAvx512ChannelKernels[index];
+    case SimdIsa::kAvx512Vnni:
+      return &kAvx512VnniChannelKernels[index];
+#endif
+#ifdef LC0_SIMD_NEON
+    case SimdIsa::kNeon:
+      return &kNeonChannelKernels[index];
+#endif
+    default:
+      return nullptr;
+  }
+}
+
+}  // namespace lczero
@@ -0,0 +1,108 @@
+/*
+ This file is part of Leela Chess Zero.
+ Copyright (C) 2018 The LCZero Authors
+
+ Leela Chess is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ Leela Chess is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || \
+    defined(_M_IX86)
+#define LC0_SIMD_X86
+#elif defined(__ARM_NEON) || defined(__aarch64__) || defined(_M_ARM64)
+#define LC0_SIMD_NEON
+#endif
+
+namespace lczero {
+
+// Instruction sets that the BLAS backend has hand-vectorized kernels for.
+enum class SimdIsa { kScalar, kAvx2, kAvx512, kAvx512Vnni, kNeon };
+
+// Returns the best instruction set supported by the CPU the binary runs on.
+// Detected once.
+SimdIsa GetSimdIsa();
+
+// Human readable name of the instruction set.
+const char* SimdIsaName(SimdIsa isa);
+
+// Vectorized versions of the loops of the BLAS backend that aren't handled by
+// the BLAS library itself. They return bit-identical results to the scalar
+// code, so that the same binary evaluates the same on every machine.
+struct SimdKernels {
+  // Winograd transforms, see WinogradConvolution3. Require the number of
+  // channels to be a multiple of channel_step.
+  void (*winograd_transform_in)(const size_t batch_size, const float* input,
+                                const size_t channels, float* V);
+  void (*winograd_transform_out)(const size_t batch_size, const float* M,
+                                 const size_t channels, const float* biases,
+                                 const float* eltwise, float* output);
+  // See Batchnorm::Apply.
+  void (*batchnorm)(const size_t batch_size, const size_t channels,
+                    float* data, const float* means, const float* stddivs,
+                    const float* eltwise);
+  // See FullyConnectedLayer::Softmax.
+  void (*softmax)(const size_t size, const float* input, float* output);
+  // See Int8Convolution3. Computes c[n][o] for n < @rows and o < @outputs,
+  // the dot products of rows of @a (7-bit activations, @depth bytes each)
+  // with the packed weights @b of output o. nullptr when there is no
+  // vectorized version.
+  void (*int8_gemm)(const size_t rows, const size_t outputs,
+                    const size_t depth, const uint8_t* a, const int8_t* b,
+                    int32_t* c);
+
+  size_t channel_step;
+};
+
+// Returns the kernels for GetSimdIsa(), or nullptr when the scalar code has
+// to be used.
+const SimdKernels* GetSimdKernels();
+
+// Same, with the loops over channels compiled for exactly @channels when it's
+// one of kSpecializedChannels, so that they have fixed trip counts and
+// strides. Otherwise same as GetSimdKernels().
+const SimdKernels* GetSimdKernels(size_t channels);
+
+// Channel counts of the usual networks: the 32 planes of the heads, the 112
+// input planes, and 64 to 256 filters. All are multiples of every
+// channel_step.
+constexpr size_t kSpecializedChannels[] = {32, 64, 112, 128, 192, 256};
+
+// Initializer of an array of kernels for every count of kSpecializedChannels,
+// from a constexpr function template @make, templated on the count.
+#define LC0_CHANNEL_KERNELS(make)                                          \
+  {                                                                        \
+    make<32>(), make<64>(), make<112>(), make<128>(), make<192>(),         \
+        make<256>()                                                        \
+  }
+
+// Kernels for any number of channels, and arrays of the specialized ones in
+// the order of kSpecializedChannels.
+#ifdef LC0_SIMD_X86
+extern const SimdKernels kAvx2Kernels;
+extern const SimdKernels kAvx2ChannelKernels[];
+extern const SimdKernels kAvx512Kernels;
+extern const SimdKernels kAvx512ChannelKernels[];
+extern const SimdKernels kAvx512VnniKernels;
+extern const SimdKernels kAvx512VnniChannelKernels[];
+#endif
+#ifdef LC0_SIMD_NEON
+extern const SimdKernels kNeonKernels;
+extern const SimdKernels kNeonChannelKernels[];
+#endif
+
+}  // namespace lczero
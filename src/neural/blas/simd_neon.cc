@@ -0,0 +1,274 @@
+/*
+ This file is part of Leela Chess Zero.
+ Copyright (C) 2018 The LCZero Authors
+
+ Leela Chess is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ Leela Chess is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "neural/blas/simd.h"
+
+#ifdef LC0_SIMD_NEON
+
+#include <arm_neon.h>
+
+#include <algorithm>
+#include <cmath>
+
+namespace lczero {
+
+namespace {
+
+constexpr int kWidth = 8;
+constexpr int kHeight = 8;
+constexpr int kSquares = kWidth * kHeight;
+constexpr int kWtiles = (kWidth + 1) / 2;
+constexpr int kTiles = kWtiles * kWtiles;
+constexpr int kWinogradTile = 16;
+
+constexpr size_t kNeonStep = 4;
+
+// The kernels below mirror the scalar code operation by operation (no fused
+// multiply-add, no reordered sums), which keeps the results bit-identical.
+
+// Loads the same square of consecutive channels.
+inline float32x4_t GatherNeon(const float* src) {
+  const float tmp[kNeonStep] = {src[0], src[kSquares], src[2 * kSquares],
+                                src[3 * kSquares]};
+  return vld1q_f32(tmp);
+}
+
+// Stores to the same square of consecutive channels.
+inline void ScatterNeon(float* dst, float32x4_t val) {
+  float tmp[kNeonStep];
+  vst1q_f32(tmp, val);
+  for (size_t i = 0; i < kNeonStep; i++) dst[i * kSquares] = tmp[i];
+}
+
+template <size_t kChannels>
+void WinogradTransformInNeon(const size_t batch_size, const float* input,
+                             const size_t runtime_channels, float* V) {
+  const size_t channels = kChannels ? kChannels : runtime_channels;
+  const float32x4_t zero = vdupq_n_f32(0.0f);
+  const auto V_incr = channels * kTiles * batch_size;
+
+  for (size_t batch_index = 0; batch_index < batch_size; batch_index++) {
+    const float* input_batch = input + batch_index * kSquares * channels;
+    float* V_batch = V + channels * kTiles * batch_index;
+    for (size_t channel = 0; channel < channels; channel += kNeonStep) {
+      const float* input_channel = input_batch + channel * kSquares;
+      for (int block_y = 0; block_y < kWtiles; block_y++) {
+        for (int block_x = 0; block_x < kWtiles; block_x++) {
+          // Tiles overlap by 2
+          const int yin = 2 * block_y - 1;
+          const int xin = 2 * block_x - 1;
+
+          float32x4_t x[4][4];
+          for (int i = 0; i < 4; i++) {
+            for (int j = 0; j < 4; j++) {
+              if ((yin + i) >= 0 && (xin + j) >= 0 && (yin + i) < kHeight &&
+                  (xin + j) < kWidth) {
+                x[i][j] =
+                    GatherNeon(input_channel + (yin + i) * kWidth + (xin + j));
+              } else {
+                x[i][j] = zero;
+              }
+            }
+          }
+
+          // transpose(B).x.B, see WinogradConvolution3::TransformIn().
+          float32x4_t T1[4][4];
+          for (int j = 0; j < 4; j++) {
+            T1[0][j] = vsubq_f32(x[0][j], x[2][j]);
+            T1[1][j] = vaddq_f32(x[1][j], x[2][j]);
+            T1[2][j] = vsubq_f32(x[2][j], x[1][j]);
+            T1[3][j] = vsubq_f32(x[1][j], x[3][j]);
+          }
+
+          float* wTile_V =
+              V_batch + channel + channels * (block_y * kWtiles + block_x);
+          for (int i = 0; i < 4; i++) {
+            vst1q_f32(wTile_V, vsubq_f32(T1[i][0], T1[i][2]));
+            wTile_V += V_incr;
+            vst1q_f32(wTile_V, vaddq_f32(T1[i][1], T1[i][2]));
+            wTile_V += V_incr;
+            vst1q_f32(wTile_V, vsubq_f32(T1[i][2], T1[i][1]));
+            wTile_V += V_incr;
+            vst1q_f32(wTile_V, vsubq_f32(T1[i][1], T1[i][3]));
+            wTile_V += V_incr;
+          }
+        }
+      }
+    }
+  }
+}
+
+template <size_t kChannels>
+void WinogradTransformOutNeon(const size_t batch_size, const float* M,
+                              const size_t runtime_channels,
+                              const float* biases, const float* eltwise,
+                              float* output) {
+  const size_t channels = kChannels ? kChannels : runtime_channels;
+  const float32x4_t zero = vdupq_n_f32(0.0f);
+  const auto M_incr = channels * kTiles * batch_size;
+
+  for (size_t batch_index = 0; batch_index < batch_size; batch_index++) {
+    const float* M_batch = M + channels * kTiles * batch_index;
+    float* output_batch = output + batch_index * kSquares * channels;
+    const float* eltwise_batch =
+        eltwise ? eltwise + batch_index * kSquares * channels : nullptr;
+
+    for (size_t channel = 0; channel < channels; channel += kNeonStep) {
+      float* output_channel = output_batch + channel * kSquares;
+      const float* eltwise_channel =
+          eltwise_batch ? eltwise_batch + channel * kSquares : nullptr;
+      const float32x4_t bias = vld1q_f32(biases + channel);
+
+      for (int block_y = 0; block_y < kWtiles; block_y++) {
+        for (int block_x = 0; block_x < kWtiles; block_x++) {
+          const auto b = block_y * kWtiles + block_x;
+          const float* M_wtile = M_batch + channel + channels * b;
+          float32x4_t m[kWinogradTile];
+          for (int wTile = 0; wTile < kWinogradTile; wTile++) {
+            m[wTile] = vld1q_f32(M_wtile);
+            M_wtile += M_incr;
+          }
+
+          // transpose(A).temp_m.A, see WinogradConvolution3::TransformOut().
+          float32x4_t o[4];
+          o[0] = vaddq_f32(m[0], m[1]);
+          o[0] = vaddq_f32(o[0], m[2]);
+          o[0] = vaddq_f32(o[0], m[4]);
+          o[0] = vaddq_f32(o[0], m[5]);
+          o[0] = vaddq_f32(o[0], m[6]);
+          o[0] = vaddq_f32(o[0], m[8]);
+          o[0] = vaddq_f32(o[0], m[9]);
+          o[0] = vaddq_f32(o[0], m[10]);
+
+          o[1] = vsubq_f32(m[1], m[2]);
+          o[1] = vsubq_f32(o[1], m[3]);
+          o[1] = vaddq_f32(o[1], m[5]);
+          o[1] = vsubq_f32(o[1], m[6]);
+          o[1] = vsubq_f32(o[1], m[7]);
+          o[1] = vaddq_f32(o[1], m[9]);
+          o[1] = vsubq_f32(o[1], m[10]);
+          o[1] = vsubq_f32(o[1], m[11]);
+
+          o[2] = vaddq_f32(m[4], m[5]);
+          o[2] = vaddq_f32(o[2], m[6]);
+          o[2] = vsubq_f32(o[2], m[8]);
+          o[2] = vsubq_f32(o[2], m[9]);
+          o[2] = vsubq_f32(o[2], m[10]);
+          o[2] = vsubq_f32(o[2], m[12]);
+          o[2] = vsubq_f32(o[2], m[13]);
+          o[2] = vsubq_f32(o[2], m[14]);
+
+          o[3] = vsubq_f32(m[5], m[6]);
+          o[3] = vsubq_f32(o[3], m[7]);
+          o[3] = vsubq_f32(o[3], m[9]);
+          o[3] = vaddq_f32(o[3], m[10]);
+          o[3] = vaddq_f32(o[3], m[11]);
+          o[3] = vsubq_f32(o[3], m[13]);
+          o[3] = vaddq_f32(o[3], m[14]);
+          o[3] = vaddq_f32(o[3], m[15]);
+
+          const int x = 2 * block_x;
+          const int y = 2 * block_y;
+          const int squares[4] = {y * kWidth + x, y * kWidth + x + 1,
+                                  (y + 1) * kWidth + x,
+                                  (y + 1) * kWidth + x + 1};
+          for (int k = 0; k < 4; k++) {
+            o[k] = vaddq_f32(o[k], bias);
+            if (eltwise_channel) {
+              o[k] = vaddq_f32(o[k], GatherNeon(eltwise_channel + squares[k]));
+            }
+            ScatterNeon(output_channel + squares[k], vmaxq_f32(o[k], zero));
+          }
+        }
+      }
+    }
+  }
+}
+
+template <size_t kChannels>
+void BatchnormNeon(const size_t batch_size, const size_t runtime_channels,
+                   float* data, const float* means, const float* stddivs,
+                   const float* eltwise) {
+  const size_t channels = kChannels ? kChannels : runtime_channels;
+  const float32x4_t zero = vdupq_n_f32(0.0f);
+  for (size_t i = 0; i < batch_size; i++) {
+    for (size_t c = 0; c < channels; ++c) {
+      const float32x4_t mean = vdupq_n_f32(means[c]);
+      const float32x4_t scale_stddiv = vdupq_n_f32(stddivs[c]);
+      auto arr = &data[c * kSquares];
+      auto res = eltwise ? &eltwise[c * kSquares] : nullptr;
+      for (int b = 0; b < kSquares; b += kNeonStep) {
+        float32x4_t val =
+            vmulq_f32(scale_stddiv, vsubq_f32(vld1q_f32(arr + b), mean));
+        if (res) val = vaddq_f32(vld1q_f32(res + b), val);
+        vst1q_f32(arr + b, vmaxq_f32(val, zero));
+      }
+    }
+    data += channels * kSquares;
+    if (eltwise != nullptr) eltwise += channels * kSquares;
+  }
+}
+
+void SoftmaxNeon(const size_t size, const float* input, float* output) {
+  size_t i = 0;
+  auto alpha = -INFINITY;
+  if (size >= kNeonStep) {
+    float32x4_t max = vld1q_f32(input);
+    for (i = kNeonStep; i + kNeonStep <= size; i += kNeonStep) {
+      max = vmaxq_f32(max, vld1q_f32(input + i));
+    }
+    float tmp[kNeonStep];
+    vst1q_f32(tmp, max);
+    alpha = *std::max_element(tmp, tmp + kNeonStep);
+  }
+  for (; i < size; i++) alpha = std::max(alpha, input[i]);
+
+  // std::exp and the order of the sum are kept from the scalar code.
+  auto denom = 0.0f;
+  for (i = 0; i < size; i++) {
+    auto val = std::exp(input[i] - alpha);
+    output[i] = val;
+    denom += val;
+  }
+
+  i = 0;
+#ifdef __aarch64__
+  // 32-bit NEON has no exact division.
+  const float32x4_t vdenom = vdupq_n_f32(denom);
+  for (; i + kNeonStep <= size; i += kNeonStep) {
+    vst1q_f32(output + i, vdivq_f32(vld1q_f32(output + i), vdenom));
+  }
+#endif
+  for (; i < size; i++) output[i] = output[i] / denom;
+}
+
+template <size_t kChannels>
+constexpr SimdKernels NeonKernels() {
+  return {WinogradTransformInNeon<kChannels>,
+          WinogradTransformOutNeon<kChannels>, BatchnormNeon<kChannels>,
+          SoftmaxNeon, nullptr, kNeonStep};
+}
+
+}  // namespace
+
+const SimdKernels kNeonKernels = NeonKernels<0>();
+const SimdKernels kNeonChannelKernels[] = LC0_CHANNEL_KERNELS(NeonKernels);
+
+}  // namespace lczero
+
+#endif  // LC0_SIMD_NEON
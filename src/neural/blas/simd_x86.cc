@@ -0,0 +1,729 @@
+/*
+ This file is part of Leela Chess Zero.
+ Copyright (C) 2018 The LCZero Authors
+
+ Leela Chess is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ Leela Chess is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "neural/blas/simd.h"
+
+#ifdef LC0_SIMD_X86
+
+#include <immintrin.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__GNUC__)
+#define LC0_TARGET(isa) __attribute__((target(isa)))
+#else
+// MSVC allows any intrinsic without target flags.
+#define LC0_TARGET(isa)
+#endif
+
+#if defined(__GNUC__) && !defined(__clang__)
+// GCC warns about the intentionally undefined start values inside of the
+// AVX-512 intrinsics.
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+namespace lczero {
+
+namespace {
+
+constexpr int kWidth = 8;
+constexpr int kHeight = 8;
+constexpr int kSquares = kWidth * kHeight;
+constexpr int kWtiles = (kWidth + 1) / 2;
+constexpr int kTiles = kWtiles * kWtiles;
+constexpr int kWinogradTile = 16;
+
+// The kernels below mirror the scalar code operation by operation (no FMA,
+// no reordered sums), which keeps the results bit-identical.
+
+/////////////////////////////////////////////////////////////////////////////
+// AVX2
+/////////////////////////////////////////////////////////////////////////////
+
+constexpr size_t kAvx2Step = 8;
+
+// Offsets of the same square in consecutive channels.
+LC0_TARGET("avx2") inline __m256i PlaneOffsetsAvx2() {
+  return _mm256_setr_epi32(0, kSquares, 2 * kSquares, 3 * kSquares,
+                           4 * kSquares, 5 * kSquares, 6 * kSquares,
+                           7 * kSquares);
+}
+
+LC0_TARGET("avx2") inline void ScatterAvx2(float* dst, __m256 val) {
+  alignas(32) float tmp[kAvx2Step];
+  _mm256_store_ps(tmp, val);
+  for (size_t i = 0; i < kAvx2Step; i++) dst[i * kSquares] = tmp[i];
+}
+
+template <size_t kChannels>
+LC0_TARGET("avx2")
+void WinogradTransformInAvx2(const size_t batch_size, const float* input,
+                             const size_t runtime_channels, float* V) {
+  const size_t channels = kChannels ? kChannels : runtime_channels;
+  const __m256i offsets = PlaneOffsetsAvx2();
+  const __m256 zero = _mm256_setzero_ps();
+  const auto V_incr = channels * kTiles * batch_size;
+
+  for (size_t batch_index = 0; batch_index < batch_size; batch_index++) {
+    const float* input_batch = input + batch_index * kSquares * channels;
+    float* V_batch = V + channels * kTiles * batch_index;
+    for (size_t channel = 0; channel < channels; channel += kAvx2Step) {
+      const float* input_channel = input_batch + channel * kSquares;
+      for (int block_y = 0; block_y < kWtiles; block_y++) {
+        for (int block_x = 0; block_x < kWtiles; block_x++) {
+          // Tiles overlap by 2
+          const int yin = 2 * block_y - 1;
+          const int xin = 2 * block_x - 1;
+
+          __m256 x[4][4];
+          for (int i = 0; i < 4; i++) {
+            for (int j = 0; j < 4; j++) {
+              if ((yin + i) >= 0 && (xin + j) >= 0 && (yin + i) < kHeight &&
+                  (xin + j) < kWidth) {
+                x[i][j] = _mm256_i32gather_ps(
+                    input_channel + (yin + i) * kWidth + (xin + j), offsets,
+                    4);
+              } else {
+                x[i][j] = zero;
+              }
+            }
+          }
+
+          // transpose(B).x.B, see WinogradConvolution3::TransformIn().
+          __m256 T1[4][4];
+          for (int j = 0; j < 4; j++) {
+            T1[0][j] = _mm256_sub_ps(x[0][j], x[2][j]);
+            T1[1][j] = _mm256_add_ps(x[1][j], x[2][j]);
+            T1[2][j] = _mm256_sub_ps(x[2][j], x[1][j]);
+            T1[3][j] = _mm256_sub_ps(x[1][j], x[3][j]);
+          }
+
+          float* wTile_V =
+              V_batch + channel + channels * (block_y * kWtiles + block_x);
+          for (int i = 0; i < 4; i++) {
+            _mm256_storeu_ps(wTile_V, _mm256_sub_ps(T1[i][0], T1[i][2]));
+            wTile_V += V_incr;
+            _mm256_storeu_ps(wTile_V, _mm256_add_ps(T1[i][1], T1[i][2]));
+            wTile_V += V_incr;
+            _mm256_storeu_ps(wTile_V, _mm256_sub_ps(T1[i][2], T1[i][1]));
+            wTile_V += V_incr;
+            _mm256_storeu_ps(wTile_V, _mm256_sub_ps(T1[i][1], T1[i][3]));
+            wTile_V += V_incr;
+          }
+        }
+      }
+    }
+  }
+}
+
+template <size_t kChannels>
+LC0_TARGET("avx2")
+void WinogradTransformOutAvx2(const size_t batch_size, const float* M,
+                              const size_t runtime_channels,
+                              const float* biases, const float* eltwise,
+                              float* output) {
+  const size_t channels = kChannels ? kChannels : runtime_channels;
+  const __m256i offsets = PlaneOffsetsAvx2();
+  const __m256 zero = _mm256_setzero_ps();
+  const auto M_incr = channels * kTiles * batch_size;
+
+  for (size_t batch_index = 0; batch_index < batch_size; batch_index++) {
+    const float* M_batch = M + channels * kTiles * batch_index;
+    float* output_batch = output + batch_index * kSquares * channels;
+    const float* eltwise_batch =
+        eltwise ? eltwise + batch_index * kSquares * channels : nullptr;
+
+    for (size_t channel = 0; channel < channels; channel += kAvx2Step) {
+      float* output_channel = output_batch + channel * kSquares;
+      const float* eltwise_channel =
+          eltwise_batch ? eltwise_batch + channel * kSquares : nullptr;
+      const __m256 bias = _mm256_loadu_ps(biases + channel);
+
+      for (int block_y = 0; block_y < kWtiles; block_y++) {
+        for (int block_x = 0; block_x < kWtiles; block_x++) {
+          const auto b = block_y * kWtiles + block_x;
+          const float* M_wtile = M_batch + channel + channels * b;
+          __m256 m[kWinogradTile];
+          for (int wTile = 0; wTile < kWinogradTile; wTile++) {
+            m[wTile] = _mm256_loadu_ps(M_wtile);
+            M_wtile += M_incr;
+          }
+
+          // transpose(A).temp_m.A, see WinogradConvolution3::TransformOut().
+          __m256 o[4];
+          o[0] = _mm256_add_ps(m[0], m[1]);
+          o[0] = _mm256_add_ps(o[0], m[2]);
+          o[0] = _mm256_add_ps(o[0], m[4]);
+          o[0] = _mm256_add_ps(o[0], m[5]);
+          o[0] = _mm256_add_ps(o[0], m[6]);
+          o[0] = _mm256_add_ps(o[0], m[8]);
+          o[0] = _mm256_add_ps(o[0], m[9]);
+          o[0] = _mm256_add_ps(o[0], m[10]);
+
+          o[1] = _mm256_sub_ps(m[1], m[2]);
+          o[1] = _mm256_sub_ps(o[1], m[3]);
+          o[1] = _mm256_add_ps(o[1], m[5]);
+          o[1] = _mm256_sub_ps(o[1], m[6]);
+          o[1] = _mm256_sub_ps(o[1], m[7]);
+          o[1] = _mm256_add_ps(o[1], m[9]);
+          o[1] = _mm256_sub_ps(o[1], m[10]);
+          o[1] = _mm256_sub_ps(o[1], m[11]);
+
+          o[2] = _mm256_add_ps(m[4], m[5]);
+          o[2] = _mm256_add_ps(o[2], m[6]);
+          o[2] = _mm256_sub_ps(o[2], m[8]);
+          o[2] = _mm256_sub_ps(o[2], m[9]);
+          o[2] = _mm256_sub_ps(o[2], m[10]);
+          o[2] = _mm256_sub_ps(o[2], m[12]);
+          o[2] = _mm256_sub_ps(o[2], m[13]);
+          o[2] = _mm256_sub_ps(o[2], m[14]);
+
+          o[3] = _mm256_sub_ps(m[5], m[6]);
+          o[3] = _mm256_sub_ps(o[3], m[7]);
+          o[3] = _mm256_sub_ps(o[3], m[9]);
+          o[3] = _mm256_add_ps(o[3], m[10]);
+          o[3] = _mm256_add_ps(o[3], m[11]);
+          o[3] = _mm256_sub_ps(o[3], m[13]);
+          o[3] = _mm256_add_ps(o[3], m[14]);
+          o[3] = _mm256_add_ps(o[3], m[15]);
+
+          const int x = 2 * block_x;
+          const int y = 2 * block_y;
+          const int squares[4] = {y * kWidth + x, y * kWidth + x + 1,
+                                  (y + 1) * kWidth + x,
+                                  (y + 1) * kWidth + x + 1};
+          for (int k = 0; k < 4; k++) {
+            o[k] = _mm256_add_ps(o[k], bias);
+            if (eltwise_channel) {
+              o[k] = _mm256_add_ps(
+                  o[k], _mm256_i32gather_ps(eltwise_channel + squares[k],
+                                            offsets, 4));
+            }
+            ScatterAvx2(output_channel + squares[k],
+                        _mm256_max_ps(o[k], zero));
+          }
+        }
+      }
+    }
+  }
+}
+
+template <size_t kChannels>
+LC0_TARGET("avx2")
+void BatchnormAvx2(const size_t batch_size, const size_t runtime_channels,
+                   float* data, const float* means, const float* stddivs,
+                   const float* eltwise) {
+  const size_t channels = kChannels ? kChannels : runtime_channels;
+  const __m256 zero = _mm256_setzero_ps();
+  for (size_t i = 0; i < batch_size; i++) {
+    for (size_t c = 0; c < channels; ++c) {
+      const __m256 mean = _mm256_set1_ps(means[c]);
+      const __m256 scale_stddiv = _mm256_set1_ps(stddivs[c]);
+      auto arr = &data[c * kSquares];
+      auto res = eltwise ? &eltwise[c * kSquares] : nullptr;
+      for (int b = 0; b < kSquares; b += kAvx2Step) {
+        __m256 val = _mm256_mul_ps(
+            scale_stddiv, _mm256_sub_ps(_mm256_loadu_ps(arr + b), mean));
+        if (res) val = _mm256_add_ps(_mm256_loadu_ps(res + b), val);
+        _mm256_storeu_ps(arr + b, _mm256_max_ps(val, zero));
+      }
+    }
+    data += channels * kSquares;
+    if (eltwise != nullptr) eltwise += channels * kSquares;
+  }
+}
+
+LC0_TARGET("avx2")
+void SoftmaxAvx2(const size_t size, const float* input, float* output) {
+  size_t i = 0;
+  auto alpha = -INFINITY;
+  if (size >= kAvx2Step) {
+    __m256 max = _mm256_loadu_ps(input);
+    for (i = kAvx2Step; i + kAvx2Step <= size; i += kAvx2Step) {
+      max = _mm256_max_ps(max, _mm256_loadu_ps(input + i));
+    }
+    alignas(32) float tmp[kAvx2Step];
+    _mm256_store_ps(tmp, max);
+    alpha = *std::max_element(tmp, tmp + kAvx2Step);
+  }
+  for (; i < size; i++) alpha = std::max(alpha, input[i]);
+
+  // std::exp and the order of the sum are kept from the scalar code.
+  auto denom = 0.0f;
+  for (i = 0; i < size; i++) {
+    auto val = std::exp(input[i] - alpha);
+    output[i] = val;
+    denom += val;
+  }
+
+  const __m256 vdenom = _mm256_set1_ps(denom);
+  for (i = 0; i + kAvx2Step <= size; i += kAvx2Step) {
+    _mm256_storeu_ps(output + i,
+                     _mm256_div_ps(_mm256_loadu_ps(output + i), vdenom));
+  }
+  for (; i < size; i++) output[i] = output[i] / denom;
+}
+
+// Packed int8 weights come in blocks of kInt8Lanes outputs, see
+// Int8Convolution3. The activations are at most 127, so the 16-bit sums of
+// _mm256_maddubs_epi16() can't saturate.
+constexpr size_t kInt8Lanes = 16;
+
+inline int32_t LoadInt8Quad(const uint8_t* a) {
+  int32_t result;
+  std::memcpy(&result, a, sizeof(result));
+  return result;
+}
+
+// c[n][o] += a[n] . b[o] over 4 bytes, for 16 outputs in two halves.
+#define LC0_INT8_MADD_AVX2(acc0, acc1, av, w0, w1)                        \
+  acc0 = _mm256_add_epi32(                                                \
+      acc0, _mm256_madd_epi16(_mm256_maddubs_epi16(av, w0), ones));       \
+  acc1 = _mm256_add_epi32(                                                \
+      acc1, _mm256_madd_epi16(_mm256_maddubs_epi16(av, w1), ones))
+
+// 4 rows of one block of outputs.
+LC0_TARGET("avx2")
+void Int8GemmBlock4Avx2(const size_t outputs, const size_t depth,
+                        const uint8_t* a, const int8_t* b, int32_t* c) {
+  const __m256i ones = _mm256_set1_epi16(1);
+  __m256i c00 = _mm256_setzero_si256(), c01 = _mm256_setzero_si256();
+  __m256i c10 = _mm256_setzero_si256(), c11 = _mm256_setzero_si256();
+  __m256i c20 = _mm256_setzero_si256(), c21 = _mm256_setzero_si256();
+  __m256i c30 = _mm256_setzero_si256(), c31 = _mm256_setzero_si256();
+  for (size_t k = 0; k < depth; k += 4) {
+    const auto w = reinterpret_cast<const __m256i*>(b + k * kInt8Lanes);
+    const __m256i w0 = _mm256_loadu_si256(w);
+    const __m256i w1 = _mm256_loadu_si256(w + 1);
+    __m256i av = _mm256_set1_epi32(LoadInt8Quad(a + k));
+    LC0_INT8_MADD_AVX2(c00, c01, av, w0, w1);
+    av = _mm256_set1_epi32(LoadInt8Quad(a + depth + k));
+    LC0_INT8_MADD_AVX2(c10, c11, av, w0, w1);
+    av = _mm256_set1_epi32(LoadInt8Quad(a + 2 * depth + k));
+    LC0_INT8_MADD_AVX2(c20, c21, av, w0, w1);
+    av = _mm256_set1_epi32(LoadInt8Quad(a + 3 * depth + k));
+    LC0_INT8_MADD_AVX2(c30, c31, av, w0, w1);
+  }
+  const auto out = reinterpret_cast<__m256i*>(c);
+  const auto stride = outputs / 8;
+  _mm256_storeu_si256(out, c00);
+  _mm256_storeu_si256(out + 1, c01);
+  _mm256_storeu_si256(out + stride, c10);
+  _mm256_storeu_si256(out + stride + 1, c11);
+  _mm256_storeu_si256(out + 2 * stride, c20);
+  _mm256_storeu_si256(out + 2 * stride + 1, c21);
+  _mm256_storeu_si256(out + 3 * stride, c30);
+  _mm256_storeu_si256(out + 3 * stride + 1, c31);
+}
+
+// One row of one block of outputs.
+LC0_TARGET("avx2")
+void Int8GemmBlock1Avx2(const size_t depth, const uint8_t* a, const int8_t* b,
+                        int32_t* c) {
+  const __m256i ones = _mm256_set1_epi16(1);
+  __m256i c00 = _mm256_setzero_si256(), c01 = _mm256_setzero_si256();
+  for (size_t k = 0; k < depth; k += 4) {
+    const auto w = reinterpret_cast<const __m256i*>(b + k * kInt8Lanes);
+    const __m256i w0 = _mm256_loadu_si256(w);
+    const __m256i w1 = _mm256_loadu_si256(w + 1);
+    const __m256i av = _mm256_set1_epi32(LoadInt8Quad(a + k));
+    LC0_INT8_MADD_AVX2(c00, c01, av, w0, w1);
+  }
+  const auto out = reinterpret_cast<__m256i*>(c);
+  _mm256_storeu_si256(out, c00);
+  _mm256_storeu_si256(out + 1, c01);
+}
+
+#undef LC0_INT8_MADD_AVX2
+
+LC0_TARGET("avx2")
+void Int8GemmAvx2(const size_t rows, const size_t outputs, const size_t depth,
+                  const uint8_t* a, const int8_t* b, int32_t* c) {
+  for (size_t o = 0; o < outputs; o += kInt8Lanes) {
+    const int8_t* b_block = b + o * depth;
+    size_t n = 0;
+    for (; n + 4 <= rows; n += 4) {
+      Int8GemmBlock4Avx2(outputs, depth, a + n * depth, b_block,
+                         c + n * outputs + o);
+    }
+    for (; n < rows; n++) {
+      Int8GemmBlock1Avx2(depth, a + n * depth, b_block, c + n * outputs + o);
+    }
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// AVX-512
+/////////////////////////////////////////////////////////////////////////////
+
+constexpr size_t kAvx512Step = 16;
+
+LC0_TARGET("avx512f") inline __m512i PlaneOffsetsAvx512() {
+  return _mm512_mullo_epi32(
+      _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15),
+      _mm512_set1_epi32(kSquares));
+}
+
+template <size_t kChannels>
+LC0_TARGET("avx512f")
+void WinogradTransformInAvx512(const size_t batch_size, const float* input,
+                               const size_t runtime_channels, float* V) {
+  const size_t channels = kChannels ? kChannels : runtime_channels;
+  const __m512i offsets = PlaneOffsetsAvx512();
+  const __m512 zero = _mm512_setzero_ps();
+  const auto V_incr = channels * kTiles * batch_size;
+
+  for (size_t batch_index = 0; batch_index < batch_size; batch_index++) {
+    const float* input_batch = input + batch_index * kSquares * channels;
+    float* V_batch = V + channels * kTiles * batch_index;
+    for (size_t channel = 0; channel < channels; channel += kAvx512Step) {
+      const float* input_channel = input_batch + channel * kSquares;
+      for (int block_y = 0; block_y < kWtiles; block_y++) {
+        for (int block_x = 0; block_x < kWtiles; block_x++) {
+          // Tiles overlap by 2
+          const int yin = 2 * block_y - 1;
+          const int xin = 2 * block_x - 1;
+
+          __m512 x[4][4];
+          for (int i = 0; i < 4; i++) {
+            for (int j = 0; j < 4; j++) {
+              if ((yin + i) >= 0 && (xin + j) >= 0 && (yin + i) < kHeight &&
+                  (xin + j) < kWidth) {
+                x[i][j] = _mm512_i32gather_ps(
+                    offsets, input_channel + (yin + i) * kWidth + (xin + j),
+                    4);
+              } else {
+                x[i][j] = zero;
+              }
+            }
+          }
+
+          __m512 T1[4][4];
+          for (int j = 0; j < 4; j++) {
+            T1[0][j] = _mm512_sub_ps(x[0][j], x[2][j]);
+            T1[1][j] = _mm512_add_ps(x[1][j], x[2][j]);
+            T1[2][j] = _mm512_sub_ps(x[2][j], x[1][j]);
+            T1[3][j] = _mm512_sub_ps(x[1][j], x[3][j]);
+          }
+
+          float* wTile_V =
+              V_batch + channel + channels * (block_y * kWtiles + block_x);
+          for (int i = 0; i < 4; i++) {
+            _mm512_storeu_ps(wTile_V, _mm512_sub_ps(T1[i][0], T1[i][2]));
+            wTile_V += V_incr;
+            _mm512_storeu_ps(wTile_V, _mm512_add_ps(T1[i][1], T1[i][2]));
+            wTile_V += V_incr;
+            _mm512_storeu_ps(wTile_V, _mm512_sub_ps(T1[i][2], T1[i][1]));
+            wTile_V += V_incr;
+            _mm512_storeu_ps(wTile_V, _mm512_sub_ps(T1[i][1], T1[i][3]));
+            wTile_V += V_incr;
+          }
+        }
+      }
+    }
+  }
+}
+
+template <size_t kChannels>
+LC0_TARGET("avx512f")
+void WinogradTransformOutAvx512(const size_t batch_size, const float* M,
+                                const size_t runtime_channels,
+                                const float* biases, const float* eltwise,
+                                float* output) {
+  const size_t channels = kChannels ? kChannels : runtime_channels;
+  const __m512i offsets = PlaneOffsetsAvx512();
+  const __m512 zero = _mm512_setzero_ps();
+  const auto M_incr = channels * kTiles * batch_size;
+
+  for (size_t batch_index = 0; batch_index < batch_size; batch_index++) {
+    const float* M_batch = M + channels * kTiles * batch_index;
+    float* output_batch = output + batch_index * kSquares * channels;
+    const float* eltwise_batch =
+        eltwise ? eltwise + batch_index * kSquares * channels : nullptr;
+
+    for (size_t channel = 0; channel < channels; channel += kAvx512Step) {
+      float* output_channel = output_batch + channel * kSquares;
+      const float* eltwise_channel =
+          eltwise_batch ? eltwise_batch + channel * kSquares : nullptr;
+      const __m512 bias = _mm512_loadu_ps(biases + channel);
+
+      for (int block_y = 0; block_y < kWtiles; block_y++) {
+        for (int block_x = 0; block_x < kWtiles; block_x++) {
+          const auto b = block_y * kWtiles + block_x;
+          const float* M_wtile = M_batch + channel + channels * b;
+          __m512 m[kWinogradTile];
+          for (int wTile = 0; wTile < kWinogradTile; wTile++) {
+            m[wTile] = _mm512_loadu_ps(M_wtile);
+            M_wtile += M_incr;
+          }
+
+          __m512 o[4];
+          o[0] = _mm512_add_ps(m[0], m[1]);
+          o[0] = _mm512_add_ps(o[0], m[2]);
+          o[0] = _mm512_add_ps(o[0], m[4]);
+          o[0] = _mm512_add_ps(o[0], m[5]);
+          o[0] = _mm512_add_ps(o[0], m[6]);
+          o[0] = _mm512_add_ps(o[0], m[8]);
+          o[0] = _mm512_add_ps(o[0], m[9]);
+          o[0] = _mm512_add_ps(o[0], m[10]);
+
+          o[1] = _mm512_sub_ps(m[1], m[2]);
+          o[1] = _mm512_sub_ps(o[1], m[3]);
+          o[1] = _mm512_add_ps(o[1], m[5]);
+          o[1] = _mm512_sub_ps(o[1], m[6]);
+          o[1] = _mm512_sub_ps(o[1], m[7]);
+          o[1] = _mm512_add_ps(o[1], m[9]);
+          o[1] = _mm512_sub_ps(o[1], m[10]);
+          o[1] = _mm512_sub_ps(o[1], m[11]);
+
+          o[2] = _mm512_add_ps(m[4], m[5]);
+          o[2] = _mm512_add_ps(o[2], m[6]);
+          o[2] = _mm512_sub_ps(o[2], m[8]);
+          o[2] = _mm512_sub_ps(o[2], m[9]);
+          o[2] = _mm512_sub_ps(o[2], m[10]);
+          o[2] = _mm512_sub_ps(o[2], m[12]);
+          o[2] = _mm512_sub_ps(o[2], m[13]);
+          o[2] = _mm512_sub_ps(o[2], m[14]);
+
+          o[3] = _mm512_sub_ps(m[5], m[6]);
+          o[3] = _mm512_sub_ps(o[3], m[7]);
+          o[3] = _mm512_sub_ps(o[3], m[9]);
+          o[3] = _mm512_add_ps(o[3], m[10]);
+          o[3] = _mm512_add_ps(o[3], m[11]);
+          o[3] = _mm512_sub_ps(o[3], m[13]);
+          o[3] = _mm512_add_ps(o[3], m[14]);
+          o[3] = _mm512_add_ps(o[3], m[15]);
+
+          const int x = 2 * block_x;
+          const int y = 2 * block_y;
+          const int squares[4] = {y * kWidth + x, y * kWidth + x + 1,
+                                  (y + 1) * kWidth + x,
+                                  (y + 1) * kWidth + x + 1};
+          for (int k = 0; k < 4; k++) {
+            o[k] = _mm512_add_ps(o[k], bias);
+            if (eltwise_channel) {
+              o[k] = _mm512_add_ps(
+                  o[k], _mm512_i32gather_ps(offsets,
+                                            eltwise_channel + squares[k], 4));
+            }
+            _mm512_i32scatter_ps(output_channel + squares[k], offsets,
+                                 _mm512_max_ps(o[k], zero), 4);
+          }
+        }
+      }
+    }
+  }
+}
+
+template <size_t kChannels>
+LC0_TARGET("avx512f")
+void BatchnormAvx512(const size_t batch_size, const size_t runtime_channels,
+                     float* data, const float* means, const float* stddivs,
+                     const float* eltwise) {
+  const size_t channels = kChannels ? kChannels : runtime_channels;
+  const __m512 zero = _mm512_setzero_ps();
+  for (size_t i = 0; i < batch_size; i++) {
+    for (size_t c = 0; c < channels; ++c) {
+      const __m512 mean = _mm512_set1_ps(means[c]);
+      const __m512 scale_stddiv = _mm512_set1_ps(stddivs[c]);
+      auto arr = &data[c * kSquares];
+      auto res = eltwise ? &eltwise[c * kSquares] : nullptr;
+      for (int b = 0; b < kSquares; b += kAvx512Step) {
+        __m512 val = _mm512_mul_ps(
+            scale_stddiv, _mm512_sub_ps(_mm512_loadu_ps(arr + b), mean));
+        if (res) val = _mm512_add_ps(_mm512_loadu_ps(res + b), val);
+        _mm512_storeu_ps(arr + b, _mm512_max_ps(val, zero));
+      }
+    }
+    data += channels * kSquares;
+    if (eltwise != nullptr) eltwise += channels * kSquares;
+  }
+}
+
+LC0_TARGET("avx512f")
+void SoftmaxAvx512(const size_t size, const float* input, float* output) {
+  size_t i = 0;
+  auto alpha = -INFINITY;
+  if (size >= kAvx512Step) {
+    __m512 max = _mm512_loadu_ps(input);
+    for (i = kAvx512Step; i + kAvx512Step <= size; i += kAvx512Step) {
+      max = _mm512_max_ps(max, _mm512_loadu_ps(input + i));
+    }
+    alpha = _mm512_reduce_max_ps(max);
+  }
+  for (; i < size; i++) alpha = std::max(alpha, input[i]);
+
+  auto denom = 0.0f;
+  for (i = 0; i < size; i++) {
+    auto val = std::exp(input[i] - alpha);
+    output[i] = val;
+    denom += val;
+  }
+
+  const __m512 vdenom = _mm512_set1_ps(denom);
+  for (i = 0; i + kAvx512Step <= size; i += kAvx512Step) {
+    _mm512_storeu_ps(output + i,
+                     _mm512_div_ps(_mm512_loadu_ps(output + i), vdenom));
+  }
+  for (; i < size; i++) output[i] = output[i] / denom;
+}
+
+// 4 rows of 4 blocks of outputs. Each weight is loaded once for the 4 rows,
+// and each activation once for the 4 blocks.
+LC0_TARGET("avx512f,avx512vnni")
+void Int8GemmBlock4x4Avx512Vnni(const size_t outputs, const size_t depth,
+                                const uint8_t* a, const int8_t* b,
+                                int32_t* c) {
+  const size_t block = kInt8Lanes * depth;
+  __m512i c00 = _mm512_setzero_si512(), c01 = _mm512_setzero_si512();
+  __m512i c02 = _mm512_setzero_si512(), c03 = _mm512_setzero_si512();
+  __m512i c10 = _mm512_setzero_si512(), c11 = _mm512_setzero_si512();
+  __m512i c12 = _mm512_setzero_si512(), c13 = _mm512_setzero_si512();
+  __m512i c20 = _mm512_setzero_si512(), c21 = _mm512_setzero_si512();
+  __m512i c22 = _mm512_setzero_si512(), c23 = _mm512_setzero_si512();
+  __m512i c30 = _mm512_setzero_si512(), c31 = _mm512_setzero_si512();
+  __m512i c32 = _mm512_setzero_si512(), c33 = _mm512_setzero_si512();
+  for (size_t k = 0; k < depth; k += 4) {
+    const int8_t* w = b + k * kInt8Lanes;
+    const __m512i w0 = _mm512_loadu_si512(w);
+    const __m512i w1 = _mm512_loadu_si512(w + block);
+    const __m512i w2 = _mm512_loadu_si512(w + 2 * block);
+    const __m512i w3 = _mm512_loadu_si512(w + 3 * block);
+    __m512i av = _mm512_set1_epi32(LoadInt8Quad(a + k));
+    c00 = _mm512_dpbusd_epi32(c00, av, w0);
+    c01 = _mm512_dpbusd_epi32(c01, av, w1);
+    c02 = _mm512_dpbusd_epi32(c02, av, w2);
+    c03 = _mm512_dpbusd_epi32(c03, av, w3);
+    av = _mm512_set1_epi32(LoadInt8Quad(a + depth + k));
+    c10 = _mm512_dpbusd_epi32(c10, av, w0);
+    c11 = _mm512_dpbusd_epi32(c11, av, w1);
+    c12 = _mm512_dpbusd_epi32(c12, av, w2);
+    c13 = _mm512_dpbusd_epi32(c13, av, w3);
+    av = _mm512_set1_epi32(LoadInt8Quad(a + 2 * depth + k));
+    c20 = _mm512_dpbusd_epi32(c20, av, w0);
+    c21 = _mm512_dpbusd_epi32(c21, av, w1);
+    c22 = _mm512_dpbusd_epi32(c22, av, w2);
+    c23 = _mm512_dpbusd_epi32(c23, av, w3);
+    av = _mm512_set1_epi32(LoadInt8Quad(a + 3 * depth + k));
+    c30 = _mm512_dpbusd_epi32(c30, av, w0);
+    c31 = _mm512_dpbusd_epi32(c31, av, w1);
+    c32 = _mm512_dpbusd_epi32(c32, av, w2);
+    c33 = _mm512_dpbusd_epi32(c33, av, w3);
+  }
+  int32_t* out = c;
+  _mm512_storeu_si512(out, c00);
+  _mm512_storeu_si512(out + kInt8Lanes, c01);
+  _mm512_storeu_si512(out + 2 * kInt8Lanes, c02);
+  _mm512_storeu_si512(out + 3 * kInt8Lanes, c03);
+  out += outputs;
+  _mm512_storeu_si512(out, c10);
+  _mm512_storeu_si512(out + kInt8Lanes, c11);
+  _mm512_storeu_si512(out + 2 * kInt8Lanes, c12);
+  _mm512_storeu_si512(out + 3 * kInt8Lanes, c13);
+  out += outputs;
+  _mm512_storeu_si512(out, c20);
+  _mm512_storeu_si512(out + kInt8Lanes, c21);
+  _mm512_storeu_si512(out + 2 * kInt8Lanes, c22);
+  _mm512_storeu_si512(out + 3 * kInt8Lanes, c23);
+  out += outputs;
+  _mm512_storeu_si512(out, c30);
+  _mm512_storeu_si512(out + kInt8Lanes, c31);
+  _mm512_storeu_si512(out + 2 * kInt8Lanes, c32);
+  _mm512_storeu_si512(out + 3 * kInt8Lanes, c33);
+}
+
+// One row of one block of outputs.
+LC0_TARGET("avx512f,avx512vnni")
+void Int8GemmBlock1Avx512Vnni(const size_t depth, const uint8_t* a,
+                              const int8_t* b, int32_t* c) {
+  __m512i acc = _mm512_setzero_si512();
+  for (size_t k = 0; k < depth; k += 4) {
+    const __m512i av = _mm512_set1_epi32(LoadInt8Quad(a + k));
+    acc = _mm512_dpbusd_epi32(acc, av, _mm512_loadu_si512(b + k * kInt8Lanes));
+  }
+  _mm512_storeu_si512(c, acc);
+}
+
+LC0_TARGET("avx512f,avx512vnni")
+void Int8GemmAvx512Vnni(const size_t rows, const size_t outputs,
+                        const size_t depth, const uint8_t* a,
+                        const int8_t* b, int32_t* c) {
+  constexpr size_t kBlocks = 4;
+  size_t o = 0;
+  size_t n = 0;
+  for (; o + kBlocks * kInt8Lanes <= outputs; o += kBlocks * kInt8Lanes) {
+    for (n = 0; n + 4 <= rows; n += 4) {
+      Int8GemmBlock4x4Avx512Vnni(outputs, depth, a + n * depth, b + o * depth,
+                                 c + n * outputs + o);
+    }
+    for (; n < rows; n++) {
+      for (size_t i = 0; i < kBlocks; i++) {
+        const auto block_o = o + i * kInt8Lanes;
+        Int8GemmBlock1Avx512Vnni(depth, a + n * depth, b + block_o * depth,
+                                 c + n * outputs + block_o);
+      }
+    }
+  }
+  for (; o < outputs; o += kInt8Lanes) {
+    for (n = 0; n < rows; n++) {
+      Int8GemmBlock1Avx512Vnni(depth, a + n * depth, b + o * depth,
+                               c + n * outputs + o);
+    }
+  }
+}
+
+template <size_t kChannels>
+constexpr SimdKernels Avx2Kernels() {
+  return {WinogradTransformInAvx2<kChannels>,
+          WinogradTransformOutAvx2<kChannels>, BatchnormAvx2<kChannels>,
+          SoftmaxAvx2, Int8GemmAvx2, kAvx2Step};
+}
+
+// AVX-512 without VNNI has no faster int8 multiply than AVX2.
+template <size_t kChannels>
+constexpr SimdKernels Avx512Kernels() {
+  return {WinogradTransformInAvx512<kChannels>,
+          WinogradTransformOutAvx512<kChannels>, BatchnormAvx512<kChannels>,
+          SoftmaxAvx512, Int8GemmAvx2, kAvx512Step};
+}
+
+template <size_t kChannels>
+constexpr SimdKernels Avx512VnniKernels() {
+  return {WinogradTransformInAvx512<kChannels>,
+          WinogradTransformOutAvx512<kChannels>, BatchnormAvx512<kChannels>,
+          SoftmaxAvx512, Int8GemmAvx512Vnni, kAvx512Step};
+}
+
+}  // namespace
+
+const SimdKernels kAvx2Kernels = Avx2Kernels<0>();
+const SimdKernels kAvx2ChannelKernels[] = LC0_CHANNEL_KERNELS(Avx2Kernels);
+
+const SimdKernels kAvx512Kernels = Avx512Kernels<0>();
+const SimdKernels kAvx512ChannelKernels[] =
+    LC0_CHANNEL_KERNELS(Avx512Kernels);
+
+const SimdKernels kAvx512VnniKernels = Avx512VnniKernels<0>();
+const SimdKernels kAvx512VnniChannelKernels[] =
+    LC0_CHANNEL_KERNELS(Avx512VnniKernels);
+
+}  // namespace lczero
+
+#endif  // LC0_SIMD_X86
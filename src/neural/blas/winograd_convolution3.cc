@@ -17,7 +17,9 @@
  */
 
 #include "neural/blas/winograd_convolution3.h"
+#include "neural/blas/bf16.h"
 #include "neural/blas/blas.h"
+#include "neural/blas/simd.h"
 
 #include <algorithm>
 #include <cassert>
@@ -102,10 +104,22 @@ void WinogradConvolution3::Forward(const size_t batch_size,
                                    const size_t input_channels,
                                    const size_t output_channels,
                                    const float* input, const float* weights,
+                                   const float* biases, const float* eltwise,
                                    float* output) {
   TransformIn(batch_size, input, input_channels);
   Sgemm(batch_size, weights, input_channels, output_channels);
-  TransformOut(batch_size, output, output_channels);
+  TransformOut(batch_size, biases, eltwise, output, output_channels);
+}
+
+void WinogradConvolution3::Forward(const size_t batch_size,
+                                   const size_t input_channels,
+                                   const size_t output_channels,
+                                   const float* input, const uint16_t* weights,
+                                   const float* biases, const float* eltwise,
+                                   float* output) {
+  TransformIn(batch_size, input, input_channels);
+  SgemmBf16(batch_size, weights, input_channels, output_channels);
+  TransformOut(batch_size, biases, eltwise, output, output_channels);
 }
 
 
@@ -115,6 +129,12 @@ void WinogradConvolution3::TransformIn(const size_t batch_size,
                                        const size_t channels) {
 #ifndef USE_ISPC
 
+  const auto simd = GetSimdKernels(channels);
+  if (simd && channels % simd->channel_step == 0) {
+    simd->winograd_transform_in(batch_size, input, channels, &V_[0]);
+    return;
+  }
+
   static const size_t kCacheSize = 128;
   float x[kWinogradAlpha][kWinogradAlpha];
   float T1[kWinogradAlpha][kWinogradAlpha];
@@ -293,20 +313,55 @@ void WinogradConvolution3::Sgemm(const size_t batch_size, const float* weights,
 #endif
 }
 
+void WinogradConvolution3::SgemmBf16(const size_t batch_size,
+                                     const uint16_t* weights,
+                                     const size_t input_channels,
+                                     const size_t output_channels) {
+  const auto weights_size = output_channels * input_channels;
+  if (U_.size() < weights_size) U_.resize(weights_size);
 
-void WinogradConvolution3::TransformOut(const size_t batch_size, float* output,
+  for (size_t b = 0; b < kWinogradTile; b++) {
+    auto offset_v = b * batch_size * input_channels * kTiles;
+    auto offset_m = b * batch_size * output_channels * kTiles;
+
+    Bf16::ToFloat(weights_size, &weights[b * weights_size], U_.data());
+    cblas_sgemm(CblasColMajor, CblasNoTrans, CblasNoTrans,
+                (int)output_channels, (int)(batch_size * kTiles),
+                (int)input_channels, 1.0f, U_.data(), (int)output_channels,
+                &V_[offset_v], (int)input_channels, 0.0f, &M_[offset_m],
+                (int)output_channels);
+  }
+}
+
+
+void WinogradConvolution3::TransformOut(const size_t batch_size,
+                                        const float* biases,
+                                        const float* eltwise, float* output,
                                         const size_t channels) {
 #ifndef USE_ISPC
 
+  const auto simd = GetSimdKernels(channels);
+  if (simd && channels % simd->channel_step == 0) {
+    simd->winograd_transform_out(batch_size, &M_[0], channels, biases, eltwise,
+                                 output);
+    return;
+  }
+
   float m[kWinogradTile];
 
   for (size_t batch_index = 0; batch_index < batch_size; batch_index++) {
     const float* M_batch = &M_[channels * kTiles * batch_index];
     float* output_batch = output + batch_index * kWidth * kHeight * channels;
+    const float* eltwise_batch =
+        eltwise ? eltwise + batch_index * kWidth * kHeight * channels : nullptr;
 
     for (size_t channel = 0; channel < channels; channel++) {
       const float* M_channel = M_batch + channel;
       float* output_channel = output_batch + channel * (kHeight * kWidth);
+      const float* eltwise_channel =
+          eltwise_batch ? eltwise_batch + channel * (kHeight * kWidth)
+                        : nullptr;
+      const float bias = biases[channel];
 
       for (int block_x = 0; block_x < kWtiles; block_x++) {
         for (int block_y = 0; block_y < kWtiles; block_y++) {
@@ -344,10 +399,21 @@ void WinogradConvolution3::TransformOut(const size_t batch_size, float* output,
                      m[2 * 4 + 2] + m[2 * 4 + 3] - m[3 * 4 + 1] + m[3 * 4 + 2] +
                      m[3 * 4 + 3];
 
-          output_channel[(y)*kWidth + (x)] = o11;
-          output_channel[(y)*kWidth + (x + 1)] = o12;
-          output_channel[(y + 1) * kWidth + (x)] = o21;
-          output_channel[(y + 1) * kWidth + (x + 1)] = o22;
+          o11 += bias;
+          o12 += bias;
+          o21 += bias;
+          o22 += bias;
+          if (eltwise_channel) {
+            o11 += eltwise_channel[(y)*kWidth + (x)];
+            o12 += eltwise_channel[(y)*kWidth + (x + 1)];
+            o21 += eltwise_channel[(y + 1) * kWidth + (x)];
+            o22 += eltwise_channel[(y + 1) * kWidth + (x + 1)];
+          }
+
+          output_channel[(y)*kWidth + (x)] = o11 > 0 ? o11 : 0;
+          output_channel[(y)*kWidth + (x + 1)] = o12 > 0 ? o12 : 0;
+          output_channel[(y + 1) * kWidth + (x)] = o21 > 0 ? o21 : 0;
+          output_channel[(y + 1) * kWidth + (x + 1)] = o22 > 0 ? o22 : 0;
         }
       }
     }
@@ -355,7 +421,8 @@ void WinogradConvolution3::TransformOut(const size_t batch_size, float* output,
 
 #else // USE_ISPC
 
-  ispc::winograd_TransformOut_ispc( batch_size, &M_[0],channels,output);
+  ispc::winograd_TransformOut_ispc(batch_size, &M_[0], channels, biases,
+                                   eltwise, output);
 
 #endif // USE_ISPC
 }
@@ -19,6 +19,7 @@
 #pragma once
 
 #include <cstddef>
+#include <cstdint>
 #include <vector>
 
 namespace lczero {
@@ -55,10 +56,21 @@ class WinogradConvolution3 {
                                        const size_t outputs,
                                        const size_t channels);
 
-  // Forward inference, batched.
+  // Forward inference, batched. Adds @biases to the result, and @eltwise (of
+  // the same size as @output) unless it's nullptr, and then applies ReLU, all
+  // while transforming the output.
   void Forward(const size_t batch_size, const size_t input_channels,
                const size_t output_channels, const float* input,
-               const float* weights, float* output);
+               const float* weights, const float* biases,
+               const float* eltwise, float* output);
+
+  // Same with the transformed weights in bf16, see Bf16. Each of the
+  // kWinogradTile weight matrices is converted to fp32 right before its
+  // SGEMM, so only half as much has to come from memory.
+  void Forward(const size_t batch_size, const size_t input_channels,
+               const size_t output_channels, const float* input,
+               const uint16_t* weights, const float* biases,
+               const float* eltwise, float* output);
 
  private:
   void TransformIn(const size_t batch_size, const float* input,
@@ -67,7 +79,11 @@ class WinogradConvolution3 {
   void Sgemm(const size_t batch_size, const float* weights,
              const size_t input_channels, const size_t output_channels);
 
-  void TransformOut(const size_t batch_size, float* output,
+  void SgemmBf16(const size_t batch_size, const uint16_t* weights,
+                 const size_t input_channels, const size_t output_channels);
+
+  void TransformOut(const size_t batch_size, const float* biases,
+                    const float* eltwise, float* output,
                     const size_t channels);
 
   static constexpr auto kWidth = 8;
@@ -82,5 +98,7 @@ class WinogradConvolution3 {
 
   std::vector<float> V_;
   std::vector<float> M_;
+  // One weight matrix in fp32, for SgemmBf16().
+  std::vector<float> U_;
 };
 }
@@ -0,0 +1,358 @@
+/*
+ This file is part of Leela Chess Zero.
+ Copyright (C) 2018 The LCZero Authors
+
+ Leela Chess is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ Leela Chess is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "neural/blas/winograd_convolution3_f4.h"
+#include "neural/blas/bf16.h"
+#include "neural/blas/blas.h"
+
+#include <algorithm>
+#include <array>
+
+namespace lczero {
+
+namespace {
+
+// F(4x4, 3x3) transformation matrices.
+//
+// transpose(B) = [[4,  0, -5,  0, 1, 0],
+//                 [0, -4, -4,  1, 1, 0],
+//                 [0,  4, -4, -1, 1, 0],
+//                 [0, -2, -1,  2, 1, 0],
+//                 [0,  2, -1, -2, 1, 0],
+//                 [0,  4,  0, -5, 0, 1]]
+//
+// transpose(A) = [[1, 1,  1, 1,  1, 0],
+//                 [0, 1, -1, 2, -2, 0],
+//                 [0, 1,  1, 4,  4, 0],
+//                 [0, 1, -1, 8, -8, 1]]
+
+// Number of channels transformed together. The transforms work on arrays of
+// that many channels, which the compiler can vectorize.
+constexpr size_t kChannelStep = 16;
+
+// Multiplies transpose(B) by a column of 6 rows of channels, @stride floats
+// apart.
+inline void TransformInColumn(const float* in, const size_t stride, float* out,
+                              const size_t out_stride) {
+  for (size_t ch = 0; ch < kChannelStep; ch++) {
+    const float d0 = in[0 * stride + ch];
+    const float d1 = in[1 * stride + ch];
+    const float d2 = in[2 * stride + ch];
+    const float d3 = in[3 * stride + ch];
+    const float d4 = in[4 * stride + ch];
+    const float d5 = in[5 * stride + ch];
+    out[0 * out_stride + ch] = 4.0f * d0 - 5.0f * d2 + d4;
+    out[1 * out_stride + ch] = -4.0f * d1 - 4.0f * d2 + d3 + d4;
+    out[2 * out_stride + ch] = 4.0f * d1 - 4.0f * d2 - d3 + d4;
+    out[3 * out_stride + ch] = -2.0f * d1 - d2 + 2.0f * d3 + d4;
+    out[4 * out_stride + ch] = 2.0f * d1 - d2 - 2.0f * d3 + d4;
+    out[5 * out_stride + ch] = 4.0f * d1 - 5.0f * d3 + d5;
+  }
+}
+
+// Multiplies transpose(A) by a column of 6 rows of channels, @stride floats
+// apart.
+inline void TransformOutColumn(const float* in, const size_t stride,
+                               float* out, const size_t out_stride) {
+  for (size_t ch = 0; ch < kChannelStep; ch++) {
+    const float m0 = in[0 * stride + ch];
+    const float m1 = in[1 * stride + ch];
+    const float m2 = in[2 * stride + ch];
+    const float m3 = in[3 * stride + ch];
+    const float m4 = in[4 * stride + ch];
+    const float m5 = in[5 * stride + ch];
+    out[0 * out_stride + ch] = m0 + m1 + m2 + m3 + m4;
+    out[1 * out_stride + ch] = m1 - m2 + 2.0f * m3 - 2.0f * m4;
+    out[2 * out_stride + ch] = m1 + m2 + 4.0f * m3 + 4.0f * m4;
+    out[3 * out_stride + ch] = m1 - m2 + 8.0f * m3 - 8.0f * m4 + m5;
+  }
+}
+
+}  // namespace
+
+std::vector<float> WinogradConvolution3F4::TransformF(
+    const std::vector<float>& f, const size_t outputs, const size_t channels) {
+  // F(4x4, 3x3) Winograd filter transformation
+  // transpose(G.dot(f).dot(G.transpose()))
+  // U matrix is transposed for better memory layout in SGEMM
+  auto U = std::vector<float>(kWinogradTile * outputs * channels);
+  auto G = std::array<float, kWinogradAlpha * 3>{
+      1.0f / 4,  0.0f,       0.0f,      //
+      -1.0f / 6, -1.0f / 6,  -1.0f / 6, //
+      -1.0f / 6, 1.0f / 6,   -1.0f / 6, //
+      1.0f / 24, 1.0f / 12,  1.0f / 6,  //
+      1.0f / 24, -1.0f / 12, 1.0f / 6,  //
+      0.0f,      0.0f,       1.0f};
+  auto temp = std::array<float, kWinogradAlpha * 3>{};
+
+  for (size_t o = 0; o < outputs; o++) {
+    for (size_t c = 0; c < channels; c++) {
+      for (size_t i = 0; i < kWinogradAlpha; i++) {
+        for (size_t j = 0; j < 3; j++) {
+          auto acc = 0.0f;
+          for (size_t k = 0; k < 3; k++) {
+            acc += G[i * 3 + k] * f[o * channels * 9 + c * 9 + k * 3 + j];
+          }
+          temp[i * 3 + j] = acc;
+        }
+      }
+
+      for (size_t xi = 0; xi < kWinogradAlpha; xi++) {
+        for (size_t nu = 0; nu < kWinogradAlpha; nu++) {
+          auto acc = 0.0f;
+          for (size_t k = 0; k < 3; k++) {
+            acc += temp[xi * 3 + k] * G[nu * 3 + k];
+          }
+          U[xi * (kWinogradAlpha * outputs * channels) +
+            nu * (outputs * channels) + c * outputs + o] = acc;
+        }
+      }
+    }
+  }
+  return U;
+}
+
+WinogradConvolution3F4::WinogradConvolution3F4(const size_t max_batch_size,
+                                               const size_t max_input_layers,
+                                               const size_t max_output_layers)
+    : V_(max_batch_size * kWinogradTile * max_input_layers * kTiles),
+      M_(max_batch_size * kWinogradTile * max_output_layers * kTiles) {}
+
+void WinogradConvolution3F4::Forward(const size_t batch_size,
+                                     const size_t input_channels,
+                                     const size_t output_channels,
+                                     const float* input, const float* weights,
+                                     const float* biases, const float* eltwise,
+                                     float* output) {
+  TransformIn(batch_size, input, input_channels);
+  Sgemm(batch_size, weights, input_channels, output_channels);
+  TransformOut(batch_size, biases, eltwise, output, output_channels);
+}
+
+void WinogradConvolution3F4::Forward(const size_t batch_size,
+                                     const size_t input_channels,
+                                     const size_t output_channels,
+                                     const float* input,
+                                     const uint16_t* weights,
+                                     const float* biases, const float* eltwise,
+                                     float* output) {
+  TransformIn(batch_size, input, input_channels);
+  SgemmBf16(batch_size, weights, input_channels, output_channels);
+  TransformOut(batch_size, biases, eltwise, output, output_channels);
+}
+
+void WinogradConvolution3F4::TransformIn(const size_t batch_size,
+                                         const float* input,
+                                         const size_t channels) {
+  // A chunk of channels of the board, with a border of zeroes so that the
+  // tiles can be read without bound checks. Tiles start at -1 and 3, and each
+  // spans 6 squares.
+  constexpr auto kPadded = kWidth + 2;
+  float padded[kPadded][kPadded][kChannelStep] = {};
+  float T1[kWinogradAlpha][kWinogradAlpha][kChannelStep];
+  float R[kWinogradAlpha][kWinogradAlpha][kChannelStep];
+  const auto V_incr = channels * kTiles * batch_size;
+
+  for (size_t batch_index = 0; batch_index < batch_size; batch_index++) {
+    const float* input_batch = input + batch_index * kSquares * channels;
+    float* V_batch = &V_[channels * kTiles * batch_index];
+    for (size_t channel_long = 0; channel_long < channels;
+         channel_long += kChannelStep) {
+      const auto channel_step =
+          std::min<size_t>(kChannelStep, channels - channel_long);
+      for (size_t ch = 0; ch < channel_step; ch++) {
+        const float* input_channel =
+            input_batch + (channel_long + ch) * kSquares;
+        for (int y = 0; y < kHeight; y++) {
+          for (int x = 0; x < kWidth; x++) {
+            padded[y + 1][x + 1][ch] = input_channel[y * kWidth + x];
+          }
+        }
+      }
+
+      for (int block_y = 0; block_y < kWtiles; block_y++) {
+        for (int block_x = 0; block_x < kWtiles; block_x++) {
+          // Tiles overlap by 2
+          const float* x = &padded[4 * block_y][4 * block_x][0];
+
+          // Calculates transpose(B).x.B
+          for (int j = 0; j < kWinogradAlpha; j++) {
+            TransformInColumn(x + j * kChannelStep, kPadded * kChannelStep,
+                              &T1[0][j][0], kWinogradAlpha * kChannelStep);
+          }
+          for (int i = 0; i < kWinogradAlpha; i++) {
+            TransformInColumn(&T1[i][0][0], kChannelStep, &R[i][0][0],
+                              kChannelStep);
+          }
+
+          float* wTile_V = V_batch + channel_long +
+                           channels * (block_y * kWtiles + block_x);
+          for (int i = 0; i < kWinogradAlpha; i++) {
+            for (int j = 0; j < kWinogradAlpha; j++) {
+              for (size_t ch = 0; ch < channel_step; ch++) {
+                wTile_V[ch] = R[i][j][ch];
+              }
+              wTile_V += V_incr;
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+void WinogradConvolution3F4::Sgemm(const size_t batch_size,
+                                   const float* weights,
+                                   const size_t input_channels,
+                                   const size_t output_channels) {
+  // See WinogradConvolution3::Sgemm().
+#ifdef USE_MKL
+
+  CBLAS_TRANSPOSE transA = CblasNoTrans;
+  CBLAS_TRANSPOSE transB = CblasNoTrans;
+  MKL_INT m_array = output_channels;
+  MKL_INT n_array = batch_size * kTiles;
+  MKL_INT k_array = input_channels;
+  float alpha_array = 1.0;
+  const float* a_array[kWinogradTile];
+  MKL_INT lda_array = output_channels;
+  const float* b_array[kWinogradTile];
+  MKL_INT ldb_array = input_channels;
+  float* c_array[kWinogradTile];
+  MKL_INT ldc_array = output_channels;
+  float beta_array = 0.0;
+  MKL_INT groupSize = kWinogradTile;
+
+  for (auto b = 0; b < kWinogradTile; b++) {
+    auto offset_u = b * output_channels * input_channels;
+    auto offset_v = b * batch_size * input_channels * kTiles;
+    auto offset_m = b * batch_size * output_channels * kTiles;
+
+    a_array[b] = &weights[offset_u];
+    b_array[b] = &V_[offset_v];
+    c_array[b] = &M_[offset_m];
+  }
+
+  cblas_sgemm_batch(CblasColMajor, &transA, &transB, &m_array, &n_array,
+                    &k_array, &alpha_array, a_array, &lda_array, b_array,
+                    &ldb_array, &beta_array, c_array, &ldc_array, 1,
+                    &groupSize);
+
+#else
+
+  for (size_t b = 0; b < kWinogradTile; b++) {
+    auto offset_u = b * output_channels * input_channels;
+    auto offset_v = b * batch_size * input_channels * kTiles;
+    auto offset_m = b * batch_size * output_channels * kTiles;
+
+    cblas_sgemm(CblasColMajor, CblasNoTrans, CblasNoTrans,
+                (int)output_channels, (int)(batch_size * kTiles),
+                (int)input_channels, 1.0f, &weights[offset_u],
+                (int)output_channels, &V_[offset_v], (int)input_channels, 0.0f,
+                &M_[offset_m], (int)output_channels);
+  }
+
+#endif
+}
+
+void WinogradConvolution3F4::SgemmBf16(const size_t batch_size,
+                                       const uint16_t* weights,
+                                       const size_t input_channels,
+                                       const size_t output_channels) {
+  const auto weights_size = output_channels * input_channels;
+  if (U_.size() < weights_size) U_.resize(weights_size);
+
+  for (size_t b = 0; b < kWinogradTile; b++) {
+    auto offset_v = b * batch_size * input_channels * kTiles;
+    auto offset_m = b * batch_size * output_channels * kTiles;
+
+    Bf16::ToFloat(weights_size, &weights[b * weights_size], U_.data());
+    cblas_sgemm(CblasColMajor, CblasNoTrans, CblasNoTrans,
+                (int)output_channels, (int)(batch_size * kTiles),
+                (int)input_channels, 1.0f, U_.data(), (int)output_channels,
+                &V_[offset_v], (int)input_channels, 0.0f, &M_[offset_m],
+                (int)output_channels);
+  }
+}
+
+void WinogradConvolution3F4::TransformOut(const size_t batch_size,
+                                          const float* biases,
+                                          const float* eltwise, float* output,
+                                          const size_t channels) {
+  float m[kWinogradAlpha][kWinogradAlpha][kChannelStep] = {};
+  float temp[4][kWinogradAlpha][kChannelStep];
+  float o[kHeight][kWidth][kChannelStep];
+  const auto M_incr = channels * kTiles * batch_size;
+
+  for (size_t batch_index = 0; batch_index < batch_size; batch_index++) {
+    const float* M_batch = &M_[channels * kTiles * batch_index];
+    float* output_batch = output + batch_index * kSquares * channels;
+    const float* eltwise_batch =
+        eltwise ? eltwise + batch_index * kSquares * channels : nullptr;
+
+    for (size_t channel_long = 0; channel_long < channels;
+         channel_long += kChannelStep) {
+      const auto channel_step =
+          std::min<size_t>(kChannelStep, channels - channel_long);
+
+      for (int block_y = 0; block_y < kWtiles; block_y++) {
+        for (int block_x = 0; block_x < kWtiles; block_x++) {
+          const auto b = block_y * kWtiles + block_x;
+          const float* M_wtile = M_batch + channel_long + channels * b;
+          for (int i = 0; i < kWinogradAlpha; i++) {
+            for (int j = 0; j < kWinogradAlpha; j++) {
+              for (size_t ch = 0; ch < channel_step; ch++) {
+                m[i][j][ch] = M_wtile[ch];
+              }
+              M_wtile += M_incr;
+            }
+          }
+
+          // Calculates transpose(A).m.A
+          for (int j = 0; j < kWinogradAlpha; j++) {
+            TransformOutColumn(&m[0][j][0], kWinogradAlpha * kChannelStep,
+                               &temp[0][j][0], kWinogradAlpha * kChannelStep);
+          }
+          for (int i = 0; i < 4; i++) {
+            TransformOutColumn(&temp[i][0][0], kChannelStep,
+                               &o[4 * block_y + i][4 * block_x][0],
+                               kChannelStep);
+          }
+        }
+      }
+
+      for (size_t ch = 0; ch < channel_step; ch++) {
+        const auto channel = channel_long + ch;
+        float* output_channel = output_batch + channel * kSquares;
+        const float* eltwise_channel =
+            eltwise_batch ? eltwise_batch + channel * kSquares : nullptr;
+        const float bias = biases[channel];
+        for (int y = 0; y < kHeight; y++) {
+          for (int x = 0; x < kWidth; x++) {
+            const auto square = y * kWidth + x;
+            auto val = o[y][x][ch] + bias;
+            if (eltwise_channel) val += eltwise_channel[square];
+            output_channel[square] = val > 0 ? val : 0;
+          }
+        }
+      }
+    }
+  }
+}
+
+}  // namespace lczero
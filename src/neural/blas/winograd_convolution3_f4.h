@@ -0,0 +1,95 @@
+/*
+ This file is part of Leela Chess Zero.
+ Copyright (C) 2018 The LCZero Authors
+
+ Leela Chess is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ Leela Chess is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace lczero {
+
+// Convolution 3x3 on a 8x8 board using the Winograd F(4x4, 3x3) algorithm.
+//
+// Compared to the F(2x2, 3x3) of WinogradConvolution3, a board is covered by
+// 4 tiles of 6x6 instead of 16 tiles of 4x4, so the SGEMMs have 144 instead
+// of 256 elements per channel, at the cost of larger transforms and a bit of
+// precision. Pays off on wide networks.
+//
+// Ref:
+//
+// Fast Algorithms for Convolutional Neural Networks
+// https://arxiv.org/abs/1509.09308
+class WinogradConvolution3F4 {
+ public:
+  // The instance will allocate memory resources for the
+  // largest batch size, and the largest input and output
+  // layers.
+  WinogradConvolution3F4(const size_t max_batch_size,
+                         const size_t max_input_layers,
+                         const size_t max_output_layers);
+
+  // Create the filter transform matrix.
+  static std::vector<float> TransformF(const std::vector<float>& f,
+                                       const size_t outputs,
+                                       const size_t channels);
+
+  // Forward inference, batched. Same as WinogradConvolution3::Forward().
+  void Forward(const size_t batch_size, const size_t input_channels,
+               const size_t output_channels, const float* input,
+               const float* weights, const float* biases,
+               const float* eltwise, float* output);
+
+  // Same with the transformed weights in bf16, see Bf16. Each of the
+  // kWinogradTile weight matrices is converted to fp32 right before its
+  // SGEMM, so only half as much has to come from memory.
+  void Forward(const size_t batch_size, const size_t input_channels,
+               const size_t output_channels, const float* input,
+               const uint16_t* weights, const float* biases,
+               const float* eltwise, float* output);
+
+ private:
+  void TransformIn(const size_t batch_size, const float* input,
+                   const size_t channels);
+
+  void Sgemm(const size_t batch_size, const float* weights,
+             const size_t input_channels, const size_t output_channels);
+
+  void SgemmBf16(const size_t batch_size, const uint16_t* weights,
+                 const size_t input_channels, const size_t output_channels);
+
+  void TransformOut(const size_t batch_size, const float* biases,
+                    const float* eltwise, float* output,
+                    const size_t channels);
+
+  static constexpr auto kWidth = 8;
+  static constexpr auto kHeight = 8;
+  static constexpr auto kSquares = kWidth * kHeight;
+
+  static constexpr auto kWtiles = (kWidth + 3) / 4;  // 2
+  static constexpr auto kTiles = kWtiles * kWtiles;  // 4
+
+  static constexpr auto kWinogradAlpha = 6;
+  static constexpr auto kWinogradTile = kWinogradAlpha * kWinogradAlpha;
+
+  std::vector<float> V_;
+  std::vector<float> M_;
+  // One weight matrix in fp32, for SgemmBf16().
+  std::vector<float> U_;
+};
+}  // namespace lczero
@@ -25,10 +25,443 @@
   Program grant you additional permission to convey the resulting work.
 */
 #include "neural/cache.h"
+#include "neural/diskcache.h"
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cstring>
 #include <iostream>
+#include <vector>
+#include "utils/exception.h"
+#include "utils/numa.h"
+#include "utils/sharedmemory.h"
 
 namespace lczero {
+
+/////////////////////////////////////////////////////////////////////////
+// NNCacheTable
+/////////////////////////////////////////////////////////////////////////
+
+namespace {
+// Number of slots in a bucket. A key can only be stored in its own bucket.
+const int kBucketSize = 8;
+// Marks a table as initialized, and changes whenever the memory layout (or
+// the order of moves of stored probabilities, or how keys are hashed) does,
+// so that processes of different versions don't share a table.
+const uint64_t kTableLayout = 0x4c6330540003ull;
+// Set in NNCacheSlot::moves of used slots.
+const uint32_t kUsedSlot = 1u << 31;
+}  // namespace
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2,
+              "Table in shared memory needs lock-free atomics");
+
+// All fields are atomics of a fixed size, so that the table is valid when
+// zero filled and can be shared even between processes.
+struct NNCacheTableHeader {
+  std::atomic<uint64_t> layout;
+  // Number of used slots.
+  std::atomic<uint32_t> size;
+};
+
+// A slot is a seqlock: the writer makes seq odd for the duration of the write,
+// and a reader retries (or misses, rather) if seq was odd or changed while it
+// was copying the slot.
+struct NNCacheSlot {
+  std::atomic<uint32_t> seq;
+  // Number of moves, with kUsedSlot bit set if the slot is used.
+  std::atomic<uint32_t> moves;
+  std::atomic<uint64_t> key;
+  // Bits of the float.
+  std::atomic<uint32_t> q;
+  // Set on every lookup, cleared when CLOCK hand passes.
+  std::atomic<uint32_t> referenced;
+  // Two probabilities per word.
+  std::atomic<uint32_t> p[NNCache::kMaxTableMoves / 2];
+};
+
+class NNCacheTable {
+ public:
+  // Table of @size_mb megabytes. If @shared_name is not empty, it's in shared
+  // memory region of that name.
+  NNCacheTable(int size_mb, const std::string& shared_name)
+      : num_buckets_(std::max<size_t>(
+            1, (size_mb * size_t(1024 * 1024) - kHeaderSize) /
+                   (sizeof(NNCacheSlot) * kBucketSize +
+                    sizeof(std::atomic<uint32_t>)))) {
+    const size_t bytes = GetSlotsOffset() +
+                         num_buckets_ * kBucketSize * sizeof(NNCacheSlot);
+    char* memory;
+    if (shared_name.empty()) {
+      memory_.reset(new char[bytes]());
+      memory = memory_.get();
+    } else {
+      shared_memory_ = std::make_unique<SharedMemory>(shared_name, bytes);
+      memory = shared_memory_->data();
+      // Pages of shared memory are placed when first touched, maybe later by
+      // any thread.
+      Numa::InterleaveMemory(memory, bytes);
+    }
+    header_ = reinterpret_cast<NNCacheTableHeader*>(memory);
+    hands_ = reinterpret_cast<std::atomic<uint32_t>*>(memory + kHeaderSize);
+    slots_ = reinterpret_cast<NNCacheSlot*>(memory + GetSlotsOffset());
+
+    uint64_t layout = 0;
+    if (!header_->layout.compare_exchange_strong(layout, kTableLayout) &&
+        layout != kTableLayout) {
+      throw Exception("Shared memory " + shared_name +
+                      " holds NNCache of a different version");
+    }
+  }
+
+  // Returns whether another entry was evicted to make room.
+  bool Insert(uint64_t key, float q, const uint16_t* p, int count) {
+    if (count > NNCache::kMaxTableMoves) return false;
+    NNCacheSlot* const begin = &slots_[(key % num_buckets_) * kBucketSize];
+
+    NNCacheSlot* victim = nullptr;
+    for (int i = 0; i < kBucketSize; ++i) {
+      NNCacheSlot* const slot = begin + i;
+      const uint32_t moves = slot->moves.load(std::memory_order_relaxed);
+      // Already there (or being written by someone else).
+      if ((moves & kUsedSlot) &&
+          slot->key.load(std::memory_order_relaxed) == key) {
+        return false;
+      }
+      if (!victim && !(moves & kUsedSlot)) victim = slot;
+    }
+    if (!victim) {
+      // Bucket is full, run the CLOCK hand until an unreferenced slot is
+      // found. After two full turns nothing is referenced anymore, unless
+      // readers are too fast, and then the value is dropped.
+      auto& hand = hands_[key % num_buckets_];
+      for (int i = 0; i < kBucketSize * 2; ++i) {
+        NNCacheSlot* const slot =
+            begin + hand.fetch_add(1, std::memory_order_relaxed) % kBucketSize;
+        if (slot->referenced.exchange(0, std::memory_order_relaxed)) continue;
+        victim = slot;
+        break;
+      }
+      if (!victim) return false;
+    }
+
+    // Someone else is writing the slot, let them.
+    uint32_t seq = victim->seq.load(std::memory_order_relaxed);
+    if ((seq & 1) ||
+        !victim->seq.compare_exchange_strong(seq, seq + 1,
+                                             std::memory_order_acquire)) {
+      return false;
+    }
+    const bool was_used =
+        victim->moves.load(std::memory_order_relaxed) & kUsedSlot;
+    victim->key.store(key, std::memory_order_relaxed);
+    uint32_t q_bits;
+    std::memcpy(&q_bits, &q, sizeof(q_bits));
+    victim->q.store(q_bits, std::memory_order_relaxed);
+    for (int i = 0; i < count; i += 2) {
+      const uint32_t high = i + 1 < count ? p[i + 1] : 0;
+      victim->p[i / 2].store(p[i] | (high << 16), std::memory_order_relaxed);
+    }
+    victim->referenced.store(0, std::memory_order_relaxed);
+    victim->moves.store(count | kUsedSlot, std::memory_order_relaxed);
+    victim->seq.store(seq + 2, std::memory_order_release);
+    if (!was_used) header_->size.fetch_add(1, std::memory_order_relaxed);
+    return was_used;
+  }
+
+  // Copies value and probabilities of @key into @q and @p. Returns number of
+  // moves, or -1 if there is no such key.
+  int Lookup(uint64_t key, float* q, uint16_t* p) {
+    NNCacheSlot* const begin = &slots_[(key % num_buckets_) * kBucketSize];
+    for (int i = 0; i < kBucketSize; ++i) {
+      NNCacheSlot* const slot = begin + i;
+      const uint32_t seq = slot->seq.load(std::memory_order_acquire);
+      if (seq & 1) continue;
+      if (slot->key.load(std::memory_order_relaxed) != key) continue;
+      const uint32_t moves = slot->moves.load(std::memory_order_relaxed);
+      if (!(moves & kUsedSlot)) continue;
+      const int count = moves & ~kUsedSlot;
+      const uint32_t q_bits = slot->q.load(std::memory_order_relaxed);
+      std::memcpy(q, &q_bits, sizeof(q_bits));
+      for (int j = 0; j < count; j += 2) {
+        const uint32_t word = slot->p[j / 2].load(std::memory_order_relaxed);
+        p[j] = word & 0xffff;
+        if (j + 1 < count) p[j + 1] = word >> 16;
+      }
+      // Makes sure that the copy is not torn by a writer.
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (slot->seq.load(std::memory_order_relaxed) != seq) continue;
+      slot->referenced.store(1, std::memory_order_relaxed);
+      return count;
+    }
+    return -1;
+  }
+
+  bool ContainsKey(uint64_t key) {
+    const NNCacheSlot* const begin =
+        &slots_[(key % num_buckets_) * kBucketSize];
+    for (int i = 0; i < kBucketSize; ++i) {
+      if ((begin[i].moves.load(std::memory_order_relaxed) & kUsedSlot) &&
+          begin[i].key.load(std::memory_order_relaxed) == key) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Drops all entries, unless the table is in shared memory.
+  void Clear() {
+    if (shared_memory_) return;
+    for (size_t i = 0; i < num_buckets_ * kBucketSize; ++i) {
+      slots_[i].moves.store(0, std::memory_order_relaxed);
+    }
+    header_->size.store(0, std::memory_order_relaxed);
+  }
+
+  int GetSize() const { return header_->size.load(std::memory_order_relaxed); }
+  int GetCapacity() const { return num_buckets_ * kBucketSize; }
+  size_t GetBytes() const {
+    return GetSlotsOffset() + num_buckets_ * kBucketSize * sizeof(NNCacheSlot);
+  }
+
+ private:
+  // Header is followed by CLOCK hands of all buckets, and then by slots.
+  static constexpr size_t kHeaderSize = 64;
+  size_t GetSlotsOffset() const {
+    const size_t offset =
+        kHeaderSize + num_buckets_ * sizeof(std::atomic<uint32_t>);
+    return (offset + 63) / 64 * 64;
+  }
+
+  std::unique_ptr<char[]> memory_;
+  std::unique_ptr<SharedMemory> shared_memory_;
+  const size_t num_buckets_;
+  NNCacheTableHeader* header_;
+  std::atomic<uint32_t>* hands_;
+  NNCacheSlot* slots_;
+};
+
+/////////////////////////////////////////////////////////////////////////
+// NNCache
+/////////////////////////////////////////////////////////////////////////
+
+NNCache::NNCache(int capacity) : lru_(capacity) {}
+
+NNCache::~NNCache() = default;
+
+// The cache is used by threads of all nodes alike, so it's spread over them.
+void NNCache::SetCapacity(int capacity) {
+  Numa::InterleaveScope interleave;
+  lru_.SetCapacity(capacity);
+}
+
+void NNCache::SetSizeMb(int size_mb, const std::string& shared_name) {
+  if (size_mb == size_mb_ && shared_name == shared_name_) return;
+  if (size_mb == 0 && !shared_name.empty()) {
+    throw Exception("NNCache in shared memory needs size in megabytes");
+  }
+  table_.reset();
+  lru_.Clear();
+  size_mb_ = 0;
+  shared_name_.clear();
+  if (size_mb > 0) {
+    Numa::InterleaveScope interleave;
+    table_ = std::make_unique<NNCacheTable>(size_mb, shared_name);
+  }
+  // Only remembered on success, so that a failure is retried next time.
+  size_mb_ = size_mb;
+  shared_name_ = shared_name;
+}
+
+void NNCache::SetDiskCache(const std::string& filename, bool read_only) {
+  if (filename == disk_filename_ && read_only == disk_read_only_) return;
+  // Old file is closed first, as it may be the same file.
+  disk_.reset();
+  disk_filename_.clear();
+  if (!filename.empty()) {
+    disk_ = std::make_unique<NNDiskCache>(filename, read_only);
+  }
+  // Only remembered on success, so that a failed open is retried next time.
+  disk_filename_ = filename;
+  disk_read_only_ = read_only;
+}
+
+void NNCache::Insert(uint64_t hash, float q, const float* p, int count) {
+  if (count > NNDiskCache::kMaxMoves) return;
+  uint16_t quantized[NNDiskCache::kMaxMoves];
+  for (int i = 0; i < count; ++i) quantized[i] = QuantizeP(p[i]);
+  InsertQuantized(hash, q, quantized, count, true);
+}
+
+void NNCache::InsertQuantized(uint64_t hash, float q, const uint16_t* p,
+                              int count, bool persist) {
+  if (persist && disk_) disk_->Append(hash, q, p, count);
+  inserts_.fetch_add(1, std::memory_order_relaxed);
+  inserted_moves_.fetch_add(count, std::memory_order_relaxed);
+  if (table_) {
+    if (table_->Insert(hash, q, p, count)) {
+      table_evictions_.fetch_add(1, std::memory_order_relaxed);
+    }
+    return;
+  }
+  auto req = std::make_unique<CachedNNRequest>(count);
+  req->q = q;
+  for (int i = 0; i < count; ++i) req->p[i] = p[i];
+  lru_.Insert(hash, std::move(req));
+}
+
+bool NNCache::ContainsKey(uint64_t hash) {
+  if (disk_ && disk_->ContainsKey(hash)) return true;
+  if (table_) return table_->ContainsKey(hash);
+  return lru_.ContainsKey(hash);
+}
+
+void NNCache::Clear() {
+  if (table_) table_->Clear();
+  lru_.Clear();
+}
+
+int NNCache::GetSize() const {
+  if (table_) return table_->GetSize();
+  return lru_.GetSize();
+}
+
+int NNCache::GetCapacity() const {
+  if (table_) return table_->GetCapacity();
+  return lru_.GetCapacity();
+}
+
+NNCacheStats NNCache::GetStats() const {
+  NNCacheStats stats;
+  stats.lookups = lookups_.load(std::memory_order_relaxed);
+  stats.hits = hits_.load(std::memory_order_relaxed);
+  stats.disk_hits = disk_hits_.load(std::memory_order_relaxed);
+  stats.inserts = inserts_.load(std::memory_order_relaxed);
+  stats.size = GetSize();
+  stats.capacity = GetCapacity();
+  if (table_) {
+    stats.evictions = table_evictions_.load(std::memory_order_relaxed);
+    stats.bytes = table_->GetBytes();
+  } else {
+    stats.evictions = lru_.GetEvictions();
+    stats.pinned = lru_.GetPinned();
+    stats.retired = lru_.GetRetired();
+    // Entries are not tracked by size, so the average number of moves of
+    // inserted ones is used. Overhead is the entry, its LRU item and a
+    // hashtable head, roughly.
+    const uint64_t moves = inserted_moves_.load(std::memory_order_relaxed);
+    const double avg_moves = stats.inserts ? double(moves) / stats.inserts : 0;
+    constexpr size_t kOverhead =
+        sizeof(CachedNNRequest) + 6 * sizeof(void*) + sizeof(uint64_t);
+    stats.bytes = static_cast<uint64_t>(
+        (stats.size + stats.retired) *
+        (kOverhead + avg_moves * sizeof(uint16_t)));
+  }
+  return stats;
+}
+
+uint16_t NNCache::QuantizeP(float p) {
+  // Same format as Edge uses for P. Adding half of the dropped bits does the
+  // rounding, and subtracting the exponent bias makes values below the
+  // smallest storable one negative.
+  constexpr int32_t kRounding = (1 << 11) - (3 << 28);
+  p = std::min(std::max(p, 0.0f), 1.0f);
+  int32_t tmp;
+  std::memcpy(&tmp, &p, sizeof(tmp));
+  tmp += kRounding;
+  return (tmp < 0) ? 0 : static_cast<uint16_t>(tmp >> 12);
+}
+
+float NNCache::DequantizeP(uint16_t p) {
+  if (p == 0) return 0.0f;
+  const uint32_t tmp = (static_cast<uint32_t>(p) << 12) | (3 << 28);
+  float result;
+  std::memcpy(&result, &tmp, sizeof(result));
+  return result;
+}
+
+/////////////////////////////////////////////////////////////////////////
+// NNCacheLock
+/////////////////////////////////////////////////////////////////////////
+
+NNCacheLock::NNCacheLock(NNCache* cache, uint64_t hash) {
+  cache->lookups_.fetch_add(1, std::memory_order_relaxed);
+  Lookup(cache, hash);
+  if (*this) {
+    cache->hits_.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  if (!cache->disk_) return;
+  // Not in memory, so an entry from the file is brought there.
+  float q;
+  uint16_t p[NNDiskCache::kMaxMoves];
+  const int count = cache->disk_->Lookup(hash, &q, p);
+  if (count < 0) return;
+  cache->disk_hits_.fetch_add(1, std::memory_order_relaxed);
+  cache->InsertQuantized(hash, q, p, count, false);
+  Lookup(cache, hash);
+}
+
+void NNCacheLock::Lookup(NNCache* cache, uint64_t hash) {
+  if (cache->table_) {
+    table_moves_ = cache->table_->Lookup(hash, &table_q_, table_p_);
+  } else {
+    lru_lock_ = LruCacheLock<uint64_t, CachedNNRequest>(&cache->lru_, hash);
+  }
+}
+
+NNCacheLock::~NNCacheLock() { Release(); }
+
+NNCacheLock::NNCacheLock(NNCacheLock&& other)
+    : lru_lock_(std::move(other.lru_lock_)) {
+  CopyTableEntryFrom(other);
+}
+
+NNCacheLock& NNCacheLock::operator=(NNCacheLock&& other) {
+  Release();
+  lru_lock_ = std::move(other.lru_lock_);
+  CopyTableEntryFrom(other);
+  return *this;
+}
+
+void NNCacheLock::CopyTableEntryFrom(const NNCacheLock& other) {
+  table_moves_ = other.table_moves_;
+  table_q_ = other.table_q_;
+  if (table_moves_ > 0) {
+    std::memcpy(table_p_, other.table_p_, table_moves_ * sizeof(table_p_[0]));
+  }
+}
+
+void NNCacheLock::Release() {
+  table_moves_ = -1;
+  // LruCacheLock unpins on destruction only.
+  { auto lock = std::move(lru_lock_); }
+}
+
+float NNCacheLock::GetQ() const {
+  return table_moves_ >= 0 ? table_q_ : lru_lock_->q;
+}
+
+int NNCacheLock::GetPSize() const {
+  return table_moves_ >= 0 ? table_moves_ : lru_lock_->p.size();
+}
+
+float NNCacheLock::GetP(int idx) const {
+  return NNCache::DequantizeP(table_moves_ >= 0 ? table_p_[idx]
+                                                : lru_lock_->p[idx]);
+}
+
+void NNCacheLock::GetPs(int count, float* out) const {
+  const int size = std::min(count, GetPSize());
+  const uint16_t* p = table_moves_ >= 0 ? table_p_ : lru_lock_->p.data();
+  for (int i = 0; i < size; ++i) out[i] = NNCache::DequantizeP(p[i]);
+  std::fill(out + size, out + count, 0.0f);
+}
+
+/////////////////////////////////////////////////////////////////////////
+// CachingComputation
+/////////////////////////////////////////////////////////////////////////
+
 CachingComputation::CachingComputation(
     std::unique_ptr<NetworkComputation> parent, NNCache* cache)
     : parent_(std::move(parent)), cache_(cache) {}
@@ -48,15 +481,16 @@ bool CachingComputation::AddInputByHash(uint64_t hash) {
   return true;
 }
 
-void CachingComputation::AddInput(
-    uint64_t hash, InputPlanes&& input,
-    std::vector<uint16_t>&& probabilities_to_cache) {
-  if (AddInputByHash(hash)) return;
+InputPlanesRef CachingComputation::AddInput(
+    uint64_t hash, std::vector<uint16_t>&& probabilities_to_cache) {
   batch_.emplace_back();
   batch_.back().hash = hash;
   batch_.back().idx_in_parent = parent_->GetBatchSize();
-  batch_.back().probabilities_to_cache = probabilities_to_cache;
-  parent_->AddInput(std::move(input));
+  batch_.back().probabilities_to_cache = std::move(probabilities_to_cache);
+  // Only the probabilities to cache are ever read from the parent.
+  return parent_->AddInputForMoves(
+      batch_.back().probabilities_to_cache.data(),
+      batch_.back().probabilities_to_cache.size());
 }
 
 void CachingComputation::PopLastInputHit() {
@@ -72,40 +506,41 @@ void CachingComputation::ComputeBlocking() {
   // Fill cache with data from NN.
   for (const auto& item : batch_) {
     if (item.idx_in_parent == -1) continue;
-    auto req =
-        std::make_unique<CachedNNRequest>(item.probabilities_to_cache.size());
-    req->q = parent_->GetQVal(item.idx_in_parent);
-    int idx = 0;
-    for (auto x : item.probabilities_to_cache) {
-      req->p[idx++] =
-          std::make_pair(x, parent_->GetPVal(item.idx_in_parent, x));
-    }
-    cache_->Insert(item.hash, std::move(req));
+    probabilities_.resize(item.probabilities_to_cache.size());
+    parent_->GetPVals(item.idx_in_parent, item.probabilities_to_cache.data(),
+                      item.probabilities_to_cache.size(),
+                      probabilities_.data());
+    cache_->Insert(item.hash, parent_->GetQVal(item.idx_in_parent),
+                   probabilities_.data(), probabilities_.size());
   }
 }
 
 float CachingComputation::GetQVal(int sample) const {
   const auto& item = batch_[sample];
   if (item.idx_in_parent >= 0) return parent_->GetQVal(item.idx_in_parent);
-  return item.lock->q;
+  return item.lock.GetQ();
 }
 
-float CachingComputation::GetPVal(int sample, int move_id) const {
-  auto& item = batch_[sample];
-  if (item.idx_in_parent >= 0)
-    return parent_->GetPVal(item.idx_in_parent, move_id);
-  const auto& moves = item.lock->p;
+float CachingComputation::GetPVal(int sample, int move_idx) const {
+  const auto& item = batch_[sample];
+  if (item.idx_in_parent >= 0) {
+    return parent_->GetPVal(item.idx_in_parent,
+                            item.probabilities_to_cache[move_idx]);
+  }
+  // Different number of moves is only possible on a hash collision.
+  if (move_idx >= item.lock.GetPSize()) return 0.0f;
+  return item.lock.GetP(move_idx);
+}
 
-  int total_count = 0;
-  while (total_count < moves.size()) {
-    // Optimization: usually moves are stored in the same order as queried.
-    const auto& move = moves[item.last_idx++];
-    if (item.last_idx == moves.size()) item.last_idx = 0;
-    if (move.first == move_id) return move.second;
-    ++total_count;
+void CachingComputation::GetPVals(int sample, int count, float* out) const {
+  const auto& item = batch_[sample];
+  if (item.idx_in_parent >= 0) {
+    assert(count <= static_cast<int>(item.probabilities_to_cache.size()));
+    parent_->GetPVals(item.idx_in_parent, item.probabilities_to_cache.data(),
+                      count, out);
+    return;
   }
-  assert(false);  // Move not found.
-  return 0;
+  item.lock.GetPs(count, out);
 }
 
 }  // namespace lczero
@@ -26,6 +26,7 @@
 */
 #pragma once
 
+#include <atomic>
 #include "neural/network.h"
 #include "utils/cache.h"
 #include "utils/smallarray.h"
@@ -34,14 +35,145 @@ namespace lczero {
 
 struct CachedNNRequest {
   CachedNNRequest(size_t size) : p(size) {}
-  typedef std::pair<uint16_t, float> IdxAndProb;
   float q;
-  // TODO(mooskagh) Don't really need index if using perfect hash.
-  SmallArray<IdxAndProb> p;
+  // Probabilities of legal moves in the order they are generated, without
+  // move indices. Stored as 16-bit floats (see NNCache::QuantizeP()).
+  SmallArray<uint16_t> p;
 };
 
-typedef LruCache<uint64_t, CachedNNRequest> NNCache;
-typedef LruCacheLock<uint64_t, CachedNNRequest> NNCacheLock;
+// Counters of NNCache since it was created, and its current state.
+struct NNCacheStats {
+  // Lookups of entries (not counting ContainsKey()), and how many of them were
+  // found in memory, or else in the file.
+  uint64_t lookups = 0;
+  uint64_t hits = 0;
+  uint64_t disk_hits = 0;
+  uint64_t inserts = 0;
+  // Entries evicted to make room for new ones.
+  uint64_t evictions = 0;
+  // LRU engine only: pins currently held, and evicted entries which are kept
+  // until they are unpinned.
+  int pinned = 0;
+  int retired = 0;
+  int size = 0;
+  int capacity = 0;
+  // Memory used by entries. Approximate for the LRU engine.
+  uint64_t bytes = 0;
+};
+
+class NNCacheTable;
+class NNDiskCache;
+
+// Cache of NN evaluations by position hash. Thread-safe. Has two engines:
+// * LRU cache, with capacity in entries and every entry allocated on insert
+//   (the default).
+// * Table of fixed size slots preallocated for the given number of megabytes,
+//   with CLOCK (second chance) eviction. Nothing is allocated on insert, but
+//   positions with more than kMaxTableMoves moves are not cached. Slots are
+//   lock-free, so the table can also be placed in shared memory and used by
+//   several processes at once.
+// Optionally, a file (NNDiskCache) is used as a second tier: it's checked on
+// a miss, and new evaluations are appended to it.
+class NNCache {
+ public:
+  NNCache(int capacity = 128);
+  ~NNCache();
+
+  // Sets capacity of the LRU engine, in entries.
+  void SetCapacity(int capacity);
+  // Switches to the table engine of @size_mb megabytes, or back to the LRU
+  // engine if @size_mb is 0. If @shared_name is not empty, the table is in
+  // shared memory of that name, attached to if another process has created it.
+  // All entries of the process are dropped on switch. Must not be called while
+  // the cache is in use by other threads.
+  void SetSizeMb(int size_mb, const std::string& shared_name = {});
+  int GetSizeMb() const { return size_mb_; }
+  // Uses file @filename as persistent tier, or no file if @filename is empty.
+  // If @read_only, new evaluations are not written to the file. Must not be
+  // called while the cache is in use by other threads.
+  void SetDiskCache(const std::string& filename, bool read_only);
+
+  // Inserts evaluation of position @hash: value @q and probabilities @p of
+  // its @count legal moves.
+  void Insert(uint64_t hash, float q, const float* p, int count);
+  // Checks whether a key exists, in memory or in the file. Of course the next
+  // moment the key may be evicted.
+  bool ContainsKey(uint64_t hash);
+  // Clears the in-memory entries, except of shared memory which other
+  // processes may be using.
+  void Clear();
+
+  // Number of entries in memory, and how many it can hold.
+  int GetSize() const;
+  int GetCapacity() const;
+  NNCacheStats GetStats() const;
+
+  // Converts probability in [0, 1] range to a 16-bit float with 5 bits of
+  // exponent and 11 bits of mantissa, and back.
+  static uint16_t QuantizeP(float p);
+  static float DequantizeP(uint16_t p);
+
+  // Most legal moves of a position stored in the table engine.
+  static constexpr int kMaxTableMoves = 80;
+
+ private:
+  // Inserts into memory, and into the file if @persist.
+  void InsertQuantized(uint64_t hash, float q, const uint16_t* p, int count,
+                       bool persist);
+
+  LruCache<uint64_t, CachedNNRequest> lru_;
+  int size_mb_ = 0;
+  std::string shared_name_;
+  std::unique_ptr<NNCacheTable> table_;
+  std::string disk_filename_;
+  bool disk_read_only_ = false;
+  std::unique_ptr<NNDiskCache> disk_;
+
+  std::atomic<uint64_t> lookups_{0};
+  std::atomic<uint64_t> hits_{0};
+  std::atomic<uint64_t> disk_hits_{0};
+  std::atomic<uint64_t> inserts_{0};
+  std::atomic<uint64_t> inserted_moves_{0};
+  std::atomic<uint64_t> table_evictions_{0};
+
+  friend class NNCacheLock;
+};
+
+// Looks up an entry of NNCache and keeps it from being evicted while the lock
+// is held. Entries of the table engine are copied into the lock instead.
+class NNCacheLock {
+ public:
+  NNCacheLock() {}
+  NNCacheLock(NNCache* cache, uint64_t hash);
+  ~NNCacheLock();
+
+  NNCacheLock(const NNCacheLock&) = delete;
+  NNCacheLock(NNCacheLock&& other);
+  NNCacheLock& operator=(NNCacheLock&& other);
+
+  // Returns whether lock holds any value.
+  operator bool() const { return lru_lock_ || table_moves_ >= 0; }
+
+  float GetQ() const;
+  // Number of stored probabilities, and the probability of legal move number
+  // @idx.
+  int GetPSize() const;
+  float GetP(int idx) const;
+  // Writes the first @count probabilities into @out, and zeroes for the ones
+  // which are not stored.
+  void GetPs(int count, float* out) const;
+
+ private:
+  void Lookup(NNCache* cache, uint64_t hash);
+  void CopyTableEntryFrom(const NNCacheLock& other);
+  void Release();
+
+  LruCacheLock<uint64_t, CachedNNRequest> lru_lock_;
+  // Copy of the table entry, number of moves is -1 if there is none.
+  int table_moves_ = -1;
+  float table_q_ = 0.0f;
+  uint16_t table_p_[NNCache::kMaxTableMoves];
+};
 
 // Wraps around NetworkComputation and caches result.
 // While it mostly repeats NetworkComputation interface, it's not derived
@@ -59,11 +191,15 @@ class CachingComputation {
   // Adds input by hash only. If that hash is not in cache, returns false
   // and does nothing. Otherwise adds.
   bool AddInputByHash(uint64_t hash);
-  // Adds a sample to the batch.
-  // @hash is a hash to store/lookup it in the cache.
-  // @probabilities_to_cache is which indices of policy head to store.
-  void AddInput(uint64_t hash, InputPlanes&& input,
-                std::vector<uint16_t>&& probabilities_to_cache);
+  // Adds a sample to the batch, to be computed by the wrapped computation. The
+  // cache is not checked, that's what AddInputByHash() is for. Returns planes
+  // to write the input into, valid until the next sample is added.
+  // @hash is a hash to store it in the cache.
+  // @probabilities_to_cache is which indices of policy head to store. Has to
+  // be legal moves of the position in the order they are generated, as the
+  // cache only stores the probabilities.
+  InputPlanesRef AddInput(uint64_t hash,
+                          std::vector<uint16_t>&& probabilities_to_cache);
   // Undos last AddInput. If it was a cache miss, the it's actually not removed
   // from parent's batch.
   void PopLastInputHit();
@@ -71,8 +207,10 @@ class CachingComputation {
   void ComputeBlocking();
   // Returns Q value of @sample.
   float GetQVal(int sample) const;
-  // Returns P value @move_id of @sample.
-  float GetPVal(int sample, int move_id) const;
+  // Returns P value of legal move number @move_idx of @sample.
+  float GetPVal(int sample, int move_idx) const;
+  // Writes P values of the first @count legal moves of @sample into @out.
+  void GetPVals(int sample, int count, float* out) const;
 
  private:
   struct WorkItem {
@@ -80,12 +218,13 @@ class CachingComputation {
     NNCacheLock lock;
     int idx_in_parent = -1;
     std::vector<uint16_t> probabilities_to_cache;
-    mutable int last_idx = 0;
   };
 
   std::unique_ptr<NetworkComputation> parent_;
   NNCache* cache_;
   std::vector<WorkItem> batch_;
+  // Buffer to pass probabilities to the cache.
+  std::vector<float> probabilities_;
 };
 
 }  // namespace lczero
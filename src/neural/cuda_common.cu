@@ -0,0 +1,183 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "neural/cuda_common.h"
+
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+#include "utils/exception.h"
+
+namespace lczero {
+
+void CudaError(cudaError_t status, const char *file, const int &line) {
+  if (status != cudaSuccess) {
+    char message[128];
+    sprintf(message, "CUDA error: %s (%s:%d) ", cudaGetErrorString(status),
+            file, line);
+    throw Exception(message);
+  }
+}
+
+void CreateCudaContexts(const std::vector<int> &gpu_ids) {
+  for (const int gpu_id : gpu_ids) {
+    ReportCUDAErrors(cudaSetDevice(gpu_id));
+    // Any runtime call which needs the context creates it.
+    ReportCUDAErrors(cudaFree(nullptr));
+  }
+}
+
+__global__ void expandPlanes_kernel_Fp32_NCHW(float *output,
+                                              const uint64_t *masks,
+                                              const float *values, int n) {
+  // Block size of 256, same mask/val for 64 consecutive threads.
+  constexpr int kNumShmemElments = 256 / 64;
+
+  __shared__ uint64_t shMasks[kNumShmemElments];
+  __shared__ float shVals[kNumShmemElments];
+
+  int index = threadIdx.x + blockDim.x * blockIdx.x;
+
+  int planeIndex = index >> 6;
+
+  if (planeIndex >= n) return;
+
+  // load inputs to shared memory.
+  if (threadIdx.x < kNumShmemElments) {
+    shMasks[threadIdx.x] = masks[planeIndex + threadIdx.x];
+    shVals[threadIdx.x] = values[planeIndex + threadIdx.x];
+  }
+  __syncthreads();
+
+  uint64_t mask = shMasks[threadIdx.x >> 6];
+
+  int sqIndex = index & 0x3F;
+  float op = 0;
+
+  bool set = !!(mask & (1ull << sqIndex));
+  if (set) {
+    op = shVals[threadIdx.x >> 6];
+  }
+  output[index] = op;
+}
+
+void expandPlanes_Fp32_NCHW(float *output, const uint64_t *masks,
+                            const float *values, int n, cudaStream_t stream) {
+  int threads = n * 8 * 8;  // Each thread writes a single element.
+  const int blockSize = 256;
+  int blocks = DivUp(threads, blockSize);
+  expandPlanes_kernel_Fp32_NCHW<<<blocks, blockSize, 0, stream>>>(
+      output, masks, values, n);
+  ReportCUDAErrors(cudaGetLastError());
+}
+
+// TODO: Can optimize using shared memory if this becomes a bottleneck.
+__global__ void expandPlanes_kernel_Fp16_NHWC(half *output,
+                                              const uint64_t *masks,
+                                              const float *values, int n) {
+  const int index = threadIdx.x + blockDim.x * blockIdx.x;
+  if (index >= n * 8 * 8) return;
+
+  const int planeIndex = index % kInputPlanes;
+  const int boardIndex = index / (kInputPlanes * 8 * 8);
+  const int sqIndex = (index / kInputPlanes) & 0x3F;
+
+  uint64_t mask = masks[boardIndex * kInputPlanes + planeIndex];
+
+  half op = 0;
+  bool set = !!(mask & (1ull << sqIndex));
+  if (set) {
+    float val = values[boardIndex * kInputPlanes + planeIndex];
+    op = (half)val;
+  }
+  output[index] = op;
+}
+
+void expandPlanes_Fp16_NHWC(half *output, const uint64_t *masks,
+                            const float *values, int n, cudaStream_t stream) {
+  int threads = n * 8 * 8;  // Each thread writes a single element.
+  const int kBlockSize = 256;
+  int blocks = DivUp(threads, kBlockSize);
+  expandPlanes_kernel_Fp16_NHWC<<<blocks, kBlockSize, 0, stream>>>(
+      output, masks, values, n);
+  ReportCUDAErrors(cudaGetLastError());
+}
+
+namespace {
+void FoldConvBlock(Weights::ConvBlock *block) {
+  const float epsilon = 1e-5f;
+
+  // Compute reciprocal of std-dev from the variances (so that it can be just
+  // multiplied).
+  std::vector<float> &stddev = block->bn_stddivs;
+  for (auto &&w : stddev) {
+    w = 1.0f / std::sqrt(w + epsilon);
+  }
+
+  // Biases are not calculated and are typically zero but some networks might
+  // still have non-zero biases.
+  // Move biases to batchnorm means to make the output match without having
+  // to separately add the biases.
+  for (auto j = size_t{0}; j < block->bn_means.size(); j++) {
+    block->bn_means[j] -= block->biases[j];
+    block->biases[j] = 0.0f;
+  }
+
+  // Get rid of the BN layer by adjusting weights and biases of the
+  // convolution idea proposed by Henrik Forstn and first implemented in
+  // leela go zero.
+  const int outputs = block->biases.size();
+  // Any filter size: all weights of an output are consecutive.
+  const int weights_per_output = block->weights.size() / outputs;
+
+  for (auto o = 0; o < outputs; o++) {
+    for (auto i = 0; i < weights_per_output; i++) {
+      block->weights[o * weights_per_output + i] *= block->bn_stddivs[o];
+    }
+
+    block->bn_means[o] *= block->bn_stddivs[o];
+    block->bn_stddivs[o] = 1.0f;
+
+    // Move means to convolution biases.
+    block->biases[o] = -block->bn_means[o];
+    block->bn_means[o] = 0.0f;
+  }
+}
+}  // namespace
+
+void FoldBatchNorm(Weights *weights) {
+  FoldConvBlock(&weights->input);
+  for (auto &residual : weights->residual) {
+    FoldConvBlock(&residual.conv1);
+    FoldConvBlock(&residual.conv2);
+  }
+  FoldConvBlock(&weights->policy);
+  FoldConvBlock(&weights->value);
+}
+
+}  // namespace lczero
@@ -0,0 +1,65 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#pragma once
+
+#include <cuda_fp16.h>
+#include <cuda_runtime.h>
+#include <cstdint>
+#include <vector>
+
+#include "neural/network.h"
+
+// Parts shared by the CUDA backends (cudnn and TensorRT).
+
+namespace lczero {
+
+// Throws Exception if @status is an error.
+void CudaError(cudaError_t status, const char *file, const int &line);
+
+#define ReportCUDAErrors(status) CudaError(status, __FILE__, __LINE__)
+
+// Creates the CUDA contexts of @gpu_ids, the slow part of CUDA
+// initialization, so that it can be done ahead of creating a backend.
+void CreateCudaContexts(const std::vector<int> &gpu_ids);
+
+inline int DivUp(int a, int b) { return (a + b - 1) / b; }
+
+// Expand packed planes (masks and values of @n planes) to full 8x8 planes,
+// of the batch in NCHW layout and fp32.
+void expandPlanes_Fp32_NCHW(float *output, const uint64_t *masks,
+                            const float *values, int n, cudaStream_t stream);
+
+// Same in NHWC layout and fp16.
+void expandPlanes_Fp16_NHWC(half *output, const uint64_t *masks,
+                            const float *values, int n, cudaStream_t stream);
+
+// Folds batch norm of all the convolutions of @weights into their weights and
+// biases, which is the form both backends compute with.
+void FoldBatchNorm(Weights *weights);
+
+}  // namespace lczero
@@ -0,0 +1,184 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+#include "neural/diskcache.h"
+#include <cstring>
+#include "utils/exception.h"
+
+namespace lczero {
+
+namespace {
+const char kMagic[4] = {'L', 'c', '0', 'E'};
+// 2: sliding piece moves are generated in the order of squares.
+// 3: keys are built from Zobrist hashes of positions.
+const uint32_t kVersion = 3;
+
+struct DiskCacheHeader {
+  char magic[4];
+  uint32_t version;
+};
+
+// Record is the hash, q, number of moves and that many probabilities. Fields
+// are not aligned in the file.
+const uint64_t kRecordHeaderSize =
+    sizeof(uint64_t) + sizeof(float) + sizeof(uint16_t);
+
+void WriteRecord(FILE* file, uint64_t hash, float q, const uint16_t* p,
+                 int count) {
+  char buf[kRecordHeaderSize + NNDiskCache::kMaxMoves * sizeof(uint16_t)];
+  const uint16_t count16 = count;
+  std::memcpy(buf, &hash, sizeof(hash));
+  std::memcpy(buf + sizeof(hash), &q, sizeof(q));
+  std::memcpy(buf + sizeof(hash) + sizeof(q), &count16, sizeof(count16));
+  std::memcpy(buf + kRecordHeaderSize, p, count * sizeof(uint16_t));
+  std::fwrite(buf, kRecordHeaderSize + count * sizeof(uint16_t), 1, file);
+}
+
+void WriteHeader(FILE* file) {
+  DiskCacheHeader header;
+  std::memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  std::fwrite(&header, sizeof(header), 1, file);
+}
+}  // namespace
+
+NNDiskCache::NNDiskCache(const std::string& filename, bool read_only)
+    : filename_(filename) {
+  if (!read_only) {
+    FILE* file = std::fopen(filename.c_str(), "ab");
+    if (!file) {
+      throw Exception("Cannot open NN cache file for writing: " + filename);
+    }
+    if (GetFileSize(filename) == 0) {
+      WriteHeader(file);
+      std::fflush(file);
+    }
+    Mutex::Lock lock(file_mutex_);
+    file_ = file;
+  }
+  mapped_ = std::make_unique<MappedFile>(filename);
+  const uint64_t valid_size = BuildIndex();
+  if (!read_only && valid_size != mapped_->size()) {
+    // Appending after a partial record would misalign all the new ones.
+    throw Exception("NN cache file has a partial record at the end: " +
+                    filename + ". Run mergecache to repair it.");
+  }
+}
+
+NNDiskCache::~NNDiskCache() {
+  Mutex::Lock lock(file_mutex_);
+  if (file_) std::fclose(file_);
+}
+
+uint64_t NNDiskCache::BuildIndex() {
+  const char* data = mapped_->data();
+  const uint64_t size = mapped_->size();
+  DiskCacheHeader header;
+  if (size < sizeof(header)) {
+    throw Exception("Not an NN cache file: " + filename_);
+  }
+  std::memcpy(&header, data, sizeof(header));
+  if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0) {
+    throw Exception("Not an NN cache file: " + filename_);
+  }
+  if (header.version != kVersion) {
+    throw Exception("Unsupported NN cache file version: " + filename_);
+  }
+
+  uint64_t offset = sizeof(header);
+  // A partial record at the end is left over from a crash while writing, it's
+  // ignored.
+  while (offset + kRecordHeaderSize <= size) {
+    uint64_t hash;
+    uint16_t count;
+    std::memcpy(&hash, data + offset, sizeof(hash));
+    std::memcpy(&count, data + offset + sizeof(hash) + sizeof(float),
+                sizeof(count));
+    const uint64_t record_size = kRecordHeaderSize + count * sizeof(uint16_t);
+    if (count > kMaxMoves || offset + record_size > size) break;
+    index_[hash] = offset;
+    offset += record_size;
+  }
+  return offset;
+}
+
+int NNDiskCache::Lookup(uint64_t hash, float* q, uint16_t* p) const {
+  const auto iter = index_.find(hash);
+  if (iter == index_.end()) return -1;
+  const char* record = mapped_->data() + iter->second;
+  uint16_t count;
+  std::memcpy(q, record + sizeof(hash), sizeof(*q));
+  std::memcpy(&count, record + sizeof(hash) + sizeof(*q), sizeof(count));
+  std::memcpy(p, record + kRecordHeaderSize, count * sizeof(uint16_t));
+  return count;
+}
+
+void NNDiskCache::Append(uint64_t hash, float q, const uint16_t* p,
+                         int count) {
+  if (count > kMaxMoves) return;
+  Mutex::Lock lock(file_mutex_);
+  if (!file_) return;
+  WriteRecord(file_, hash, q, p, count);
+}
+
+void NNDiskCache::Merge(const std::vector<std::string>& inputs,
+                        const std::string& output) {
+  std::vector<std::unique_ptr<NNDiskCache>> caches;
+  // Which input the record of each hash is taken from.
+  std::unordered_map<uint64_t, const NNDiskCache*> sources;
+  for (const auto& input : inputs) {
+    caches.emplace_back(std::make_unique<NNDiskCache>(input, true));
+    for (const auto& entry : caches.back()->index_) {
+      sources[entry.first] = caches.back().get();
+    }
+  }
+
+  // Written to a temporary file first, as output may be one of the inputs.
+  const std::string tmp_filename = output + ".tmp";
+  FILE* file = std::fopen(tmp_filename.c_str(), "wb");
+  if (!file) throw Exception("Cannot open file for writing: " + tmp_filename);
+  WriteHeader(file);
+  float q;
+  uint16_t p[kMaxMoves];
+  for (const auto& source : sources) {
+    const int count = source.second->Lookup(source.first, &q, p);
+    WriteRecord(file, source.first, q, p, count);
+  }
+  const bool failed = std::ferror(file);
+  std::fclose(file);
+  caches.clear();
+  if (failed) {
+    std::remove(tmp_filename.c_str());
+    throw Exception("Cannot write file: " + tmp_filename);
+  }
+
+  std::remove(output.c_str());
+  if (std::rename(tmp_filename.c_str(), output.c_str()) != 0) {
+    throw Exception("Cannot rename " + tmp_filename + " to " + output);
+  }
+}
+
+}  // namespace lczero
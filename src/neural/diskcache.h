@@ -0,0 +1,90 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "utils/filesystem.h"
+#include "utils/mutex.h"
+
+namespace lczero {
+
+// Persistent tier of NNCache. A file of NN evaluations, looked up when a
+// position is not in memory and appended to with every new NN evaluation, so
+// that they are kept across runs.
+//
+// The file is a header followed by records of hash, q and 16-bit
+// probabilities in legal move order (see NNCache::QuantizeP()). Records are
+// only appended, a later record of the same hash overrides an earlier one.
+// Contents present at open time are mapped into memory and indexed.
+//
+// Any number of processes can share a file read-only, but only one may write
+// to it at a time.
+class NNDiskCache {
+ public:
+  // Most legal moves a record can have.
+  static constexpr int kMaxMoves = 255;
+
+  // Opens @filename. If not @read_only, creates the file if it doesn't exist
+  // and appends new evaluations to it. Throws exception on failure.
+  NNDiskCache(const std::string& filename, bool read_only);
+  ~NNDiskCache();
+
+  // Looks up @hash. If found, fills @q and @p (which must have room for
+  // kMaxMoves values) and returns number of moves. Otherwise returns -1.
+  int Lookup(uint64_t hash, float* q, uint16_t* p) const;
+  bool ContainsKey(uint64_t hash) const { return index_.count(hash) > 0; }
+  // Appends a record, if writable.
+  void Append(uint64_t hash, float q, const uint16_t* p, int count);
+
+  // Number of records indexed at open time.
+  size_t GetSize() const { return index_.size(); }
+
+  // Writes records of all @inputs to @output, one record per hash. Records of
+  // later inputs override earlier ones. Output may be one of inputs, which is
+  // the way to compact or repair a file.
+  static void Merge(const std::vector<std::string>& inputs,
+                    const std::string& output);
+
+ private:
+  // Returns the length of valid data in the mapped file.
+  uint64_t BuildIndex();
+
+  const std::string filename_;
+  std::unique_ptr<MappedFile> mapped_;
+  // Hash to record offset in the mapped file.
+  std::unordered_map<uint64_t, uint64_t> index_;
+
+  Mutex file_mutex_{"disk cache"};
+  FILE* file_ GUARDED_BY(file_mutex_) = nullptr;
+};
+
+}  // namespace lczero
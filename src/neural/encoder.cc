@@ -27,62 +27,127 @@
 
 #include "neural/encoder.h"
 #include <algorithm>
+#include <iterator>
 
 namespace lczero {
 
 namespace {
-const int kMoveHistory = 8;
-const int kPlanesPerBoard = 13;
 const int kAuxPlaneBase = kPlanesPerBoard * kMoveHistory;
-}  // namespace
+static_assert(kAuxPlaneBase + 8 == kInputPlanes, "Wrong number of planes");
+
+// Encodes castling, side to move and move counters of the last position.
+void EncodeAuxPlanes(const PositionHistory& history, InputPlanesRef out) {
+  std::uint64_t* const masks = out.masks;
+  const ChessBoard& board = history.Last().GetBoard();
+  const bool we_are_black = board.flipped();
+  if (board.castlings().we_can_000()) masks[kAuxPlaneBase + 0] = ~0ull;
+  if (board.castlings().we_can_00()) masks[kAuxPlaneBase + 1] = ~0ull;
+  if (board.castlings().they_can_000()) masks[kAuxPlaneBase + 2] = ~0ull;
+  if (board.castlings().they_can_00()) masks[kAuxPlaneBase + 3] = ~0ull;
+  if (we_are_black) masks[kAuxPlaneBase + 4] = ~0ull;
+  masks[kAuxPlaneBase + 5] = ~0ull;
+  out.values[kAuxPlaneBase + 5] = history.Last().GetNoCapturePly();
+  // Plane kAuxPlaneBase + 6 used to be movecount plane, now it's all zeros.
+  // Plane kAuxPlaneBase + 7 is all ones to help NN find board edges.
+  masks[kAuxPlaneBase + 7] = ~0ull;
+}
 
-InputPlanes EncodePositionForNN(const PositionHistory& history,
-                                int history_planes) {
-  InputPlanes result(kAuxPlaneBase + 8);
-
-  {
-    const ChessBoard& board = history.Last().GetBoard();
-    const bool we_are_black = board.flipped();
-    if (board.castlings().we_can_000()) result[kAuxPlaneBase + 0].SetAll();
-    if (board.castlings().we_can_00()) result[kAuxPlaneBase + 1].SetAll();
-    if (board.castlings().they_can_000()) result[kAuxPlaneBase + 2].SetAll();
-    if (board.castlings().they_can_00()) result[kAuxPlaneBase + 3].SetAll();
-    if (we_are_black) result[kAuxPlaneBase + 4].SetAll();
-    result[kAuxPlaneBase + 5].Fill(history.Last().GetNoCapturePly());
-    // Plane kAuxPlaneBase + 6 used to be movecount plane, now it's all zeros.
-    // Plane kAuxPlaneBase + 7 is all ones to help NN find board edges.
-    result[kAuxPlaneBase + 7].SetAll();
+// Encodes position number @i from the end of @history into kPlanesPerBoard
+// @masks, from the point of view of the player to move in the last position.
+void EncodeBoard(const PositionHistory& history, int i, std::uint64_t* masks) {
+  const Position& position = history.GetPositionAt(history.GetLength() - 1 - i);
+  // Positions with the opponent to move are encoded from the opponent's
+  // point of view: with sides swapped, and mirrored below.
+  const bool flip = i % 2 == 1;
+  const ChessBoard& board = position.GetBoard();
+  std::uint64_t* const our_masks = flip ? masks + 6 : masks;
+  std::uint64_t* const their_masks = flip ? masks : masks + 6;
+
+  our_masks[0] = (board.ours() * board.pawns()).as_int();
+  our_masks[1] = (board.our_knights()).as_int();
+  our_masks[2] = (board.ours() * board.bishops()).as_int();
+  our_masks[3] = (board.ours() * board.rooks()).as_int();
+  our_masks[4] = (board.ours() * board.queens()).as_int();
+  our_masks[5] = (board.our_king()).as_int();
+
+  their_masks[0] = (board.theirs() * board.pawns()).as_int();
+  their_masks[1] = (board.their_knights()).as_int();
+  their_masks[2] = (board.theirs() * board.bishops()).as_int();
+  their_masks[3] = (board.theirs() * board.rooks()).as_int();
+  their_masks[4] = (board.theirs() * board.queens()).as_int();
+  their_masks[5] = (board.their_king()).as_int();
+
+  if (flip) {
+    for (int plane = 0; plane < 12; ++plane) {
+      BitBoard mirrored = masks[plane];
+      mirrored.Mirror();
+      masks[plane] = mirrored.as_int();
+    }
   }
 
-  bool flip = false;
-  int history_idx = history.GetLength() - 1;
-  for (int i = 0; i < std::min(history_planes, kMoveHistory);
-       ++i, flip = !flip, --history_idx) {
-    if (history_idx < 0) break;
-    const Position& position = history.GetPositionAt(history_idx);
-    const ChessBoard& board =
-        flip ? position.GetThemBoard() : position.GetBoard();
-
-    const int base = i * kPlanesPerBoard;
-    result[base + 0].mask = (board.ours() * board.pawns()).as_int();
-    result[base + 1].mask = (board.our_knights()).as_int();
-    result[base + 2].mask = (board.ours() * board.bishops()).as_int();
-    result[base + 3].mask = (board.ours() * board.rooks()).as_int();
-    result[base + 4].mask = (board.ours() * board.queens()).as_int();
-    result[base + 5].mask = (board.our_king()).as_int();
-
-    result[base + 6].mask = (board.theirs() * board.pawns()).as_int();
-    result[base + 7].mask = (board.their_knights()).as_int();
-    result[base + 8].mask = (board.theirs() * board.bishops()).as_int();
-    result[base + 9].mask = (board.theirs() * board.rooks()).as_int();
-    result[base + 10].mask = (board.theirs() * board.queens()).as_int();
-    result[base + 11].mask = (board.their_king()).as_int();
-
-    const int repetitions = position.GetRepetitions();
-    if (repetitions >= 1) result[base + 12].SetAll();
+  const int repetitions = position.GetRepetitions();
+  if (repetitions >= 1) masks[12] = ~0ull;
+}
+
+// Number of positions to encode.
+int GetBoardCount(const PositionHistory& history, int history_planes) {
+  return std::min({history_planes, kMoveHistory, history.GetLength()});
+}
+}  // namespace
+
+void EncodePositionForNN(const PositionHistory& history, int history_planes,
+                         InputPlanesRef out) {
+  EncodeAuxPlanes(history, out);
+  const int boards = GetBoardCount(history, history_planes);
+  for (int i = 0; i < boards; ++i) {
+    EncodeBoard(history, i, &out.masks[i * kPlanesPerBoard]);
   }
+}
 
+InputPlanes EncodePositionForNN(const PositionHistory& history,
+                                int history_planes) {
+  InputPlanes result;
+  EncodePositionForNN(history, history_planes, result.GetRef());
   return result;
 }
 
+void CachingPositionEncoder::Encode(const PositionHistory& history,
+                                    int history_planes, InputPlanesRef out) {
+  EncodeAuxPlanes(history, out);
+  const int boards = GetBoardCount(history, history_planes);
+  if (boards == 0) return;
+  EncodeBoard(history, 0, out.masks);
+  const int older = boards - 1;
+  if (older == 0) return;
+
+  // Older positions are the same for all positions after the same move
+  // sequence, so they are looked up by their hashes.
+  const int length = history.GetLength();
+  uint64_t hashes[kMoveHistory - 1];
+  for (int i = 0; i < older; ++i) {
+    hashes[i] = history.GetPositionAt(length - 2 - i).Hash();
+  }
+  Entry* entry = nullptr;
+  for (auto& candidate : entries_) {
+    if (candidate.length == length && candidate.boards == older &&
+        std::equal(hashes, hashes + older, candidate.hashes)) {
+      entry = &candidate;
+      break;
+    }
+  }
+  if (!entry) {
+    entry = &entries_[next_entry_];
+    next_entry_ = (next_entry_ + 1) % kEntries;
+    entry->length = length;
+    entry->boards = older;
+    std::copy(hashes, hashes + older, entry->hashes);
+    std::fill(std::begin(entry->masks), std::end(entry->masks), 0);
+    for (int i = 0; i < older; ++i) {
+      EncodeBoard(history, i + 1, &entry->masks[i * kPlanesPerBoard]);
+    }
+  }
+  std::copy(entry->masks, entry->masks + older * kPlanesPerBoard,
+            &out.masks[kPlanesPerBoard]);
+}
+
 }  // namespace lczero
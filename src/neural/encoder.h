@@ -32,8 +32,39 @@
 
 namespace lczero {
 
+// Number of positions encoded, and planes per position.
+constexpr int kMoveHistory = 8;
+constexpr int kPlanesPerBoard = 13;
+
 // Encodes the last position in history for the neural network request.
 InputPlanes EncodePositionForNN(const PositionHistory& history,
                                 int history_planes);
+// Same, but writes into planes @out, which have to be cleared (as returned by
+// NetworkComputation::AddInputInPlace()).
+void EncodePositionForNN(const PositionHistory& history, int history_planes,
+                         InputPlanesRef out);
+
+// Encodes positions like EncodePositionForNN() does, and remembers the planes
+// of older positions, which are the same for all positions reached by one
+// move from the same history. Search mostly encodes siblings one after another,
+// and then only the newest board is encoded. Not thread safe.
+class CachingPositionEncoder {
+ public:
+  // Writes into planes @out, which have to be cleared.
+  void Encode(const PositionHistory& history, int history_planes,
+              InputPlanesRef out);
+
+ private:
+  static constexpr int kEntries = 16;
+  struct Entry {
+    // Length of the history, and number of older positions and their hashes.
+    int length = 0;
+    int boards = 0;
+    uint64_t hashes[kMoveHistory - 1];
+    uint64_t masks[(kMoveHistory - 1) * kPlanesPerBoard];
+  };
+  Entry entries_[kEntries];
+  int next_entry_ = 0;
+};
 
 }  // namespace lczero
@@ -0,0 +1,86 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include <benchmark/benchmark.h>
+
+#include "chess/position.h"
+#include "neural/encoder.h"
+#include "utils/random.h"
+
+namespace lczero {
+namespace {
+
+// Plays random moves from the starting position, and returns the history
+// with @plies moves, or less if the game is over before.
+PositionHistory RandomGame(int plies) {
+  PositionHistory history;
+  ChessBoard board;
+  board.SetFromFen(ChessBoard::kStartingFen);
+  history.Reset(board, 0, 1);
+  for (int i = 0; i < plies; ++i) {
+    if (history.ComputeGameResult() != GameResult::UNDECIDED) break;
+    const MoveList moves = history.Last().GetBoard().GenerateLegalMoves();
+    history.Append(
+        moves[Random::Get().GetInt(0, static_cast<int>(moves.size()) - 1)]);
+  }
+  return history;
+}
+
+void BM_EncodePositionForNN(benchmark::State& state) {
+  const PositionHistory history = RandomGame(state.range(0));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(EncodePositionForNN(history, kMoveHistory));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+// Short games have fewer than kMoveHistory positions to encode.
+BENCHMARK(BM_EncodePositionForNN)->Arg(4)->Arg(40);
+
+// Encodes all children of a position, the way search does after expanding
+// a node, so that the encoder cache is hit.
+void BM_CachingPositionEncoder(benchmark::State& state) {
+  PositionHistory history = RandomGame(40);
+  const MoveList moves = history.Last().GetBoard().GenerateLegalMoves();
+  CachingPositionEncoder encoder;
+  InputPlanes planes;
+  for (auto _ : state) {
+    for (const Move move : moves) {
+      history.Append(move);
+      planes = InputPlanes();
+      encoder.Encode(history, kMoveHistory, planes.GetRef());
+      benchmark::DoNotOptimize(planes);
+      history.Pop();
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * moves.size());
+}
+BENCHMARK(BM_CachingPositionEncoder);
+
+}  // namespace
+}  // namespace lczero
+
+BENCHMARK_MAIN();
@@ -28,6 +28,9 @@
 #include "neural/factory.h"
 
 #include <algorithm>
+#include <chrono>
+#include <exception>
+#include <future>
 #include <iostream>
 
 namespace lczero {
@@ -42,6 +45,11 @@ NetworkFactory::Register::Register(const std::string& name, FactoryFunc factory,
   NetworkFactory::Get()->RegisterNetwork(name, factory, priority);
 }
 
+NetworkFactory::RegisterPrepare::RegisterPrepare(const std::string& name,
+                                                 PrepareFunc prepare) {
+  NetworkFactory::Get()->prepares_[name] = prepare;
+}
+
 void NetworkFactory::RegisterNetwork(const std::string& name,
                                      FactoryFunc factory, int priority) {
   factories_.emplace_back(name, factory, priority);
@@ -55,7 +63,7 @@ std::vector<std::string> NetworkFactory::GetBackendsList() const {
 }
 
 std::unique_ptr<Network> NetworkFactory::Create(const std::string& network,
-                                                const Weights& weights,
+                                                const WeightsPtr& weights,
                                                 const OptionsDict& options) {
   std::cerr << "Creating backend [" << network << "]..." << std::endl;
   for (const auto& factory : factories_) {
@@ -66,4 +74,45 @@ std::unique_ptr<Network> NetworkFactory::Create(const std::string& network,
   throw Exception("Unknown backend: " + network);
 }
 
+namespace {
+int64_t MillisecondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+}  // namespace
+
+std::unique_ptr<Network> NetworkFactory::LoadAndCreate(
+    const std::string& network,
+    const std::function<WeightsPtr()>& load_weights,
+    const OptionsDict& options) {
+  const auto start = std::chrono::steady_clock::now();
+  int64_t prepare_ms = 0;
+  auto prepared = std::async(std::launch::async, [&]() {
+    Prepare(network, options);
+    prepare_ms = MillisecondsSince(start);
+  });
+  const auto weights = load_weights();
+  std::cerr << "Weights loading took " << MillisecondsSince(start) << "ms."
+            << std::endl;
+  try {
+    prepared.get();
+    std::cerr << "Backend preparation took " << prepare_ms
+              << "ms, in parallel." << std::endl;
+  } catch (const std::exception&) {
+    // The error shows up again when the backend is created.
+  }
+  const auto create_start = std::chrono::steady_clock::now();
+  auto result = Create(network, weights, options);
+  std::cerr << "Backend creation took " << MillisecondsSince(create_start)
+            << "ms." << std::endl;
+  return result;
+}
+
+void NetworkFactory::Prepare(const std::string& network,
+                             const OptionsDict& options) {
+  const auto iter = prepares_.find(network);
+  if (iter != prepares_.end()) iter->second(options);
+}
+
 }  // namespace lczero
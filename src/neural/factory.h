@@ -28,6 +28,7 @@
 #pragma once
 
 #include <functional>
+#include <map>
 #include <string>
 #include "neural/network.h"
 #include "utils/optionsdict.h"
@@ -37,7 +38,8 @@ namespace lczero {
 class NetworkFactory {
  public:
   using FactoryFunc = std::function<std::unique_ptr<Network>(
-      const Weights&, const OptionsDict&)>;
+      const WeightsPtr&, const OptionsDict&)>;
+  using PrepareFunc = std::function<void(const OptionsDict&)>;
 
   static NetworkFactory* Get();
 
@@ -51,12 +53,29 @@ class NetworkFactory {
     Register(const std::string& name, FactoryFunc factory, int priority = 0);
   };
 
+  // Registers preparation of a backend: initialization which doesn't need
+  // weights (such as of devices), done while the weights are loaded.
+  class RegisterPrepare {
+   public:
+    RegisterPrepare(const std::string& name, PrepareFunc prepare);
+  };
+
   // Returns list of backend names, sorted by priority (higher priority first).
   std::vector<std::string> GetBackendsList() const;
 
   // Creates a backend given name and config.
-  std::unique_ptr<Network> Create(const std::string& network, const Weights&,
+  std::unique_ptr<Network> Create(const std::string& network,
+                                  const WeightsPtr& weights,
                                   const OptionsDict& options);
+  // Same, with weights returned by @load_weights, which is called while the
+  // backend is prepared. Reports time taken by the stages.
+  std::unique_ptr<Network> LoadAndCreate(
+      const std::string& network,
+      const std::function<WeightsPtr()>& load_weights,
+      const OptionsDict& options);
+
+  // Runs preparation of backend @network, if it has one.
+  void Prepare(const std::string& network, const OptionsDict& options);
 
  private:
   void RegisterNetwork(const std::string& name, FactoryFunc factory,
@@ -79,14 +98,16 @@ class NetworkFactory {
   };
 
   std::vector<Factory> factories_;
+  std::map<std::string, PrepareFunc> prepares_;
   friend class Register;
+  friend class RegisterPrepare;
 };
 
 #define REGISTER_NETWORK_WITH_COUNTER2(name, cls, priority, counter) \
   namespace {                                                        \
   static NetworkFactory::Register regH38fhs##counter(                \
       name,                                                          \
-      [](const Weights& w, const OptionsDict& o) {                   \
+      [](const WeightsPtr& w, const OptionsDict& o) {                \
         return std::make_unique<cls>(w, o);                          \
       },                                                             \
       priority);                                                     \
@@ -94,13 +115,25 @@ class NetworkFactory {
 #define REGISTER_NETWORK_WITH_COUNTER(name, cls, priority, counter) \
   REGISTER_NETWORK_WITH_COUNTER2(name, cls, priority, counter)
 
+#define REGISTER_NETWORK_PREPARE_WITH_COUNTER2(name, func, counter)      \
+  namespace {                                                            \
+  static NetworkFactory::RegisterPrepare regP38fhs##counter(name, func); \
+  }
+#define REGISTER_NETWORK_PREPARE_WITH_COUNTER(name, func, counter) \
+  REGISTER_NETWORK_PREPARE_WITH_COUNTER2(name, func, counter)
+
 // Registers a Network.
 // Constructor of a network class must have parameters:
-// (const Weights& w, const OptionsDict& o)
+// (const WeightsPtr& w, const OptionsDict& o)
 // @name -- name under which the backend will be known in configs.
 // @cls -- class name of a backend.
 // @priority -- numeric priority of a backend. Higher is higher, highest number
 // is the default backend.
 #define REGISTER_NETWORK(name, cls, priority) \
   REGISTER_NETWORK_WITH_COUNTER(name, cls, priority, __LINE__)
+
+// Registers preparation of the backend @name, function @func with parameter
+// (const OptionsDict& o), which gets the options the backend is created with.
+#define REGISTER_NETWORK_PREPARE(name, func) \
+  REGISTER_NETWORK_PREPARE_WITH_COUNTER(name, func, __LINE__)
 }  // namespace lczero
@@ -46,6 +46,11 @@ FloatVectors LoadFloatsFromFile(std::string* buffer);
 // Read v2 weights file and fill the weights structure.
 Weights LoadWeightsFromFile(const std::string& filename);
 
+// Writes @weights in uncompressed binary format, which LoadWeightsFromFile()
+// maps rather than parses. Floats are stored in native byte order.
+void SaveWeightsToBinaryFile(const Weights& weights,
+                             const std::string& filename);
+
 // Tries to find a file which looks like a weights file, and located in
 // directory of binary_name or one of subdirectories. If there are several such
 // files, returns one which has the latest modification date.
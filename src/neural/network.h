@@ -27,6 +27,10 @@
 
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
 #include <memory>
 #include <vector>
 
@@ -67,40 +71,145 @@ struct Weights {
   Vec ip2_val_b;
 };
 
+// Weights are loaded once and shared, unmodified, by all networks created
+// from them.
+using WeightsPtr = std::shared_ptr<const Weights>;
+
 // All input planes are 64 value vectors, every element of which is either
 // 0 or some value, unique for the plane. Therefore, input is defined as
 // a bitmask showing where to set the value, and the value itself.
-struct InputPlane {
-  InputPlane() = default;
-  void SetAll() { mask = ~0ull; }
-  void Fill(float val) {
-    SetAll();
-    value = val;
+// InputPlanesRef points to planes of a sample in the input buffer of a
+// computation. Masks and values are separate arrays of kInputPlanes elements
+// each, so that the buffer of the whole batch can be passed to a device as is.
+struct InputPlanesRef {
+  std::uint64_t* masks;
+  float* values;
+};
+
+// Planes of a sample stored by value, of fixed size so that they are never
+// allocated. Cleared on construction (no bits set and value of 1).
+struct InputPlanes {
+  InputPlanes() { std::fill(std::begin(values), std::end(values), 1.0f); }
+  InputPlanesRef GetRef() { return {masks, values}; }
+
+  std::uint64_t masks[kInputPlanes] = {};
+  float values[kInputPlanes];
+};
+
+// Contiguous input buffer of a batch, for backends which don't have a buffer
+// of their own.
+class InputBatch {
+ public:
+  // Appends a sample with cleared planes (no bits set and value of 1). The
+  // returned planes are valid until the next call.
+  InputPlanesRef Add() {
+    masks_.resize(masks_.size() + kInputPlanes, 0);
+    values_.resize(values_.size() + kInputPlanes, 1.0f);
+    return {&masks_[masks_.size() - kInputPlanes],
+            &values_[values_.size() - kInputPlanes]};
+  }
+  int GetSize() const { return masks_.size() / kInputPlanes; }
+  const std::uint64_t* GetMasks(int sample) const {
+    return &masks_[sample * kInputPlanes];
+  }
+  const float* GetValues(int sample) const {
+    return &values_[sample * kInputPlanes];
   }
-  std::uint64_t mask = 0ull;
-  float value = 1.0f;
+  // Copies planes of @sample to @out.
+  void CopyTo(int sample, InputPlanesRef out) const {
+    std::memcpy(out.masks, GetMasks(sample), kInputPlanes * sizeof(*out.masks));
+    std::memcpy(out.values, GetValues(sample),
+                kInputPlanes * sizeof(*out.values));
+  }
+
+ private:
+  std::vector<std::uint64_t> masks_;
+  std::vector<float> values_;
 };
-using InputPlanes = std::vector<InputPlane>;
 
 // An interface to implement by computing backends.
 class NetworkComputation {
  public:
-  // Adds a sample to the batch.
-  virtual void AddInput(InputPlanes&& input) = 0;
+  // Adds a sample to the batch and returns its planes, cleared (no bits set
+  // and value of 1), for the caller to write the input into. The planes are
+  // owned by the computation and are valid until the next sample is added.
+  virtual InputPlanesRef AddInputInPlace() = 0;
+  // Adds a sample to the batch, copying it from @input.
+  void AddInput(const InputPlanes& input) {
+    const InputPlanesRef planes = AddInputInPlace();
+    std::memcpy(planes.masks, input.masks, sizeof(input.masks));
+    std::memcpy(planes.values, input.values, sizeof(input.values));
+  }
+  // Same as AddInputInPlace(), for a sample of which only P values of the
+  // @count moves @move_ids (copied) will be asked for. Backends may then
+  // compute the softmax over those moves only and not keep the rest of the
+  // policy, so P values of other moves are 0.
+  virtual InputPlanesRef AddInputForMoves(const std::uint16_t* /*move_ids*/,
+                                          int /*count*/) {
+    return AddInputInPlace();
+  }
+  // Computations of higher priority are computed first by backends which
+  // queue them from several threads (multiplexing). 0 is background work,
+  // 1 (the default) is interactive.
+  virtual void SetPriority(int /*priority*/) {}
+  // Makes P values the softmax of policy logits divided by @temp. Only called
+  // (before any input is added) if Network::SupportsPolicySoftmaxTemp().
+  virtual void SetPolicySoftmaxTemp(float /*temp*/) {}
   // Do the computation.
   virtual void ComputeBlocking() = 0;
-  // Returns how many times AddInput() was called.
+  // Returns how many samples were added.
   virtual int GetBatchSize() const = 0;
   // Returns Q value of @sample.
   virtual float GetQVal(int sample) const = 0;
   // Returns P value @move_id of @sample.
   virtual float GetPVal(int sample, int move_id) const = 0;
+  // Writes P values of @count moves @move_ids of @sample into @out. Backends
+  // which have the policy of a sample in one array should override it, to
+  // avoid a virtual call per move.
+  virtual void GetPVals(int sample, const std::uint16_t* move_ids, int count,
+                        float* out) const {
+    for (int i = 0; i < count; ++i) out[i] = GetPVal(sample, move_ids[i]);
+  }
   virtual ~NetworkComputation() {}
 };
 
+// How busy a backend is, counted since it was created.
+struct NetworkLoad {
+  // Batches computed, samples in them, and how many samples they could hold.
+  std::int64_t batches = 0;
+  std::int64_t samples = 0;
+  std::int64_t capacity = 0;
+  // Time spent computing batches, summed over the threads which compute them.
+  double busy_seconds = 0;
+  int threads = 0;
+};
+
 class Network {
  public:
   virtual std::unique_ptr<NetworkComputation> NewComputation() = 0;
+  // Backends which batch computations of many searches (multiplexing) fill
+  // @load and return true. Others return false.
+  virtual bool GetLoad(NetworkLoad* /*load*/) const { return false; }
+  // Batches of a multiple of this size are computed most efficiently. Search
+  // tries to shape its batches accordingly.
+  virtual int GetPreferredBatchStep() const { return 1; }
+  // Whether computations apply policy softmax temperature themselves, see
+  // NetworkComputation::SetPolicySoftmaxTemp().
+  virtual bool SupportsPolicySoftmaxTemp() const { return false; }
+  // NUMA node closest to the device computing the batches, -1 if there's
+  // none in particular.
+  virtual int GetNumaNode() const { return -1; }
+  // Computes dummy batches of up to @max_batch samples, so that one-time
+  // costs of the backend (algorithm selection, kernel builds, page-in of the
+  // weights) are not paid by the first search.
+  virtual void Warmup(int max_batch) {
+    for (const int size : {1, max_batch}) {
+      auto computation = NewComputation();
+      for (int i = 0; i < size; ++i) computation->AddInputInPlace();
+      computation->ComputeBlocking();
+      if (max_batch <= 1) break;
+    }
+  }
   virtual ~Network(){};
 };
 
@@ -62,14 +62,18 @@ class CheckComputation : public NetworkComputation {
         work_comp_(std::move(work_comp)),
         check_comp_(std::move(check_comp)) {}
 
-  void AddInput(InputPlanes&& input) override {
-    InputPlanes x = input;
-    InputPlanes y = input;
-    work_comp_->AddInput(std::move(x));
-    check_comp_->AddInput(std::move(y));
+  InputPlanesRef AddInputInPlace() override { return planes_.Add(); }
+
+  void SetPolicySoftmaxTemp(float temp) override {
+    work_comp_->SetPolicySoftmaxTemp(temp);
+    check_comp_->SetPolicySoftmaxTemp(temp);
   }
 
   void ComputeBlocking() override {
+    for (int i = 0; i < planes_.GetSize(); ++i) {
+      planes_.CopyTo(i, work_comp_->AddInputInPlace());
+      planes_.CopyTo(i, check_comp_->AddInputInPlace());
+    }
     work_comp_->ComputeBlocking();
     check_comp_->ComputeBlocking();
     switch (params_.mode) {
@@ -85,9 +89,7 @@ class CheckComputation : public NetworkComputation {
     }
   }
 
-  int GetBatchSize() const override {
-    return static_cast<int>(work_comp_->GetBatchSize());
-  }
+  int GetBatchSize() const override { return planes_.GetSize(); }
 
   float GetQVal(int sample) const override {
     return work_comp_->GetQVal(sample);
@@ -97,6 +99,11 @@ class CheckComputation : public NetworkComputation {
     return work_comp_->GetPVal(sample, move_id);
   }
 
+  void GetPVals(int sample, const uint16_t* move_ids, int count,
+                float* out) const override {
+    work_comp_->GetPVals(sample, move_ids, count, out);
+  }
+
  private:
   static constexpr int kNumOutputPolicies = 1858;
   const CheckParams& params_;
@@ -221,6 +228,7 @@ class CheckComputation : public NetworkComputation {
     policy_error.Dump("  policy");
   }
 
+  InputBatch planes_;
   std::unique_ptr<NetworkComputation> work_comp_;
   std::unique_ptr<NetworkComputation> check_comp_;
 };
@@ -232,7 +240,7 @@ class CheckNetwork : public Network {
   static constexpr double kDefaultAbsoluteTolerance = 1e-5;
   static constexpr double kDefaultRelativeTolerance = 1e-4;
 
-  CheckNetwork(const Weights& weights, const OptionsDict& options) {
+  CheckNetwork(const WeightsPtr& weights, const OptionsDict& options) {
     params_.mode = kDefaultMode;
     params_.absolute_tolerance = kDefaultAbsoluteTolerance;
     params_.relative_tolerance = kDefaultRelativeTolerance;
@@ -320,6 +328,16 @@ class CheckNetwork : public Network {
     return work_net_->NewComputation();
   }
 
+  int GetPreferredBatchStep() const override {
+    return work_net_->GetPreferredBatchStep();
+  }
+
+  // Both networks have to apply it, so that their results are comparable.
+  bool SupportsPolicySoftmaxTemp() const override {
+    return work_net_->SupportsPolicySoftmaxTemp() &&
+           check_net_->SupportsPolicySoftmaxTemp();
+  }
+
  private:
   CheckParams params_;
 
@@ -24,14 +24,26 @@
   terms of the respective license agreement, the licensors of this
   Program grant you additional permission to convey the resulting work.
 */
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
 #include <functional>
+#include <iomanip>
+#include <iostream>
 #include <list>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <thread>
+#include "neural/cuda_common.h"
 #include "neural/factory.h"
+#include "neural/shared_weights.h"
 #include "utils/bititer.h"
 #include "utils/exception.h"
+#include "utils/numa.h"
+#include "utils/string.h"
 
 #include <cublas_v2.h>
 #include <cudnn.h>
@@ -39,6 +51,11 @@
 
 //#define DEBUG_RAW_NPS
 
+// Stream capture into CUDA graphs, as used here, needs CUDA 10.1.
+#if CUDART_VERSION >= 10010
+#define LC0_CUDA_GRAPHS
+#endif
+
 namespace lczero {
 namespace {
 
@@ -86,18 +103,23 @@ void CublasError(cublasStatus_t status, const char *file, const int &line) {
   }
 }
 
-void CudaError(cudaError_t status, const char *file, const int &line) {
-  if (status != cudaSuccess) {
-    char message[128];
-    sprintf(message, "CUDA error: %s (%s:%d) ", cudaGetErrorString(status),
-            file, line);
-    throw Exception(message);
-  }
-}
-
 #define ReportCUDNNErrors(status) CudnnError(status, __FILE__, __LINE__)
 #define ReportCUBLASErrors(status) CublasError(status, __FILE__, __LINE__)
-#define ReportCUDAErrors(status) CudaError(status, __FILE__, __LINE__)
+
+// Tensor descriptor owned by a scope. Layers describe their input and output
+// in Eval() instead of keeping descriptors, as the batch size changes and
+// several batches can be evaluated at the same time.
+class ScopedTensorDescriptor {
+ public:
+  ScopedTensorDescriptor() {
+    ReportCUDNNErrors(cudnnCreateTensorDescriptor(&desc_));
+  }
+  ~ScopedTensorDescriptor() { cudnnDestroyTensorDescriptor(desc_); }
+  operator cudnnTensorDescriptor_t() const { return desc_; }
+
+ private:
+  cudnnTensorDescriptor_t desc_;
+};
 
 // Hard-coded for now, no point in going above this anyway (can possibly save
 // memory by reducing this).
@@ -162,8 +184,6 @@ class ConvLayer : public BaseLayer<DataType> {
   cudnnConvolutionFwdAlgo_t conv_algo_;
 
   cudnnTensorDescriptor_t bias_desc_;
-  cudnnTensorDescriptor_t in_tensor_desc_;
-  cudnnTensorDescriptor_t out_tensor_desc_;
   cudnnActivationDescriptor_t activation_;
 };
 
@@ -178,9 +198,6 @@ class SoftMaxLayer : public BaseLayer<DataType> {
   void Eval(int N, DataType *output, const DataType *input,
             const DataType *input2, void *scratch, size_t scratch_size,
             cudnnHandle_t cudnn, cublasHandle_t cublas) override;
-
- private:
-  cudnnTensorDescriptor_t out_tensor_desc_;
 };
 
 template <typename DataType>
@@ -230,8 +247,6 @@ class FCLayer : public BaseLayer<DataType> {
 //  2. output of the layer
 //  3. data from old layer for skip connection
 
-int DivUp(int a, int b) { return (a + b - 1) / b; }
-
 /////////////////////////////////////////////////////////////////////////////
 //          Simple CUDA kernels used by certain layers                     //
 /////////////////////////////////////////////////////////////////////////////
@@ -267,12 +282,12 @@ __global__ void addVectors_kernel(T *c, T *a, T *b, int size, int asize,
 // activation.
 template <typename T>
 void addVectors(T *c, T *a, T *b, int size, int asize, int bsize, bool relu,
-                bool use_tanh) {
+                bool use_tanh, cudaStream_t stream) {
   const int kBlockSize = 256;
   int blocks = DivUp(size, kBlockSize);
 
-  addVectors_kernel<<<blocks, kBlockSize>>>(c, a, b, size, asize, bsize, relu,
-                                            use_tanh);
+  addVectors_kernel<<<blocks, kBlockSize, 0, stream>>>(c, a, b, size, asize,
+                                                       bsize, relu, use_tanh);
   ReportCUDAErrors(cudaGetLastError());
 }
 
@@ -332,10 +347,28 @@ __global__ void copyTypeConverted_kernel(DstType *op, SrcType *ip, int N) {
 }
 
 template <typename DstType, typename SrcType>
-void copyTypeConverted(DstType *op, SrcType *ip, int N) {
+void copyTypeConverted(DstType *op, SrcType *ip, int N,
+                       cudaStream_t stream = 0) {
   const int kBlockSize = 256;
   int blocks = DivUp(N, kBlockSize);
-  copyTypeConverted_kernel<<<blocks, kBlockSize>>>(op, ip, N);
+  copyTypeConverted_kernel<<<blocks, kBlockSize, 0, stream>>>(op, ip, N);
+}
+
+template <typename T>
+__global__ void scaleVector_kernel(T *data, float scale, int N) {
+  int tid = blockIdx.x * blockDim.x + threadIdx.x;
+
+  if (tid >= N) return;
+
+  data[tid] = (T)((float)data[tid] * scale);
+}
+
+// Multiplies @N elements of @data by @scale, in place.
+template <typename T>
+void scaleVector(T *data, float scale, int N, cudaStream_t stream = 0) {
+  const int kBlockSize = 256;
+  int blocks = DivUp(N, kBlockSize);
+  scaleVector_kernel<<<blocks, kBlockSize, 0, stream>>>(data, scale, N);
 }
 
 template <typename T>
@@ -370,102 +403,24 @@ __global__ void batchNormForward_kernel(T *output, const T *input,
 template <typename T>
 void batchNormForward(T *output, const T *input, const T *skipInput, int N,
                       int C, int H, int W, float *means, float *var_multipliers,
-                      bool relu) {
+                      bool relu, cudaStream_t stream) {
   const int total_elements = N * C * H * W;
   const int kBlockSize = 256;
   int blocks = DivUp(total_elements, kBlockSize);
 
-  batchNormForward_kernel<<<blocks, kBlockSize>>>(
+  batchNormForward_kernel<<<blocks, kBlockSize, 0, stream>>>(
       output, input, skipInput, N, C, H, W, means, var_multipliers, relu);
 
   ReportCUDAErrors(cudaGetLastError());
 }
 
-__global__ void expandPlanes_kernel_Fp32_NCHW(float *output,
-                                              const uint64_t *masks,
-                                              const float *values, int n) {
-  // Block size of 256, same mask/val for 64 consecutive threads.
-  constexpr int kNumShmemElments = 256 / 64;
-
-  __shared__ uint64_t shMasks[kNumShmemElments];
-  __shared__ float shVals[kNumShmemElments];
-
-  int index = threadIdx.x + blockDim.x * blockIdx.x;
-
-  int planeIndex = index >> 6;
-
-  if (planeIndex >= n) return;
-
-  // load inputs to shared memory.
-  if (threadIdx.x < kNumShmemElments) {
-    shMasks[threadIdx.x] = masks[planeIndex + threadIdx.x];
-    shVals[threadIdx.x] = values[planeIndex + threadIdx.x];
-  }
-  __syncthreads();
-
-  uint64_t mask = shMasks[threadIdx.x >> 6];
-
-  int sqIndex = index & 0x3F;
-  float op = 0;
-
-  bool set = !!(mask & (1ull << sqIndex));
-  if (set) {
-    op = shVals[threadIdx.x >> 6];
-  }
-  output[index] = op;
-}
-
-void expandPlanes_Fp32_NCHW(float *output, const uint64_t *masks,
-                            const float *values, int n) {
-  int threads = n * 8 * 8;  // Each thread writes a single element.
-  const int blockSize = 256;
-  int blocks = DivUp(threads, blockSize);
-  expandPlanes_kernel_Fp32_NCHW<<<blocks, blockSize>>>(output, masks, values,
-                                                       n);
-  ReportCUDAErrors(cudaGetLastError());
-}
-
-// TODO: Can optimize using shared memory if this becomes a bottleneck.
-__global__ void expandPlanes_kernel_Fp16_NHWC(half *output,
-                                              const uint64_t *masks,
-                                              const float *values, int n) {
-  const int index = threadIdx.x + blockDim.x * blockIdx.x;
-  if (index >= n * 8 * 8) return;
-
-  const int planeIndex = index % kInputPlanes;
-  const int boardIndex = index / (kInputPlanes * 8 * 8);
-  const int sqIndex = (index / kInputPlanes) & 0x3F;
-
-  uint64_t mask = masks[boardIndex * kInputPlanes + planeIndex];
-
-  half op = 0;
-  bool set = !!(mask & (1ull << sqIndex));
-  if (set) {
-    float val = values[boardIndex * kInputPlanes + planeIndex];
-    op = (half)val;
-  }
-  output[index] = op;
-}
-
-void expandPlanes_Fp16_NHWC(half *output, const uint64_t *masks,
-                            const float *values, int n) {
-  int threads = n * 8 * 8;  // Each thread writes a single element.
-  const int kBlockSize = 256;
-  int blocks = DivUp(threads, kBlockSize);
-  expandPlanes_kernel_Fp16_NHWC<<<blocks, kBlockSize>>>(output, masks, values,
-                                                        n);
-  ReportCUDAErrors(cudaGetLastError());
-}
-
 template <typename DataType>
 BaseLayer<DataType>::BaseLayer(int c, int h, int w, BaseLayer *ip)
     : C(c), H(h), W(w), input_(ip) {}
 
 template <typename DataType>
 SoftMaxLayer<DataType>::SoftMaxLayer(BaseLayer<DataType> *ip)
-    : BaseLayer<DataType>(ip->GetC(), ip->GetH(), ip->GetW(), ip) {
-  cudnnCreateTensorDescriptor(&out_tensor_desc_);
-}
+    : BaseLayer<DataType>(ip->GetC(), ip->GetH(), ip->GetW(), ip) {}
 
 template <typename DataType>
 void SoftMaxLayer<DataType>::Eval(int N, DataType *output,
@@ -475,17 +430,18 @@ void SoftMaxLayer<DataType>::Eval(int N, DataType *output,
   float alpha = 1.0f, beta = 0.0f;
 
   // Need to call this at Eval as 'N' changes :-/
+  ScopedTensorDescriptor out_tensor_desc;
   if (std::is_same<half, DataType>::value) {
-    cudnnSetTensor4dDescriptor(out_tensor_desc_, CUDNN_TENSOR_NHWC,
+    cudnnSetTensor4dDescriptor(out_tensor_desc, CUDNN_TENSOR_NHWC,
                                CUDNN_DATA_HALF, N, GetC(), GetH(), GetW());
   } else {
-    cudnnSetTensor4dDescriptor(out_tensor_desc_, CUDNN_TENSOR_NCHW,
+    cudnnSetTensor4dDescriptor(out_tensor_desc, CUDNN_TENSOR_NCHW,
                                CUDNN_DATA_FLOAT, N, GetC(), GetH(), GetW());
   }
 
   cudnnSoftmaxForward(cudnn, CUDNN_SOFTMAX_ACCURATE,
-                      CUDNN_SOFTMAX_MODE_INSTANCE, &alpha, out_tensor_desc_,
-                      input, &beta, out_tensor_desc_, output);
+                      CUDNN_SOFTMAX_MODE_INSTANCE, &alpha, out_tensor_desc,
+                      input, &beta, out_tensor_desc, output);
 }
 
 template <typename DataType>
@@ -508,8 +464,6 @@ ConvLayer<DataType>::ConvLayer(BaseLayer<DataType> *ip, int C, int H, int W,
   // Create cudnn objects for various tensors, algorithms, etc.
   cudnnCreateFilterDescriptor(&filter_desc_);
   cudnnCreateConvolutionDescriptor(&conv_desc_);
-  cudnnCreateTensorDescriptor(&out_tensor_desc_);
-  cudnnCreateTensorDescriptor(&in_tensor_desc_);
   cudnnCreateTensorDescriptor(&bias_desc_);
   cudnnCreateActivationDescriptor(&activation_);
 
@@ -596,32 +550,34 @@ void ConvLayer<DataType>::Eval(int N, DataType *output, const DataType *input,
                                cublasHandle_t cublas) {
   const bool fp16 = std::is_same<half, DataType>::value;
 
+  ScopedTensorDescriptor out_tensor_desc;
+  ScopedTensorDescriptor in_tensor_desc;
   ReportCUDNNErrors(cudnnSetTensor4dDescriptor(
-      out_tensor_desc_, fp16 ? CUDNN_TENSOR_NHWC : CUDNN_TENSOR_NCHW,
+      out_tensor_desc, fp16 ? CUDNN_TENSOR_NHWC : CUDNN_TENSOR_NCHW,
       fp16 ? CUDNN_DATA_HALF : CUDNN_DATA_FLOAT, N, C, H, W));
 
   ReportCUDNNErrors(cudnnSetTensor4dDescriptor(
-      in_tensor_desc_, fp16 ? CUDNN_TENSOR_NHWC : CUDNN_TENSOR_NCHW,
+      in_tensor_desc, fp16 ? CUDNN_TENSOR_NHWC : CUDNN_TENSOR_NCHW,
       fp16 ? CUDNN_DATA_HALF : CUDNN_DATA_FLOAT, N, c_input_, H, W));
 
   float alpha = 1.0f, beta = 0.0f;
 
   if (!(use_relu_ || use_bias_)) {
     ReportCUDNNErrors(cudnnConvolutionForward(
-        cudnn, &alpha, in_tensor_desc_, input, filter_desc_, weights,
-        conv_desc_, conv_algo_, scratch, scratch_size, &beta, out_tensor_desc_,
+        cudnn, &alpha, in_tensor_desc, input, filter_desc_, weights,
+        conv_desc_, conv_algo_, scratch, scratch_size, &beta, out_tensor_desc,
         output));
   } else if (input2) {
     // fused bias + sum + relu!
     ReportCUDNNErrors(cudnnConvolutionBiasActivationForward(
-        cudnn, &alpha, in_tensor_desc_, input, filter_desc_, weights,
-        conv_desc_, conv_algo_, scratch, scratch_size, &alpha, out_tensor_desc_,
-        input2, bias_desc_, biases, activation_, out_tensor_desc_, output));
+        cudnn, &alpha, in_tensor_desc, input, filter_desc_, weights,
+        conv_desc_, conv_algo_, scratch, scratch_size, &alpha, out_tensor_desc,
+        input2, bias_desc_, biases, activation_, out_tensor_desc, output));
   } else {
     ReportCUDNNErrors(cudnnConvolutionBiasActivationForward(
-        cudnn, &alpha, in_tensor_desc_, input, filter_desc_, weights,
-        conv_desc_, conv_algo_, scratch, scratch_size, &beta, out_tensor_desc_,
-        output, bias_desc_, biases, activation_, out_tensor_desc_, output));
+        cudnn, &alpha, in_tensor_desc, input, filter_desc_, weights,
+        conv_desc_, conv_algo_, scratch, scratch_size, &beta, out_tensor_desc,
+        output, bias_desc_, biases, activation_, out_tensor_desc, output));
   }
 }
 
@@ -654,8 +610,10 @@ template <>
 void BNLayer<half>::Eval(int N, half *output, const half *input,
                          const half *input2, void *scratch, size_t scratch_size,
                          cudnnHandle_t cudnn, cublasHandle_t cublas) {
+  cudaStream_t stream;
+  ReportCUDNNErrors(cudnnGetStream(cudnn, &stream));
   batchNormForward(output, input, input2, N, C, H, W, means_, variances_,
-                   use_relu_);
+                   use_relu_, stream);
 }
 
 template <>
@@ -663,8 +621,10 @@ void BNLayer<float>::Eval(int N, float *output, const float *input,
                           const float *input2, void *scratch,
                           size_t scratch_size, cudnnHandle_t cudnn,
                           cublasHandle_t cublas) {
+  cudaStream_t stream;
+  ReportCUDNNErrors(cudnnGetStream(cudnn, &stream));
   batchNormForward(output, input, input2, N, C, H, W, means_, variances_,
-                   use_relu_);
+                   use_relu_, stream);
 }
 
 template <typename DataType>
@@ -845,8 +805,10 @@ void FCLayer<half>::Eval(int N, half *output_tensor, const half *input_tensor,
                                  num_outputs));
 
   if (use_bias_ || use_relu_ || use_tanh_) {
+    cudaStream_t stream;
+    ReportCUBLASErrors(cublasGetStream(cublas, &stream));
     addVectors(output_tensor, biases_, output_tensor, num_outputs * N,
-               num_outputs, num_outputs * N, use_relu_, use_tanh_);
+               num_outputs, num_outputs * N, use_relu_, use_tanh_, stream);
   }
 }
 
@@ -865,8 +827,10 @@ void FCLayer<float>::Eval(int N, float *output_tensor,
                                  num_outputs));
 
   if (use_bias_ || use_relu_ || use_tanh_) {
+    cudaStream_t stream;
+    ReportCUBLASErrors(cublasGetStream(cublas, &stream));
     addVectors(output_tensor, biases_, output_tensor, num_outputs * N,
-               num_outputs, num_outputs * N, use_relu_, use_tanh_);
+               num_outputs, num_outputs * N, use_relu_, use_tanh_, stream);
   }
 }
 
@@ -876,28 +840,31 @@ FCLayer<DataType>::~FCLayer() {
   ReportCUDAErrors(cudaFree(biases_));
 }
 
+// Pinned host buffers which GPUs read inputs from and write outputs to
+// directly. They are portable, so that a batch can be evaluated on any of the
+// GPUs of the backend.
 struct InputsOutputs {
   InputsOutputs() {
     ReportCUDAErrors(cudaHostAlloc(
         &input_masks_mem_, kMaxBatchSize * kInputPlanes * sizeof(uint64_t),
-        cudaHostAllocMapped));
+        cudaHostAllocMapped | cudaHostAllocPortable));
     ReportCUDAErrors(
         cudaHostGetDevicePointer(&input_masks_mem_gpu_, input_masks_mem_, 0));
 
-    ReportCUDAErrors(cudaHostAlloc(&input_val_mem_,
-                                   kMaxBatchSize * kInputPlanes * sizeof(float),
-                                   cudaHostAllocMapped));
+    ReportCUDAErrors(cudaHostAlloc(
+        &input_val_mem_, kMaxBatchSize * kInputPlanes * sizeof(float),
+        cudaHostAllocMapped | cudaHostAllocPortable));
     ReportCUDAErrors(
         cudaHostGetDevicePointer(&input_val_mem_gpu_, input_val_mem_, 0));
 
     ReportCUDAErrors(cudaHostAlloc(
         &op_policy_mem_, kMaxBatchSize * kNumOutputPolicy * sizeof(float),
-        cudaHostAllocMapped));
+        cudaHostAllocMapped | cudaHostAllocPortable));
     ReportCUDAErrors(
         cudaHostGetDevicePointer(&op_policy_mem_gpu_, op_policy_mem_, 0));
 
-    ReportCUDAErrors(cudaHostAlloc(
-        &op_value_mem_, kMaxBatchSize * sizeof(float), cudaHostAllocMapped));
+    ReportCUDAErrors(cudaHostAlloc(&op_value_mem_, kMaxBatchSize * sizeof(float),
+                                   cudaHostAllocMapped | cudaHostAllocPortable));
     ReportCUDAErrors(
         cudaHostGetDevicePointer(&op_value_mem_gpu_, op_value_mem_, 0));
   }
@@ -919,6 +886,70 @@ struct InputsOutputs {
   float *op_value_mem_gpu_;
 };
 
+// Stream, handles and activation buffers for evaluating one batch. Batches
+// evaluated with different contexts run concurrently on the GPU.
+template <typename DataType>
+struct ExecutionContext {
+  ExecutionContext(size_t tensor_size, size_t scratch_size, bool fp16,
+                   bool use_graphs) {
+    ReportCUDAErrors(
+        cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking));
+    ReportCUDNNErrors(cudnnCreate(&cudnn));
+    ReportCUDNNErrors(cudnnSetStream(cudnn, stream));
+    ReportCUBLASErrors(cublasCreate(&cublas));
+    ReportCUBLASErrors(cublasSetStream(cublas, stream));
+    // Enable Tensor cores!
+    if (fp16) {
+      ReportCUBLASErrors(cublasSetMathMode(cublas, CUBLAS_TENSOR_OP_MATH));
+    }
+    for (auto &mem : tensor_mem) {
+      ReportCUDAErrors(cudaMalloc(&mem, tensor_size));
+      ReportCUDAErrors(cudaMemset(mem, 0, tensor_size));
+    }
+    ReportCUDAErrors(cudaMalloc(&scratch_mem, scratch_size));
+    if (use_graphs) {
+      ReportCUDAErrors(cudaMalloc(
+          &input_masks, kMaxBatchSize * kInputPlanes * sizeof(uint64_t)));
+      ReportCUDAErrors(cudaMalloc(
+          &input_values, kMaxBatchSize * kInputPlanes * sizeof(float)));
+      ReportCUDAErrors(cudaMalloc(
+          &op_policy, kMaxBatchSize * kNumOutputPolicy * sizeof(float)));
+      ReportCUDAErrors(cudaMalloc(&op_value, kMaxBatchSize * sizeof(float)));
+    }
+  }
+  ~ExecutionContext() {
+#ifdef LC0_CUDA_GRAPHS
+    for (auto &graph : graphs) cudaGraphExecDestroy(graph.second);
+#endif
+    if (input_masks) ReportCUDAErrors(cudaFree(input_masks));
+    if (input_values) ReportCUDAErrors(cudaFree(input_values));
+    if (op_policy) ReportCUDAErrors(cudaFree(op_policy));
+    if (op_value) ReportCUDAErrors(cudaFree(op_value));
+    for (auto mem : tensor_mem) ReportCUDAErrors(cudaFree(mem));
+    ReportCUDAErrors(cudaFree(scratch_mem));
+    cudnnDestroy(cudnn);
+    cublasDestroy(cublas);
+    cudaStreamDestroy(stream);
+  }
+  cudaStream_t stream;
+  cudnnHandle_t cudnn;
+  cublasHandle_t cublas;
+  DataType *tensor_mem[3];
+  void *scratch_mem;
+
+  // Inputs and outputs at fixed addresses, which graphs are captured with.
+  // Only allocated when graphs are used.
+  uint64_t *input_masks = nullptr;
+  float *input_values = nullptr;
+  float *op_policy = nullptr;
+  float *op_value = nullptr;
+#ifdef LC0_CUDA_GRAPHS
+  // Captured forward passes, by padded batch size and policy softmax
+  // temperature.
+  std::map<std::pair<int, float>, cudaGraphExec_t> graphs;
+#endif
+};
+
 // This namespace should be closed at the very end of file, but otherwise
 // there are nvcc warnings. Weird way to silence warnings.
 }  // namespace
@@ -932,22 +963,22 @@ class CudnnNetworkComputation : public NetworkComputation {
   CudnnNetworkComputation(CudnnNetwork<DataType> *network);
   ~CudnnNetworkComputation();
 
-  void AddInput(InputPlanes &&input) override {
+  // Planes are written straight into the pinned buffer which the GPU reads.
+  InputPlanesRef AddInputInPlace() override {
     auto iter_mask =
         &inputs_outputs_->input_masks_mem_[batch_size_ * kInputPlanes];
     auto iter_val =
         &inputs_outputs_->input_val_mem_[batch_size_ * kInputPlanes];
-
-    int i = 0;
-    for (const auto &plane : input) {
-      iter_mask[i] = plane.mask;
-      iter_val[i] = plane.value;
-      i++;
-    }
+    std::fill(iter_mask, iter_mask + kInputPlanes, 0);
+    std::fill(iter_val, iter_val + kInputPlanes, 1.0f);
 
     batch_size_++;
+    return {iter_mask, iter_val};
   }
 
+  // Logits are divided by the temperature on the GPU, before the softmax.
+  void SetPolicySoftmaxTemp(float temp) override { policy_temp_ = temp; }
+
   void ComputeBlocking() override;
 
   int GetBatchSize() const override { return batch_size_; }
@@ -958,27 +989,29 @@ class CudnnNetworkComputation : public NetworkComputation {
   float GetPVal(int sample, int move_id) const override {
     return inputs_outputs_->op_policy_mem_[sample * kNumOutputPolicy + move_id];
   }
+  void GetPVals(int sample, const uint16_t *move_ids, int count,
+                float *out) const override {
+    const float *policy =
+        &inputs_outputs_->op_policy_mem_[sample * kNumOutputPolicy];
+    for (int i = 0; i < count; ++i) out[i] = policy[move_ids[i]];
+  }
 
  private:
   // Memory holding inputs, outputs.
   std::unique_ptr<InputsOutputs> inputs_outputs_;
   int batch_size_;
+  float policy_temp_ = 1.0f;
 
   CudnnNetwork<DataType> *network_;
 };
 
+// The network loaded on one GPU. @weights have to be processed by
+// CudnnNetwork::ProcessWeights() already.
 template <typename DataType>
-class CudnnNetwork : public Network {
+class CudnnDevice {
  public:
-  CudnnNetwork(Weights weights, const OptionsDict &options) {
-    gpu_id_ = options.GetOrDefault<int>("gpu", 0);
-
-    int total_gpus;
-    ReportCUDAErrors(cudaGetDeviceCount(&total_gpus));
-
-    if (gpu_id_ >= total_gpus)
-      throw Exception("Invalid GPU Id: " + std::to_string(gpu_id_));
-
+  CudnnDevice(Weights weights, int gpu_id, const OptionsDict &options)
+      : gpu_id_(gpu_id) {
     // Select GPU to run on (for *the current* thread).
     ReportCUDAErrors(cudaSetDevice(gpu_id_));
 
@@ -1002,15 +1035,6 @@ class CudnnNetwork : public Network {
 
     numBlocks_ = weights.residual.size();
 
-    // 0. Process weights.
-    processConvBlock(weights.input, true);
-    for (auto i = size_t{0}; i < numBlocks_; i++) {
-      processConvBlock(weights.residual[i].conv1, true);
-      processConvBlock(weights.residual[i].conv2, true);
-    }
-    processConvBlock(weights.policy);
-    processConvBlock(weights.value);
-
     // 1. Allocate scratch space (used internally by cudnn to run convolutions,
     //     and also for format/layout conversion for weights).
     cudnnFilterDescriptor_t wDesc;
@@ -1092,15 +1116,12 @@ class CudnnNetwork : public Network {
     // policy head
     {
       auto convPol = std::make_unique<ConvLayer<DataType>>(
-          resi_last_, weights.policy.bn_means.size(), 8, 8, 1, kNumFilters);
-      convPol->LoadWeights(&weights.policy.weights[0], nullptr, scratch_mem_);
+          resi_last_, weights.policy.bn_means.size(), 8, 8, 1, kNumFilters,
+          true, true);
+      convPol->LoadWeights(&weights.policy.weights[0],
+                           &weights.policy.biases[0], scratch_mem_);
       network_.emplace_back(std::move(convPol));
 
-      auto BNPol = std::make_unique<BNLayer<DataType>>(getLastLayer(), true);
-      BNPol->LoadWeights(&weights.policy.bn_means[0],
-                         &weights.policy.bn_stddivs[0]);
-      network_.emplace_back(std::move(BNPol));
-
       auto FCPol = std::make_unique<FCLayer<DataType>>(
           getLastLayer(), weights.ip_pol_b.size(), 1, 1, false, true);
       FCPol->LoadWeights(&weights.ip_pol_w[0], &weights.ip_pol_b[0],
@@ -1116,15 +1137,12 @@ class CudnnNetwork : public Network {
     // value head
     {
       auto convVal = std::make_unique<ConvLayer<DataType>>(
-          resi_last_, weights.value.bn_means.size(), 8, 8, 1, kNumFilters);
-      convVal->LoadWeights(&weights.value.weights[0], nullptr, scratch_mem_);
+          resi_last_, weights.value.bn_means.size(), 8, 8, 1, kNumFilters,
+          true, true);
+      convVal->LoadWeights(&weights.value.weights[0], &weights.value.biases[0],
+                           scratch_mem_);
       network_.emplace_back(std::move(convVal));
 
-      auto BNVal = std::make_unique<BNLayer<DataType>>(getLastLayer(), true);
-      BNVal->LoadWeights(&weights.value.bn_means[0],
-                         &weights.value.bn_stddivs[0]);
-      network_.emplace_back(std::move(BNVal));
-
       auto FCVal1 = std::make_unique<FCLayer<DataType>>(
           getLastLayer(), weights.ip1_val_b.size(), 1, 1, true, true);
       FCVal1->LoadWeights(&weights.ip1_val_w[0], &weights.ip1_val_b[0],
@@ -1139,175 +1157,286 @@ class CudnnNetwork : public Network {
     }
     value_out_ = getLastLayer();
 
-    // 3. allocate GPU memory for running the network
+    // Weights are copied asynchronously through the scratch space. Once that
+    // is done, execution contexts each have a scratch space of their own.
+    ReportCUDAErrors(cudaDeviceSynchronize());
+    ReportCUDAErrors(cudaFree(scratch_mem_));
+    scratch_mem_ = nullptr;
+
+    // 3. allocate GPU memory for running the network, for each of the
+    //    batches which can be evaluated concurrently.
     //    - three buffers of max size are enough (one to hold input, second to
     //    hold output and third to hold skip connection's input).
+    const int streams = options.GetOrDefault<int>("streams", 1);
+    if (streams < 1) {
+      throw Exception("streams of the cuDNN backend has to be at least 1.");
+    }
+#ifdef LC0_CUDA_GRAPHS
+    use_graphs_ = options.GetOrDefault<bool>("graphs", false);
+#else
+    use_graphs_ = false;
+#endif
     size_t maxSize = resi_last_->GetOutputSize(kMaxBatchSize);
-    for (auto &mem : tensor_mem_) {
-      ReportCUDAErrors(cudaMalloc(&mem, maxSize));
-      ReportCUDAErrors(cudaMemset(mem, 0, maxSize));
+    for (int i = 0; i < streams; i++) {
+      free_contexts_.push_back(std::make_unique<ExecutionContext<DataType>>(
+          maxSize, scratch_size_, fp16, use_graphs_));
     }
 
     // printf("Allocated %d bytes of GPU memory to run the network\n", 3 *
     // maxSize);
   }
 
-  void forwardEval(InputsOutputs *io, int batchSize) {
-    std::lock_guard<std::mutex> lock(lock_);
+  void forwardEval(InputsOutputs *io, int batchSize, float policyTemp) {
+    // The calling thread may have used another GPU last.
+    ReportCUDAErrors(cudaSetDevice(gpu_id_));
+    std::unique_ptr<ExecutionContext<DataType>> context = GetContext();
+    cudaStream_t stream = context->stream;
 
 #ifdef DEBUG_RAW_NPS
     auto t_start = std::chrono::high_resolution_clock::now();
 #endif
 
-    // expand packed planes to full planes
-    uint64_t *ipDataMasks = io->input_masks_mem_gpu_;
-    float *ipDataValues = io->input_val_mem_gpu_;
+#ifdef LC0_CUDA_GRAPHS
+    if (use_graphs_) {
+      // The graph reads and writes the buffers of the context, so inputs and
+      // outputs are copied. The batch is padded with whatever the buffers
+      // hold, the results of which are not copied back.
+      const int paddedSize = GetGraphBatchSize(batchSize);
+      ReportCUDAErrors(cudaMemcpyAsync(
+          context->input_masks, io->input_masks_mem_,
+          batchSize * kInputPlanes * sizeof(uint64_t), cudaMemcpyHostToDevice,
+          stream));
+      ReportCUDAErrors(cudaMemcpyAsync(
+          context->input_values, io->input_val_mem_,
+          batchSize * kInputPlanes * sizeof(float), cudaMemcpyHostToDevice,
+          stream));
+      cudaGraphExec_t &graph = context->graphs[{paddedSize, policyTemp}];
+      if (!graph) {
+        cudaGraph_t captured;
+        ReportCUDAErrors(
+            cudaStreamBeginCapture(stream, cudaStreamCaptureModeThreadLocal));
+        enqueueForward(context.get(), context->input_masks,
+                       context->input_values, context->op_policy,
+                       context->op_value, paddedSize, policyTemp);
+        ReportCUDAErrors(cudaStreamEndCapture(stream, &captured));
+#if CUDART_VERSION >= 12000
+        ReportCUDAErrors(cudaGraphInstantiate(&graph, captured, 0));
+#else
+        ReportCUDAErrors(
+            cudaGraphInstantiate(&graph, captured, nullptr, nullptr, 0));
+#endif
+        ReportCUDAErrors(cudaGraphDestroy(captured));
+      }
+      ReportCUDAErrors(cudaGraphLaunch(graph, stream));
+      ReportCUDAErrors(cudaMemcpyAsync(
+          io->op_policy_mem_, context->op_policy,
+          batchSize * kNumOutputPolicy * sizeof(float), cudaMemcpyDeviceToHost,
+          stream));
+      ReportCUDAErrors(cudaMemcpyAsync(io->op_value_mem_, context->op_value,
+                                       batchSize * sizeof(float),
+                                       cudaMemcpyDeviceToHost, stream));
+    } else
+#endif
+    {
+      enqueueForward(context.get(), io->input_masks_mem_gpu_,
+                     io->input_val_mem_gpu_, io->op_policy_mem_gpu_,
+                     io->op_value_mem_gpu_, batchSize, policyTemp);
+    }
+    ReportCUDAErrors(cudaStreamSynchronize(stream));
+    ReleaseContext(std::move(context));
+
+#ifdef DEBUG_RAW_NPS
+    const int reportingCalls = 100;
+    static int numCalls = 0;
+    static int sumBatchSize = 0;
+    static double totalTime = 0;
+
+    sumBatchSize += batchSize;
+    numCalls++;
+
+    auto t_end = std::chrono::high_resolution_clock::now();
+
+    double dt = std::chrono::duration<double>(t_end - t_start).count();
+    totalTime += dt;
+    if (numCalls == reportingCalls) {
+      double avgBatchSize = ((double)sumBatchSize) / numCalls;
+      printf("\nAvg batch size: %lf, NN eval time: %lf seconds per %d evals\n",
+             avgBatchSize, totalTime, sumBatchSize);
+      sumBatchSize = 0;
+      totalTime = 0;
+      numCalls = 0;
+    }
+#endif
+  }
 
+  // Enqueues the whole forward pass of a batch on the stream of @context.
+  void enqueueForward(ExecutionContext<DataType> *context,
+                      uint64_t *ipDataMasks, float *ipDataValues, float *opPol,
+                      float *opVal, int batchSize, float policyTemp) {
+    DataType **tensor_mem = context->tensor_mem;
+    void *scratch = context->scratch_mem;
+    cudnnHandle_t cudnn = context->cudnn;
+    cublasHandle_t cublas = context->cublas;
+    cudaStream_t stream = context->stream;
+
+    // expand packed planes to full planes
     if (std::is_same<half, DataType>::value) {
-      expandPlanes_Fp16_NHWC((half *)(tensor_mem_[0]), ipDataMasks,
-                             ipDataValues, batchSize * kInputPlanes);
+      expandPlanes_Fp16_NHWC((half *)(tensor_mem[0]), ipDataMasks,
+                             ipDataValues, batchSize * kInputPlanes, stream);
     } else {
-      expandPlanes_Fp32_NCHW((float *)(tensor_mem_[0]), ipDataMasks,
-                             ipDataValues, batchSize * kInputPlanes);
+      expandPlanes_Fp32_NCHW((float *)(tensor_mem[0]), ipDataMasks,
+                             ipDataValues, batchSize * kInputPlanes, stream);
     }
 
-    float *opPol = io->op_policy_mem_gpu_;
-    float *opVal = io->op_value_mem_gpu_;
-
     int l = 0;
     // input
-    network_[l++]->Eval(batchSize, tensor_mem_[2], tensor_mem_[0], nullptr,
-                        scratch_mem_, scratch_size_, cudnn_,
-                        cublas_);  // input conv
+    network_[l++]->Eval(batchSize, tensor_mem[2], tensor_mem[0], nullptr,
+                        scratch, scratch_size_, cudnn,
+                        cublas);  // input conv
 
     // residual block
     for (int block = 0; block < numBlocks_; block++) {
-      network_[l++]->Eval(batchSize, tensor_mem_[0], tensor_mem_[2], nullptr,
-                          scratch_mem_, scratch_size_, cudnn_,
-                          cublas_);  // conv1
+      network_[l++]->Eval(batchSize, tensor_mem[0], tensor_mem[2], nullptr,
+                          scratch, scratch_size_, cudnn,
+                          cublas);  // conv1
 
-      network_[l++]->Eval(batchSize, tensor_mem_[2], tensor_mem_[0],
-                          tensor_mem_[2], scratch_mem_, scratch_size_, cudnn_,
-                          cublas_);  // conv2
+      network_[l++]->Eval(batchSize, tensor_mem[2], tensor_mem[0],
+                          tensor_mem[2], scratch, scratch_size_, cudnn,
+                          cublas);  // conv2
     }
 
     // policy head
-    network_[l++]->Eval(batchSize, tensor_mem_[0], tensor_mem_[2], nullptr,
-                        scratch_mem_, scratch_size_, cudnn_,
-                        cublas_);  // pol conv
-    network_[l++]->Eval(batchSize, tensor_mem_[1], tensor_mem_[0], nullptr,
-                        scratch_mem_, scratch_size_, cudnn_,
-                        cublas_);  // pol BN
-    network_[l++]->Eval(batchSize, tensor_mem_[0], tensor_mem_[1], nullptr,
-                        scratch_mem_, scratch_size_, cudnn_,
-                        cublas_);  // pol FC
+    network_[l++]->Eval(batchSize, tensor_mem[1], tensor_mem[2], nullptr,
+                        scratch, scratch_size_, cudnn,
+                        cublas);  // pol conv + BN + ReLU
+    network_[l++]->Eval(batchSize, tensor_mem[0], tensor_mem[1], nullptr,
+                        scratch, scratch_size_, cudnn,
+                        cublas);  // pol FC
+    if (policyTemp != 1.0f) {
+      scaleVector(tensor_mem[0], 1.0f / policyTemp,
+                  batchSize * kNumOutputPolicy, stream);
+    }
     if (std::is_same<half, DataType>::value) {
       // TODO: consider softmax layer that writes directly to fp32
-      network_[l++]->Eval(batchSize, tensor_mem_[1], tensor_mem_[0], nullptr,
-                          scratch_mem_, scratch_size_, cudnn_,
-                          cublas_);  // pol softmax
-      copyTypeConverted(opPol, (half *)(tensor_mem_[1]),
-                        batchSize * kNumOutputPolicy);  // POLICY
+      network_[l++]->Eval(batchSize, tensor_mem[1], tensor_mem[0], nullptr,
+                          scratch, scratch_size_, cudnn,
+                          cublas);  // pol softmax
+      copyTypeConverted(opPol, (half *)(tensor_mem[1]),
+                        batchSize * kNumOutputPolicy, stream);  // POLICY
     } else {
-      network_[l++]->Eval(batchSize, (DataType *)opPol, tensor_mem_[0], nullptr,
-                          scratch_mem_, scratch_size_, cudnn_,
-                          cublas_);  // pol softmax  // POLICY
+      network_[l++]->Eval(batchSize, (DataType *)opPol, tensor_mem[0], nullptr,
+                          scratch, scratch_size_, cudnn,
+                          cublas);  // pol softmax  // POLICY
     }
 
     // value head
-    network_[l++]->Eval(batchSize, tensor_mem_[0], tensor_mem_[2], nullptr,
-                        scratch_mem_, scratch_size_, cudnn_,
-                        cublas_);  // value conv
-    network_[l++]->Eval(batchSize, tensor_mem_[2], tensor_mem_[0], nullptr,
-                        scratch_mem_, scratch_size_, cudnn_,
-                        cublas_);  // value BN
-    network_[l++]->Eval(batchSize, tensor_mem_[0], tensor_mem_[2], nullptr,
-                        scratch_mem_, scratch_size_, cudnn_,
-                        cublas_);  // value FC1
+    network_[l++]->Eval(batchSize, tensor_mem[0], tensor_mem[2], nullptr,
+                        scratch, scratch_size_, cudnn,
+                        cublas);  // value conv + BN + ReLU
+    network_[l++]->Eval(batchSize, tensor_mem[2], tensor_mem[0], nullptr,
+                        scratch, scratch_size_, cudnn,
+                        cublas);  // value FC1
 
     if (std::is_same<half, DataType>::value) {
       // TODO: consider fusing the bias-add of FC2 with format conversion
-      network_[l++]->Eval(batchSize, tensor_mem_[2], tensor_mem_[0], nullptr,
-                          scratch_mem_, scratch_size_, cudnn_,
-                          cublas_);  // value FC2
-      copyTypeConverted(opVal, (half *)(tensor_mem_[2]), batchSize);  // VALUE
+      network_[l++]->Eval(batchSize, tensor_mem[0], tensor_mem[2], nullptr,
+                          scratch, scratch_size_, cudnn,
+                          cublas);  // value FC2
+      copyTypeConverted(opVal, (half *)(tensor_mem[0]), batchSize,
+                        stream);  // VALUE
     } else {
-      network_[l++]->Eval(batchSize, (DataType *)opVal, tensor_mem_[0], nullptr,
-                          scratch_mem_, scratch_size_, cudnn_,
-                          cublas_);  // value FC2    // VALUE
+      network_[l++]->Eval(batchSize, (DataType *)opVal, tensor_mem[2], nullptr,
+                          scratch, scratch_size_, cudnn,
+                          cublas);  // value FC2    // VALUE
     }
-    ReportCUDAErrors(cudaDeviceSynchronize());
+  }
 
-#ifdef DEBUG_RAW_NPS
-    const int reportingCalls = 100;
-    static int numCalls = 0;
-    static int sumBatchSize = 0;
-    static double totalTime = 0;
+  ~CudnnDevice() {
+    cudaSetDevice(gpu_id_);
+    free_contexts_.clear();
+    if (scratch_mem_) ReportCUDAErrors(cudaFree(scratch_mem_));
+    cudnnDestroy(cudnn_);
+    cublasDestroy(cublas_);
+  }
 
-    sumBatchSize += batchSize;
-    numCalls++;
+  int GetGpuId() const { return gpu_id_; }
 
-    auto t_end = std::chrono::high_resolution_clock::now();
+  // Load of the device: samples of the batches scheduled on it which are not
+  // computed yet.
+  int GetPendingSamples() const { return pending_samples_.load(); }
 
-    double dt = std::chrono::duration<double>(t_end - t_start).count();
-    totalTime += dt;
-    if (numCalls == reportingCalls) {
-      double avgBatchSize = ((double)sumBatchSize) / numCalls;
-      printf("\nAvg batch size: %lf, NN eval time: %lf seconds per %d evals\n",
-             avgBatchSize, totalTime, sumBatchSize);
-      sumBatchSize = 0;
-      totalTime = 0;
-      numCalls = 0;
-    }
-#endif
+  // Schedules a batch on the device, evaluates it and keeps statistics.
+  void Evaluate(InputsOutputs *io, int batchSize, float policyTemp) {
+    pending_samples_ += batchSize;
+    StartBusy();
+    forwardEval(io, batchSize, policyTemp);
+    EndBusy(batchSize);
+    pending_samples_ -= batchSize;
   }
 
-  ~CudnnNetwork() {
-    for (auto mem : tensor_mem_) {
-      if (mem) ReportCUDAErrors(cudaFree(mem));
-    }
-    if (scratch_mem_) ReportCUDAErrors(cudaFree(scratch_mem_));
-    cudnnDestroy(cudnn_);
-    cublasDestroy(cublas_);
+  // Prints how many batches were evaluated on the device and for which part
+  // of its lifetime it had at least one batch to evaluate.
+  void ReportUtilization() {
+    std::lock_guard<std::mutex> lock(stats_lock_);
+    const double lifetime = std::chrono::duration<double>(
+                                std::chrono::steady_clock::now() - created_)
+                                .count();
+    std::cerr << "GPU " << gpu_id_ << ": " << batches_ << " batches, "
+              << samples_ << " samples, " << std::fixed
+              << std::setprecision(1)
+              << (lifetime > 0 ? 100.0 * busy_time_ / lifetime : 0.0)
+              << "% busy." << std::endl;
   }
 
-  std::unique_ptr<NetworkComputation> NewComputation() override {
-    // set correct gpu id for this computation (as it might have been called
-    // from a different thread)
-    ReportCUDAErrors(cudaSetDevice(gpu_id_));
-    return std::make_unique<CudnnNetworkComputation<DataType>>(this);
+  // Batch sizes are padded to a few buckets, so that only a few graphs are
+  // captured: powers of two up to 32, then multiples of 32.
+  static int GetGraphBatchSize(int batchSize) {
+    if (batchSize > 32) return (batchSize + 31) / 32 * 32;
+    int size = 1;
+    while (size < batchSize) size *= 2;
+    return size;
   }
 
-  std::unique_ptr<InputsOutputs> GetInputsOutputs() {
-    std::lock_guard<std::mutex> lock(inputs_outputs_lock_);
-    if (free_inputs_outputs_.empty()) {
-      return std::make_unique<InputsOutputs>();
-    } else {
-      std::unique_ptr<InputsOutputs> resource =
-          std::move(free_inputs_outputs_.front());
-      free_inputs_outputs_.pop_front();
-      return resource;
+  // Waits until an execution context is free, and takes it.
+  std::unique_ptr<ExecutionContext<DataType>> GetContext() {
+    std::unique_lock<std::mutex> lock(contexts_lock_);
+    contexts_cv_.wait(lock, [this]() { return !free_contexts_.empty(); });
+    std::unique_ptr<ExecutionContext<DataType>> context =
+        std::move(free_contexts_.front());
+    free_contexts_.pop_front();
+    return context;
+  }
+
+  void ReleaseContext(std::unique_ptr<ExecutionContext<DataType>> context) {
+    {
+      std::lock_guard<std::mutex> lock(contexts_lock_);
+      free_contexts_.push_back(std::move(context));
     }
+    contexts_cv_.notify_one();
   }
 
-  void ReleaseInputsOutputs(std::unique_ptr<InputsOutputs> resource) {
-    std::lock_guard<std::mutex> lock(inputs_outputs_lock_);
-    free_inputs_outputs_.push_back(std::move(resource));
+ private:
+  void StartBusy() {
+    std::lock_guard<std::mutex> lock(stats_lock_);
+    if (batches_in_flight_++ == 0) {
+      busy_since_ = std::chrono::steady_clock::now();
+    }
   }
 
-  // Apparently nvcc doesn't see constructor invocations through make_unique.
-  // This function invokes constructor just to please complier and silence
-  // warning. Is never called (but compiler thinks that it could).
-  void UglyFunctionToSilenceNvccWarning() { InputsOutputs io; }
+  void EndBusy(int batchSize) {
+    std::lock_guard<std::mutex> lock(stats_lock_);
+    ++batches_;
+    samples_ += batchSize;
+    if (--batches_in_flight_ == 0) {
+      busy_time_ += std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - busy_since_)
+                        .count();
+    }
+  }
 
- private:
   cudnnHandle_t cudnn_;
   cublasHandle_t cublas_;
-  int gpu_id_;
-
-  // currently only one NN Eval can happen a time (we can fix this if needed by
-  // allocating more memory)
-  mutable std::mutex lock_;
+  const int gpu_id_;
 
   int numBlocks_;
   std::vector<std::unique_ptr<BaseLayer<DataType>>> network_;
@@ -1317,55 +1446,154 @@ class CudnnNetwork : public Network {
   BaseLayer<DataType> *policy_out_;
   BaseLayer<DataType> *value_out_;
 
-  DataType *tensor_mem_[3];
   void *scratch_mem_;
   size_t scratch_size_;
 
-  mutable std::mutex inputs_outputs_lock_;
-  std::list<std::unique_ptr<InputsOutputs>> free_inputs_outputs_;
+  // Whether forward passes are captured into CUDA graphs and replayed.
+  bool use_graphs_;
+
+  // As many batches as there are contexts can be evaluated at the same time.
+  std::mutex contexts_lock_;
+  std::condition_variable contexts_cv_;
+  std::list<std::unique_ptr<ExecutionContext<DataType>>> free_contexts_;
+
+  std::atomic<int> pending_samples_{0};
+
+  // Utilization statistics.
+  std::mutex stats_lock_;
+  const std::chrono::steady_clock::time_point created_ =
+      std::chrono::steady_clock::now();
+  std::chrono::steady_clock::time_point busy_since_;
+  int batches_in_flight_ = 0;
+  int64_t batches_ = 0;
+  int64_t samples_ = 0;
+  double busy_time_ = 0.0;
+};
 
-  void processConvBlock(Weights::ConvBlock &block, bool foldBNLayer = false) {
-    const float epsilon = 1e-5f;
+// GPUs of the "gpus" option (comma separated list of ids), or the single
+// "gpu" id if not set.
+std::vector<int> GetGpuIds(const OptionsDict &options) {
+  std::vector<int> gpu_ids;
+  if (options.Exists<std::string>("gpus")) {
+    gpu_ids = ParseIntList(options.Get<std::string>("gpus"));
+  } else if (options.Exists<int>("gpus")) {
+    gpu_ids.push_back(options.Get<int>("gpus"));
+  } else {
+    gpu_ids.push_back(options.GetOrDefault<int>("gpu", 0));
+  }
+  return gpu_ids;
+}
 
-    // Compute reciprocal of std-dev from the variances (so that it can be just
-    // multiplied).
-    std::vector<float> &stddev = block.bn_stddivs;
-    for (auto &&w : stddev) {
-      w = 1.0f / std::sqrt(w + epsilon);
-    }
+// The cuDNN backend. Weights are loaded on every GPU of GetGpuIds(), and each
+// batch is evaluated on the GPU which has the fewest samples pending.
+template <typename DataType>
+class CudnnNetwork : public Network {
+ public:
+  CudnnNetwork(const WeightsPtr &weights, const OptionsDict &options) {
+    const std::vector<int> gpu_ids = GetGpuIds(options);
 
-    // Biases are not calculated and are typically zero but some networks might
-    // still have non-zero biases.
-    // Move biases to batchnorm means to make the output match without having
-    // to separately add the biases.
-    for (auto j = size_t{0}; j < block.bn_means.size(); j++) {
-      block.bn_means[j] -= block.biases[j];
-      block.biases[j] = 0.0f;
+    int total_gpus;
+    ReportCUDAErrors(cudaGetDeviceCount(&total_gpus));
+    for (const int gpu_id : gpu_ids) {
+      if (gpu_id < 0 || gpu_id >= total_gpus)
+        throw Exception("Invalid GPU Id: " + std::to_string(gpu_id));
     }
 
-    // Get rid of the BN layer by adjusting weights and biases of the
-    // convolution idea proposed by Henrik Forstn and first implemented in
-    // leela go zero.
-    if (foldBNLayer) {
-      const int outputs = block.biases.size();
-      const int channels = block.weights.size() / (outputs * 3 * 3);
-
-      for (auto o = 0; o < outputs; o++) {
-        for (auto c = 0; c < channels; c++) {
-          for (auto i = 0; i < 9; i++) {
-            block.weights[o * channels * 9 + c * 9 + i] *= block.bn_stddivs[o];
-          }
+    // Processed once for all GPUs and all networks on the same weights.
+    const auto processed = GetTransformedWeights<Weights>(
+        weights, "cudnn", [](const Weights &weights) {
+          Weights processed = weights;
+          FoldBatchNorm(&processed);
+          return processed;
+        });
+
+    // Weights are uploaded to all GPUs in parallel.
+    devices_.resize(gpu_ids.size());
+    std::vector<std::exception_ptr> errors(gpu_ids.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < gpu_ids.size(); i++) {
+      threads.emplace_back([&, i]() {
+        try {
+          devices_[i] = std::make_unique<CudnnDevice<DataType>>(
+              *processed, gpu_ids[i], options);
+        } catch (...) {
+          errors[i] = std::current_exception();
         }
+      });
+    }
+    for (auto &thread : threads) thread.join();
+    for (const auto &error : errors) {
+      if (error) std::rethrow_exception(error);
+    }
+  }
+
+  ~CudnnNetwork() {
+    if (devices_.size() > 1) {
+      for (const auto &device : devices_) device->ReportUtilization();
+    }
+    free_inputs_outputs_.clear();
+  }
 
-        block.bn_means[o] *= block.bn_stddivs[o];
-        block.bn_stddivs[o] = 1.0f;
+  std::unique_ptr<NetworkComputation> NewComputation() override {
+    // Pinned buffers are allocated with the first GPU current.
+    ReportCUDAErrors(cudaSetDevice(devices_[0]->GetGpuId()));
+    return std::make_unique<CudnnNetworkComputation<DataType>>(this);
+  }
+
+  bool SupportsPolicySoftmaxTemp() const override { return true; }
+
+  // Tensor cores, used in fp16 mode, work on batches of multiples of 8.
+  int GetPreferredBatchStep() const override {
+    return std::is_same<half, DataType>::value ? 8 : 1;
+  }
+
+  // The node of the first GPU, whose PCIe root is attached to it.
+  int GetNumaNode() const override {
+    char bus_id[32];
+    if (cudaDeviceGetPCIBusId(bus_id, sizeof(bus_id),
+                              devices_[0]->GetGpuId()) != cudaSuccess) {
+      return -1;
+    }
+    return Numa::GetPciDeviceNode(bus_id);
+  }
 
-        // Move means to convolution biases.
-        block.biases[o] = -block.bn_means[o];
-        block.bn_means[o] = 0.0f;
+  void forwardEval(InputsOutputs *io, int batchSize, float policyTemp) {
+    CudnnDevice<DataType> *least_loaded = devices_[0].get();
+    for (const auto &device : devices_) {
+      if (device->GetPendingSamples() < least_loaded->GetPendingSamples()) {
+        least_loaded = device.get();
       }
     }
+    least_loaded->Evaluate(io, batchSize, policyTemp);
   }
+
+  std::unique_ptr<InputsOutputs> GetInputsOutputs() {
+    std::lock_guard<std::mutex> lock(inputs_outputs_lock_);
+    if (free_inputs_outputs_.empty()) {
+      return std::make_unique<InputsOutputs>();
+    } else {
+      std::unique_ptr<InputsOutputs> resource =
+          std::move(free_inputs_outputs_.front());
+      free_inputs_outputs_.pop_front();
+      return resource;
+    }
+  }
+
+  void ReleaseInputsOutputs(std::unique_ptr<InputsOutputs> resource) {
+    std::lock_guard<std::mutex> lock(inputs_outputs_lock_);
+    free_inputs_outputs_.push_back(std::move(resource));
+  }
+
+  // Apparently nvcc doesn't see constructor invocations through make_unique.
+  // This function invokes constructor just to please complier and silence
+  // warning. Is never called (but compiler thinks that it could).
+  void UglyFunctionToSilenceNvccWarning() { InputsOutputs io; }
+
+ private:
+  std::vector<std::unique_ptr<CudnnDevice<DataType>>> devices_;
+
+  mutable std::mutex inputs_outputs_lock_;
+  std::list<std::unique_ptr<InputsOutputs>> free_inputs_outputs_;
 };
 
 template <typename DataType>
@@ -1383,10 +1611,17 @@ CudnnNetworkComputation<DataType>::~CudnnNetworkComputation() {
 
 template <typename DataType>
 void CudnnNetworkComputation<DataType>::ComputeBlocking() {
-  network_->forwardEval(inputs_outputs_.get(), GetBatchSize());
+  network_->forwardEval(inputs_outputs_.get(), GetBatchSize(), policy_temp_);
 }
 
 REGISTER_NETWORK("cudnn", CudnnNetwork<float>, 110)
 REGISTER_NETWORK("cudnn-fp16", CudnnNetwork<half>, 105)
 
+// Contexts of the GPUs are created while the weights are loaded.
+void PrepareCudnnNetwork(const OptionsDict &options) {
+  CreateCudaContexts(GetGpuIds(options));
+}
+REGISTER_NETWORK_PREPARE("cudnn", PrepareCudnnNetwork)
+REGISTER_NETWORK_PREPARE("cudnn-fp16", PrepareCudnnNetwork)
+
 }  // namespace lczero
@@ -0,0 +1,244 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+
+#include "neural/factory.h"
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <future>
+#include "utils/exception.h"
+#include "utils/mutex.h"
+#include "utils/threadpool.h"
+
+namespace lczero {
+namespace {
+
+// Weight of the latest measurement in the throughput estimate of a child.
+const double kThroughputDecay = 0.1;
+
+class DemuxingNetwork;
+class DemuxingComputation : public NetworkComputation {
+ public:
+  DemuxingComputation(DemuxingNetwork* network) : network_(network) {}
+
+  InputPlanesRef AddInputInPlace() override { return planes_.Add(); }
+
+  void SetPriority(int priority) override { priority_ = priority; }
+
+  void SetPolicySoftmaxTemp(float temp) override { policy_temp_ = temp; }
+
+  void ComputeBlocking() override;
+
+  int GetBatchSize() const override { return planes_.GetSize(); }
+
+  float GetQVal(int sample) const override {
+    const auto& part = GetPart(sample);
+    return part.computation->GetQVal(sample - part.offset);
+  }
+
+  float GetPVal(int sample, int move_id) const override {
+    const auto& part = GetPart(sample);
+    return part.computation->GetPVal(sample - part.offset, move_id);
+  }
+
+  void GetPVals(int sample, const uint16_t* move_ids, int count,
+                float* out) const override {
+    const auto& part = GetPart(sample);
+    part.computation->GetPVals(sample - part.offset, move_ids, count, out);
+  }
+
+ private:
+  // Samples [offset, offset + computation->GetBatchSize()) of the batch.
+  struct Part {
+    int offset;
+    std::unique_ptr<NetworkComputation> computation;
+  };
+
+  const Part& GetPart(int sample) const {
+    // Parts are sorted by offset, and the first one is at 0.
+    return *(std::upper_bound(parts_.begin(), parts_.end(), sample,
+                              [](int sample, const Part& part) {
+                                return sample < part.offset;
+                              }) -
+             1);
+  }
+
+  DemuxingNetwork* const network_;
+  InputBatch planes_;
+  int priority_ = 1;
+  float policy_temp_ = 1.0f;
+  std::vector<Part> parts_;
+};
+
+// Computes one batch on several networks in parallel, splitting it
+// proportionally to their measured throughput.
+class DemuxingNetwork : public Network {
+ public:
+  DemuxingNetwork(const WeightsPtr& weights, const OptionsDict& options) {
+    const auto children = options.ListSubdicts();
+    if (children.empty()) {
+      throw Exception("demux backend needs child backends to split over.");
+    }
+    for (const auto& name : children) {
+      const auto& opts = options.GetSubdict(name);
+      const std::string backend =
+          opts.GetOrDefault<std::string>("backend", name);
+      networks_.emplace_back(
+          NetworkFactory::Get()->Create(backend, weights, opts));
+      throughputs_.push_back(1.0);
+    }
+  }
+
+  std::unique_ptr<NetworkComputation> NewComputation() override {
+    return std::make_unique<DemuxingComputation>(this);
+  }
+
+  bool SupportsPolicySoftmaxTemp() const override {
+    return std::all_of(networks_.begin(), networks_.end(),
+                       [](const std::unique_ptr<Network>& network) {
+                         return network->SupportsPolicySoftmaxTemp();
+                       });
+  }
+
+  int GetNetworkCount() const { return networks_.size(); }
+  Network* GetNetwork(int idx) const { return networks_[idx].get(); }
+
+  // Returns how many of @batch_size samples each network should compute.
+  std::vector<int> Split(int batch_size) {
+    std::vector<double> throughputs;
+    {
+      Mutex::Lock lock(mutex_);
+      throughputs = throughputs_;
+    }
+    double total = 0.0;
+    for (const auto x : throughputs) total += x;
+
+    // Shares rounded down to the preferred batch step of a network, the
+    // rest given out by largest remainder.
+    std::vector<int> sizes(networks_.size());
+    std::vector<std::pair<double, int>> remainders;
+    int left = batch_size;
+    for (size_t i = 0; i < networks_.size(); ++i) {
+      const double share = batch_size * throughputs[i] / total;
+      const int step = networks_[i]->GetPreferredBatchStep();
+      sizes[i] = static_cast<int>(share) / step * step;
+      left -= sizes[i];
+      remainders.emplace_back(share - sizes[i], i);
+    }
+    std::sort(remainders.rbegin(), remainders.rend());
+    for (size_t i = 0; left > 0; i = (i + 1) % remainders.size()) {
+      const int idx = remainders[i].second;
+      const int add =
+          std::min(left, networks_[idx]->GetPreferredBatchStep());
+      sizes[idx] += add;
+      left -= add;
+    }
+    return sizes;
+  }
+
+  // Updates throughput estimate of network @idx, which computed
+  // @batch_size samples in @seconds.
+  void Report(int idx, int batch_size, double seconds) {
+    if (seconds <= 0.0) return;
+    Mutex::Lock lock(mutex_);
+    throughputs_[idx] = (1.0 - kThroughputDecay) * throughputs_[idx] +
+                        kThroughputDecay * batch_size / seconds;
+  }
+
+ private:
+  std::vector<std::unique_ptr<Network>> networks_;
+  Mutex mutex_{"demux"};
+  // Samples per second of each network.
+  std::vector<double> throughputs_ GUARDED_BY(mutex_);
+};
+
+void DemuxingComputation::ComputeBlocking() {
+  const auto sizes = network_->Split(planes_.GetSize());
+  int offset = 0;
+  std::vector<int> networks;
+  for (int i = 0; i < network_->GetNetworkCount(); ++i) {
+    if (sizes[i] == 0) continue;
+    auto computation = network_->GetNetwork(i)->NewComputation();
+    computation->SetPriority(priority_);
+    if (policy_temp_ != 1.0f) computation->SetPolicySoftmaxTemp(policy_temp_);
+    for (int j = offset; j < offset + sizes[i]; ++j) {
+      planes_.CopyTo(j, computation->AddInputInPlace());
+    }
+    parts_.push_back({offset, std::move(computation)});
+    networks.push_back(i);
+    offset += sizes[i];
+  }
+
+  const auto compute = [this, &networks](size_t part) {
+    const auto start = std::chrono::steady_clock::now();
+    parts_[part].computation->ComputeBlocking();
+    network_->Report(networks[part],
+                     parts_[part].computation->GetBatchSize(),
+                     std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count());
+  };
+  // The first part is computed in this thread.
+  std::vector<std::future<void>> futures;
+  for (size_t i = 1; i < parts_.size(); ++i) {
+    futures.push_back(ThreadPool::Get()->Run([&compute, i]() { compute(i); }));
+  }
+  // All parts have to finish before an error propagates, as they refer to
+  // this computation.
+  std::exception_ptr error;
+  try {
+    if (!parts_.empty()) compute(0);
+  } catch (...) {
+    error = std::current_exception();
+  }
+  for (auto& future : futures) {
+    try {
+      future.get();
+    } catch (...) {
+      if (!error) error = std::current_exception();
+    }
+  }
+  if (error) std::rethrow_exception(error);
+}
+
+// Prepares the child backends.
+void PrepareDemuxingNetwork(const OptionsDict& options) {
+  for (const auto& name : options.ListSubdicts()) {
+    const auto& opts = options.GetSubdict(name);
+    NetworkFactory::Get()->Prepare(
+        opts.GetOrDefault<std::string>("backend", name), opts);
+  }
+}
+
+}  // namespace
+
+REGISTER_NETWORK("demux", DemuxingNetwork, -1000)
+REGISTER_NETWORK_PREPARE("demux", PrepareDemuxingNetwork)
+
+}  // namespace lczero
@@ -27,24 +27,62 @@
 
 #include "neural/factory.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
-#include <queue>
+#include <deque>
+#include <iostream>
 #include <thread>
 #include "utils/exception.h"
+#include "utils/histogram.h"
+#include "utils/metrics.h"
+#include "utils/mutex.h"
+#include "utils/numa.h"
+#include "utils/trace.h"
 
 namespace lczero {
 namespace {
 
+// How many times a thread polls before it parks when waiting for work or for
+// results, as most waits are short and parking costs a syscall each side.
+const int kSpinIterations = 256;
+
+// Metrics of batches of all multiplexing backends of the process.
+struct MuxMetrics {
+  MetricsCounter* const batches = Metrics::Get().GetCounter(
+      "lc0_mux_batches_total", "Batches computed by multiplexing backends");
+  MetricsCounter* const samples = Metrics::Get().GetCounter(
+      "lc0_mux_samples_total", "Samples in batches of multiplexing backends");
+  ConcurrentHistogram* const batch_fill = Metrics::Get().GetHistogram(
+      "lc0_mux_batch_fill_ratio", "Batch size relative to max_batch");
+  ConcurrentHistogram* const queue_delay = Metrics::Get().GetHistogram(
+      "lc0_mux_queue_seconds",
+      "Time between queuing of a computation and the start of its batch");
+  ConcurrentHistogram* const compute_time = Metrics::Get().GetHistogram(
+      "lc0_mux_compute_seconds", "Time backends take to compute a batch");
+};
+MuxMetrics& GetMuxMetrics() {
+  static MuxMetrics metrics;
+  return metrics;
+}
+
 class MuxingNetwork;
 class MuxingComputation : public NetworkComputation {
  public:
   MuxingComputation(MuxingNetwork* network) : network_(network) {}
 
-  void AddInput(InputPlanes&& input) override { planes_.emplace_back(input); }
+  InputPlanesRef AddInputInPlace() override { return planes_.Add(); }
+
+  void SetPriority(int priority) override { priority_ = priority; }
+
+  void SetPolicySoftmaxTemp(float temp) override { policy_temp_ = temp; }
 
   void ComputeBlocking() override;
 
-  int GetBatchSize() const override { return planes_.size(); }
+  int GetBatchSize() const override { return planes_.GetSize(); }
+  int GetPriority() const { return priority_; }
+  float GetPolicySoftmaxTemp() const { return policy_temp_; }
 
   float GetQVal(int sample) const override {
     return parent_->GetQVal(sample + idx_in_parent_);
@@ -54,37 +92,73 @@ class MuxingComputation : public NetworkComputation {
     return parent_->GetPVal(sample + idx_in_parent_, move_id);
   }
 
+  void GetPVals(int sample, const uint16_t* move_ids, int count,
+                float* out) const override {
+    parent_->GetPVals(sample + idx_in_parent_, move_ids, count, out);
+  }
+
   void PopulateToParent(std::shared_ptr<NetworkComputation> parent) {
     // Populate our batch into batch of batches.
     parent_ = parent;
     idx_in_parent_ = parent->GetBatchSize();
-    for (auto& x : planes_) parent_->AddInput(std::move(x));
+    for (int i = 0; i < planes_.GetSize(); ++i) {
+      planes_.CopyTo(i, parent_->AddInputInPlace());
+    }
   }
 
+  // Time when the computation was queued, set by MuxingNetwork.
+  std::chrono::steady_clock::time_point enqueued_at;
+  // Next computation in the submission stack of MuxingNetwork.
+  MuxingComputation* next = nullptr;
+
   void NotifyReady() {
-    {
-      std::unique_lock<std::mutex> lock(mutex_);
-      dataready_ = true;
-    }
+    // The computation may be destroyed as soon as the waiter sees the
+    // result, so only a parked waiter is touched after the exchange, and
+    // under the lock it needs to return.
+    if (state_.exchange(kReady) != kParked) return;
+    std::lock_guard<std::mutex> lock(mutex_);
+    state_ = kNotified;
     dataready_cv_.notify_one();
   }
 
  private:
-  std::vector<InputPlanes> planes_;
+  InputBatch planes_;
   MuxingNetwork* network_;
+  int priority_ = 1;
+  float policy_temp_ = 1.0f;
   std::shared_ptr<NetworkComputation> parent_;
   int idx_in_parent_ = 0;
 
+  enum State { kWaiting, kParked, kReady, kNotified };
+  std::atomic<int> state_{kWaiting};
   std::mutex mutex_;
   std::condition_variable dataready_cv_;
-  bool dataready_ = false;
+};
+
+// Batching parameters and statistics of a backend. Statistics are guarded by
+// MuxingNetwork::gather_mutex_.
+struct MuxingBackend {
+  std::string name;
+  int max_batch;
+  // A batch smaller than this waits for more computations, for at most
+  // max_wait after its first computation was queued.
+  int min_batch;
+  std::chrono::microseconds max_wait;
+  bool dump_stats;
+  // Batch size relative to max_batch.
+  Histogram batch_fill{-3, 0, 5};
+  // Seconds between queuing of a computation and the start of its batch.
+  Histogram queue_delay{-6, 0, 5};
+  // Seconds the backend takes to compute a batch. Added to by all workers of
+  // the backend, without the lock.
+  ConcurrentHistogram compute_time;
 };
 
 class MuxingNetwork : public Network {
  public:
-  MuxingNetwork(const Weights& weights, const OptionsDict& options) {
-    // int threads, int max_batch)
-    //: network_(std::move(network)), max_batch_(max_batch) {
+  MuxingNetwork(const WeightsPtr& weights, const OptionsDict& options)
+      : max_starve_(std::chrono::microseconds(
+            options.GetOrDefault<int>("max_starve_us", 50000))) {
 
     const auto parents = options.ListSubdicts();
     if (parents.empty()) {
@@ -99,43 +173,100 @@ class MuxingNetwork : public Network {
     }
   }
 
-  void AddBackend(const std::string& name, const Weights& weights,
+  void AddBackend(const std::string& name, const WeightsPtr& weights,
                   const OptionsDict& opts) {
     const int nn_threads = opts.GetOrDefault<int>("threads", 1);
-    const int max_batch = opts.GetOrDefault<int>("max_batch", 256);
+    int max_batch = opts.GetOrDefault<int>("max_batch", 256);
+    const int min_batch = opts.GetOrDefault<int>("min_batch", 1);
+    const int max_wait_us = opts.GetOrDefault<int>("max_wait_us", 0);
     const std::string backend = opts.GetOrDefault<std::string>("backend", name);
 
     networks_.emplace_back(
         NetworkFactory::Get()->Create(backend, weights, opts));
     Network* net = networks_.back().get();
+    const int step = net->GetPreferredBatchStep();
+    preferred_batch_step_ = std::max(preferred_batch_step_, step);
+    supports_policy_temp_ =
+        supports_policy_temp_ && net->SupportsPolicySoftmaxTemp();
+    // Keep combined batches to sizes the backend computes efficiently.
+    if (max_batch > step) max_batch -= max_batch % step;
+
+    backends_.emplace_back();
+    MuxingBackend* params = &backends_.back();
+    params->name = name;
+    params->max_batch = max_batch;
+    params->min_batch = std::min(min_batch, max_batch);
+    params->max_wait = std::chrono::microseconds(max_wait_us);
+    params->dump_stats = opts.GetOrDefault<bool>("stats", false);
 
     for (int i = 0; i < nn_threads; ++i) {
-      threads_.emplace_back(
-          [this, net, max_batch]() { Worker(net, max_batch); });
+      threads_.emplace_back([this, net, params]() {
+        Numa::BindThread(net->GetNumaNode());
+        Worker(net, params);
+      });
     }
   }
 
+  bool GetLoad(NetworkLoad* load) const override {
+    load->batches = batches_;
+    load->samples = samples_;
+    load->capacity = capacity_;
+    load->busy_seconds = busy_us_ * 1e-6;
+    load->threads = threads_.size();
+    return true;
+  }
+
   std::unique_ptr<NetworkComputation> NewComputation() override {
     return std::make_unique<MuxingComputation>(this);
   }
 
+  int GetPreferredBatchStep() const override { return preferred_batch_step_; }
+
+  bool SupportsPolicySoftmaxTemp() const override {
+    return supports_policy_temp_;
+  }
+
   void Enqueue(MuxingComputation* computation) {
-    std::lock_guard<std::mutex> lock(mutex_);
-    queue_.push(computation);
-    cv_.notify_one();
+    computation->enqueued_at = std::chrono::steady_clock::now();
+    computation->next = submitted_.load(std::memory_order_relaxed);
+    while (!submitted_.compare_exchange_weak(computation->next, computation)) {
+    }
+    // Both the push above and this load are sequentially consistent, so
+    // either the worker sees the computation before parking, or it is seen
+    // as parked here.
+    if (worker_parked_) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      cv_.notify_one();
+    }
   }
 
   ~MuxingNetwork() {
     Abort();
     Wait();
     // Unstuck waiting computations.
-    while (!queue_.empty()) {
-      queue_.front()->NotifyReady();
-      queue_.pop();
+    TakeSubmitted();
+    for (const auto& lane : pending_) {
+      for (auto computation : lane) computation->NotifyReady();
+    }
+    for (auto& backend : backends_) {
+      if (!backend.dump_stats) continue;
+      std::cerr << "Backend " << backend.name
+                << ", batch size / max_batch (" << backend.max_batch
+                << "), log10:" << std::endl;
+      backend.batch_fill.Dump();
+      std::cerr << "Backend " << backend.name
+                << ", queueing delay in seconds, log10:" << std::endl;
+      backend.queue_delay.Dump();
+      std::cerr << "Backend " << backend.name
+                << ", compute time of batches in seconds: "
+                << backend.compute_time.GetSnapshot().DebugString()
+                << std::endl;
     }
   }
 
-  void Worker(Network* network, const int max_batch) {
+  void Worker(Network* network, MuxingBackend* params) {
+    Tracer::Get().SetThreadName("mux worker");
+    const int max_batch = params->max_batch;
     // While Abort() is not called (and it can only be called from destructor).
     while (!abort_) {
       std::vector<MuxingComputation*> children;
@@ -143,41 +274,104 @@ class MuxingNetwork : public Network {
       // there.
       std::shared_ptr<NetworkComputation> parent(network->NewComputation());
       {
-        std::unique_lock<std::mutex> lock(mutex_);
+        // Only one worker gathers a batch at a time, so that computations
+        // queued while it waits for more go to its batch. What doesn't fit
+        // stays in pending_ for whichever worker is free next, so a backend
+        // which falls behind doesn't hold back work others could do.
+        Mutex::Lock gather_lock(gather_mutex_);
+        TraceScope trace("gather batch", "nn");
         // Wait until there's come work to compute.
-        cv_.wait(lock, [&] { return abort_ || !queue_.empty(); });
+        TakeSubmitted();
+        while (!abort_ && !GetOldestPending()) {
+          WaitForSubmissions(nullptr);
+          TakeSubmitted();
+        }
         if (abort_) break;
-
-        // While there is a work in queue, add it.
-        while (!queue_.empty()) {
-          // If we are reaching batch size limit, stop adding.
-          // However, if a single input batch is larger than output batch limit,
-          // we still have to add it.
-          if (parent->GetBatchSize() != 0 &&
-              parent->GetBatchSize() + queue_.front()->GetBatchSize() >
-                  max_batch) {
-            break;
+        const auto deadline =
+            GetOldestPending()->enqueued_at + params->max_wait;
+
+        int priority = 0;
+        while (true) {
+          bool full = false;
+          // While there is a work in queue, add it.
+          const auto now = std::chrono::steady_clock::now();
+          while (auto* lane = GetNextLane(now)) {
+            // If we are reaching batch size limit, stop adding.
+            // However, if a single input batch is larger than output batch
+            // limit, we still have to add it.
+            if (parent->GetBatchSize() != 0 &&
+                parent->GetBatchSize() + lane->front()->GetBatchSize() >
+                    max_batch) {
+              full = true;
+              break;
+            }
+            // Policy softmax temperature is per batch, so computations of
+            // another one are left for the next batch.
+            if (children.empty()) {
+              const float temp = lane->front()->GetPolicySoftmaxTemp();
+              if (temp != 1.0f) parent->SetPolicySoftmaxTemp(temp);
+            } else if (lane->front()->GetPolicySoftmaxTemp() !=
+                       children.front()->GetPolicySoftmaxTemp()) {
+              full = true;
+              break;
+            }
+            // Remember which of "input" computations we serve.
+            children.push_back(lane->front());
+            lane->pop_front();
+            priority = std::max(priority, children.back()->GetPriority());
+            // Make "input" computation populate data into output batch.
+            children.back()->PopulateToParent(parent);
           }
-          // Remember which of "input" computations we serve.
-          children.push_back(queue_.front());
-          queue_.pop();
-          // Make "input" computation populate data into output batch.
-          children.back()->PopulateToParent(parent);
+          if (full || parent->GetBatchSize() >= params->min_batch) break;
+          // Trade some latency for a fuller batch.
+          if (!WaitForSubmissions(&deadline) || abort_) break;
+          TakeSubmitted();
+        }
+
+        // For backends which queue computations themselves.
+        parent->SetPriority(priority);
+
+        const auto now = std::chrono::steady_clock::now();
+        const double fill =
+            static_cast<double>(parent->GetBatchSize()) / max_batch;
+        params->batch_fill.Add(fill);
+        GetMuxMetrics().batch_fill->Add(fill);
+        for (auto child : children) {
+          const double delay =
+              std::chrono::duration<double>(now - child->enqueued_at).count();
+          params->queue_delay.Add(delay);
+          GetMuxMetrics().queue_delay->Add(delay);
         }
       }
 
       // Compute.
-      parent->ComputeBlocking();
+      const auto start = std::chrono::steady_clock::now();
+      {
+        TraceScope trace("compute batch", "nn");
+        parent->ComputeBlocking();
+      }
+      const auto compute_time = std::chrono::steady_clock::now() - start;
+      busy_us_ +=
+          std::chrono::duration_cast<std::chrono::microseconds>(compute_time)
+              .count();
+      const double compute_seconds =
+          std::chrono::duration<double>(compute_time).count();
+      params->compute_time.Add(compute_seconds);
+      GetMuxMetrics().compute_time->Add(compute_seconds);
+      GetMuxMetrics().batches->Add();
+      GetMuxMetrics().samples->Add(parent->GetBatchSize());
+      ++batches_;
+      samples_ += parent->GetBatchSize();
+      // A single computation may be larger than max_batch.
+      capacity_ += std::max(max_batch, parent->GetBatchSize());
       // Notify children that data is ready!
       for (auto child : children) child->NotifyReady();
     }
   }
 
   void Abort() {
-    {
-      std::lock_guard<std::mutex> lock(mutex_);
-      abort_ = true;
-    }
+    abort_ = true;
+    std::lock_guard<std::mutex> lock(mutex_);
     cv_.notify_all();
   }
 
@@ -189,24 +383,131 @@ class MuxingNetwork : public Network {
   }
 
  private:
-  std::vector<std::unique_ptr<Network>> networks_;
-  std::queue<MuxingComputation*> queue_;
-  bool abort_ = false;
+  // Moves submitted computations to their lanes of pending_, in submission
+  // order.
+  void TakeSubmitted() REQUIRES(gather_mutex_) {
+    // Taking the whole stack at once is ABA-free.
+    MuxingComputation* head = submitted_.exchange(nullptr);
+    std::vector<MuxingComputation*> computations;
+    for (; head; head = head->next) computations.push_back(head);
+    for (auto iter = computations.rbegin(); iter != computations.rend();
+         ++iter) {
+      pending_[(*iter)->GetPriority() > 0 ? 1 : 0].push_back(*iter);
+    }
+  }
+
+  // Returns the lane to take the next computation of a batch from, nullptr
+  // if nothing is pending. Interactive computations go first, unless a
+  // background one has waited for longer than max_starve_.
+  std::deque<MuxingComputation*>* GetNextLane(
+      std::chrono::steady_clock::time_point now) REQUIRES(gather_mutex_) {
+    auto& background = pending_[0];
+    auto& interactive = pending_[1];
+    if (!background.empty() &&
+        (interactive.empty() ||
+         now - background.front()->enqueued_at > max_starve_)) {
+      return &background;
+    }
+    return interactive.empty() ? nullptr : &interactive;
+  }
 
+  // Returns the computation which was queued first, nullptr if there are
+  // none.
+  MuxingComputation* GetOldestPending() const REQUIRES(gather_mutex_) {
+    MuxingComputation* oldest = nullptr;
+    for (const auto& lane : pending_) {
+      if (!lane.empty() &&
+          (!oldest || lane.front()->enqueued_at < oldest->enqueued_at)) {
+        oldest = lane.front();
+      }
+    }
+    return oldest;
+  }
+
+  // Waits until something is submitted (true), @deadline passes (false) or
+  // the network is aborted (true). Called with gather_mutex_ held, so at
+  // most one worker waits.
+  bool WaitForSubmissions(const std::chrono::steady_clock::time_point* deadline)
+      REQUIRES(gather_mutex_) {
+    const auto ready = [&] { return abort_ || submitted_ != nullptr; };
+    for (int i = 0; i < kSpinIterations; ++i) {
+      if (ready()) return true;
+      std::this_thread::yield();
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    worker_parked_ = true;
+    bool result = true;
+    if (deadline) {
+      result = cv_.wait_until(lock, *deadline, ready);
+    } else {
+      cv_.wait(lock, ready);
+    }
+    worker_parked_ = false;
+    return result;
+  }
+
+  std::vector<std::unique_ptr<Network>> networks_;
+  // Backends with their batching parameters, addresses are stable.
+  std::deque<MuxingBackend> backends_;
+  int preferred_batch_step_ = 1;
+  // Whether all backends apply policy softmax temperature.
+  bool supports_policy_temp_ = true;
+  // Lock-free stack of computations submitted by search threads, newest
+  // first, linked through MuxingComputation::next.
+  std::atomic<MuxingComputation*> submitted_{nullptr};
+  std::atomic<bool> abort_{false};
+
+  Mutex gather_mutex_{"mux gather"};
+  // Submitted computations not in a batch yet, oldest first, by lane:
+  // background (priority 0) and interactive.
+  std::deque<MuxingComputation*> pending_[2] GUARDED_BY(gather_mutex_);
+  // How long a background computation may be overtaken.
+  const std::chrono::microseconds max_starve_;
+
+  // Only for parking of the gathering worker.
   std::mutex mutex_;
   std::condition_variable cv_;
+  std::atomic<bool> worker_parked_{false};
+
+  // Counters of GetLoad().
+  std::atomic<int64_t> batches_{0};
+  std::atomic<int64_t> samples_{0};
+  std::atomic<int64_t> capacity_{0};
+  std::atomic<int64_t> busy_us_{0};
 
   std::vector<std::thread> threads_;
 };
 
 void MuxingComputation::ComputeBlocking() {
   network_->Enqueue(this);
+  for (int i = 0; i < kSpinIterations; ++i) {
+    if (state_ == kReady) return;
+    std::this_thread::yield();
+  }
   std::unique_lock<std::mutex> lock(mutex_);
-  dataready_cv_.wait(lock, [this]() { return dataready_; });
+  int expected = kWaiting;
+  // Already ready.
+  if (!state_.compare_exchange_strong(expected, kParked)) return;
+  dataready_cv_.wait(lock, [this]() { return state_ == kNotified; });
+}
+
+// Prepares the backends as the constructor would add them.
+void PrepareMuxingNetwork(const OptionsDict& options) {
+  const auto parents = options.ListSubdicts();
+  if (parents.empty()) {
+    auto backends = NetworkFactory::Get()->GetBackendsList();
+    NetworkFactory::Get()->Prepare(backends[0], options);
+  }
+  for (const auto& name : parents) {
+    const auto& opts = options.GetSubdict(name);
+    NetworkFactory::Get()->Prepare(
+        opts.GetOrDefault<std::string>("backend", name), opts);
+  }
 }
 
 }  // namespace
 
 REGISTER_NETWORK("multiplexing", MuxingNetwork, -1000)
-  
+REGISTER_NETWORK_PREPARE("multiplexing", PrepareMuxingNetwork)
+
 }  // namespace lczero
@@ -36,23 +36,27 @@ namespace lczero {
 class RandomNetworkComputation : public NetworkComputation {
  public:
   RandomNetworkComputation(int delay, int seed) : delay_ms_(delay), seed_(seed) {}
-  void AddInput(InputPlanes&& input) override {
-    std::uint64_t hash = seed_;
-    for (const auto& plane : input) {
-      hash = HashCat({hash, plane.mask});
-      std::uint64_t value_hash = 
-          *reinterpret_cast<const std::uint32_t*>(&plane.value);
-      hash = HashCat({hash, value_hash});
-    }
-    inputs_.push_back(hash);
-  }
+  InputPlanesRef AddInputInPlace() override { return planes_.Add(); }
   void ComputeBlocking() override {
+    inputs_.clear();
+    for (int i = 0; i < planes_.GetSize(); ++i) {
+      const std::uint64_t* masks = planes_.GetMasks(i);
+      const float* values = planes_.GetValues(i);
+      std::uint64_t hash = seed_;
+      for (int j = 0; j < kInputPlanes; ++j) {
+        hash = HashCat({hash, masks[j]});
+        std::uint64_t value_hash =
+            *reinterpret_cast<const std::uint32_t*>(&values[j]);
+        hash = HashCat({hash, value_hash});
+      }
+      inputs_.push_back(hash);
+    }
     if (delay_ms_) {
       std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms_));
     }
   }
 
-  int GetBatchSize() const override { return inputs_.size(); }
+  int GetBatchSize() const override { return planes_.GetSize(); }
   float GetQVal(int sample) const override {
     return (int(inputs_[sample] % 200000) - 100000) / 100000.0;
   }
@@ -63,6 +67,8 @@ class RandomNetworkComputation : public NetworkComputation {
   }
 
  private:
+  InputBatch planes_;
+  // Hashes of inputs, computed in ComputeBlocking().
   std::vector<std::uint64_t> inputs_;
   int delay_ms_ = 0;
   int seed_ = 0;
@@ -70,7 +76,7 @@ class RandomNetworkComputation : public NetworkComputation {
 
 class RandomNetwork : public Network {
  public:
-  RandomNetwork(const Weights& /*weights*/, const OptionsDict& options)
+  RandomNetwork(const WeightsPtr& /*weights*/, const OptionsDict& options)
       : delay_ms_(options.GetOrDefault<int>("delay", 0)), 
         seed_(options.GetOrDefault<int>("seed", 0)) {}
   std::unique_ptr<NetworkComputation> NewComputation() override {
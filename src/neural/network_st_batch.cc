@@ -51,11 +51,24 @@ SingleThreadBatchingNetworkComputation::SingleThreadBatchingNetworkComputation(
     : network_(network),
       start_idx_(network_->parent_computation_->GetBatchSize()) {}
 
-void SingleThreadBatchingNetworkComputation::AddInput(InputPlanes&& input) {
+InputPlanesRef SingleThreadBatchingNetworkComputation::AddInputInPlace() {
   assert(start_idx_ + batch_size_ ==
          network_->parent_computation_->GetBatchSize());
   ++batch_size_;
-  network_->parent_computation_->AddInput(std::move(input));
+  return network_->parent_computation_->AddInputInPlace();
+}
+
+InputPlanesRef SingleThreadBatchingNetworkComputation::AddInputForMoves(
+    const uint16_t* move_ids, int count) {
+  assert(start_idx_ + batch_size_ ==
+         network_->parent_computation_->GetBatchSize());
+  ++batch_size_;
+  return network_->parent_computation_->AddInputForMoves(move_ids, count);
+}
+
+void SingleThreadBatchingNetworkComputation::SetPolicySoftmaxTemp(
+    float temp) {
+  network_->parent_computation_->SetPolicySoftmaxTemp(temp);
 }
 
 void SingleThreadBatchingNetworkComputation::ComputeBlocking() {
@@ -72,4 +85,12 @@ float SingleThreadBatchingNetworkComputation::GetPVal(int sample,
   return network_->parent_computation_->GetPVal(sample - start_idx_, move_id);
 }
 
+void SingleThreadBatchingNetworkComputation::GetPVals(int sample,
+                                                      const uint16_t* move_ids,
+                                                      int count,
+                                                      float* out) const {
+  network_->parent_computation_->GetPVals(sample - start_idx_, move_ids, count,
+                                          out);
+}
+
 }  // namespace lczero
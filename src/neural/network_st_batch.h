@@ -52,6 +52,12 @@ class SingleThreadBatchingNetwork : public Network {
  public:
   SingleThreadBatchingNetwork(std::unique_ptr<Network> parent);
   std::unique_ptr<NetworkComputation> NewComputation() override;
+  int GetPreferredBatchStep() const override {
+    return parent_->GetPreferredBatchStep();
+  }
+  bool SupportsPolicySoftmaxTemp() const override {
+    return parent_->SupportsPolicySoftmaxTemp();
+  }
 
   // Start a fresh batch.
   void Reset();
@@ -68,16 +74,23 @@ class SingleThreadBatchingNetworkComputation : public NetworkComputation {
   SingleThreadBatchingNetworkComputation(SingleThreadBatchingNetwork* network);
 
   // Adds a sample to the parent batch.
-  void AddInput(InputPlanes&& input) override;
+  InputPlanesRef AddInputInPlace() override;
+  InputPlanesRef AddInputForMoves(const uint16_t* move_ids,
+                                  int count) override;
+  // Sets temperature of the whole parent batch, so all computations of a
+  // batch are expected to use the same one.
+  void SetPolicySoftmaxTemp(float temp) override;
   // May not actually compute immediately. Instead computes when all computations
   // of the network called this.
   void ComputeBlocking() override;
-  // Returns how many times AddInput() was called.
+  // Returns how many samples were added.
   int GetBatchSize() const override { return batch_size_; }
   // Returns Q value of @sample.
   float GetQVal(int sample) const override;
   // Returns P value @move_id of @sample.
   float GetPVal(int sample, int move_id) const override;
+  void GetPVals(int sample, const uint16_t* move_ids, int count,
+                float* out) const override;
 
  private:
   SingleThreadBatchingNetwork* const network_;
@@ -27,9 +27,13 @@
 
 #include "neural/factory.h"
 #include "utils/bititer.h"
+#include "utils/exception.h"
+#include "utils/mutex.h"
 #include "utils/optionsdict.h"
 #include "utils/transpose.h"
 
+#include <map>
+
 #include <tensorflow/cc/client/client_session.h>
 #include <tensorflow/cc/ops/standard_ops.h>
 #include <tensorflow/core/framework/tensor.h>
@@ -171,48 +175,71 @@ class TFNetworkComputation;
 template <bool CPU>
 class TFNetwork : public Network {
  public:
-  TFNetwork(const Weights& weights, const OptionsDict& options);
+  TFNetwork(const WeightsPtr& weights, const OptionsDict& options);
 
   std::unique_ptr<NetworkComputation> NewComputation() override;
 
   tensorflow::Status Compute(tensorflow::Tensor& input,
                              std::vector<tensorflow::Tensor>* outputs) const;
 
+  // Returns an input tensor for @batch_size samples, padded to the batch
+  // size of a bucket so that the graph only sees a few shapes. Contents are
+  // undefined.
+  tensorflow::Tensor AcquireInput(int batch_size) const;
+  // Returns a tensor from AcquireInput() to be reused.
+  void ReleaseInput(tensorflow::Tensor tensor) const;
+
  private:
+  int GetPaddedSize(int batch_size) const;
+
   tensorflow::Scope scope_;
   std::unique_ptr<tensorflow::ClientSession> session_;
 
   std::unique_ptr<tensorflow::ops::Placeholder> input_;
   std::unique_ptr<tensorflow::Output> policy_head_;
   std::unique_ptr<tensorflow::Output> value_head_;
+
+  // Padded batch sizes, ascending. Larger batches are padded to a multiple
+  // of the last one.
+  std::vector<int> buckets_;
+  mutable Mutex inputs_mutex_;
+  // Input tensors not in use, by padded batch size.
+  mutable std::map<int, std::vector<tensorflow::Tensor>> free_inputs_
+      GUARDED_BY(inputs_mutex_);
 };
 
 template <bool CPU>
 class TFNetworkComputation : public NetworkComputation {
  public:
   TFNetworkComputation(const TFNetwork<CPU>* network) : network_(network) {}
-  void AddInput(InputPlanes&& input) override {
-    raw_input_.emplace_back(input);
+  ~TFNetworkComputation() {
+    if (input_.IsInitialized()) network_->ReleaseInput(std::move(input_));
   }
+  InputPlanesRef AddInputInPlace() override { return raw_input_.Add(); }
   void ComputeBlocking() override {
     PrepareInput();
     status_ = network_->Compute(input_, &output_);
     CHECK(status_.ok()) << status_.ToString();
   }
 
-  int GetBatchSize() const override { return raw_input_.size(); }
+  int GetBatchSize() const override { return raw_input_.GetSize(); }
   float GetQVal(int sample) const override {
     return output_[0].template matrix<float>()(sample, 0);
   }
   float GetPVal(int sample, int move_id) const override {
     return output_[1].template matrix<float>()(sample, move_id);
   }
+  void GetPVals(int sample, const uint16_t* move_ids, int count,
+                float* out) const override {
+    const auto policy = output_[1].template matrix<float>();
+    for (int i = 0; i < count; ++i) out[i] = policy(sample, move_ids[i]);
+  }
 
  private:
   void PrepareInput();
 
   const TFNetwork<CPU>* network_;
-  std::vector<InputPlanes> raw_input_;
+  InputBatch raw_input_;
 
   tensorflow::Tensor input_;
   std::vector<tensorflow::Tensor> output_;
@@ -222,18 +249,18 @@ class TFNetworkComputation : public NetworkComputation {
 // Version for GPU.
 template <>
 void TFNetworkComputation<false>::PrepareInput() {
-  input_ = tensorflow::Tensor(
-      tensorflow::DataType::DT_FLOAT,
-      {static_cast<int>(raw_input_.size()), kInputPlanes, 8, 8});
+  input_ = network_->AcquireInput(raw_input_.GetSize());
 
+  // Padding samples are zeroed too.
   auto flat = input_.flat<float>();
   memset(flat.data(), 0, flat.size() * sizeof(*flat.data()));
   auto iter = flat.data();
-  for (const auto& sample : raw_input_) {
-    CHECK_EQ(sample.size(), kInputPlanes);
-    for (const auto& plane : sample) {
-      for (auto bit : IterateBits(plane.mask)) {
-        *(iter + bit) = plane.value;
+  for (int input_idx = 0; input_idx < raw_input_.GetSize(); ++input_idx) {
+    const uint64_t* masks = raw_input_.GetMasks(input_idx);
+    const float* values = raw_input_.GetValues(input_idx);
+    for (int plane_idx = 0; plane_idx < kInputPlanes; ++plane_idx) {
+      for (auto bit : IterateBits(masks[plane_idx])) {
+        *(iter + bit) = values[plane_idx];
       }
       iter += 64;
     }
@@ -243,33 +270,37 @@ void TFNetworkComputation<false>::PrepareInput() {
 // Version for CPU.
 template <>
 void TFNetworkComputation<true>::PrepareInput() {
-  input_ = tensorflow::Tensor(
-      tensorflow::DataType::DT_FLOAT,
-      {static_cast<int>(raw_input_.size()), 8, 8, kInputPlanes});
+  input_ = network_->AcquireInput(raw_input_.GetSize());
 
   auto flat = input_.flat<float>();
   memset(flat.data(), 0, flat.size() * sizeof(*flat.data()));
   auto* data = flat.data();
-  for (size_t input_idx = 0; input_idx < raw_input_.size(); ++input_idx) {
-    const auto& sample = raw_input_[input_idx];
+  for (int input_idx = 0; input_idx < raw_input_.GetSize(); ++input_idx) {
+    const uint64_t* masks = raw_input_.GetMasks(input_idx);
+    const float* values = raw_input_.GetValues(input_idx);
     int base = kInputPlanes * 8 * 8 * input_idx;
 
-    CHECK_EQ(sample.size(), kInputPlanes);
     for (int plane_idx = 0; plane_idx < kInputPlanes; ++plane_idx) {
-      const auto& plane = sample[plane_idx];
-      for (auto bit : IterateBits(plane.mask)) {
-        data[base + bit * kInputPlanes + plane_idx] = plane.value;
+      for (auto bit : IterateBits(masks[plane_idx])) {
+        data[base + bit * kInputPlanes + plane_idx] = values[plane_idx];
       }
     }
   }
 }  // namespace
 
 template <bool CPU>
-TFNetwork<CPU>::TFNetwork(const Weights& weights,
-                          const OptionsDict& /*options*/)
+TFNetwork<CPU>::TFNetwork(const WeightsPtr& weights,
+                          const OptionsDict& options)
     : scope_(Scope::NewRootScope()) {
   tensorflow::SessionOptions session_options;
   if (CPU) (*session_options.config.mutable_device_count())["GPU"] = 0;
+  // XLA compiles the graph once per input shape, which the fixed batch
+  // buckets keep to a few.
+  if (options.GetOrDefault<bool>("xla", false)) {
+    session_options.config.mutable_graph_options()
+        ->mutable_optimizer_options()
+        ->set_global_jit_level(OptimizerOptions::ON_1);
+  }
   session_ =
       std::make_unique<tensorflow::ClientSession>(scope_, session_options);
 
@@ -283,17 +314,61 @@ TFNetwork<CPU>::TFNetwork(const Weights& weights,
         Placeholder::Shape({-1, kInputPlanes, 8, 8}));
   }
 
-  auto output = MakeNetwork<CPU>(scope_, *input_, weights);
+  auto output = MakeNetwork<CPU>(scope_, *input_, *weights);
   CHECK(scope_.ok()) << scope_.status().ToString();
 
   policy_head_ = std::make_unique<Output>(output.first);
   value_head_ = std::make_unique<Output>(output.second);
 
-  // First request to tensorflow is slow (0.6s), so doing an empty request for
-  // preheating.
-  auto fake_request = NewComputation();
-  fake_request->AddInput(InputPlanes(kInputPlanes));
-  fake_request->ComputeBlocking();
+  // Powers of two up to max_batch.
+  const int max_batch = options.GetOrDefault<int>("max_batch", 256);
+  if (max_batch < 1) throw Exception("max_batch must be positive.");
+  for (int size = 1; size < max_batch; size *= 2) buckets_.push_back(size);
+  buckets_.push_back(max_batch);
+
+  // First request of a shape to tensorflow is slow (0.6s, much more with
+  // XLA), so doing an empty request per bucket for preheating.
+  for (const int size : buckets_) {
+    auto fake_request = NewComputation();
+    for (int i = 0; i < size; ++i) fake_request->AddInput(InputPlanes());
+    fake_request->ComputeBlocking();
+  }
+}
+
+template <bool CPU>
+int TFNetwork<CPU>::GetPaddedSize(int batch_size) const {
+  for (const int size : buckets_) {
+    if (batch_size <= size) return size;
+  }
+  const int step = buckets_.back();
+  return (batch_size + step - 1) / step * step;
+}
+
+template <bool CPU>
+tensorflow::Tensor TFNetwork<CPU>::AcquireInput(int batch_size) const {
+  const int padded = GetPaddedSize(batch_size);
+  {
+    Mutex::Lock lock(inputs_mutex_);
+    auto& free = free_inputs_[padded];
+    if (!free.empty()) {
+      auto tensor = std::move(free.back());
+      free.pop_back();
+      return tensor;
+    }
+  }
+  if (CPU) {
+    return tensorflow::Tensor(tensorflow::DataType::DT_FLOAT,
+                              {padded, 8, 8, kInputPlanes});
+  }
+  return tensorflow::Tensor(tensorflow::DataType::DT_FLOAT,
+                            {padded, kInputPlanes, 8, 8});
+}
+
+template <bool CPU>
+void TFNetwork<CPU>::ReleaseInput(tensorflow::Tensor tensor) const {
+  const int padded = tensor.dim_size(0);
+  Mutex::Lock lock(inputs_mutex_);
+  free_inputs_[padded].push_back(std::move(tensor));
 }
 
 template <bool CPU>
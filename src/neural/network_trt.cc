@@ -0,0 +1,836 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include <NvInfer.h>
+#include <algorithm>
+#include <cctype>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "chess/position.h"
+#include "neural/cuda_common.h"
+#include "neural/encoder.h"
+#include "neural/factory.h"
+#include "neural/shared_weights.h"
+#include "utils/commandline.h"
+#include "utils/exception.h"
+#include "utils/hashcat.h"
+#include "utils/numa.h"
+#include "utils/random.h"
+#include "utils/string.h"
+
+// Tensor names and enqueueV3() are used, which need TensorRT 8.5.
+#if NV_TENSORRT_MAJOR * 100 + NV_TENSORRT_MINOR < 805
+#error "The TensorRT backend needs TensorRT 8.5 or newer."
+#endif
+
+namespace lczero {
+namespace {
+
+constexpr int kNumOutputPolicy = 1858;
+
+const char* kInputName = "input";
+const char* kPolicyTempName = "policy_temp_inv";
+const char* kPolicyName = "policy";
+const char* kValueName = "value";
+
+enum class Precision { kFp16, kInt8 };
+
+// Prints warnings and errors of TensorRT.
+class Logger : public nvinfer1::ILogger {
+ public:
+  void log(Severity severity,
+           const nvinfer1::AsciiChar* msg) noexcept override {
+    if (severity <= Severity::kWARNING) {
+      std::cerr << "TensorRT: " << msg << std::endl;
+    }
+  }
+};
+
+Logger& GetLogger() {
+  static Logger logger;
+  return logger;
+}
+
+// Builds the engine of the network in TensorRT's layers: convolutions with
+// batch norm folded into them, and the fully connected layers of the heads as
+// matrix multiplications. TensorRT fuses the biases, residual additions and
+// ReLUs into the convolutions.
+class NetworkBuilder {
+ public:
+  NetworkBuilder(nvinfer1::INetworkDefinition* network,
+                 Precision precision)
+      : network_(network), precision_(precision) {}
+
+  void Build(const Weights& weights) {
+    // Planes are expanded by expandPlanes_Fp16_NHWC(): fp16, channels last,
+    // which is TensorRT's HWC8 format as there are 112 of them.
+    auto input = network_->addInput(
+        kInputName, nvinfer1::DataType::kHALF,
+        nvinfer1::Dims4{-1, kInputPlanes, 8, 8});
+    input->setAllowedFormats(1U << static_cast<int>(
+                                 nvinfer1::TensorFormat::kHWC8));
+
+    auto flow = Conv(input, weights.input, 3, true);
+    for (const auto& residual : weights.residual) {
+      auto block = Conv(flow, residual.conv1, 3, true);
+      block = Conv(block, residual.conv2, 3, false);
+      flow = Relu(Add(block, flow));
+    }
+
+    // Policy head. The logits are multiplied by the inverse of the softmax
+    // temperature, which is an input so that one engine serves all of them.
+    auto policy = Flatten(Conv(flow, weights.policy, 1, true));
+    policy = FullyConnected(policy, weights.ip_pol_w, weights.ip_pol_b);
+    auto temp = network_->addInput(kPolicyTempName, nvinfer1::DataType::kFLOAT,
+                                   nvinfer1::Dims2{1, 1});
+    policy = network_
+                 ->addElementWise(*policy, *temp,
+                                  nvinfer1::ElementWiseOperation::kPROD)
+                 ->getOutput(0);
+    auto softmax = network_->addSoftMax(*policy);
+    softmax->setAxes(1U << 1);
+    Output(softmax->getOutput(0), kPolicyName);
+
+    // Value head.
+    auto value = Flatten(Conv(flow, weights.value, 1, true));
+    value = Relu(FullyConnected(value, weights.ip1_val_w, weights.ip1_val_b));
+    value = FullyConnected(value, weights.ip2_val_w, weights.ip2_val_b);
+    value = network_
+                ->addActivation(*value, nvinfer1::ActivationType::kTANH)
+                ->getOutput(0);
+    Output(value, kValueName);
+  }
+
+ private:
+  static nvinfer1::Weights Wrap(const std::vector<float>& vec) {
+    return {nvinfer1::DataType::kFLOAT, vec.data(),
+            static_cast<int64_t>(vec.size())};
+  }
+
+  nvinfer1::ITensor* Conv(nvinfer1::ITensor* input,
+                          const Weights::ConvBlock& block, int filter_size,
+                          bool relu) {
+    auto conv = network_->addConvolutionNd(
+        *input, block.biases.size(), nvinfer1::DimsHW{filter_size, filter_size},
+        Wrap(block.weights), Wrap(block.biases));
+    conv->setPaddingNd(nvinfer1::DimsHW{filter_size / 2, filter_size / 2});
+    auto output = conv->getOutput(0);
+    return relu ? Relu(output) : output;
+  }
+
+  nvinfer1::ITensor* Relu(nvinfer1::ITensor* input) {
+    return network_->addActivation(*input, nvinfer1::ActivationType::kRELU)
+        ->getOutput(0);
+  }
+
+  nvinfer1::ITensor* Add(nvinfer1::ITensor* a, nvinfer1::ITensor* b) {
+    return network_
+        ->addElementWise(*a, *b, nvinfer1::ElementWiseOperation::kSUM)
+        ->getOutput(0);
+  }
+
+  // NCHW to N x CHW, the order the weights of the heads are in.
+  nvinfer1::ITensor* Flatten(nvinfer1::ITensor* input) {
+    auto shuffle = network_->addShuffle(*input);
+    shuffle->setReshapeDimensions(nvinfer1::Dims2{0, -1});
+    return shuffle->getOutput(0);
+  }
+
+  // Weights are outputs x inputs, row-major.
+  nvinfer1::ITensor* FullyConnected(nvinfer1::ITensor* input,
+                                    const std::vector<float>& weights,
+                                    const std::vector<float>& biases) {
+    const int outputs = biases.size();
+    const int inputs = weights.size() / outputs;
+    auto w = network_->addConstant(nvinfer1::Dims2{outputs, inputs},
+                                   Wrap(weights));
+    auto b = network_->addConstant(nvinfer1::Dims2{1, outputs}, Wrap(biases));
+    auto matmul = network_->addMatrixMultiply(
+        *input, nvinfer1::MatrixOperation::kNONE, *w->getOutput(0),
+        nvinfer1::MatrixOperation::kTRANSPOSE);
+    auto add = network_->addElementWise(*matmul->getOutput(0),
+                                        *b->getOutput(0),
+                                        nvinfer1::ElementWiseOperation::kSUM);
+    // The heads are small, and their outputs are what the search sees, so
+    // they are kept out of int8.
+    if (precision_ == Precision::kInt8) {
+      matmul->setPrecision(nvinfer1::DataType::kHALF);
+      add->setPrecision(nvinfer1::DataType::kHALF);
+    }
+    return add->getOutput(0);
+  }
+
+  void Output(nvinfer1::ITensor* tensor, const char* name) {
+    tensor->setName(name);
+    tensor->setType(nvinfer1::DataType::kFLOAT);
+    network_->markOutput(*tensor);
+  }
+
+  nvinfer1::INetworkDefinition* const network_;
+  const Precision precision_;
+};
+
+// Reads a whole file, returns an empty vector if it cannot be read.
+std::vector<char> ReadFile(const std::string& filename) {
+  std::ifstream file(filename, std::ios::binary);
+  if (!file) return {};
+  return std::vector<char>(std::istreambuf_iterator<char>(file),
+                           std::istreambuf_iterator<char>());
+}
+
+// Writes a file through a temporary one, so that other processes never read
+// a partial file. Failures are only reported, as the file is only a cache.
+void WriteFile(const std::string& filename, const void* data, size_t size) {
+  const std::string tmp_filename =
+      filename + ".tmp" + Random::Get().GetString(8);
+  {
+    std::ofstream file(tmp_filename, std::ios::binary);
+    file.write(static_cast<const char*>(data), size);
+    if (!file) {
+      std::cerr << "Cannot write " << tmp_filename << std::endl;
+      std::remove(tmp_filename.c_str());
+      return;
+    }
+  }
+  if (std::rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+    std::cerr << "Cannot write " << filename << std::endl;
+    std::remove(tmp_filename.c_str());
+  }
+}
+
+// Positions to calibrate int8 with: FEN (or EPD) positions of @filename, one
+// per line, or if it's empty, positions of games of random moves.
+std::vector<InputPlanes> GetCalibrationPositions(const std::string& filename,
+                                                 int count) {
+  std::vector<InputPlanes> result;
+  PositionHistory history;
+  if (!filename.empty()) {
+    std::ifstream file(filename);
+    if (!file) throw Exception("Cannot read " + filename);
+    std::string line;
+    while (static_cast<int>(result.size()) < count &&
+           std::getline(file, line)) {
+      auto fields = StrSplitAtWhitespace(line);
+      if (fields.size() < 4) continue;
+      // EPD has operations instead of move counters.
+      if (fields.size() < 6 || !std::isdigit(fields[4][0]) ||
+          !std::isdigit(fields[5][0])) {
+        fields.resize(4);
+        fields.push_back("0");
+        fields.push_back("1");
+      }
+      ChessBoard board;
+      int no_capture_ply;
+      int full_moves;
+      board.SetFromFen(fields[0] + " " + fields[1] + " " + fields[2] + " " +
+                           fields[3] + " " + fields[4] + " " + fields[5],
+                       &no_capture_ply, &full_moves);
+      history.Reset(board, no_capture_ply,
+                    full_moves * 2 - (board.flipped() ? 1 : 2));
+      result.push_back(EncodePositionForNN(history, kMoveHistory));
+    }
+    if (result.empty()) throw Exception("No positions in " + filename);
+    return result;
+  }
+  // Random games are short in legal positions of the middlegame, so a few
+  // positions are taken from each of many games.
+  ChessBoard start;
+  start.SetFromFen(ChessBoard::kStartingFen);
+  while (static_cast<int>(result.size()) < count) {
+    history.Reset(start, 0, 0);
+    const int plies = Random::Get().GetInt(0, 120);
+    for (int ply = 0; ply < plies; ++ply) {
+      if (history.ComputeGameResult() != GameResult::UNDECIDED) break;
+      const auto moves = history.Last().GetBoard().GenerateLegalMoves();
+      history.Append(moves[Random::Get().GetInt(0, moves.size() - 1)]);
+    }
+    result.push_back(EncodePositionForNN(history, kMoveHistory));
+  }
+  return result;
+}
+
+// Feeds batches of calibration positions to the int8 calibration of the
+// builder. The resulting scales are cached in a file per weights, so that
+// engines for other batch profiles or GPUs don't calibrate again.
+class Int8Calibrator : public nvinfer1::IInt8EntropyCalibrator2 {
+ public:
+  static constexpr int kBatchSize = 64;
+
+  Int8Calibrator(std::vector<InputPlanes> positions,
+                 const std::string& cache_filename)
+      : positions_(std::move(positions)), cache_filename_(cache_filename) {
+    ReportCUDAErrors(cudaStreamCreate(&stream_));
+    ReportCUDAErrors(
+        cudaMalloc(&masks_, kBatchSize * kInputPlanes * sizeof(uint64_t)));
+    ReportCUDAErrors(
+        cudaMalloc(&values_, kBatchSize * kInputPlanes * sizeof(float)));
+    ReportCUDAErrors(
+        cudaMalloc(&input_, kBatchSize * kInputPlanes * 64 * sizeof(half)));
+    ReportCUDAErrors(cudaMalloc(&temp_inv_, sizeof(float)));
+    const float one = 1.0f;
+    ReportCUDAErrors(
+        cudaMemcpy(temp_inv_, &one, sizeof(float), cudaMemcpyHostToDevice));
+  }
+
+  ~Int8Calibrator() {
+    cudaFree(masks_);
+    cudaFree(values_);
+    cudaFree(input_);
+    cudaFree(temp_inv_);
+    cudaStreamDestroy(stream_);
+  }
+
+  // With the batch dimension explicit, the size of batches comes from the
+  // calibration profile.
+  int32_t getBatchSize() const noexcept override { return 1; }
+
+  bool getBatch(void* bindings[], const char* names[],
+                int32_t nbBindings) noexcept override {
+    if (next_ + kBatchSize > static_cast<int>(positions_.size())) {
+      return false;
+    }
+    std::vector<uint64_t> masks;
+    std::vector<float> values;
+    for (int i = next_; i < next_ + kBatchSize; ++i) {
+      masks.insert(masks.end(), std::begin(positions_[i].masks),
+                   std::end(positions_[i].masks));
+      values.insert(values.end(), std::begin(positions_[i].values),
+                    std::end(positions_[i].values));
+    }
+    next_ += kBatchSize;
+    try {
+      ReportCUDAErrors(cudaMemcpyAsync(masks_, masks.data(),
+                                       masks.size() * sizeof(uint64_t),
+                                       cudaMemcpyHostToDevice, stream_));
+      ReportCUDAErrors(cudaMemcpyAsync(values_, values.data(),
+                                       values.size() * sizeof(float),
+                                       cudaMemcpyHostToDevice, stream_));
+      expandPlanes_Fp16_NHWC(input_, masks_, values_,
+                             kBatchSize * kInputPlanes, stream_);
+      ReportCUDAErrors(cudaStreamSynchronize(stream_));
+    } catch (const Exception& e) {
+      std::cerr << e.what() << std::endl;
+      return false;
+    }
+    for (int i = 0; i < nbBindings; ++i) {
+      bindings[i] = std::strcmp(names[i], kInputName) == 0
+                        ? static_cast<void*>(input_)
+                        : static_cast<void*>(temp_inv_);
+    }
+    return true;
+  }
+
+  const void* readCalibrationCache(size_t& length) noexcept override {
+    cache_ = ReadFile(cache_filename_);
+    length = cache_.size();
+    return cache_.empty() ? nullptr : cache_.data();
+  }
+
+  void writeCalibrationCache(const void* cache,
+                             size_t length) noexcept override {
+    WriteFile(cache_filename_, cache, length);
+  }
+
+ private:
+  const std::vector<InputPlanes> positions_;
+  const std::string cache_filename_;
+  std::vector<char> cache_;
+  int next_ = 0;
+
+  cudaStream_t stream_;
+  uint64_t* masks_;
+  float* values_;
+  half* input_;
+  float* temp_inv_;
+};
+
+// Pinned host buffers of a computation. The GPU reads inputs from them
+// directly, and outputs are copied into them.
+struct InputsOutputs {
+  InputsOutputs(int max_batch_size) {
+    ReportCUDAErrors(cudaHostAlloc(
+        &input_masks_mem_, max_batch_size * kInputPlanes * sizeof(uint64_t),
+        cudaHostAllocMapped));
+    ReportCUDAErrors(
+        cudaHostGetDevicePointer(&input_masks_mem_gpu_, input_masks_mem_, 0));
+    ReportCUDAErrors(cudaHostAlloc(
+        &input_val_mem_, max_batch_size * kInputPlanes * sizeof(float),
+        cudaHostAllocMapped));
+    ReportCUDAErrors(
+        cudaHostGetDevicePointer(&input_val_mem_gpu_, input_val_mem_, 0));
+    ReportCUDAErrors(cudaMallocHost(
+        &op_policy_mem_, max_batch_size * kNumOutputPolicy * sizeof(float)));
+    ReportCUDAErrors(
+        cudaMallocHost(&op_value_mem_, max_batch_size * sizeof(float)));
+    ReportCUDAErrors(cudaMallocHost(&policy_temp_inv_mem_, sizeof(float)));
+  }
+  ~InputsOutputs() {
+    ReportCUDAErrors(cudaFreeHost(input_masks_mem_));
+    ReportCUDAErrors(cudaFreeHost(input_val_mem_));
+    ReportCUDAErrors(cudaFreeHost(op_policy_mem_));
+    ReportCUDAErrors(cudaFreeHost(op_value_mem_));
+    ReportCUDAErrors(cudaFreeHost(policy_temp_inv_mem_));
+  }
+  uint64_t* input_masks_mem_;
+  float* input_val_mem_;
+  float* op_policy_mem_;
+  float* op_value_mem_;
+  float* policy_temp_inv_mem_;
+
+  // GPU pointers for the inputs.
+  uint64_t* input_masks_mem_gpu_;
+  float* input_val_mem_gpu_;
+};
+
+// Execution context of the engine with its stream and buffers. Each one has
+// an optimization profile of its own, so that they run concurrently.
+struct ExecutionContext {
+  ExecutionContext(nvinfer1::ICudaEngine* engine, int profile,
+                   int max_batch_size) {
+    ReportCUDAErrors(
+        cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking));
+    context.reset(engine->createExecutionContext());
+    if (!context) throw Exception("Cannot create TensorRT context.");
+    context->setOptimizationProfileAsync(profile, stream);
+    ReportCUDAErrors(cudaMalloc(
+        &input, max_batch_size * kInputPlanes * 64 * sizeof(half)));
+    ReportCUDAErrors(cudaMalloc(
+        &op_policy, max_batch_size * kNumOutputPolicy * sizeof(float)));
+    ReportCUDAErrors(cudaMalloc(&op_value, max_batch_size * sizeof(float)));
+    ReportCUDAErrors(cudaMalloc(&policy_temp_inv, sizeof(float)));
+    context->setTensorAddress(kInputName, input);
+    context->setTensorAddress(kPolicyTempName, policy_temp_inv);
+    context->setTensorAddress(kPolicyName, op_policy);
+    context->setTensorAddress(kValueName, op_value);
+    ReportCUDAErrors(cudaStreamSynchronize(stream));
+  }
+  ~ExecutionContext() {
+    context.reset();
+    ReportCUDAErrors(cudaFree(input));
+    ReportCUDAErrors(cudaFree(op_policy));
+    ReportCUDAErrors(cudaFree(op_value));
+    ReportCUDAErrors(cudaFree(policy_temp_inv));
+    cudaStreamDestroy(stream);
+  }
+  cudaStream_t stream;
+  std::unique_ptr<nvinfer1::IExecutionContext> context;
+  half* input;
+  float* op_policy;
+  float* op_value;
+  float* policy_temp_inv;
+};
+
+class TrtNetwork;
+
+class TrtNetworkComputation : public NetworkComputation {
+ public:
+  TrtNetworkComputation(TrtNetwork* network);
+  ~TrtNetworkComputation();
+
+  // Planes are written straight into the pinned buffer which the GPU reads.
+  InputPlanesRef AddInputInPlace() override;
+
+  // Logits are divided by the temperature in the engine, before the softmax.
+  void SetPolicySoftmaxTemp(float temp) override { policy_temp_ = temp; }
+
+  void ComputeBlocking() override;
+
+  int GetBatchSize() const override { return batch_size_; }
+
+  float GetQVal(int sample) const override {
+    return inputs_outputs_->op_value_mem_[sample];
+  }
+  float GetPVal(int sample, int move_id) const override {
+    return inputs_outputs_->op_policy_mem_[sample * kNumOutputPolicy + move_id];
+  }
+  void GetPVals(int sample, const uint16_t* move_ids, int count,
+                float* out) const override {
+    const float* policy =
+        &inputs_outputs_->op_policy_mem_[sample * kNumOutputPolicy];
+    for (int i = 0; i < count; ++i) out[i] = policy[move_ids[i]];
+  }
+
+ private:
+  std::unique_ptr<InputsOutputs> inputs_outputs_;
+  int batch_size_ = 0;
+  float policy_temp_ = 1.0f;
+
+  TrtNetwork* const network_;
+};
+
+// The TensorRT backend, in fp16 or int8 (with fp16 where int8 is slower or
+// for the heads). An engine is built for the weights, GPU, precision and
+// batch profile, and serialized into the "engine-cache" directory, so that
+// it's built only once. Engines for int8 are calibrated with positions of the
+// "calibration-file" (FEN or EPD positions, one per line) or, if it's not
+// set, of games of random moves.
+class TrtNetwork : public Network {
+ public:
+  TrtNetwork(const WeightsPtr& weights, const OptionsDict& options,
+             Precision precision)
+      : gpu_id_(options.GetOrDefault<int>("gpu", 0)) {
+    int total_gpus;
+    ReportCUDAErrors(cudaGetDeviceCount(&total_gpus));
+    if (gpu_id_ < 0 || gpu_id_ >= total_gpus) {
+      throw Exception("Invalid GPU Id: " + std::to_string(gpu_id_));
+    }
+    ReportCUDAErrors(cudaSetDevice(gpu_id_));
+    cudaDeviceProp deviceProp = {};
+    ReportCUDAErrors(cudaGetDeviceProperties(&deviceProp, gpu_id_));
+    if (deviceProp.major < 7) throw Exception("Your GPU doesn't support FP16");
+
+    max_batch_size_ = options.GetOrDefault<int>("max-batch", 1024);
+    const int opt_batch_size =
+        std::min(options.GetOrDefault<int>("opt-batch", 256), max_batch_size_);
+    const int streams = options.GetOrDefault<int>("streams", 1);
+    if (max_batch_size_ < 1 || opt_batch_size < 1 || streams < 1) {
+      throw Exception(
+          "max-batch, opt-batch and streams of the TensorRT backend have to "
+          "be at least 1.");
+    }
+
+    // Same form as the cuDNN backend computes with.
+    const auto processed = GetTransformedWeights<Weights>(
+        weights, "cudnn", [](const Weights& weights) {
+          Weights processed = weights;
+          FoldBatchNorm(&processed);
+          return processed;
+        });
+
+    // Engines depend on everything which goes into the builder.
+    std::string gpu_name = deviceProp.name;
+    std::replace_if(gpu_name.begin(), gpu_name.end(),
+                    [](char c) { return !std::isalnum(c); }, '_');
+    std::ostringstream prefix;
+    prefix << options.GetOrDefault<std::string>("engine-cache",
+                                                CommandLine::BinaryDirectory())
+           << "/lc0-" << std::hex << HashWeights(*processed) << std::dec
+           << "-trt" << NV_TENSORRT_MAJOR << "." << NV_TENSORRT_MINOR << "."
+           << NV_TENSORRT_PATCH;
+    const std::string calibration_cache = prefix.str() + ".calib";
+    prefix << "-" << gpu_name << "-sm" << deviceProp.major
+           << deviceProp.minor
+           << (precision == Precision::kInt8 ? "-int8" : "-fp16") << "-b"
+           << opt_batch_size << "-" << max_batch_size_ << "x" << streams
+           << ".engine";
+    const std::string engine_cache = prefix.str();
+
+    runtime_.reset(nvinfer1::createInferRuntime(GetLogger()));
+    if (!runtime_) throw Exception("Cannot create TensorRT runtime.");
+    std::vector<char> serialized = ReadFile(engine_cache);
+    if (!serialized.empty()) {
+      engine_.reset(runtime_->deserializeCudaEngine(serialized.data(),
+                                                    serialized.size()));
+      if (!engine_) {
+        std::cerr << "Cannot load " << engine_cache << ", rebuilding it."
+                  << std::endl;
+      }
+    }
+    if (!engine_) {
+      std::cerr << "Building TensorRT engine " << engine_cache
+                << ", which may take minutes." << std::endl;
+      serialized = BuildEngine(*processed, precision, opt_batch_size, streams,
+                               options, calibration_cache);
+      engine_.reset(runtime_->deserializeCudaEngine(serialized.data(),
+                                                    serialized.size()));
+      if (!engine_) throw Exception("Cannot load TensorRT engine.");
+      WriteFile(engine_cache, serialized.data(), serialized.size());
+    }
+
+    for (int i = 0; i < streams; ++i) {
+      free_contexts_.push_back(std::make_unique<ExecutionContext>(
+          engine_.get(), i, max_batch_size_));
+    }
+  }
+
+  ~TrtNetwork() {
+    cudaSetDevice(gpu_id_);
+    free_contexts_.clear();
+    free_inputs_outputs_.clear();
+    engine_.reset();
+    runtime_.reset();
+  }
+
+  std::unique_ptr<NetworkComputation> NewComputation() override {
+    ReportCUDAErrors(cudaSetDevice(gpu_id_));
+    return std::make_unique<TrtNetworkComputation>(this);
+  }
+
+  bool SupportsPolicySoftmaxTemp() const override { return true; }
+
+  // Tensor cores work on batches of multiples of 8.
+  int GetPreferredBatchStep() const override { return 8; }
+
+  int GetNumaNode() const override {
+    char bus_id[32];
+    if (cudaDeviceGetPCIBusId(bus_id, sizeof(bus_id), gpu_id_) !=
+        cudaSuccess) {
+      return -1;
+    }
+    return Numa::GetPciDeviceNode(bus_id);
+  }
+
+  int GetMaxBatchSize() const { return max_batch_size_; }
+
+  void forwardEval(InputsOutputs* io, int batchSize, float policyTemp) {
+    // The calling thread may have used another GPU last.
+    ReportCUDAErrors(cudaSetDevice(gpu_id_));
+    std::unique_ptr<ExecutionContext> context = GetContext();
+    cudaStream_t stream = context->stream;
+
+    expandPlanes_Fp16_NHWC(context->input, io->input_masks_mem_gpu_,
+                           io->input_val_mem_gpu_, batchSize * kInputPlanes,
+                           stream);
+    *io->policy_temp_inv_mem_ = 1.0f / policyTemp;
+    ReportCUDAErrors(cudaMemcpyAsync(context->policy_temp_inv,
+                                     io->policy_temp_inv_mem_, sizeof(float),
+                                     cudaMemcpyHostToDevice, stream));
+    context->context->setInputShape(
+        kInputName, nvinfer1::Dims4{batchSize, kInputPlanes, 8, 8});
+    if (!context->context->enqueueV3(stream)) {
+      ReleaseContext(std::move(context));
+      throw Exception("TensorRT failed to evaluate a batch.");
+    }
+    ReportCUDAErrors(cudaMemcpyAsync(
+        io->op_policy_mem_, context->op_policy,
+        batchSize * kNumOutputPolicy * sizeof(float), cudaMemcpyDeviceToHost,
+        stream));
+    ReportCUDAErrors(cudaMemcpyAsync(io->op_value_mem_, context->op_value,
+                                     batchSize * sizeof(float),
+                                     cudaMemcpyDeviceToHost, stream));
+    ReportCUDAErrors(cudaStreamSynchronize(stream));
+    ReleaseContext(std::move(context));
+  }
+
+  std::unique_ptr<InputsOutputs> GetInputsOutputs() {
+    std::lock_guard<std::mutex> lock(inputs_outputs_lock_);
+    if (free_inputs_outputs_.empty()) {
+      return std::make_unique<InputsOutputs>(max_batch_size_);
+    }
+    std::unique_ptr<InputsOutputs> resource =
+        std::move(free_inputs_outputs_.front());
+    free_inputs_outputs_.pop_front();
+    return resource;
+  }
+
+  void ReleaseInputsOutputs(std::unique_ptr<InputsOutputs> resource) {
+    std::lock_guard<std::mutex> lock(inputs_outputs_lock_);
+    free_inputs_outputs_.push_back(std::move(resource));
+  }
+
+ private:
+  static uint64_t HashWeights(const Weights& weights) {
+    uint64_t hash = weights.residual.size();
+    auto add = [&hash](const std::vector<float>& vec) {
+      hash = HashCat(hash, vec.size());
+      for (const float x : vec) {
+        uint32_t bits;
+        std::memcpy(&bits, &x, sizeof(bits));
+        hash = HashCat(hash, bits);
+      }
+    };
+    auto add_block = [&add](const Weights::ConvBlock& block) {
+      add(block.weights);
+      add(block.biases);
+    };
+    add_block(weights.input);
+    for (const auto& residual : weights.residual) {
+      add_block(residual.conv1);
+      add_block(residual.conv2);
+    }
+    add_block(weights.policy);
+    add(weights.ip_pol_w);
+    add(weights.ip_pol_b);
+    add_block(weights.value);
+    add(weights.ip1_val_w);
+    add(weights.ip1_val_b);
+    add(weights.ip2_val_w);
+    add(weights.ip2_val_b);
+    return hash;
+  }
+
+  std::vector<char> BuildEngine(const Weights& weights, Precision precision,
+                                int opt_batch_size, int profiles,
+                                const OptionsDict& options,
+                                const std::string& calibration_cache) {
+    std::unique_ptr<nvinfer1::IBuilder> builder(
+        nvinfer1::createInferBuilder(GetLogger()));
+    if (!builder) throw Exception("Cannot create TensorRT builder.");
+    std::unique_ptr<nvinfer1::INetworkDefinition> network(
+        builder->createNetworkV2(
+            1U << static_cast<uint32_t>(
+                nvinfer1::NetworkDefinitionCreationFlag::kEXPLICIT_BATCH)));
+    std::unique_ptr<nvinfer1::IBuilderConfig> config(
+        builder->createBuilderConfig());
+    NetworkBuilder(network.get(), precision).Build(weights);
+
+    config->setFlag(nvinfer1::BuilderFlag::kFP16);
+    config->setMemoryPoolLimit(
+        nvinfer1::MemoryPoolType::kWORKSPACE,
+        static_cast<size_t>(options.GetOrDefault<int>("workspace", 1024))
+            << 20);
+    for (int i = 0; i < profiles; ++i) {
+      auto profile = builder->createOptimizationProfile();
+      profile->setDimensions(kInputName, nvinfer1::OptProfileSelector::kMIN,
+                             nvinfer1::Dims4{1, kInputPlanes, 8, 8});
+      profile->setDimensions(
+          kInputName, nvinfer1::OptProfileSelector::kOPT,
+          nvinfer1::Dims4{opt_batch_size, kInputPlanes, 8, 8});
+      profile->setDimensions(
+          kInputName, nvinfer1::OptProfileSelector::kMAX,
+          nvinfer1::Dims4{max_batch_size_, kInputPlanes, 8, 8});
+      config->addOptimizationProfile(profile);
+    }
+
+    std::unique_ptr<Int8Calibrator> calibrator;
+    if (precision == Precision::kInt8) {
+      if (!builder->platformHasFastInt8()) {
+        throw Exception("Your GPU doesn't support INT8");
+      }
+      config->setFlag(nvinfer1::BuilderFlag::kINT8);
+      config->setFlag(nvinfer1::BuilderFlag::kPREFER_PRECISION_CONSTRAINTS);
+      auto profile = builder->createOptimizationProfile();
+      const nvinfer1::Dims4 dims{Int8Calibrator::kBatchSize, kInputPlanes, 8,
+                                 8};
+      for (const auto selector : {nvinfer1::OptProfileSelector::kMIN,
+                                  nvinfer1::OptProfileSelector::kOPT,
+                                  nvinfer1::OptProfileSelector::kMAX}) {
+        profile->setDimensions(kInputName, selector, dims);
+      }
+      config->setCalibrationProfile(profile);
+      // Positions are only generated if the scales are not cached.
+      std::vector<InputPlanes> positions;
+      if (ReadFile(calibration_cache).empty()) {
+        positions = GetCalibrationPositions(
+            options.GetOrDefault<std::string>("calibration-file", ""),
+            options.GetOrDefault<int>("calibration-positions", 1024));
+      }
+      calibrator = std::make_unique<Int8Calibrator>(std::move(positions),
+                                                    calibration_cache);
+      config->setInt8Calibrator(calibrator.get());
+    }
+
+    std::unique_ptr<nvinfer1::IHostMemory> serialized(
+        builder->buildSerializedNetwork(*network, *config));
+    if (!serialized) throw Exception("Cannot build TensorRT engine.");
+    const char* data = static_cast<const char*>(serialized->data());
+    return std::vector<char>(data, data + serialized->size());
+  }
+
+  // Waits until an execution context is free, and takes it.
+  std::unique_ptr<ExecutionContext> GetContext() {
+    std::unique_lock<std::mutex> lock(contexts_lock_);
+    contexts_cv_.wait(lock, [this]() { return !free_contexts_.empty(); });
+    std::unique_ptr<ExecutionContext> context =
+        std::move(free_contexts_.front());
+    free_contexts_.pop_front();
+    return context;
+  }
+
+  void ReleaseContext(std::unique_ptr<ExecutionContext> context) {
+    {
+      std::lock_guard<std::mutex> lock(contexts_lock_);
+      free_contexts_.push_back(std::move(context));
+    }
+    contexts_cv_.notify_one();
+  }
+
+  const int gpu_id_;
+  int max_batch_size_;
+
+  std::unique_ptr<nvinfer1::IRuntime> runtime_;
+  std::unique_ptr<nvinfer1::ICudaEngine> engine_;
+
+  // As many batches as there are contexts can be evaluated at the same time.
+  std::mutex contexts_lock_;
+  std::condition_variable contexts_cv_;
+  std::list<std::unique_ptr<ExecutionContext>> free_contexts_;
+
+  std::mutex inputs_outputs_lock_;
+  std::list<std::unique_ptr<InputsOutputs>> free_inputs_outputs_;
+};
+
+TrtNetworkComputation::TrtNetworkComputation(TrtNetwork* network)
+    : inputs_outputs_(network->GetInputsOutputs()), network_(network) {}
+
+TrtNetworkComputation::~TrtNetworkComputation() {
+  network_->ReleaseInputsOutputs(std::move(inputs_outputs_));
+}
+
+InputPlanesRef TrtNetworkComputation::AddInputInPlace() {
+  if (batch_size_ == network_->GetMaxBatchSize()) {
+    throw Exception("Batch is larger than max-batch of the TensorRT backend.");
+  }
+  auto iter_mask =
+      &inputs_outputs_->input_masks_mem_[batch_size_ * kInputPlanes];
+  auto iter_val =
+      &inputs_outputs_->input_val_mem_[batch_size_ * kInputPlanes];
+  std::fill(iter_mask, iter_mask + kInputPlanes, 0);
+  std::fill(iter_val, iter_val + kInputPlanes, 1.0f);
+  batch_size_++;
+  return {iter_mask, iter_val};
+}
+
+void TrtNetworkComputation::ComputeBlocking() {
+  network_->forwardEval(inputs_outputs_.get(), batch_size_, policy_temp_);
+}
+
+class TrtNetworkFp16 : public TrtNetwork {
+ public:
+  TrtNetworkFp16(const WeightsPtr& weights, const OptionsDict& options)
+      : TrtNetwork(weights, options, Precision::kFp16) {}
+};
+
+class TrtNetworkInt8 : public TrtNetwork {
+ public:
+  TrtNetworkInt8(const WeightsPtr& weights, const OptionsDict& options)
+      : TrtNetwork(weights, options, Precision::kInt8) {}
+};
+
+REGISTER_NETWORK("trt-fp16", TrtNetworkFp16, 104)
+REGISTER_NETWORK("trt-int8", TrtNetworkInt8, 103)
+
+// The context of the GPU is created while the weights are loaded.
+void PrepareTrtNetwork(const OptionsDict& options) {
+  CreateCudaContexts({options.GetOrDefault<int>("gpu", 0)});
+}
+REGISTER_NETWORK_PREPARE("trt-fp16", PrepareTrtNetwork)
+REGISTER_NETWORK_PREPARE("trt-int8", PrepareTrtNetwork)
+
+}  // namespace
+}  // namespace lczero
@@ -20,24 +20,39 @@
 #include <array>
 #include <cassert>
 #include <cmath>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <iterator>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <sstream>
 #include <string>
 #include <thread>
+#include <unordered_map>
 
 #include "neural/opencl/OpenCL.h"
 #include "neural/opencl/OpenCLParams.h"
 #include "neural/opencl/OpenCLTuner.h"
+#include "utils/filesystem.h"
 
 static std::string cl_args =
     "-cl-mad-enable -cl-fast-relaxed-math -cl-no-signed-zeros "
     "-cl-denorms-are-zero";
 
+// Compiled programs are cached in this directory.
+static const std::string PROGRAM_CACHE_DIR = "leelaz_opencl_cache";
+
+// SGEMM parameters used while tuning runs in the background. Valid for any
+// device, if not fast.
+static const std::string kDefaultSgemmTuners =
+    " -DKWG=32 -DKWI=2 -DMDIMA=8 -DMDIMC=8 -DMWG=16 -DNDIMB=8 -DNDIMC=8"
+    " -DNWG=16 -DSA=0 -DSB=0 -DSTRM=0 -DSTRN=0 -DVWM=1 -DVWN=1";
+
 const std::string sourceCode_config =
 #include "clsource/config.opencl"
     ;
@@ -80,23 +95,60 @@ const std::string sourceCode_sgemv =
 #include "clblast_level3/xgemv.opencl"
     ;
 
-thread_local ThreadData opencl_thread_data;
+// Data of every OpenCL instance used by a thread, by instance ID.
+static thread_local std::unordered_map<uint64_t, ThreadData>
+    opencl_thread_data;
+// IDs of instances which exist, so that data of destroyed instances is
+// dropped.
+static std::mutex live_instances_mutex;
+static std::set<uint64_t> live_instances;
+static uint64_t next_instance_id = 0;
+
+OpenCL::OpenCL() {
+  std::lock_guard<std::mutex> lock(live_instances_mutex);
+  m_id = next_instance_id++;
+  live_instances.insert(m_id);
+}
+
+ThreadData& OpenCL::get_thread_data() const {
+  const auto it = opencl_thread_data.find(m_id);
+  if (it != opencl_thread_data.end()) return it->second;
+  // First use of the instance in this thread, a good time to drop data of
+  // instances which are gone.
+  {
+    std::lock_guard<std::mutex> lock(live_instances_mutex);
+    for (auto i = opencl_thread_data.begin(); i != opencl_thread_data.end();) {
+      if (live_instances.count(i->first)) {
+        ++i;
+      } else {
+        i = opencl_thread_data.erase(i);
+      }
+    }
+  }
+  return opencl_thread_data[m_id];
+}
 
 void OpenCL::ensure_thread_initialized() {
-  if (!opencl_thread_data.m_is_initialized) {
+  auto& thread_data = get_thread_data();
+  if (!thread_data.m_is_initialized) {
     // Make kernels
-    opencl_thread_data.m_convolve1_kernel = cl::Kernel(m_program, "convolve1");
-    opencl_thread_data.m_merge_kernel = cl::Kernel(m_program, "merge_bn");
-    opencl_thread_data.m_in_transform_kernel =
+    thread_data.m_convolve1_kernel = cl::Kernel(m_program, "convolve1");
+    thread_data.m_merge_kernel = cl::Kernel(m_program, "merge_bn");
+    thread_data.m_in_transform_kernel =
         cl::Kernel(m_program, "in_transform");
-    opencl_thread_data.m_sgemm_kernel = cl::Kernel(m_program, "XgemmBatched");
-    opencl_thread_data.m_out_transform_bn_kernel =
+    thread_data.m_sgemm_kernels.clear();
+    for (const auto& bucket : m_sgemm_buckets) {
+      thread_data.m_sgemm_kernels.emplace_back(bucket.program,
+                                                      "XgemmBatched");
+    }
+    thread_data.m_out_transform_bn_kernel =
         cl::Kernel(m_program, "out_transform_fused_bn");
-    opencl_thread_data.m_out_transform_bn_in_kernel =
+    thread_data.m_out_transform_bn_in_kernel =
         cl::Kernel(m_program, "out_transform_fused_bn_in");
-    opencl_thread_data.m_sgemv_kernel = cl::Kernel(m_program, "Xgemv");
-    opencl_thread_data.m_commandqueue = cl::CommandQueue(m_context, m_device);
-    opencl_thread_data.m_is_initialized = true;
+    thread_data.m_sgemv_kernel = cl::Kernel(m_program, "Xgemv");
+    thread_data.m_commandqueue = cl::CommandQueue(m_context, m_device);
+    thread_data.m_transferqueue = cl::CommandQueue(m_context, m_device);
+    thread_data.m_is_initialized = true;
   }
 }
 
@@ -106,86 +158,142 @@ void OpenCL_Network::add_weights(size_t layer, size_t size,
     m_layers.push_back(Layer());
   }
 
+  const auto weightSize = size * m_opencl.get_net_t_size();
+  if (m_opencl.use_half()) {
+    auto converted_weights = std::vector<uint16_t>();
+    for (auto i = size_t{0}; i < size; i++) {
+      converted_weights.emplace_back(float_to_half(weights[i]));
+    }
+    m_layers.back().weights.emplace_back(
+        m_opencl.m_context, CL_MEM_COPY_HOST_PTR | CL_MEM_READ_ONLY,
+        weightSize, converted_weights.data());
+    return;
+  }
+
   auto converted_weights = std::vector<net_t>();
   for (auto i = size_t{0}; i < size; i++) {
     converted_weights.emplace_back(weights[i]);
   }
 
-  auto weightSize = size * sizeof(decltype(converted_weights)::value_type);
   m_layers.back().weights.emplace_back(
       m_opencl.m_context, CL_MEM_COPY_HOST_PTR | CL_MEM_READ_ONLY, weightSize,
       const_cast<net_t*>(converted_weights.data()));
 }
 
-void OpenCL_Network::forward(const std::vector<net_t>& input,
-                             std::vector<net_t>& output_pol,
-                             std::vector<net_t>& output_val,
-                             const int batch_size) const {
-  constexpr auto tiles = WINOGRAD_P;
+// The heads are the last two layers, in either order.
+size_t OpenCL_Network::get_output_size_pol() const {
+  const auto& last = m_layers.back();
+  const auto& head = last.is_policy ? last : m_layers[m_layers.size() - 2];
+  return head.ip_out_size * m_opencl.get_net_t_size();
+}
 
-  auto finalSize_pol =
-      m_layers[m_layers.size() - 2].ip_out_size * sizeof(net_t);
-  auto finalSize_val = m_layers.back().ip_out_size * sizeof(net_t);
+size_t OpenCL_Network::get_output_size_val() const {
+  const auto& last = m_layers.back();
+  const auto& head = last.is_value ? last : m_layers[m_layers.size() - 2];
+  return head.ip_out_size * m_opencl.get_net_t_size();
+}
 
-  if (m_layers.back().is_policy) {
-    std::swap(finalSize_pol, finalSize_val);
+void OpenCL_Network::ensure_buffers_allocated() const {
+  m_opencl.ensure_thread_initialized();
+
+  auto& thread_data = m_opencl.get_thread_data();
+  if (thread_data.m_buffers_allocated) return;
+
+  constexpr auto tiles = WINOGRAD_P;
+  constexpr auto squares = 8 * 8;
+
+  auto max_channels = unsigned{0};
+  for (const auto& layer : m_layers) {
+    max_channels =
+        std::max(max_channels, std::max(layer.channels, layer.outputs));
   }
 
-  m_opencl.ensure_thread_initialized();
+  const auto mwg = m_opencl.m_sgemm_tuners.mwg;
+  const auto vwm = m_opencl.m_sgemm_tuners.vwm;
+
+  const auto m_ceil = ceilMultiple(ceilMultiple(max_channels, mwg), vwm);
+  // Buckets pad the tiles of a batch differently, allocate for the largest.
+  auto n_ceil = size_t{0};
+  for (const auto& bucket : m_opencl.m_sgemm_buckets) {
+    const auto nwg = bucket.tuners.nwg;
+    const auto vwn = bucket.tuners.vwn;
+    n_ceil = std::max(n_ceil, ceilMultiple(ceilMultiple(tiles, nwg), vwn));
+  }
 
-  if (!opencl_thread_data.m_buffers_allocated) {
-    auto max_channels = unsigned{0};
-    for (const auto& layer : m_layers) {
-      max_channels =
-          std::max(max_channels, std::max(layer.channels, layer.outputs));
-    }
-
-    const auto mwg = m_opencl.m_sgemm_tuners.mwg;
-    const auto nwg = m_opencl.m_sgemm_tuners.nwg;
-    const auto vwm = m_opencl.m_sgemm_tuners.vwm;
-    const auto vwn = m_opencl.m_sgemm_tuners.vwn;
-
-    const auto m_ceil = ceilMultiple(ceilMultiple(max_channels, mwg), vwm);
-    const auto n_ceil = ceilMultiple(ceilMultiple(tiles, nwg), vwn);
-
-    const auto max_batch_size = getMaxMatchSize();
-    const auto alloc_inSize =
-        max_batch_size * m_ceil * m_ceil * max_channels * sizeof(net_t);
-    const auto alloc_vm_size =
-        max_batch_size * WINOGRAD_TILE * m_ceil * n_ceil * sizeof(net_t);
-
-    auto v_zeros = std::vector<float>(alloc_vm_size);
-
-    opencl_thread_data.m_inBuffer =
-        cl::Buffer(m_opencl.m_context, CL_MEM_READ_WRITE, alloc_inSize);
-    opencl_thread_data.m_inBuffer2 =
-        cl::Buffer(m_opencl.m_context, CL_MEM_READ_WRITE, alloc_inSize);
-    opencl_thread_data.m_VBuffer = cl::Buffer(
-        m_opencl.m_context,
-        CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS | CL_MEM_COPY_HOST_PTR,
-        alloc_vm_size, v_zeros.data(), nullptr);
-    opencl_thread_data.m_MBuffer =
-        cl::Buffer(m_opencl.m_context,
-                   CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, alloc_vm_size);
-
-    opencl_thread_data.m_pinnedOutBuffer_pol = cl::Buffer(
+  const auto max_batch_size = getMaxMatchSize();
+  const auto net_t_size = m_opencl.get_net_t_size();
+  const auto alloc_inSize =
+      max_batch_size * m_ceil * m_ceil * max_channels * net_t_size;
+  const auto alloc_vm_size =
+      max_batch_size * WINOGRAD_TILE * m_ceil * n_ceil * net_t_size;
+  const auto alloc_inputSize =
+      max_batch_size * m_layers.front().channels * squares * net_t_size;
+
+  auto v_zeros = std::vector<float>(alloc_vm_size);
+
+  thread_data.m_inBuffer =
+      cl::Buffer(m_opencl.m_context, CL_MEM_READ_WRITE, alloc_inSize);
+  thread_data.m_inBuffer2 =
+      cl::Buffer(m_opencl.m_context, CL_MEM_READ_WRITE, alloc_inSize);
+  thread_data.m_VBuffer = cl::Buffer(
+      m_opencl.m_context,
+      CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS | CL_MEM_COPY_HOST_PTR,
+      alloc_vm_size, v_zeros.data(), nullptr);
+  thread_data.m_MBuffer =
+      cl::Buffer(m_opencl.m_context, CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS,
+                 alloc_vm_size);
+
+  for (auto slot = 0; slot < kPipelineSlots; slot++) {
+    thread_data.m_inputBuffer[slot] = cl::Buffer(
+        m_opencl.m_context, CL_MEM_READ_ONLY, alloc_inputSize);
+    thread_data.m_pinnedOutBuffer_pol[slot] = cl::Buffer(
         m_opencl.m_context, CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR,
-        max_batch_size * finalSize_pol);
-    opencl_thread_data.m_pinnedOutBuffer_val = cl::Buffer(
+        max_batch_size * get_output_size_pol());
+    thread_data.m_pinnedOutBuffer_val[slot] = cl::Buffer(
         m_opencl.m_context, CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR,
-        max_batch_size * finalSize_val);
+        max_batch_size * get_output_size_val());
+  }
 
-    opencl_thread_data.m_buffers_allocated = true;
+  thread_data.m_buffers_allocated = true;
+}
+
+void OpenCL_Network::enqueue_input(const std::vector<net_t>& input,
+                                   int slot) const {
+  ensure_buffers_allocated();
+
+  auto& thread_data = m_opencl.get_thread_data();
+  const void* data = input.data();
+  if (m_opencl.use_half()) {
+    auto& input_half = thread_data.m_inputHalf[slot];
+    input_half.resize(input.size());
+    for (auto i = size_t{0}; i < input.size(); i++) {
+      input_half[i] = float_to_half(input[i]);
+    }
+    data = input_half.data();
   }
 
-  cl::Buffer& inBuffer = opencl_thread_data.m_inBuffer;
-  cl::Buffer& inBuffer2 = opencl_thread_data.m_inBuffer2;
-  cl::Buffer& VBuffer = opencl_thread_data.m_VBuffer;
-  cl::Buffer& MBuffer = opencl_thread_data.m_MBuffer;
-  cl::CommandQueue& queue = opencl_thread_data.m_commandqueue;
+  const auto inSize = m_opencl.get_net_t_size() * input.size();
+  thread_data.m_transferqueue.enqueueWriteBuffer(
+      thread_data.m_inputBuffer[slot], CL_FALSE, 0, inSize, data,
+      nullptr, &thread_data.m_inputEvent[slot]);
+  // Start the upload now, not at the next wait.
+  thread_data.m_transferqueue.flush();
+}
+
+void OpenCL_Network::enqueue_forward(int slot, int batch_size) const {
+  ensure_buffers_allocated();
 
-  const auto inSize = sizeof(net_t) * input.size();
-  queue.enqueueWriteBuffer(inBuffer, CL_FALSE, 0, inSize, input.data());
+  auto& thread_data = m_opencl.get_thread_data();
+  cl::Buffer& inputBuffer = thread_data.m_inputBuffer[slot];
+  cl::Buffer& inBuffer = thread_data.m_inBuffer;
+  cl::Buffer& inBuffer2 = thread_data.m_inBuffer2;
+  cl::Buffer& VBuffer = thread_data.m_VBuffer;
+  cl::Buffer& MBuffer = thread_data.m_MBuffer;
+  cl::CommandQueue& queue = thread_data.m_commandqueue;
+
+  // The input convolution waits for the upload on the transfer queue.
+  const std::vector<cl::Event> input_events = {
+      thread_data.m_inputEvent[slot]};
 
   auto skip_in_trans = false;
   for (auto iter = cbegin(m_layers); iter != cend(m_layers); iter++) {
@@ -200,9 +308,9 @@ void OpenCL_Network::forward(const std::vector<net_t>& input,
       if (niter->is_residual_block) {
         skip_next_in_trans = true;
       }
-      convolve3(layer.channels, layer.outputs, inBuffer, inBuffer, VBuffer,
+      convolve3(layer.channels, layer.outputs, inputBuffer, inBuffer, VBuffer,
                 MBuffer, conv_weights, nullptr, bn_weights, skip_in_trans,
-                skip_next_in_trans, true, batch_size);
+                skip_next_in_trans, true, batch_size, &input_events);
       skip_in_trans = skip_next_in_trans;
     } else if (layer.is_residual_block) {
       assert(layer.channels == layer.outputs);
@@ -228,9 +336,9 @@ void OpenCL_Network::forward(const std::vector<net_t>& input,
 
       cl::Buffer out_buffer;
       if (layer.is_policy) {
-        out_buffer = opencl_thread_data.m_pinnedOutBuffer_pol;
+        out_buffer = thread_data.m_pinnedOutBuffer_pol[slot];
       } else {
-        out_buffer = opencl_thread_data.m_pinnedOutBuffer_val;
+        out_buffer = thread_data.m_pinnedOutBuffer_val[slot];
       }
 
       auto ip_w = begin(layer.weights) + 3;
@@ -244,28 +352,50 @@ void OpenCL_Network::forward(const std::vector<net_t>& input,
     }
   }
 
-  auto pinnedOutBufferHost_pol =
-      queue.enqueueMapBuffer(opencl_thread_data.m_pinnedOutBuffer_pol, CL_FALSE,
-                             CL_MAP_READ, 0, batch_size * finalSize_pol);
-  auto pinnedOutBufferHost_val =
-      queue.enqueueMapBuffer(opencl_thread_data.m_pinnedOutBuffer_val, CL_FALSE,
-                             CL_MAP_READ, 0, batch_size * finalSize_val);
+  thread_data.m_pinnedOutBufferHost_pol[slot] = queue.enqueueMapBuffer(
+      thread_data.m_pinnedOutBuffer_pol[slot], CL_FALSE, CL_MAP_READ, 0,
+      batch_size * get_output_size_pol());
+  thread_data.m_pinnedOutBufferHost_val[slot] = queue.enqueueMapBuffer(
+      thread_data.m_pinnedOutBuffer_val[slot], CL_FALSE, CL_MAP_READ, 0,
+      batch_size * get_output_size_val(), nullptr,
+      &thread_data.m_outputEvent[slot]);
+  queue.flush();
+}
 
-  {
-    // Finish call is usually a busy wait. When using multiple threads,
-    // use the lock to avoid busy waiting with all threads.
-    std::lock_guard<std::mutex> lock(m_queue_finish_mutex);
-    queue.finish();
+void OpenCL_Network::retrieve_outputs(int slot, std::vector<net_t>& output_pol,
+                                      std::vector<net_t>& output_val,
+                                      int batch_size) const {
+  auto& thread_data = m_opencl.get_thread_data();
+  cl::CommandQueue& queue = thread_data.m_commandqueue;
+  void* pinnedOutBufferHost_pol =
+      thread_data.m_pinnedOutBufferHost_pol[slot];
+  void* pinnedOutBufferHost_val =
+      thread_data.m_pinnedOutBufferHost_val[slot];
+
+  // The queue is in order, so once the last map is done, so is the batch.
+  thread_data.m_outputEvent[slot].wait();
+
+  if (m_opencl.use_half()) {
+    const auto* pol = static_cast<const uint16_t*>(pinnedOutBufferHost_pol);
+    const auto* val = static_cast<const uint16_t*>(pinnedOutBufferHost_val);
+    const auto pol_count = batch_size * get_output_size_pol() / sizeof(*pol);
+    const auto val_count = batch_size * get_output_size_val() / sizeof(*val);
+    for (auto i = size_t{0}; i < pol_count; i++) {
+      output_pol[i] = half_to_float(pol[i]);
+    }
+    for (auto i = size_t{0}; i < val_count; i++) {
+      output_val[i] = half_to_float(val[i]);
+    }
+  } else {
+    std::memcpy(output_pol.data(), pinnedOutBufferHost_pol,
+                batch_size * get_output_size_pol());
+    std::memcpy(output_val.data(), pinnedOutBufferHost_val,
+                batch_size * get_output_size_val());
   }
 
-  std::memcpy(output_pol.data(), pinnedOutBufferHost_pol,
-              batch_size * finalSize_pol);
-  std::memcpy(output_val.data(), pinnedOutBufferHost_val,
-              batch_size * finalSize_val);
-
-  queue.enqueueUnmapMemObject(opencl_thread_data.m_pinnedOutBuffer_pol,
+  queue.enqueueUnmapMemObject(thread_data.m_pinnedOutBuffer_pol[slot],
                               pinnedOutBufferHost_pol);
-  queue.enqueueUnmapMemObject(opencl_thread_data.m_pinnedOutBuffer_val,
+  queue.enqueueUnmapMemObject(thread_data.m_pinnedOutBuffer_val[slot],
                               pinnedOutBufferHost_val);
 }
 
@@ -275,21 +405,25 @@ void OpenCL_Network::convolve3(int channels, int outputs, cl::Buffer& bufferIn,
                                cl::Buffer* bufferResidual,
                                weight_slice_t bn_weights,
                                bool skip_in_transform, bool fuse_in_transform,
-                               bool store_inout, int batch_size) const {
-  cl::Kernel& in_transform_kernel = opencl_thread_data.m_in_transform_kernel;
-  cl::Kernel& sgemm_kernel = opencl_thread_data.m_sgemm_kernel;
+                               bool store_inout, int batch_size,
+                               const std::vector<cl::Event>* events) const {
+  auto& thread_data = m_opencl.get_thread_data();
+  cl::Kernel& in_transform_kernel = thread_data.m_in_transform_kernel;
+  const auto bucket = m_opencl.get_sgemm_bucket(batch_size);
+  const auto& tuners = m_opencl.m_sgemm_buckets[bucket].tuners;
+  cl::Kernel& sgemm_kernel = thread_data.m_sgemm_kernels[bucket];
   cl::Kernel& out_transform_bn_kernel =
-      opencl_thread_data.m_out_transform_bn_kernel;
+      thread_data.m_out_transform_bn_kernel;
   cl::Kernel& out_transform_bn_in_kernel =
-      opencl_thread_data.m_out_transform_bn_in_kernel;
-
-  auto mwg = m_opencl.m_sgemm_tuners.mwg;
-  auto nwg = m_opencl.m_sgemm_tuners.nwg;
-  auto kwg = m_opencl.m_sgemm_tuners.kwg;
-  auto vwm = m_opencl.m_sgemm_tuners.vwm;
-  auto vwn = m_opencl.m_sgemm_tuners.vwn;
-  auto mdimc = m_opencl.m_sgemm_tuners.mdimc;
-  auto ndimc = m_opencl.m_sgemm_tuners.ndimc;
+      thread_data.m_out_transform_bn_in_kernel;
+
+  auto mwg = tuners.mwg;
+  auto nwg = tuners.nwg;
+  auto kwg = tuners.kwg;
+  auto vwm = tuners.vwm;
+  auto vwn = tuners.vwn;
+  auto mdimc = tuners.mdimc;
+  auto ndimc = tuners.ndimc;
   auto wavefront_size = m_opencl.m_wavefront_size;
 
   assert(mwg != 0);
@@ -310,7 +444,7 @@ void OpenCL_Network::convolve3(int channels, int outputs, cl::Buffer& bufferIn,
   auto n_ceil = int(ceilMultiple(ceilMultiple(batch_size * tiles, nwg), vwn));
   auto k_ceil = int(ceilMultiple(ceilMultiple(channels, kwg), vwm));
 
-  cl::CommandQueue& queue = opencl_thread_data.m_commandqueue;
+  cl::CommandQueue& queue = thread_data.m_commandqueue;
 
   if (!skip_in_transform) {
     try {
@@ -321,7 +455,8 @@ void OpenCL_Network::convolve3(int channels, int outputs, cl::Buffer& bufferIn,
       in_transform_kernel.setArg(4, n_ceil);
 
       queue.enqueueNDRangeKernel(in_transform_kernel, cl::NullRange,
-                                 cl::NDRange(wgs, channels, batch_size));
+                                 cl::NDRange(wgs, channels, batch_size),
+                                 cl::NullRange, events);
     } catch (const cl::Error& e) {
       std::cerr << "Error in convolve3: " << e.what() << ": " << e.err()
                 << std::endl;
@@ -421,7 +556,8 @@ void OpenCL_Network::convolve1(int channels, int outputs,
   constexpr int rowGroup = 1;
   size_t outputGroup = std::min(outputs, 32);
 
-  auto m_convolve_kernel = &opencl_thread_data.m_convolve1_kernel;
+  auto& thread_data = m_opencl.get_thread_data();
+  auto m_convolve_kernel = &thread_data.m_convolve1_kernel;
 
 #ifndef NDEBUG
   // Total output size after reducing.
@@ -438,7 +574,7 @@ void OpenCL_Network::convolve1(int channels, int outputs,
   int rowBuffer = std::min<int>(channelGroup, 7);
   size_t rowSize = channelGroup * outputGroup * rowBuffer * sizeof(float);
 
-  cl::CommandQueue& queue = opencl_thread_data.m_commandqueue;
+  cl::CommandQueue& queue = thread_data.m_commandqueue;
 
   try {
     m_convolve_kernel->setArg(0, bufferInput);
@@ -458,7 +594,7 @@ void OpenCL_Network::convolve1(int channels, int outputs,
     throw;
   }
 
-  cl::Kernel& merge_kernel = opencl_thread_data.m_merge_kernel;
+  cl::Kernel& merge_kernel = thread_data.m_merge_kernel;
   assert(channels % (1 << channelShift) == 0);
 
   try {
@@ -481,8 +617,9 @@ void OpenCL_Network::innerproduct(cl::Buffer& input, weight_slice_t weights,
                                   weight_slice_t biases, cl::Buffer& output,
                                   const int inputs, const int outputs,
                                   const int relu, int batch_size) const {
-  auto sgemv_kernel = opencl_thread_data.m_sgemv_kernel;
-  cl::CommandQueue& queue = opencl_thread_data.m_commandqueue;
+  auto& thread_data = m_opencl.get_thread_data();
+  auto sgemv_kernel = thread_data.m_sgemv_kernel;
+  cl::CommandQueue& queue = thread_data.m_commandqueue;
 
   // TODO: Tune these.
   size_t wgs1 = 64;
@@ -534,7 +671,8 @@ static const char* trim_left(const char* trim_me) {
   return trim_me;
 }
 
-void OpenCL::process_tuners(std::string tuners) {
+OpenCL::sgemm_tuners OpenCL::process_tuners(std::string tuners) {
+  sgemm_tuners result;
   std::string buf;
   std::stringstream ss(tuners);
   std::size_t found;
@@ -555,31 +693,31 @@ void OpenCL::process_tuners(std::string tuners) {
     std::string name = buf.substr(0, found);
     auto value = std::stoi(buf.substr(found + 1, std::string::npos));
     if (name == "-DMWG") {
-      m_sgemm_tuners.mwg = value;
+      result.mwg = value;
       mwg = true;
     }
     if (name == "-DNWG") {
-      m_sgemm_tuners.nwg = value;
+      result.nwg = value;
       nwg = true;
     }
     if (name == "-DKWG") {
-      m_sgemm_tuners.kwg = value;
+      result.kwg = value;
       kwg = true;
     }
     if (name == "-DMDIMC") {
-      m_sgemm_tuners.mdimc = value;
+      result.mdimc = value;
       mdimc = true;
     }
     if (name == "-DNDIMC") {
-      m_sgemm_tuners.ndimc = value;
+      result.ndimc = value;
       ndimc = true;
     }
     if (name == "-DVWM") {
-      m_sgemm_tuners.vwm = value;
+      result.vwm = value;
       vwm = true;
     }
     if (name == "-DVWN") {
-      m_sgemm_tuners.vwn = value;
+      result.vwn = value;
       vwn = true;
     }
   }
@@ -609,6 +747,98 @@ void OpenCL::process_tuners(std::string tuners) {
     std::cerr << std::endl;
     std::exit(-1);
   }
+  return result;
+}
+
+// 64-bit FNV-1a, stable across runs and platforms.
+static uint64_t fnv1a(const std::string& s,
+                      uint64_t hash = 14695981039346656037ULL) {
+  for (const unsigned char c : s) {
+    hash ^= c;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+cl::Program OpenCL::build_program(const std::string& source,
+                                  const std::string& args) {
+  // The binary depends on the device, the driver, the source and the
+  // options, which include the tuners.
+  const auto key =
+      fnv1a(args, fnv1a(source, fnv1a(get_device_name() + ";" +
+                                      m_device.getInfo<CL_DRIVER_VERSION>())));
+  std::ostringstream filename;
+  filename << PROGRAM_CACHE_DIR << "/" << std::hex << std::setw(16)
+           << std::setfill('0') << key << ".bin";
+
+  {
+    auto file = std::ifstream{filename.str(), std::ios::binary};
+    if (file.good()) {
+      auto binary = std::vector<unsigned char>(
+          std::istreambuf_iterator<char>(file),
+          std::istreambuf_iterator<char>());
+      try {
+        auto program = cl::Program(m_context, {m_device},
+                                   cl::Program::Binaries{binary});
+        program.build(args.c_str());
+        return program;
+      } catch (const cl::Error&) {
+        // Rejected by the driver, compile from source and replace it.
+      }
+    }
+  }
+
+  auto program = cl::Program(m_context, source);
+  try {
+    program.build(args.c_str());
+  } catch (const cl::Error&) {
+    std::cerr << "Error building kernels: "
+              << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(m_device) << "."
+              << std::endl;
+    throw std::runtime_error("Error building OpenCL kernels.");
+  }
+
+  // Failing to cache only costs a compilation at the next start.
+  try {
+    lczero::CreateDirectory(PROGRAM_CACHE_DIR);
+    const auto binaries = program.getInfo<CL_PROGRAM_BINARIES>();
+    if (binaries.size() == 1 && !binaries[0].empty()) {
+      auto file = std::ofstream{filename.str(), std::ios::binary};
+      file.write(reinterpret_cast<const char*>(binaries[0].data()),
+                 binaries[0].size());
+    }
+  } catch (const std::exception&) {
+  }
+  return program;
+}
+
+size_t OpenCL::get_sgemm_bucket(int batch_size) const {
+  for (auto i = size_t{0}; i < m_sgemm_buckets.size(); i++) {
+    if (batch_size <= m_sgemm_buckets[i].batch_size) return i;
+  }
+  return m_sgemm_buckets.size() - 1;
+}
+
+size_t OpenCL::get_batch_step() const {
+  const auto nwg = m_sgemm_tuners.nwg;
+  const auto vwn = m_sgemm_tuners.vwn;
+  auto step = size_t{1};
+  while (ceilMultiple(ceilMultiple(step * WINOGRAD_P, nwg), vwn) !=
+         step * WINOGRAD_P) {
+    step++;
+  }
+  return step;
+}
+
+void OpenCL::build_sgemm_buckets(const std::vector<int>& batch_sizes,
+                                 const std::vector<std::string>& tuners) {
+  m_sgemm_buckets.clear();
+  for (auto i = size_t{0}; i < batch_sizes.size(); i++) {
+    auto program = build_program(sourceCode_sgemm, m_cl_args + tuners[i]);
+    m_sgemm_buckets.push_back(
+        {batch_sizes[i], process_tuners(tuners[i]), program});
+  }
+  m_sgemm_tuners = m_sgemm_buckets.back().tuners;
 }
 
 std::vector<size_t> OpenCL::get_sgemm_tuners(void) {
@@ -625,6 +855,15 @@ std::vector<size_t> OpenCL::get_sgemm_tuners(void) {
   return tuners;
 }
 
+OpenCL::~OpenCL() {
+  if (m_tuning_thread.joinable()) {
+    m_stop_tuning = true;
+    m_tuning_thread.join();
+  }
+  std::lock_guard<std::mutex> lock(live_instances_mutex);
+  live_instances.erase(m_id);
+}
+
 void OpenCL::initialize(const int channels, const OpenCLParams& params) {
   bool verbose = params.verbose;
   if (verbose) {
@@ -755,41 +994,109 @@ void OpenCL::initialize(const int channels, const OpenCLParams& params) {
   m_context = context;
   m_device = best_device;
 
-  // Make program of the source code in the context.
-  try {
-    m_program =
-        cl::Program(m_context, sourceCode_config + sourceCode_convolve1 +
-                                   sourceCode_convolve3 + sourceCode_sgemm +
-                                   sourceCode_sgemv);
-  } catch (const cl::Error& e) {
-    std::cerr << "Error getting kernels: " << e.what() << ": " << e.err()
-              << std::endl;
-    throw std::runtime_error("Error getting OpenCL kernels.");
+  m_use_half = params.use_half;
+  if (m_use_half) {
+    const auto extensions = best_device.getInfo<CL_DEVICE_EXTENSIONS>();
+    if (extensions.find("cl_khr_fp16") == std::string::npos) {
+      throw std::runtime_error(
+          "Your OpenCL device doesn't support FP16 (cl_khr_fp16).");
+    }
   }
 
   m_cl_args = cl_args;
+  if (m_use_half) {
+    m_cl_args += " -DUSE_HALF -DPRECISION=16";
+  }
 
+  // SGEMM kernels are tuned for buckets of batch sizes: powers of two up to
+  // the tuning batch size. The largest bucket is tuned first, and sets the
+  // layout parameters which the other buckets are tuned with.
+  std::vector<int> batch_sizes;
+  for (auto size = 1; size < params.tune_batch_size; size *= 2) {
+    batch_sizes.push_back(size);
+  }
+  batch_sizes.push_back(std::max(params.tune_batch_size, 1));
+  std::reverse(batch_sizes.begin(), batch_sizes.end());
+
+  // The matrices multiplied in a Winograd convolution of a batch: 16 of
+  // channels x (batch * tiles) x channels.
+  const auto tune_bucket = [channels](Tuner& t, int batch_size,
+                                      const TuneParameters& fixed,
+                                      bool load_only) {
+    const auto n = WINOGRAD_P * batch_size;
+    return load_only ? t.find_sgemm_tuners(channels, n, channels,
+                                           WINOGRAD_TILE, fixed)
+                     : t.load_sgemm_tuners(channels, n, channels,
+                                           WINOGRAD_TILE, fixed);
+  };
+  const auto tune_buckets = [tune_bucket, batch_sizes](Tuner& t,
+                                                      bool load_only) {
+    std::vector<std::string> tuners;
+    TuneParameters fixed;
+    for (const auto batch_size : batch_sizes) {
+      tuners.push_back(tune_bucket(t, batch_size, fixed, load_only));
+      if (tuners.back().empty()) return std::vector<std::string>();
+      if (fixed.empty()) {
+        auto p = Tuner::defines_to_parameters(tuners.back());
+        fixed = {{"MWG", p["MWG"]}, {"KWG", p["KWG"]}, {"VWM", p["VWM"]}};
+      }
+    }
+    return tuners;
+  };
+
+  const auto background = params.tune_background && !params.tune_only;
   auto t = Tuner(*this, params, m_context, m_device);
-  auto sgemm_tuners = t.load_sgemm_tuners(
-      channels, WINOGRAD_P, channels, params.tune_batch_size * WINOGRAD_TILE);
+  auto sgemm_tuners = std::vector<std::string>();
+  const auto known = params.known_sgemm_tuners.find(get_device_key());
+  if (known != params.known_sgemm_tuners.end() &&
+      known->second.size() == batch_sizes.size()) {
+    // Tuned already, for another device of the same type.
+    sgemm_tuners = known->second;
+  } else if (!background) {
+    sgemm_tuners = tune_buckets(t, false);
+  } else if (!params.force_tune) {
+    sgemm_tuners = tune_buckets(t, true);
+  }
+  if (sgemm_tuners.empty()) {
+    // Not tuned yet: tune in the background and meanwhile use defaults.
+    // The results are stored, and used from the next start on.
+    std::cerr << "Tuning SGEMM in the background, using default parameters "
+                 "until the next start." << std::endl;
+    sgemm_tuners.assign(batch_sizes.size(), kDefaultSgemmTuners);
+    m_tuning_thread = std::thread([this, params, tune_buckets]() {
+      try {
+        auto t = Tuner(*this, params, m_context, m_device);
+        tune_buckets(t, false);
+        std::cerr << "SGEMM tuning done." << std::endl;
+      } catch (const std::exception& e) {
+        std::cerr << "SGEMM tuning failed: " << e.what() << std::endl;
+      }
+    });
+  }
 
-  // Build program for these specific devices.
-  try {
-    std::string args = cl_args;
-    args += sgemm_tuners;
-    m_program.build(args.c_str());
-  } catch (const cl::Error&) {
-    std::cerr << "Error building kernels: "
-              << m_program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(m_device) << "."
-              << std::endl;
-    throw std::runtime_error("Error building OpenCL kernels.");
+  // Exit immediately after tuning. Some NVIDIA drivers are buggy,
+  // and will fail to compile the rest of the kernels after a tuning,
+  // run. See #729.
+  if (params.tune_only) {
+    exit(EXIT_SUCCESS);
   }
 
+  m_sgemm_bucket_tuners = sgemm_tuners;
+  std::reverse(batch_sizes.begin(), batch_sizes.end());
+  std::reverse(sgemm_tuners.begin(), sgemm_tuners.end());
+  build_sgemm_buckets(batch_sizes, sgemm_tuners);
+
+  // Build program for these specific devices. Its SGEMM kernel is not used
+  // (buckets have their own), but has to be built too.
+  m_program = build_program(sourceCode_config + sourceCode_convolve1 +
+                                sourceCode_convolve3 + sourceCode_sgemm +
+                                sourceCode_sgemv,
+                            m_cl_args + sgemm_tuners.back());
+
   ensure_thread_initialized();
-  process_tuners(sgemm_tuners);
 
   m_wavefront_size =
-      opencl_thread_data.m_sgemm_kernel
+      get_thread_data().m_sgemm_kernels.back()
           .getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(
               best_device);
   if (verbose) {
@@ -820,3 +1127,29 @@ std::string OpenCL::get_device_name() {
 
   return ss.str();
 }
+
+std::string OpenCL::get_device_key() {
+  return get_device_name() + " driver " +
+         m_device.getInfo<CL_DRIVER_VERSION>();
+}
+
+std::vector<int> OpenCL::get_gpu_ids() {
+  std::vector<cl::Platform> platforms;
+  cl::Platform::get(&platforms);
+  // Devices are numbered as in initialize().
+  std::vector<int> ids;
+  auto id = 0;
+  for (const auto& p : platforms) {
+    std::vector<cl::Device> devices;
+    try {
+      p.getDevices(CL_DEVICE_TYPE_ALL, &devices);
+    } catch (const cl::Error&) {
+      devices.clear();
+    }
+    for (const auto& d : devices) {
+      if (d.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_GPU) ids.push_back(id);
+      id++;
+    }
+  }
+  return ids;
+}
@@ -24,9 +24,13 @@ using net_t = float;
 #define CL_HPP_TARGET_OPENCL_VERSION 120
 #define CL_HPP_ENABLE_EXCEPTIONS
 #include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <cstring>
 #include <memory>
 #include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 #include "cl2.hpp"
 
@@ -37,6 +41,62 @@ inline size_t ceilMultiple(size_t a, size_t b) {
   return a + (b - a % b);
 }
 
+// Conversions between float and IEEE half floats, the storage format of
+// device buffers in fp16 mode. Rounds to nearest even.
+inline uint16_t float_to_half(float f) {
+  uint32_t x;
+  std::memcpy(&x, &f, sizeof(x));
+  const uint32_t sign = (x >> 16) & 0x8000;
+  const int exponent = int((x >> 23) & 0xff) - 127 + 15;
+  uint32_t mantissa = x & 0x7fffff;
+  if (((x >> 23) & 0xff) == 0xff) {
+    // Infinity or NaN.
+    return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+  }
+  if (exponent >= 31) return sign | 0x7c00;
+  if (exponent <= 0) {
+    // Subnormal half, or zero.
+    if (exponent < -10) return sign;
+    mantissa |= 0x800000;
+    const int shift = 14 - exponent;
+    uint32_t h = mantissa >> shift;
+    const uint32_t rem = mantissa & ((1u << shift) - 1);
+    const uint32_t halfway = 1u << (shift - 1);
+    if (rem > halfway || (rem == halfway && (h & 1))) h++;
+    return sign | h;
+  }
+  uint32_t h = sign | (exponent << 10) | (mantissa >> 13);
+  const uint32_t rem = mantissa & 0x1fff;
+  // A carry into the exponent gives the right result, up to infinity.
+  if (rem > 0x1000 || (rem == 0x1000 && (h & 1))) h++;
+  return h;
+}
+
+inline float half_to_float(uint16_t h) {
+  const uint32_t sign = uint32_t(h & 0x8000) << 16;
+  uint32_t exponent = (h >> 10) & 0x1f;
+  uint32_t mantissa = h & 0x3ff;
+  uint32_t x;
+  if (exponent == 0x1f) {
+    x = sign | 0x7f800000 | (mantissa << 13);
+  } else if (exponent != 0) {
+    x = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+  } else if (mantissa == 0) {
+    x = sign;
+  } else {
+    // Subnormal half, normal float.
+    exponent = 127 - 15 + 1;
+    while (!(mantissa & 0x400)) {
+      mantissa <<= 1;
+      exponent--;
+    }
+    x = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+  }
+  float f;
+  std::memcpy(&f, &x, sizeof(f));
+  return f;
+}
+
 static constexpr auto WINOGRAD_P = 8 * 8 / 4;
 static constexpr auto WINOGRAD_TILE = 4 * 4;
 
@@ -58,6 +118,7 @@ class Layer {
   std::vector<cl::Buffer> weights;
 };
 
+// Kernels, queues and buffers of an OpenCL instance used by a thread.
 class ThreadData {
   friend class OpenCL;
   friend class OpenCL_Network;
@@ -68,16 +129,27 @@ class ThreadData {
   cl::Kernel m_convolve1_kernel;
   cl::Kernel m_merge_kernel;
   cl::Kernel m_in_transform_kernel;
-  cl::Kernel m_sgemm_kernel;
+  // One for each batch size bucket.
+  std::vector<cl::Kernel> m_sgemm_kernels;
   cl::Kernel m_sgemv_kernel;
   cl::Kernel m_out_transform_bn_kernel;
   cl::Kernel m_out_transform_bn_in_kernel;
+  // Uploads of inputs, so that they overlap with computations.
+  cl::CommandQueue m_transferqueue;
   cl::Buffer m_inBuffer;
   cl::Buffer m_inBuffer2;
   cl::Buffer m_VBuffer;
   cl::Buffer m_MBuffer;
-  cl::Buffer m_pinnedOutBuffer_pol;
-  cl::Buffer m_pinnedOutBuffer_val;
+  // A set of input and output buffers for each batch of the pipeline.
+  cl::Buffer m_inputBuffer[2];
+  cl::Buffer m_pinnedOutBuffer_pol[2];
+  cl::Buffer m_pinnedOutBuffer_val[2];
+  // Inputs converted to half floats in fp16 mode, kept until uploaded.
+  std::vector<uint16_t> m_inputHalf[2];
+  cl::Event m_inputEvent[2];
+  cl::Event m_outputEvent[2];
+  void* m_pinnedOutBufferHost_pol[2];
+  void* m_pinnedOutBufferHost_val[2];
   bool m_buffers_allocated{false};
 };
 
@@ -168,8 +240,23 @@ class OpenCL_Network {
 
   size_t get_layer_count() const { return m_layers.size(); }
 
-  void forward(const std::vector<net_t>& input, std::vector<net_t>& output_pol,
-               std::vector<net_t>& output_val, const int batch_size) const;
+  // Batches are computed in a pipeline of two buffer sets (slots), so that
+  // the input of a batch is uploaded while the previous batch is computed.
+  // A slot can be reused once its outputs are retrieved.
+  static constexpr int kPipelineSlots = 2;
+
+  // Enqueues the upload of @input to @slot without waiting. @input has to
+  // stay valid until the outputs of the slot are retrieved.
+  void enqueue_input(const std::vector<net_t>& input, int slot) const;
+
+  // Enqueues the forward pass of the batch uploaded to @slot, and the mapping
+  // of its outputs, without waiting.
+  void enqueue_forward(int slot, int batch_size) const;
+
+  // Waits for the batch of @slot to be computed and copies its outputs.
+  void retrieve_outputs(int slot, std::vector<net_t>& output_pol,
+                        std::vector<net_t>& output_val,
+                        int batch_size) const;
 
  private:
   using weight_slice_t = std::vector<cl::Buffer>::const_iterator;
@@ -179,12 +266,19 @@ class OpenCL_Network {
   }
   void add_weights(size_t layer, size_t size, const float* weights);
 
+  void ensure_buffers_allocated() const;
+
+  // Sizes in bytes of the outputs of a sample, on the device.
+  size_t get_output_size_pol() const;
+  size_t get_output_size_val() const;
+
   void convolve3(int channels, int outputs, cl::Buffer& bufferIn,
                  cl::Buffer& bufferOut, cl::Buffer& bufferV,
                  cl::Buffer& bufferM, weight_slice_t weights,
                  cl::Buffer* bufferResidual, weight_slice_t bn_weights,
                  bool skip_in_transform, bool fuse_in_transform,
-                 bool store_inout, int batch_size) const;
+                 bool store_inout, int batch_size,
+                 const std::vector<cl::Event>* events = nullptr) const;
 
   void convolve1(int channels, int outputs, cl::Buffer& bufferInput,
                  cl::Buffer& bufferOutput, cl::Buffer& bufferMerge,
@@ -197,11 +291,6 @@ class OpenCL_Network {
   OpenCL& m_opencl;
   size_t m_max_batch_size;
 
-  // this mutex is not required for correctness, but this exists simply
-  // because queue.finish() is a busy wait and having a lot of threads
-  // waiting here is counterproductive CPU-wise.  At least std::mutex
-  // isn't busy wait so it should be better.
-  mutable std::mutex m_queue_finish_mutex;
   std::vector<Layer> m_layers;
 };
 
@@ -210,31 +299,84 @@ class OpenCL {
   friend class Tuner;
 
  public:
+  OpenCL();
+  ~OpenCL();
+
+  // IDs (as OpenCLParams::gpuId) of all GPU devices.
+  static std::vector<int> get_gpu_ids();
+
   void initialize(const int channels, const OpenCLParams& params);
   void ensure_thread_initialized(void);
   std::string get_device_name();
+  // Devices of the same key share tunings and compiled programs.
+  std::string get_device_key();
+
+  // SGEMM tuners of the buckets, largest first, as in
+  // OpenCLParams::known_sgemm_tuners.
+  const std::vector<std::string>& get_sgemm_bucket_tuners() const {
+    return m_sgemm_bucket_tuners;
+  }
 
   std::vector<size_t> get_sgemm_tuners(void);
 
+  // Smallest number of samples whose Winograd tiles fill whole SGEMM tiles
+  // of the largest bucket, so that larger batches need no padding. It's 1
+  // when no batch size is padded.
+  size_t get_batch_step() const;
+
+  bool use_half() const { return m_use_half; }
+
+  // Size of an element of device buffers.
+  size_t get_net_t_size() const {
+    return m_use_half ? sizeof(uint16_t) : sizeof(net_t);
+  }
+
   cl::Device m_device;
   cl::Context m_context;
 
  private:
-  void tune_sgemm(void);
-  void process_tuners(std::string tuners);
-
-  cl::Program m_program;
-  std::string m_cl_args;
-
   struct sgemm_tuners {
     size_t mwg, nwg, kwg;
     size_t vwm, vwn;
     size_t mdimc, ndimc;
   };
+
+  // SGEMM kernels tuned for batches of up to batch_size samples. Tuners of
+  // all buckets share MWG, KWG and VWM, which set the layout of the weights.
+  struct sgemm_bucket {
+    int batch_size;
+    sgemm_tuners tuners;
+    cl::Program program;
+  };
+
+  // Data of this instance for the calling thread.
+  ThreadData& get_thread_data() const;
+
+  void tune_sgemm(void);
+  sgemm_tuners process_tuners(std::string tuners);
+  // Builds @source with @args, or loads its binary if it was built before.
+  cl::Program build_program(const std::string& source,
+                            const std::string& args);
+  void build_sgemm_buckets(const std::vector<int>& batch_sizes,
+                           const std::vector<std::string>& tuners);
+  // Index of the smallest bucket which fits @batch_size, or of the largest.
+  size_t get_sgemm_bucket(int batch_size) const;
+
+  cl::Program m_program;
+  std::string m_cl_args;
+
+  uint64_t m_id;
+  // Tuners of the largest bucket.
   sgemm_tuners m_sgemm_tuners;
+  std::vector<std::string> m_sgemm_bucket_tuners;
+  std::vector<sgemm_bucket> m_sgemm_buckets;
+  // Tuning in the background, and the request to stop it.
+  std::thread m_tuning_thread;
+  std::atomic<bool> m_stop_tuning{false};
   size_t m_wavefront_size{0};
   size_t m_max_workgroup_size{0};
   std::vector<size_t> m_max_workgroup_dims;
+  bool m_use_half{false};
   bool m_init_ok{false};
 };
 
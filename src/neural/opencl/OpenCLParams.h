@@ -18,6 +18,10 @@
 
 #pragma once
 
+#include <map>
+#include <string>
+#include <vector>
+
 struct OpenCLParams {
   int gpuId = -1;
 
@@ -26,5 +30,14 @@ struct OpenCLParams {
   bool force_tune = false;
   bool tune_exhaustive = false;
   int tune_batch_size = 1;
-  
+  // Tune in a thread and use default parameters until the next start,
+  // instead of tuning before starting.
+  bool tune_background = false;
+  // Store weights and activations as half floats and multiply matrices in
+  // half precision. Needs cl_khr_fp16.
+  bool use_half = false;
+  // SGEMM tuners (of buckets, largest first) by device key, already found
+  // for other devices. A device of one of those keys uses them instead of
+  // being tuned.
+  std::map<std::string, std::vector<std::string>> known_sgemm_tuners;
 };
@@ -17,6 +17,7 @@
  */
 
 #include <array>
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <fstream>
@@ -35,6 +36,8 @@
 
 const auto TUNER_FILE_LOCAL = std::string("leelaz_opencl_tuning");
 constexpr auto MAX_ERROR = 1e-4f;
+// Half precision matrix multiplications are much less accurate.
+constexpr auto MAX_ERROR_HALF = 1e-1f;
 
 static void sgemmBatched_ref(const std::vector<float>& a,
                              const std::vector<float>& b, std::vector<float>& c,
@@ -50,6 +53,30 @@ static void sgemmBatched_ref(const std::vector<float>& a,
   }
 }
 
+// Tunings of half precision kernels are stored apart from single precision.
+std::string Tuner::get_tuning_name() const {
+  return m_opencl.use_half() ? "XgemmBatchedHalf" : "XgemmBatched";
+}
+
+// Tunings are kept for a device and driver version.
+std::string Tuner::get_device_key() const {
+  return m_opencl.get_device_key();
+}
+
+TuneParameters Tuner::defines_to_parameters(const std::string& defines) {
+  TuneParameters p;
+  auto ss = std::stringstream{defines};
+  auto define = std::string{};
+  while (ss >> define) {
+    const auto equal = define.find('=');
+    if (define.compare(0, 2, "-D") != 0 || equal == std::string::npos) {
+      continue;
+    }
+    p[define.substr(2, equal - 2)] = std::stoul(define.substr(equal + 1));
+  }
+  return p;
+}
+
 static bool IsMultiple(const size_t a, const size_t b) { return (a % b == 0); }
 
 bool Tuner::valid_config_sgemm(TuneParameters p, bool exhaustive) {
@@ -172,7 +199,8 @@ static float compare_ref(std::vector<float>& x, std::vector<float>& ref,
 }
 
 std::string Tuner::tune_sgemm(const int m, const int n, const int k,
-                              const int batch_size, const int runs) {
+                              const int batch_size, const TuneParameters& fixed,
+                              const int runs) {
   auto opts = std::vector<Configurations>();
   if (m_params.tune_exhaustive) {
     opts = {
@@ -191,6 +219,10 @@ std::string Tuner::tune_sgemm(const int m, const int n, const int k,
         {"SA", {0, 1}},         {"SB", {0, 1}},
     };
   }
+  for (auto& opt : opts) {
+    const auto iter = fixed.find(opt.first);
+    if (iter != fixed.end()) opt.second = {iter->second};
+  }
 
   // This needs to be at minimum the maximum (MNK/WG) values above.
   auto m_max = std::max(64, m);
@@ -216,15 +248,24 @@ std::string Tuner::tune_sgemm(const int m, const int n, const int k,
 
   sgemmBatched_ref(at, b, c_ref, m, n, k, batch_size);
 
-  auto aBuffer = cl::Buffer(m_context, CL_MEM_READ_WRITE,
-                            sizeof(float) * at_size, nullptr, nullptr);
-  auto bBuffer = cl::Buffer(m_context, CL_MEM_READ_WRITE,
-                            sizeof(float) * b_size, nullptr, nullptr);
-  auto cBuffer = cl::Buffer(m_context, CL_MEM_READ_WRITE,
-                            sizeof(float) * c_size, nullptr, nullptr);
-
-  std::cerr << "Started OpenCL SGEMM tuner with batch size " << batch_size
-            << "." << std::endl;
+  // In fp16 mode, the kernel is built for half floats, which the data is
+  // converted from and to.
+  const auto use_half = m_opencl.use_half();
+  const auto net_t_size = m_opencl.get_net_t_size();
+  const auto error_limit = use_half ? MAX_ERROR_HALF : MAX_ERROR;
+  auto at_half = std::vector<uint16_t>(use_half ? at_size : 0);
+  auto b_half = std::vector<uint16_t>(use_half ? b_size : 0);
+  auto c_half = std::vector<uint16_t>(use_half ? c_size : 0);
+
+  auto aBuffer = cl::Buffer(m_context, CL_MEM_READ_WRITE, net_t_size * at_size,
+                            nullptr, nullptr);
+  auto bBuffer = cl::Buffer(m_context, CL_MEM_READ_WRITE, net_t_size * b_size,
+                            nullptr, nullptr);
+  auto cBuffer = cl::Buffer(m_context, CL_MEM_READ_WRITE, net_t_size * c_size,
+                            nullptr, nullptr);
+
+  std::cerr << "Started OpenCL SGEMM tuner for " << m << "x" << n << "x" << k
+            << ", batch size " << batch_size << "." << std::endl;
 
   auto valid_params = std::vector<int>{};
   auto cfgs = 1;
@@ -261,6 +302,9 @@ std::string Tuner::tune_sgemm(const int m, const int n, const int k,
 
   for (const auto& i : valid_params) {
     param_counter++;
+    if (m_opencl.m_stop_tuning) {
+      throw std::runtime_error("Tuning was stopped.");
+    }
 
     auto p = get_parameters_by_int(opts, i);
     auto defines = parameters_to_defines(p);
@@ -288,10 +332,19 @@ std::string Tuner::tune_sgemm(const int m, const int n, const int k,
       sgemm_generate_data(at, k, m, batch_size, k_ceil, m_ceil);
       sgemm_generate_data(b, n, k, batch_size, n_ceil, k_ceil);
 
-      queue.enqueueWriteBuffer(aBuffer, CL_FALSE, 0, at_size * sizeof(float),
-                               at.data());
-      queue.enqueueWriteBuffer(bBuffer, CL_FALSE, 0, b_size * sizeof(float),
-                               b.data());
+      if (use_half) {
+        std::transform(at.begin(), at.end(), at_half.begin(), float_to_half);
+        std::transform(b.begin(), b.end(), b_half.begin(), float_to_half);
+        queue.enqueueWriteBuffer(aBuffer, CL_FALSE, 0, at_size * net_t_size,
+                                 at_half.data());
+        queue.enqueueWriteBuffer(bBuffer, CL_FALSE, 0, b_size * net_t_size,
+                                 b_half.data());
+      } else {
+        queue.enqueueWriteBuffer(aBuffer, CL_FALSE, 0, at_size * net_t_size,
+                                 at.data());
+        queue.enqueueWriteBuffer(bBuffer, CL_FALSE, 0, b_size * net_t_size,
+                                 b.data());
+      }
       queue.finish();
     }
 
@@ -317,9 +370,17 @@ std::string Tuner::tune_sgemm(const int m, const int n, const int k,
         queue.finish();
         event.wait();
 
-        queue.enqueueReadBuffer(cBuffer, CL_FALSE, 0, c_size * sizeof(float),
-                                c.data());
-        queue.finish();
+        if (use_half) {
+          queue.enqueueReadBuffer(cBuffer, CL_FALSE, 0, c_size * net_t_size,
+                                  c_half.data());
+          queue.finish();
+          std::transform(c_half.begin(), c_half.end(), c.begin(),
+                         half_to_float);
+        } else {
+          queue.enqueueReadBuffer(cBuffer, CL_FALSE, 0, c_size * net_t_size,
+                                  c.data());
+          queue.finish();
+        }
 
         auto this_error =
             compare_ref(c, c_ref, n, m, batch_size, n_ceil, m_ceil);
@@ -331,11 +392,11 @@ std::string Tuner::tune_sgemm(const int m, const int n, const int k,
         sum += elapsed;
       } catch (const cl::Error&) {
         // Failed to enqueue kernel. Set error to max.
-        max_error = MAX_ERROR;
+        max_error = error_limit;
         break;
       }
     }
-    if (max_error < MAX_ERROR && (best_time == 0 || sum < best_time)) {
+    if (max_error < error_limit && (best_time == 0 || sum < best_time)) {
       auto param_str = parameters_to_string(p);
       auto kernel_us = 1e-3f * (sum / runs);
       // Timing is in nanoseconds (10^-9), Giga = 10^9, so this works out.
@@ -372,11 +433,12 @@ void Tuner::store_sgemm_tuners(const int m, const int n, const int k,
   }
   auto file = std::ofstream{TUNER_FILE_LOCAL};
 
-  auto device_name = m_opencl.get_device_name();
+  auto device_name = get_device_key();
   auto tuning_params = std::stringstream{};
   tuning_params << m << ";" << n << ";" << k << ";" << batch_size;
 
-  auto tuning_line_prefix = std::to_string(TUNER_VERSION) + ";XgemmBatched;" +
+  auto tuning_line_prefix = std::to_string(TUNER_VERSION) + ";" +
+                            get_tuning_name() + ";" +
                             tuning_params.str() + ";";
   auto tuning_line = tuning_line_prefix + tuners + ";" + device_name;
 
@@ -418,7 +480,7 @@ std::string Tuner::sgemm_tuners_from_line(std::string line, const int m,
     return "";
   }
 
-  if (s[1] != "XgemmBatched") {
+  if (s[1] != get_tuning_name()) {
     return "";
   }
 
@@ -438,40 +500,46 @@ std::string Tuner::sgemm_tuners_from_line(std::string line, const int m,
     return "";
   }
 
-  if (s[7] != m_opencl.get_device_name()) {
+  if (s[7] != get_device_key()) {
     return "";
   }
 
   return s[6];
 }
 
+std::string Tuner::find_sgemm_tuners(const int m, const int n, const int k,
+                                     const int batch_size,
+                                     const TuneParameters& fixed) {
+  auto file = std::ifstream{TUNER_FILE_LOCAL};
+  auto line = std::string{};
+  while (file.good() && std::getline(file, line)) {
+    auto tuners = sgemm_tuners_from_line(line, m, n, k, batch_size);
+    if (tuners.size() == 0) continue;
+    auto p = defines_to_parameters(tuners);
+    for (const auto& x : fixed) {
+      if (p[x.first] != x.second) tuners.clear();
+    }
+    if (tuners.size() != 0) return tuners;
+  }
+  return "";
+}
+
 std::string Tuner::load_sgemm_tuners(const int m, const int n, const int k,
-                                     const int batch_size) {
+                                     const int batch_size,
+                                     const TuneParameters& fixed) {
   if (!m_params.force_tune) {
-    auto file = std::ifstream{TUNER_FILE_LOCAL};
-    if (file.good()) {
-      auto line = std::string{};
-      while (std::getline(file, line)) {
-        auto tuners = sgemm_tuners_from_line(line, m, n, k, batch_size);
-        if (tuners.size() != 0) {
-          if (m_params.verbose) {
-            std::cerr << "Loaded existing SGEMM tuning for batch_size "
-                      << batch_size << "." << std::endl;
-          }
-          return tuners;
-        }
+    auto tuners = find_sgemm_tuners(m, n, k, batch_size, fixed);
+    if (tuners.size() != 0) {
+      if (m_params.verbose) {
+        std::cerr << "Loaded existing SGEMM tuning for " << m << "x" << n
+                  << "x" << k << ", batch_size " << batch_size << "."
+                  << std::endl;
       }
+      return tuners;
     }
   }
 
-  auto tuners = tune_sgemm(m, n, k, batch_size);
+  auto tuners = tune_sgemm(m, n, k, batch_size, fixed);
   store_sgemm_tuners(m, n, k, batch_size, tuners);
-
-  // Exit immediately after tuning. Some NVIDIA drivers are buggy,
-  // and will fail to compile the rest of the kernels after a tuning,
-  // run. See #729.
-  if (m_params.tune_only) {
-    exit(EXIT_SUCCESS);
-  }
   return tuners;
 }
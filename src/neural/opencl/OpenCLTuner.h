@@ -36,12 +36,23 @@ class Tuner {
   cl::Device m_device;
 
  public:
+  // Parameters in @fixed are not tuned but set to the given values.
   std::string tune_sgemm(const int m, const int n, const int k,
-                         const int batch_size, const int runs = 4);
+                         const int batch_size, const TuneParameters& fixed,
+                         const int runs = 4);
+  // Returns stored tuners, or tunes and stores them.
   std::string load_sgemm_tuners(const int m, const int n, const int k,
-                                const int batch_size);
+                                const int batch_size,
+                                const TuneParameters& fixed = {});
+  // Returns stored tuners which agree with @fixed, or an empty string.
+  std::string find_sgemm_tuners(const int m, const int n, const int k,
+                                const int batch_size,
+                                const TuneParameters& fixed = {});
 
-  static constexpr auto TUNER_VERSION = 0;
+  // Parses tuners given as defines ("-DMWG=32 -DNWG=16 ...").
+  static TuneParameters defines_to_parameters(const std::string& defines);
+
+  static constexpr auto TUNER_VERSION = 1;
   Tuner(OpenCL& opencl, const OpenCLParams& params, cl::Context context,
         cl::Device device)
       : m_opencl(opencl),
@@ -50,6 +61,8 @@ class Tuner {
         m_device(device) {}
 
  private:
+  std::string get_tuning_name() const;
+  std::string get_device_key() const;
   void store_sgemm_tuners(const int m, const int n, const int k,
                           const int batch_size, std::string tuners);
   bool valid_config_sgemm(TuneParameters p, bool exhaustive);
@@ -27,18 +27,27 @@
 
 #include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <cmath>
 #include <condition_variable>
+#include <exception>
+#include <future>
 #include <iostream>
 #include <thread>
 
 #include "utils/bititer.h"
 #include "utils/exception.h"
+#include "utils/mutex.h"
+#include "utils/string.h"
+#include "utils/threadpool.h"
 
 namespace lczero {
 
 namespace {
 
+// Weight of the latest measurement in the throughput estimate of a device.
+const double kThroughputDecay = 0.1;
+
 class OpenCLNetwork;
 
 // Copy the vectors we need after weights is deallocated.
@@ -55,67 +64,31 @@ struct OpenCLWeights {
         num_value_channels(weights.ip1_val_b.size()) {}
 };
 
+// A device the network is loaded on.
+struct OpenCLDevice {
+  OpenCLDevice() : opencl_net(opencl) {}
+
+  OpenCL opencl;
+  OpenCL_Network opencl_net;
+};
+
 class OpenCLComputation : public NetworkComputation {
  public:
-  OpenCLComputation(const OpenCL_Network& opencl_net,
-                    const OpenCLWeights& weights)
-      : opencl_net_(opencl_net), weights_(weights), policies_(), q_values_() {}
+  OpenCLComputation(OpenCLNetwork* network, const OpenCLWeights& weights)
+      : network_(network), weights_(weights), policies_(), q_values_() {}
 
   virtual ~OpenCLComputation() {}
 
   // Adds a sample to the batch.
-  void AddInput(InputPlanes&& input) override { planes_.emplace_back(input); }
-
-  // Do the computation.
-  void ComputeBlocking() override {
-    // Determine the largest batch for allocations.
-    const auto plane_count = planes_.size();
-    const auto max_batch_size = opencl_net_.getMaxMatchSize();
-    const auto largest_batch_size = std::min(max_batch_size, plane_count);
-
-    const auto num_output_policies = weights_.num_output_policies;
-    const auto num_value_channels = weights_.num_value_channels;
-
-    // Typically
-    // input_channels = 112
-    // num_value_channels = 128
-    // num_output_policy = 1858
-
-    std::vector<float> output_pol(largest_batch_size * num_output_policies);
-    std::vector<float> output_val(largest_batch_size * num_value_channels);
-    std::vector<float> input_data(largest_batch_size * kInputPlanes * kSquares);
-
-    for (size_t i = 0; i < plane_count; i += largest_batch_size) {
-      const auto batch_size = std::min(plane_count - i, largest_batch_size);
-      for (size_t j = 0; j < batch_size; j++) {
-        EncodePlanes(planes_[i + j], &input_data[j * kSquares * kInputPlanes]);
-      }
+  InputPlanesRef AddInputInPlace() override { return planes_.Add(); }
 
-      opencl_net_.forward(input_data, output_pol, output_val, batch_size);
+  void SetPolicySoftmaxTemp(float temp) override { policy_temp_ = temp; }
 
-      for (size_t j = 0; j < batch_size; j++) {
-        std::vector<float> policy(weights_.num_output_policies);
-
-        // Get the moves.
-        FullyConnectedLayer::Softmax(num_output_policies,
-                                     &output_pol[j * num_output_policies],
-                                     policy.data());
-
-        policies_.emplace_back(std::move(policy));
-
-        // Now get the score.
-        auto winrate = FullyConnectedLayer::Forward0D(
-                             num_value_channels, weights_.ip2_val_w.data(),
-                             &output_val[j * num_value_channels]) +
-                         weights_.ip2_val_b[0];
-
-        q_values_.emplace_back(std::tanh(winrate));
-      }
-    }
-  }
+  // Do the computation.
+  void ComputeBlocking() override;
 
-  // Returns how many times AddInput() was called.
-  int GetBatchSize() const override { return static_cast<int>(planes_.size()); }
+  // Returns how many samples were added.
+  int GetBatchSize() const override { return planes_.GetSize(); }
 
   // Returns Q value of @sample.
   float GetQVal(int sample) const override { return q_values_[sample]; }
@@ -124,28 +97,40 @@ class OpenCLComputation : public NetworkComputation {
   float GetPVal(int sample, int move_id) const override {
     return policies_[sample][move_id];
   }
+  void GetPVals(int sample, const uint16_t* move_ids, int count,
+                float* out) const override {
+    const float* policy = policies_[sample].data();
+    for (int i = 0; i < count; ++i) out[i] = policy[move_ids[i]];
+  }
 
  private:
   static constexpr auto kWidth = 8;
   static constexpr auto kHeight = 8;
   static constexpr auto kSquares = kWidth * kHeight;
 
-  void EncodePlanes(const InputPlanes& sample, float* buffer);
+  void EncodePlanes(int sample, float* buffer);
+  // Computes samples [first, first + count) on @opencl_net, in this thread.
+  void ComputeRange(const OpenCL_Network& opencl_net, size_t first,
+                    size_t count);
 
-  const OpenCL_Network& opencl_net_;
+  OpenCLNetwork* const network_;
   const OpenCLWeights& weights_;
+  float policy_temp_ = 1.0f;
 
-  std::vector<InputPlanes> planes_;
+  InputBatch planes_;
 
   std::vector<std::vector<float>> policies_;
   std::vector<float> q_values_;
 };
 
-void OpenCLComputation::EncodePlanes(const InputPlanes& sample, float* buffer) {
-  for (const InputPlane& plane : sample) {
-    const float value = plane.value;
+void OpenCLComputation::EncodePlanes(int sample, float* buffer) {
+  const uint64_t* masks = planes_.GetMasks(sample);
+  const float* values = planes_.GetValues(sample);
+  for (int plane = 0; plane < kInputPlanes; plane++) {
+    const uint64_t mask = masks[plane];
+    const float value = values[plane];
     for (auto i = 0; i < kSquares; i++) {
-      *(buffer++) = (plane.mask & (((uint64_t)1) << i)) != 0 ? value : 0;
+      *(buffer++) = (mask & (((uint64_t)1) << i)) != 0 ? value : 0;
     }
   }
 }
@@ -154,14 +139,18 @@ class OpenCLNetwork : public Network {
  public:
   virtual ~OpenCLNetwork(){};
 
-  OpenCLNetwork(const Weights& weights, const OptionsDict& options)
-      : weights_(weights), params_(), opencl_(), opencl_net_(opencl_) {
+  OpenCLNetwork(const WeightsPtr& shared_weights, const OptionsDict& options,
+                bool use_half = false)
+      : weights_(*shared_weights), params_() {
+    params_.use_half = use_half;
     params_.gpuId = options.GetOrDefault<int>("gpu", -1);
     params_.verbose = options.GetOrDefault<bool>("verbose", true);
     params_.force_tune = options.GetOrDefault<bool>("force_tune", false);
     params_.tune_only = options.GetOrDefault<bool>("tune_only", false);
     params_.tune_exhaustive =
         options.GetOrDefault<bool>("tune_exhaustive", false);
+    params_.tune_background =
+        options.GetOrDefault<bool>("tune_background", false);
         
     // By default batch size is 1, as many old cards may not support more.
     auto max_batch_size_ =
@@ -178,7 +167,103 @@ class OpenCLNetwork : public Network {
     // tune.
     params_.tune_batch_size =
         options.GetOrDefault<int>("tune_batch_size", max_batch_size_);
-        
+
+    // Devices of the "gpus" option (comma separated list of ids, or "all"
+    // GPUs), or the single "gpu" one.
+    std::vector<int> gpu_ids;
+    if (options.Exists<std::string>("gpus")) {
+      const auto gpus = options.Get<std::string>("gpus");
+      gpu_ids = gpus == "all" ? OpenCL::get_gpu_ids() : ParseIntList(gpus);
+      if (gpu_ids.empty()) throw Exception("No OpenCL GPUs found.");
+    } else if (options.Exists<int>("gpus")) {
+      gpu_ids.push_back(options.Get<int>("gpus"));
+    } else {
+      gpu_ids.push_back(params_.gpuId);
+    }
+
+    // Devices are loaded one after the other, so that a device of the same
+    // type as a previous one uses its tuning, and its programs compiled into
+    // the cache.
+    for (const int gpu_id : gpu_ids) {
+      params_.gpuId = gpu_id;
+      devices_.push_back(std::make_unique<OpenCLDevice>());
+      auto& device = *devices_.back();
+      LoadDevice(*shared_weights, max_batch_size_, &device);
+      params_.known_sgemm_tuners.emplace(
+          device.opencl.get_device_key(),
+          device.opencl.get_sgemm_bucket_tuners());
+      throughputs_.push_back(1.0);
+    }
+    if (devices_.size() > 1) {
+      std::cerr << "OpenCL, batches split over " << devices_.size()
+                << " devices." << std::endl;
+    }
+  }
+
+  std::unique_ptr<NetworkComputation> NewComputation() override {
+    return std::make_unique<OpenCLComputation>(this, weights_);
+  }
+
+  bool SupportsPolicySoftmaxTemp() const override { return true; }
+
+  // Multiples of the step fill the SGEMM tiles without padding.
+  int GetPreferredBatchStep() const override {
+    return static_cast<int>(devices_[0]->opencl.get_batch_step());
+  }
+
+  int GetDeviceCount() const { return devices_.size(); }
+  const OpenCL_Network& GetDevice(int idx) const {
+    return devices_[idx]->opencl_net;
+  }
+
+  // Returns how many of @batch_size samples each device should compute.
+  std::vector<size_t> Split(size_t batch_size) {
+    std::vector<double> throughputs;
+    {
+      Mutex::Lock lock(mutex_);
+      throughputs = throughputs_;
+    }
+    double total = 0.0;
+    for (const auto x : throughputs) total += x;
+
+    // Shares rounded down to whole batch steps, the rest given out by
+    // largest remainder.
+    const size_t step = GetPreferredBatchStep();
+    std::vector<size_t> sizes(devices_.size());
+    std::vector<std::pair<double, int>> remainders;
+    size_t left = batch_size;
+    for (size_t i = 0; i < devices_.size(); ++i) {
+      const double share = batch_size * throughputs[i] / total;
+      sizes[i] = static_cast<size_t>(share) / step * step;
+      left -= sizes[i];
+      remainders.emplace_back(share - sizes[i], i);
+    }
+    std::sort(remainders.rbegin(), remainders.rend());
+    for (size_t i = 0; left > 0; i = (i + 1) % remainders.size()) {
+      const size_t add = std::min(left, step);
+      sizes[remainders[i].second] += add;
+      left -= add;
+    }
+    return sizes;
+  }
+
+  // Updates throughput estimate of device @idx, which computed @batch_size
+  // samples in @seconds.
+  void Report(int idx, size_t batch_size, double seconds) {
+    if (seconds <= 0.0) return;
+    Mutex::Lock lock(mutex_);
+    throughputs_[idx] = (1.0 - kThroughputDecay) * throughputs_[idx] +
+                        kThroughputDecay * batch_size / seconds;
+  }
+
+ private:
+  static constexpr auto kHardMaxBatchSize = 16;
+
+  // Initializes @device with params_, and uploads @weights to it.
+  void LoadDevice(const Weights& weights, size_t max_batch_size,
+                  OpenCLDevice* device) {
+    OpenCL& opencl = device->opencl;
+    OpenCL_Network& opencl_net = device->opencl_net;
 
     const auto inputChannels = static_cast<size_t>(kInputPlanes);
     const auto channels = weights.input.biases.size();
@@ -199,9 +284,9 @@ class OpenCLNetwork : public Network {
     
     static constexpr auto kWinogradAlpha = 4;
 
-    opencl_.initialize(channels, params_);
+    opencl.initialize(channels, params_);
 
-    auto tuners = opencl_.get_sgemm_tuners();
+    auto tuners = opencl.get_sgemm_tuners();
 
     auto mwg = tuners[0];
     auto kwg = tuners[2];
@@ -222,7 +307,7 @@ class OpenCLNetwork : public Network {
         Batchnorm::InvertStddev(weights.input);
 
     // Winograd filter transformation changes filter size to 4x4.
-    opencl_net_.push_input_convolution(kWinogradAlpha, inputChannels, channels,
+    opencl_net.push_input_convolution(kWinogradAlpha, inputChannels, channels,
                                        Upad, input_batchnorm_means,
                                        input_batchnorm_stddivs);
 
@@ -248,7 +333,7 @@ class OpenCLNetwork : public Network {
       std::vector<float> batchnorm_stddivs_1 = Batchnorm::InvertStddev(conv1);
       std::vector<float> batchnorm_stddivs_2 = Batchnorm::InvertStddev(conv2);
 
-      opencl_net_.push_residual(kWinogradAlpha, channels, channels, Upad1,
+      opencl_net.push_residual(kWinogradAlpha, channels, channels, Upad1,
                                 batchnorm_means_1, batchnorm_stddivs_1, Upad2,
                                 batchnorm_means_2, batchnorm_stddivs_2);
     }
@@ -259,7 +344,7 @@ class OpenCLNetwork : public Network {
     std::vector<float> bn_pol_means = Batchnorm::OffsetMeans(weights.policy);
     std::vector<float> bn_pol_stddivs = Batchnorm::InvertStddev(weights.policy);
 
-    opencl_net_.push_policy(channels, num_policy_input_planes,
+    opencl_net.push_policy(channels, num_policy_input_planes,
                             num_policy_input_planes * width * height,
                             num_output_policy, weights.policy.weights,
                             bn_pol_means, bn_pol_stddivs, weights.ip_pol_w,
@@ -268,30 +353,157 @@ class OpenCLNetwork : public Network {
     std::vector<float> bn_val_means = Batchnorm::OffsetMeans(weights.value);
     std::vector<float> bn_val_stddivs = Batchnorm::InvertStddev(weights.value);
 
-    opencl_net_.push_value(channels, num_value_input_planes,
+    opencl_net.push_value(channels, num_value_input_planes,
                            num_value_input_planes * width * height,
                            num_value_channels, weights.value.weights,
                            bn_val_means, bn_val_stddivs, weights.ip1_val_w,
                            weights.ip1_val_b);
 
-    opencl_net_.setMaxMatchSize(max_batch_size_);
+    opencl_net.setMaxMatchSize(max_batch_size);
   }
 
-  std::unique_ptr<NetworkComputation> NewComputation() override {
-    return std::make_unique<OpenCLComputation>(opencl_net_, weights_);
+  OpenCLWeights weights_;
+  OpenCLParams params_;
+  std::vector<std::unique_ptr<OpenCLDevice>> devices_;
+  Mutex mutex_{"opencl"};
+  // Samples per second of each device.
+  std::vector<double> throughputs_ GUARDED_BY(mutex_);
+};
+
+void OpenCLComputation::ComputeRange(const OpenCL_Network& opencl_net,
+                                   size_t first, size_t count) {
+  // Determine the largest batch for allocations.
+  const auto end = first + count;
+  const auto max_batch_size = opencl_net.getMaxMatchSize();
+  const auto largest_batch_size = std::min(max_batch_size, count);
+
+  const auto num_output_policies = weights_.num_output_policies;
+  const auto num_value_channels = weights_.num_value_channels;
+
+  // Typically
+  // input_channels = 112
+  // num_value_channels = 128
+  // num_output_policy = 1858
+
+  std::vector<float> output_pol(largest_batch_size * num_output_policies);
+  std::vector<float> output_val(largest_batch_size * num_value_channels);
+  std::vector<float> input_data[OpenCL_Network::kPipelineSlots];
+  for (auto& input : input_data) {
+    input.resize(largest_batch_size * kInputPlanes * kSquares);
   }
 
- private:
-  static constexpr auto kHardMaxBatchSize = 16;
+  // Encodes, uploads and computes the batch starting at @begin in @slot.
+  auto enqueue_batch = [&](size_t begin, int slot) {
+    const auto batch_size = std::min(end - begin, largest_batch_size);
+    for (size_t j = 0; j < batch_size; j++) {
+      EncodePlanes(begin + j, &input_data[slot][j * kSquares * kInputPlanes]);
+    }
+    opencl_net.enqueue_input(input_data[slot], slot);
+    opencl_net.enqueue_forward(slot, batch_size);
+  };
+
+  // The next batch is encoded, uploaded and queued while the GPU computes
+  // the current one, and the current one is post-processed while the GPU
+  // computes the next.
+  int slot = 0;
+  if (count > 0) enqueue_batch(first, slot);
+  for (size_t i = first; i < end; i += largest_batch_size) {
+    const auto batch_size = std::min(end - i, largest_batch_size);
+    const int next_slot = (slot + 1) % OpenCL_Network::kPipelineSlots;
+    if (i + batch_size < end) enqueue_batch(i + batch_size, next_slot);
+
+    opencl_net.retrieve_outputs(slot, output_pol, output_val, batch_size);
+    slot = next_slot;
+
+    for (size_t j = 0; j < batch_size; j++) {
+      auto& policy = policies_[i + j];
+      policy.resize(num_output_policies);
+
+      // Get the moves.
+      float* logits = &output_pol[j * num_output_policies];
+      if (policy_temp_ != 1.0f) {
+        const float inv_temp = 1.0f / policy_temp_;
+        for (size_t k = 0; k < num_output_policies; k++) {
+          logits[k] *= inv_temp;
+        }
+      }
+      FullyConnectedLayer::Softmax(num_output_policies, logits,
+                                   policy.data());
 
-  OpenCLWeights weights_;
-  OpenCLParams params_;
-  OpenCL opencl_;
-  OpenCL_Network opencl_net_;
+      // Now get the score.
+      auto winrate = FullyConnectedLayer::Forward0D(
+                           num_value_channels, weights_.ip2_val_w.data(),
+                           &output_val[j * num_value_channels]) +
+                       weights_.ip2_val_b[0];
+
+      q_values_[i + j] = std::tanh(winrate);
+    }
+  }
+}
+
+void OpenCLComputation::ComputeBlocking() {
+  const auto count = static_cast<size_t>(planes_.GetSize());
+  policies_.resize(count);
+  q_values_.resize(count);
+  if (network_->GetDeviceCount() == 1) {
+    ComputeRange(network_->GetDevice(0), 0, count);
+    return;
+  }
+
+  const auto sizes = network_->Split(count);
+  const auto compute = [this, &sizes](int device, size_t first) {
+    const auto start = std::chrono::steady_clock::now();
+    ComputeRange(network_->GetDevice(device), first, sizes[device]);
+    network_->Report(device, sizes[device],
+                     std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count());
+  };
+  // The first device computes in this thread.
+  std::vector<std::future<void>> futures;
+  size_t first = sizes[0];
+  for (int i = 1; i < network_->GetDeviceCount(); ++i) {
+    if (sizes[i] > 0) {
+      futures.push_back(ThreadPool::Get()->Run(
+          [&compute, i, first]() { compute(i, first); }));
+    }
+    first += sizes[i];
+  }
+  // All devices have to finish before an error propagates, as they refer to
+  // this computation.
+  std::exception_ptr error;
+  try {
+    if (sizes[0] > 0) compute(0, 0);
+  } catch (...) {
+    error = std::current_exception();
+  }
+  for (auto& future : futures) {
+    try {
+      future.get();
+    } catch (...) {
+      if (!error) error = std::current_exception();
+    }
+  }
+  if (error) std::rethrow_exception(error);
+}
+
+// Half precision storage and matrix multiplications, on devices which have
+// cl_khr_fp16.
+class OpenCLNetworkFp16 : public OpenCLNetwork {
+ public:
+  OpenCLNetworkFp16(const WeightsPtr& weights, const OptionsDict& options)
+      : OpenCLNetwork(weights, options, true) {}
 };
 
+// Loading the ICDs and enumerating the platforms is done while the weights
+// are loaded.
+void PrepareOpenCLNetwork(const OptionsDict&) { OpenCL::get_gpu_ids(); }
+
 }  // namespace
 
 REGISTER_NETWORK("opencl", OpenCLNetwork, 100)
+REGISTER_NETWORK("opencl-fp16", OpenCLNetworkFp16, 95)
+REGISTER_NETWORK_PREPARE("opencl", PrepareOpenCLNetwork)
+REGISTER_NETWORK_PREPARE("opencl-fp16", PrepareOpenCLNetwork)
 
 }  // namespace lczero
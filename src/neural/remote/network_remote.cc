@@ -0,0 +1,292 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "neural/factory.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <thread>
+#include <unordered_map>
+
+#include "neural/remote/protocol.h"
+#include "utils/exception.h"
+#include "utils/mutex.h"
+#include "utils/socket.h"
+
+namespace lczero {
+namespace {
+
+using namespace remote;
+
+class RemoteNetwork;
+class RemoteComputation : public NetworkComputation {
+ public:
+  RemoteComputation(RemoteNetwork* network) : network_(network) {}
+
+  InputPlanesRef AddInputInPlace() override {
+    move_counts_.push_back(kAllMoves);
+    return planes_.Add();
+  }
+
+  InputPlanesRef AddInputForMoves(const uint16_t* move_ids,
+                                  int count) override {
+    move_counts_.push_back(count);
+    move_ids_.insert(move_ids_.end(), move_ids, move_ids + count);
+    return planes_.Add();
+  }
+
+  void SetPriority(int priority) override { priority_ = priority; }
+
+  void ComputeBlocking() override;
+
+  int GetBatchSize() const override { return planes_.GetSize(); }
+
+  float GetQVal(int sample) const override { return q_[sample]; }
+
+  float GetPVal(int sample, int move_id) const override {
+    const float* policy = &p_[p_offsets_[sample]];
+    if (move_counts_[sample] == kAllMoves) return policy[move_id];
+    const uint16_t* moves = &move_ids_[move_offsets_[sample]];
+    const uint16_t* end = moves + move_counts_[sample];
+    const uint16_t* iter = std::find(moves, end, move_id);
+    return iter == end ? 0.0f : policy[iter - moves];
+  }
+
+  void GetPVals(int sample, const uint16_t* move_ids, int count,
+                float* out) const override {
+    // Usually asked for the moves it was added with, in the same order.
+    if (move_counts_[sample] == count &&
+        std::equal(move_ids, move_ids + count,
+                   move_ids_.begin() + move_offsets_[sample])) {
+      std::copy_n(&p_[p_offsets_[sample]], count, out);
+      return;
+    }
+    for (int i = 0; i < count; ++i) out[i] = GetPVal(sample, move_ids[i]);
+  }
+
+ private:
+  friend class RemoteNetwork;
+
+  RemoteNetwork* const network_;
+  InputBatch planes_;
+  int priority_ = 1;
+  std::vector<uint16_t> move_counts_;
+  std::vector<uint16_t> move_ids_;
+  // Where moves and P values of a sample start, filled with the results.
+  std::vector<size_t> move_offsets_;
+  std::vector<size_t> p_offsets_;
+  std::vector<float> q_;
+  std::vector<float> p_;
+  // Set by the reader thread of the network under its mutex.
+  bool done_ = false;
+  bool failed_ = false;
+};
+
+// Sends batches to an "lc0 nnserver" over a persistent TCP connection. Any
+// number of requests (up to "pipeline") are in flight at once, so that the
+// round trip time is hidden when several threads search.
+class RemoteNetwork : public Network {
+ public:
+  RemoteNetwork(const WeightsPtr& weights, const OptionsDict& options)
+      : socket_(options.GetOrDefault<std::string>("host", "localhost"),
+                options.GetOrDefault<int>("port", kDefaultPort)),
+        max_in_flight_(
+            std::max(1, options.GetOrDefault<int>("pipeline", 8))) {
+    const Hello hello{kMagic, kProtocolVersion, HashWeights(*weights)};
+    socket_.Send(&hello, sizeof(hello));
+    HelloReply reply;
+    if (!socket_.Receive(&reply, sizeof(reply)) || reply.magic != kMagic) {
+      throw Exception("Remote backend: not an nnserver.");
+    }
+    if (reply.status == kBadVersion) {
+      throw Exception("Remote backend: protocol version mismatch.");
+    }
+    if (reply.status == kWeightsMismatch) {
+      throw Exception("Remote backend: server uses different weights.");
+    }
+    if (reply.status != kAccepted) {
+      throw Exception("Remote backend: connection refused.");
+    }
+    reader_ = std::thread([this]() { Reader(); });
+  }
+
+  ~RemoteNetwork() {
+    socket_.Shutdown();
+    reader_.join();
+  }
+
+  std::unique_ptr<NetworkComputation> NewComputation() override {
+    return std::make_unique<RemoteComputation>(this);
+  }
+
+  void Compute(RemoteComputation* computation) {
+    const int batch_size = computation->GetBatchSize();
+    if (batch_size == 0) return;
+    RequestHeader header{
+        0, static_cast<uint32_t>(batch_size),
+        static_cast<uint32_t>(computation->move_ids_.size()),
+        computation->priority_};
+    const size_t masks_size = batch_size * kInputPlanes * sizeof(uint64_t);
+    const size_t values_size = batch_size * kInputPlanes * sizeof(float);
+    const size_t counts_size = batch_size * sizeof(uint16_t);
+    const size_t moves_size =
+        computation->move_ids_.size() * sizeof(uint16_t);
+    std::vector<char> message(sizeof(header) + masks_size + values_size +
+                              counts_size + moves_size);
+    char* ptr = message.data() + sizeof(header);
+    std::memcpy(ptr, computation->planes_.GetMasks(0), masks_size);
+    ptr += masks_size;
+    std::memcpy(ptr, computation->planes_.GetValues(0), values_size);
+    ptr += values_size;
+    std::memcpy(ptr, computation->move_counts_.data(), counts_size);
+    ptr += counts_size;
+    std::memcpy(ptr, computation->move_ids_.data(), moves_size);
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [&]() {
+      return !error_.empty() ||
+             static_cast<int>(in_flight_.size()) < max_in_flight_;
+    });
+    if (!error_.empty()) throw Exception(error_);
+    const uint32_t id = next_id_++;
+    header.id = id;
+    std::memcpy(message.data(), &header, sizeof(header));
+    in_flight_[id] = computation;
+    {
+      // Sent without mutex_, so that the reader can go on meanwhile.
+      lock.unlock();
+      std::lock_guard<std::mutex> send_lock(send_mutex_);
+      try {
+        socket_.Send(message.data(), message.size());
+      } catch (const Exception& e) {
+        lock.lock();
+        in_flight_.erase(id);
+        SetError(e.what());
+        throw;
+      }
+      lock.lock();
+    }
+    cv_.wait(lock, [&]() { return computation->done_ || !error_.empty(); });
+    if (!computation->done_) {
+      in_flight_.erase(id);
+      throw Exception(error_);
+    }
+    if (computation->failed_) {
+      throw Exception("Remote backend: computation failed on the server.");
+    }
+  }
+
+ private:
+  void Reader() {
+    try {
+      ResponseHeader header;
+      while (socket_.Receive(&header, sizeof(header))) {
+        RemoteComputation* computation;
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          auto iter = in_flight_.find(header.id);
+          if (iter == in_flight_.end()) {
+            throw Exception("Remote backend: unexpected response.");
+          }
+          computation = iter->second;
+        }
+        // The computation waits until done_, so it's safe to fill it here.
+        if (header.status == 0) {
+          if (static_cast<int>(header.batch_size) !=
+              computation->GetBatchSize()) {
+            throw Exception("Remote backend: response of a wrong size.");
+          }
+          size_t moves = 0;
+          size_t p = 0;
+          for (const auto count : computation->move_counts_) {
+            computation->move_offsets_.push_back(moves);
+            computation->p_offsets_.push_back(p);
+            if (count == kAllMoves) {
+              p += kPolicySize;
+            } else {
+              moves += count;
+              p += count;
+            }
+          }
+          // Checked before anything is allocated for it.
+          if (p != header.policy_size) {
+            throw Exception("Remote backend: response of a wrong size.");
+          }
+          computation->q_.resize(header.batch_size);
+          computation->p_.resize(header.policy_size);
+          if (!socket_.Receive(computation->q_.data(),
+                               header.batch_size * sizeof(float)) ||
+              !socket_.Receive(computation->p_.data(),
+                               header.policy_size * sizeof(float))) {
+            throw Exception(
+                "Remote backend: connection closed in the middle of a "
+                "response.");
+          }
+        }
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          computation->done_ = true;
+          computation->failed_ = header.status != 0;
+          in_flight_.erase(header.id);
+        }
+        cv_.notify_all();
+      }
+      SetError("Remote backend: server closed the connection.");
+    } catch (const Exception& e) {
+      SetError(e.what());
+    }
+  }
+
+  void SetError(const std::string& error) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (error_.empty()) error_ = error;
+    }
+    cv_.notify_all();
+  }
+
+  Socket socket_;
+  const int max_in_flight_;
+  std::thread reader_;
+  std::mutex send_mutex_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  uint32_t next_id_ = 0;
+  std::unordered_map<uint32_t, RemoteComputation*> in_flight_;
+  // Set when the connection is broken, all computations fail after that.
+  std::string error_;
+};
+
+void RemoteComputation::ComputeBlocking() { network_->Compute(this); }
+
+}  // namespace
+
+REGISTER_NETWORK("remote", RemoteNetwork, -1000)
+
+}  // namespace lczero
@@ -0,0 +1,126 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "neural/network.h"
+
+namespace lczero {
+namespace remote {
+
+// Wire format of the "remote" backend and the nnserver mode. Messages are
+// sent as is, so both sides have to have the same byte order.
+
+const uint32_t kMagic = 0x5230434c;  // "LC0R"
+const uint32_t kProtocolVersion = 1;
+const int kDefaultPort = 9779;
+const int kPolicySize = 1858;
+// Move count of a sample which needs the whole policy.
+const uint16_t kAllMoves = 0xffff;
+
+// First message of the client.
+struct Hello {
+  uint32_t magic;
+  uint32_t version;
+  // HashWeights() of the client's weights, so that both sides are sure to
+  // use the same network.
+  uint64_t weights_hash;
+};
+
+enum HelloStatus : uint32_t { kAccepted, kBadVersion, kWeightsMismatch };
+
+// Reply of the server to Hello.
+struct HelloReply {
+  uint32_t magic;
+  uint32_t status;
+};
+
+// Request to compute a batch. Followed by
+//   uint64_t masks[batch_size * kInputPlanes];
+//   float values[batch_size * kInputPlanes];
+//   uint16_t move_counts[batch_size];  // kAllMoves for the whole policy.
+//   uint16_t move_ids[total_moves];    // Moves of all samples in order.
+// Requests of a connection may be answered in any order.
+struct RequestHeader {
+  uint32_t id;
+  uint32_t batch_size;
+  uint32_t total_moves;
+  int32_t priority;
+};
+
+// Response to request @id. Unless status is non-zero (the computation
+// failed), followed by
+//   float q[batch_size];
+//   float p[policy_size];  // P values of the requested moves of all samples
+//                          // in order, kPolicySize for kAllMoves.
+struct ResponseHeader {
+  uint32_t id;
+  uint32_t batch_size;
+  uint32_t policy_size;
+  uint32_t status;
+};
+
+// 64-bit FNV-1a of all weights of the network.
+inline uint64_t HashWeights(const Weights& weights) {
+  uint64_t hash = 14695981039346656037ULL;
+  const auto add = [&hash](const std::vector<float>& values) {
+    const auto* bytes = reinterpret_cast<const unsigned char*>(values.data());
+    for (size_t i = 0; i < values.size() * sizeof(float); ++i) {
+      hash ^= bytes[i];
+      hash *= 1099511628211ULL;
+    }
+    // Separates vectors, so that weights can't move between them.
+    hash ^= values.size();
+    hash *= 1099511628211ULL;
+  };
+  const auto add_block = [&add](const Weights::ConvBlock& block) {
+    add(block.weights);
+    add(block.biases);
+    add(block.bn_means);
+    add(block.bn_stddivs);
+  };
+  add_block(weights.input);
+  for (const auto& residual : weights.residual) {
+    add_block(residual.conv1);
+    add_block(residual.conv2);
+  }
+  add_block(weights.policy);
+  add(weights.ip_pol_w);
+  add(weights.ip_pol_b);
+  add_block(weights.value);
+  add(weights.ip1_val_w);
+  add(weights.ip1_val_b);
+  add(weights.ip2_val_w);
+  add(weights.ip2_val_b);
+  return hash;
+}
+
+}  // namespace remote
+}  // namespace lczero
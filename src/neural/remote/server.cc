@@ -0,0 +1,296 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "neural/remote/server.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <numeric>
+#include <thread>
+#include <vector>
+
+#include "neural/factory.h"
+#include "neural/loader.h"
+#include "neural/remote/protocol.h"
+#include "utils/exception.h"
+#include "utils/optionsparser.h"
+#include "utils/threadpool.h"
+
+namespace lczero {
+
+using namespace remote;
+
+namespace {
+const char* kWeightsStr = "Network weights file path";
+const char* kNnBackendStr = "NN backend to use";
+const char* kNnBackendOptionsStr = "NN backend parameters";
+const char* kPortStr = "TCP port to listen on";
+const char* kStatsIntervalStr = "Seconds between stats reports, 0 for none";
+const char* kAutoDiscover = "<autodiscover>";
+
+// Sanity limit of a request, to not allocate whatever a broken client asks.
+const uint32_t kMaxBatchSize = 65536;
+// Requests of a connection computed at once. Every one takes a pool thread
+// until it's answered, so when a client pipelines more, further requests are
+// not read until some are answered.
+const int kMaxRequestsInFlight = 32;
+}  // namespace
+
+void NNServer::Run() {
+  OptionsParser options;
+  options.Add<StringOption>(kWeightsStr, "weights", 'w') = kAutoDiscover;
+  const auto backends = NetworkFactory::Get()->GetBackendsList();
+  options.Add<ChoiceOption>(kNnBackendStr, backends, "backend") =
+      "multiplexing";
+  options.Add<StringOption>(kNnBackendOptionsStr, "backend-opts");
+  options.Add<IntOption>(kPortStr, 1, 65535, "port") = kDefaultPort;
+  options.Add<IntOption>(kStatsIntervalStr, 0, 86400, "stats-interval") = 60;
+  if (!options.ProcessAllFlags()) return;
+  const auto& dict = options.GetOptionsDict();
+
+  std::string path = dict.Get<std::string>(kWeightsStr);
+  if (path == kAutoDiscover) path = DiscoverWeightsFile();
+  const auto weights =
+      std::make_shared<const Weights>(LoadWeightsFromFile(path));
+  weights_hash_ = HashWeights(*weights);
+  network_ = NetworkFactory::Get()->Create(
+      dict.Get<std::string>(kNnBackendStr), weights,
+      OptionsDict::FromString(dict.Get<std::string>(kNnBackendOptionsStr),
+                              &dict));
+
+  ServerSocket server(dict.Get<int>(kPortStr));
+  std::cerr << "Serving on port " << dict.Get<int>(kPortStr) << "."
+            << std::endl;
+
+  const int stats_interval = dict.Get<int>(kStatsIntervalStr);
+  if (stats_interval > 0) {
+    std::thread([this, stats_interval]() {
+      while (true) {
+        std::this_thread::sleep_for(std::chrono::seconds(stats_interval));
+        ReportStats(stats_interval);
+      }
+    }).detach();
+  }
+
+  while (true) {
+    std::shared_ptr<Socket> socket = server.Accept();
+    std::thread([this, socket]() {
+      ++clients_;
+      try {
+        ServeConnection(socket);
+      } catch (const Exception& e) {
+        std::cerr << "Connection dropped: " << e.what() << std::endl;
+      }
+      --clients_;
+    }).detach();
+  }
+}
+
+void NNServer::ServeConnection(std::shared_ptr<Socket> socket) {
+  Hello hello;
+  if (!socket->Receive(&hello, sizeof(hello))) return;
+  HelloReply reply{kMagic, kAccepted};
+  if (hello.magic != kMagic || hello.version != kProtocolVersion) {
+    reply.status = kBadVersion;
+  } else if (hello.weights_hash != weights_hash_) {
+    reply.status = kWeightsMismatch;
+  }
+  socket->Send(&reply, sizeof(reply));
+  if (reply.status != kAccepted) return;
+
+  // Responses are sent from pool threads as computations finish.
+  struct Connection {
+    std::mutex send_mutex;
+    std::mutex mutex;
+    std::condition_variable cv;
+    int in_flight = 0;
+  };
+  auto connection = std::make_shared<Connection>();
+  RequestHeader header;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(connection->mutex);
+      connection->cv.wait(lock, [&connection]() {
+        return connection->in_flight < kMaxRequestsInFlight;
+      });
+    }
+    if (!socket->Receive(&header, sizeof(header))) break;
+    if (header.batch_size > kMaxBatchSize ||
+        header.total_moves > header.batch_size * kPolicySize) {
+      throw Exception("Request too large.");
+    }
+    const size_t planes = header.batch_size * kInputPlanes;
+    auto payload = std::make_shared<std::vector<char>>(
+        planes * (sizeof(uint64_t) + sizeof(float)) +
+        (header.batch_size + header.total_moves) * sizeof(uint16_t));
+    if (!socket->Receive(payload->data(), payload->size())) {
+      throw Exception("Connection closed in the middle of a message.");
+    }
+    const auto received_at = std::chrono::steady_clock::now();
+    const uint64_t* masks = reinterpret_cast<const uint64_t*>(payload->data());
+    const float* values = reinterpret_cast<const float*>(masks + planes);
+    const uint16_t* counts = reinterpret_cast<const uint16_t*>(values + planes);
+    // Move ids index the policy in the backends, so they are all checked.
+    size_t total_moves = 0;
+    for (uint32_t i = 0; i < header.batch_size; ++i) {
+      if (counts[i] == kAllMoves) continue;
+      if (counts[i] > kPolicySize) throw Exception("Malformed request.");
+      total_moves += counts[i];
+    }
+    if (total_moves != header.total_moves) {
+      throw Exception("Malformed request.");
+    }
+    const uint16_t* move_ids = counts + header.batch_size;
+    if (std::any_of(move_ids, move_ids + total_moves,
+                    [](uint16_t id) { return id >= kPolicySize; })) {
+      throw Exception("Malformed request.");
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(connection->mutex);
+      ++connection->in_flight;
+    }
+    ThreadPool::Get()->Run([this, socket, connection, header, payload, masks,
+                            values, counts, received_at]() {
+      static const std::vector<uint16_t> kAllMoveIds = []() {
+        std::vector<uint16_t> ids(kPolicySize);
+        std::iota(ids.begin(), ids.end(), 0);
+        return ids;
+      }();
+      const uint16_t* moves = counts + header.batch_size;
+      ResponseHeader response{header.id, header.batch_size, 0, 0};
+      std::vector<float> results;
+      try {
+        auto computation = network_->NewComputation();
+        computation->SetPriority(header.priority);
+        for (uint32_t i = 0; i < header.batch_size; ++i) {
+          InputPlanesRef input;
+          if (counts[i] == kAllMoves) {
+            input = computation->AddInputInPlace();
+            response.policy_size += kPolicySize;
+          } else {
+            input = computation->AddInputForMoves(moves, counts[i]);
+            moves += counts[i];
+            response.policy_size += counts[i];
+          }
+          std::memcpy(input.masks, masks + i * kInputPlanes,
+                      kInputPlanes * sizeof(uint64_t));
+          std::memcpy(input.values, values + i * kInputPlanes,
+                      kInputPlanes * sizeof(float));
+        }
+        computation->ComputeBlocking();
+
+        results.resize(header.batch_size + response.policy_size);
+        float* q = results.data();
+        float* p = q + header.batch_size;
+        moves = counts + header.batch_size;
+        for (uint32_t i = 0; i < header.batch_size; ++i) {
+          q[i] = computation->GetQVal(i);
+          if (counts[i] == kAllMoves) {
+            computation->GetPVals(i, kAllMoveIds.data(), kPolicySize, p);
+            p += kPolicySize;
+          } else {
+            computation->GetPVals(i, moves, counts[i], p);
+            moves += counts[i];
+            p += counts[i];
+          }
+        }
+      } catch (const std::exception& e) {
+        std::cerr << "Computation failed: " << e.what() << std::endl;
+        response.policy_size = 0;
+        response.status = 1;
+        results.clear();
+      }
+
+      // Sent as one message, as the socket doesn't delay small writes.
+      std::vector<char> message(sizeof(response) +
+                                results.size() * sizeof(float));
+      std::memcpy(message.data(), &response, sizeof(response));
+      if (!results.empty()) {
+        std::memcpy(message.data() + sizeof(response), results.data(),
+                    results.size() * sizeof(float));
+      }
+      bool sent = true;
+      {
+        std::lock_guard<std::mutex> lock(connection->send_mutex);
+        try {
+          socket->Send(message.data(), message.size());
+        } catch (const Exception&) {
+          // The client is gone.
+          sent = false;
+        }
+      }
+      if (sent) {
+        AddRequestStats(header.batch_size,
+                        std::chrono::duration<double>(
+                            std::chrono::steady_clock::now() - received_at)
+                            .count());
+      }
+      {
+        std::lock_guard<std::mutex> lock(connection->mutex);
+        --connection->in_flight;
+      }
+      connection->cv.notify_one();
+    });
+  }
+}
+
+void NNServer::AddRequestStats(int batch_size, double seconds) {
+  Mutex::Lock lock(stats_mutex_);
+  samples_ += batch_size;
+  latencies_.push_back(seconds);
+}
+
+void NNServer::ReportStats(double interval_seconds) {
+  int64_t samples;
+  std::vector<double> latencies;
+  {
+    Mutex::Lock lock(stats_mutex_);
+    samples = samples_;
+    samples_ = 0;
+    latencies.swap(latencies_);
+  }
+  std::sort(latencies.begin(), latencies.end());
+  const auto percentile_ms = [&latencies](double fraction) {
+    if (latencies.empty()) return 0.0;
+    return 1000.0 * latencies[static_cast<size_t>(
+                        fraction * (latencies.size() - 1))];
+  };
+  std::cerr << std::fixed << std::setprecision(1) << "clients "
+            << clients_.load() << ", requests/s "
+            << latencies.size() / interval_seconds << ", samples/s "
+            << samples / interval_seconds << ", latency ms p50 "
+            << percentile_ms(0.5) << " p99 " << percentile_ms(0.99)
+            << " max " << percentile_ms(1.0) << std::endl;
+}
+
+}  // namespace lczero
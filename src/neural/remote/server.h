@@ -0,0 +1,65 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "neural/network.h"
+#include "utils/mutex.h"
+#include "utils/socket.h"
+
+namespace lczero {
+
+// "nnserver" mode: computes batches sent by "remote" backends of other lc0
+// instances with a local backend ("multiplexing" by default, which batches
+// requests of all clients together).
+class NNServer {
+ public:
+  // Parses flags, loads the network and serves clients until killed.
+  void Run();
+
+ private:
+  void ServeConnection(std::shared_ptr<Socket> socket);
+  // Records a request of @batch_size samples served in @seconds.
+  void AddRequestStats(int batch_size, double seconds);
+  // Writes throughput and latency since the previous report to stderr.
+  void ReportStats(double interval_seconds);
+
+  std::unique_ptr<Network> network_;
+  uint64_t weights_hash_ = 0;
+
+  std::atomic<int> clients_{0};
+  Mutex stats_mutex_;
+  int64_t samples_ GUARDED_BY(stats_mutex_) = 0;
+  // Seconds from receiving a request to sending its response.
+  std::vector<double> latencies_ GUARDED_BY(stats_mutex_);
+};
+
+}  // namespace lczero
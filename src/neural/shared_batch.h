@@ -0,0 +1,169 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <memory>
+#include <utility>
+#include <vector>
+#include "neural/network.h"
+
+namespace lczero {
+
+class SharedBatchNetwork;
+
+// Inputs of all computations of a SharedBatchNetwork between two calls of
+// ComputeBatch() go into one computation of the wrapped network (one per
+// policy softmax temperature). Computations are filled one after another, so
+// that inputs of each are contiguous.
+class SharedBatchComputation : public NetworkComputation {
+ public:
+  explicit SharedBatchComputation(SharedBatchNetwork* network);
+
+  InputPlanesRef AddInputInPlace() override {
+    assert(batch_->GetBatchSize() == first_ + size_);
+    ++size_;
+    return batch_->AddInputInPlace();
+  }
+  InputPlanesRef AddInputForMoves(const std::uint16_t* move_ids,
+                                  int count) override {
+    assert(batch_->GetBatchSize() == first_ + size_);
+    ++size_;
+    return batch_->AddInputForMoves(move_ids, count);
+  }
+  // Moves the computation to the batch of @temp, so it has to be called
+  // before adding inputs and setting priority.
+  void SetPolicySoftmaxTemp(float temp) override;
+  void SetPriority(int priority) override { batch_->SetPriority(priority); }
+  // The batch is computed by SharedBatchNetwork::ComputeBatch().
+  void ComputeBlocking() override {}
+  int GetBatchSize() const override { return size_; }
+  float GetQVal(int sample) const override {
+    return batch_->GetQVal(first_ + sample);
+  }
+  float GetPVal(int sample, int move_id) const override {
+    return batch_->GetPVal(first_ + sample, move_id);
+  }
+  void GetPVals(int sample, const std::uint16_t* move_ids, int count,
+                float* out) const override {
+    batch_->GetPVals(first_ + sample, move_ids, count, out);
+  }
+
+ private:
+  SharedBatchNetwork* const network_;
+  std::shared_ptr<NetworkComputation> batch_;
+  int first_;
+  int size_ = 0;
+};
+
+// Wraps a network for the searches which one thread runs at once (games of
+// a multi-game selfplay worker, positions of analysis), so that all their
+// minibatches of a step are computed as one batch.
+class SharedBatchNetwork : public Network {
+ public:
+  explicit SharedBatchNetwork(std::shared_ptr<Network> network)
+      : network_(std::move(network)) {}
+
+  std::unique_ptr<NetworkComputation> NewComputation() override {
+    return std::make_unique<SharedBatchComputation>(this);
+  }
+  bool SupportsPolicySoftmaxTemp() const override {
+    return network_->SupportsPolicySoftmaxTemp();
+  }
+
+  // Returns the batch which computations of policy softmax temperature @temp
+  // go into, creating it if needed.
+  std::shared_ptr<NetworkComputation> GetBatch(float temp) {
+    for (const auto& batch : batches_) {
+      if (batch.first == temp) return batch.second;
+    }
+    batches_.emplace_back(temp, network_->NewComputation());
+    if (temp != 1.0f) batches_.back().second->SetPolicySoftmaxTemp(temp);
+    return batches_.back().second;
+  }
+
+  // Computes inputs added since the last call. Computations keep the results
+  // until they are destroyed, later ones go to new batches.
+  void ComputeBatch() {
+    for (const auto& batch : batches_) {
+      if (batch.second->GetBatchSize() != 0) batch.second->ComputeBlocking();
+    }
+    batches_.clear();
+  }
+
+  // Whether anything but this uses the wrapped network.
+  bool IsUsed() const { return network_.use_count() > 1; }
+  const Network* GetWrapped() const { return network_.get(); }
+
+ private:
+  const std::shared_ptr<Network> network_;
+  // Batches of the current step, by policy softmax temperature.
+  std::vector<std::pair<float, std::shared_ptr<NetworkComputation>>> batches_;
+};
+
+inline SharedBatchComputation::SharedBatchComputation(
+    SharedBatchNetwork* network)
+    : network_(network),
+      batch_(network->GetBatch(1.0f)),
+      first_(batch_->GetBatchSize()) {}
+
+inline void SharedBatchComputation::SetPolicySoftmaxTemp(float temp) {
+  assert(size_ == 0);
+  batch_ = network_->GetBatch(temp);
+  first_ = batch_->GetBatchSize();
+}
+
+// SharedBatchNetworks of all networks which searches of a thread use.
+class SharedBatchNetworks {
+ public:
+  Network* Get(const std::shared_ptr<Network>& network) {
+    for (const auto& shared : networks_) {
+      if (shared->GetWrapped() == network.get()) return shared.get();
+    }
+    networks_.push_back(std::make_unique<SharedBatchNetwork>(network));
+    return networks_.back().get();
+  }
+
+  // Computes batches of all networks, and drops the ones which were replaced
+  // and are not used by searches anymore.
+  void ComputeBatches() {
+    for (const auto& shared : networks_) shared->ComputeBatch();
+    networks_.erase(
+        std::remove_if(networks_.begin(), networks_.end(),
+                       [](const std::unique_ptr<SharedBatchNetwork>& shared) {
+                         return !shared->IsUsed();
+                       }),
+        networks_.end());
+  }
+
+ private:
+  std::vector<std::unique_ptr<SharedBatchNetwork>> networks_;
+};
+
+}  // namespace lczero
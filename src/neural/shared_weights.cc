@@ -0,0 +1,73 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "neural/shared_weights.h"
+
+#include <map>
+#include <utility>
+
+#include "utils/mutex.h"
+
+namespace lczero {
+
+namespace {
+struct Entry {
+  // To tell weights from later ones at the same address.
+  std::weak_ptr<const Weights> source;
+  std::weak_ptr<const void> transformed;
+};
+
+Mutex cache_mutex;
+std::map<std::pair<const Weights*, std::string>, Entry> cache
+    GUARDED_BY(cache_mutex);
+}  // namespace
+
+std::shared_ptr<const void> GetTransformedWeightsImpl(
+    const WeightsPtr& weights, const std::string& key,
+    const std::function<std::shared_ptr<const void>()>& transform) {
+  // Held while transforming, so that backends created in parallel don't
+  // transform the same weights twice.
+  Mutex::Lock lock(cache_mutex);
+  for (auto iter = cache.begin(); iter != cache.end();) {
+    if (iter->second.transformed.expired()) {
+      iter = cache.erase(iter);
+    } else {
+      ++iter;
+    }
+  }
+
+  auto& entry = cache[{weights.get(), key}];
+  if (entry.source.lock() == weights) {
+    if (auto transformed = entry.transformed.lock()) return transformed;
+  }
+  auto transformed = transform();
+  entry.source = weights;
+  entry.transformed = transformed;
+  return transformed;
+}
+
+}  // namespace lczero
@@ -0,0 +1,58 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+
+#include "neural/network.h"
+
+namespace lczero {
+
+// Type-erased GetTransformedWeights().
+std::shared_ptr<const void> GetTransformedWeightsImpl(
+    const WeightsPtr& weights, const std::string& key,
+    const std::function<std::shared_ptr<const void>()>& transform);
+
+// Returns the form of @weights which a backend computes with (e.g. with batch
+// norm folded and Winograd transformed), shared by all instances of the
+// backend on the same weights: @transform runs only if no network holds the
+// form of @key (which has to name the backend, the type and the parameters
+// of the transform) anymore.
+template <typename T>
+std::shared_ptr<const T> GetTransformedWeights(
+    const WeightsPtr& weights, const std::string& key,
+    const std::function<T(const Weights&)>& transform) {
+  return std::static_pointer_cast<const T>(GetTransformedWeightsImpl(
+      weights, key, [&]() -> std::shared_ptr<const void> {
+        return std::make_shared<const T>(transform(*weights));
+      }));
+}
+
+}  // namespace lczero
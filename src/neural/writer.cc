@@ -27,8 +27,11 @@
 
 #include "neural/writer.h"
 
+#include <cassert>
+#include <cstring>
 #include <iomanip>
 #include <sstream>
+#include "neural/cache.h"
 #include "utils/commandline.h"
 #include "utils/exception.h"
 #include "utils/filesystem.h"
@@ -36,7 +39,8 @@
 
 namespace lczero {
 
-TrainingDataWriter::TrainingDataWriter(int game_id) {
+namespace {
+std::string GameFileName(int game_id) {
   static std::string directory =
       CommandLine::BinaryDirectory() + "/data-" + Random::Get().GetString(12);
   // It's fine if it already exists.
@@ -45,16 +49,57 @@ TrainingDataWriter::TrainingDataWriter(int game_id) {
   std::ostringstream oss;
   oss << directory << '/' << "game_" << std::setfill('0') << std::setw(6)
       << game_id << ".gz";
+  return oss.str();
+}
+}  // namespace
+
+V3TrainingData SparseTrainingData::ToV3() const {
+  V3TrainingData result;
+  result.version = 3;
+  std::memset(result.probabilities, 0, sizeof(result.probabilities));
+  for (const auto& entry : probabilities) {
+    if (entry.index >= 1858) throw Exception("Invalid move index in data");
+    result.probabilities[entry.index] =
+        NNCache::DequantizeP(entry.probability);
+  }
+  std::memcpy(result.planes, header.planes, sizeof(result.planes));
+  result.castling_us_ooo = header.castling_us_ooo;
+  result.castling_us_oo = header.castling_us_oo;
+  result.castling_them_ooo = header.castling_them_ooo;
+  result.castling_them_oo = header.castling_them_oo;
+  result.side_to_move = header.side_to_move;
+  result.move_count = header.move_count;
+  result.rule50_count = header.rule50_count;
+  result.result = header.result;
+  return result;
+}
 
-  filename_ = oss.str();
-  fout_ = gzopen(filename_.c_str(), "wb");
+TrainingDataWriter::TrainingDataWriter(int game_id, int compression_level)
+    : TrainingDataWriter(GameFileName(game_id), compression_level) {}
+
+TrainingDataWriter::TrainingDataWriter(const std::string& filename,
+                                       int compression_level)
+    : filename_(filename) {
+  const std::string mode = "wb" + std::to_string(compression_level);
+  fout_ = gzopen(filename_.c_str(), mode.c_str());
   if (!fout_) throw Exception("Cannot create gzip file " + filename_);
 }
 
 void TrainingDataWriter::WriteChunk(const V3TrainingData& data) {
-  auto bytes_written =
-      gzwrite(fout_, reinterpret_cast<const char*>(&data), sizeof(data));
-  if (bytes_written != sizeof(data)) {
+  Write(&data, sizeof(data));
+}
+
+void TrainingDataWriter::WriteChunk(const SparseTrainingData& data) {
+  assert(data.header.num_probabilities == data.probabilities.size());
+  Write(&data.header, sizeof(data.header));
+  Write(data.probabilities.data(),
+        data.probabilities.size() * sizeof(data.probabilities[0]));
+}
+
+void TrainingDataWriter::Write(const void* data, size_t size) {
+  if (size == 0) return;
+  auto bytes_written = gzwrite(fout_, data, size);
+  if (bytes_written != static_cast<int>(size)) {
     throw Exception("Unable to write into " + filename_);
   }
 }
@@ -64,4 +109,137 @@ void TrainingDataWriter::Finalize() {
   fout_ = nullptr;
 }
 
+void ConvertTrainingDataToV3(const std::string& input,
+                             const std::string& output) {
+  gzFile fin = gzopen(input.c_str(), "rb");
+  if (!fin) throw Exception("Cannot open gzip file " + input);
+  // Closes the input on exceptions too.
+  std::unique_ptr<gzFile_s, int (*)(gzFile)> closer(fin, gzclose);
+  auto read = [&](void* data, size_t size) {
+    const int bytes_read = gzread(fin, data, size);
+    if (bytes_read == 0) return false;
+    if (bytes_read != static_cast<int>(size)) {
+      throw Exception("Truncated training data in " + input);
+    }
+    return true;
+  };
+
+  TrainingDataWriter writer(output, 6);
+  uint32_t version;
+  while (read(&version, sizeof(version))) {
+    if (version == 3) {
+      V3TrainingData chunk;
+      chunk.version = version;
+      read(reinterpret_cast<char*>(&chunk) + sizeof(version),
+           sizeof(chunk) - sizeof(version));
+      writer.WriteChunk(chunk);
+    } else if (version == kSparseTrainingDataVersion) {
+      SparseTrainingData chunk;
+      chunk.header.version = version;
+      read(reinterpret_cast<char*>(&chunk.header) + sizeof(version),
+           sizeof(chunk.header) - sizeof(version));
+      chunk.probabilities.resize(chunk.header.num_probabilities);
+      if (!chunk.probabilities.empty()) {
+        read(chunk.probabilities.data(),
+             chunk.probabilities.size() * sizeof(chunk.probabilities[0]));
+      }
+      writer.WriteChunk(chunk.ToV3());
+    } else {
+      throw Exception("Unknown training data version " +
+                      std::to_string(version) + " in " + input);
+    }
+  }
+  writer.Finalize();
+}
+
+AsyncTrainingDataWriter::AsyncTrainingDataWriter(int games_per_file,
+                                                 int compression_level,
+                                                 int max_queued_games)
+    : kGamesPerFile(games_per_file),
+      kCompressionLevel(compression_level),
+      kMaxQueuedGames(max_queued_games),
+      thread_([this]() { Worker(); }) {}
+
+AsyncTrainingDataWriter::~AsyncTrainingDataWriter() {
+  {
+    Mutex::Lock lock(mutex_);
+    stop_ = true;
+  }
+  queued_cv_.notify_one();
+  thread_.join();
+}
+
+void AsyncTrainingDataWriter::Write(int game_id,
+                                    std::vector<SparseTrainingData> chunks,
+                                    Callback callback) {
+  Enqueue({game_id, std::move(chunks), std::move(callback), false});
+}
+
+// Uses condition variable with the lock, which thread safety analysis doesn't
+// understand.
+void AsyncTrainingDataWriter::Flush() NO_THREAD_SAFETY_ANALYSIS {
+  Enqueue({-1, {}, nullptr, true});
+  std::unique_lock<std::mutex> lock(mutex_.get_raw());
+  const uint64_t entry = entries_queued_;
+  written_cv_.wait(lock, [&]() { return entries_written_ >= entry; });
+}
+
+void AsyncTrainingDataWriter::Enqueue(Entry entry) NO_THREAD_SAFETY_ANALYSIS {
+  {
+    std::unique_lock<std::mutex> lock(mutex_.get_raw());
+    written_cv_.wait(lock, [this]() {
+      return queue_.size() < kMaxQueuedGames;
+    });
+    queue_.push_back(std::move(entry));
+    ++entries_queued_;
+  }
+  queued_cv_.notify_one();
+}
+
+void AsyncTrainingDataWriter::Worker() NO_THREAD_SAFETY_ANALYSIS {
+  while (true) {
+    Entry entry;
+    {
+      std::unique_lock<std::mutex> lock(mutex_.get_raw());
+      queued_cv_.wait(lock, [this]() { return stop_ || !queue_.empty(); });
+      // Only exit when everything is written.
+      if (queue_.empty()) break;
+      entry = std::move(queue_.front());
+      queue_.pop_front();
+    }
+    // Make room in the queue for waiting Write()s.
+    written_cv_.notify_all();
+
+    if (!entry.close_file) {
+      if (!file_) {
+        file_ = std::make_unique<TrainingDataWriter>(entry.game_id,
+                                                     kCompressionLevel);
+      }
+      for (const auto& chunk : entry.chunks) file_->WriteChunk(chunk);
+      file_callbacks_.push_back(std::move(entry.callback));
+    }
+    if (file_ && (entry.close_file || ++games_in_file_ >= kGamesPerFile)) {
+      file_->Finalize();
+      const std::string filename = file_->GetFileName();
+      file_.reset();
+      games_in_file_ = 0;
+      for (const auto& callback : file_callbacks_) callback(filename);
+      file_callbacks_.clear();
+    }
+
+    {
+      Mutex::Lock lock(mutex_);
+      ++entries_written_;
+    }
+    written_cv_.notify_all();
+  }
+  // Close the last file, if it's incomplete.
+  if (file_) {
+    file_->Finalize();
+    for (const auto& callback : file_callbacks_) {
+      callback(file_->GetFileName());
+    }
+  }
+}
+
 }  // namespace lczero
@@ -26,8 +26,16 @@
 */
 
 #include <zlib.h>
+#include <condition_variable>
+#include <deque>
 #include <fstream>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
 #include "utils/cppattributes.h"
+#include "utils/mutex.h"
 
 #pragma once
 
@@ -50,13 +58,53 @@ struct V3TrainingData {
 } PACKED_STRUCT;
 static_assert(sizeof(V3TrainingData) == 8276, "Wrong struct size");
 
+// Fields of V3TrainingData without the policy. In sparse records it's followed
+// by num_probabilities SparseProbability entries.
+struct SparseTrainingHeader {
+  uint32_t version;
+  uint64_t planes[104];
+  uint8_t castling_us_ooo;
+  uint8_t castling_us_oo;
+  uint8_t castling_them_ooo;
+  uint8_t castling_them_oo;
+  uint8_t side_to_move;
+  uint8_t move_count;
+  uint8_t rule50_count;
+  int8_t result;
+  uint16_t num_probabilities;
+} PACKED_STRUCT;
+static_assert(sizeof(SparseTrainingHeader) == 846, "Wrong struct size");
+
+// Probability of the move with the NN index @index. Stored as a 16-bit float
+// (see NNCache::QuantizeP()).
+struct SparseProbability {
+  uint16_t index;
+  uint16_t probability;
+} PACKED_STRUCT;
+
 #pragma pack(pop)
 
+// Version of the sparse records, which can be mixed with V3 ones in a file.
+constexpr uint32_t kSparseTrainingDataVersion = 0x103;
+
+// Training data of a position with the probabilities of visited moves only.
+// It's about a tenth of the size of V3TrainingData.
+struct SparseTrainingData {
+  SparseTrainingHeader header;
+  std::vector<SparseProbability> probabilities;
+
+  // Converts to the V3 format, with zero probabilities of unvisited moves.
+  V3TrainingData ToV3() const;
+};
+
 class TrainingDataWriter {
  public:
   // Creates a new file to write in data directory. It will has @game_id
-  // somewhere in the filename.
-  TrainingDataWriter(int game_id);
+  // somewhere in the filename. @compression_level is the gzip level, from 0
+  // (stored) to 9.
+  TrainingDataWriter(int game_id, int compression_level = 6);
+  // Creates file @filename.
+  TrainingDataWriter(const std::string& filename, int compression_level);
 
   ~TrainingDataWriter() {
     if (fout_) Finalize();
@@ -64,6 +112,7 @@ class TrainingDataWriter {
 
   // Writes a chunk.
   void WriteChunk(const V3TrainingData& data);
+  void WriteChunk(const SparseTrainingData& data);
 
   // Flushes file and closes it.
   void Finalize();
@@ -72,8 +121,75 @@ class TrainingDataWriter {
   std::string GetFileName() const { return filename_; }
 
  private:
+  void Write(const void* data, size_t size);
+
   std::string filename_;
   gzFile fout_;
 };
 
+// Converts a training data file of sparse (or V3) records into V3 records, for
+// pipelines which read V3 only.
+void ConvertTrainingDataToV3(const std::string& input,
+                             const std::string& output);
+
+// Writes training data of finished games from a thread of its own, so that
+// game threads don't wait for compression and disk. Games are appended to the
+// current file until it has @games_per_file of them, then the file is closed
+// and the next game starts a new one.
+class AsyncTrainingDataWriter {
+ public:
+  // Called with the name of the file the game was written to, from the writer
+  // thread, once that file is complete.
+  using Callback = std::function<void(const std::string& filename)>;
+
+  // At most @max_queued_games are kept in memory, after that Write() waits
+  // for the writer thread to catch up.
+  AsyncTrainingDataWriter(int games_per_file, int compression_level,
+                          int max_queued_games = 256);
+  // Writes all queued games and closes the file.
+  ~AsyncTrainingDataWriter();
+
+  // Queues @chunks of game @game_id to be written.
+  void Write(int game_id, std::vector<SparseTrainingData> chunks,
+             Callback callback);
+
+  // Waits until all games queued so far are written, and closes the current
+  // file even if it has less than games_per_file games.
+  void Flush();
+
+ private:
+  struct Entry {
+    int game_id;
+    std::vector<SparseTrainingData> chunks;
+    Callback callback;
+    // Entry queued by Flush(), closes the file.
+    bool close_file;
+  };
+
+  void Enqueue(Entry entry);
+  void Worker();
+
+  const int kGamesPerFile;
+  const int kCompressionLevel;
+  const size_t kMaxQueuedGames;
+
+  Mutex mutex_{"training writer"};
+  // Signalled when an entry is queued, or on stop.
+  std::condition_variable queued_cv_;
+  // Signalled when an entry is taken from the queue or written.
+  std::condition_variable written_cv_;
+  std::deque<Entry> queue_ GUARDED_BY(mutex_);
+  // Entries ever queued and written, to let Flush() know when it's done.
+  uint64_t entries_queued_ GUARDED_BY(mutex_) = 0;
+  uint64_t entries_written_ GUARDED_BY(mutex_) = 0;
+  bool stop_ GUARDED_BY(mutex_) = false;
+
+  // Owned by the writer thread.
+  std::unique_ptr<TrainingDataWriter> file_;
+  int games_in_file_ = 0;
+  std::vector<Callback> file_callbacks_;
+
+  std::thread thread_;
+};
+
 }  // namespace lczero
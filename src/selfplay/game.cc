@@ -29,18 +29,25 @@
 #include <algorithm>
 
 #include "neural/writer.h"
+#include "utils/random.h"
 
 namespace lczero {
 
 namespace {
 const char* kReuseTreeStr = "Reuse the node statistics between moves";
 const char* kResignPercentageStr = "Resign when win percentage drops below n";
+const char* kFullSearchFractionStr = "Fraction of moves with full search";
+const char* kReducedVisitsStr = "Visits per move for reduced search";
 }  // namespace
 
 void SelfPlayGame::PopulateUciParams(OptionsParser* options) {
   options->Add<BoolOption>(kReuseTreeStr, "reuse-tree") = false;
   options->Add<FloatOption>(kResignPercentageStr, 0.0f, 100.0f,
                             "resign-percentage", 'r') = 0.0f;
+  options->Add<FloatOption>(kFullSearchFractionStr, 0.0f, 1.0f,
+                            "full-search-fraction") = 1.0f;
+  options->Add<IntOption>(kReducedVisitsStr, 1, 999999999, "reduced-visits") =
+      100;
 }
 
 SelfPlayGame::SelfPlayGame(PlayerOptions player1, PlayerOptions player2,
@@ -59,56 +66,109 @@ SelfPlayGame::SelfPlayGame(PlayerOptions player1, PlayerOptions player2,
 
 void SelfPlayGame::Play(int white_threads, int black_threads,
                         bool enable_resign) {
-  bool blacks_move = false;
-
   // Do moves while not end of the game. (And while not abort_)
-  while (!abort_) {
-    game_result_ = tree_[0]->GetPositionHistory().ComputeGameResult();
+  while (StartMove()) {
+    search_->RunBlocking(blacks_move_ ? black_threads : white_threads);
+    if (!FinishMove(enable_resign)) break;
+  }
+}
 
-    // If endgame, stop.
-    if (game_result_ != GameResult::UNDECIDED) break;
+bool SelfPlayGame::StartMove() {
+  if (abort_) return false;
+  game_result_ = tree_[0]->GetPositionHistory().ComputeGameResult();
 
-    // Initialize search.
-    const int idx = blacks_move ? 1 : 0;
-    if (!options_[idx].uci_options->Get<bool>(kReuseTreeStr)) {
-      tree_[idx]->TrimTreeAtHead();
-    }
-    {
-      std::lock_guard<std::mutex> lock(mutex_);
-      if (abort_) break;
-      search_ = std::make_unique<Search>(
-          *tree_[idx], options_[idx].network, options_[idx].best_move_callback,
-          options_[idx].info_callback, options_[idx].search_limits,
-          *options_[idx].uci_options, options_[idx].cache);
+  // If endgame, stop.
+  if (game_result_ != GameResult::UNDECIDED) return false;
+
+  // Positions in tablebases are adjudicated.
+  const int idx = blacks_move_ ? 1 : 0;
+  game_result_ = ProbeGameResult(options_[idx].syzygy_tb);
+  if (game_result_ != GameResult::UNDECIDED) return false;
+
+  // Initialize search.
+  if (!options_[idx].uci_options->Get<bool>(kReuseTreeStr)) {
+    tree_[idx]->TrimTreeAtHead();
+  }
+  // Only a fraction of moves get the full budget, others are searched with
+  // a small visits cap just to play the game on.
+  const float full_search_fraction =
+      options_[idx].uci_options->Get<float>(kFullSearchFractionStr);
+  full_search_ = full_search_fraction >= 1.0f ||
+                 Random::Get().GetFloat(1.0f) < full_search_fraction;
+  SearchLimits limits = options_[idx].search_limits;
+  if (!full_search_) {
+    const int reduced_visits =
+        options_[idx].uci_options->Get<int>(kReducedVisitsStr);
+    if (limits.visits < 0 || limits.visits > reduced_visits) {
+      limits.visits = reduced_visits;
     }
+    limits.playouts = -1;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (abort_) return false;
+  search_ = std::make_unique<Search>(
+      *tree_[idx], options_[idx].network, options_[idx].best_move_callback,
+      options_[idx].info_callback, limits, *options_[idx].uci_options,
+      options_[idx].cache, options_[idx].syzygy_tb,
+      options_[idx].cache_generation);
+  return true;
+}
 
-    // Do search.
-    search_->RunBlocking(blacks_move ? black_threads : white_threads);
-    if (abort_) break;
+bool SelfPlayGame::FinishMove(bool enable_resign) {
+  if (abort_) return false;
+  const int idx = blacks_move_ ? 1 : 0;
 
-    // Append training data. The GameResult is later overwritten.
-    training_data_.push_back(tree_[idx]->GetCurrentHead()->GetV3TrainingData(
+  // Append training data, only for fully searched moves. The GameResult is
+  // later overwritten.
+  if (full_search_) {
+    training_data_.push_back(tree_[idx]->GetCurrentHead()->GetTrainingData(
         GameResult::UNDECIDED, tree_[idx]->GetPositionHistory()));
+  }
 
-    float eval = search_->GetBestEval();
-    eval = (eval + 1) / 2;
-    if (eval < min_eval_[idx]) min_eval_[idx] = eval;
-    if (enable_resign) {
-      const float resignpct =
-          options_[idx].uci_options->Get<float>(kResignPercentageStr) / 100;
-      if (eval < resignpct) {  // always false when resignpct == 0
-        game_result_ =
-            blacks_move ? GameResult::WHITE_WON : GameResult::BLACK_WON;
-        break;
-      }
+  float eval = search_->GetBestEval();
+  eval = (eval + 1) / 2;
+  if (eval < min_eval_[idx]) min_eval_[idx] = eval;
+  if (enable_resign) {
+    const float resignpct =
+        options_[idx].uci_options->Get<float>(kResignPercentageStr) / 100;
+    if (eval < resignpct) {  // always false when resignpct == 0
+      game_result_ =
+          blacks_move_ ? GameResult::WHITE_WON : GameResult::BLACK_WON;
+      return false;
     }
+  }
 
-    // Add best move to the tree.
-    Move move = search_->GetBestMove().first;
-    tree_[0]->MakeMove(move);
-    if (tree_[0] != tree_[1]) tree_[1]->MakeMove(move);
-    blacks_move = !blacks_move;
+  // Add best move to the tree.
+  Move move = search_->GetBestMove().first;
+  tree_[0]->MakeMove(move);
+  if (tree_[0] != tree_[1]) tree_[1]->MakeMove(move);
+  blacks_move_ = !blacks_move_;
+  return true;
+}
+
+GameResult SelfPlayGame::ProbeGameResult(SyzygyTablebase* syzygy_tb) const {
+  if (!syzygy_tb) return GameResult::UNDECIDED;
+  const Position& position = tree_[0]->GetPositionHistory().Last();
+  const ChessBoard& board = position.GetBoard();
+  if (!syzygy_tb->CanProbe(board)) return GameResult::UNDECIDED;
+  ProbeState state;
+  // Score for the side to move: 1 win, -1 loss, 0 draw.
+  int score;
+  const int rule50_ply = position.GetNoCapturePly();
+  if (rule50_ply == 0) {
+    const WdlScore wdl = syzygy_tb->ProbeWdl(board, &state);
+    score = wdl == WdlScore::kWin ? 1 : wdl == WdlScore::kLoss ? -1 : 0;
+  } else {
+    // Whether the result is reached depends on the 50-move counter.
+    const int dtz = syzygy_tb->ProbeDtz(board, &state);
+    score = dtz > 0 && dtz + rule50_ply <= 100    ? 1
+            : dtz < 0 && -dtz + rule50_ply <= 100 ? -1
+                                                  : 0;
   }
+  if (state == ProbeState::kFail) return GameResult::UNDECIDED;
+  if (score == 0) return GameResult::DRAW;
+  return (score > 0) == blacks_move_ ? GameResult::BLACK_WON
+                                     : GameResult::WHITE_WON;
 }
 
 std::vector<Move> SelfPlayGame::GetMoves() const {
@@ -135,20 +195,20 @@ void SelfPlayGame::Abort() {
   if (search_) search_->Abort();
 }
 
-void SelfPlayGame::WriteTrainingData(TrainingDataWriter* writer) const {
-  bool black_to_move =
-      tree_[0]->GetPositionHistory().Starting().IsBlackToMove();
-  for (auto chunk : training_data_) {
+std::vector<SparseTrainingData> SelfPlayGame::GetTrainingData() const {
+  std::vector<SparseTrainingData> result = training_data_;
+  for (auto& chunk : result) {
+    // Not every move has a chunk, so the side to move is taken from the chunk.
+    const bool black_to_move = chunk.header.side_to_move;
     if (game_result_ == GameResult::WHITE_WON) {
-      chunk.result = black_to_move ? -1 : 1;
+      chunk.header.result = black_to_move ? -1 : 1;
     } else if (game_result_ == GameResult::BLACK_WON) {
-      chunk.result = black_to_move ? 1 : -1;
+      chunk.header.result = black_to_move ? 1 : -1;
     } else {
-      chunk.result = 0;
+      chunk.header.result = 0;
     }
-    writer->WriteChunk(chunk);
-    black_to_move = !black_to_move;
   }
+  return result;
 }
 
 }  // namespace lczero
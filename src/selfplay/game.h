@@ -45,6 +45,10 @@ struct PlayerOptions {
   ThinkingInfo::Callback info_callback;
   // NNcache to use.
   NNCache* cache;
+  // Generation of the network's entries in the cache.
+  uint32_t cache_generation = 0;
+  // Tablebases to search and adjudicate games with, if not null.
+  SyzygyTablebase* syzygy_tb = nullptr;
   // User options dictionary.
   const OptionsDict* uci_options;
   // Limits to use for every move.
@@ -65,12 +69,22 @@ class SelfPlayGame {
 
   // Starts the game and blocks until the game is finished.
   void Play(int white_threads, int black_threads, bool enable_resign=true);
+
+  // Play() one move at a time, for callers which run the searches themselves:
+  // Creates the search of the next move. Returns false if the game is over or
+  // aborted.
+  bool StartMove();
+  // Returns the search created by StartMove().
+  Search* GetSearch() const { return search_.get(); }
+  // Once the search is done, makes the move it found. Returns false if the
+  // game is over or aborted.
+  bool FinishMove(bool enable_resign);
   // Aborts the game currently played, doesn't matter if it's synchronous or
   // not.
   void Abort();
 
-  // Writes training data to a file.
-  void WriteTrainingData(TrainingDataWriter* writer) const;
+  // Returns training data of the game, with the game result filled in.
+  std::vector<SparseTrainingData> GetTrainingData() const;
 
   GameResult GetGameResult() const { return game_result_; }
   std::vector<Move> GetMoves() const;
@@ -79,6 +93,10 @@ class SelfPlayGame {
   float GetWorstEvalForWinnerOrDraw() const;
 
  private:
+  // Returns result of the current position from @syzygy_tb, UNDECIDED if
+  // it's not in the tablebases (or @syzygy_tb is null).
+  GameResult ProbeGameResult(SyzygyTablebase* syzygy_tb) const;
+
   // options_[0] is for white player, [1] for black.
   PlayerOptions options_[2];
   // Node tree for player1 and player2. If the tree is shared between players,
@@ -89,6 +107,9 @@ class SelfPlayGame {
   // can stop it.
   std::unique_ptr<Search> search_;
   bool abort_ = false;
+  bool blacks_move_ = false;
+  // Whether the move being searched gets the full budget.
+  bool full_search_ = true;
   GameResult game_result_ = GameResult::UNDECIDED;
   // Track minimum eval for each player so that GetWorstEvalForWinnerOrDraw()
   // can be calculated after end of game.
@@ -96,7 +117,7 @@ class SelfPlayGame {
   std::mutex mutex_;
 
   // Training data to send.
-  std::vector<V3TrainingData> training_data_;
+  std::vector<SparseTrainingData> training_data_;
 };
 
 }  // namespace lczero
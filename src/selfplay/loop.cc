@@ -28,11 +28,18 @@
 #include "selfplay/loop.h"
 #include "selfplay/tournament.h"
 #include "utils/configfile.h"
+#include "utils/numa.h"
+#include "utils/trace.h"
 
 namespace lczero {
 
 namespace {
 const char* kInteractive = "Run in interactive mode with uci-like interface";
+const char* kMetricsPortStr = "Port to serve metrics on in Prometheus format";
+const char* kMetricsFileStr = "File to append metrics to as JSON lines";
+const char* kMetricsIntervalStr = "Seconds between metrics written to file";
+const char* kTraceFileStr = "File to write a timeline trace of threads to";
+const char* kNumaStr = "Binding of threads to NUMA nodes";
 }  // namespace
 
 SelfPlayLoop::SelfPlayLoop() {}
@@ -44,9 +51,28 @@ SelfPlayLoop::~SelfPlayLoop() {
 
 void SelfPlayLoop::RunLoop() {
   options_.Add<BoolOption>(kInteractive, "interactive") = false;
+  options_.Add<IntOption>(kMetricsPortStr, 0, 65535, "metrics-port") = 0;
+  options_.Add<StringOption>(kMetricsFileStr, "metrics-file");
+  options_.Add<IntOption>(kMetricsIntervalStr, 1, 86400, "metrics-interval") =
+      60;
+  options_.Add<StringOption>(kTraceFileStr, "trace-file");
+  options_.Add<ChoiceOption>(kNumaStr, Numa::GetBindingChoices(), "numa") =
+      "none";
   SelfPlayTournament::PopulateOptions(&options_);
 
   if (!options_.ProcessAllFlags()) return;
+  const auto& options = options_.GetOptionsDict();
+  // The trace is written at exit.
+  Tracer::Get().SetFile(options.Get<std::string>(kTraceFileStr));
+  // Threads and caches of the tournament are placed as they are created.
+  Numa::SetBinding(options.Get<std::string>(kNumaStr));
+  if (options.Get<int>(kMetricsPortStr) != 0 ||
+      !options.Get<std::string>(kMetricsFileStr).empty()) {
+    metrics_exporter_ = std::make_unique<MetricsExporter>(
+        options.Get<int>(kMetricsPortStr),
+        options.Get<std::string>(kMetricsFileStr),
+        options.Get<int>(kMetricsIntervalStr));
+  }
   if (options_.GetOptionsDict().Get<bool>(kInteractive)) {
     UciLoop::RunLoop();
   } else {
@@ -120,6 +146,8 @@ void SelfPlayLoop::CmdSetOption(const std::string& name,
                                 const std::string& value,
                                 const std::string& context) {
   options_.SetOption(name, value, context);
+  // New networks are picked up without restarting the tournament.
+  if (tournament_) tournament_->ReloadNetworks(options_.GetOptionsDict());
 }
 
 void SelfPlayLoop::SendTournament(const TournamentInfo& info) {
@@ -131,6 +159,18 @@ void SelfPlayLoop::SendTournament(const TournamentInfo& info) {
          std::to_string(info.results[2][1]);
   res += " draw " + std::to_string(info.results[1][0]) + " " +
          std::to_string(info.results[1][1]);
+  res += " parallelism " + std::to_string(info.parallelism);
+  if (info.finished) {
+    for (int i = 0; i < 2; ++i) {
+      const auto& stats = info.cache_stats[i];
+      res += " cache" + std::to_string(i + 1) + " lookups " +
+             std::to_string(stats.lookups) + " hits " +
+             std::to_string(stats.hits) + " evictions " +
+             std::to_string(stats.evictions) + " size " +
+             std::to_string(stats.size) + " capacity " +
+             std::to_string(stats.capacity);
+    }
+  }
   SendResponse(res);
 }
 
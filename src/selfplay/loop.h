@@ -30,6 +30,7 @@
 #include <thread>
 #include "chess/uciloop.h"
 #include "selfplay/tournament.h"
+#include "utils/metrics.h"
 #include "utils/optionsparser.h"
 
 namespace lczero {
@@ -52,6 +53,8 @@ class SelfPlayLoop : public UciLoop {
   void EnsureOptionsSent();
   OptionsParser options_;
 
+  // Exports metrics while the loop runs, if enabled.
+  std::unique_ptr<MetricsExporter> metrics_exporter_;
   std::unique_ptr<SelfPlayTournament> tournament_;
   std::unique_ptr<std::thread> thread_;
 };
@@ -26,12 +26,23 @@
 */
 
 #include "selfplay/tournament.h"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <future>
+#include <iostream>
+
 #include "mcts/search.h"
 #include "neural/factory.h"
 #include "neural/loader.h"
+#include "neural/shared_batch.h"
 #include "selfplay/game.h"
+#include "utils/metrics.h"
+#include "utils/numa.h"
 #include "utils/optionsparser.h"
 #include "utils/random.h"
+#include "utils/trace.h"
 
 namespace lczero {
 
@@ -39,22 +50,126 @@ namespace {
 const char* kShareTreesStr = "Share game trees for two players";
 const char* kTotalGamesStr = "Number of games to play";
 const char* kParallelGamesStr = "Number of games to play in parallel";
+const char* kGamesPerThreadStr = "Number of games searched by every thread";
+const char* kMinParallelGamesStr =
+    "Minimum number of games to play in parallel";
+const char* kMaxParallelGamesStr =
+    "Maximum number of games to play in parallel";
 const char* kThreadsStr = "Number of CPU threads for every game";
 const char* kNnCacheSizeStr = "NNCache size";
+const char* kNnCacheSizeMbStr = "NNCache size, MB";
+const char* kNnCacheSharedStr = "NNCache shared memory name";
+const char* kNnCacheFileStr = "Persistent NNCache file";
+const char* kNnCacheFileReadOnlyStr = "Don't write to persistent NNCache file";
 const char* kNetFileStr = "Network weights file path";
 const char* kPlayoutsStr = "Number of playouts per move to search";
 const char* kVisitsStr = "Number of visits per move to search";
 const char* kTimeMsStr = "Time per move, in milliseconds";
 const char* kTrainingStr = "Write training data";
+const char* kTrainingGamesPerFileStr =
+    "Number of games in every training data file";
+const char* kTrainingCompressionStr = "Training data compression level";
 const char* kNnBackendStr = "NN backend to use";
 const char* kNnBackendOptionsStr = "NN backend parameters";
 const char* kVerboseThinkingStr = "Show verbose thinking messages";
+const char* kSyzygyTablebaseStr = "List of Syzygy tablebase directories";
 const char* kResignPlaythroughStr =
               "The percentage of games which ignore resign";
+const char* kSeedStr = "Seed of the random choices of games, 0 for random";
+const char* kOpeningCachePliesStr =
+    "Plies of openings evaluated into NNCache upfront";
 
 // Value for network autodiscover.
 const char* kAutoDiscover = "<autodiscover>";
 
+const char* kPlayerNames[2] = {"player1", "player2"};
+
+// How often parallelism is adjusted to the load of the backend meanwhile.
+const auto kParallelismInterval = std::chrono::seconds(5);
+// A backend busy for a smaller fraction of the time waits for searches, and
+// one which computes batches less full than this could compute more samples
+// at little extra cost, so more games are played in parallel.
+const double kMinBusyFraction = 0.9;
+const double kMinBatchFill = 0.5;
+// When batches of a busy backend are this full, computations queue up, and
+// fewer games are played in parallel.
+const double kMaxBatchFill = 0.95;
+
+// Options which networks are created from, to tell when they change.
+std::string GetNetworkSettings(const OptionsDict& options) {
+  std::string result;
+  for (const char* player : kPlayerNames) {
+    for (const auto& option_str :
+         {kNetFileStr, kNnBackendStr, kNnBackendOptionsStr}) {
+      result += options.GetSubdict(player).Get<std::string>(option_str);
+      result += '\n';
+    }
+  }
+  return result;
+}
+
+// Creates and warms up networks of both players, or one network for both if
+// their settings are the same.
+void CreateNetworks(const OptionsDict& options,
+                    std::shared_ptr<Network> networks[2]) {
+  // Players with the same weights file but different backends or options
+  // still share one load of it.
+  std::string loaded_path;
+  WeightsPtr weights;
+  for (int idx : {0, 1}) {
+    // If two players have the same network, no need to load two.
+    if (idx == 1) {
+      bool network_identical = true;
+      for (const auto& option_str :
+           {kNetFileStr, kNnBackendStr, kNnBackendOptionsStr}) {
+        if (options.GetSubdict("player1").Get<std::string>(option_str) !=
+            options.GetSubdict("player2").Get<std::string>(option_str)) {
+          network_identical = false;
+          break;
+        }
+      }
+      if (network_identical) {
+        networks[1] = networks[0];
+        break;
+      }
+    }
+
+    std::string backend =
+        options.GetSubdict(kPlayerNames[idx]).Get<std::string>(kNnBackendStr);
+    std::string backend_options = options.GetSubdict(kPlayerNames[idx])
+                                      .Get<std::string>(kNnBackendOptionsStr);
+
+    OptionsDict network_options = OptionsDict::FromString(
+        backend_options, &options.GetSubdict(kPlayerNames[idx]));
+
+    networks[idx] = NetworkFactory::Get()->LoadAndCreate(
+        backend,
+        [&]() {
+          std::string path = options.GetSubdict(kPlayerNames[idx])
+                                 .Get<std::string>(kNetFileStr);
+          if (path == kAutoDiscover) {
+            path = DiscoverWeightsFile();
+          }
+          if (!weights || path != loaded_path) {
+            weights =
+                std::make_shared<const Weights>(LoadWeightsFromFile(path));
+            loaded_path = path;
+          }
+          return weights;
+        },
+        network_options);
+
+    const auto start = std::chrono::steady_clock::now();
+    networks[idx]->Warmup(options.GetSubdict(kPlayerNames[idx])
+                              .Get<int>(Search::kMiniBatchSizeStr));
+    const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+    std::cerr << "Backend warm-up of " << kPlayerNames[idx] << " took " << ms
+              << "ms." << std::endl;
+  }
+}
+
 }  // namespace
 
 void SelfPlayTournament::PopulateOptions(OptionsParser* options) {
@@ -64,20 +179,41 @@ void SelfPlayTournament::PopulateOptions(OptionsParser* options) {
   options->Add<BoolOption>(kShareTreesStr, "share-trees") = true;
   options->Add<IntOption>(kTotalGamesStr, -1, 999999, "games") = -1;
   options->Add<IntOption>(kParallelGamesStr, 1, 256, "parallelism") = 8;
+  options->Add<IntOption>(kGamesPerThreadStr, 0, 65536, "games-per-thread") =
+      0;
+  // Unless both are 0, parallelism is adjusted within these limits (0 is the
+  // value of --parallelism) to keep a multiplexing backend busy.
+  options->Add<IntOption>(kMinParallelGamesStr, 0, 256, "min-parallelism") =
+      0;
+  options->Add<IntOption>(kMaxParallelGamesStr, 0, 256, "max-parallelism") =
+      0;
   options->Add<IntOption>(kThreadsStr, 1, 8, "threads", 't') = 1;
   options->Add<IntOption>(kNnCacheSizeStr, 0, 999999999, "nncache") = 200000;
+  options->Add<IntOption>(kNnCacheSizeMbStr, 0, 1048576, "nncache-mb") = 0;
+  options->Add<StringOption>(kNnCacheSharedStr, "nncache-shared");
+  options->Add<StringOption>(kNnCacheFileStr, "nncache-file");
+  options->Add<BoolOption>(kNnCacheFileReadOnlyStr, "nncache-file-readonly") =
+      false;
   options->Add<StringOption>(kNetFileStr, "weights", 'w') = kAutoDiscover;
   options->Add<IntOption>(kPlayoutsStr, -1, 999999999, "playouts", 'p') = -1;
   options->Add<IntOption>(kVisitsStr, -1, 999999999, "visits", 'v') = -1;
   options->Add<IntOption>(kTimeMsStr, -1, 999999999, "movetime") = -1;
   options->Add<BoolOption>(kTrainingStr, "training") = false;
+  options->Add<IntOption>(kTrainingGamesPerFileStr, 1, 100000,
+                          "training-games-per-file") = 1;
+  options->Add<IntOption>(kTrainingCompressionStr, 0, 9,
+                          "training-compression") = 6;
   const auto backends = NetworkFactory::Get()->GetBackendsList();
   options->Add<ChoiceOption>(kNnBackendStr, backends, "backend") =
       "multiplexing";
   options->Add<StringOption>(kNnBackendOptionsStr, "backend-opts");
   options->Add<BoolOption>(kVerboseThinkingStr, "verbose-thinking") = false;
+  options->Add<StringOption>(kSyzygyTablebaseStr, "syzygy-paths", 's');
   options->Add<FloatOption>(kResignPlaythroughStr, 0.0f, 100.0f,
                             "resign-playthrough") = 0.0f;
+  options->Add<IntOption>(kSeedStr, 0, 999999999, "seed") = 0;
+  options->Add<IntOption>(kOpeningCachePliesStr, 0, 4,
+                          "opening-cache-plies") = 0;
 
   Search::PopulateUciParams(options);
   SelfPlayGame::PopulateUciParams(options);
@@ -87,6 +223,7 @@ void SelfPlayTournament::PopulateOptions(OptionsParser* options) {
   defaults->Set<float>(Search::kTemperatureStr, 1.0f);    // Temperature = 1.0
   defaults->Set<bool>(Search::kNoiseStr, true);          // Dirichlet noise
   defaults->Set<float>(Search::kFpuReductionStr, 0.0f);   // No FPU reduction.
+  defaults->Set<int>(Search::kNnPriorityStr, 0);  // Yield to interactive use.
 }
 
 SelfPlayTournament::SelfPlayTournament(const OptionsDict& options,
@@ -107,59 +244,56 @@ SelfPlayTournament::SelfPlayTournament(const OptionsDict& options,
       kTotalGames(options.Get<int>(kTotalGamesStr)),
       kShareTree(options.Get<bool>(kShareTreesStr)),
       kParallelism(options.Get<int>(kParallelGamesStr)),
+      kMinParallelism(options.Get<int>(kMinParallelGamesStr)
+                          ? options.Get<int>(kMinParallelGamesStr)
+                          : kParallelism),
+      kMaxParallelism(options.Get<int>(kMaxParallelGamesStr)
+                          ? options.Get<int>(kMaxParallelGamesStr)
+                          : kParallelism),
+      kGamesPerThread(options.Get<int>(kGamesPerThreadStr)),
       kTraining(options.Get<bool>(kTrainingStr)),
-      kResignPlaythrough(options.Get<float>(kResignPlaythroughStr)) {
+      kResignPlaythrough(options.Get<float>(kResignPlaythroughStr)),
+      kSeed(options.Get<int>(kSeedStr)),
+      kOpeningCachePlies(options.Get<int>(kOpeningCachePliesStr)) {
+  if (kMinParallelism > kParallelism || kParallelism > kMaxParallelism) {
+    throw Exception(
+        "--parallelism has to be between --min-parallelism and "
+        "--max-parallelism.");
+  }
+  {
+    Mutex::Lock lock(mutex_);
+    target_parallelism_ = kParallelism;
+    tournament_info_.parallelism = kParallelism;
+  }
+
   // If playing just one game, the player1 is white, otherwise randomize.
   if (kTotalGames != 1) {
-    next_game_black_ = Random::Get().GetBool();
+    next_game_black_ = Random(Random::MakeSeed(kSeed, 0)).GetBool();
   }
 
-  static const char* kPlayerNames[2] = {"player1", "player2"};
-  // Initializing networks.
-  for (int idx : {0, 1}) {
-    // If two players have the same network, no need to load two.
-    if (idx == 1) {
-      bool network_identical = true;
-      for (const auto& option_str :
-           {kNetFileStr, kNnBackendStr, kNnBackendOptionsStr}) {
-        if (options.GetSubdict("player1").Get<std::string>(option_str) !=
-            options.GetSubdict("player2").Get<std::string>(option_str)) {
-          network_identical = false;
-          break;
-        }
-      }
-      if (network_identical) {
-        networks_[1] = networks_[0];
-        break;
-      }
-    }
-
-    std::string path =
-        options.GetSubdict(kPlayerNames[idx]).Get<std::string>(kNetFileStr);
-    if (path == kAutoDiscover) {
-      path = DiscoverWeightsFile();
-    }
-    Weights weights = LoadWeightsFromFile(path);
-    std::string backend =
-        options.GetSubdict(kPlayerNames[idx]).Get<std::string>(kNnBackendStr);
-    std::string backend_options = options.GetSubdict(kPlayerNames[idx])
-                                      .Get<std::string>(kNnBackendOptionsStr);
-
-    OptionsDict network_options = OptionsDict::FromString(
-        backend_options, &options.GetSubdict(kPlayerNames[idx]));
+  // Caches are allocated and tablebases opened while the networks load.
+  auto caches_ready = std::async(std::launch::async, [this, &options]() {
+    const auto start = std::chrono::steady_clock::now();
+    InitializeCachesAndTablebases(options);
+    const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+    std::cerr << "NNCache and tablebases setup took " << ms
+              << "ms, in parallel." << std::endl;
+  });
 
-    networks_[idx] =
-        NetworkFactory::Get()->Create(backend, weights, network_options);
+  // Initializing networks.
+  {
+    Mutex::Lock lock(mutex_);
+    CreateNetworks(options, networks_);
   }
+  caches_ready.get();
+  network_settings_ = GetNetworkSettings(options);
 
-  // Initializing cache.
-  cache_[0] = std::make_shared<NNCache>(
-      options.GetSubdict("player1").Get<int>(kNnCacheSizeStr));
-  if (kShareTree) {
-    cache_[1] = cache_[0];
-  } else {
-    cache_[1] = std::make_shared<NNCache>(
-        options.GetSubdict("player2").Get<int>(kNnCacheSizeStr));
+  if (kTraining) {
+    training_writer_ = std::make_unique<AsyncTrainingDataWriter>(
+        options.Get<int>(kTrainingGamesPerFileStr),
+        options.Get<int>(kTrainingCompressionStr));
   }
 
   // SearchLimits.
@@ -178,28 +312,142 @@ SelfPlayTournament::SelfPlayTournament(const OptionsDict& options,
           "not clear when to stop search.");
     }
   }
+
+  // Every game starts from the same position, so its first plies are
+  // evaluated once for all of them.
+  {
+    Mutex::Lock lock(mutex_);
+    PopulateCaches(networks_, cache_generation_, opening_locks_);
+  }
+
+  Metrics::Get().AddCollector(this, [this]() { CollectMetrics(); });
+}
+
+void SelfPlayTournament::InitializeCachesAndTablebases(
+    const OptionsDict& options) {
+  // Games end when they reach a position in tablebases.
+  const auto syzygy_paths = options.Get<std::string>(kSyzygyTablebaseStr);
+  if (!syzygy_paths.empty()) {
+    syzygy_tb_ = std::make_unique<SyzygyTablebase>();
+    if (!syzygy_tb_->Init(syzygy_paths)) {
+      throw Exception("No Syzygy tablebases found in " + syzygy_paths);
+    }
+  }
+
+  // Initializing cache.
+  cache_[0] = std::make_shared<NNCache>(
+      options.GetSubdict("player1").Get<int>(kNnCacheSizeStr));
+  cache_[0]->SetSizeMb(
+      options.GetSubdict("player1").Get<int>(kNnCacheSizeMbStr),
+      options.GetSubdict("player1").Get<std::string>(kNnCacheSharedStr));
+  cache_[0]->SetDiskCache(
+      options.GetSubdict("player1").Get<std::string>(kNnCacheFileStr),
+      options.GetSubdict("player1").Get<bool>(kNnCacheFileReadOnlyStr));
+  if (kShareTree) {
+    cache_[1] = cache_[0];
+  } else {
+    cache_[1] = std::make_shared<NNCache>(
+        options.GetSubdict("player2").Get<int>(kNnCacheSizeStr));
+    cache_[1]->SetSizeMb(
+        options.GetSubdict("player2").Get<int>(kNnCacheSizeMbStr),
+        options.GetSubdict("player2").Get<std::string>(kNnCacheSharedStr));
+    const auto& filename =
+        options.GetSubdict("player2").Get<std::string>(kNnCacheFileStr);
+    // Only one writer per file is allowed.
+    cache_[1]->SetDiskCache(
+        filename,
+        options.GetSubdict("player2").Get<bool>(kNnCacheFileReadOnlyStr) ||
+            filename == options.GetSubdict("player1").Get<std::string>(
+                            kNnCacheFileStr));
+  }
 }
 
-void SelfPlayTournament::PlayOneGame(int game_number) {
-  bool player1_black;  // Whether player1 will player as black in this game.
+void SelfPlayTournament::PopulateCaches(
+    const std::shared_ptr<Network> networks[2], uint32_t cache_generation,
+    std::vector<NNCacheLock> locks[2]) {
+  if (kOpeningCachePlies == 0) return;
+  NodeTree tree;
+  tree.ResetToPosition(ChessBoard::kStartingFen, {});
+  for (int idx : {0, 1}) {
+    // Players sharing the cache share its entries too.
+    if (idx == 1 && cache_[1] == cache_[0]) break;
+    // Keys and probabilities depend on the options of the player, which are
+    // those of its searches.
+    Search search(tree, networks[idx].get(), [](const BestMoveInfo&) {},
+                  [](const ThinkingInfo&) {}, search_limits_[idx],
+                  player_options_[idx], cache_[idx].get(), nullptr,
+                  cache_generation);
+    locks[idx] = search.PopulateCache(kOpeningCachePlies);
+  }
+}
+
+void SelfPlayTournament::CollectMetrics() {
+  auto& metrics = Metrics::Get();
+  {
+    Mutex::Lock lock(mutex_);
+    metrics.GetGauge("lc0_selfplay_parallelism", "Games played in parallel")
+        ->Set(target_parallelism_);
+  }
+  // Players may share the cache.
+  NNCacheStats stats = cache_[0]->GetStats();
+  if (cache_[1] != cache_[0]) {
+    const NNCacheStats stats2 = cache_[1]->GetStats();
+    stats.lookups += stats2.lookups;
+    stats.hits += stats2.hits;
+    stats.size += stats2.size;
+    stats.capacity += stats2.capacity;
+  }
+  metrics.GetGauge("lc0_nncache_lookups", "NNCache lookups")
+      ->Set(stats.lookups);
+  metrics.GetGauge("lc0_nncache_hits", "NNCache lookups which hit")
+      ->Set(stats.hits);
+  metrics.GetGauge("lc0_nncache_size", "Positions in NNCache")->Set(stats.size);
+  metrics.GetGauge("lc0_nncache_capacity", "Capacity of NNCache")
+      ->Set(stats.capacity);
+}
+
+std::unique_ptr<SelfPlayTournament::GameInProgress>
+SelfPlayTournament::StartGame(const NetworkWrapper& wrap_network) {
+  auto state = std::make_unique<GameInProgress>();
+  uint32_t cache_generation;
   {
     Mutex::Lock lock(mutex_);
-    player1_black = next_game_black_;
+    if (abort_) return nullptr;
+    if (kTotalGames != -1 && games_count_ >= kTotalGames) return nullptr;
+    // The worker retires if fewer games are to be played in parallel.
+    if (active_workers_ > target_parallelism_) {
+      --active_workers_;
+      return nullptr;
+    }
+    state->game_number = games_count_++;
+    state->player1_black = next_game_black_;
     next_game_black_ = !next_game_black_;
+    state->networks[0] = networks_[0];
+    state->networks[1] = networks_[1];
+    cache_generation = cache_generation_;
   }
+  const int game_number = state->game_number;
+  const bool player1_black = state->player1_black;
+  // Random choices of the game come from its own generator, so that with
+  // --seed it's replayed the same if searches run on the game's thread.
+  state->random = Random(Random::MakeSeed(kSeed, game_number + 1));
+  Random::Scope random_scope(state->random);
   const int color_idx[2] = {player1_black ? 1 : 0, player1_black ? 0 : 1};
 
   PlayerOptions options[2];
 
-  ThinkingInfo last_thinking_info;
+  ThinkingInfo& last_thinking_info = state->last_thinking_info;
   last_thinking_info.depth = -1;
   for (int pl_idx : {0, 1}) {
     const bool verbose_thinking =
         player_options_[pl_idx].Get<bool>(kVerboseThinkingStr);
     // Populate per-player options.
     PlayerOptions& opt = options[color_idx[pl_idx]];
-    opt.network = networks_[pl_idx].get();
+    opt.network = wrap_network ? wrap_network(state->networks[pl_idx])
+                               : state->networks[pl_idx].get();
     opt.cache = cache_[pl_idx].get();
+    opt.cache_generation = cache_generation;
+    opt.syzygy_tb = syzygy_tb_.get();
     opt.uci_options = &player_options_[pl_idx];
     opt.search_limits = search_limits_[pl_idx];
 
@@ -238,87 +486,247 @@ void SelfPlayTournament::PlayOneGame(int game_number) {
   // Iterator to store the game in. Have to keep it so that later we can
   // delete it. Need to expose it in games_ member variable only because
   // of possible Abort() that should stop them all.
-  std::list<std::unique_ptr<SelfPlayGame>>::iterator game_iter;
   {
     Mutex::Lock lock(mutex_);
     games_.emplace_front(
         std::make_unique<SelfPlayGame>(options[0], options[1], kShareTree));
-    game_iter = games_.begin();
+    state->game_iter = games_.begin();
   }
-  auto& game = **game_iter;
 
   // If kResignPlaythrough == 0, then this comparison is unconditionally true
-  bool enable_resign = Random::Get().GetFloat(100.0f) >= kResignPlaythrough;
+  state->enable_resign = Random::Get().GetFloat(100.0f) >= kResignPlaythrough;
+  return state;
+}
 
-  // PLAY GAME!
-  game.Play(kThreads[color_idx[0]], kThreads[color_idx[1]], enable_resign);
+void SelfPlayTournament::FinishGame(GameInProgress* state) {
+  auto& game = state->game();
+  const int game_number = state->game_number;
+  const bool player1_black = state->player1_black;
 
   // If game was aborted, it's still undecided.
-  if (game.GetGameResult() != GameResult::UNDECIDED) {
+  const GameResult game_result = game.GetGameResult();
+  if (game_result != GameResult::UNDECIDED) {
     // Game callback.
     GameInfo game_info;
-    game_info.game_result = game.GetGameResult();
+    game_info.game_result = game_result;
     game_info.is_black = player1_black;
     game_info.game_id = game_number;
     game_info.moves = game.GetMoves();
-    if (!enable_resign) {
+    if (!state->enable_resign) {
       game_info.min_false_positive_threshold =
           game.GetWorstEvalForWinnerOrDraw();
     }
-    if (kTraining) {
-      TrainingDataWriter writer(game_number);
-      game.WriteTrainingData(&writer);
-      writer.Finalize();
-      game_info.training_filename = writer.GetFileName();
-    }
-    game_callback_(game_info);
-
-    // Update tournament stats.
-    {
+    auto report = [this, game_info, game_result,
+                   player1_black](const std::string& training_filename) {
+      GameInfo info = game_info;
+      info.training_filename = training_filename;
+      game_callback_(info);
+      static MetricsCounter* const games = Metrics::Get().GetCounter(
+          "lc0_selfplay_games_total", "Selfplay games finished");
+      static MetricsCounter* const plies = Metrics::Get().GetCounter(
+          "lc0_selfplay_plies_total", "Plies of finished selfplay games");
+      games->Add();
+      plies->Add(info.moves.size());
+
+      // Update tournament stats.
       Mutex::Lock lock(mutex_);
-      int result = game.GetGameResult() == GameResult::DRAW
+      int result = game_result == GameResult::DRAW
                        ? 1
-                       : game.GetGameResult() == GameResult::WHITE_WON ? 0 : 2;
+                       : game_result == GameResult::WHITE_WON ? 0 : 2;
       if (player1_black) result = 2 - result;
       ++tournament_info_.results[result][player1_black ? 1 : 0];
       tournament_callback_(tournament_info_);
+    };
+    if (training_writer_) {
+      // The game is reported once its file is written.
+      training_writer_->Write(game_number, game.GetTrainingData(), report);
+    } else {
+      report("");
     }
   }
 
   {
     Mutex::Lock lock(mutex_);
-    games_.erase(game_iter);
+    games_.erase(state->game_iter);
   }
 }
 
 void SelfPlayTournament::Worker() {
+  if (kGamesPerThread > 0) {
+    MultiGameWorker();
+    return;
+  }
   // Play games while game limit is not reached (or while not aborted).
+  while (auto state = StartGame(nullptr)) {
+    const bool player1_black = state->player1_black;
+    Random::Scope random_scope(state->random);
+    state->game().Play(kThreads[player1_black ? 1 : 0],
+                       kThreads[player1_black ? 0 : 1], state->enable_resign);
+    FinishGame(state.get());
+  }
+}
+
+void SelfPlayTournament::MultiGameWorker() {
+  SharedBatchNetworks networks;
+  const NetworkWrapper wrap_network =
+      [&networks](const std::shared_ptr<Network>& network) {
+        return networks.Get(network);
+      };
+  struct Slot {
+    std::unique_ptr<GameInProgress> state;
+    // Worker of the search of the current move.
+    std::unique_ptr<SearchWorker> worker;
+  };
+  std::vector<Slot> slots(kGamesPerThread);
+  bool more_games = true;
+
   while (true) {
-    int game_id;
-    {
-      Mutex::Lock lock(mutex_);
-      if (abort_) break;
-      if (kTotalGames != -1 && games_count_ >= kTotalGames) break;
-      game_id = games_count_++;
+    // Starts searches of next moves, and new games in place of finished ones.
+    bool active = false;
+    for (auto& slot : slots) {
+      while (!slot.worker) {
+        if (!slot.state) {
+          if (more_games) slot.state = StartGame(wrap_network);
+          if (!slot.state) {
+            more_games = false;
+            break;
+          }
+        }
+        Random::Scope random_scope(slot.state->random);
+        if (slot.state->game().StartMove()) {
+          slot.worker = slot.state->game().GetSearch()->NewWorker();
+        } else {
+          FinishGame(slot.state.get());
+          slot.state.reset();
+        }
+      }
+      if (slot.worker) active = true;
+    }
+    if (!active) break;
+
+    // Gathers minibatches of all searches, computes them at once, and backs
+    // them up.
+    for (auto& slot : slots) {
+      if (!slot.worker) continue;
+      Random::Scope random_scope(slot.state->random);
+      slot.worker->InitializeIteration(slot.worker->NewComputation());
+      slot.worker->GatherMinibatch();
+      slot.worker->MaybePrefetchIntoCache();
+    }
+    networks.ComputeBatches();
+    for (auto& slot : slots) {
+      if (!slot.worker) continue;
+      Random::Scope random_scope(slot.state->random);
+      SearchWorker* const worker = slot.worker.get();
+      worker->RunNNComputation();
+      worker->FetchMinibatchResults();
+      worker->DoBackupUpdate();
+      worker->UpdateCounters();
+      if (worker->IsSearchActive()) continue;
+      // The worker holds locks of the search's NNCache, so it's destroyed
+      // before the search is.
+      slot.worker.reset();
+      if (!slot.state->game().FinishMove(slot.state->enable_resign)) {
+        FinishGame(slot.state.get());
+        slot.state.reset();
+      }
     }
-    PlayOneGame(game_id);
   }
 }
 
 void SelfPlayTournament::StartAsync() {
-  Mutex::Lock lock(threads_mutex_);
-  while (threads_.size() < kParallelism) {
-    threads_.emplace_back([&]() { Worker(); });
+  Mutex::Lock lock(mutex_);
+  {
+    Mutex::Lock threads_lock(threads_mutex_);
+    while (active_workers_ < target_parallelism_) AddWorker();
+  }
+  if (kMinParallelism != kMaxParallelism && !parallelism_thread_.joinable()) {
+    stop_adjusting_ = false;
+    parallelism_thread_ = std::thread([this]() { AdjustParallelism(); });
+  }
+}
+
+void SelfPlayTournament::AddWorker() {
+  ++active_workers_;
+  threads_.emplace_back([this]() {
+    Tracer::Get().SetThreadName("selfplay worker");
+    Numa::BindThread();
+    Worker();
+  });
+}
+
+void SelfPlayTournament::AdjustParallelism() NO_THREAD_SAFETY_ANALYSIS {
+  std::unique_lock<std::mutex> lock(mutex_.get_raw());
+  // Load counters at the previous adjustment, of networks_ then.
+  std::shared_ptr<Network> last_networks[2];
+  NetworkLoad last_load;
+  auto last_time = std::chrono::steady_clock::now();
+  while (!adjust_cv_.wait_for(lock, kParallelismInterval,
+                              [this]() { return stop_adjusting_; })) {
+    NetworkLoad load;
+    bool has_load = false;
+    for (int idx : {0, 1}) {
+      if (idx == 1 && networks_[1] == networks_[0]) break;
+      NetworkLoad network_load;
+      if (!networks_[idx]->GetLoad(&network_load)) continue;
+      has_load = true;
+      load.batches += network_load.batches;
+      load.samples += network_load.samples;
+      load.capacity += network_load.capacity;
+      load.busy_seconds += network_load.busy_seconds;
+      load.threads += network_load.threads;
+    }
+    const auto time = std::chrono::steady_clock::now();
+    const double seconds =
+        std::chrono::duration<double>(time - last_time).count();
+    const bool same_networks = networks_[0] == last_networks[0] &&
+                               networks_[1] == last_networks[1];
+    const NetworkLoad previous = last_load;
+    last_networks[0] = networks_[0];
+    last_networks[1] = networks_[1];
+    last_load = load;
+    last_time = time;
+    // Counters of new networks start over.
+    if (!has_load || !same_networks || load.capacity == previous.capacity) {
+      continue;
+    }
+    // No workers are added once all games are started.
+    if (abort_ || (kTotalGames != -1 && games_count_ >= kTotalGames)) break;
+
+    const double busy = (load.busy_seconds - previous.busy_seconds) /
+                        (seconds * std::max(load.threads, 1));
+    const double fill = static_cast<double>(load.samples - previous.samples) /
+                        (load.capacity - previous.capacity);
+    int target = target_parallelism_;
+    if (busy < kMinBusyFraction || fill < kMinBatchFill) {
+      target = std::min(kMaxParallelism, target + std::max(1, target / 4));
+    } else if (fill >= kMaxBatchFill) {
+      target = std::max(kMinParallelism, target - 1);
+    }
+    if (target == target_parallelism_) continue;
+    std::cerr << "Games in parallel: " << target_parallelism_ << " -> "
+              << target << ", backend busy " << static_cast<int>(busy * 100)
+              << "%, batches " << static_cast<int>(fill * 100) << "% full."
+              << std::endl;
+    target_parallelism_ = target;
+    {
+      Mutex::Lock threads_lock(threads_mutex_);
+      while (active_workers_ < target_parallelism_) AddWorker();
+    }
+    tournament_info_.parallelism = target_parallelism_;
+    tournament_callback_(tournament_info_);
   }
 }
 
 void SelfPlayTournament::RunBlocking() {
-  if (kParallelism == 1) {
+  if (kParallelism == 1 && kMinParallelism == kMaxParallelism) {
     // No need for multiple threads if there is one worker.
     Worker();
+    if (training_writer_) training_writer_->Flush();
     Mutex::Lock lock(mutex_);
     if (!abort_) {
       tournament_info_.finished = true;
+      FillCacheStats();
       tournament_callback_(tournament_info_);
     }
   } else {
@@ -328,22 +736,48 @@ void SelfPlayTournament::RunBlocking() {
 }
 
 void SelfPlayTournament::Wait() {
-  {
-    Mutex::Lock lock(threads_mutex_);
-    while (!threads_.empty()) {
-      threads_.back().join();
+  // Workers may be added meanwhile, until all games are started.
+  while (true) {
+    std::thread thread;
+    {
+      Mutex::Lock lock(threads_mutex_);
+      if (threads_.empty()) break;
+      thread = std::move(threads_.back());
       threads_.pop_back();
     }
+    thread.join();
   }
+  {
+    Mutex::Lock lock(mutex_);
+    stop_adjusting_ = true;
+  }
+  adjust_cv_.notify_all();
+  if (parallelism_thread_.joinable()) parallelism_thread_.join();
+  // Games are reported when their training data is written, so that has to
+  // happen before the final status.
+  if (training_writer_) training_writer_->Flush();
   {
     Mutex::Lock lock(mutex_);
     if (!abort_) {
       tournament_info_.finished = true;
+      FillCacheStats();
       tournament_callback_(tournament_info_);
     }
   }
 }
 
+void SelfPlayTournament::FillCacheStats() {
+  for (int i = 0; i < 2; ++i) {
+    const NNCacheStats stats = cache_[i]->GetStats();
+    auto& info = tournament_info_.cache_stats[i];
+    info.lookups = stats.lookups;
+    info.hits = stats.hits;
+    info.evictions = stats.evictions;
+    info.size = stats.size;
+    info.capacity = stats.capacity;
+  }
+}
+
 void SelfPlayTournament::Abort() {
   Mutex::Lock lock(mutex_);
   abort_ = true;
@@ -351,9 +785,43 @@ void SelfPlayTournament::Abort() {
     if (game) game->Abort();
 }
 
+void SelfPlayTournament::ReloadNetworks(const OptionsDict& options) {
+  const std::string settings = GetNetworkSettings(options);
+  if (settings == network_settings_) return;
+  network_settings_ = settings;
+  if (reload_thread_.joinable()) reload_thread_.join();
+  reload_thread_ = std::thread([this, &options]() {
+    std::shared_ptr<Network> networks[2];
+    try {
+      CreateNetworks(options, networks);
+    } catch (const Exception& e) {
+      std::cerr << "Networks not reloaded: " << e.what() << std::endl;
+      return;
+    }
+    // Only this thread changes the generation.
+    uint32_t cache_generation;
+    {
+      Mutex::Lock lock(mutex_);
+      cache_generation = cache_generation_ + 1;
+    }
+    std::vector<NNCacheLock> locks[2];
+    PopulateCaches(networks, cache_generation, locks);
+    Mutex::Lock lock(mutex_);
+    networks_[0] = std::move(networks[0]);
+    networks_[1] = std::move(networks[1]);
+    // Instead of clearing the caches, entries of the old networks are left to
+    // be evicted.
+    cache_generation_ = cache_generation;
+    opening_locks_[0] = std::move(locks[0]);
+    opening_locks_[1] = std::move(locks[1]);
+  });
+}
+
 SelfPlayTournament::~SelfPlayTournament() {
+  Metrics::Get().RemoveCollectors(this);
   Abort();
   Wait();
+  if (reload_thread_.joinable()) reload_thread_.join();
 }
 
 }  // namespace lczero
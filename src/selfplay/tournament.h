@@ -27,15 +27,22 @@
 
 #pragma once
 
+#include <condition_variable>
+#include <functional>
 #include <list>
+#include <thread>
+#include "neural/writer.h"
 #include "selfplay/game.h"
 #include "utils/mutex.h"
 #include "utils/optionsdict.h"
 #include "utils/optionsparser.h"
+#include "utils/random.h"
 
 namespace lczero {
 
-// Runs many selfplay games, possibly in parallel.
+// Runs many selfplay games, possibly in parallel. Every thread either plays
+// one game at a time with its own search threads, or searches many games in
+// lock-step, computing their leaves in one batch per step.
 class SelfPlayTournament {
  public:
   SelfPlayTournament(const OptionsDict& options,
@@ -59,14 +66,65 @@ class SelfPlayTournament {
   // Tells worker threads to finish ASAP. Does not block.
   void Abort();
 
+  // If network settings in @options have changed, loads and warms up the new
+  // networks in the background. Games which start once they are ready use
+  // them, games in progress finish with the old ones. Does not block, unless
+  // an earlier reload is still in progress. @options have to outlive the
+  // tournament.
+  void ReloadNetworks(const OptionsDict& options);
+
   // If there are ongoing games, aborts and waits.
   ~SelfPlayTournament();
 
  private:
+  // A game being played by a worker.
+  struct GameInProgress {
+    int game_number;
+    bool player1_black;
+    bool enable_resign;
+    // Generator of the random choices of the game.
+    Random random{0};
+    // Kept for the whole game, even if the networks are replaced meanwhile.
+    std::shared_ptr<Network> networks[2];
+    // In non-verbose mode, the last "info" message of the move.
+    ThinkingInfo last_thinking_info;
+    // Position of the game in games_.
+    std::list<std::unique_ptr<SelfPlayGame>>::iterator game_iter;
+    SelfPlayGame& game() { return **game_iter; }
+  };
+  // Returns the network searches use in place of the given one.
+  using NetworkWrapper =
+      std::function<Network*(const std::shared_ptr<Network>&)>;
+
+  // Starts a worker thread, which plays games while there are no more than
+  // target_parallelism_ workers.
+  void AddWorker() REQUIRES(mutex_, threads_mutex_);
+  // Until Wait() stops it, periodically sets target_parallelism_ from the
+  // load of the networks and starts workers if it grows.
+  void AdjustParallelism();
   void Worker();
-  void PlayOneGame(int game_id);
-
-  Mutex mutex_;
+  // Worker() which searches kGamesPerThread games in lock-step.
+  void MultiGameWorker();
+  // Creates the next game, with searches which use @wrap_network(network)
+  // (if set) instead of the networks. Returns nullptr if no more games are to
+  // be played.
+  std::unique_ptr<GameInProgress> StartGame(const NetworkWrapper& wrap_network);
+  // Reports the result of a played game and removes it.
+  void FinishGame(GameInProgress* game);
+  // Creates the caches and opens the tablebases of @options.
+  void InitializeCachesAndTablebases(const OptionsDict& options);
+  // Evaluates the first kOpeningCachePlies plies of games with @networks into
+  // the caches, as entries of @cache_generation, and sets @locks to pins of
+  // them.
+  void PopulateCaches(const std::shared_ptr<Network> networks[2],
+                      uint32_t cache_generation,
+                      std::vector<NNCacheLock> locks[2]);
+  // Copies NNCache counters into tournament_info_.
+  void FillCacheStats() REQUIRES(mutex_);
+  // Updates gauges of Metrics from the state of the tournament.
+  void CollectMetrics() EXCLUDES(mutex_);
+
+  Mutex mutex_{"tournament"};
   // Whether next game will be black for player1.
   bool next_game_black_ GUARDED_BY(mutex_) = false;
   // Number of games which already started.
@@ -78,14 +136,31 @@ class SelfPlayTournament {
   std::list<std::unique_ptr<SelfPlayGame>> games_ GUARDED_BY(mutex_);
   // Place to store tournament stats.
   TournamentInfo tournament_info_ GUARDED_BY(mutex_);
-
-  Mutex threads_mutex_;
+  // Number of workers to play games, and how many workers take new games.
+  int target_parallelism_ GUARDED_BY(mutex_) = 0;
+  int active_workers_ GUARDED_BY(mutex_) = 0;
+  bool stop_adjusting_ GUARDED_BY(mutex_) = false;
+  std::condition_variable adjust_cv_;
+
+  Mutex threads_mutex_ ACQUIRED_AFTER(mutex_){"tournament threads"};
+  // Workers, including those which retired and are not joined yet.
   std::vector<std::thread> threads_ GUARDED_BY(threads_mutex_);
+  std::thread parallelism_thread_;
 
   // All those are [0] for player1 and [1] for player2
   // Shared pointers for both players may point to the same object.
-  std::shared_ptr<Network> networks_[2];
+  std::shared_ptr<Network> networks_[2] GUARDED_BY(mutex_);
+  // Tags cache entries of networks_ (see Search::Search()).
+  uint32_t cache_generation_ GUARDED_BY(mutex_) = 0;
+  // Settings networks_ were created with, or are being loaded with.
+  std::string network_settings_;
+  std::thread reload_thread_;
   std::shared_ptr<NNCache> cache_[2];
+  // Pins of the openings of networks_ in cache_, so that they stay there for
+  // all the games.
+  std::vector<NNCacheLock> opening_locks_[2] GUARDED_BY(mutex_);
+  // Shared by both players, null if no tablebase paths were given.
+  std::unique_ptr<SyzygyTablebase> syzygy_tb_;
   const OptionsDict player_options_[2];
   SearchLimits search_limits_[2];
 
@@ -96,9 +171,18 @@ class SelfPlayTournament {
   const int kThreads[2];
   const int kTotalGames;
   const bool kShareTree;
-  const size_t kParallelism;
+  const int kParallelism;
+  const int kMinParallelism;
+  const int kMaxParallelism;
+  const int kGamesPerThread;
   const bool kTraining;
   const float kResignPlaythrough;
+  const uint64_t kSeed;
+  const int kOpeningCachePlies;
+
+  // Writes training data of finished games when kTraining. Declared last so
+  // that it's destroyed (and calls back) while the callbacks are still alive.
+  std::unique_ptr<AsyncTrainingDataWriter> training_writer_;
 };
 
 }  // namespace lczero
@@ -0,0 +1,1099 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "syzygy/syzygy.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "utils/exception.h"
+#include "utils/filesystem.h"
+#include "utils/string.h"
+
+namespace lczero {
+
+namespace {
+
+// Tables have up to 7 pieces.
+constexpr int kMaxPieces = 7;
+
+// Piece codes used by the tables: piece type, plus 8 for black.
+enum PieceType { kPawn = 1, kKnight, kBishop, kRook, kQueen, kKing };
+constexpr int kBlack = 8;
+const char kPieceChars[] = " PNBRQK";
+
+enum TableType { kWdl, kDtz };
+
+// Flags of PairsData.
+enum TableFlag {
+  kStm = 1,
+  kMapped = 2,
+  kWinPlies = 4,
+  kLossPlies = 8,
+  kWide = 16,
+  kSingleValue = 128,
+};
+
+// Magic numbers at the start of the files.
+const uint8_t kWdlMagic[] = {0x71, 0xE8, 0x23, 0x5D};
+const uint8_t kDtzMagic[] = {0xD7, 0x66, 0x0C, 0xA5};
+
+// Tables store values of a file unaligned, in either byte order.
+template <typename T>
+T ReadLittleEndian(const uint8_t* data) {
+  T result = 0;
+  for (size_t i = 0; i < sizeof(T); ++i) {
+    result |= static_cast<T>(static_cast<T>(data[i]) << (8 * i));
+  }
+  return result;
+}
+
+template <typename T>
+T ReadBigEndian(const uint8_t* data) {
+  T result = 0;
+  for (size_t i = 0; i < sizeof(T); ++i) {
+    result = static_cast<T>((result << 8) | data[i]);
+  }
+  return result;
+}
+
+int FileOf(int square) { return square & 7; }
+int RankOf(int square) { return square >> 3; }
+// Positive above the a1-h8 diagonal, negative below, 0 on it.
+int OffA1H8(int square) { return RankOf(square) - FileOf(square); }
+
+// Indices of the encoding of positions, computed once.
+// kBinomial[k][n] is the number of ways to choose k of n elements.
+int kBinomial[6][64];
+// For positions with pawns: index of the leading pawn of the group of
+// @count leading pawns, and the number of indices of a file.
+int kLeadPawnIdx[6][64];
+int kLeadPawnsSize[6][4];
+// Maps squares a2-h7 to 0..47, higher for squares of a leading pawn (nearer
+// to the edge and, on the same file, lower rank).
+int kMapPawns[64];
+// Maps squares below the a1-h8 diagonal to 0..27.
+int kMapB1H1H7[64];
+// Maps squares of the a1-d1-d4 triangle to 0..9, the diagonal last.
+int kMapA1D1D4[64];
+// Index of the 462 legal placements of two kings, with the first one in the
+// a1-d1-d4 triangle.
+int kMapKK[10][64];
+
+void InitIndices() {
+  int code = 0;
+  for (int s = 0; s < 64; ++s) {
+    if (OffA1H8(s) < 0) kMapB1H1H7[s] = code++;
+  }
+
+  std::vector<int> diagonal;
+  code = 0;
+  for (int rank = 0; rank < 4; ++rank) {
+    for (int file = 0; file < 4; ++file) {
+      const int s = rank * 8 + file;
+      if (OffA1H8(s) < 0) {
+        kMapA1D1D4[s] = code++;
+      } else if (OffA1H8(s) == 0) {
+        diagonal.push_back(s);
+      }
+    }
+  }
+  for (int s : diagonal) kMapA1D1D4[s] = code++;
+
+  // If the first king is on the a1-d4 diagonal, the other one is not above
+  // the a1-h8 diagonal. Placements of both kings on the diagonal go last.
+  std::vector<std::pair<int, int>> both_on_diagonal;
+  code = 0;
+  for (int idx = 0; idx < 10; ++idx) {
+    for (int s1 = 0; s1 < 28; ++s1) {
+      // b1 maps to 0, as well as squares outside of the triangle.
+      if (kMapA1D1D4[s1] != idx || (idx == 0 && s1 != 1)) continue;
+      for (int s2 = 0; s2 < 64; ++s2) {
+        if (std::abs(RankOf(s1) - RankOf(s2)) <= 1 &&
+            std::abs(FileOf(s1) - FileOf(s2)) <= 1) {
+          continue;  // Kings touch.
+        }
+        if (OffA1H8(s1) == 0 && OffA1H8(s2) > 0) continue;
+        if (OffA1H8(s1) == 0 && OffA1H8(s2) == 0) {
+          both_on_diagonal.emplace_back(idx, s2);
+        } else {
+          kMapKK[idx][s2] = code++;
+        }
+      }
+    }
+  }
+  for (const auto& p : both_on_diagonal) kMapKK[p.first][p.second] = code++;
+
+  kBinomial[0][0] = 1;
+  for (int n = 1; n < 64; ++n) {
+    for (int k = 0; k < 6 && k <= n; ++k) {
+      kBinomial[k][n] = (k > 0 ? kBinomial[k - 1][n - 1] : 0) +
+                        (k < n ? kBinomial[k][n - 1] : 0);
+    }
+  }
+
+  // There are 47 squares for other pawns when the leading one is on a2, and
+  // 2 less for every rank up because of mirroring.
+  int available_squares = 47;
+  for (int lead_pawns = 1; lead_pawns <= 5; ++lead_pawns) {
+    for (int file = 0; file < 4; ++file) {
+      // Tables are split by file, so indices restart for every one.
+      int idx = 0;
+      for (int rank = 1; rank <= 6; ++rank) {
+        const int s = rank * 8 + file;
+        if (lead_pawns == 1) {
+          kMapPawns[s] = available_squares--;
+          kMapPawns[s ^ 7] = available_squares--;
+        }
+        kLeadPawnIdx[lead_pawns][s] = idx;
+        idx += kBinomial[lead_pawns - 1][kMapPawns[s]];
+      }
+      kLeadPawnsSize[lead_pawns][file] = idx;
+    }
+  }
+}
+
+bool PawnsCompare(int a, int b) { return kMapPawns[a] < kMapPawns[b]; }
+
+// Decompression data of a table (of a side to move, and of a file of the
+// leading pawn for tables with pawns). Pointers point into the mapped file.
+struct PairsData {
+  uint8_t flags = 0;
+  // Block size in bytes.
+  uint64_t block_size = 0;
+  // There is a sparse index entry about every @span values.
+  uint64_t span = 0;
+  int num_blocks = 0;
+  // Maximum and minimum length in bits of the Huffman symbols.
+  int max_sym_len = 0;
+  int min_sym_len = 0;
+  // 16-bit lowest symbol of every length.
+  const uint8_t* lowest_sym = nullptr;
+  // For every symbol, 12-bit left and right symbols which it expands into.
+  const uint8_t* btree = nullptr;
+  // 16-bit number of values (minus one) in every block.
+  const uint8_t* block_length = nullptr;
+  int block_length_size = 0;
+  // 6-byte entries of 32-bit block and 16-bit offset in it.
+  const uint8_t* sparse_index = nullptr;
+  uint64_t sparse_index_size = 0;
+  // Huffman compressed data.
+  const uint8_t* data = nullptr;
+  // base64[l - min_sym_len] is the lowest symbol of length l, padded to 64
+  // bits.
+  std::vector<uint64_t> base64;
+  // Number of values (minus one) a symbol expands into.
+  std::vector<uint8_t> symlen;
+  // Pieces in order of encoding, which defines the groups.
+  int pieces[kMaxPieces] = {};
+  // Start index of the encoding of the pieces of every group, and their
+  // number.
+  uint64_t group_idx[kMaxPieces + 1] = {};
+  int group_len[kMaxPieces + 1] = {};
+  // Offsets of value maps of DTZ tables: win, loss, cursed win and blessed
+  // loss.
+  uint16_t map_idx[4] = {};
+
+  int Left(int sym) const {
+    const uint8_t* lr = btree + 3 * sym;
+    return ((lr[1] & 0xF) << 8) | lr[0];
+  }
+  int Right(int sym) const {
+    const uint8_t* lr = btree + 3 * sym;
+    return (lr[2] << 4) | (lr[1] >> 4);
+  }
+};
+
+// WDL or DTZ table of a material combination.
+struct Table {
+  Table(TableType type, const std::string& name) : type(type), name(name) {}
+
+  PairsData* Get(int stm, int file) {
+    return &items[stm % (type == kWdl ? 2 : 1)][has_pawns ? file : 0];
+  }
+
+  const TableType type;
+  // Like "KRvK", the stronger side first.
+  const std::string name;
+  // Set when the file is mapped (or failed to be mapped).
+  std::atomic<bool> ready{false};
+  std::unique_ptr<MappedFile> file;
+  // Value maps of DTZ tables.
+  const uint8_t* map = nullptr;
+  // Material keys with the stronger side being white and black.
+  uint64_t key = 0;
+  uint64_t key2 = 0;
+  int piece_count = 0;
+  bool has_pawns = false;
+  bool has_unique_pieces = false;
+  // Number of pawns of the leading color and of the other one.
+  int pawn_count[2] = {};
+  // [side to move][file of the leading pawn].
+  PairsData items[2][4];
+};
+
+// Key of material of @counts[color][piece type].
+uint64_t MaterialKey(const int counts[2][7]) {
+  uint64_t key = 0;
+  for (int color = 0; color < 2; ++color) {
+    for (int type = kPawn; type <= kKing; ++type) {
+      key += static_cast<uint64_t>(counts[color][type])
+             << (4 * (color * 6 + type - 1));
+    }
+  }
+  return key;
+}
+
+// Pieces of the board, "ours" (the side to move) being white.
+struct BoardPieces {
+  explicit BoardPieces(const ChessBoard& board)
+      : white(board.ours()), all(board.ours() + board.theirs()) {
+    types[kPawn] = board.pawns();
+    types[kKnight] = board.our_knights() + board.their_knights();
+    types[kBishop] = board.bishops();
+    types[kRook] = board.rooks();
+    types[kQueen] = board.queens();
+    types[kKing] = board.our_king() + board.their_king();
+  }
+
+  int PieceOn(int square) const {
+    int type = kPawn;
+    while (!types[type].get(square)) ++type;
+    return white.get(square) ? type : type + kBlack;
+  }
+
+  BitBoard Pieces(int color, int type) const {
+    return types[type] * (color ? all - white : white);
+  }
+
+  uint64_t Key() const {
+    int counts[2][7] = {};
+    for (int type = kPawn; type <= kKing; ++type) {
+      counts[0][type] = Pieces(0, type).count();
+      counts[1][type] = Pieces(1, type).count();
+    }
+    return MaterialKey(counts);
+  }
+
+  BitBoard white;
+  BitBoard all;
+  BitBoard types[7];
+};
+
+bool IsCapture(const ChessBoard& board, Move move) {
+  // Diagonal pawn moves to empty squares are en passant captures.
+  return board.theirs().get(move.to()) ||
+         (board.pawns().get(move.from()) &&
+          move.from().col() != move.to().col());
+}
+
+bool IsPawnMove(const ChessBoard& board, Move move) {
+  return board.pawns().get(move.from());
+}
+
+// Board after @move, from the point of view of the other side.
+ChessBoard AfterMove(const ChessBoard& board, Move move) {
+  ChessBoard result = board;
+  result.ApplyMove(move);
+  result.Mirror();
+  return result;
+}
+
+int Sign(int value) { return (value > 0) - (value < 0); }
+
+// DTZ of the position before a zeroing move with @wdl result.
+int DtzBeforeZeroing(int wdl) {
+  switch (wdl) {
+    case 2:
+      return 1;
+    case 1:
+      return 101;
+    case -1:
+      return -101;
+    case -2:
+      return -1;
+    default:
+      return 0;
+  }
+}
+
+int DecompressPairs(const PairsData* d, uint64_t idx) {
+  // All positions of the table have the same value.
+  if (d->flags & kSingleValue) return d->min_sym_len;
+
+  // Block n stores block_length[n] + 1 values. The sparse index entry k points
+  // to the block and offset of value k * span + span / 2, and blocks are
+  // walked from there.
+  const uint32_t k = static_cast<uint32_t>(idx / d->span);
+  uint32_t block = ReadLittleEndian<uint32_t>(d->sparse_index + 6 * k);
+  int offset = ReadLittleEndian<uint16_t>(d->sparse_index + 6 * k + 4);
+  offset += static_cast<int>(idx % d->span) - static_cast<int>(d->span / 2);
+
+  auto block_length = [d](uint32_t block) {
+    return ReadLittleEndian<uint16_t>(d->block_length + 2 * block);
+  };
+  while (offset < 0) offset += block_length(--block) + 1;
+  while (offset > block_length(block)) offset -= block_length(block++) + 1;
+
+  // The block is a sequence of canonical Huffman symbols.
+  const uint8_t* ptr = d->data + block * d->block_size;
+  uint64_t buf64 = ReadBigEndian<uint64_t>(ptr);
+  ptr += 8;
+  int buf64_size = 64;
+  int sym;
+
+  while (true) {
+    // Symbols of a length l padded to 64 bits are between base64[l - 1] and
+    // base64[l], and consecutive integers.
+    int len = 0;
+    while (buf64 < d->base64[len]) ++len;
+    sym = static_cast<int>((buf64 - d->base64[len]) >>
+                           (64 - len - d->min_sym_len));
+    sym += ReadLittleEndian<uint16_t>(d->lowest_sym + 2 * len);
+
+    if (offset < d->symlen[sym] + 1) break;
+
+    // The value is not in this symbol, skip it.
+    offset -= d->symlen[sym] + 1;
+    len += d->min_sym_len;
+    buf64 <<= len;
+    buf64_size -= len;
+    if (buf64_size <= 32) {
+      buf64_size += 32;
+      buf64 |= static_cast<uint64_t>(ReadBigEndian<uint32_t>(ptr))
+               << (64 - buf64_size);
+      ptr += 4;
+    }
+  }
+
+  // The symbol expands into a pair of symbols recursively (Recursive Pairing
+  // compression), down to the one of the value.
+  while (d->symlen[sym]) {
+    const int left = d->Left(sym);
+    if (offset < d->symlen[left] + 1) {
+      sym = left;
+    } else {
+      offset -= d->symlen[left] + 1;
+      sym = d->Right(sym);
+    }
+  }
+  return d->Left(sym);
+}
+
+// DTZ tables are one-sided.
+bool CheckDtzStm(Table* entry, int stm, int file) {
+  if (entry->type == kWdl) return true;
+  const int flags = entry->Get(stm, file)->flags;
+  return (flags & kStm) == stm ||
+         (entry->key == entry->key2 && !entry->has_pawns);
+}
+
+// Converts a stored value to WDL, or to DTZ in plies. DTZ values are stored
+// by frequency of occurrence, and mapped back to the distances.
+int MapScore(Table* entry, int file, int value, int wdl) {
+  if (entry->type == kWdl) return value - 2;
+
+  constexpr int kWdlMap[] = {1, 3, 0, 2, 0};
+  const PairsData* d = entry->Get(0, file);
+  const int flags = d->flags;
+  if (flags & kMapped) {
+    const int idx = d->map_idx[kWdlMap[wdl + 2]] + value;
+    value = (flags & kWide) ? ReadLittleEndian<uint16_t>(entry->map + 2 * idx)
+                            : entry->map[idx];
+  }
+
+  // Distances are stored in moves or in plies.
+  if ((wdl == 2 && !(flags & kWinPlies)) ||
+      (wdl == -2 && !(flags & kLossPlies)) || wdl == 1 || wdl == -1) {
+    value *= 2;
+  }
+  return value + 1;
+}
+
+// Returns index of the position in the table, and sets the side to move and
+// the file of the leading pawn, which select its PairsData.
+uint64_t EncodePosition(const ChessBoard& board, Table* entry, int* stm_out,
+                        int* file_out) {
+  const BoardPieces pos(board);
+  int squares[kMaxPieces];
+  int pieces[kMaxPieces];
+  int size = 0;
+  int lead_pawns_count = 0;
+  BitBoard lead_pawns;
+  int tb_file = 0;
+
+  // Tables are computed with the stronger side (the first one of the name)
+  // as white. Our side is white, so if it's the weaker one, colors are
+  // switched and the board mirrored.
+  const bool flip = pos.Key() != entry->key;
+  const int flip_color = flip ? kBlack : 0;
+  const int flip_squares = flip ? 070 : 0;
+  const int stm = flip ? 1 : 0;
+
+  // Tables with pawns are split by the file of the leading pawn, the one of
+  // the leading color with the highest kMapPawns[].
+  if (entry->has_pawns) {
+    const int pc = entry->Get(0, 0)->pieces[0] ^ flip_color;
+    lead_pawns = pos.Pieces(pc >= kBlack, kPawn);
+    for (auto square : lead_pawns) {
+      squares[size++] = square.as_int() ^ flip_squares;
+    }
+    lead_pawns_count = size;
+    std::swap(squares[0], *std::max_element(
+                              squares, squares + lead_pawns_count,
+                              PawnsCompare));
+    tb_file = FileOf(squares[0]);
+    if (tb_file > 3) tb_file = FileOf(squares[0] ^ 7);
+  }
+
+  for (auto square : pos.all - lead_pawns) {
+    squares[size] = square.as_int() ^ flip_squares;
+    pieces[size++] = pos.PieceOn(square.as_int()) ^ flip_color;
+  }
+
+  PairsData* d = entry->Get(stm, tb_file);
+
+  // Order pieces as the table encodes them.
+  for (int i = lead_pawns_count; i < size; ++i) {
+    for (int j = i; j < size; ++j) {
+      if (d->pieces[i] == pieces[j]) {
+        std::swap(pieces[i], pieces[j]);
+        std::swap(squares[i], squares[j]);
+        break;
+      }
+    }
+  }
+
+  // The leading piece goes into the a1-d1-d4 triangle.
+  if (FileOf(squares[0]) > 3) {
+    for (int i = 0; i < size; ++i) squares[i] ^= 7;
+  }
+
+  uint64_t idx;
+  if (entry->has_pawns) {
+    idx = kLeadPawnIdx[lead_pawns_count][squares[0]];
+    std::sort(squares + 1, squares + lead_pawns_count, PawnsCompare);
+    for (int i = 1; i < lead_pawns_count; ++i) {
+      idx += kBinomial[i][kMapPawns[squares[i]]];
+    }
+  } else {
+    if (RankOf(squares[0]) > 3) {
+      for (int i = 0; i < size; ++i) squares[i] ^= 070;
+    }
+    // The first piece of the leading group which is not on the a1-h8
+    // diagonal goes below it.
+    for (int i = 0; i < d->group_len[0]; ++i) {
+      if (!OffA1H8(squares[i])) continue;
+      if (OffA1H8(squares[i]) > 0) {
+        for (int j = i; j < size; ++j) {
+          squares[j] = ((squares[j] >> 3) | (squares[j] << 3)) & 63;
+        }
+      }
+      break;
+    }
+
+    if (entry->has_unique_pieces) {
+      // Three unique pieces (kings included) are encoded together.
+      const int adjust1 = squares[1] > squares[0];
+      const int adjust2 = (squares[2] > squares[0]) + (squares[2] > squares[1]);
+      if (OffA1H8(squares[0])) {
+        idx = (kMapA1D1D4[squares[0]] * 63 + (squares[1] - adjust1)) * 62 +
+              squares[2] - adjust2;
+      } else if (OffA1H8(squares[1])) {
+        idx = (6 * 63 + RankOf(squares[0]) * 28 + kMapB1H1H7[squares[1]]) *
+                  62 +
+              squares[2] - adjust2;
+      } else if (OffA1H8(squares[2])) {
+        idx = 6 * 63 * 62 + 4 * 28 * 62 + RankOf(squares[0]) * 7 * 28 +
+              (RankOf(squares[1]) - adjust1) * 28 + kMapB1H1H7[squares[2]];
+      } else {
+        idx = 6 * 63 * 62 + 4 * 28 * 62 + 4 * 7 * 28 +
+              RankOf(squares[0]) * 7 * 6 + (RankOf(squares[1]) - adjust1) * 6 +
+              (RankOf(squares[2]) - adjust2);
+      }
+    } else {
+      // Only the kings are encoded together.
+      idx = kMapKK[kMapA1D1D4[squares[0]]][squares[1]];
+    }
+  }
+
+  // Other groups are encoded as combinations of squares not taken by the
+  // previous groups.
+  idx *= d->group_idx[0];
+  int* group_sq = squares + d->group_len[0];
+  bool remaining_pawns = entry->has_pawns && entry->pawn_count[1];
+  for (int next = 1; d->group_len[next]; ++next) {
+    std::sort(group_sq, group_sq + d->group_len[next]);
+    uint64_t n = 0;
+    for (int i = 0; i < d->group_len[next]; ++i) {
+      const int adjust = std::count_if(
+          squares, group_sq, [&](int s) { return group_sq[i] > s; });
+      n += kBinomial[i + 1][group_sq[i] - adjust - 8 * remaining_pawns];
+    }
+    remaining_pawns = false;
+    idx += n * d->group_idx[next];
+    group_sq += d->group_len[next];
+  }
+
+  *stm_out = stm;
+  *file_out = tb_file;
+  return idx;
+}
+
+// Looks up the position in the table, returning WDL or DTZ (of @wdl result).
+int DoProbeTable(const ChessBoard& board, Table* entry, int wdl,
+                 ProbeState* result) {
+  int stm;
+  int file;
+  const uint64_t idx = EncodePosition(board, entry, &stm, &file);
+  if (!CheckDtzStm(entry, stm, file)) {
+    *result = ProbeState::kChangeStm;
+    return 0;
+  }
+  return MapScore(entry, file, DecompressPairs(entry->Get(stm, file), idx),
+                  wdl);
+}
+
+// Computes the groups of pieces which are encoded together, and their
+// indices. @order gives the order of the leading group and of the remaining
+// pawns among the groups.
+void SetGroups(const Table& e, PairsData* d, const int order[2], int file) {
+  int n = 0;
+  int first_len = e.has_pawns ? 0 : e.has_unique_pieces ? 3 : 2;
+  d->group_len[n] = 1;
+  for (int i = 1; i < e.piece_count; ++i) {
+    if (--first_len > 0 || d->pieces[i] == d->pieces[i - 1]) {
+      d->group_len[n]++;
+    } else {
+      d->group_len[++n] = 1;
+    }
+  }
+  d->group_len[++n] = 0;
+
+  const bool pp = e.has_pawns && e.pawn_count[1];
+  int next = pp ? 2 : 1;
+  int free_squares = 64 - d->group_len[0] - (pp ? d->group_len[1] : 0);
+  uint64_t idx = 1;
+  for (int k = 0; next < n || k == order[0] || k == order[1]; ++k) {
+    if (k == order[0]) {
+      // Leading pawns or pieces.
+      d->group_idx[0] = idx;
+      idx *= e.has_pawns ? kLeadPawnsSize[d->group_len[0]][file]
+                         : e.has_unique_pieces ? 31332 : 462;
+    } else if (k == order[1]) {
+      // Remaining pawns.
+      d->group_idx[1] = idx;
+      idx *= kBinomial[d->group_len[1]][48 - d->group_len[0]];
+    } else {
+      // Remaining pieces.
+      d->group_idx[next] = idx;
+      idx *= kBinomial[d->group_len[next]][free_squares];
+      free_squares -= d->group_len[next++];
+    }
+  }
+  d->group_idx[n] = idx;
+}
+
+uint8_t SetSymLen(PairsData* d, int s, std::vector<bool>* visited) {
+  (*visited)[s] = true;
+  const int sr = d->Right(s);
+  if (sr == 0xFFF) return 0;
+  const int sl = d->Left(s);
+  if (!(*visited)[sl]) d->symlen[sl] = SetSymLen(d, sl, visited);
+  if (!(*visited)[sr]) d->symlen[sr] = SetSymLen(d, sr, visited);
+  return d->symlen[sl] + d->symlen[sr] + 1;
+}
+
+const uint8_t* SetSizes(PairsData* d, const uint8_t* data) {
+  d->flags = *data++;
+  if (d->flags & kSingleValue) {
+    // The single value is stored instead of the minimum symbol length.
+    d->min_sym_len = *data++;
+    return data;
+  }
+
+  // The last group index is the size of the table.
+  const uint64_t tb_size =
+      d->group_idx[std::find(d->group_len, d->group_len + kMaxPieces, 0) -
+                   d->group_len];
+  d->block_size = 1ULL << *data++;
+  d->span = 1ULL << *data++;
+  d->sparse_index_size = (tb_size + d->span - 1) / d->span;
+  const int padding = *data++;
+  d->num_blocks = ReadLittleEndian<uint32_t>(data);
+  data += 4;
+  // Padded so that the sparse index doesn't point out of range.
+  d->block_length_size = d->num_blocks + padding;
+  d->max_sym_len = *data++;
+  d->min_sym_len = *data++;
+  d->lowest_sym = data;
+  d->base64.resize(d->max_sym_len - d->min_sym_len + 1);
+
+  // Longer symbols have lower values in the canonical code, so
+  // base64[i] >= base64[i + 1].
+  for (int i = static_cast<int>(d->base64.size()) - 2; i >= 0; --i) {
+    d->base64[i] = (d->base64[i + 1] +
+                    ReadLittleEndian<uint16_t>(d->lowest_sym + 2 * i) -
+                    ReadLittleEndian<uint16_t>(d->lowest_sym + 2 * i + 2)) /
+                   2;
+  }
+  for (size_t i = 0; i < d->base64.size(); ++i) {
+    d->base64[i] <<= 64 - i - d->min_sym_len;
+  }
+
+  data += d->base64.size() * 2;
+  d->symlen.resize(ReadLittleEndian<uint16_t>(data));
+  data += 2;
+  d->btree = data;
+
+  std::vector<bool> visited(d->symlen.size());
+  for (size_t sym = 0; sym < d->symlen.size(); ++sym) {
+    if (!visited[sym]) d->symlen[sym] = SetSymLen(d, sym, &visited);
+  }
+  return data + d->symlen.size() * 3 + (d->symlen.size() & 1);
+}
+
+const uint8_t* SetDtzMap(Table* e, const uint8_t* data, int max_file) {
+  if (e->type == kWdl) return data;
+  e->map = data;
+  for (int f = 0; f <= max_file; ++f) {
+    PairsData* d = e->Get(0, f);
+    if (!(d->flags & kMapped)) continue;
+    if (d->flags & kWide) {
+      // Word aligned, tables may mix both kinds.
+      data += reinterpret_cast<uintptr_t>(data) & 1;
+      for (int i = 0; i < 4; ++i) {
+        d->map_idx[i] = static_cast<uint16_t>((data - e->map) / 2 + 1);
+        data += 2 * ReadLittleEndian<uint16_t>(data) + 2;
+      }
+    } else {
+      for (int i = 0; i < 4; ++i) {
+        d->map_idx[i] = static_cast<uint16_t>(data - e->map + 1);
+        data += *data + 1;
+      }
+    }
+  }
+  return data + (reinterpret_cast<uintptr_t>(data) & 1);
+}
+
+// Sets up decompression of the table from the mapped file @data (after the
+// magic number).
+void InitTable(Table* e, const uint8_t* data) {
+  // The first byte has flags, of which we use none.
+  ++data;
+  const int sides = e->type == kWdl && e->key != e->key2 ? 2 : 1;
+  const int max_file = e->has_pawns ? 3 : 0;
+  const bool pp = e->has_pawns && e->pawn_count[1];
+
+  for (int f = 0; f <= max_file; ++f) {
+    for (int i = 0; i < sides; ++i) *e->Get(i, f) = PairsData();
+    const int order[2][2] = {{*data & 0xF, pp ? *(data + 1) & 0xF : 0xF},
+                             {*data >> 4, pp ? *(data + 1) >> 4 : 0xF}};
+    data += 1 + pp;
+    for (int k = 0; k < e->piece_count; ++k, ++data) {
+      for (int i = 0; i < sides; ++i) {
+        e->Get(i, f)->pieces[k] = i ? *data >> 4 : *data & 0xF;
+      }
+    }
+    for (int i = 0; i < sides; ++i) SetGroups(*e, e->Get(i, f), order[i], f);
+  }
+  data += reinterpret_cast<uintptr_t>(data) & 1;
+
+  for (int f = 0; f <= max_file; ++f) {
+    for (int i = 0; i < sides; ++i) data = SetSizes(e->Get(i, f), data);
+  }
+  data = SetDtzMap(e, data, max_file);
+
+  for (int f = 0; f <= max_file; ++f) {
+    for (int i = 0; i < sides; ++i) {
+      PairsData* d = e->Get(i, f);
+      d->sparse_index = data;
+      data += d->sparse_index_size * 6;
+    }
+  }
+  for (int f = 0; f <= max_file; ++f) {
+    for (int i = 0; i < sides; ++i) {
+      PairsData* d = e->Get(i, f);
+      d->block_length = data;
+      data += d->block_length_size * 2;
+    }
+  }
+  for (int f = 0; f <= max_file; ++f) {
+    for (int i = 0; i < sides; ++i) {
+      // 64 byte aligned.
+      data = reinterpret_cast<const uint8_t*>(
+          (reinterpret_cast<uintptr_t>(data) + 0x3F) & ~uintptr_t(0x3F));
+      PairsData* d = e->Get(i, f);
+      d->data = data;
+      data += d->num_blocks * d->block_size;
+    }
+  }
+}
+
+}  // namespace
+
+class SyzygyTablebase::Tables {
+ public:
+  explicit Tables(const std::vector<std::string>& paths) : paths_(paths) {}
+
+  // Adds the table of @pieces (strongest side first, then the other one, each
+  // starting with the king) if its WDL file exists. Returns whether it does.
+  bool Add(const std::vector<int>& pieces) {
+    std::string name;
+    for (int type : pieces) name += kPieceChars[type];
+    name.insert(name.find('K', 1), "v");
+    if (FindFile(name + ".rtbw").empty()) return false;
+
+    int counts[2][7] = {};
+    int color = 0;
+    for (size_t i = 0; i < pieces.size(); ++i) {
+      if (i > 0 && pieces[i] == kKing) color = 1;
+      ++counts[color][pieces[i]];
+    }
+    wdl_.emplace_back(kWdl, name);
+    dtz_.emplace_back(kDtz, name);
+    for (Table* e : {&wdl_.back(), &dtz_.back()}) {
+      e->key = MaterialKey(counts);
+      std::swap(counts[0], counts[1]);
+      e->key2 = MaterialKey(counts);
+      std::swap(counts[0], counts[1]);
+      e->piece_count = pieces.size();
+      e->has_pawns = counts[0][kPawn] + counts[1][kPawn] > 0;
+      for (int c = 0; c < 2; ++c) {
+        for (int type = kPawn; type < kKing; ++type) {
+          if (counts[c][type] == 1) e->has_unique_pieces = true;
+        }
+      }
+      // The leading color is the one with less pawns (but some), which
+      // compresses better.
+      const bool white_leads =
+          !counts[1][kPawn] ||
+          (counts[0][kPawn] && counts[1][kPawn] >= counts[0][kPawn]);
+      e->pawn_count[0] = counts[white_leads ? 0 : 1][kPawn];
+      e->pawn_count[1] = counts[white_leads ? 1 : 0][kPawn];
+    }
+    by_key_[wdl_.back().key] = {&wdl_.back(), &dtz_.back()};
+    by_key_[wdl_.back().key2] = {&wdl_.back(), &dtz_.back()};
+    return true;
+  }
+
+  Table* Get(uint64_t key, TableType type) const {
+    const auto iter = by_key_.find(key);
+    if (iter == by_key_.end()) return nullptr;
+    return type == kWdl ? iter->second.first : iter->second.second;
+  }
+
+  size_t size() const { return wdl_.size(); }
+
+  // Maps the file of the table on first use. Returns whether it's mapped.
+  bool Map(Table* e) {
+    if (e->ready.load(std::memory_order_acquire)) return e->file != nullptr;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (e->ready.load(std::memory_order_relaxed)) return e->file != nullptr;
+
+    const bool wdl = e->type == kWdl;
+    const std::string filename = FindFile(e->name + (wdl ? ".rtbw" : ".rtbz"));
+    if (!filename.empty()) {
+      try {
+        e->file = std::make_unique<MappedFile>(filename);
+      } catch (Exception& ex) {
+        std::cerr << ex.what() << std::endl;
+      }
+    }
+    if (e->file) {
+      const auto* data = reinterpret_cast<const uint8_t*>(e->file->data());
+      if (e->file->size() % 64 != 16 ||
+          std::memcmp(data, wdl ? kWdlMagic : kDtzMagic, 4) != 0) {
+        std::cerr << "Corrupted table in file " << filename << std::endl;
+        e->file.reset();
+      } else {
+        InitTable(e, data + 4);
+      }
+    }
+    e->ready.store(true, std::memory_order_release);
+    return e->file != nullptr;
+  }
+
+ private:
+  // Returns path of @name in the first directory which has it, or "".
+  std::string FindFile(const std::string& name) const {
+    for (const auto& path : paths_) {
+      const std::string filename = path + "/" + name;
+      if (std::ifstream(filename).good()) return filename;
+    }
+    return "";
+  }
+
+  const std::vector<std::string> paths_;
+  // Deques keep tables in place as they are added.
+  std::deque<Table> wdl_;
+  std::deque<Table> dtz_;
+  // WDL and DTZ tables by material key.
+  std::unordered_map<uint64_t, std::pair<Table*, Table*>> by_key_;
+  std::mutex mutex_;
+};
+
+// Tables may store any value for positions where a capture wins, and a loss
+// where it draws, so captures have to be searched.
+int SyzygyTablebase::SearchZeroingMoves(const ChessBoard& board,
+                                        ProbeState* result,
+                                        bool check_zeroing_moves) {
+  int best_value = -2;
+  const auto moves = board.GenerateLegalMoves();
+  size_t move_count = 0;
+
+  for (const auto& move : moves) {
+    if (!IsCapture(board, move) &&
+        (!check_zeroing_moves || !IsPawnMove(board, move))) {
+      continue;
+    }
+    ++move_count;
+    const int value =
+        -SearchZeroingMoves(AfterMove(board, move), result, false);
+    if (*result == ProbeState::kFail) return 0;
+    if (value > best_value) {
+      best_value = value;
+      if (value >= 2) {
+        *result = ProbeState::kZeroingBestMove;
+        return value;
+      }
+    }
+  }
+
+  // If all moves were searched, the stored value could be wrong (e.g. tables
+  // don't have en passant rights), so it's not probed.
+  const bool no_more_moves = move_count && move_count == moves.size();
+  int value;
+  if (no_more_moves) {
+    value = best_value;
+  } else {
+    value = ProbeTable(board, false, result);
+    if (*result == ProbeState::kFail) return 0;
+  }
+
+  // DTZ stores a "don't care" value if the best value is a win.
+  if (best_value >= value) {
+    *result = (best_value > 0 || no_more_moves) ? ProbeState::kZeroingBestMove
+                                                : ProbeState::kOk;
+    return best_value;
+  }
+  *result = ProbeState::kOk;
+  return value;
+}
+
+int SyzygyTablebase::ProbeTable(const ChessBoard& board, bool dtz,
+                                ProbeState* result, int wdl) {
+  // KvK.
+  if ((board.ours() + board.theirs()).count() == 2) return 0;
+  Table* entry = tables_->Get(BoardPieces(board).Key(), dtz ? kDtz : kWdl);
+  if (!entry || !tables_->Map(entry)) {
+    *result = ProbeState::kFail;
+    return 0;
+  }
+  return DoProbeTable(board, entry, wdl, result);
+}
+
+SyzygyTablebase::SyzygyTablebase() {
+  static std::once_flag indices_initialized;
+  std::call_once(indices_initialized, InitIndices);
+}
+
+SyzygyTablebase::~SyzygyTablebase() = default;
+
+bool SyzygyTablebase::Init(const std::string& paths) {
+  paths_ = paths;
+  max_cardinality_ = 0;
+#ifdef _WIN32
+  const char* kSeparator = ";";
+#else
+  const char* kSeparator = ":";
+#endif
+  std::vector<std::string> dirs;
+  for (const auto& path : StrSplit(paths, kSeparator)) {
+    if (!Trim(path).empty()) dirs.push_back(Trim(path));
+  }
+  tables_ = std::make_unique<Tables>(dirs);
+  if (dirs.empty()) return false;
+
+  auto add = [this](const std::vector<int>& pieces) {
+    if (tables_->Add(pieces)) {
+      max_cardinality_ =
+          std::max(max_cardinality_, static_cast<int>(pieces.size()));
+    }
+  };
+  for (int p1 = kPawn; p1 < kKing; ++p1) {
+    add({kKing, p1, kKing});
+    for (int p2 = kPawn; p2 <= p1; ++p2) {
+      add({kKing, p1, p2, kKing});
+      add({kKing, p1, kKing, p2});
+      for (int p3 = kPawn; p3 < kKing; ++p3) add({kKing, p1, p2, kKing, p3});
+      for (int p3 = kPawn; p3 <= p2; ++p3) {
+        add({kKing, p1, p2, p3, kKing});
+        for (int p4 = kPawn; p4 <= p3; ++p4) {
+          add({kKing, p1, p2, p3, p4, kKing});
+          for (int p5 = kPawn; p5 <= p4; ++p5) {
+            add({kKing, p1, p2, p3, p4, p5, kKing});
+          }
+          for (int p5 = kPawn; p5 < kKing; ++p5) {
+            add({kKing, p1, p2, p3, p4, kKing, p5});
+          }
+        }
+        for (int p4 = kPawn; p4 < kKing; ++p4) {
+          add({kKing, p1, p2, p3, kKing, p4});
+          for (int p5 = kPawn; p5 <= p4; ++p5) {
+            add({kKing, p1, p2, p3, kKing, p4, p5});
+          }
+        }
+      }
+      for (int p3 = kPawn; p3 <= p1; ++p3) {
+        for (int p4 = kPawn; p4 <= (p1 == p3 ? p2 : p3); ++p4) {
+          add({kKing, p1, p2, kKing, p3, p4});
+        }
+      }
+    }
+  }
+  std::cerr << "Found " << tables_->size() << " Syzygy tablebases, up to "
+            << max_cardinality_ << " pieces." << std::endl;
+  return max_cardinality_ > 0;
+}
+
+WdlScore SyzygyTablebase::ProbeWdl(const ChessBoard& board,
+                                   ProbeState* result) {
+  *result = ProbeState::kOk;
+  return static_cast<WdlScore>(SearchZeroingMoves(board, result, false));
+}
+
+int SyzygyTablebase::ProbeDtz(const ChessBoard& board, ProbeState* result) {
+  *result = ProbeState::kOk;
+  const int wdl = SearchZeroingMoves(board, result, true);
+  // DTZ tables don't store draws.
+  if (*result == ProbeState::kFail || wdl == 0) return 0;
+  // DTZ stores a "don't care" value in this case, or even a wrong one when
+  // the best move is an en passant capture.
+  if (*result == ProbeState::kZeroingBestMove) return DtzBeforeZeroing(wdl);
+
+  int dtz = ProbeTable(board, true, result, wdl);
+  if (*result == ProbeState::kFail) return 0;
+  if (*result != ProbeState::kChangeStm) {
+    return (dtz + 100 * (wdl == -1 || wdl == 1)) * Sign(wdl);
+  }
+
+  // The table stores the other side to move, so find the move to the best DTZ
+  // with a 1-ply search.
+  int min_dtz = 0xFFFF;
+  for (const auto& move : board.GenerateLegalMoves()) {
+    const bool zeroing = IsCapture(board, move) || IsPawnMove(board, move);
+    const ChessBoard next = AfterMove(board, move);
+    // For zeroing moves the DTZ before the move is wanted, but the position
+    // after it tells the sign.
+    dtz = zeroing
+              ? -DtzBeforeZeroing(SearchZeroingMoves(next, result, false))
+              : -ProbeDtz(next, result);
+    // Mating moves have DTZ of 1.
+    if (dtz == 1 && next.IsUnderCheck() && next.GenerateLegalMoves().empty()) {
+      min_dtz = 1;
+    }
+    if (!zeroing) dtz += Sign(dtz);
+    if (dtz < min_dtz && Sign(dtz) == Sign(wdl)) min_dtz = dtz;
+    if (*result == ProbeState::kFail) return 0;
+  }
+  // Without legal moves, the position is a mate.
+  return min_dtz == 0xFFFF ? -1 : min_dtz;
+}
+
+bool SyzygyTablebase::RootProbe(const PositionHistory& history,
+                                MoveList* moves) {
+  const Position& position = history.Last();
+  const ChessBoard& board = position.GetBoard();
+  const int cnt50 = position.GetNoCapturePly();
+  const bool repeated = history.DidRepeatSinceLastZeroingMove();
+
+  MoveList all_moves = board.GenerateLegalMoves();
+  std::vector<int> ranks;
+  ProbeState result;
+  for (const auto& move : all_moves) {
+    ChessBoard next = board;
+    const bool zeroing = next.ApplyMove(move);
+    next.Mirror();
+    int dtz;
+    if (zeroing) {
+      dtz = DtzBeforeZeroing(-static_cast<int>(ProbeWdl(next, &result)));
+    } else {
+      // DTZ of the position after the move, corrected by 1 ply.
+      dtz = -ProbeDtz(next, &result);
+      dtz = dtz > 0 ? dtz + 1 : dtz < 0 ? dtz - 1 : dtz;
+    }
+    if (next.IsUnderCheck() && dtz == 2 && next.GenerateLegalMoves().empty()) {
+      dtz = 1;
+    }
+    if (result == ProbeState::kFail) return false;
+    // Certain wins are ranked equally, as well as losses unless the 50-move
+    // draw is in sight.
+    const int rank =
+        dtz > 0 ? (dtz + cnt50 <= 99 && !repeated ? 1000
+                                                  : 1000 - (dtz + cnt50))
+        : dtz < 0 ? (-dtz * 2 + cnt50 < 100 ? -1000 : -1000 + (-dtz + cnt50))
+                  : 0;
+    ranks.push_back(rank);
+  }
+
+  if (ranks.empty()) return false;
+  const int best_rank = *std::max_element(ranks.begin(), ranks.end());
+  moves->clear();
+  for (size_t i = 0; i < all_moves.size(); ++i) {
+    if (ranks[i] == best_rank) moves->push_back(all_moves[i]);
+  }
+  return true;
+}
+
+bool SyzygyTablebase::RootProbeWdl(const ChessBoard& board, MoveList* moves) {
+  const MoveList all_moves = board.GenerateLegalMoves();
+  std::vector<int> scores;
+  ProbeState result;
+  for (const auto& move : all_moves) {
+    scores.push_back(
+        -static_cast<int>(ProbeWdl(AfterMove(board, move), &result)));
+    if (result == ProbeState::kFail) return false;
+  }
+
+  if (scores.empty()) return false;
+  const int best_score = *std::max_element(scores.begin(), scores.end());
+  moves->clear();
+  for (size_t i = 0; i < all_moves.size(); ++i) {
+    if (scores[i] == best_score) moves->push_back(all_moves[i]);
+  }
+  return true;
+}
+
+}  // namespace lczero
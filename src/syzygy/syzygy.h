@@ -0,0 +1,114 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include "chess/board.h"
+#include "chess/position.h"
+
+namespace lczero {
+
+// Result of a position for the side to move. Cursed wins and blessed losses
+// are wins and losses which the 50-move rule turns into draws.
+enum class WdlScore {
+  kLoss = -2,
+  kBlessedLoss = -1,
+  kDraw = 0,
+  kCursedWin = 1,
+  kWin = 2,
+};
+
+// Outcome of a probe.
+enum class ProbeState {
+  kFail,
+  kOk,
+  // The DTZ table only stores the other side to move.
+  kChangeStm,
+  // The best move zeroes the 50-move counter (a capture or a pawn move).
+  kZeroingBestMove,
+};
+
+// Syzygy endgame tablebases. Positions with at most GetMaxCardinality() pieces
+// (kings included) and no castling rights are probed for win/draw/loss (WDL
+// tables, *.rtbw) and for the distance to the next zeroing move which keeps
+// the result (DTZ tables, *.rtbz). Files are mapped into memory on first use.
+// Boards are probed as they are, from the point of view of the side to move.
+//
+// The decoder follows the probing code of Stockfish, which is based on the
+// original code of Ronald de Man, the author of the tablebases.
+class SyzygyTablebase {
+ public:
+  SyzygyTablebase();
+  ~SyzygyTablebase();
+
+  // Finds tables in @paths, separated by ':' (';' on Windows). Returns whether
+  // any were found.
+  bool Init(const std::string& paths);
+  // Largest number of pieces of the tables found, 0 if there are none.
+  int GetMaxCardinality() const { return max_cardinality_; }
+  // Paths the tables were looked for in.
+  const std::string& GetPaths() const { return paths_; }
+  // Returns whether @board may be in the tables: it has no castling rights and
+  // few enough pieces.
+  bool CanProbe(const ChessBoard& board) const {
+    return board.castlings().as_int() == 0 &&
+           (board.ours() + board.theirs()).count() <= max_cardinality_;
+  }
+
+  // Returns WDL of the position, assuming that the 50-move counter is zero.
+  WdlScore ProbeWdl(const ChessBoard& board, ProbeState* result);
+  // Returns the number of plies to the next zeroing move of the optimal line,
+  // positive if the side to move wins and negative if it loses (by 100 more
+  // for cursed wins and blessed losses), 0 for draws.
+  int ProbeDtz(const ChessBoard& board, ProbeState* result);
+
+  // Leaves in @moves only those legal moves of the last position of @history
+  // which keep its best result under the 50-move rule, using DTZ tables.
+  // Returns false if some probes failed, and then @moves is unchanged.
+  bool RootProbe(const PositionHistory& history, MoveList* moves);
+  // Same using WDL tables only, without regard to the 50-move counter.
+  bool RootProbeWdl(const ChessBoard& board, MoveList* moves);
+
+ private:
+  class Tables;
+
+  // Probes WDL, searching captures (and with @check_zeroing_moves, pawn moves)
+  // too. Returns WDL as int.
+  int SearchZeroingMoves(const ChessBoard& board, ProbeState* result,
+                         bool check_zeroing_moves);
+  // Looks up the position in its WDL table, or DTZ table for @wdl result.
+  int ProbeTable(const ChessBoard& board, bool dtz, ProbeState* result,
+                 int wdl = 0);
+
+  std::unique_ptr<Tables> tables_;
+  std::string paths_;
+  int max_cardinality_ = 0;
+};
+
+}  // namespace lczero
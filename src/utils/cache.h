@@ -24,155 +24,158 @@
   terms of the respective license agreement, the licensors of this
   Program grant you additional permission to convey the resulting work.
 */
-
 #pragma once
 
+#include <atomic>
 #include <cassert>
+#include <cstdint>
 #include <cstring>
+#include <functional>
 #include <memory>
 #include <string>
+#include <vector>
 #include "utils/mutex.h"
 
 namespace lczero {
 
-// Generic LRU cache. Thread-safe. Takes ownership of all values, which are
-// deleted upon eviction; thus, using values stored requires pinning them, which
-// in turn requires Unpin()ing them after use. The use of LruCacheLock is
-// recommend to automate this element-memory management.
+// One shard of LruCache (see below), a complete LRU cache with its own lock.
+//
+// Only writers (Insert, SetCapacity, Clear) take the lock. Readers traverse
+// hash chains without locking, and evicted items are reclaimed by epochs:
+// a reader registers in the current epoch for as long as it uses the value,
+// and an evicted item is only deleted once the epoch has advanced twice since
+// its eviction, which requires all readers of older epochs to be gone.
 template <class K, class V>
-class LruCache {
+class LruCacheShard {
   static const double constexpr kLoadFactor = 1.33;
 
  public:
-  LruCache(int capacity = 128)
+  LruCacheShard(int capacity = 128)
       : capacity_(capacity),
-        hash_(static_cast<size_t>(capacity * kLoadFactor + 1)) {
-    std::memset(&hash_[0], 0, sizeof(hash_[0]) * hash_.size());
+        hash_(new HashTable(static_cast<size_t>(capacity * kLoadFactor + 1))) {
   }
 
-  ~LruCache() {
+  ~LruCacheShard() {
     ShrinkToCapacity(0);
     assert(size_ == 0);
+    assert(readers_[0] == 0 && readers_[1] == 0);
+    for (auto& retired : retired_) {
+      for (Item* item : retired) delete item;
+      allocated_ -= retired.size();
+    }
     assert(allocated_ == 0);
+    for (auto& retired : retired_tables_) {
+      for (HashTable* table : retired) delete table;
+    }
+    delete hash_.load(std::memory_order_relaxed);
   }
 
   // Inserts the element under key @key with value @val.
-  // If the element is pinned, old value is still kept (until fully unpinned),
-  // but new lookups will return updated value.
-  // If @pinned, pins inserted element, Unpin has to be called to unpin.
+  // If the old element under that key is being read, it's still kept (until
+  // all its readers are gone), but new lookups will return updated value.
   // In any case, puts element to front of the queue (makes it last to evict).
-  V* Insert(K key, std::unique_ptr<V> val, bool pinned = false) {
-    Mutex::Lock lock(mutex_);
+  void Insert(K key, std::unique_ptr<V> val) {
+    Mutex::Lock lock(mutex_, "cache insert wait");
 
-    auto hash = hasher_(key) % hash_.size();
-    auto& hash_head = hash_[hash];
-    for (Item* iter = hash_head; iter; iter = iter->next_in_hash) {
+    HashTable* table = hash_.load(std::memory_order_relaxed);
+    auto& hash_head = table->heads[hasher_(key) % table->size];
+    for (Item* iter = hash_head.load(std::memory_order_relaxed); iter;
+         iter = iter->next_in_hash.load(std::memory_order_relaxed)) {
       if (key == iter->key) {
         EvictItem(iter);
         break;
       }
     }
 
-    ShrinkToCapacity(capacity_ - 1);
+    evictions_ += ShrinkToCapacity(capacity_ - 1);
     ++size_;
     ++allocated_;
-    Item* new_item = new Item(key, std::move(val), pinned ? 1 : 0);
-    new_item->next_in_hash = hash_head;
-    hash_head = new_item;
+    Item* new_item = new Item(key, std::move(val));
+    new_item->next_in_hash.store(hash_head.load(std::memory_order_relaxed),
+                                 std::memory_order_relaxed);
+    // Publishes the item to readers.
+    hash_head.store(new_item, std::memory_order_release);
     InsertIntoLru(new_item);
-    return new_item->value.get();
+    TryAdvanceEpoch();
   }
 
   // Checks whether a key exists. Doesn't lock. Of course the next moment the
   // key may be evicted.
   bool ContainsKey(K key) {
-    Mutex::Lock lock(mutex_);
-    auto hash = hasher_(key) % hash_.size();
-    for (Item* iter = hash_[hash]; iter; iter = iter->next_in_hash) {
-      if (key == iter->key) return true;
-    }
-    return false;
+    const int epoch = EnterReader();
+    const bool found = Lookup(key) != nullptr;
+    LeaveReader(epoch);
+    return found;
   }
 
-  // Looks up and pins the element by key. Returns nullptr if not found.
-  // If found, brings the element to the head of the queue (makes it last to
-  // evict); furthermore, a call to Unpin must be made for each such element.
-  // Use of LruCacheLock is recommended to automate this pin management.
-  V* LookupAndPin(K key) {
-    Mutex::Lock lock(mutex_);
-
-    auto hash = hasher_(key) % hash_.size();
-    for (Item* iter = hash_[hash]; iter; iter = iter->next_in_hash) {
-      if (key == iter->key) {
-        // BringToFront(iter);
-        ++iter->pins;
-        return iter->value.get();
-      }
+  // Looks up the element by key. Returns nullptr if not found. Doesn't lock.
+  // The value is only guaranteed to stay alive while the caller is registered
+  // as a reader, i.e. between EnterReader() and LeaveReader() calls.
+  V* Lookup(K key) {
+    const HashTable* table = hash_.load(std::memory_order_acquire);
+    for (Item* iter = table->heads[hasher_(key) % table->size].load(
+             std::memory_order_acquire);
+         iter; iter = iter->next_in_hash.load(std::memory_order_acquire)) {
+      if (key == iter->key) return iter->value.get();
     }
     return nullptr;
   }
 
-  // Unpins the element given key and value. Use of LruCacheLock is recommended
-  // to automate this pin management.
-  void Unpin(K key, V* value) {
-    Mutex::Lock lock(mutex_);
-
-    // Checking evicted list first.
-    Item** cur = &evicted_head_;
-    for (Item* el = evicted_head_; el; el = el->next_in_hash) {
-      if (key == el->key && value == el->value.get()) {
-        if (--el->pins == 0) {
-          *cur = el->next_in_hash;
-          --allocated_;
-          delete el;
-        }
-        return;
-      }
-      cur = &el->next_in_hash;
-    }
-
-    // Now lookup in active list.
-    auto hash = hasher_(key) % hash_.size();
-    for (Item* iter = hash_[hash]; iter; iter = iter->next_in_hash) {
-      if (key == iter->key && value == iter->value.get()) {
-        assert(iter->pins > 0);
-        --iter->pins;
-        return;
-      }
+  // Registers the reader in the current epoch. Returns a token that has to be
+  // passed to LeaveReader(). Doesn't lock.
+  int EnterReader() {
+    while (true) {
+      const uint64_t epoch = epoch_.load();
+      const int idx = epoch & 1;
+      readers_[idx].fetch_add(1);
+      // If the epoch has advanced meanwhile, items the writer has already
+      // checked to be free of readers of this epoch may be deleted. Retry.
+      if (epoch_.load() == epoch) return idx;
+      readers_[idx].fetch_sub(1);
     }
-    assert(false);
   }
 
+  void LeaveReader(int token) { readers_[token].fetch_sub(1); }
+
   // Sets the capacity of the cache. If new capacity is less than current size
   // of the cache, oldest entries are evicted. In any case the hashtable is
-  // rehashed.
+  // rehashed. Lookups which run concurrently with rehashing may miss.
   void SetCapacity(int capacity) {
     Mutex::Lock lock(mutex_);
 
     if (capacity_ == capacity) return;
-    ShrinkToCapacity(capacity);
+    evictions_ += ShrinkToCapacity(capacity);
     capacity_ = capacity;
 
-    std::vector<Item*> new_hash(
-        static_cast<size_t>(capacity * kLoadFactor + 1));
-    std::memset(&new_hash[0], 0, sizeof(new_hash[0]) * new_hash.size());
+    HashTable* old_table = hash_.load(std::memory_order_relaxed);
+    HashTable* new_table =
+        new HashTable(static_cast<size_t>(capacity * kLoadFactor + 1));
 
     if (size_ != 0) {
-      for (Item* head : hash_) {
-        for (Item* iter = head; head; head = head->next_in_hash) {
-          auto& new_hash_head = new_hash[hasher_(iter->key) % new_hash.size()];
-          iter->next_in_hash = new_hash_head;
-          new_hash_head = iter;
+      for (size_t i = 0; i < old_table->size; ++i) {
+        for (Item* iter = old_table->heads[i].load(std::memory_order_relaxed);
+             iter;) {
+          Item* next = iter->next_in_hash.load(std::memory_order_relaxed);
+          auto& new_hash_head =
+              new_table->heads[hasher_(iter->key) % new_table->size];
+          iter->next_in_hash.store(
+              new_hash_head.load(std::memory_order_relaxed),
+              std::memory_order_release);
+          new_hash_head.store(iter, std::memory_order_relaxed);
+          iter = next;
         }
       }
     }
-    hash_.swap(new_hash);
+    hash_.store(new_table, std::memory_order_release);
+    retired_tables_[epoch_.load() & 1].push_back(old_table);
+    TryAdvanceEpoch();
   }
 
   // Clears the cache;
   void Clear() {
     Mutex::Lock lock(mutex_);
     ShrinkToCapacity(0);
+    TryAdvanceEpoch();
   }
 
   int GetSize() const {
@@ -183,19 +186,37 @@ class LruCache {
     Mutex::Lock lock(mutex_);
     return capacity_;
   }
+  uint64_t GetEvictions() const {
+    Mutex::Lock lock(mutex_);
+    return evictions_;
+  }
+  int GetRetired() const {
+    Mutex::Lock lock(mutex_);
+    return allocated_ - size_;
+  }
+  int GetReaders() const { return readers_[0].load() + readers_[1].load(); }
 
  private:
   struct Item {
-    Item(K key, std::unique_ptr<V> value, int pins)
-        : key(key), value(std::move(value)), pins(pins) {}
-    K key;
-    std::unique_ptr<V> value;
-    int pins = 0;
-    Item* next_in_hash = nullptr;
+    Item(K key, std::unique_ptr<V> value)
+        : key(key), value(std::move(value)) {}
+    const K key;
+    const std::unique_ptr<V> value;
+    std::atomic<Item*> next_in_hash{nullptr};
     Item* prev_in_queue = nullptr;
     Item* next_in_queue = nullptr;
   };
 
+  struct HashTable {
+    HashTable(size_t size) : size(size), heads(new std::atomic<Item*>[size]) {
+      for (size_t i = 0; i < size; ++i) {
+        heads[i].store(nullptr, std::memory_order_relaxed);
+      }
+    }
+    const size_t size;
+    const std::unique_ptr<std::atomic<Item*>[]> heads;
+  };
+
   void EvictItem(Item* iter) REQUIRES(mutex_) {
     --size_;
 
@@ -211,18 +232,16 @@ class LruCache {
       iter->next_in_queue->prev_in_queue = iter->prev_in_queue;
     }
 
-    // Destroy or move into evicted list depending on whether it's pinned.
-    Item** cur = &hash_[hasher_(iter->key) % hash_.size()];
-    for (Item* el = *cur; el; el = el->next_in_hash) {
+    // Unlink from the hash chain. Readers which are at the item still can
+    // follow its next_in_hash, so it's left intact.
+    HashTable* table = hash_.load(std::memory_order_relaxed);
+    std::atomic<Item*>* cur = &table->heads[hasher_(iter->key) % table->size];
+    for (Item* el = cur->load(std::memory_order_relaxed); el;
+         el = cur->load(std::memory_order_relaxed)) {
       if (el == iter) {
-        *cur = el->next_in_hash;
-        if (el->pins == 0) {
-          --allocated_;
-          delete el;
-        } else {
-          el->next_in_hash = evicted_head_;
-          evicted_head_ = el;
-        }
+        cur->store(el->next_in_hash.load(std::memory_order_relaxed),
+                   std::memory_order_release);
+        retired_[epoch_.load() & 1].push_back(el);
         return;
       }
       cur = &el->next_in_hash;
@@ -231,26 +250,30 @@ class LruCache {
     assert(false);
   }
 
-  void ShrinkToCapacity(int capacity) REQUIRES(mutex_) {
+  // Advances the epoch if no readers of the previous epoch are left, deleting
+  // what was retired during it.
+  void TryAdvanceEpoch() REQUIRES(mutex_) {
+    const uint64_t epoch = epoch_.load();
+    // Same parity as the previous epoch.
+    const int idx = (epoch + 1) & 1;
+    if (readers_[idx].load() != 0) return;
+    for (Item* item : retired_[idx]) delete item;
+    allocated_ -= retired_[idx].size();
+    retired_[idx].clear();
+    for (HashTable* table : retired_tables_[idx]) delete table;
+    retired_tables_[idx].clear();
+    epoch_.store(epoch + 1);
+  }
+
+  // Returns number of items evicted.
+  int ShrinkToCapacity(int capacity) REQUIRES(mutex_) {
     if (capacity < 0) capacity = 0;
+    int evicted = 0;
     while (lru_tail_ && size_ > capacity) {
       EvictItem(lru_tail_);
+      ++evicted;
     }
-  }
-
-  void BringToFront(Item* iter) REQUIRES(mutex_) {
-    if (lru_head_ == iter) {
-      return;
-    } else {
-      iter->prev_in_queue->next_in_queue = iter->next_in_queue;
-    }
-    if (lru_tail_ == iter) {
-      lru_tail_ = iter->prev_in_queue;
-    } else {
-      iter->next_in_queue->prev_in_queue = iter->prev_in_queue;
-    }
-
-    InsertIntoLru(iter);
+    return evicted;
   }
 
   void InsertIntoLru(Item* iter) REQUIRES(mutex_) {
@@ -270,14 +293,123 @@ class LruCache {
   int capacity_ GUARDED_BY(mutex_);
   int size_ GUARDED_BY(mutex_) = 0;
   int allocated_ GUARDED_BY(mutex_) = 0;
+  // Items evicted to make room, not counting Clear().
+  uint64_t evictions_ GUARDED_BY(mutex_) = 0;
   Item* lru_head_ GUARDED_BY(mutex_) = nullptr;  // Newest elements.
   Item* lru_tail_ GUARDED_BY(mutex_) = nullptr;  // Oldest elements.
-  Item* evicted_head_ GUARDED_BY(mutex_) =
-      nullptr;  // Evicted but pinned elements.
-  std::vector<Item*> hash_ GUARDED_BY(mutex_);
-  std::hash<K> hasher_ GUARDED_BY(mutex_);
+  // Written under mutex_, read by lookups without it.
+  std::atomic<HashTable*> hash_;
+  std::hash<K> hasher_;
+
+  std::atomic<uint64_t> epoch_{0};
+  // Number of readers registered in even and odd epochs.
+  std::atomic<int> readers_[2] = {{0}, {0}};
+  // Evicted items and replaced hash tables, which may still be used by readers,
+  // by parity of epoch in which they were retired.
+  std::vector<Item*> retired_[2] GUARDED_BY(mutex_);
+  std::vector<HashTable*> retired_tables_[2] GUARDED_BY(mutex_);
+
+  mutable Mutex mutex_{"cache shard"};
+};
+
+// Generic LRU cache. Thread-safe. Takes ownership of all values, which are
+// deleted upon eviction; thus, using values stored requires pinning them, which
+// in turn requires Unpin()ing them after use. The use of LruCacheLock is
+// recommend to automate this element-memory management.
+// Pinning doesn't lock anything: the pin keeps the value from being deleted
+// (though not from being evicted) by registering as a reader of the shard.
+// To keep threads from contending for one lock, the cache is split into
+// shards by key, each with its own lock and LRU queue. Capacity is split
+// evenly between shards, so the eviction order is only LRU within a shard.
+template <class K, class V>
+class LruCache {
+  static constexpr int kShardBits = 4;
+  static constexpr int kShards = 1 << kShardBits;
+
+ public:
+  LruCache(int capacity = 128) { SetCapacity(capacity); }
+
+  // Inserts the element under key @key with value @val.
+  // If the old element is pinned, it's still kept (until fully unpinned),
+  // but new lookups will return updated value.
+  // In any case, puts element to front of the queue (makes it last to evict).
+  void Insert(K key, std::unique_ptr<V> val) {
+    GetShard(key).Insert(key, std::move(val));
+  }
+
+  // Checks whether a key exists. Of course the next moment the key may be
+  // evicted.
+  bool ContainsKey(K key) { return GetShard(key).ContainsKey(key); }
+
+  // Looks up and pins the element by key. Returns nullptr if not found.
+  // If found, a call to Unpin must be made for each such element with the
+  // same @key and the @pin token returned.
+  // Use of LruCacheLock is recommended to automate this pin management.
+  V* LookupAndPin(K key, int* pin) {
+    auto& shard = GetShard(key);
+    *pin = shard.EnterReader();
+    V* value = shard.Lookup(key);
+    if (!value) shard.LeaveReader(*pin);
+    return value;
+  }
+
+  // Unpins the element given key and pin token. Use of LruCacheLock is
+  // recommended to automate this pin management.
+  void Unpin(K key, int pin) { GetShard(key).LeaveReader(pin); }
+
+  // Sets the total capacity of the cache. If new capacity of a shard is less
+  // than its current size, its oldest entries are evicted.
+  void SetCapacity(int capacity) {
+    capacity_.store(capacity, std::memory_order_relaxed);
+    for (int i = 0; i < kShards; ++i) {
+      shards_[i].SetCapacity(capacity / kShards +
+                             (i < capacity % kShards ? 1 : 0));
+    }
+  }
+
+  // Clears the cache;
+  void Clear() {
+    for (auto& shard : shards_) shard.Clear();
+  }
+
+  int GetSize() const {
+    int size = 0;
+    for (const auto& shard : shards_) size += shard.GetSize();
+    return size;
+  }
+  int GetCapacity() const { return capacity_.load(std::memory_order_relaxed); }
+
+  // Number of entries evicted to make room for new ones (or due to lower
+  // capacity), but not by Clear().
+  uint64_t GetEvictions() const {
+    uint64_t evictions = 0;
+    for (const auto& shard : shards_) evictions += shard.GetEvictions();
+    return evictions;
+  }
+  // Number of pins currently held.
+  int GetPinned() const {
+    int pinned = 0;
+    for (const auto& shard : shards_) pinned += shard.GetReaders();
+    return pinned;
+  }
+  // Number of evicted entries which are not deleted yet, as they may still be
+  // pinned.
+  int GetRetired() const {
+    int retired = 0;
+    for (const auto& shard : shards_) retired += shard.GetRetired();
+    return retired;
+  }
+
+ private:
+  LruCacheShard<K, V>& GetShard(K key) {
+    // Keys may be hashes already, so the shard is taken from the top bits of
+    // a multiplicative hash, to stay independent from the bucket in a shard.
+    const uint64_t hash = static_cast<uint64_t>(std::hash<K>()(key));
+    return shards_[(hash * 0x9E3779B97F4A7C15ull) >> (64 - kShardBits)];
+  }
 
-  mutable Mutex mutex_;
+  std::atomic<int> capacity_{0};
+  LruCacheShard<K, V> shards_[kShards];
 };
 
 // Convenience class for pinning cache items.
@@ -286,11 +418,11 @@ class LruCacheLock {
  public:
   // Looks up the value in @cache by @key and pins it if found.
   LruCacheLock(LruCache<K, V>* cache, K key)
-      : cache_(cache), key_(key), value_(cache->LookupAndPin(key_)) {}
+      : cache_(cache), key_(key), value_(cache->LookupAndPin(key_, &pin_)) {}
 
   // Unpins the cache entry (if holds).
   ~LruCacheLock() {
-    if (value_) cache_->Unpin(key_, value_);
+    if (value_) cache_->Unpin(key_, pin_);
   }
 
   LruCacheLock(const LruCacheLock&) = delete;
@@ -304,12 +436,16 @@ class LruCacheLock {
 
   LruCacheLock() {}
   LruCacheLock(LruCacheLock&& other)
-      : cache_(other.cache_), key_(other.key_), value_(other.value_) {
+      : cache_(other.cache_),
+        key_(other.key_),
+        pin_(other.pin_),
+        value_(other.value_) {
     other.value_ = nullptr;
   }
   void operator=(LruCacheLock&& other) {
     cache_ = other.cache_;
     key_ = other.key_;
+    pin_ = other.pin_;
     value_ = other.value_;
     other.value_ = nullptr;
   }
@@ -317,6 +453,7 @@ class LruCacheLock {
  private:
   LruCache<K, V>* cache_ = nullptr;
   K key_;
+  int pin_ = 0;
   V* value_ = nullptr;
 };
 
@@ -0,0 +1,104 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include <benchmark/benchmark.h>
+
+#include "utils/cache.h"
+
+namespace lczero {
+namespace {
+
+const int kCapacity = 200000;
+
+// Inserts and looks up keys of a cache shared by the benchmark's threads.
+// The keys are spread over twice the capacity, so about half of lookups hit
+// and inserts evict.
+class CacheFixture : public benchmark::Fixture {
+ public:
+  void SetUp(const benchmark::State& state) override {
+    if (state.thread_index() == 0) cache_.SetCapacity(kCapacity);
+  }
+  void TearDown(const benchmark::State& state) override {
+    if (state.thread_index() == 0) cache_.Clear();
+  }
+
+ protected:
+  // Key of the @i-th operation of thread @thread, as multiplicative hashes.
+  static uint64_t GetKey(int thread, uint64_t i) {
+    return ((i * 64 + thread) % (2 * kCapacity)) * 0x9E3779B97F4A7C15ull;
+  }
+
+  LruCache<uint64_t, int> cache_;
+};
+
+BENCHMARK_DEFINE_F(CacheFixture, Insert)(benchmark::State& state) {
+  uint64_t i = 0;
+  for (auto _ : state) {
+    cache_.Insert(GetKey(state.thread_index(), i++), std::make_unique<int>(1));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_REGISTER_F(CacheFixture, Insert)->ThreadRange(1, 16)->UseRealTime();
+
+BENCHMARK_DEFINE_F(CacheFixture, Lookup)(benchmark::State& state) {
+  if (state.thread_index() == 0) {
+    for (int i = 0; i < kCapacity; ++i) {
+      cache_.Insert(GetKey(0, i), std::make_unique<int>(i));
+    }
+  }
+  uint64_t i = 0;
+  for (auto _ : state) {
+    const uint64_t key = GetKey(state.thread_index(), i++);
+    LruCacheLock<uint64_t, int> lock(&cache_, key);
+    benchmark::DoNotOptimize(static_cast<bool>(lock));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_REGISTER_F(CacheFixture, Lookup)->ThreadRange(1, 16)->UseRealTime();
+
+// Mix of searches: every lookup which misses is followed by an insert.
+BENCHMARK_DEFINE_F(CacheFixture, LookupOrInsert)(benchmark::State& state) {
+  uint64_t i = 0;
+  for (auto _ : state) {
+    const uint64_t key = GetKey(state.thread_index(), i++);
+    bool found;
+    {
+      LruCacheLock<uint64_t, int> lock(&cache_, key);
+      found = lock;
+    }
+    if (!found) cache_.Insert(key, std::make_unique<int>(1));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_REGISTER_F(CacheFixture, LookupOrInsert)
+    ->ThreadRange(1, 16)
+    ->UseRealTime();
+
+}  // namespace
+}  // namespace lczero
+
+BENCHMARK_MAIN();
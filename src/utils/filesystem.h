@@ -27,6 +27,7 @@
 
 #pragma once
 
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <time.h>
@@ -48,4 +49,25 @@ uint64_t GetFileSize(const std::string& filename);
 // Returns modification time of a file. Throws exception if file doesn't exist.
 time_t GetFileTime(const std::string& filename);
 
+// Read-only memory mapping of a whole file. Contents appended to the file
+// after mapping are not visible. Throws exception if file cannot be mapped.
+class MappedFile {
+ public:
+  MappedFile(const std::string& filename);
+  ~MappedFile();
+
+  MappedFile(const MappedFile&) = delete;
+  void operator=(const MappedFile&) = delete;
+
+  const char* data() const { return data_; }
+  uint64_t size() const { return size_; }
+
+ private:
+  const char* data_ = nullptr;
+  uint64_t size_ = 0;
+  // Platform specific handles.
+  void* file_ = nullptr;
+  void* mapping_ = nullptr;
+};
+
 }  // namespace lczero
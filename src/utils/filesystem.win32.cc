@@ -71,4 +71,42 @@ time_t GetFileTime(const std::string& filename) {
          << 32) + s.ftLastWriteTime.dwLowDateTime;
 }
 
+MappedFile::MappedFile(const std::string& filename) {
+  HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ,
+                            FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    throw Exception("Cannot open file: " + filename);
+  }
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file, &size)) {
+    CloseHandle(file);
+    throw Exception("Cannot stat file: " + filename);
+  }
+  file_ = file;
+  size_ = size.QuadPart;
+  // Zero length mappings are not allowed.
+  if (size_ == 0) return;
+  HANDLE mapping =
+      CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (!mapping) {
+    CloseHandle(file);
+    throw Exception("Cannot map file: " + filename);
+  }
+  mapping_ = mapping;
+  data_ = static_cast<const char*>(
+      MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+  if (!data_) {
+    CloseHandle(mapping);
+    CloseHandle(file);
+    throw Exception("Cannot map file: " + filename);
+  }
+}
+
+MappedFile::~MappedFile() {
+  if (data_) UnmapViewOfFile(data_);
+  if (mapping_) CloseHandle(mapping_);
+  if (file_) CloseHandle(file_);
+}
+
 }  // namespace lczero
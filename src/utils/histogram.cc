@@ -29,6 +29,7 @@
 #include <cmath>
 #include <iomanip>
 #include <iostream>
+#include <sstream>
 #include <stdio.h>
 #include <string.h>
 #include "utils/histogram.h"
@@ -134,4 +135,79 @@ int Histogram::GetIndex(double val) const {
   return index + 2;
 }
 
+ConcurrentHistogram::ConcurrentHistogram(int min_exp, int max_exp,
+                                         int minor_scales)
+    : min_exp_(min_exp),
+      minor_scales_(minor_scales),
+      // One more at each end, for samples out of the range.
+      num_buckets_((max_exp - min_exp) * minor_scales + 2),
+      buckets_(new std::atomic<uint64_t>[num_buckets_]) {
+  for (int i = 0; i < num_buckets_; ++i) buckets_[i] = 0;
+}
+
+int ConcurrentHistogram::GetIndex(double value) const {
+  if (value <= 0) return 0;
+  const double index =
+      std::floor(minor_scales_ * (std::log10(value) - min_exp_)) + 1;
+  if (index < 0) return 0;
+  if (index >= num_buckets_ - 1) return num_buckets_ - 1;
+  return static_cast<int>(index);
+}
+
+void ConcurrentHistogram::Add(double value) {
+  buckets_[GetIndex(value)].fetch_add(1, std::memory_order_relaxed);
+  double sum = sum_.load(std::memory_order_relaxed);
+  while (!sum_.compare_exchange_weak(sum, sum + value,
+                                     std::memory_order_relaxed)) {
+  }
+  double max = max_.load(std::memory_order_relaxed);
+  while (value > max &&
+         !max_.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+  }
+}
+
+ConcurrentHistogram::Snapshot ConcurrentHistogram::GetSnapshot(bool reset) {
+  Snapshot result;
+  result.min_exp = min_exp_;
+  result.minor_scales = minor_scales_;
+  result.buckets.resize(num_buckets_);
+  // Buckets are read one by one, and the count is taken from them, so that
+  // it matches the buckets even with concurrent samples.
+  for (int i = 0; i < num_buckets_; ++i) {
+    result.buckets[i] = reset ? buckets_[i].exchange(0) : buckets_[i].load();
+    result.count += result.buckets[i];
+  }
+  if (reset) {
+    result.sum = sum_.exchange(0);
+    result.max = max_.exchange(0);
+  } else {
+    result.sum = sum_;
+    result.max = max_;
+  }
+  return result;
+}
+
+double ConcurrentHistogram::Snapshot::GetPercentile(double fraction) const {
+  if (count == 0) return 0;
+  const uint64_t rank =
+      std::min(count - 1, static_cast<uint64_t>(fraction * count));
+  uint64_t seen = 0;
+  size_t index = 0;
+  while (seen + buckets[index] <= rank) seen += buckets[index++];
+  if (index == 0) return std::min(max, std::pow(10.0, min_exp));
+  if (index == buckets.size() - 1) return max;
+  // Bucket i covers [10^(min_exp + (i-1)/minor_scales), next bound).
+  const double middle =
+      std::pow(10.0, min_exp + (index - 0.5) / minor_scales);
+  return std::min(max, middle);
+}
+
+std::string ConcurrentHistogram::Snapshot::DebugString() const {
+  std::ostringstream oss;
+  oss << "p50 " << GetPercentile(0.5) << " p90 " << GetPercentile(0.9)
+      << " p99 " << GetPercentile(0.99) << " max " << max << " count "
+      << count;
+  return oss.str();
+}
+
 }  // namespace lczero
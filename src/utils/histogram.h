@@ -27,7 +27,10 @@
 
 #pragma once
 
+#include <atomic>
 #include <cstddef>
+#include <cstdint>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -87,4 +90,48 @@ class Histogram {
   double max_;
 };
 
+// Distribution of non-negative samples (such as latencies), for percentiles.
+// Samples are counted in buckets with logarithmic bounds, minor_scales per
+// power of 10 from 10^min_exp to 10^max_exp, so percentiles are accurate to
+// a bucket. Add() may be called concurrently from any threads, and doesn't
+// lock.
+class ConcurrentHistogram {
+ public:
+  // Samples added since the last reset.
+  struct Snapshot {
+    uint64_t count = 0;
+    double sum = 0;
+    double max = 0;
+    // Middle of the bucket of the @fraction quantile, or max if that's less.
+    // 0 if there are no samples.
+    double GetPercentile(double fraction) const;
+    double GetMean() const { return count ? sum / count : 0; }
+    // "p50 <> p90 <> p99 <> max <> count <>".
+    std::string DebugString() const;
+
+    std::vector<uint64_t> buckets;
+    int min_exp = 0;
+    int minor_scales = 0;
+  };
+
+  // By default from 1 nanosecond to 100 seconds, for times in seconds.
+  ConcurrentHistogram(int min_exp = -9, int max_exp = 2,
+                      int minor_scales = 10);
+
+  void Add(double value);
+  // Returns samples added so far. With @reset, they are removed, and samples
+  // added concurrently go either to this snapshot or the next one.
+  Snapshot GetSnapshot(bool reset = false);
+
+ private:
+  int GetIndex(double value) const;
+
+  const int min_exp_;
+  const int minor_scales_;
+  const int num_buckets_;
+  std::unique_ptr<std::atomic<uint64_t>[]> buckets_;
+  std::atomic<double> sum_{0};
+  std::atomic<double> max_{0};
+};
+
 }  // namespace lczero
@@ -0,0 +1,96 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "utils/histogram.h"
+#include <gtest/gtest.h>
+
+#include <thread>
+#include <vector>
+
+namespace lczero {
+
+TEST(ConcurrentHistogram, Percentiles) {
+  ConcurrentHistogram histogram;
+  // 1..1000 microseconds.
+  for (int i = 1; i <= 1000; ++i) histogram.Add(i * 1e-6);
+  const auto snapshot = histogram.GetSnapshot();
+  EXPECT_EQ(snapshot.count, 1000u);
+  EXPECT_DOUBLE_EQ(snapshot.max, 1e-3);
+  EXPECT_NEAR(snapshot.GetMean(), 500.5e-6, 1e-9);
+  // Buckets are 10 per power of 10, so within 13% of the value.
+  EXPECT_NEAR(snapshot.GetPercentile(0.5), 500e-6, 65e-6);
+  EXPECT_NEAR(snapshot.GetPercentile(0.9), 900e-6, 117e-6);
+  EXPECT_LE(snapshot.GetPercentile(0.99), 1e-3);
+  EXPECT_DOUBLE_EQ(snapshot.GetPercentile(1.0), 1e-3);
+  EXPECT_LT(snapshot.GetPercentile(0.0), 1.3e-6);
+}
+
+TEST(ConcurrentHistogram, OutOfRange) {
+  ConcurrentHistogram histogram(-3, 0, 5);
+  histogram.Add(0);
+  histogram.Add(1e-6);
+  histogram.Add(100);
+  const auto snapshot = histogram.GetSnapshot();
+  EXPECT_EQ(snapshot.count, 3u);
+  EXPECT_DOUBLE_EQ(snapshot.GetPercentile(0.0), 1e-3);
+  EXPECT_DOUBLE_EQ(snapshot.GetPercentile(1.0), 100);
+}
+
+TEST(ConcurrentHistogram, ResetOnRead) {
+  ConcurrentHistogram histogram;
+  histogram.Add(1.0);
+  EXPECT_EQ(histogram.GetSnapshot(true).count, 1u);
+  const auto snapshot = histogram.GetSnapshot();
+  EXPECT_EQ(snapshot.count, 0u);
+  EXPECT_EQ(snapshot.max, 0);
+  EXPECT_EQ(snapshot.GetPercentile(0.5), 0);
+}
+
+TEST(ConcurrentHistogram, ConcurrentAdds) {
+  ConcurrentHistogram histogram;
+  const int kThreads = 4;
+  const int kSamples = 100000;
+  uint64_t taken = 0;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kThreads; ++i) {
+    threads.emplace_back([&histogram]() {
+      for (int j = 0; j < kSamples; ++j) histogram.Add(1e-3);
+    });
+  }
+  // Snapshots which are reset while samples are added lose none of them.
+  for (int i = 0; i < 10; ++i) taken += histogram.GetSnapshot(true).count;
+  for (auto& thread : threads) thread.join();
+  taken += histogram.GetSnapshot(true).count;
+  EXPECT_EQ(taken, static_cast<uint64_t>(kThreads * kSamples));
+}
+
+}  // namespace lczero
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
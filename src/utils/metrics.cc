@@ -0,0 +1,269 @@
+/*
+ This file is part of Leela Chess Zero.
+ Copyright (C) 2018 The LCZero Authors
+
+ Leela Chess is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ Leela Chess is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+ Additional permission under GNU GPL version 3 section 7
+
+ If you modify this Program, or any covered work, by linking or
+ combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+ Toolkit and the the NVIDIA CUDA Deep Neural Network library (or a
+ modified version of those libraries), containing parts covered by the
+ terms of the respective license agreement, the licensors of this
+ Program grant you additional permission to convey the resulting work.
+ */
+
+#include "utils/metrics.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include "utils/exception.h"
+#include "utils/socket.h"
+
+namespace lczero {
+
+namespace {
+const double kQuantiles[] = {0.5, 0.9, 0.99};
+const char* kQuantileNames[] = {"p50", "p90", "p99"};
+const int kMaxRequestSize = 8192;
+}  // namespace
+
+Metrics& Metrics::Get() {
+  static Metrics metrics;
+  return metrics;
+}
+
+Metrics::Metric* Metrics::GetMetric(const std::string& name,
+                                    const std::string& help, Type type) {
+  Mutex::Lock lock(mutex_);
+  auto iter = metrics_.find(name);
+  if (iter == metrics_.end()) {
+    Metric metric;
+    metric.type = type;
+    metric.help = help;
+    switch (type) {
+      case Type::kCounter:
+        metric.counter = std::make_unique<MetricsCounter>();
+        break;
+      case Type::kGauge:
+        metric.gauge = std::make_unique<MetricsGauge>();
+        break;
+      case Type::kHistogram:
+        metric.histogram = std::make_unique<ConcurrentHistogram>();
+        break;
+    }
+    iter = metrics_.emplace(name, std::move(metric)).first;
+  }
+  if (iter->second.type != type) {
+    throw Exception("Metric " + name + " is registered with another type");
+  }
+  return &iter->second;
+}
+
+MetricsCounter* Metrics::GetCounter(const std::string& name,
+                                    const std::string& help) {
+  return GetMetric(name, help, Type::kCounter)->counter.get();
+}
+
+MetricsGauge* Metrics::GetGauge(const std::string& name,
+                                const std::string& help) {
+  return GetMetric(name, help, Type::kGauge)->gauge.get();
+}
+
+ConcurrentHistogram* Metrics::GetHistogram(const std::string& name,
+                                           const std::string& help) {
+  return GetMetric(name, help, Type::kHistogram)->histogram.get();
+}
+
+void Metrics::AddCollector(const void* owner,
+                           std::function<void()> collector) {
+  Mutex::Lock lock(collectors_mutex_);
+  collectors_.emplace_back(owner, std::move(collector));
+}
+
+void Metrics::RemoveCollectors(const void* owner) {
+  Mutex::Lock lock(collectors_mutex_);
+  collectors_.erase(
+      std::remove_if(collectors_.begin(), collectors_.end(),
+                     [owner](const std::pair<const void*,
+                                             std::function<void()>>& entry) {
+                       return entry.first == owner;
+                     }),
+      collectors_.end());
+}
+
+void Metrics::RunCollectors() {
+  Mutex::Lock lock(collectors_mutex_);
+  for (const auto& entry : collectors_) entry.second();
+}
+
+std::string Metrics::ToPrometheusText() {
+  RunCollectors();
+  std::ostringstream oss;
+  Mutex::Lock lock(mutex_);
+  for (const auto& entry : metrics_) {
+    const std::string& name = entry.first;
+    const Metric& metric = entry.second;
+    oss << "# HELP " << name << " " << metric.help << "\n";
+    switch (metric.type) {
+      case Type::kCounter:
+        oss << "# TYPE " << name << " counter\n"
+            << name << " " << metric.counter->Get() << "\n";
+        break;
+      case Type::kGauge:
+        oss << "# TYPE " << name << " gauge\n"
+            << name << " " << metric.gauge->Get() << "\n";
+        break;
+      case Type::kHistogram: {
+        const auto snapshot = metric.histogram->GetSnapshot();
+        oss << "# TYPE " << name << " summary\n";
+        for (const double quantile : kQuantiles) {
+          oss << name << "{quantile=\"" << quantile << "\"} "
+              << snapshot.GetPercentile(quantile) << "\n";
+        }
+        oss << name << "_sum " << snapshot.sum << "\n"
+            << name << "_count " << snapshot.count << "\n";
+        break;
+      }
+    }
+  }
+  return oss.str();
+}
+
+std::string Metrics::ToJson() {
+  RunCollectors();
+  std::ostringstream oss;
+  oss << "{\"time\":"
+      << std::chrono::duration_cast<std::chrono::seconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+             .count();
+  Mutex::Lock lock(mutex_);
+  for (const auto& entry : metrics_) {
+    const Metric& metric = entry.second;
+    oss << ",\"" << entry.first << "\":";
+    switch (metric.type) {
+      case Type::kCounter:
+        oss << metric.counter->Get();
+        break;
+      case Type::kGauge:
+        oss << metric.gauge->Get();
+        break;
+      case Type::kHistogram: {
+        const auto snapshot = metric.histogram->GetSnapshot();
+        oss << "{\"count\":" << snapshot.count << ",\"sum\":" << snapshot.sum;
+        for (int i = 0; i < 3; ++i) {
+          oss << ",\"" << kQuantileNames[i]
+              << "\":" << snapshot.GetPercentile(kQuantiles[i]);
+        }
+        oss << ",\"max\":" << snapshot.max << "}";
+        break;
+      }
+    }
+  }
+  oss << "}";
+  return oss.str();
+}
+
+MetricsExporter::MetricsExporter(int port, const std::string& json_path,
+                                 int interval_seconds)
+    : port_(port),
+      json_path_(json_path),
+      interval_seconds_(interval_seconds) {
+  if (port_ != 0) {
+    server_ = std::make_unique<ServerSocket>(port_);
+    http_thread_ = std::thread([this]() { ServeHttp(); });
+  }
+  if (!json_path_.empty()) {
+    json_thread_ = std::thread([this]() { WriteJson(); });
+  }
+}
+
+MetricsExporter::~MetricsExporter() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  if (json_thread_.joinable()) json_thread_.join();
+  if (http_thread_.joinable()) {
+    // Accept() is woken up by a connection.
+    try {
+      Socket socket("localhost", port_);
+      http_thread_.join();
+    } catch (Exception&) {
+      // The thread may still use the server, so both are left behind.
+      http_thread_.detach();
+      server_.release();
+    }
+  }
+}
+
+void MetricsExporter::ServeHttp() {
+  while (true) {
+    std::unique_ptr<Socket> socket;
+    try {
+      socket = server_->Accept();
+    } catch (Exception& ex) {
+      std::cerr << "Metrics server stopped: " << ex.what() << std::endl;
+      return;
+    }
+    if (stop_) return;
+    // Requests are read until the end of headers and then ignored, whatever
+    // was asked for gets the metrics.
+    try {
+      std::string request;
+      char buffer[1024];
+      while (request.find("\r\n\r\n") == std::string::npos &&
+             request.size() < kMaxRequestSize) {
+        const size_t size = socket->ReceiveSome(buffer, sizeof(buffer));
+        if (size == 0) break;
+        request.append(buffer, size);
+      }
+      const std::string body = Metrics::Get().ToPrometheusText();
+      const std::string response =
+          "HTTP/1.0 200 OK\r\n"
+          "Content-Type: text/plain; version=0.0.4\r\n"
+          "Content-Length: " +
+          std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" +
+          body;
+      socket->Send(response.data(), response.size());
+    } catch (Exception&) {
+      // The client is gone, nothing to do about it.
+    }
+  }
+}
+
+void MetricsExporter::WriteJson() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    // The last line is written when stopping, so that the totals are there.
+    const bool stopping =
+        cv_.wait_for(lock, std::chrono::seconds(interval_seconds_),
+                     [this]() { return stop_.load(); });
+    std::ofstream file(json_path_, std::ios::app);
+    if (!file) {
+      std::cerr << "Cannot write metrics to " << json_path_ << std::endl;
+    } else {
+      file << Metrics::Get().ToJson() << std::endl;
+    }
+    if (stopping) return;
+  }
+}
+
+}  // namespace lczero
@@ -0,0 +1,151 @@
+/*
+ This file is part of Leela Chess Zero.
+ Copyright (C) 2018 The LCZero Authors
+
+ Leela Chess is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ Leela Chess is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+ Additional permission under GNU GPL version 3 section 7
+
+ If you modify this Program, or any covered work, by linking or
+ combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+ Toolkit and the the NVIDIA CUDA Deep Neural Network library (or a
+ modified version of those libraries), containing parts covered by the
+ terms of the respective license agreement, the licensors of this
+ Program grant you additional permission to convey the resulting work.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "utils/histogram.h"
+#include "utils/mutex.h"
+
+namespace lczero {
+
+class ServerSocket;
+
+// Monotonically growing count of events.
+class MetricsCounter {
+ public:
+  void Add(int64_t value = 1) {
+    value_.fetch_add(value, std::memory_order_relaxed);
+  }
+  int64_t Get() const { return value_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<int64_t> value_{0};
+};
+
+// Value which may go up and down.
+class MetricsGauge {
+ public:
+  void Set(double value) { value_.store(value, std::memory_order_relaxed); }
+  double Get() const { return value_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<double> value_{0};
+};
+
+// Registry of named metrics of the process, for monitoring of many processes
+// (selfplay farms). Metrics are created on first use and live until the end
+// of the process, so callers look them up once and keep the pointers. Names
+// follow Prometheus conventions: lc0_<what>_<unit>, with _total for counters.
+// Updates are single atomic operations, cheap enough for once per batch, not
+// for once per node.
+class Metrics {
+ public:
+  static Metrics& Get();
+
+  // Return the metric @name, which is created with @help text if it doesn't
+  // exist yet.
+  MetricsCounter* GetCounter(const std::string& name, const std::string& help);
+  MetricsGauge* GetGauge(const std::string& name, const std::string& help);
+  // Samples are exported as count, sum and quantiles 0.5, 0.9 and 0.99 of
+  // all of them since the start.
+  ConcurrentHistogram* GetHistogram(const std::string& name,
+                                    const std::string& help);
+
+  // Adds @collector, called before metrics are exported, to update gauges
+  // from statistics which are kept elsewhere. Collectors of @owner are
+  // removed with RemoveCollectors(), which has to be called before @owner
+  // is destroyed.
+  void AddCollector(const void* owner, std::function<void()> collector);
+  void RemoveCollectors(const void* owner);
+
+  // Returns all metrics in Prometheus text exposition format.
+  std::string ToPrometheusText();
+  // Returns all metrics as one line of JSON, with the time in seconds since
+  // the epoch: {"time":1537000000,"lc0_games_total":12,...}. Histograms are
+  // objects of count, sum, p50, p90, p99 and max.
+  std::string ToJson();
+
+ private:
+  Metrics() = default;
+  void RunCollectors();
+
+  enum class Type { kCounter, kGauge, kHistogram };
+  struct Metric {
+    Type type;
+    std::string help;
+    std::unique_ptr<MetricsCounter> counter;
+    std::unique_ptr<MetricsGauge> gauge;
+    std::unique_ptr<ConcurrentHistogram> histogram;
+  };
+  Metric* GetMetric(const std::string& name, const std::string& help,
+                    Type type);
+
+  Mutex mutex_;
+  // Sorted by name, for stable output.
+  std::map<std::string, Metric> metrics_ GUARDED_BY(mutex_);
+  // Collectors are run under their own lock, as they may register metrics.
+  Mutex collectors_mutex_ ACQUIRED_BEFORE(mutex_);
+  std::vector<std::pair<const void*, std::function<void()>>> collectors_
+      GUARDED_BY(collectors_mutex_);
+};
+
+// Exports Metrics of the process while it exists: serves them over HTTP in
+// Prometheus format (GET of any path) on @port, unless it's 0, and appends
+// them as a JSON line to file @json_path every @interval_seconds, unless the
+// path is empty. Throws exception if the port can't be listened on.
+class MetricsExporter {
+ public:
+  MetricsExporter(int port, const std::string& json_path,
+                  int interval_seconds);
+  ~MetricsExporter();
+
+ private:
+  void ServeHttp();
+  void WriteJson();
+
+  const int port_;
+  const std::string json_path_;
+  const int interval_seconds_;
+  std::unique_ptr<ServerSocket> server_;
+  std::atomic<bool> stop_{false};
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::thread http_thread_;
+  std::thread json_thread_;
+};
+
+}  // namespace lczero
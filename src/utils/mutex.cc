@@ -0,0 +1,123 @@
+/*
+ This file is part of Leela Chess Zero.
+ Copyright (C) 2018 The LCZero Authors
+
+ Leela Chess is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ Leela Chess is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+ Additional permission under GNU GPL version 3 section 7
+
+ If you modify this Program, or any covered work, by linking or
+ combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+ Toolkit and the the NVIDIA CUDA Deep Neural Network library (or a
+ modified version of those libraries), containing parts covered by the
+ terms of the respective license agreement, the licensors of this
+ Program grant you additional permission to convey the resulting work.
+ */
+
+#include "utils/mutex.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <deque>
+#include <string>
+#include <vector>
+
+namespace lczero {
+
+#ifdef LOCK_PROFILING
+namespace {
+
+struct NamedLockStats {
+  std::string name;
+  LockStats stats;
+};
+
+// Never destroyed, as locks may still be used while static objects go away.
+struct LockRegistry {
+  std::mutex mutex;
+  // Deque keeps the stats at the same address as it grows.
+  std::deque<NamedLockStats> stats;
+};
+
+LockRegistry* GetLockRegistry() {
+  static LockRegistry* registry = new LockRegistry();
+  return registry;
+}
+
+// Dumps the statistics when the program exits.
+struct LockStatsDumper {
+  ~LockStatsDumper() { DumpLockStats(); }
+} lock_stats_dumper;
+
+}  // namespace
+
+LockStats* GetLockStats(const char* name) {
+  LockRegistry* registry = GetLockRegistry();
+  std::lock_guard<std::mutex> lock(registry->mutex);
+  for (auto& entry : registry->stats) {
+    if (entry.name == name) return &entry.stats;
+  }
+  registry->stats.emplace_back();
+  registry->stats.back().name = name;
+  return &registry->stats.back().stats;
+}
+
+void DumpLockStats() {
+  struct Row {
+    std::string name;
+    uint64_t acquisitions;
+    uint64_t contended;
+    uint64_t wait_ns;
+  };
+  std::vector<Row> rows;
+  {
+    LockRegistry* registry = GetLockRegistry();
+    std::lock_guard<std::mutex> lock(registry->mutex);
+    for (const auto& entry : registry->stats) {
+      rows.push_back({entry.name, entry.stats.acquisitions.load(),
+                      entry.stats.contended.load(),
+                      entry.stats.wait_ns.load()});
+    }
+  }
+  std::sort(rows.begin(), rows.end(), [](const Row& a, const Row& b) {
+    return a.wait_ns > b.wait_ns;
+  });
+
+  std::fprintf(stderr, "%-24s %14s %12s %9s %12s %12s\n", "lock",
+               "acquisitions", "contended", "cont_%", "wait_ms",
+               "avg_wait_us");
+  for (const auto& row : rows) {
+    const double contended_pct =
+        row.acquisitions ? 100.0 * row.contended / row.acquisitions : 0.0;
+    const double avg_wait_us =
+        row.contended ? row.wait_ns / 1e3 / row.contended : 0.0;
+    std::fprintf(stderr, "%-24s %14llu %12llu %9.2f %12.3f %12.3f\n",
+                 row.name.c_str(),
+                 static_cast<unsigned long long>(row.acquisitions),
+                 static_cast<unsigned long long>(row.contended),
+                 contended_pct, row.wait_ns / 1e6, avg_wait_us);
+  }
+}
+
+#else
+
+void DumpLockStats() {
+  std::fprintf(stderr,
+               "Lock statistics are only recorded by builds with "
+               "-Dlock_profiling=true.\n");
+}
+
+#endif
+
+}  // namespace lczero
@@ -28,29 +28,94 @@
 #pragma once
 
 #include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <mutex>
 #include <shared_mutex>
 #include "utils/cppattributes.h"
+#include "utils/trace.h"
 
 namespace lczero {
 
+// Lock contention profiling. Builds with LOCK_PROFILING defined count, for
+// every lock name, acquisitions, contended acquisitions (those which had to
+// wait for another thread) and the total time waited. Waits on condition
+// variables, which go through get_raw(), are not counted.
+#ifdef LOCK_PROFILING
+struct LockStats {
+  std::atomic<uint64_t> acquisitions{0};
+  std::atomic<uint64_t> contended{0};
+  std::atomic<uint64_t> wait_ns{0};
+};
+
+// Returns the statistics shared by all locks named @name.
+LockStats* GetLockStats(const char* name);
+#endif
+
+// Prints the statistics of all locks to stderr, most waited for first. Also
+// done on exit of LOCK_PROFILING builds.
+void DumpLockStats();
+
+// Acquires a lock, and in LOCK_PROFILING builds records the acquisition.
+class LockProfile {
+ public:
+#ifdef LOCK_PROFILING
+  LockProfile(const char* name) : stats_(GetLockStats(name)) {}
+
+  // Acquires with @try_lock, and only if it fails waits with @lock.
+  template <typename TryLock, typename Lock>
+  void Acquire(TryLock try_lock, Lock lock) {
+    stats_->acquisitions.fetch_add(1, std::memory_order_relaxed);
+    if (try_lock()) return;
+    const auto start = std::chrono::steady_clock::now();
+    lock();
+    const auto wait = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start);
+    stats_->contended.fetch_add(1, std::memory_order_relaxed);
+    stats_->wait_ns.fetch_add(wait.count(), std::memory_order_relaxed);
+  }
+
+ private:
+  LockStats* const stats_;
+#else
+  LockProfile(const char*) {}
+
+  template <typename TryLock, typename Lock>
+  void Acquire(TryLock, Lock lock) {
+    lock();
+  }
+#endif
+};
+
 // Implementation of reader-preferenced shared mutex. Based on fair shared
 // mutex.
 class CAPABILITY("mutex") RpSharedMutex {
  public:
-  RpSharedMutex() : waiting_readers_(0) {}
+  // @name groups the lock statistics of LOCK_PROFILING builds.
+  RpSharedMutex(const char* name = "unnamed")
+      : waiting_readers_(0), profile_(name) {}
 
   void lock() ACQUIRE() {
-    while (true) {
-      mutex_.lock();
-      if (waiting_readers_ == 0) return;
-      mutex_.unlock();
-    }
+    profile_.Acquire(
+        [this]() {
+          if (!mutex_.try_lock()) return false;
+          if (waiting_readers_ == 0) return true;
+          mutex_.unlock();
+          return false;
+        },
+        [this]() {
+          while (true) {
+            mutex_.lock();
+            if (waiting_readers_ == 0) return;
+            mutex_.unlock();
+          }
+        });
   }
   void unlock() RELEASE() { mutex_.unlock(); }
   void lock_shared() ACQUIRE_SHARED() {
     ++waiting_readers_;
-    mutex_.lock_shared();
+    profile_.Acquire([this]() { return mutex_.try_lock_shared(); },
+                     [this]() { mutex_.lock_shared(); });
   }
   void unlock_shared() RELEASE_SHARED() {
     --waiting_readers_;
@@ -60,6 +125,7 @@ class CAPABILITY("mutex") RpSharedMutex {
  private:
   std::shared_timed_mutex mutex_;
   std::atomic<int> waiting_readers_;
+  LockProfile profile_;
 };
 
 // std::mutex wrapper for clang thread safety annotation.
@@ -68,19 +134,40 @@ class CAPABILITY("mutex") Mutex {
   // std::unique_lock<std::mutex> wrapper.
   class SCOPED_CAPABILITY Lock {
    public:
-    Lock(Mutex& m) ACQUIRE(m) : lock_(m.get_raw()) {}
+    Lock(Mutex& m) ACQUIRE(m) : lock_(m.get_raw(), std::defer_lock) {
+      m.profile_.Acquire([this]() { return lock_.try_lock(); },
+                         [this]() { lock_.lock(); });
+    }
+    // Same, and records the wait as event @wait_event of the Tracer if the
+    // mutex is held by another thread.
+    Lock(Mutex& m, const char* wait_event) ACQUIRE(m)
+        : lock_(m.get_raw(), std::defer_lock) {
+      m.profile_.Acquire([this]() { return lock_.try_lock(); },
+                         [this, wait_event]() {
+                           if (lock_.try_lock()) return;
+                           TraceScope trace(wait_event, "lock");
+                           lock_.lock();
+                         });
+    }
     ~Lock() RELEASE() {}
 
    private:
     std::unique_lock<std::mutex> lock_;
   };
 
-  void lock() ACQUIRE() { mutex_.lock(); }
+  // @name groups the lock statistics of LOCK_PROFILING builds.
+  Mutex(const char* name = "unnamed") : profile_(name) {}
+
+  void lock() ACQUIRE() {
+    profile_.Acquire([this]() { return mutex_.try_lock(); },
+                     [this]() { mutex_.lock(); });
+  }
   void unlock() RELEASE() { mutex_.unlock(); }
   std::mutex& get_raw() { return mutex_; }
 
  private:
   std::mutex mutex_;
+  LockProfile profile_;
 };
 
 // std::shared_mutex wrapper for clang thread safety annotation.
@@ -89,7 +176,10 @@ class CAPABILITY("mutex") SharedMutex {
   // std::unique_lock<std::shared_mutex> wrapper.
   class SCOPED_CAPABILITY Lock {
    public:
-    Lock(SharedMutex& m) ACQUIRE(m) : lock_(m.get_raw()) {}
+    Lock(SharedMutex& m) ACQUIRE(m) : lock_(m.get_raw(), std::defer_lock) {
+      m.profile_.Acquire([this]() { return lock_.try_lock(); },
+                         [this]() { lock_.lock(); });
+    }
     ~Lock() RELEASE() {}
 
    private:
@@ -99,22 +189,36 @@ class CAPABILITY("mutex") SharedMutex {
   // std::shared_lock<std::shared_mutex> wrapper.
   class SCOPED_CAPABILITY SharedLock {
    public:
-    SharedLock(SharedMutex& m) ACQUIRE_SHARED(m) : lock_(m.get_raw()) {}
+    SharedLock(SharedMutex& m) ACQUIRE_SHARED(m)
+        : lock_(m.get_raw(), std::defer_lock) {
+      m.profile_.Acquire([this]() { return lock_.try_lock(); },
+                         [this]() { lock_.lock(); });
+    }
     ~SharedLock() RELEASE() {}
 
    private:
     std::shared_lock<std::shared_timed_mutex> lock_;
   };
 
-  void lock() ACQUIRE() { mutex_.lock(); }
+  // @name groups the lock statistics of LOCK_PROFILING builds.
+  SharedMutex(const char* name = "unnamed") : profile_(name) {}
+
+  void lock() ACQUIRE() {
+    profile_.Acquire([this]() { return mutex_.try_lock(); },
+                     [this]() { mutex_.lock(); });
+  }
   void unlock() RELEASE() { mutex_.unlock(); }
-  void lock_shared() ACQUIRE_SHARED() { mutex_.lock_shared(); }
+  void lock_shared() ACQUIRE_SHARED() {
+    profile_.Acquire([this]() { return mutex_.try_lock_shared(); },
+                     [this]() { mutex_.lock_shared(); });
+  }
   void unlock_shared() RELEASE_SHARED() { mutex_.unlock_shared(); }
 
   std::shared_timed_mutex& get_raw() { return mutex_; }
 
  private:
   std::shared_timed_mutex mutex_;
+  LockProfile profile_;
 };
 
 }  // namespace lczero
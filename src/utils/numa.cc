@@ -0,0 +1,230 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "utils/numa.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include "utils/exception.h"
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace lczero {
+
+namespace {
+
+enum class Binding { kNone, kNode, kCore };
+
+std::atomic<Binding> binding{Binding::kNone};
+// Threads bound so far, to spread them over the nodes.
+std::atomic<int> bound_threads{0};
+
+struct Node {
+  int id;
+  std::vector<int> cpus;
+  // Threads bound to the node so far, to spread them over its cores.
+  std::unique_ptr<std::atomic<int>> bound_threads{new std::atomic<int>(0)};
+};
+
+// Parses lists like "0-3,8,10-11" of sysfs.
+std::vector<int> ParseCpuList(const std::string& list) {
+  std::vector<int> result;
+  std::istringstream stream(list);
+  std::string range;
+  while (std::getline(stream, range, ',')) {
+    if (range.empty() || !isdigit(range[0])) continue;
+    const auto dash = range.find('-');
+    const int first = std::stoi(range.substr(0, dash));
+    const int last =
+        dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+    for (int i = first; i <= last; ++i) result.push_back(i);
+  }
+  return result;
+}
+
+std::string ReadLine(const std::string& filename) {
+  std::ifstream file(filename);
+  std::string line;
+  std::getline(file, line);
+  return line;
+}
+
+// Nodes with cores, the host is a single node if sysfs is not there.
+const std::vector<Node>& GetNodes() {
+  static const std::vector<Node> nodes = []() {
+    std::vector<Node> nodes;
+    const std::string sysfs = "/sys/devices/system/node/";
+    for (const int id : ParseCpuList(ReadLine(sysfs + "online"))) {
+      Node node;
+      node.id = id;
+      node.cpus = ParseCpuList(
+          ReadLine(sysfs + "node" + std::to_string(id) + "/cpulist"));
+      if (!node.cpus.empty()) nodes.push_back(std::move(node));
+    }
+    return nodes;
+  }();
+  return nodes;
+}
+
+#ifdef __linux__
+// Memory policy modes of <linux/mempolicy.h>.
+const int kMpolDefault = 0;
+const int kMpolPreferred = 1;
+const int kMpolInterleave = 3;
+const unsigned long kMaxNodes = 16 * 8 * sizeof(unsigned long);
+
+// Sets @mask to the nodes with cores.
+void GetAllNodesMask(unsigned long* mask) {
+  for (const auto& node : GetNodes()) {
+    if (static_cast<unsigned long>(node.id) >= kMaxNodes) continue;
+    mask[node.id / (8 * sizeof(unsigned long))] |=
+        1ul << (node.id % (8 * sizeof(unsigned long)));
+  }
+}
+#endif
+
+}  // namespace
+
+std::vector<std::string> Numa::GetBindingChoices() {
+  return {"none", "node", "core"};
+}
+
+void Numa::SetBinding(const std::string& value) {
+  if (value == "none") {
+    binding = Binding::kNone;
+  } else if (value == "node") {
+    binding = Binding::kNode;
+  } else if (value == "core") {
+    binding = Binding::kCore;
+  } else {
+    throw Exception("Unknown NUMA binding: " + value);
+  }
+}
+
+int Numa::GetNodeCount() {
+  return std::max<int>(1, GetNodes().size());
+}
+
+void Numa::BindThread(int node_id) {
+#ifdef __linux__
+  const Binding mode = binding.load();
+  const auto& nodes = GetNodes();
+  if (mode == Binding::kNone || nodes.empty()) return;
+  const Node* node = &nodes[bound_threads++ % nodes.size()];
+  if (node_id >= 0) {
+    const auto iter =
+        std::find_if(nodes.begin(), nodes.end(),
+                     [node_id](const Node& n) { return n.id == node_id; });
+    if (iter == nodes.end()) return;
+    node = &*iter;
+  }
+
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  if (mode == Binding::kCore) {
+    const int idx = (*node->bound_threads)++ % node->cpus.size();
+    CPU_SET(node->cpus[idx], &cpus);
+  } else {
+    for (const int cpu : node->cpus) CPU_SET(cpu, &cpus);
+  }
+  pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+  if (static_cast<unsigned long>(node->id) < kMaxNodes) {
+    unsigned long mask[16] = {};
+    mask[node->id / (8 * sizeof(unsigned long))] =
+        1ul << (node->id % (8 * sizeof(unsigned long)));
+    syscall(SYS_set_mempolicy, kMpolPreferred, mask, kMaxNodes);
+  }
+#else
+  (void)node_id;
+#endif
+}
+
+int Numa::GetPciDeviceNode(const std::string& bus_id) {
+  std::string id = bus_id;
+  std::transform(id.begin(), id.end(), id.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  const std::string line =
+      ReadLine("/sys/bus/pci/devices/" + id + "/numa_node");
+  if (line.empty()) return -1;
+  try {
+    return std::stoi(line);
+  } catch (const std::exception&) {
+    return -1;
+  }
+}
+
+void Numa::InterleaveMemory(void* data, size_t size) {
+#ifdef __linux__
+  if (binding.load() == Binding::kNone || GetNodes().size() < 2) return;
+  const uintptr_t page = sysconf(_SC_PAGESIZE);
+  const uintptr_t begin = reinterpret_cast<uintptr_t>(data) & ~(page - 1);
+  const uintptr_t end = reinterpret_cast<uintptr_t>(data) + size;
+  unsigned long mask[16] = {};
+  GetAllNodesMask(mask);
+  syscall(SYS_mbind, begin, end - begin, kMpolInterleave, mask, kMaxNodes, 0);
+#else
+  (void)data;
+  (void)size;
+#endif
+}
+
+Numa::InterleaveScope::InterleaveScope() {
+#ifdef __linux__
+  if (binding.load() == Binding::kNone || GetNodes().size() < 2) return;
+  if (syscall(SYS_get_mempolicy, &previous_mode_, previous_mask_, kMaxNodes,
+              nullptr, 0) != 0) {
+    return;
+  }
+  unsigned long mask[16] = {};
+  GetAllNodesMask(mask);
+  active_ = syscall(SYS_set_mempolicy, kMpolInterleave, mask, kMaxNodes) == 0;
+#endif
+}
+
+Numa::InterleaveScope::~InterleaveScope() {
+#ifdef __linux__
+  if (!active_) return;
+  if (previous_mode_ == kMpolDefault) {
+    syscall(SYS_set_mempolicy, kMpolDefault, nullptr, 0);
+  } else {
+    syscall(SYS_set_mempolicy, previous_mode_, previous_mask_, kMaxNodes);
+  }
+#endif
+}
+
+}  // namespace lczero
@@ -0,0 +1,77 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace lczero {
+
+// NUMA placement of threads and memory. The topology is read from sysfs and
+// memory policies are set with system calls, without libnuma. Elsewhere than
+// on Linux the host is treated as a single node and nothing is bound.
+class Numa {
+ public:
+  // Sets how threads are bound, to one of GetBindingChoices(): "none",
+  // "node" (to all cores of a node, spreading threads over the nodes) or
+  // "core" (to a single core, the same way). Affects threads which start
+  // or call BindThread() afterwards.
+  static void SetBinding(const std::string& binding);
+  static std::vector<std::string> GetBindingChoices();
+  // Returns the number of nodes with cores.
+  static int GetNodeCount();
+
+  // Binds the calling thread as set by SetBinding(), to the next node in
+  // turn, or to @node if it's not negative. Its memory is then allocated on
+  // that node if possible.
+  static void BindThread(int node = -1);
+
+  // Returns the node of the PCI device @bus_id (e.g. "0000:3b:00.0"), or -1
+  // if unknown.
+  static int GetPciDeviceNode(const std::string& bus_id);
+
+  // Spreads the pages of @size bytes at @data over all nodes, when threads
+  // are bound. For memory used by threads of all nodes alike.
+  static void InterleaveMemory(void* data, size_t size);
+
+  // While in scope, memory which the calling thread touches first is spread
+  // over all nodes, when threads are bound.
+  class InterleaveScope {
+   public:
+    InterleaveScope();
+    ~InterleaveScope();
+
+   private:
+    bool active_ = false;
+    int previous_mode_ = 0;
+    unsigned long previous_mask_[16] = {};
+  };
+};
+
+}  // namespace lczero
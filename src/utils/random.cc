@@ -26,19 +26,54 @@
 */
 
 #include "random.h"
+
+#include <atomic>
 #include <random>
 
 namespace lczero {
 
-Random::Random() : gen_(std::random_device()()) {}
+namespace {
+uint64_t SplitMix64(uint64_t* state) {
+  uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  return z ^ (z >> 31);
+}
+
+// Stream of the next thread's generator, its seed is mixed from it.
+std::atomic<uint64_t> next_thread_stream{
+    (static_cast<uint64_t>(std::random_device()()) << 32) ^
+    std::random_device()()};
+
+thread_local Random* current_random = nullptr;
+}  // namespace
+
+void Xoshiro256::Seed(uint64_t seed) {
+  for (auto& s : s_) s = SplitMix64(&seed);
+}
+
+Random::Scope::Scope(Random& random) : previous_(current_random) {
+  current_random = &random;
+}
+
+Random::Scope::~Scope() { current_random = previous_; }
 
 Random& Random::Get() {
-  static Random rand;
+  if (current_random) return *current_random;
+  thread_local Random rand([]() {
+    uint64_t stream = next_thread_stream.fetch_add(1);
+    return SplitMix64(&stream);
+  }());
   return rand;
 }
 
+uint64_t Random::MakeSeed(uint64_t seed, uint64_t stream) {
+  if (seed == 0) return Get().GetUint64();
+  uint64_t state = seed ^ SplitMix64(&stream);
+  return SplitMix64(&state);
+}
+
 int Random::GetInt(int min, int max) {
-  Mutex::Lock lock(mutex_);
   std::uniform_int_distribution<> dist(min, max);
   return dist(gen_);
 }
@@ -46,13 +81,11 @@ int Random::GetInt(int min, int max) {
 bool Random::GetBool() { return GetInt(0, 1) != 0; }
 
 double Random::GetDouble(double maxval) {
-  Mutex::Lock lock(mutex_);
   std::uniform_real_distribution<> dist(0.0, maxval);
   return dist(gen_);
 }
 
 float Random::GetFloat(float maxval) {
-  Mutex::Lock lock(mutex_);
   std::uniform_real_distribution<> dist(0.0, maxval);
   return dist(gen_);
 }
@@ -66,7 +99,6 @@ std::string Random::GetString(int length) {
 }
 
 double Random::GetGamma(double alpha, double beta) {
-  Mutex::Lock lock(mutex_);
   std::gamma_distribution<double> dist(alpha, beta);
   return dist(gen_);
 }
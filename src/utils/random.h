@@ -27,15 +27,67 @@
 
 #pragma once
 
-#include <random>
+#include <cstdint>
+#include <limits>
 #include <string>
-#include "utils/mutex.h"
 
 namespace lczero {
 
+// xoshiro256** generator by David Blackman and Sebastiano Vigna, for use with
+// the distributions of <random>.
+class Xoshiro256 {
+ public:
+  using result_type = uint64_t;
+
+  explicit Xoshiro256(uint64_t seed) { Seed(seed); }
+  // Sets the state from @seed expanded with splitmix64.
+  void Seed(uint64_t seed);
+
+  static constexpr result_type min() { return 0; }
+  static constexpr result_type max() {
+    return std::numeric_limits<result_type>::max();
+  }
+  result_type operator()() {
+    const uint64_t result = Rotl(s_[1] * 5, 7) * 9;
+    const uint64_t t = s_[1] << 17;
+    s_[2] ^= s_[0];
+    s_[3] ^= s_[1];
+    s_[1] ^= s_[2];
+    s_[0] ^= s_[3];
+    s_[2] ^= t;
+    s_[3] = Rotl(s_[3], 45);
+    return result;
+  }
+
+ private:
+  static uint64_t Rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+  uint64_t s_[4];
+};
+
+// Random number generator. Get() returns the generator of the calling thread,
+// so no locking is needed. Threads are seeded independently from one random
+// seed of the process.
 class Random {
  public:
+  // Generator seeded with @seed, e.g. to play a game reproducibly.
+  explicit Random(uint64_t seed) : gen_(seed) {}
+
+  // Makes Get() return @random on the calling thread while in scope.
+  class Scope {
+   public:
+    Scope(Random& random);
+    ~Scope();
+
+   private:
+    Random* const previous_;
+  };
+
   static Random& Get();
+  // Returns a new seed, mixed from @seed and @stream if @seed is not zero,
+  // and random otherwise.
+  static uint64_t MakeSeed(uint64_t seed, uint64_t stream);
+
   double GetDouble(double max_val);
   float GetFloat(float max_val);
   double GetGamma(double alpha, double beta);
@@ -43,12 +95,10 @@ class Random {
   int GetInt(int min, int max);
   std::string GetString(int length);
   bool GetBool();
+  uint64_t GetUint64() { return gen_(); }
 
  private:
-  Random();
-
-  Mutex mutex_;
-  std::mt19937 gen_ GUARDED_BY(mutex_);
+  Xoshiro256 gen_;
 };
 
 }  // namespace lczero
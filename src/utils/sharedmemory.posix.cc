@@ -0,0 +1,73 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+#include "utils/exception.h"
+#include "utils/sharedmemory.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace lczero {
+
+SharedMemory::SharedMemory(const std::string& name, uint64_t size)
+    : size_(size) {
+  const std::string shm_name = "/lc0-" + name;
+  const int fd = shm_open(shm_name.c_str(), O_RDWR | O_CREAT, 0666);
+  if (fd < 0) throw Exception("Cannot open shared memory: " + shm_name);
+  struct stat s;
+  if (fstat(fd, &s) < 0) {
+    close(fd);
+    throw Exception("Cannot stat shared memory: " + shm_name);
+  }
+  // Newly created region has zero size. If several processes race to create
+  // it, they all set the same size.
+  if (s.st_size == 0) {
+    if (ftruncate(fd, size) < 0) {
+      close(fd);
+      throw Exception("Cannot resize shared memory: " + shm_name);
+    }
+  } else if (static_cast<uint64_t>(s.st_size) != size) {
+    close(fd);
+    throw Exception("Shared memory " + shm_name + " exists with size " +
+                    std::to_string(s.st_size) + " bytes, requested " +
+                    std::to_string(size));
+  }
+  void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  // The mapping stays valid after the descriptor is closed.
+  close(fd);
+  if (data == MAP_FAILED) {
+    throw Exception("Cannot map shared memory: " + shm_name);
+  }
+  data_ = static_cast<char*>(data);
+}
+
+SharedMemory::~SharedMemory() {
+  if (data_) munmap(data_, size_);
+}
+
+}  // namespace lczero
@@ -0,0 +1,58 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+#include "utils/exception.h"
+#include "utils/sharedmemory.h"
+
+#include <windows.h>
+
+namespace lczero {
+
+SharedMemory::SharedMemory(const std::string& name, uint64_t size)
+    : size_(size) {
+  const std::string shm_name = "Local\\lc0-" + name;
+  // Memory of a new mapping is zero filled.
+  HANDLE mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr,
+                                      PAGE_READWRITE,
+                                      static_cast<DWORD>(size >> 32),
+                                      static_cast<DWORD>(size),
+                                      shm_name.c_str());
+  if (!mapping) throw Exception("Cannot open shared memory: " + shm_name);
+  handle_ = mapping;
+  data_ = static_cast<char*>(
+      MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size));
+  if (!data_) {
+    CloseHandle(mapping);
+    throw Exception("Cannot map shared memory: " + shm_name);
+  }
+}
+
+SharedMemory::~SharedMemory() {
+  if (data_) UnmapViewOfFile(data_);
+  if (handle_) CloseHandle(handle_);
+}
+
+}  // namespace lczero
@@ -0,0 +1,155 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "utils/slaballocator.h"
+
+#include <algorithm>
+#include <atomic>
+#include "utils/exception.h"
+
+namespace lczero {
+
+namespace {
+// Approximate size of one slab requested from the system.
+const size_t kSlabBytes = 64 * 1024;
+// Smallest number of blocks in a slab (and in a batch).
+const int kMinBatchSize = 16;
+
+std::atomic<int> gNextAllocatorId{0};
+
+// Every block has to be able to hold a pointer to a next free block, and be
+// aligned as a pointer.
+size_t RoundUpBlockSize(size_t size) {
+  const size_t kAlign = alignof(void*);
+  return (std::max(size, sizeof(void*)) + kAlign - 1) / kAlign * kAlign;
+}
+}  // namespace
+
+struct SlabAllocator::ThreadFreeLists {
+  ~ThreadFreeLists() {
+    // Thread exits, give all its free blocks back to the shared pools.
+    for (int i = 0; i < kMaxAllocators; ++i) {
+      if (owners[i]) owners[i]->GiveAll(&lists[i]);
+    }
+  }
+
+  SlabAllocator* owners[kMaxAllocators] = {};
+  FreeList lists[kMaxAllocators];
+};
+
+SlabAllocator::SlabAllocator(size_t block_size)
+    : block_size_(RoundUpBlockSize(block_size)),
+      batch_size_(std::max(kMinBatchSize,
+                           static_cast<int>(kSlabBytes / block_size_))),
+      id_(gNextAllocatorId++) {
+  if (id_ >= kMaxAllocators) throw Exception("Too many slab allocators.");
+}
+
+SlabAllocator::FreeList* SlabAllocator::GetThreadFreeList() {
+  static thread_local ThreadFreeLists thread_lists;
+  thread_lists.owners[id_] = this;
+  return &thread_lists.lists[id_];
+}
+
+void* SlabAllocator::Allocate() {
+  FreeList* list = GetThreadFreeList();
+  if (!list->head) TakeBatch(list);
+  FreeBlock* block = list->head;
+  list->head = block->next;
+  --list->size;
+  return block;
+}
+
+void SlabAllocator::Free(void* ptr) {
+  if (!ptr) return;
+  FreeList* list = GetThreadFreeList();
+  FreeBlock* block = static_cast<FreeBlock*>(ptr);
+  block->next = list->head;
+  list->head = block;
+  // Keep at most two batches per thread, so that the thread could both
+  // allocate and free a little without touching the shared pool.
+  if (++list->size >= 2 * batch_size_) GiveBatch(list);
+}
+
+size_t SlabAllocator::GetReservedBytes() {
+  Mutex::Lock lock(mutex_);
+  return slabs_.size() * batch_size_ * block_size_;
+}
+
+size_t SlabAllocator::GetUsedBytes() {
+  Mutex::Lock lock(mutex_);
+  return (slabs_.size() * batch_size_ - pooled_blocks_) * block_size_;
+}
+
+void SlabAllocator::TakeBatch(FreeList* list) {
+  {
+    Mutex::Lock lock(mutex_);
+    if (!batches_.empty()) {
+      *list = batches_.back();
+      batches_.pop_back();
+      pooled_blocks_ -= list->size;
+      return;
+    }
+    slabs_.emplace_back(std::make_unique<char[]>(block_size_ * batch_size_));
+    char* slab = slabs_.back().get();
+    // Link all blocks of a new slab into a list, in order of addresses.
+    for (int i = batch_size_ - 1; i >= 0; --i) {
+      FreeBlock* block = reinterpret_cast<FreeBlock*>(slab + i * block_size_);
+      block->next = list->head;
+      list->head = block;
+    }
+  }
+  list->size = batch_size_;
+}
+
+void SlabAllocator::GiveBatch(FreeList* list) {
+  FreeList batch;
+  batch.head = list->head;
+  batch.size = batch_size_;
+  // Cut first batch_size_ blocks off the list.
+  FreeBlock* last = list->head;
+  for (int i = 1; i < batch_size_; ++i) last = last->next;
+  list->head = last->next;
+  list->size -= batch_size_;
+  last->next = nullptr;
+
+  Mutex::Lock lock(mutex_);
+  batches_.push_back(batch);
+  pooled_blocks_ += batch.size;
+}
+
+void SlabAllocator::GiveAll(FreeList* list) {
+  if (!list->head) return;
+  {
+    Mutex::Lock lock(mutex_);
+    batches_.push_back(*list);
+    pooled_blocks_ += list->size;
+  }
+  *list = FreeList();
+}
+
+}  // namespace lczero
@@ -0,0 +1,99 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+#include "utils/mutex.h"
+
+namespace lczero {
+
+// Allocator of memory blocks of one fixed size.
+// Memory is requested from the system in slabs of many blocks and is never
+// given back while the allocator is alive; freed blocks are reused instead.
+// Every thread keeps its own list of free blocks, and exchanges them with a
+// shared pool in whole batches, so allocation and deallocation only rarely
+// have to take a lock, and blocks freed in bulk (e.g. by garbage collector
+// thread) are returned to the pool in bulk too.
+//
+// Intended to be used as a long living (global) object which outlives all
+// threads using it. There can be no more than kMaxAllocators of them in a
+// program.
+class SlabAllocator {
+ public:
+  static constexpr int kMaxAllocators = 64;
+
+  explicit SlabAllocator(size_t block_size);
+
+  // Returns block of at least block_size bytes.
+  void* Allocate();
+  // Returns block back to allocator.
+  void Free(void* ptr);
+
+  size_t GetBlockSize() const { return block_size_; }
+  // Returns total size of slabs requested from the system, in bytes.
+  size_t GetReservedBytes();
+  // Returns size of blocks which are not in the shared pool, in bytes. That's
+  // blocks in use plus a few batches cached by threads.
+  size_t GetUsedBytes();
+
+ private:
+  struct FreeBlock {
+    FreeBlock* next;
+  };
+  // Singly linked list of free blocks.
+  struct FreeList {
+    FreeBlock* head = nullptr;
+    int size = 0;
+  };
+  // Free lists of the current thread, for all allocators.
+  struct ThreadFreeLists;
+
+  FreeList* GetThreadFreeList();
+  // Refills an empty @list either with a batch from the shared pool or with a
+  // freshly allocated slab.
+  void TakeBatch(FreeList* list);
+  // Moves batch_size_ blocks from @list to the shared pool.
+  void GiveBatch(FreeList* list);
+  // Moves everything from @list to the shared pool.
+  void GiveAll(FreeList* list);
+
+  const size_t block_size_;
+  const int batch_size_;
+  const int id_;
+
+  Mutex mutex_{"slab allocator"};
+  // Shared pool of free blocks, in batches.
+  std::vector<FreeList> batches_ GUARDED_BY(mutex_);
+  // Total number of blocks in batches_.
+  size_t pooled_blocks_ GUARDED_BY(mutex_) = 0;
+  std::vector<std::unique_ptr<char[]>> slabs_ GUARDED_BY(mutex_);
+};
+
+}  // namespace lczero
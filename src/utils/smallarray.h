@@ -41,6 +41,8 @@ class SmallArray {
   T& operator[](int idx) { return data_[idx]; }
   const T& operator[](int idx) const { return data_[idx]; }
   int size() const { return size_; }
+  T* data() { return data_.get(); }
+  const T* data() const { return data_.get(); }
 
  private:
   unsigned char size_;
@@ -0,0 +1,83 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace lczero {
+
+// Connected TCP socket. Methods throw exception on failure.
+class Socket {
+ public:
+  // Connects to @host:@port.
+  Socket(const std::string& host, int port);
+  ~Socket();
+
+  Socket(const Socket&) = delete;
+  void operator=(const Socket&) = delete;
+
+  // Sends @size bytes of @data.
+  void Send(const void* data, size_t size);
+  // Receives exactly @size bytes into @data. Returns false if the peer closed
+  // the connection before sending any of them.
+  bool Receive(void* data, size_t size);
+  // Receives at most @size bytes, whatever is available, into @data. Returns
+  // the number of bytes received, 0 if the peer closed the connection.
+  size_t ReceiveSome(void* data, size_t size);
+  // Shuts the connection down, so that a Receive() blocked in another thread
+  // returns.
+  void Shutdown();
+
+ private:
+  friend class ServerSocket;
+  explicit Socket(intptr_t handle);
+
+  // Platform specific handle.
+  intptr_t handle_;
+};
+
+// TCP socket listening on all interfaces.
+class ServerSocket {
+ public:
+  explicit ServerSocket(int port);
+  ~ServerSocket();
+
+  ServerSocket(const ServerSocket&) = delete;
+  void operator=(const ServerSocket&) = delete;
+
+  // Waits for the next connection.
+  std::unique_ptr<Socket> Accept();
+
+ private:
+  intptr_t handle_;
+};
+
+}  // namespace lczero
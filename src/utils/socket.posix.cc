@@ -0,0 +1,163 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "utils/socket.h"
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+#include "utils/exception.h"
+
+namespace lczero {
+
+namespace {
+std::string LastError() { return std::strerror(errno); }
+
+void SetNoDelay(int fd) {
+  // Requests and responses are written whole, don't hold them back.
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+}  // namespace
+
+Socket::Socket(intptr_t handle) : handle_(handle) {
+  SetNoDelay(static_cast<int>(handle_));
+}
+
+Socket::Socket(const std::string& host, int port) : handle_(-1) {
+  addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo* addresses;
+  const int error = getaddrinfo(host.c_str(), std::to_string(port).c_str(),
+                                &hints, &addresses);
+  if (error != 0) {
+    throw Exception("Cannot resolve " + host + ": " + gai_strerror(error));
+  }
+  for (addrinfo* addr = addresses; addr; addr = addr->ai_next) {
+    const int fd =
+        socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+    if (fd < 0) continue;
+    if (connect(fd, addr->ai_addr, addr->ai_addrlen) == 0) {
+      handle_ = fd;
+      break;
+    }
+    close(fd);
+  }
+  freeaddrinfo(addresses);
+  if (handle_ < 0) {
+    throw Exception("Cannot connect to " + host + ":" + std::to_string(port) +
+                    ": " + LastError());
+  }
+  SetNoDelay(static_cast<int>(handle_));
+}
+
+Socket::~Socket() { close(static_cast<int>(handle_)); }
+
+void Socket::Send(const void* data, size_t size) {
+  const char* ptr = static_cast<const char*>(data);
+  while (size > 0) {
+    const ssize_t sent =
+        send(static_cast<int>(handle_), ptr, size, MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR) continue;
+      throw Exception("Cannot send: " + LastError());
+    }
+    ptr += sent;
+    size -= sent;
+  }
+}
+
+bool Socket::Receive(void* data, size_t size) {
+  char* ptr = static_cast<char*>(data);
+  const size_t total = size;
+  while (size > 0) {
+    const ssize_t received = recv(static_cast<int>(handle_), ptr, size, 0);
+    if (received < 0) {
+      if (errno == EINTR) continue;
+      throw Exception("Cannot receive: " + LastError());
+    }
+    if (received == 0) {
+      if (size == total) return false;
+      throw Exception("Connection closed in the middle of a message.");
+    }
+    ptr += received;
+    size -= received;
+  }
+  return true;
+}
+
+size_t Socket::ReceiveSome(void* data, size_t size) {
+  while (true) {
+    const ssize_t received = recv(static_cast<int>(handle_), data, size, 0);
+    if (received >= 0) return received;
+    if (errno != EINTR) throw Exception("Cannot receive: " + LastError());
+  }
+}
+
+void Socket::Shutdown() { shutdown(static_cast<int>(handle_), SHUT_RDWR); }
+
+ServerSocket::ServerSocket(int port) {
+  const int fd = socket(AF_INET6, SOCK_STREAM, 0);
+  if (fd < 0) throw Exception("Cannot create socket: " + LastError());
+  handle_ = fd;
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  // Accept IPv4 connections too.
+  int zero = 0;
+  setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+  sockaddr_in6 addr = {};
+  addr.sin6_family = AF_INET6;
+  addr.sin6_addr = in6addr_any;
+  addr.sin6_port = htons(port);
+  if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 ||
+      listen(fd, SOMAXCONN) < 0) {
+    const std::string error = LastError();
+    close(fd);
+    throw Exception("Cannot listen on port " + std::to_string(port) + ": " +
+                    error);
+  }
+}
+
+ServerSocket::~ServerSocket() { close(static_cast<int>(handle_)); }
+
+std::unique_ptr<Socket> ServerSocket::Accept() {
+  while (true) {
+    const int fd = accept(static_cast<int>(handle_), nullptr, nullptr);
+    if (fd >= 0) return std::unique_ptr<Socket>(new Socket(fd));
+    if (errno != EINTR && errno != ECONNABORTED) {
+      throw Exception("Cannot accept connection: " + LastError());
+    }
+  }
+}
+
+}  // namespace lczero
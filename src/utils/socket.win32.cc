@@ -0,0 +1,175 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "utils/socket.h"
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <algorithm>
+
+#include "utils/exception.h"
+
+namespace lczero {
+
+namespace {
+std::string LastError() { return std::to_string(WSAGetLastError()); }
+
+// Initializes Winsock once per process.
+void EnsureWinsock() {
+  static const bool initialized = []() {
+    WSADATA data;
+    if (WSAStartup(MAKEWORD(2, 2), &data) != 0) {
+      throw Exception("Cannot initialize Winsock.");
+    }
+    return true;
+  }();
+  (void)initialized;
+}
+
+void SetNoDelay(SOCKET s) {
+  // Requests and responses are written whole, don't hold them back.
+  BOOL one = TRUE;
+  setsockopt(s, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&one),
+             sizeof(one));
+}
+}  // namespace
+
+Socket::Socket(intptr_t handle) : handle_(handle) {
+  SetNoDelay(static_cast<SOCKET>(handle_));
+}
+
+Socket::Socket(const std::string& host, int port)
+    : handle_(static_cast<intptr_t>(INVALID_SOCKET)) {
+  EnsureWinsock();
+  addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo* addresses;
+  if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints,
+                  &addresses) != 0) {
+    throw Exception("Cannot resolve " + host + ": " + LastError());
+  }
+  for (addrinfo* addr = addresses; addr; addr = addr->ai_next) {
+    const SOCKET s =
+        socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+    if (s == INVALID_SOCKET) continue;
+    if (connect(s, addr->ai_addr, static_cast<int>(addr->ai_addrlen)) == 0) {
+      handle_ = static_cast<intptr_t>(s);
+      break;
+    }
+    closesocket(s);
+  }
+  freeaddrinfo(addresses);
+  if (static_cast<SOCKET>(handle_) == INVALID_SOCKET) {
+    throw Exception("Cannot connect to " + host + ":" + std::to_string(port) +
+                    ": " + LastError());
+  }
+  SetNoDelay(static_cast<SOCKET>(handle_));
+}
+
+Socket::~Socket() { closesocket(static_cast<SOCKET>(handle_)); }
+
+void Socket::Send(const void* data, size_t size) {
+  const char* ptr = static_cast<const char*>(data);
+  while (size > 0) {
+    const int sent =
+        send(static_cast<SOCKET>(handle_), ptr,
+             static_cast<int>(std::min<size_t>(size, 1 << 30)), 0);
+    if (sent == SOCKET_ERROR) throw Exception("Cannot send: " + LastError());
+    ptr += sent;
+    size -= sent;
+  }
+}
+
+bool Socket::Receive(void* data, size_t size) {
+  char* ptr = static_cast<char*>(data);
+  const size_t total = size;
+  while (size > 0) {
+    const int received =
+        recv(static_cast<SOCKET>(handle_), ptr,
+             static_cast<int>(std::min<size_t>(size, 1 << 30)), 0);
+    if (received == SOCKET_ERROR) {
+      throw Exception("Cannot receive: " + LastError());
+    }
+    if (received == 0) {
+      if (size == total) return false;
+      throw Exception("Connection closed in the middle of a message.");
+    }
+    ptr += received;
+    size -= received;
+  }
+  return true;
+}
+
+size_t Socket::ReceiveSome(void* data, size_t size) {
+  const int received =
+      recv(static_cast<SOCKET>(handle_), static_cast<char*>(data),
+           static_cast<int>(std::min<size_t>(size, 1 << 30)), 0);
+  if (received == SOCKET_ERROR) {
+    throw Exception("Cannot receive: " + LastError());
+  }
+  return received;
+}
+
+void Socket::Shutdown() { shutdown(static_cast<SOCKET>(handle_), SD_BOTH); }
+
+ServerSocket::ServerSocket(int port) {
+  EnsureWinsock();
+  const SOCKET s = socket(AF_INET6, SOCK_STREAM, 0);
+  if (s == INVALID_SOCKET) {
+    throw Exception("Cannot create socket: " + LastError());
+  }
+  handle_ = static_cast<intptr_t>(s);
+  // Accept IPv4 connections too.
+  DWORD zero = 0;
+  setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, reinterpret_cast<const char*>(&zero),
+             sizeof(zero));
+  sockaddr_in6 addr = {};
+  addr.sin6_family = AF_INET6;
+  addr.sin6_addr = in6addr_any;
+  addr.sin6_port = htons(static_cast<u_short>(port));
+  if (bind(s, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) ==
+          SOCKET_ERROR ||
+      listen(s, SOMAXCONN) == SOCKET_ERROR) {
+    const std::string error = LastError();
+    closesocket(s);
+    throw Exception("Cannot listen on port " + std::to_string(port) + ": " +
+                    error);
+  }
+}
+
+ServerSocket::~ServerSocket() { closesocket(static_cast<SOCKET>(handle_)); }
+
+std::unique_ptr<Socket> ServerSocket::Accept() {
+  const SOCKET s = accept(static_cast<SOCKET>(handle_), nullptr, nullptr);
+  if (s == INVALID_SOCKET) {
+    throw Exception("Cannot accept connection: " + LastError());
+  }
+  return std::unique_ptr<Socket>(new Socket(static_cast<intptr_t>(s)));
+}
+
+}  // namespace lczero
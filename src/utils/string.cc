@@ -58,7 +58,7 @@ std::vector<std::string> StrSplit(const std::string& str,
   for (std::string::size_type pos = 0, next = 0; pos != std::string::npos;
        pos = next) {
     next = str.find(delim, pos);
-    result.push_back(str.substr(pos, next));
+    result.push_back(str.substr(pos, next - pos));
     if (next != std::string::npos) next += delim.size();
   }
   return result;
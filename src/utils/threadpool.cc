@@ -0,0 +1,93 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#include "utils/threadpool.h"
+
+#include "utils/numa.h"
+
+namespace lczero {
+
+ThreadPool::~ThreadPool() {
+  std::vector<std::thread> threads;
+  {
+    Mutex::Lock lock(mutex_);
+    stop_ = true;
+    threads.swap(threads_);
+  }
+  cv_.notify_all();
+  for (auto& thread : threads) thread.join();
+}
+
+ThreadPool* ThreadPool::Get() {
+  static ThreadPool pool;
+  return &pool;
+}
+
+std::future<void> ThreadPool::Run(std::function<void()> task) {
+  std::packaged_task<void()> packaged_task(std::move(task));
+  auto result = packaged_task.get_future();
+  {
+    Mutex::Lock lock(mutex_);
+    tasks_.push_back(std::move(packaged_task));
+    // Not enough idle threads to pick up all tasks, start one more.
+    if (static_cast<int>(tasks_.size()) > idle_threads_) {
+      threads_.emplace_back([this]() {
+        Numa::BindThread();
+        Worker();
+      });
+      return result;
+    }
+  }
+  cv_.notify_one();
+  return result;
+}
+
+int ThreadPool::GetThreadCount() {
+  Mutex::Lock lock(mutex_);
+  return threads_.size();
+}
+
+// Uses condition variable with the lock, which thread safety analysis doesn't
+// understand.
+void ThreadPool::Worker() NO_THREAD_SAFETY_ANALYSIS {
+  while (true) {
+    std::packaged_task<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(mutex_.get_raw());
+      ++idle_threads_;
+      cv_.wait(lock, [this]() { return stop_ || !tasks_.empty(); });
+      --idle_threads_;
+      // Only exit when everything is done.
+      if (tasks_.empty()) return;
+      task = std::move(tasks_.front());
+      tasks_.pop_front();
+    }
+    task();
+  }
+}
+
+}  // namespace lczero
@@ -0,0 +1,73 @@
+/*
+  This file is part of Leela Chess Zero.
+  Copyright (C) 2018 The LCZero Authors
+
+  Leela Chess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Leela Chess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+  Additional permission under GNU GPL version 3 section 7
+
+  If you modify this Program, or any covered work, by linking or
+  combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+  Toolkit and the the NVIDIA CUDA Deep Neural Network library (or a
+  modified version of those libraries), containing parts covered by the
+  terms of the respective license agreement, the licensors of this
+  Program grant you additional permission to convey the resulting work.
+*/
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <thread>
+#include <vector>
+#include "utils/mutex.h"
+
+namespace lczero {
+
+// Pool of threads which run submitted tasks.
+// Every task gets its own thread right away: if there are no idle threads, a
+// new one is started. When a task is done, its thread waits for the next
+// task instead of exiting, so that threads (and their thread-local state) are
+// reused. That makes the pool suitable for long running tasks, like search
+// workers.
+class ThreadPool {
+ public:
+  ThreadPool() = default;
+  // Waits for all submitted tasks to finish, and stops the threads.
+  ~ThreadPool();
+
+  // Returns process-wide thread pool.
+  static ThreadPool* Get();
+
+  // Runs @task in a pool thread. The returned future becomes ready when the
+  // task is done (and rethrows the exception if the task has thrown).
+  std::future<void> Run(std::function<void()> task);
+
+  // Returns total number of threads in the pool.
+  int GetThreadCount();
+
+ private:
+  void Worker();
+
+  Mutex mutex_{"thread pool"};
+  std::condition_variable cv_;
+  std::deque<std::packaged_task<void()>> tasks_ GUARDED_BY(mutex_);
+  int idle_threads_ GUARDED_BY(mutex_) = 0;
+  bool stop_ GUARDED_BY(mutex_) = false;
+  std::vector<std::thread> threads_ GUARDED_BY(mutex_);
+};
+
+}  // namespace lczero
@@ -0,0 +1,143 @@
+/*
+ This file is part of Leela Chess Zero.
+ Copyright (C) 2018 The LCZero Authors
+
+ Leela Chess is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ Leela Chess is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+ Additional permission under GNU GPL version 3 section 7
+
+ If you modify this Program, or any covered work, by linking or
+ combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+ Toolkit and the the NVIDIA CUDA Deep Neural Network library (or a
+ modified version of those libraries), containing parts covered by the
+ terms of the respective license agreement, the licensors of this
+ Program grant you additional permission to convey the resulting work.
+ */
+
+#include "utils/trace.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+
+namespace lczero {
+
+std::atomic<bool> Tracer::enabled_{false};
+
+Tracer& Tracer::Get() {
+  static Tracer tracer;
+  return tracer;
+}
+
+Tracer::~Tracer() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (IsEnabled()) Flush();
+}
+
+void Tracer::SetFile(const std::string& filename) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (filename == filename_) return;
+  if (IsEnabled()) Flush();
+  filename_ = filename;
+  start_ns_ = Now();
+  enabled_ = !filename_.empty();
+}
+
+Tracer::ThreadBuffer* Tracer::GetThreadBuffer() {
+  // Threads come and go (searches start theirs for every move), so a buffer
+  // is handed to another thread when its thread exits. The timeline of a
+  // buffer is then that of consecutive threads.
+  struct Holder {
+    ~Holder() {
+      if (!buffer) return;
+      std::lock_guard<std::mutex> lock(buffer->mutex);
+      buffer->in_use = false;
+    }
+    std::shared_ptr<ThreadBuffer> buffer;
+  };
+  static thread_local Holder holder;
+  if (holder.buffer) return holder.buffer.get();
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto& buffer : buffers_) {
+    std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+    if (!buffer->in_use) {
+      buffer->in_use = true;
+      buffer->name = nullptr;
+      holder.buffer = buffer;
+      return holder.buffer.get();
+    }
+  }
+  buffers_.push_back(std::make_shared<ThreadBuffer>());
+  holder.buffer = buffers_.back();
+  holder.buffer->tid = buffers_.size();
+  return holder.buffer.get();
+}
+
+void Tracer::AddEvent(const char* name, const char* category,
+                      std::int64_t start_ns) {
+  const std::int64_t end_ns = Now();
+  ThreadBuffer* buffer = GetThreadBuffer();
+  std::lock_guard<std::mutex> lock(buffer->mutex);
+  // Threads which are only named don't take memory for events.
+  if (buffer->events.empty()) buffer->events.resize(kEventsPerThread);
+  buffer->events[buffer->count++ % kEventsPerThread] = {
+      name, category, start_ns, end_ns - start_ns};
+}
+
+void Tracer::SetThreadName(const char* name) {
+  ThreadBuffer* buffer = GetThreadBuffer();
+  std::lock_guard<std::mutex> lock(buffer->mutex);
+  buffer->name = name;
+}
+
+void Tracer::Flush() {
+  std::ofstream file(filename_);
+  if (!file) {
+    std::cerr << "Cannot write trace to " << filename_ << std::endl;
+    return;
+  }
+  // Timestamps are in microseconds since the start of recording.
+  file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[" << std::fixed
+       << std::setprecision(3);
+  bool first = true;
+  for (const auto& buffer : buffers_) {
+    std::lock_guard<std::mutex> lock(buffer->mutex);
+    if (buffer->name) {
+      file << (first ? "" : ",")
+           << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":"
+           << buffer->tid << ",\"args\":{\"name\":\"" << buffer->name
+           << "\"}}";
+      first = false;
+    }
+    const std::int64_t begin =
+        std::max<std::int64_t>(0, buffer->count - kEventsPerThread);
+    for (std::int64_t i = begin; i < buffer->count; ++i) {
+      const Event& event = buffer->events[i % kEventsPerThread];
+      if (event.start_ns < start_ns_) continue;
+      file << (first ? "" : ",") << "\n{\"name\":\"" << event.name
+           << "\",\"cat\":\"" << event.category
+           << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->tid
+           << ",\"ts\":" << (event.start_ns - start_ns_) / 1000.0
+           << ",\"dur\":" << event.duration_ns / 1000.0 << "}";
+      first = false;
+    }
+    buffer->count = 0;
+  }
+  file << "\n]}\n";
+  std::cerr << "Trace written to " << filename_ << std::endl;
+}
+
+}  // namespace lczero
@@ -0,0 +1,125 @@
+/*
+ This file is part of Leela Chess Zero.
+ Copyright (C) 2018 The LCZero Authors
+
+ Leela Chess is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ Leela Chess is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with Leela Chess.  If not, see <http://www.gnu.org/licenses/>.
+
+ Additional permission under GNU GPL version 3 section 7
+
+ If you modify this Program, or any covered work, by linking or
+ combining it with NVIDIA Corporation's libraries from the NVIDIA CUDA
+ Toolkit and the the NVIDIA CUDA Deep Neural Network library (or a
+ modified version of those libraries), containing parts covered by the
+ terms of the respective license agreement, the licensors of this
+ Program grant you additional permission to convey the resulting work.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace lczero {
+
+// Records timeline events of threads (search stages, NN batches, GC) and
+// writes them in Chrome trace event JSON format, which about:tracing and
+// Perfetto show as a timeline per thread. Each thread records into its own
+// ring buffer of the latest kEventsPerThread events, so recording takes no
+// shared lock. When no trace file is set, recording is a single relaxed load.
+class Tracer {
+ public:
+  static constexpr int kEventsPerThread = 1 << 16;
+
+  static Tracer& Get();
+
+  // Starts recording for @filename, unless it's already the file recorded
+  // for. Events recorded for the previous file are written to it. Empty
+  // @filename stops recording. The last file is written at exit.
+  void SetFile(const std::string& filename);
+
+  static bool IsEnabled() { return enabled_.load(std::memory_order_relaxed); }
+  // Returns the current time in trace timestamps.
+  static std::int64_t Now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+  // Records event @name (of @category) of the calling thread, which started
+  // at @start_ns (see Now()) and ends now. Names and categories must be
+  // string literals, they are only written out later.
+  void AddEvent(const char* name, const char* category, std::int64_t start_ns);
+  // Names the calling thread in traces, also when tracing is off, as threads
+  // are often started before. @name must be a string literal.
+  void SetThreadName(const char* name);
+
+  ~Tracer();
+
+ private:
+  struct Event {
+    const char* name;
+    const char* category;
+    std::int64_t start_ns;
+    std::int64_t duration_ns;
+  };
+  struct ThreadBuffer {
+    std::mutex mutex;
+    int tid = 0;
+    bool in_use = true;
+    const char* name = nullptr;
+    std::vector<Event> events;
+    // Number of events ever added, events[count % kEventsPerThread] is next.
+    std::int64_t count = 0;
+  };
+
+  Tracer() = default;
+  ThreadBuffer* GetThreadBuffer();
+  // Writes events of all threads to filename_, and clears them.
+  void Flush();
+
+  static std::atomic<bool> enabled_;
+  std::mutex mutex_;
+  std::string filename_;
+  std::int64_t start_ns_ = 0;
+  // Buffers outlive their threads, to keep events of threads which have
+  // exited.
+  std::vector<std::shared_ptr<ThreadBuffer>> buffers_;
+};
+
+// Records an event of the calling thread from construction to destruction, if
+// tracing is on. @name and @category must be string literals.
+class TraceScope {
+ public:
+  explicit TraceScope(const char* name, const char* category = "lc0")
+      : name_(name),
+        category_(category),
+        start_ns_(Tracer::IsEnabled() ? Tracer::Now() : -1) {}
+  ~TraceScope() {
+    if (start_ns_ >= 0) Tracer::Get().AddEvent(name_, category_, start_ns_);
+  }
+
+  TraceScope(const TraceScope&) = delete;
+  void operator=(const TraceScope&) = delete;
+
+ private:
+  const char* const name_;
+  const char* const category_;
+  const std::int64_t start_ns_;
+};
+
+}  // namespace lczero